@@ -0,0 +1,235 @@
+#include "BedrockClient.h"
+
+const uint64_t BedrockClient::HOST_RETRY_US = STIME_US_PER_S;
+
+BedrockClient::BedrockClient(const list<string>& hosts, size_t connectionsPerHost, size_t pipelineDepth,
+                             uint64_t timeoutUS, bool readYourWrites)
+  : _hosts(hosts), _connectionsPerHost(max(connectionsPerHost, (size_t)1)),
+    _pipelineDepth(max(pipelineDepth, (size_t)1)), _timeoutUS(timeoutUS), _readYourWrites(readYourWrites),
+    _commitCount(0), _exit(false)
+{
+    SASSERT(!_hosts.empty());
+    for (const string& host : _hosts) {
+        SASSERT(SHostIsValid(host));
+    }
+    _thread = thread(&BedrockClient::_loop, this);
+}
+
+BedrockClient::~BedrockClient() {
+    _exit = true;
+    _incoming.push(nullptr);
+    _thread.join();
+
+    // Nothing else can answer these now.
+    for (auto& request : _incoming.popAll()) {
+        if (request) {
+            _answer(*request, SData("000 Client closed"));
+        }
+    }
+    for (auto& request : _waiting) {
+        _answer(*request, SData("000 Client closed"));
+    }
+    for (auto& connection : _connections) {
+        for (auto& request : connection.inFlight) {
+            _answer(*request, SData("000 Client closed"));
+        }
+        closeSocket(connection.socket);
+    }
+}
+
+void BedrockClient::send(const SData& request, Callback callback) {
+    auto queued = make_shared<Request>();
+    queued->request = request;
+    queued->callback = move(callback);
+    queued->deadline = STimeNow() + _timeoutUS;
+    _incoming.push(move(queued));
+}
+
+future<SData> BedrockClient::send(const SData& request) {
+    auto response = make_shared<promise<SData>>();
+    send(request, [response](SData& result) {
+        response->set_value(move(result));
+    });
+    return response->get_future();
+}
+
+SData BedrockClient::execute(const SData& request) {
+    return send(request).get();
+}
+
+void BedrockClient::_loop() {
+    SInitialize("client");
+    while (!_exit.load()) {
+        // Nothing here waits on anything but the poll, which wakes for responses and new requests, and often enough
+        // otherwise to time requests out and retry hosts.
+        fd_map fdm;
+        _incoming.prePoll(fdm);
+        prePoll(fdm);
+        S_poll(fdm, 100 * STIME_US_PER_MS);
+        const uint64_t now = STimeNow();
+        _incoming.postPoll(fdm);
+        for (auto& request : _incoming.popAll()) {
+            if (request) {
+                _waiting.push_back(move(request));
+            }
+        }
+        postPoll(fdm);
+
+        // Handle what each connection received before seeing whether it's closed, as the last responses can arrive
+        // along with the close.
+        for (auto it = _connections.begin(); it != _connections.end();) {
+            _receive(*it, now);
+            if (it->socket->state.load() == Socket::CLOSED || (it->closing && it->inFlight.empty())) {
+                _close(*it, now);
+                it = _connections.erase(it);
+            } else {
+                it++;
+            }
+        }
+        _expire(now);
+        _dispatch(now);
+    }
+}
+
+void BedrockClient::_dispatch(uint64_t now) {
+    while (!_waiting.empty()) {
+        Connection* connection = _getConnection(now);
+        if (!connection) {
+            return;
+        }
+        shared_ptr<Request> request = move(_waiting.front());
+        _waiting.pop_front();
+        if (_readYourWrites && !request->request.isSet("commitCount") && _commitCount.load()) {
+            request->request["commitCount"] = to_string(_commitCount.load());
+        }
+
+        // Tell the server how much longer we'll wait, so it doesn't run this after we've given up on it.
+        const uint64_t remainingUS = request->deadline > now ? request->deadline - now : 0;
+        request->request["clientTimeout"] = to_string(remainingUS / STIME_US_PER_MS);
+        connection->socket->send(request->request.serialize());
+        connection->inFlight.push_back(move(request));
+    }
+}
+
+BedrockClient::Connection* BedrockClient::_getConnection(uint64_t now) {
+    for (const string& host : _hosts) {
+        auto retryIt = _hostRetryAt.find(host);
+        if (retryIt != _hostRetryAt.end()) {
+            if (retryIt->second > now) {
+                continue;
+            }
+            _hostRetryAt.erase(retryIt);
+        }
+
+        // An idle connection is best, then a new one, then pipelining behind whatever's least busy.
+        Connection* leastBusy = nullptr;
+        size_t count = 0;
+        for (auto& connection : _connections) {
+            if (connection.host != host) {
+                continue;
+            }
+            count++;
+            if (!connection.closing && connection.inFlight.size() < _pipelineDepth &&
+                (!leastBusy || connection.inFlight.size() < leastBusy->inFlight.size())) {
+                leastBusy = &connection;
+            }
+        }
+        if (leastBusy && leastBusy->inFlight.empty()) {
+            return leastBusy;
+        }
+        if (count < _connectionsPerHost) {
+            Socket* socket = openSocket(host);
+            if (!socket) {
+                SHMMM("Couldn't open a connection to " << host << ", skipping it for now.");
+                _hostRetryAt[host] = now + HOST_RETRY_US;
+                continue;
+            }
+            _connections.emplace_back();
+            _connections.back().host = host;
+            _connections.back().socket = socket;
+            return &_connections.back();
+        }
+
+        // This host is up, just busy, so the request waits for it rather than going to a fallback.
+        return leastBusy;
+    }
+    return nullptr;
+}
+
+void BedrockClient::_receive(Connection& connection, uint64_t now) {
+    string& recvBuffer = connection.socket->recvBuffer;
+    while (true) {
+        SData response;
+        const int size = response.deserialize(recvBuffer);
+        if (!size) {
+            return;
+        }
+        SConsumeFront(recvBuffer, size);
+        if (connection.inFlight.empty()) {
+            SWARN("Got '" << response.methodLine << "' from " << connection.host << " with nothing sent, closing.");
+            connection.socket->state.store(Socket::CLOSED);
+            return;
+        }
+        shared_ptr<Request> request = move(connection.inFlight.front());
+        connection.inFlight.pop_front();
+
+        // Only this thread writes the commit count, so there's no race between the check and the store.
+        const uint64_t commitCount = SToUInt64(response["commitCount"]);
+        if (commitCount > _commitCount.load()) {
+            _commitCount.store(commitCount);
+        }
+
+        // A node that's shutting down still answers what it's read, but new requests should go elsewhere.
+        if (SIEquals(response["Connection"], "close") && !connection.closing) {
+            SINFO(connection.host << " is closing our connection, skipping it for now.");
+            connection.closing = true;
+            _hostRetryAt[connection.host] = now + HOST_RETRY_US;
+        }
+        _answer(*request, move(response));
+    }
+}
+
+void BedrockClient::_close(Connection& connection, uint64_t now) {
+    if (connection.socket->connectFailure) {
+        // The node never saw anything we sent, so it can all go to the next one, ahead of anything sent after it.
+        SHMMM("Couldn't connect to " << connection.host << ", skipping it for now.");
+        _hostRetryAt[connection.host] = now + HOST_RETRY_US;
+        _waiting.splice(_waiting.begin(), connection.inFlight);
+    } else {
+        for (auto& request : connection.inFlight) {
+            _answer(*request, SData("000 Disconnected"));
+        }
+    }
+    closeSocket(connection.socket);
+    connection.socket = nullptr;
+}
+
+void BedrockClient::_answer(Request& request, SData response) {
+    if (request.answered) {
+        return;
+    }
+    request.answered = true;
+    if (request.callback) {
+        request.callback(response);
+    }
+}
+
+void BedrockClient::_expire(uint64_t now) {
+    for (auto it = _waiting.begin(); it != _waiting.end();) {
+        if ((*it)->deadline <= now) {
+            _answer(**it, SData("000 Timeout"));
+            it = _waiting.erase(it);
+        } else {
+            it++;
+        }
+    }
+
+    // Anything already sent keeps its place, so that its response, when it comes, isn't mistaken for the next one's.
+    for (auto& connection : _connections) {
+        for (auto& request : connection.inFlight) {
+            if (request->deadline <= now) {
+                _answer(*request, SData("000 Timeout"));
+            }
+        }
+    }
+}
@@ -0,0 +1,109 @@
+#pragma once
+#include <libstuff/libstuff.h>
+#include <future>
+
+// A client for sending commands to a Bedrock cluster from another C++ program. It keeps a pool of connections to each
+// node, pipelines requests on them (the server answers each connection's requests in the order they were sent), and
+// hands back each response through a callback or a future, without the caller waiting on the network.
+//
+// All networking happens on the client's own thread. Requests go to the first node in `hosts` that's taking
+// connections, so list the node you want to talk to first and the rest as fallbacks. A node that refuses connections
+// (because it's down, or has closed its command port with `suppressCommandPort`) or answers with `Connection: close`
+// (because it's shutting down) is skipped for HOST_RETRY_US. Requests sent on a connection that never connected are
+// sent to the next node instead. A request the node may already have run when its connection dropped isn't resent, as
+// it might not be safe to run twice; it gets a "000 Disconnected" response.
+//
+// With `readYourWrites`, the client remembers the highest `commitCount` any response has had, and sends it with every
+// request that doesn't have its own, so a slave won't answer until it has every commit this client has seen. That way
+// a read sees the writes this client made before it, whichever node serves it.
+class BedrockClient : public STCPManager {
+  public:
+    // Called with each response on the client's thread, so it should hand off anything slow rather than block.
+    typedef function<void(SData& response)> Callback;
+
+    // How long a node that refused us is skipped for.
+    static const uint64_t HOST_RETRY_US;
+
+    BedrockClient(const list<string>& hosts, size_t connectionsPerHost = 4, size_t pipelineDepth = 10,
+                  uint64_t timeoutUS = 60 * STIME_US_PER_S, bool readYourWrites = true);
+
+    // Answers anything still outstanding with "000 Client closed" and closes every connection.
+    ~BedrockClient();
+
+    // Sends `request`, and calls `callback` with the response. If there's no response within the timeout, the
+    // response is "000 Timeout" (and if the request was sent, whatever the server eventually says is discarded). The
+    // time left is sent as `clientTimeout`, so the server won't run a request we've already given up on.
+    void send(const SData& request, Callback callback);
+
+    // Sends `request`, returning a future for its response.
+    future<SData> send(const SData& request);
+
+    // Sends `request` and waits for its response.
+    SData execute(const SData& request);
+
+    // The highest `commitCount` seen in any response.
+    uint64_t getCommitCount() const { return _commitCount.load(); }
+
+  private:
+    struct Request {
+        SData request;
+        Callback callback;
+        uint64_t deadline;
+
+        // Set once this has been answered with a timeout, so the server's response can be discarded when it comes.
+        bool answered = false;
+    };
+
+    // A connection to a node, and the requests sent on it that are waiting for responses, oldest first.
+    struct Connection {
+        string host;
+        Socket* socket;
+        list<shared_ptr<Request>> inFlight;
+
+        // Set once the server has said it will close this connection, after which nothing more is sent on it.
+        bool closing = false;
+    };
+
+    // Runs until `_exit` is set, doing all of the networking.
+    void _loop();
+
+    // Sends each waiting request on a connection that has room for it, opening connections as needed.
+    void _dispatch(uint64_t now);
+
+    // Returns a connection to the first available host with room for another request, opening one if needed, or
+    // nullptr if there's nowhere to send right now.
+    Connection* _getConnection(uint64_t now);
+
+    // Handles each complete response on `connection`.
+    void _receive(Connection& connection, uint64_t now);
+
+    // Closes `connection`, resending or failing what was sent on it, as described above.
+    void _close(Connection& connection, uint64_t now);
+
+    // Answers `request` with `response` unless it's already been answered.
+    void _answer(Request& request, SData response);
+
+    // Answers every request whose deadline has passed with "000 Timeout".
+    void _expire(uint64_t now);
+
+    const list<string> _hosts;
+    const size_t _connectionsPerHost;
+    const size_t _pipelineDepth;
+    const uint64_t _timeoutUS;
+    const bool _readYourWrites;
+    atomic<uint64_t> _commitCount;
+
+    // Callers queue their requests here for the networking thread, which wakes when anything's pushed. A null request
+    // is pushed just to wake it to exit. Everything below this is only touched by the networking thread.
+    SSynchronizedQueue<shared_ptr<Request>> _incoming;
+
+    // Requests waiting for a connection to send on, in the order they were sent to us.
+    list<shared_ptr<Request>> _waiting;
+
+    // Hosts we aren't sending to until the time given.
+    map<string, uint64_t> _hostRetryAt;
+    list<Connection> _connections;
+
+    atomic<bool> _exit;
+    thread _thread;
+};
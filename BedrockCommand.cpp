@@ -6,6 +6,9 @@ BedrockCommand::BedrockCommand() :
     priority(PRIORITY_NORMAL),
     peekCount(0),
     processCount(0),
+    timingTotals(),
+    timingPhases(0),
+    lastTiming(INVALID, 0, 0),
     onlyProcessOnSyncThread(false),
     _inProgressTiming(INVALID, 0, 0)
 { }
@@ -21,23 +24,30 @@ BedrockCommand::BedrockCommand(SQLiteCommand&& from) :
     priority(PRIORITY_NORMAL),
     peekCount(0),
     processCount(0),
+    timingTotals(),
+    timingPhases(0),
+    lastTiming(INVALID, 0, 0),
     onlyProcessOnSyncThread(false),
     _inProgressTiming(INVALID, 0, 0)
 {
     _init();
 }
 
-BedrockCommand::BedrockCommand(BedrockCommand&& from) :
+BedrockCommand::BedrockCommand(BedrockCommand&& from) noexcept :
     SQLiteCommand(move(from)),
     httpsRequests(move(from.httpsRequests)),
     priority(from.priority),
     peekCount(from.peekCount),
     processCount(from.processCount),
-    timingInfo(from.timingInfo),
+    timingPhases(from.timingPhases),
+    lastTiming(from.lastTiming),
     onlyProcessOnSyncThread(from.onlyProcessOnSyncThread),
     crashIdentifyingValues(move(from.crashIdentifyingValues)),
+    processedBy(move(from.processedBy)),
     _inProgressTiming(from._inProgressTiming)
 {
+    copy(begin(from.timingTotals), end(from.timingTotals), begin(timingTotals));
+
     // The move constructor (and likewise, the move assignment operator), don't simply copy these pointer values, but
     // they clear them from the old object, so that when its destructor is called, the HTTPS transactions aren't
     // closed.
@@ -49,6 +59,9 @@ BedrockCommand::BedrockCommand(SData&& _request) :
     priority(PRIORITY_NORMAL),
     peekCount(0),
     processCount(0),
+    timingTotals(),
+    timingPhases(0),
+    lastTiming(INVALID, 0, 0),
     onlyProcessOnSyncThread(false),
     _inProgressTiming(INVALID, 0, 0)
 {
@@ -60,6 +73,9 @@ BedrockCommand::BedrockCommand(SData _request) :
     priority(PRIORITY_NORMAL),
     peekCount(0),
     processCount(0),
+    timingTotals(),
+    timingPhases(0),
+    lastTiming(INVALID, 0, 0),
     onlyProcessOnSyncThread(false),
     _inProgressTiming(INVALID, 0, 0)
 {
@@ -83,9 +99,12 @@ BedrockCommand& BedrockCommand::operator=(BedrockCommand&& from) {
         peekCount = from.peekCount;
         processCount = from.processCount;
         priority = from.priority;
-        timingInfo = from.timingInfo;
+        copy(begin(from.timingTotals), end(from.timingTotals), begin(timingTotals));
+        timingPhases = from.timingPhases;
+        lastTiming = from.lastTiming;
         onlyProcessOnSyncThread = from.onlyProcessOnSyncThread;
         crashIdentifyingValues = move(from.crashIdentifyingValues);
+        processedBy = move(from.processedBy);
         _inProgressTiming = from._inProgressTiming;
 
         // And call the base class's move constructor as well.
@@ -136,8 +155,7 @@ void BedrockCommand::stopTiming(TIMING_INFO type) {
     }
 
     // Add it to the list of timing info.
-    get<2>(_inProgressTiming) = STimeNow();
-    timingInfo.push_back(_inProgressTiming);
+    addTiming(get<0>(_inProgressTiming), get<1>(_inProgressTiming), STimeNow());
 
     // And reset it for next use.
     get<0>(_inProgressTiming) = INVALID;
@@ -145,6 +163,12 @@ void BedrockCommand::stopTiming(TIMING_INFO type) {
     get<2>(_inProgressTiming) = 0;
 }
 
+void BedrockCommand::addTiming(TIMING_INFO type, uint64_t start, uint64_t end) {
+    timingTotals[type] += end - start;
+    timingPhases |= 1 << type;
+    lastTiming = make_tuple(type, start, end);
+}
+
 bool BedrockCommand::areHttpsRequestsComplete() const {
     for (auto request : httpsRequests) {
         if (!request->response) {
@@ -155,29 +179,132 @@ bool BedrockCommand::areHttpsRequestsComplete() const {
 }
 
 
-void BedrockCommand::finalizeTimingInfo() {
-    uint64_t peekTotal = 0;
-    uint64_t processTotal = 0;
-    uint64_t commitWorkerTotal = 0;
-    uint64_t commitSyncTotal = 0;
-    uint64_t queueWorkerTotal = 0;
-    uint64_t queueSyncTotal = 0;
-    for (const auto& entry: timingInfo) {
-        if (get<0>(entry) == PEEK) {
-            peekTotal += get<2>(entry) - get<1>(entry);
-        } else if (get<0>(entry) == PROCESS) {
-            processTotal += get<2>(entry) - get<1>(entry);
-        } else if (get<0>(entry) == COMMIT_WORKER) {
-            commitWorkerTotal += get<2>(entry) - get<1>(entry);
-        } else if (get<0>(entry) == COMMIT_SYNC) {
-            commitSyncTotal += get<2>(entry) - get<1>(entry);
-        } else if (get<0>(entry) == QUEUE_WORKER) {
-            queueWorkerTotal += get<2>(entry) - get<1>(entry);
-        } else if (get<0>(entry) == QUEUE_SYNC) {
-            queueSyncTotal += get<2>(entry) - get<1>(entry);
+// Latency histograms are kept per command verb, with one histogram for each timing phase. The TIMING_INFO phases use
+// their own values as slots, the slot for INVALID holds the total time, and there's one more for escalation time.
+static constexpr int TOTAL_SLOT = BedrockCommand::INVALID;
+static constexpr int ESCALATION_SLOT = BedrockCommand::QUEUE_SYNC + 1;
+static constexpr int TIMING_SLOT_COUNT = ESCALATION_SLOT + 1;
+static const char* const TIMING_SLOT_NAMES[TIMING_SLOT_COUNT] = {
+    "total", "peek", "process", "commitWorker", "commitSync", "queueWorker", "queueSync", "escalation"
+};
+
+// The histograms for a single verb. Each is only allocated when a command first goes through its phase.
+struct VerbTiming {
+    VerbTiming() {
+        for (auto& slot : slots) {
+            slot.store(nullptr);
+        }
+    }
+
+    ~VerbTiming() {
+        for (auto& slot : slots) {
+            delete slot.load();
+        }
+    }
+
+    // Records `value` in the given slot. Only the owning thread may call this.
+    void record(int slot, uint64_t value) {
+        SHistogram* histogram = slots[slot].load(memory_order_acquire);
+        if (!histogram) {
+            histogram = new SHistogram();
+            slots[slot].store(histogram, memory_order_release);
+        }
+        histogram->record(value);
+    }
+
+    // Adds everything in `other` into this object. Unlike `record`, this can be called from any thread, as long as
+    // calls for the same object are serialized by the caller.
+    void merge(const VerbTiming& other) {
+        for (int slot = 0; slot < TIMING_SLOT_COUNT; slot++) {
+            const SHistogram* histogram = other.slots[slot].load(memory_order_acquire);
+            if (histogram) {
+                if (!slots[slot].load()) {
+                    slots[slot].store(new SHistogram());
+                }
+                slots[slot].load()->merge(*histogram);
+            }
+        }
+    }
+
+    atomic<SHistogram*> slots[TIMING_SLOT_COUNT];
+};
+
+// Each thread records into its own set of histograms, so recording never waits on another thread. When a thread
+// exits, its histograms are merged into a shared set so that nothing is lost.
+class ThreadTimingStats {
+  public:
+    static ThreadTimingStats& forThisThread() {
+        static thread_local ThreadTimingStats stats;
+        return stats;
+    }
+
+    // Returns the histograms for `verb`, creating them if this thread hasn't seen it before.
+    VerbTiming& getVerb(const string& verb) {
+        // Only this thread ever adds to `_verbs`, so looking up an existing verb doesn't need a lock.
+        auto it = _verbs.find(verb);
+        if (it == _verbs.end()) {
+            lock_guard<mutex> lock(_verbsMutex);
+            it = _verbs.emplace(piecewise_construct, forward_as_tuple(verb), forward_as_tuple()).first;
         }
+        return it->second;
     }
 
+    // Merges the histograms from every thread (including exited threads) into `merged`.
+    static void mergeAll(map<string, VerbTiming>& merged) {
+        lock_guard<mutex> lock(_registryMutex);
+        for (ThreadTimingStats* stats : _registry) {
+            lock_guard<mutex> verbsLock(stats->_verbsMutex);
+            _mergeVerbs(stats->_verbs, merged);
+        }
+        _mergeVerbs(_exitedThreads, merged);
+    }
+
+    // When we started keeping track, for computing rates.
+    static const uint64_t startTime;
+
+  private:
+    ThreadTimingStats() {
+        lock_guard<mutex> lock(_registryMutex);
+        _registry.insert(this);
+    }
+
+    ~ThreadTimingStats() {
+        lock_guard<mutex> lock(_registryMutex);
+        _registry.erase(this);
+        _mergeVerbs(_verbs, _exitedThreads);
+    }
+
+    static void _mergeVerbs(const map<string, VerbTiming>& from, map<string, VerbTiming>& to) {
+        for (const auto& verb : from) {
+            auto it = to.find(verb.first);
+            if (it == to.end()) {
+                it = to.emplace(piecewise_construct, forward_as_tuple(verb.first), forward_as_tuple()).first;
+            }
+            it->second.merge(verb.second);
+        }
+    }
+
+    map<string, VerbTiming> _verbs;
+    mutex _verbsMutex;
+
+    static mutex _registryMutex;
+    static set<ThreadTimingStats*> _registry;
+    static map<string, VerbTiming> _exitedThreads;
+};
+
+const uint64_t ThreadTimingStats::startTime = STimeNow();
+mutex ThreadTimingStats::_registryMutex;
+set<ThreadTimingStats*> ThreadTimingStats::_registry;
+map<string, VerbTiming> ThreadTimingStats::_exitedThreads;
+
+void BedrockCommand::finalizeTimingInfo() {
+    const uint64_t peekTotal = timingTotals[PEEK];
+    const uint64_t processTotal = timingTotals[PROCESS];
+    const uint64_t commitWorkerTotal = timingTotals[COMMIT_WORKER];
+    const uint64_t commitSyncTotal = timingTotals[COMMIT_SYNC];
+    const uint64_t queueWorkerTotal = timingTotals[QUEUE_WORKER];
+    const uint64_t queueSyncTotal = timingTotals[QUEUE_SYNC];
+
     // The lifespan of the object up until now.
     uint64_t totalTime = STimeNow() - creationTime;
 
@@ -192,6 +319,8 @@ void BedrockCommand::finalizeTimingInfo() {
         {"totalTime",       totalTime},
         {"escalationTime",  escalationTimeUS},
         {"unaccountedTime", unaccountedTime},
+        {"queueTime",       queueWorkerTotal + queueSyncTotal},
+        {"commitTime",      commitWorkerTotal + commitSyncTotal},
     };
 
     // We also want to know what master did if we're on a slave.
@@ -249,30 +378,83 @@ void BedrockCommand::finalizeTimingInfo() {
             response[p.first] = to_string(p.second);
         }
     }
+
+    // Add this command to the histograms for its verb, skipping any phase it never went through.
+    bool sawPhase[TIMING_SLOT_COUNT] = {};
+    for (int phase = PEEK; phase < TIMING_INFO_COUNT; phase++) {
+        sawPhase[phase] = timingPhases & (1 << phase);
+    }
+    const uint64_t phaseTotals[TIMING_SLOT_COUNT] = {totalTime, peekTotal, processTotal, commitWorkerTotal,
+                                                     commitSyncTotal, queueWorkerTotal, queueSyncTotal,
+                                                     escalationTimeUS};
+    sawPhase[TOTAL_SLOT] = true;
+    sawPhase[ESCALATION_SLOT] = escalationTimeUS > 0;
+    VerbTiming& verbTiming = ThreadTimingStats::forThisThread().getVerb(request.getVerb());
+    for (int slot = 0; slot < TIMING_SLOT_COUNT; slot++) {
+        if (sawPhase[slot]) {
+            verbTiming.record(slot, phaseTotals[slot]);
+        }
+    }
+
+    // If this command is traced, record the time it spent in each phase here, along with what master reported for it
+    // if we escalated it, or which peer escalated it to us.
+    if (request.isSet("traceID")) {
+        STable span;
+        span["verb"] = request.getVerb();
+        span["escalatedFromPeer"] = initiatingPeerID != 0;
+        for (int slot = 0; slot < TIMING_SLOT_COUNT; slot++) {
+            if (sawPhase[slot]) {
+                span[TIMING_SLOT_NAMES[slot]] = phaseTotals[slot];
+            }
+        }
+        for (const auto& header : response.nameValueMap) {
+            if (SStartsWith(header.first, "upstream")) {
+                span[header.first] = header.second;
+            }
+        }
+        recordTraceSpan(request["traceID"], "command", creationTime, move(span));
+    }
 }
 
-// pop and push specializations for SSynchronizedQueue that record timing info.
-template<>
-BedrockCommand SSynchronizedQueue<BedrockCommand>::pop() {
-    SAUTOLOCK(_queueMutex);
-    if (!_queue.empty()) {
-        BedrockCommand item = move(_queue.front());
-        _queue.pop_front();
-        item.stopTiming(BedrockCommand::QUEUE_SYNC);
-        return item;
+STable BedrockCommand::getTimingStats() {
+    // Merge each thread's histograms, along with those of threads that are gone.
+    map<string, VerbTiming> merged;
+    ThreadTimingStats::mergeAll(merged);
+
+    STable stats;
+    double elapsedSeconds = (double)(STimeNow() - ThreadTimingStats::startTime) / STIME_US_PER_S;
+    for (const auto& verb : merged) {
+        STable verbStats;
+        const SHistogram* total = verb.second.slots[TOTAL_SLOT].load();
+        uint64_t count = total ? total->count() : 0;
+        verbStats["count"] = count;
+        verbStats["perSecond"] = elapsedSeconds > 0 ? count / elapsedSeconds : 0;
+        for (int slot = 0; slot < TIMING_SLOT_COUNT; slot++) {
+            const SHistogram* histogram = verb.second.slots[slot].load();
+            if (histogram) {
+                STable phase;
+                phase["count"] = histogram->count();
+                phase["p50"] = histogram->percentile(50);
+                phase["p99"] = histogram->percentile(99);
+                phase["p999"] = histogram->percentile(99.9);
+                phase["max"] = histogram->max();
+                verbStats[TIMING_SLOT_NAMES[slot]] = SComposeJSONObject(phase);
+            }
+        }
+        stats[verb.first] = SComposeJSONObject(verbStats);
     }
-    throw out_of_range("No commands");
+    return stats;
+}
+
+// Specializations for SSynchronizedQueue that record timing info.
+template<>
+void SSynchronizedQueue<BedrockCommand>::_pushed(BedrockCommand& cmd) {
+    SINFO("Enqueuing command '" << cmd.request.methodLine << "', with " << (_queue.size() - 1)
+          << " commands already queued.");
+    cmd.startTiming(BedrockCommand::QUEUE_SYNC);
 }
 
 template<>
-void SSynchronizedQueue<BedrockCommand>::push(BedrockCommand&& cmd) {
-    SAUTOLOCK(_queueMutex);
-    SINFO("Enqueuing command '" << cmd.request.methodLine << "', with " << _queue.size() << " commands already queued.");
-    // Just add to the queue
-    _queue.push_back(move(cmd));
-    _queue.back().startTiming(BedrockCommand::QUEUE_SYNC);
-
-    // Write arbitrary buffer to the pipe so any subscribers will be awoken.
-    // **NOTE: 1 byte so write is atomic.
-    SASSERT(write(_pipeFD[1], "A", 1));
+void SSynchronizedQueue<BedrockCommand>::_popped(BedrockCommand& cmd) {
+    cmd.stopTiming(BedrockCommand::QUEUE_SYNC);
 }
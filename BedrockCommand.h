@@ -21,14 +21,17 @@ class BedrockCommand : public SQLiteCommand {
         QUEUE_SYNC,
     };
 
+    // The number of TIMING_INFO values, for sizing arrays indexed by them.
+    static constexpr int TIMING_INFO_COUNT = QUEUE_SYNC + 1;
+
     // Constructor to make an empty object.
     BedrockCommand();
 
     // Constructor to convert from an existing SQLiteCommand (by move).
     BedrockCommand(SQLiteCommand&& from);
 
-    // Move constructor.
-    BedrockCommand(BedrockCommand&& from);
+    // Move constructor. This doesn't allocate, so containers of commands can move them rather than copying.
+    BedrockCommand(BedrockCommand&& from) noexcept;
 
     // Constructor to initialize via a request object (by move).
     BedrockCommand(SData&& _request);
@@ -49,14 +52,24 @@ class BedrockCommand : public SQLiteCommand {
     // `startTiming`.
     void stopTiming(TIMING_INFO type);
 
-    // Add a summary of our timing info to our response object.
+    // Add a finished timing entry to `timingTotals`, and make it `lastTiming`.
+    void addTiming(TIMING_INFO type, uint64_t start, uint64_t end);
+
+    // Add a summary of our timing info to our response object, and record it in the latency histograms returned by
+    // `getTimingStats`.
     void finalizeTimingInfo();
 
+    // Returns latency statistics for every command verb this server has finished, merged across all threads. Each
+    // value is a JSON object with the number of commands (`count`), the average rate since startup (`perSecond`), and
+    // for each timing phase (`total`, `peek`, `process`, etc) its `p50`, `p99`, `p999`, and `max` in microseconds.
+    static STable getTimingStats();
+
     // Returns true if all of the httpsRequests for this command are complete (or if it has none).
     bool areHttpsRequestsComplete() const;
 
-    // If the `peek` portion of this command needs to make an HTTPS request, this is where we store it.
-    list<SHTTPSManager::Transaction*> httpsRequests;
+    // If the `peek` portion of this command needs to make an HTTPS request, this is where we store it. Most commands
+    // make none, so this is usually empty and costs nothing to move.
+    vector<SHTTPSManager::Transaction*> httpsRequests;
 
     // Each command is assigned a priority.
     Priority priority;
@@ -65,8 +78,14 @@ class BedrockCommand : public SQLiteCommand {
     int peekCount;
     int processCount;
 
-    // A list of timing sets, with an info type, start, and end.
-    list<tuple<TIMING_INFO, uint64_t, uint64_t>> timingInfo;
+    // The total time spent in each TIMING_INFO phase, indexed by phase, and a bit (`1 << phase`) for each phase this
+    // command has been through at all. These are kept inline rather than as a list of entries, so a command never
+    // allocates for its timing, and moving one just copies them.
+    uint64_t timingTotals[TIMING_INFO_COUNT];
+    uint8_t timingPhases;
+
+    // The most recent entry passed to `addTiming`, with its info type, start, and end.
+    tuple<TIMING_INFO, uint64_t, uint64_t> lastTiming;
 
     // This defaults to false, but a specific plugin can set it to 'true' in peek() to force this command to be passed
     // to the sync thread for processing, thus guaranteeing that process() will not result in a conflict.
@@ -79,6 +98,10 @@ class BedrockCommand : public SQLiteCommand {
     // cause a crash, and not processed.
     set<string> crashIdentifyingValues;
 
+    // The name of the plugin that processed this command, if one has, so that committing it can be charged to that
+    // plugin (see `BedrockCore::AutoAccount`).
+    string processedBy;
+
   private:
     // Set certain initial state on construction. Common functionality to several constructors.
     void _init();
@@ -86,3 +109,7 @@ class BedrockCommand : public SQLiteCommand {
     // used as a temporary variable for startTiming and stopTiming.
     tuple<TIMING_INFO, uint64_t, uint64_t> _inProgressTiming;
 };
+
+// These record how long each command spends in a queue of them.
+template<> void SSynchronizedQueue<BedrockCommand>::_pushed(BedrockCommand& cmd);
+template<> void SSynchronizedQueue<BedrockCommand>::_popped(BedrockCommand& cmd);
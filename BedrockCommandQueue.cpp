@@ -2,23 +2,41 @@
 #include "BedrockCommand.h"
 #include "BedrockCommandQueue.h"
 
+constexpr uint64_t BedrockCommandQueue::TIMER_WHEEL_TICK_US;
+constexpr size_t BedrockCommandQueue::TIMER_WHEEL_SLOTS;
+constexpr uint64_t BedrockCommandQueue::FAIR_QUEUE_COST;
+
+BedrockCommandQueue::BedrockCommandQueue() :
+    _timerWheel(TIMER_WHEEL_SLOTS),
+    _timerWheelTick(STimeNow() / TIMER_WHEEL_TICK_US),
+    _timerWheelCount(0),
+    _fair(false),
+    _virtualTime(0),
+    _flowSweepSize(0),
+    _size(0)
+{ }
+
 void BedrockCommandQueue::clear()  {
     SAUTOLOCK(_queueMutex);
-    return _commandQueue.clear();
+    _commandQueue.clear();
+    for (auto& slot : _timerWheel) {
+        slot.clear();
+    }
+    _timerWheelCount = 0;
+    _futureCommands.clear();
+    _commandIndex.clear();
+    _recentWaitUS.clear();
+    _readyCounts.clear();
+    _flowFinishTimes.clear();
+    _size = 0;
 }
 
 bool BedrockCommandQueue::empty()  {
-    SAUTOLOCK(_queueMutex);
-    return _commandQueue.empty();
+    return !_size.load();
 }
 
 size_t BedrockCommandQueue::size()  {
-    SAUTOLOCK(_queueMutex);
-    size_t size = 0;
-    for (const auto& queue : _commandQueue) {
-        size += queue.second.size();
-    }
-    return size;
+    return _size.load();
 }
 
 BedrockCommand BedrockCommandQueue::get(uint64_t timeoutUS) {
@@ -29,16 +47,6 @@ BedrockCommand BedrockCommandQueue::get(uint64_t timeoutUS) {
 BedrockCommand BedrockCommandQueue::getSynchronized(uint64_t timeoutUS, atomic<int>& incrementBeforeDequeue) {
     unique_lock<mutex> queueLock(_queueMutex);
 
-    // NOTE:
-    // Possible future improvement: Say there's work in the queue, but it's not ready yet (i.e., it's scheduled in the
-    // future). Someone calls `get(1000000)`, and nothing gets added to the queue during that second (which would wake
-    // someone up to process whatever is next, which isn't necessarily the same thing that was added). BUT, some work
-    // in the queue comes due during that wait (i.e., it's timestamp is no longer in the future). Currently, we won't
-    // wake up here, we'll wait out our full second and force the caller to retry. This is fine for the current
-    // (03-2017) use case, where we interrupt every second and only really use scheduling at 1-second granularity.
-    //
-    // What we could do, is truncate the timeout to not be farther in the future than the next timestamp in the list.
-
     // If there's already work in the queue, just return some.
     try {
         return _dequeue(incrementBeforeDequeue);
@@ -46,34 +54,39 @@ BedrockCommand BedrockCommandQueue::getSynchronized(uint64_t timeoutUS, atomic<i
         // Nothing available.
     }
 
-    // Otherwise, we'll wait for some.
-    if (timeoutUS) {
-        auto timeout = chrono::steady_clock::now() + chrono::microseconds(timeoutUS);
-        while (true) {
-            // Wait until we hit our timeout, or someone gives us some work.
-            _queueCondition.wait_until(queueLock, timeout);
-            
-            // If we got any work, return it.
-            try {
-                return _dequeue(incrementBeforeDequeue);
-            } catch (const out_of_range& e) {
-                // Still nothing available.
-            }
-
-            // Did we go past our timeout? If so, we give up. Otherwise, we awoke spuriously, and will retry.
-            if (chrono::steady_clock::now() > timeout) {
-                throw timeout_error();
+    // Otherwise, we'll wait for some. Nobody will notify us when a future command comes due, so we never wait past the
+    // next one.
+    auto timeout = chrono::steady_clock::now() + chrono::microseconds(timeoutUS);
+    while (true) {
+        uint64_t nextFutureCommand = _nextFutureCommandTime();
+        auto wakeTime = timeout;
+        if (nextFutureCommand) {
+            uint64_t now = STimeNow();
+            uint64_t untilDue = nextFutureCommand > now ? nextFutureCommand - now : 0;
+            auto due = chrono::steady_clock::now() + chrono::microseconds(untilDue);
+            if (!timeoutUS || due < wakeTime) {
+                wakeTime = due;
             }
         }
-    } else {
-        // Wait indefinitely.
-        while (true) {
+
+        // Wait until we hit our timeout, a future command comes due, or someone gives us some work.
+        if (timeoutUS || nextFutureCommand) {
+            _queueCondition.wait_until(queueLock, wakeTime);
+        } else {
             _queueCondition.wait(queueLock);
-            try {
-                return _dequeue(incrementBeforeDequeue);
-            } catch (const out_of_range& e) {
-                // Nothing yet, loop again.
-            }
+        }
+
+        // If we got any work, return it.
+        try {
+            return _dequeue(incrementBeforeDequeue);
+        } catch (const out_of_range& e) {
+            // Still nothing available.
+        }
+
+        // Did we go past our timeout? If so, we give up. Otherwise, we awoke spuriously or for a command someone else
+        // got first, and will retry.
+        if (timeoutUS && chrono::steady_clock::now() > timeout) {
+            throw timeout_error();
         }
     }
 }
@@ -86,40 +99,121 @@ list<string> BedrockCommandQueue::getRequestMethodLines() {
             returnVal.push_back(entry.second.request.methodLine);
         }
     }
+    for (auto& slot : _timerWheel) {
+        for (auto& entry : slot) {
+            returnVal.push_back(entry.second.request.methodLine);
+        }
+    }
+    for (auto& entry : _futureCommands) {
+        returnVal.push_back(entry.second.request.methodLine);
+    }
     return returnVal;
 }
 
-void BedrockCommandQueue::push(BedrockCommand&& item) {
+void BedrockCommandQueue::setFairQueuing(const map<int, uint64_t>& weights, const string& flowKey) {
     SAUTOLOCK(_queueMutex);
-    auto& queue = _commandQueue[item.priority];
+    SASSERT(!_size.load());
+    _fair = true;
+    _fairWeights = weights;
+    _fairFlowKey = flowKey;
+}
+
+uint64_t BedrockCommandQueue::getRecentWaitUS(int priority) {
+    SAUTOLOCK(_queueMutex);
+    uint64_t wait = 0;
+    for (auto it = _readyCounts.begin(); it != _readyCounts.end() && it->first <= priority; it++) {
+        auto waitIt = _recentWaitUS.find(it->first);
+        if (waitIt != _recentWaitUS.end()) {
+            wait = max(wait, waitIt->second);
+        }
+    }
+    return wait;
+}
+
+void BedrockCommandQueue::push(BedrockCommand&& item) {
+    // Do everything we can before taking the lock, so we hold it as briefly as possible.
+    uint64_t executeTime = item.request.calcU64("commandExecuteTime");
     item.startTiming(BedrockCommand::QUEUE_WORKER);
-    queue.emplace(item.request.calcU64("commandExecuteTime"), move(item));
+    bool ready = executeTime <= STimeNow();
+    {
+        SAUTOLOCK(_queueMutex);
+        if (ready) {
+            _insertReady(executeTime, move(item));
+        } else {
+            _schedule(executeTime, move(item));
+        }
+        _size++;
+    }
+
+    // A future command might be earlier than whatever a waiting thread was planning to wake up for, so we wake
+    // someone up to reconsider either way.
     _queueCondition.notify_one();
 }
 
-// This function currently never gets called. It's actually completely untested, so if you ever make any changes that
-// cause it to actually get called, you'll want to do that testing.
+void BedrockCommandQueue::push(list<BedrockCommand>&& items) {
+    if (items.empty()) {
+        return;
+    }
+    const uint64_t now = STimeNow();
+    vector<uint64_t> executeTimes;
+    executeTimes.reserve(items.size());
+    for (auto& item : items) {
+        executeTimes.push_back(item.request.calcU64("commandExecuteTime"));
+        item.startTiming(BedrockCommand::QUEUE_WORKER);
+    }
+    {
+        SAUTOLOCK(_queueMutex);
+        auto timeIt = executeTimes.begin();
+        for (auto& item : items) {
+            if (*timeIt <= now) {
+                _insertReady(*timeIt, move(item));
+            } else {
+                _schedule(*timeIt, move(item));
+            }
+            timeIt++;
+        }
+        _size += items.size();
+    }
+    if (items.size() == 1) {
+        _queueCondition.notify_one();
+    } else {
+        _queueCondition.notify_all();
+    }
+}
+
 bool BedrockCommandQueue::removeByID(const string& id) {
     SAUTOLOCK(_queueMutex);
-    bool retVal = false;
-    for (auto queueIt = _commandQueue.begin(); queueIt != _commandQueue.end(); queueIt++) {
-        auto& queue = queueIt->second;
-        auto it = queue.begin();
-        while (it != queue.end()) {
-            if (it->second.id == id) {
-                // Found it!
-                queue.erase(it);
-                retVal = true;
-                break;
+    auto indexIt = _commandIndex.find(id);
+    if (indexIt == _commandIndex.end()) {
+        return false;
+    }
+    const CommandLocation location = indexIt->second;
+    _commandIndex.erase(indexIt);
+    switch (location.container) {
+        case CommandLocation::READY:
+        {
+            // If that was the last command at this priority, remove the queue, too.
+            const int priority = location.mapIt->second.priority;
+            auto queueIt = _commandQueue.find(_readyQueue(location.mapIt->second));
+            queueIt->second.erase(location.mapIt);
+            if (!--_readyCounts[priority]) {
+                _readyCounts.erase(priority);
+            }
+            if (queueIt->second.empty()) {
+                _commandQueue.erase(queueIt);
             }
-            it++;
-        }
-        if (retVal) {
-            _commandQueue.erase(queueIt);
             break;
         }
+        case CommandLocation::WHEEL:
+            _timerWheel[location.slot].erase(location.slotIt);
+            _timerWheelCount--;
+            break;
+        case CommandLocation::FUTURE:
+            _futureCommands.erase(location.mapIt);
+            break;
     }
-    return retVal;
+    _size--;
+    return true;
 }
 
 void BedrockCommandQueue::abandonFutureCommands(int msInFuture) {
@@ -129,37 +223,159 @@ void BedrockCommandQueue::abandonFutureCommands(int msInFuture) {
     // Lock around changes to the queue.
     unique_lock<mutex> queueLock(_queueMutex);
 
-    // We're going to look at each queue by priority. It's possible we'll end up removing *everything* from multiple
-    // queues. In that case, we need to remove the queues themselves, so we keep a list of queues to delete when we're
-    // done operating on each of them (so that we don't delete them while iterating over them).
-    list<decltype(_commandQueue)::iterator> toDelete;
-    for (decltype(_commandQueue)::iterator queueMapIt = _commandQueue.begin(); queueMapIt != _commandQueue.end(); ++queueMapIt) {
-        // Starting from the first item, skip any items that have a valid scheduled time.
-        auto commandMapIt = queueMapIt->second.begin();
-        while (commandMapIt != queueMapIt->second.end() && commandMapIt->first < timeLimit) {
-            commandMapIt++;
+    // Everything in `_commandQueue` was already due when it was put there, so it's only future commands that can be
+    // scheduled this far out. This is rare (it happens when standing down and shutting down), so we just look at
+    // everything in the wheel.
+    size_t numberToErase = 0;
+    if (_timerWheelCount) {
+        for (auto& slot : _timerWheel) {
+            auto it = slot.begin();
+            while (it != slot.end()) {
+                if (it->first >= timeLimit) {
+                    _unindex(it->second);
+                    it = slot.erase(it);
+                    numberToErase++;
+                } else {
+                    it++;
+                }
+            }
         }
+        _timerWheelCount -= numberToErase;
+    }
+    auto it = _futureCommands.lower_bound(timeLimit);
+    size_t numberInFuture = distance(it, _futureCommands.end());
+    for (auto unindexIt = it; unindexIt != _futureCommands.end(); unindexIt++) {
+        _unindex(unindexIt->second);
+    }
+    _futureCommands.erase(it, _futureCommands.end());
+    numberToErase += numberInFuture;
+    if (numberToErase) {
+        _size -= numberToErase;
+        SINFO("Erased " << numberToErase << " commands scheduled more than " << msInFuture << "ms in the future.");
+    }
+}
+
+void BedrockCommandQueue::_schedule(uint64_t executeTime, BedrockCommand&& command) {
+    // If the clock has gone backwards, a command could be due in a tick we've already swept past. We put it in the
+    // earliest slot we'll still look at, which still won't promote it until it's due.
+    uint64_t tick = max(executeTime / TIMER_WHEEL_TICK_US, _timerWheelTick);
+    CommandLocation location;
+    if (tick < _timerWheelTick + TIMER_WHEEL_SLOTS) {
+        location.container = CommandLocation::WHEEL;
+        location.slot = tick % TIMER_WHEEL_SLOTS;
+        TimerSlot& slot = _timerWheel[location.slot];
+        location.slotIt = slot.emplace(slot.end(), executeTime, move(command));
+        _timerWheelCount++;
+    } else {
+        location.container = CommandLocation::FUTURE;
+        location.mapIt = _futureCommands.emplace(executeTime, move(command));
+    }
+    _index(*location.command(), location);
+}
+
+void BedrockCommandQueue::_insertReady(uint64_t executeTime, BedrockCommand&& command) {
+    CommandLocation location;
+    location.container = CommandLocation::READY;
+    _readyCounts[command.priority]++;
+    const uint64_t position = _readyPosition(command, executeTime);
+    location.mapIt = _commandQueue[_readyQueue(command)].emplace(position, move(command));
+    _index(location.mapIt->second, location);
+}
 
-        // Whatever's left in the queue is scheduled in the future and can be erased.
-        size_t numberToErase = distance(commandMapIt, queueMapIt->second.end());
-        if (numberToErase) {
-            queueMapIt->second.erase(commandMapIt, queueMapIt->second.end());
+int BedrockCommandQueue::_readyQueue(const BedrockCommand& command) const {
+    return _fair ? 0 : command.priority;
+}
+
+uint64_t BedrockCommandQueue::_readyPosition(const BedrockCommand& command, uint64_t executeTime) {
+    if (!_fair) {
+        return executeTime;
+    }
+    string key;
+    if (SIEquals(_fairFlowKey, "verb")) {
+        key = command.request.getVerb();
+    } else if (SIEquals(_fairFlowKey, "source")) {
+        key = command.request["_source"];
+    } else {
+        key = command.request[_fairFlowKey];
+    }
+    auto weightIt = _fairWeights.find(command.priority);
+    const uint64_t weight = weightIt == _fairWeights.end() ? 1 : max(weightIt->second, (uint64_t)1);
+    uint64_t& finish = _flowFinishTimes[make_pair((int)command.priority, key)];
+    const uint64_t start = max(finish, _virtualTime);
+    finish = start + FAIR_QUEUE_COST / weight;
+    return start;
+}
+
+const BedrockCommand* BedrockCommandQueue::CommandLocation::command() const {
+    return container == WHEEL ? &slotIt->second : &mapIt->second;
+}
+
+void BedrockCommandQueue::_index(const BedrockCommand& command, const CommandLocation& location) {
+    if (!command.id.empty()) {
+        _commandIndex[command.id] = location;
+    }
+}
+
+void BedrockCommandQueue::_unindex(const BedrockCommand& command) {
+    if (!command.id.empty()) {
+        auto it = _commandIndex.find(command.id);
+        if (it != _commandIndex.end() && it->second.command() == &command) {
+            _commandIndex.erase(it);
         }
+    }
+}
 
-        // If the whole queue is empty, save it for deletion.
-        if (queueMapIt->second.empty()) {
-            toDelete.push_back(queueMapIt);
+uint64_t BedrockCommandQueue::_nextFutureCommandTime() {
+    if (_timerWheelCount) {
+        // Find the first slot with anything in it, and the earliest command in that slot.
+        for (uint64_t tick = _timerWheelTick; tick < _timerWheelTick + TIMER_WHEEL_SLOTS; tick++) {
+            const TimerSlot& slot = _timerWheel[tick % TIMER_WHEEL_SLOTS];
+            if (!slot.empty()) {
+                uint64_t earliest = slot.front().first;
+                for (const auto& entry : slot) {
+                    earliest = min(earliest, entry.first);
+                }
+                return earliest;
+            }
         }
+    }
+    return _futureCommands.empty() ? 0 : _futureCommands.begin()->first;
+}
 
-        // If we deleted any commands, log that.
-        if (numberToErase) {
-            SINFO("Erased " << numberToErase << " commands scheduled more than " << msInFuture << "ms in the future.");
+void BedrockCommandQueue::_promoteFutureCommands(uint64_t now) {
+    // Sweep every slot from the earliest tick that might still have commands through the current one. The current
+    // tick's slot can have commands due later in the tick, so we stay on it rather than moving past it.
+    uint64_t nowTick = now / TIMER_WHEEL_TICK_US;
+    if (_timerWheelCount) {
+        uint64_t lastTick = min(nowTick, _timerWheelTick + TIMER_WHEEL_SLOTS - 1);
+        for (uint64_t tick = _timerWheelTick; tick <= lastTick; tick++) {
+            TimerSlot& slot = _timerWheel[tick % TIMER_WHEEL_SLOTS];
+            auto it = slot.begin();
+            while (it != slot.end()) {
+                if (it->first <= now) {
+                    _unindex(it->second);
+                    _insertReady(it->first, move(it->second));
+                    it = slot.erase(it);
+                    _timerWheelCount--;
+                } else {
+                    it++;
+                }
+            }
         }
     }
+    _timerWheelTick = max(_timerWheelTick, nowTick);
 
-    // Delete any empty queues.
-    for (auto& it : toDelete) {
-        _commandQueue.erase(it);
+    // Anything in the outer level that's due now goes straight to the ready queue, and anything that's now within
+    // the span of the wheel moves into it.
+    auto it = _futureCommands.begin();
+    while (it != _futureCommands.end() && it->first / TIMER_WHEEL_TICK_US < _timerWheelTick + TIMER_WHEEL_SLOTS) {
+        _unindex(it->second);
+        if (it->first <= now) {
+            _insertReady(it->first, move(it->second));
+        } else {
+            _schedule(it->first, move(it->second));
+        }
+        it = _futureCommands.erase(it);
     }
 }
 
@@ -168,38 +384,58 @@ BedrockCommand BedrockCommandQueue::_dequeue(atomic<int>& incrementBeforeDequeue
     // we need to only lock it once, which we've already done in whichever function is calling this one (since this is
     // private).
 
-    // We check to see if a command is going to occur in the future, if so, we won't dequeue it yet.
-    uint64_t now = STimeNow();
-
-    // Look at each priority queue, starting from the highest priority.
-    for (auto queueMapIt = _commandQueue.rbegin(); queueMapIt != _commandQueue.rend(); ++queueMapIt) {
-        
-        // Look at the first item in the list, this is the one with the lowest timestamp. If this one isn't suitable,
-        // none of the others will be, either.
-        auto commandMapIt = queueMapIt->second.begin();
-        if (commandMapIt->first <= now) {
-            // Pull out the command we want to return.
-            BedrockCommand command = move(commandMapIt->second);
-
-            // Make sure we increment this counter before we actually dequeue, so this commands will never be not in
-            // the queue and also not counted by the counter.
-            incrementBeforeDequeue++;
-
-            // And delete the entry in the queue.
-            queueMapIt->second.erase(commandMapIt);
-
-            // If the whole queue is empty, delete that too.
-            if (queueMapIt->second.empty()) {
-                // The odd syntax in the argument converts a reverse to forward iterator.
-                _commandQueue.erase(next(queueMapIt).base());
-            }
+    // Anything scheduled in the future that's come due is now ready to run.
+    _promoteFutureCommands(STimeNow());
+
+    // Everything left in `_commandQueue` is ready, so the command we want is the first (lowest timestamp) one at the
+    // highest priority. When fair queuing, there's only one queue, and the first command in it is the one whose turn
+    // starts soonest.
+    if (_commandQueue.empty()) {
+        // No command suitable to process.
+        throw out_of_range("No command found.");
+    }
+    auto queueMapIt = prev(_commandQueue.end());
+    auto commandMapIt = queueMapIt->second.begin();
+
+    // Pull out the command we want to return.
+    _unindex(commandMapIt->second);
+    BedrockCommand command = move(commandMapIt->second);
+    const int priority = command.priority;
+    uint64_t readyTime = commandMapIt->first;
+    if (_fair) {
+        _virtualTime = readyTime;
+        readyTime = command.request.calcU64("commandExecuteTime");
+    }
+    if (!--_readyCounts[priority]) {
+        _readyCounts.erase(priority);
+    }
+
+    // Make sure we increment this counter before we actually dequeue, so this commands will never be not in the
+    // queue and also not counted by the counter.
+    incrementBeforeDequeue++;
+
+    // And delete the entry in the queue.
+    queueMapIt->second.erase(commandMapIt);
+    _size--;
+
+    // If the whole queue is empty, delete that too.
+    if (queueMapIt->second.empty()) {
+        _commandQueue.erase(queueMapIt);
+    }
 
-            // Done!
-            command.stopTiming(BedrockCommand::QUEUE_WORKER);
-            return command;
+    // Forget any flows that have caught up, once there are enough of them to be worth looking through.
+    if (_flowFinishTimes.size() > max(_flowSweepSize, (size_t)1024)) {
+        for (auto it = _flowFinishTimes.begin(); it != _flowFinishTimes.end();) {
+            it = it->second <= _virtualTime ? _flowFinishTimes.erase(it) : next(it);
         }
+        _flowSweepSize = _flowFinishTimes.size() * 2;
     }
 
-    // No command suitable to process.
-    throw out_of_range("No command found.");
+    // Done! A command scheduled for the future has only been waiting since it was due, not since it was queued.
+    command.stopTiming(BedrockCommand::QUEUE_WORKER);
+    const auto& timing = command.lastTiming;
+    const uint64_t waitingSince = max(std::get<1>(timing), readyTime);
+    const uint64_t dequeued = std::get<2>(timing);
+    _recentWaitUS[priority] = dequeued > waitingSince ? dequeued - waitingSince : 0;
+    return command;
 }
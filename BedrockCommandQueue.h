@@ -10,6 +10,8 @@ class BedrockCommandQueue {
         }
     };
 
+    BedrockCommandQueue();
+
     // Remove all items from the queue.
     void clear();
 
@@ -33,13 +35,29 @@ class BedrockCommandQueue {
     // Add an item to the queue. The queue takes ownership of the item and the caller's copy is invalidated.
     void push(BedrockCommand&& item);
 
-    // Looks for a command with the given ID and removes it.
-    // This will inspect every command in the case the command does not exist.
+    // Add several items to the queue at once, taking the lock once for all of them.
+    void push(list<BedrockCommand>&& items);
+
+    // Looks for a command with the given ID and removes it. Returns true if there was one.
     bool removeByID(const string& id);
 
     // Discards all commands scheduled more than msInFuture milliseconds after right now.
     void abandonFutureCommands(int msInFuture);
 
+    // By default, the queue is strictly ordered by priority: a command only runs when nothing of higher priority is
+    // ready. This switches it to weighted fair queuing instead. Each ready command belongs to a flow, made up of its
+    // priority and a key from its request: its verb if `flowKey` is "verb", its client's address if it's "source", or
+    // otherwise the value of the header named by `flowKey`. Flows take turns, with each taking a share in proportion to
+    // the weight of its priority in `weights` (1 if not listed), so that higher priorities are favored but can't
+    // starve lower ones, and a flood of commands from one flow doesn't delay any other. Commands within a flow run in
+    // the order they became ready. This must be called before anything is queued.
+    void setFairQueuing(const map<int, uint64_t>& weights, const string& flowKey);
+
+    // Returns how long commands at `priority` or below have recently waited to be dequeued: for each such priority
+    // with commands ready to run, how long the last one dequeued at that priority had waited, and the longest of
+    // those. Priorities with nothing ready count as no wait, since a new command there would be next in line.
+    uint64_t getRecentWaitUS(int priority);
+
   private:
     // Removes and returns the first workable command in the queue. A command is workable if it's executeTimestamp is
     // not in the future.
@@ -50,11 +68,90 @@ class BedrockCommandQueue {
     // This function throws an exception if no workable commands are available.
     BedrockCommand _dequeue(atomic<int>& incrementBeforeDequeue);
 
+    // Moves any commands in the timer wheel that have come due by `now` into `_commandQueue`, and cascades commands
+    // from `_futureCommands` into the wheel as they come within its span.
+    void _promoteFutureCommands(uint64_t now);
+
+    // Adds a command that isn't due yet to the timer wheel, or to `_futureCommands` if it's beyond the wheel's span.
+    void _schedule(uint64_t executeTime, BedrockCommand&& command);
+
+    // Returns the timestamp of the next command scheduled in the future, or 0 if there isn't one.
+    uint64_t _nextFutureCommandTime();
+
+    // Adds a command that's ready to run to `_commandQueue`.
+    void _insertReady(uint64_t executeTime, BedrockCommand&& command);
+
     // Synchronization primitives for managing access to the queue.
     mutex _queueMutex;
     condition_variable _queueCondition;
 
-    // The priority queue in which we store commands. This is a map of integer priorities to their respective maps.
-    // Each of those maps maps timestamps to commands.
+    // The priority queue in which we store commands that are ready to run. This is a map of integer priorities to
+    // their respective maps. Each of those maps maps timestamps to commands. Empty priorities are always removed, so
+    // the highest priority command that's ready to run is always the first one in the last map.
     map<int, multimap<uint64_t, BedrockCommand>> _commandQueue;
+
+    // Commands scheduled to run in the near future are kept in a timer wheel: a ring of slots, each holding the
+    // commands due within one tick. Each slot only ever holds commands from a single tick, as the wheel only holds
+    // commands due within TIMER_WHEEL_SLOTS ticks of `_timerWheelTick`, which is the earliest tick that might still
+    // have commands in it. Adding or removing a command is constant time, and promoting commands only looks at the
+    // slots for ticks that have passed.
+    static constexpr uint64_t TIMER_WHEEL_TICK_US = 10 * STIME_US_PER_MS;
+    static constexpr size_t TIMER_WHEEL_SLOTS = 4096;
+    typedef list<pair<uint64_t, BedrockCommand>> TimerSlot;
+    vector<TimerSlot> _timerWheel;
+    uint64_t _timerWheelTick;
+    size_t _timerWheelCount;
+
+    // Commands scheduled beyond the span of the timer wheel, by timestamp. These are the outer level of the wheel,
+    // and are moved into it as they come within its span.
+    multimap<uint64_t, BedrockCommand> _futureCommands;
+
+    // Where a queued command is, so that it can be found by ID without searching. `mapIt` is used for commands in
+    // `_commandQueue` or `_futureCommands`, and `slot` and `slotIt` for commands in the timer wheel.
+    struct CommandLocation {
+        enum Container { READY, WHEEL, FUTURE };
+        Container container;
+        multimap<uint64_t, BedrockCommand>::iterator mapIt;
+        size_t slot;
+        TimerSlot::iterator slotIt;
+
+        // The command at this location.
+        const BedrockCommand* command() const;
+    };
+
+    // Queued commands by ID. Every queued command with an ID is in here, and has to be added or removed whenever it's
+    // added, moved, or removed in the containers above. If two queued commands have the same ID (which shouldn't
+    // happen), only the most recently queued one can be found by ID.
+    map<string, CommandLocation> _commandIndex;
+
+    // Add and remove commands from `_commandIndex`. `_unindex` is a no-op if the index points at a different command
+    // with the same ID, and needs to be called before the command is moved from.
+    void _index(const BedrockCommand& command, const CommandLocation& location);
+    void _unindex(const BedrockCommand& command);
+
+    // How long the last command dequeued at each priority had waited since it was ready, and how many commands are
+    // ready at each priority, for `getRecentWaitUS`.
+    map<int, uint64_t> _recentWaitUS;
+    map<int, size_t> _readyCounts;
+
+    // Fair queuing state, see `setFairQueuing`. When it's enabled, every ready command is kept in `_commandQueue[0]`,
+    // by the virtual time at which its flow's turn to run it starts, rather than by priority and timestamp. Each
+    // command advances its flow's virtual time by `FAIR_QUEUE_COST` divided by the flow's weight, and a flow that's
+    // been idle starts again at the current virtual time (that of the last command dequeued), so it can't save up
+    // turns. Flows that have caught up with the current virtual time are removed when `_flowFinishTimes` gets large.
+    static constexpr uint64_t FAIR_QUEUE_COST = 1 << 20;
+    bool _fair;
+    map<int, uint64_t> _fairWeights;
+    string _fairFlowKey;
+    uint64_t _virtualTime;
+    map<pair<int, string>, uint64_t> _flowFinishTimes;
+    size_t _flowSweepSize;
+
+    // Returns the key `command` is stored under in `_commandQueue`, and its position within that key's queue when it
+    // became ready at `executeTime`, updating its flow's virtual time if we're fair queuing.
+    int _readyQueue(const BedrockCommand& command) const;
+    uint64_t _readyPosition(const BedrockCommand& command, uint64_t executeTime);
+
+    // The total number of commands in all of the above, so that checking the size doesn't require the lock.
+    atomic<size_t> _size;
 };
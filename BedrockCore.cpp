@@ -7,6 +7,280 @@ SQLiteCore(db),
 _server(server)
 { }
 
+// Responses from peeks that plugins have opted in to caching, by `_getPeekCacheKey`, with the least recently used
+// dropped first. Each entry is valid until a commit after the one it was peeked at changes a table the peek read.
+class PeekCache {
+  public:
+    void setSize(size_t entries) {
+        lock_guard<mutex> lock(_cacheMutex);
+        _maxSize = entries;
+        _evict();
+    }
+
+    bool enabled() {
+        return _enabled.load(memory_order_relaxed);
+    }
+
+    // If there's a valid entry for `key`, copies its response into `response` and returns true.
+    bool get(const string& key, const SQLite& db, SData& response) {
+        lock_guard<mutex> lock(_cacheMutex);
+        auto it = _entries.find(key);
+        if (it == _entries.end()) {
+            return false;
+        }
+        if (db.getTablesChangedAt(it->second.tables) > it->second.commitCount) {
+            _lru.erase(it->second.lruIt);
+            _entries.erase(it);
+            return false;
+        }
+        _lru.splice(_lru.begin(), _lru, it->second.lruIt);
+        response = it->second.response;
+        return true;
+    }
+
+    // Stores the response to a command peeked in a snapshot at least as new as `commitCount`, which read `tables`.
+    void put(const string& key, uint64_t commitCount, set<string>&& tables, const SData& response) {
+        lock_guard<mutex> lock(_cacheMutex);
+        if (!_maxSize) {
+            return;
+        }
+        auto it = _entries.find(key);
+        if (it == _entries.end()) {
+            _lru.push_front(key);
+            it = _entries.emplace(key, Entry()).first;
+            it->second.lruIt = _lru.begin();
+        } else {
+            _lru.splice(_lru.begin(), _lru, it->second.lruIt);
+        }
+        it->second.commitCount = commitCount;
+        it->second.tables = move(tables);
+        it->second.response = response;
+        _evict();
+    }
+
+  private:
+    struct Entry {
+        uint64_t commitCount = 0;
+        set<string> tables;
+        SData response;
+        list<string>::iterator lruIt;
+    };
+
+    // Drops the least recently used entries until there are no more than `_maxSize`. Caller holds `_cacheMutex`.
+    void _evict() {
+        while (_entries.size() > _maxSize) {
+            _entries.erase(_lru.back());
+            _lru.pop_back();
+        }
+        _enabled.store(_maxSize > 0);
+    }
+
+    mutex _cacheMutex;
+    map<string, Entry> _entries;
+    list<string> _lru;
+    size_t _maxSize = 0;
+    atomic<bool> _enabled{false};
+};
+static PeekCache _peekCache;
+
+void BedrockCore::setPeekCacheSize(size_t entries) {
+    _peekCache.setSize(entries);
+    if (entries) {
+        // Cached responses are only dropped when a commit changes a table they read, so every write has to be seen.
+        SQLite::enableWriteTracking();
+    }
+}
+
+string BedrockCore::_getPeekCacheKey(const string& pluginName, const SData& request) {
+    // These headers are about how this particular request gets handled, and not what it asks for.
+    static const set<string> ignoredHeaders = {"clientTimeout", "commandExecuteTime", "Connection", "Content-Length",
+                                               "debugID", "minCommitCount", "priority", "requestID", "timeout",
+                                               "_source"};
+    string key = pluginName + "\n" + request.methodLine + "\n";
+    for (const auto& header : request.nameValueMap) {
+        if (!ignoredHeaders.count(header.first)) {
+            key += header.first + ": " + header.second + "\n";
+        }
+    }
+    key += "\n";
+    key += request.content;
+    return key;
+}
+
+// Identical commands being peeked right now, by `_getPeekCacheKey`, for plugins that let us coalesce them. The first
+// one to start peeks it, and any that arrive before it's done, with nothing committed in between, wait for its
+// response rather than peeking it again.
+class PeekFlights {
+  public:
+    struct Flight {
+        // The commit count when the first command started peeking.
+        uint64_t commitCount;
+
+        // Set, along with `response` if the first command completed in peek, once it's done.
+        bool done = false;
+        bool completed = false;
+        SData response;
+    };
+
+    // If there's a flight for `key` that started as of `commitCount`, sets `flight` to it and returns false.
+    // Otherwise, starts a new flight, which the caller leads, sets `flight` to that, and returns true.
+    bool join(const string& key, uint64_t commitCount, shared_ptr<Flight>& flight) {
+        lock_guard<mutex> lock(_flightsMutex);
+        auto it = _flights.find(key);
+        if (it != _flights.end() && it->second->commitCount == commitCount) {
+            flight = it->second;
+            return false;
+        }
+        flight = make_shared<Flight>();
+        flight->commitCount = commitCount;
+        _flights[key] = flight;
+        return true;
+    }
+
+    // Waits until `flight` is done, or until `timeoutMS` have passed. Returns true, with its response in `response`,
+    // if the command leading it completed in peek.
+    bool wait(const shared_ptr<Flight>& flight, uint64_t timeoutMS, SData& response) {
+        unique_lock<mutex> lock(_flightsMutex);
+        _flightDone.wait_for(lock, chrono::milliseconds(timeoutMS), [&]() { return flight->done; });
+        if (flight->completed) {
+            response = flight->response;
+            return true;
+        }
+        return false;
+    }
+
+    // Called by the leader of `flight` when it's done peeking, with its response if it completed. A newer flight may
+    // have taken its place for `key` in the meantime, which is left alone.
+    void finish(const string& key, const shared_ptr<Flight>& flight, const SData* response) {
+        {
+            lock_guard<mutex> lock(_flightsMutex);
+            flight->done = true;
+            if (response) {
+                flight->completed = true;
+                flight->response = *response;
+            }
+            auto it = _flights.find(key);
+            if (it != _flights.end() && it->second == flight) {
+                _flights.erase(it);
+            }
+        }
+        _flightDone.notify_all();
+    }
+
+  private:
+    mutex _flightsMutex;
+    condition_variable _flightDone;
+    map<string, shared_ptr<Flight>> _flights;
+};
+static PeekFlights _peekFlights;
+
+// Finishes the flight a command is leading when it goes out of scope, without a response unless `complete` was called
+// first, so that anyone waiting on it peeks for themselves.
+class AutoFinishFlight {
+  public:
+    AutoFinishFlight(const string& key, shared_ptr<PeekFlights::Flight> flight) :
+        _key(key), _flight(flight), _response(nullptr) { }
+    ~AutoFinishFlight() {
+        if (_flight) {
+            _peekFlights.finish(_key, _flight, _response);
+        }
+    }
+    void complete(const SData& response) {
+        _response = &response;
+    }
+  private:
+    string _key;
+    shared_ptr<PeekFlights::Flight> _flight;
+    const SData* _response;
+};
+
+// The resources `AutoAccount` has charged to each plugin and verb.
+class ResourceAccounts {
+  public:
+    struct Totals {
+        uint64_t calls = 0;
+        uint64_t cpuUS = 0;
+        uint64_t vmSteps = 0;
+        uint64_t pagesRead = 0;
+        uint64_t pagesWritten = 0;
+        uint64_t commitLockUS = 0;
+
+        void add(const Totals& other) {
+            calls += other.calls;
+            cpuUS += other.cpuUS;
+            vmSteps += other.vmSteps;
+            pagesRead += other.pagesRead;
+            pagesWritten += other.pagesWritten;
+            commitLockUS += other.commitLockUS;
+        }
+
+        string toJSON() const {
+            STable json;
+            json["calls"] = calls;
+            json["cpuUS"] = cpuUS;
+            json["vmSteps"] = vmSteps;
+            json["pagesRead"] = pagesRead;
+            json["pagesWritten"] = pagesWritten;
+            json["commitLockUS"] = commitLockUS;
+            return SComposeJSONObject(json);
+        }
+    };
+
+    void charge(const string& plugin, const string& verb, const Totals& used) {
+        lock_guard<mutex> lock(_accountsMutex);
+        _accounts[plugin][verb].add(used);
+    }
+
+    STable get() {
+        lock_guard<mutex> lock(_accountsMutex);
+        STable usage;
+        for (const auto& plugin : _accounts) {
+            Totals pluginTotals;
+            STable verbs;
+            for (const auto& verb : plugin.second) {
+                pluginTotals.add(verb.second);
+                verbs[verb.first] = verb.second.toJSON();
+            }
+            STable pluginUsage = SParseJSONObject(pluginTotals.toJSON());
+            pluginUsage["verbs"] = SComposeJSONObject(verbs);
+            usage[plugin.first] = SComposeJSONObject(pluginUsage);
+        }
+        return usage;
+    }
+
+  private:
+    mutex _accountsMutex;
+    map<string, map<string, Totals>> _accounts;
+};
+static ResourceAccounts _resourceAccounts;
+
+// Returns the CPU time this thread has used, in microseconds.
+static uint64_t _threadCPUTime() {
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec * STIME_US_PER_S + now.tv_nsec / 1000;
+}
+
+BedrockCore::AutoAccount::AutoAccount(SQLite& db, const string& plugin, const string& verb) :
+    _db(db), _plugin(plugin), _verb(verb), _start(db.getResourceUsage()), _startCPU(_threadCPUTime())
+{ }
+
+BedrockCore::AutoAccount::~AutoAccount() {
+    const SQLite::ResourceUsage end = _db.getResourceUsage();
+    ResourceAccounts::Totals used;
+    used.calls = 1;
+    used.cpuUS = _threadCPUTime() - _startCPU;
+    used.vmSteps = end.vmSteps - _start.vmSteps;
+    used.pagesRead = end.pagesRead - _start.pagesRead;
+    used.pagesWritten = end.pagesWritten - _start.pagesWritten;
+    used.commitLockUS = end.commitLockUS - _start.commitLockUS;
+    _resourceAccounts.charge(_plugin, _verb, used);
+}
+
+STable BedrockCore::getResourceUsage() {
+    return _resourceAccounts.get();
+}
+
 // RAII-style mechanism for automatically setting and unsetting query rewriting 
 class AutoScopeRewrite {
   public:
@@ -28,6 +302,24 @@ class AutoScopeRewrite {
     bool (*_handler)(int, const char*, string&);
 };
 
+// RAII-style mechanism for setting a plugin's whitelist while it handles a command.
+class AutoScopeWhitelist {
+  public:
+    AutoScopeWhitelist(const SQLite::Whitelist* whitelist, SQLite& db) : _enable(whitelist), _db(db) {
+        if (_enable) {
+            _db.setWhitelist(whitelist);
+        }
+    }
+    ~AutoScopeWhitelist() {
+        if (_enable) {
+            _db.setWhitelist(nullptr);
+        }
+    }
+  private:
+    bool _enable;
+    SQLite& _db;
+};
+
 bool BedrockCore::peekCommand(BedrockCommand& command) {
     AutoTimer timer(command, BedrockCommand::PEEK);
     // Convenience references to commonly used properties.
@@ -35,6 +327,7 @@ bool BedrockCore::peekCommand(BedrockCommand& command) {
     SData& response = command.response;
     STable& content = command.jsonContent;
     SDEBUG("Peeking at '" << request.methodLine << "' with priority: " << command.priority);
+    SAutoQueryOrigin origin(request.methodLine, request["requestID"]);
     command.peekCount++;
     uint64_t timeout = command.request.isSet("timeout") ? command.request.calc("timeout") : DEFAULT_TIMEOUT;
 
@@ -44,6 +337,50 @@ bool BedrockCore::peekCommand(BedrockCommand& command) {
         timeout /= 1000;
     }
 
+    // If a plugin lets us cache this command, we may already have its response. The cached response is as good as
+    // one peeked now, as nothing it read has changed since, so it gets the current commit count.
+    BedrockPlugin* cachePlugin = nullptr;
+    string cacheKey;
+    if (_peekCache.enabled()) {
+        for (auto plugin : _server.plugins) {
+            if (plugin->shouldCachePeek(command)) {
+                cachePlugin = plugin;
+                cacheKey = _getPeekCacheKey(plugin->getName(), request);
+                break;
+            }
+        }
+        const uint64_t commitCount = cachePlugin ? _db.getCommitCount() : 0;
+        if (cachePlugin && _peekCache.get(cacheKey, _db, response)) {
+            SINFO("Responding '" << response.methodLine << "' to read-only '" << request.methodLine
+                  << "' from the peek cache.");
+            response["commitCount"] = to_string(commitCount);
+            command.complete = true;
+            return true;
+        }
+    }
+
+    // If a plugin lets us coalesce this command, and an identical one is being peeked in the same state of the
+    // database, we wait for its response. Otherwise we lead a new flight that later ones can wait on.
+    string flightKey;
+    for (auto plugin : _server.plugins) {
+        if (plugin->shouldCoalescePeek(command)) {
+            flightKey = _getPeekCacheKey(plugin->getName(), request);
+            break;
+        }
+    }
+    shared_ptr<PeekFlights::Flight> flight;
+    if (!flightKey.empty() && !_peekFlights.join(flightKey, _db.getCommitCount(), flight)) {
+        if (_peekFlights.wait(flight, timeout, response)) {
+            SINFO("Responding '" << response.methodLine << "' to read-only '" << request.methodLine
+                  << "' with the response to an identical command.");
+            command.complete = true;
+            return true;
+        }
+        SINFO("Identical command to '" << request.methodLine << "' didn't finish in peek, peeking ourselves.");
+        flight = nullptr;
+    }
+    AutoFinishFlight flightFinisher(flightKey, flight);
+
     // We catch any exception and handle in `_handleCommandException`.
     try {
         _db.startTiming(timeout * 1000);
@@ -51,10 +388,15 @@ bool BedrockCore::peekCommand(BedrockCommand& command) {
         // through process. This allows for consistency through this two-phase process. I.e., anything checked in
         // peek is guaranteed to still be valid in process, because they're done together as one transaction.
         bool pluginPeeked = false;
+        BedrockPlugin* peekedBy = nullptr;
 
         // Some plugins want to alert timeout errors themselves, and make them silent on bedrock.
         bool shouldSuppressTimeoutWarnings = false;
 
+        // Anything we cache is valid as of at least this commit, as the transaction's snapshot can't be older.
+        const uint64_t cacheCommitCount = _db.getCommitCount();
+        set<string> cacheTables;
+
         try {
             if (!_db.beginConcurrentTransaction()) {
                 STHROW("501 Failed to begin concurrent transaction");
@@ -64,17 +406,27 @@ bool BedrockCore::peekCommand(BedrockCommand& command) {
             _db.read("PRAGMA query_only = true;");
 
             // Try each plugin, and go with the first one that says it succeeded.
+            if (cachePlugin) {
+                _db.startReadTracking();
+            }
             for (auto plugin : _server.plugins) {
                 shouldSuppressTimeoutWarnings = plugin->shouldSuppressTimeoutWarnings();
 
                 // Try to peek the command.
+                AutoScopeWhitelist whitelist(plugin->getQueryWhitelist(command), _db);
+                AutoAccount account(_db, plugin->getName(), request.getVerb());
                 if (plugin->peekCommand(_db, command)) {
                     SINFO("Plugin '" << plugin->getName() << "' peeked command '" << request.methodLine << "'");
                     pluginPeeked = true;
+                    peekedBy = plugin;
                     break;
                 }
             }
+            if (cachePlugin) {
+                cacheTables = _db.stopReadTracking();
+            }
         } catch (const SQLite::timeout_error& e) {
+            _db.stopReadTracking();
             if (!shouldSuppressTimeoutWarnings) {
                 SALERT("Command " << command.request.methodLine << " timed out after " << e.time()/1000 << "ms.");
             }
@@ -113,10 +465,17 @@ bool BedrockCore::peekCommand(BedrockCommand& command) {
                 response.content = newContent;
             }
         }
+
+        // Only the plugin that opted in to caching this command knows that its response can be cached.
+        if (cachePlugin && peekedBy == cachePlugin && command.httpsRequests.empty()) {
+            _peekCache.put(cacheKey, cacheCommitCount, move(cacheTables), response);
+        }
     } catch (const SException& e) {
+        _db.stopReadTracking();
         _db.read("PRAGMA query_only = false;");
         _handleCommandException(command, e);
     } catch (...) {
+        _db.stopReadTracking();
         _db.read("PRAGMA query_only = false;");
         SALERT("Unhandled exception typename: " << SGetCurrentExceptionName() << ", command: " << request.methodLine);
         command.response.methodLine = "500 Unhandled Exception";
@@ -124,6 +483,7 @@ bool BedrockCore::peekCommand(BedrockCommand& command) {
 
     // If we get here, it means the command is fully completed.
     command.complete = true;
+    flightFinisher.complete(response);
 
     // Back out of the current transaction, it doesn't need to do anything.
     _db.rollback();
@@ -141,6 +501,7 @@ bool BedrockCore::processCommand(BedrockCommand& command) {
     SData& response = command.response;
     STable& content = command.jsonContent;
     SDEBUG("Processing '" << request.methodLine << "'");
+    SAutoQueryOrigin origin(request.methodLine, request["requestID"]);
     command.processCount++;
     uint64_t timeout = command.request.isSet("timeout") ? command.request.calc("timeout") : DEFAULT_TIMEOUT;
 
@@ -172,10 +533,13 @@ bool BedrockCore::processCommand(BedrockCommand& command) {
             bool (*handler)(int, const char*, string&) = nullptr;
             bool enable = plugin->shouldEnableQueryRewriting(_db, command, &handler);
             AutoScopeRewrite rewrite(enable, _db, handler);
+            AutoScopeWhitelist whitelist(plugin->getQueryWhitelist(command), _db);
             try {
+                AutoAccount account(_db, plugin->getName(), request.getVerb());
                 if (plugin->processCommand(_db, command)) {
                     SINFO("Plugin '" << plugin->getName() << "' processed command '" << request.methodLine << "'");
                     pluginProcessed = true;
+                    command.processedBy = plugin->getName();
                     break;
                 }
             } catch (const SQLite::timeout_error& e) {
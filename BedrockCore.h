@@ -14,7 +14,7 @@ class BedrockCore : public SQLiteCore {
         AutoTimer(BedrockCommand& command, BedrockCommand::TIMING_INFO type) :
         _command(command), _type(type), _start(STimeNow()) { }
         ~AutoTimer() {
-            _command.timingInfo.emplace_back(make_tuple(_type, _start, STimeNow()));
+            _command.addTiming(_type, _start, STimeNow());
         }
       private:
         BedrockCommand& _command;
@@ -22,6 +22,26 @@ class BedrockCore : public SQLiteCore {
         uint64_t _start;
     };
 
+    // Charges the work done during its lifespan to `plugin` and `verb`: the CPU time used by this thread, and the VM
+    // steps, pages read and written, and commit lock hold time that `db.getResourceUsage` reports.
+    class AutoAccount {
+      public:
+        AutoAccount(SQLite& db, const string& plugin, const string& verb);
+        ~AutoAccount();
+      private:
+        SQLite& _db;
+        string _plugin;
+        string _verb;
+        SQLite::ResourceUsage _start;
+        uint64_t _startCPU;
+    };
+
+    // Returns what's been charged to each plugin by `AutoAccount`: each plugin's totals, and the same for each verb
+    // it's handled (as `verbs`), with the number of `calls`, `cpuUS`, `vmSteps`, `pagesRead`, `pagesWritten`, and
+    // `commitLockUS`. Each plugin's `peekCommand` and `processCommand` calls are charged, whether or not it handles
+    // the command, as is committing each command to the plugin that processed it.
+    static STable getResourceUsage();
+
     // Peek lets you pre-process a command. It will be called on each command before `process` is called on the same
     // command, and it *may be called multiple times*. Preventing duplicate actions on calling peek multiple times is
     // up to the implementer, and may happen *across multiple servers*. I.e., a slave server may call `peek`, and on
@@ -43,7 +63,17 @@ class BedrockCore : public SQLiteCore {
     // this command *will be passed to process again in the future to retry*.
     bool processCommand(BedrockCommand& command);
 
+    // Sets how many peeked responses to keep for commands that a plugin opts in to caching with
+    // `BedrockPlugin::shouldCachePeek`. The cache is shared by every BedrockCore in the process. 0, the default,
+    // disables it.
+    static void setPeekCacheSize(size_t entries);
+
   private:
+    // Returns the key for `request` in the peek cache, which is also what makes two in-flight commands identical for
+    // coalescing (see `BedrockPlugin::shouldCoalescePeek`): the plugin's name, the method line, every header except
+    // those that differ between otherwise identical requests (i.e., `requestID`), and the content.
+    static string _getPeekCacheKey(const string& pluginName, const SData& request);
+
     // When called in the context of handling an exception, returns the demangled (if possible) name of the exception.
     string _getExceptionName();
     void _handleCommandException(BedrockCommand& command, const SException& e);
@@ -48,6 +48,10 @@ bool BedrockPlugin::shouldEnableQueryRewriting(const SQLite& db, const BedrockCo
     return false;
 }
 
+const SQLite::Whitelist* BedrockPlugin::getQueryWhitelist(const BedrockCommand& command) {
+    return nullptr;
+}
+
 STable BedrockPlugin::getInfo() {
     return STable();
 }
@@ -66,6 +70,10 @@ bool BedrockPlugin::processCommand(SQLite& db, BedrockCommand& command) {
     return false;
 }
 
+bool BedrockPlugin::holdCommand(BedrockCommand& command) {
+    return false;
+}
+
 bool BedrockPlugin::shouldSuppressTimeoutWarnings() {
     return false;
 }
@@ -51,16 +51,27 @@ class BedrockPlugin {
     // with any changes to the DB made by this plugin.
     virtual bool processCommand(SQLite& db, BedrockCommand& command);
 
+    // If `peekCommand` returns false after setting the request's `HeldBy` header to this plugin's name (optionally
+    // followed by ':' and anything else), the command is offered to the plugin here instead of being processed. If
+    // the plugin returns true, it has taken the command, which it will hand back with `BedrockServer::acceptCommand`
+    // when it's ready to be peeked again (or completed, to be replied to). Returning false processes it as usual.
+    virtual bool holdCommand(BedrockCommand& command);
+
     // Bedrock will call this before each or `processCommand` (note: not `peekCommand`) for each plugin to allow it to
     // enable query rewriting. If a plugin would like to enable query rewriting, this should return true, and it should
     // set the rewriteHandler it would like to use.
     virtual bool shouldEnableQueryRewriting(const SQLite& db, const BedrockCommand& command, bool (**rewriteHandler)(int, const char*, string&));
 
+    // Bedrock will call this before each `peekCommand` and `processCommand` for each plugin to allow it to restrict the
+    // command to reading only the tables and columns in a whitelist (see `SQLite::setWhitelist`). If it wants to, it
+    // should return a whitelist it built ahead of time, as it's used as-is, rather than checking each query itself.
+    virtual const SQLite::Whitelist* getQueryWhitelist(const BedrockCommand& command);
+
     // Called at some point during initiation to allow the plugin to verify/change the database schema.
     virtual void upgradeDatabase(SQLite& db);
 
-    // A list of SHTTPSManagers that the plugin would like the server to watch for activity. It is only guaranteed to
-    // be safe to modify this list during `initialize`.
+    // A list of SHTTPSManagers that the plugin would like the server to watch for activity. They're polled on the
+    // server's HTTPS thread. It is only guaranteed to be safe to modify this list during `initialize`.
     list<SHTTPSManager*> httpsManagers;
 
     // The plugin can register any number of timers it wants. When any of them `ding`, then the `timerFired`
@@ -84,6 +95,27 @@ class BedrockPlugin {
     // s        Optional socket from which this request was received
     virtual void onPortRequestComplete(const BedrockCommand& command, STCPManager::Socket* s) { }
 
+    // Called when a socket accepted on this plugin's port is closed, so the plugin can drop anything it was keeping
+    // for that connection.
+    virtual void onPortClose(STCPManager::Socket* s) { }
+
+    // Returns read-only queries for the data this plugin expects to need first if this node becomes master. With
+    // `-warmUpInterval`, idle workers on a node that isn't master run these every so often, so their page caches are
+    // already warm when it's promoted. This is called from worker threads, so it needs to be thread-safe.
+    virtual list<string> getWarmUpQueries() { return {}; }
+
+    // Called before peeking a command when the server has a peek cache (`-peekCacheSize`). Returning true lets the
+    // response from this plugin's `peekCommand` be cached, and given to later commands with the same verb and
+    // parameters without peeking them, until a commit changes one of the tables that peek read. Only opt in commands
+    // whose peek depends on nothing but the database: not the time, and not state kept by the plugin.
+    virtual bool shouldCachePeek(const BedrockCommand& command) { return false; }
+
+    // Called before peeking a command. Returning true lets a command that's identical to one being peeked right now
+    // (with the same verb and parameters, and nothing committed since the other started) wait for that one's response
+    // instead of being peeked itself. Unlike `shouldCachePeek`, this only shares a response between commands that
+    // were in flight at the same time, so it suits any read whose peek has nothing to do for the later ones.
+    virtual bool shouldCoalescePeek(const BedrockCommand& command) { return false; }
+
     // Set to true if we don't want to log timeout alerts, and let the caller deal with it.
     virtual bool shouldSuppressTimeoutWarnings();
 
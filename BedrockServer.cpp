@@ -7,6 +7,7 @@
 
 set<string>BedrockServer::_blacklistedParallelCommands;
 recursive_mutex BedrockServer::_blacklistedParallelCommandMutex;
+constexpr uint64_t BedrockServer::MAX_PIPELINED_REQUESTS;
 
 void BedrockServer::acceptCommand(SQLiteCommand&& command, bool isNew) {
     // If the sync node tells us that a command causes a crash, we immediately save that.
@@ -18,40 +19,17 @@ void BedrockServer::acceptCommand(SQLiteCommand&& command, bool isNew) {
         unique_lock<decltype(_crashCommandMutex)> lock(_crashCommandMutex);
 
         // Add the blacklisted command to the map.
-        _crashCommands[request.methodLine].insert(request.nameValueMap);
+        if (_crashCommands[request.methodLine].insert(request.nameValueMap).second) {
+            _addCrashMatcher(request.methodLine, request.nameValueMap);
+        }
+        _hasCrashCommands = true;
         size_t totalCount = 0;
         for (const auto& s : _crashCommands) {
             totalCount += s.second.size();
         }
         SALERT("Blacklisting command (now have " << totalCount << " blacklisted commands): " << request.serialize());
     } else {
-        if (SIEquals(command.request.methodLine, "BROADCAST_COMMAND")) {
-            SData newRequest;
-            newRequest.deserialize(command.request.content);
-            command.request = newRequest;
-            command.initiatingClientID = -1;
-            command.initiatingPeerID = 0;
-        }
-        // Add a request ID if one was missing.
-        _addRequestID(command.request);
-        SAUTOPREFIX(command.request["requestID"]);
-        if (command.writeConsistency != SQLiteNode::QUORUM
-            && _syncCommands.find(command.request.methodLine) != _syncCommands.end()) {
-
-            command.writeConsistency = SQLiteNode::QUORUM;
-            SINFO("Forcing QUORUM consistency for command " << command.request.methodLine);
-        }
-        SINFO("Queued new '" << command.request.methodLine << "' command from bedrock node, with " << _commandQueue.size()
-              << " commands already queued.");
-
-        auto it = command.request.nameValueMap.find("Connection");
-        if (it != command.request.nameValueMap.end() && SIEquals(it->second, "forget")) {
-            // Forgotten commands are always "new". This is because when we escalate one of these commands, we assume
-            // we'll never see a response to it, so we no longer consider it a command in progress. However, if master
-            // is standing down when this happens, the command will be returned to BedrockServer to be re-queued later
-            // on, and we need to make sure we don't double-decrement the _commandsInProgress counter.
-            isNew = true;
-        }
+        isNew = _prepareAcceptedCommand(command, isNew);
         _commandQueue.push(BedrockCommand(move(command)));
         if (!isNew) {
             // If the command isn't new, then we already think it's in progress, but it's been returned to us, so reset
@@ -61,6 +39,54 @@ void BedrockServer::acceptCommand(SQLiteCommand&& command, bool isNew) {
     }
 }
 
+void BedrockServer::acceptCommands(list<SQLiteCommand>&& commands, bool isNew) {
+    list<BedrockCommand> queued;
+    int returned = 0;
+    for (auto& command : commands) {
+        if (SIEquals(command.request.methodLine, "CRASH_COMMAND")) {
+            acceptCommand(move(command), isNew);
+            continue;
+        }
+        if (!_prepareAcceptedCommand(command, isNew)) {
+            returned++;
+        }
+        queued.emplace_back(move(command));
+    }
+    _commandQueue.push(move(queued));
+    _commandsInProgress -= returned;
+}
+
+bool BedrockServer::_prepareAcceptedCommand(SQLiteCommand& command, bool isNew) {
+    if (SIEquals(command.request.methodLine, "BROADCAST_COMMAND")) {
+        SData newRequest;
+        newRequest.deserialize(command.request.content);
+        command.request = newRequest;
+        command.initiatingClientID = -1;
+        command.initiatingPeerID = 0;
+    }
+    // Add a request ID if one was missing.
+    _addRequestID(command.request);
+    SAUTOPREFIX(command.request["requestID"]);
+    if (command.writeConsistency != SQLiteNode::QUORUM
+        && _syncCommands.find(command.request.methodLine) != _syncCommands.end()) {
+
+        command.writeConsistency = SQLiteNode::QUORUM;
+        SINFO("Forcing QUORUM consistency for command " << command.request.methodLine);
+    }
+    SINFO("Queued new '" << command.request.methodLine << "' command from bedrock node, with " << _commandQueue.size()
+          << " commands already queued.");
+
+    auto it = command.request.nameValueMap.find("Connection");
+    if (it != command.request.nameValueMap.end() && SIEquals(it->second, "forget")) {
+        // Forgotten commands are always "new". This is because when we escalate one of these commands, we assume
+        // we'll never see a response to it, so we no longer consider it a command in progress. However, if master
+        // is standing down when this happens, the command will be returned to BedrockServer to be re-queued later
+        // on, and we need to make sure we don't double-decrement the _commandsInProgress counter.
+        isNew = true;
+    }
+    return isNew;
+}
+
 void BedrockServer::cancelCommand(const string& commandID) {
     _commandQueue.removeByID(commandID);
 }
@@ -85,6 +111,9 @@ void BedrockServer::syncWrapper(SData& args,
 {
     // Initialize the thread.
     SInitialize(_syncThreadName);
+    if (args.isSet("-syncCPUs")) {
+        SSetThreadAffinity(args["-syncCPUs"]);
+    }
 
     while(true) {
         // If the server's set to be detached, we wait until that flag is unset, and then start the sync thread.
@@ -129,8 +158,23 @@ void BedrockServer::sync(SData& args,
     // If still no value, use the number of cores on the machine, if available.
     workerThreads = workerThreads ? workerThreads : max(1u, thread::hardware_concurrency());
 
+    // Slaves can apply transactions from master on threads of their own, which get the journal tables after the
+    // workers'.
+    int applyThreads = max(0, args.calc("-slaveApplyThreads"));
+
     // Initialize the DB.
-    SQLite db(args["-db"], args.calc("-cacheSize"), true, args.calc("-maxJournalSize"), -1, workerThreads - 1, args["-synchronous"]);
+    const int cacheSize = _getCacheSizePerHandle(args, workerThreads);
+    const int64_t mmapSize = args.calc64("-mmapSize") * 1024 * 1024;
+    SQLite db(args["-db"], cacheSize, true, args.calc("-maxJournalSize"), -1,
+              workerThreads + applyThreads - 1, args["-synchronous"]);
+    if (mmapSize) {
+        db.setMmapSize(mmapSize);
+    }
+
+    // Whichever thread commits, commands waiting for that commit can run now.
+    db.setCommitCountListener([&server](uint64_t commitCount) {
+        server._requeueFutureCommitCommands(commitCount);
+    });
 
     // And the command processor.
     BedrockCore core(db, server);
@@ -142,15 +186,43 @@ void BedrockServer::sync(SData& args,
     server._syncNode = make_shared<SQLiteNode>(server, db, args["-nodeName"], args["-nodeHost"],
                                                args["-peerList"], args.calc("-priority"), firstTimeout,
                                                server._version, args.calc("-quorumCheckpoint"));
+    server._syncNode->setEscalatedLimits(server._maxEscalatedCount, server._maxEscalatedBytes,
+                                         server._expireHeldCommands);
+    server._syncNode->setEscalationTimeout(args.calcU64("-escalationTimeout") * STIME_US_PER_MS);
+    if (args.isSet("-fastFailover")) {
+        server._syncNode->enableFastFailover();
+    }
+    if (args.isSet("-changesetReplication")) {
+        server._syncNode->enableChangesetReplication();
+    }
+    if (args.isSet("-replicateFrom")) {
+        server._syncNode->setUpstreamPeer(args["-replicateFrom"]);
+    }
+    if (applyThreads) {
+        server._syncNode->enableParallelApply(args["-db"], cacheSize, args.calc("-maxJournalSize"),
+                                              workerThreads, applyThreads, args["-synchronous"], mmapSize);
+    }
 
     // We keep a queue of completed commands that workers will insert into when they've successfully finished a command
     // that just needs to be returned to a peer.
     CommandQueue completedCommands;
 
+    // Workers put commands they've committed that need ONE or QUORUM consistency here. We move them into
+    // `unacknowledgedCommands`, ordered by commit count, until enough peers have acknowledged them to respond.
+    CommandQueue unacknowledgedCommandQueue;
+    multimap<uint64_t, BedrockCommand> unacknowledgedCommands;
+
     // The node is now coming up, and should eventually end up in a `MASTERING` or `SLAVING` state. We can start adding
     // our worker threads now. We don't wait until the node is `MASTERING` or `SLAVING`, as it's state can change while
     // it's running, and our workers will have to maintain awareness of that state anyway.
-    SINFO("Starting " << workerThreads << " worker threads.");
+    server._maxWorkerThreads = workerThreads;
+    server._minWorkerThreads = args.isSet("-minWorkerThreads") ? max(1, min(args.calc("-minWorkerThreads"), workerThreads))
+                                                                : workerThreads;
+    server._activeWorkerThreads = server._minWorkerThreads;
+    server._workerPoolScaledAt = STimeNow();
+    server._workerPoolCommands = server._workerCommandCount.load();
+    server._workerPoolConflicts = SQLite::commitConflicts.load();
+    SINFO("Starting " << workerThreads << " worker threads, " << server._minWorkerThreads << " active.");
     list<thread> workerThreadList;
     for (int threadId = 0; threadId < workerThreads; threadId++) {
         workerThreadList.emplace_back(worker,
@@ -160,6 +232,7 @@ void BedrockServer::sync(SData& args,
                                       ref(masterVersion),
                                       ref(syncNodeQueuedCommands),
                                       ref(completedCommands),
+                                      ref(unacknowledgedCommandQueue),
                                       ref(server),
                                       threadId,
                                       workerThreads);
@@ -170,42 +243,34 @@ void BedrockServer::sync(SData& args,
     BedrockCommand command;
     bool committingCommand = false;
 
-    // We hold a lock here around all operations on `syncNode`, because `SQLiteNode` isn't thread-safe, but we need
-    // `BedrockServer` to be able to introspect it in `Status` requests. We hold this lock at all times until exiting
-    // our main loop, aside from when we're waiting on `poll`. Strictly, we could hold this lock less often, but there
-    // are not that many status commands coming in, and they can wait for a fraction of a second, which lets us keep
-    // the logic of this loop simpler.
+    // Charges the resources used committing `command` to the plugin that processed it, once the commit is done.
+    unique_ptr<BedrockCore::AutoAccount> commitAccount;
+
+    // Set once we've limited how long escalated commands can wait after we've started shutting down.
+    bool escalationsLimited = false;
+
+    // We hold a lock here around all operations on `syncNode`, because `SQLiteNode` isn't thread-safe, but other
+    // threads (like `broadcastCommand`) occasionally need to use it. We hold this lock at all times until exiting our
+    // main loop, aside from when we're waiting on `poll`. `Status` doesn't need it, as it reads what we publish with
+    // `_publishSyncStatus` instead.
     server._syncMutex.lock();
     do {
 
         // Make sure the existing command prefix is still valid since they're reset when SAUTOPREFIX goes out of scope.
         SAUTOPREFIX(command.request["requestID"]);
 
-        // If there were commands waiting on our commit count to come up-to-date, we'll move them back to the main
-        // command queue here. There's no place in particular that's best to do this, so we do it at the top of this
-        // main loop, as that prevents it from ever getting skipped in the event that we `continue` early from a loop
-        // iteration.
-        // We also move all commands back to the main queue here if we're shutting down, just to make sure they don't
-        // end up lost in the ether.
-        {
-            SAUTOLOCK(server._futureCommitCommandMutex);
-            if (!server._futureCommitCommands.empty()) {
-                uint64_t commitCount = db.getCommitCount();
-                auto it = server._futureCommitCommands.begin();
-                auto& eraseTo = it;
-                while (it != server._futureCommitCommands.end() && (it->first <= commitCount || server._shutdownState.load() != RUNNING)) {
-                    SINFO("Returning command (" << it->second.request.methodLine << ") waiting on commit " << it->first
-                          << " to queue, now have commit " << commitCount);
-                    server._commandQueue.push(move(it->second));
-                    server._commandsInProgress--;
+        // Commands waiting on our commit count to come up-to-date are moved back to the main command queue as soon as
+        // the commit they're waiting for lands. We also check here, at the top of this main loop, to move all of them
+        // back to the main queue if we're shutting down, just to make sure they don't end up lost in the ether.
+        server._requeueFutureCommitCommands(db.getCommitCount());
 
-                    eraseTo = it;
-                    it++;
-                }
-                if (eraseTo != server._futureCommitCommands.begin()) {
-                    server._futureCommitCommands.erase(server._futureCommitCommands.begin(), eraseTo);
-                }
-            }
+        // Once we've started shutting down, nothing we've escalated can wait longer than we have left to answer our
+        // clients, less what the sync node gets to shut down, so a slow master can't run out our shutdown timeout.
+        if (!escalationsLimited && server._shutdownState.load() != RUNNING) {
+            int64_t timeAllowed = server._gracefulShutdownTimeout.alarmDuration.load() - server._gracefulShutdownTimeout.elapsed();
+            timeAllowed -= ESCALATION_SHUTDOWN_MARGIN_US;
+            server._syncNode->expireEscalationsBy(STimeNow() + max(timeAllowed, 0l));
+            escalationsLimited = true;
         }
 
         // If we're in a state where we can initialize shutdown, then go ahead and do so.
@@ -225,15 +290,13 @@ void BedrockServer::sync(SData& args,
         // activity. Once any of them has activity (or the timeout ends), poll will return.
         fd_map fdm;
 
-        // Prepare our plugins for `poll` (for instance, in case they're making HTTP requests).
-        server._prePollPlugins(fdm);
-
         // Pre-process any sockets the sync node is managing (i.e., communication with peer nodes).
         server._syncNode->prePoll(fdm);
 
         // Add our command queues to our fd_map.
         syncNodeQueuedCommands.prePoll(fdm);
         completedCommands.prePoll(fdm);
+        unacknowledgedCommandQueue.prePoll(fdm);
 
         // Wait for activity on any of those FDs, up to a timeout.
         const uint64_t now = STimeNow();
@@ -251,11 +314,10 @@ void BedrockServer::sync(SData& args,
         {
             SAUTOPREFIX("xxxxxx");
 
-            // Process any activity in our plugins.
-            server._postPollPlugins(fdm, nextActivity);
             server._syncNode->postPoll(fdm, nextActivity);
             syncNodeQueuedCommands.postPoll(fdm);
             completedCommands.postPoll(fdm);
+            unacknowledgedCommandQueue.postPoll(fdm);
         }
 
         // Ok, let the sync node to it's updating for as many iterations as it requires. We'll update the replication
@@ -265,11 +327,59 @@ void BedrockServer::sync(SData& args,
         SQLiteNode::State nodeState = server._syncNode->getState();
         replicationState.store(nodeState);
         masterVersion.store(server._syncNode->getMasterVersion());
+        if (nodeState != preUpdateState || STimeNow() >= server._syncStatusPublished + STATUS_PUBLISH_INTERVAL_US) {
+            server._publishSyncStatus(server._syncNode.get());
+        }
+
+        // Respond to any commands committed by workers that enough peers have now acknowledged. If we've stopped
+        // mastering, we're not going to hear any more acknowledgements, and there's no way of knowing whether these
+        // made it to the rest of the cluster, so we say so.
+        try {
+            while (true) {
+                BedrockCommand unacknowledgedCommand = unacknowledgedCommandQueue.pop();
+                const uint64_t commitCount = SToUInt64(unacknowledgedCommand.response["commitCount"]);
+                unacknowledgedCommands.emplace(commitCount, move(unacknowledgedCommand));
+            }
+        } catch (const out_of_range& e) {
+            // when unacknowledgedCommandQueue.pop() throws for running out of commands, we fall out of the loop.
+        }
+        if (!unacknowledgedCommands.empty()) {
+            const bool mastering = nodeState == SQLiteNode::MASTERING || nodeState == SQLiteNode::STANDINGDOWN;
+            const uint64_t acknowledgedOne = server._syncNode->getAcknowledgedCommitCount(SQLiteNode::ONE);
+            const uint64_t acknowledgedQuorum = server._syncNode->getAcknowledgedCommitCount(SQLiteNode::QUORUM);
+            for (auto it = unacknowledgedCommands.begin(); it != unacknowledgedCommands.end();) {
+                BedrockCommand& unacknowledgedCommand = it->second;
+                SAUTOPREFIX(unacknowledgedCommand.request["requestID"]);
+                if (mastering) {
+                    const uint64_t acknowledged = unacknowledgedCommand.writeConsistency == SQLiteNode::ONE ?
+                                                  acknowledgedOne : acknowledgedQuorum;
+                    if (it->first > acknowledged) {
+                        it++;
+                        continue;
+                    }
+                    SINFO("[performance] Peers acknowledged commit " << it->first << " for worker command "
+                          << unacknowledgedCommand.request.methodLine << ", responding.");
+                } else {
+                    SWARN("Stopped mastering before peers acknowledged commit " << it->first << " for "
+                          << unacknowledgedCommand.request.methodLine << ", responding unconfirmed.");
+                    unacknowledgedCommand.response.methodLine = "500 Unconfirmed commit";
+                }
+                SQLiteNode::acknowledgementsRequested--;
+                if (unacknowledgedCommand.initiatingPeerID) {
+                    server._finishPeerCommand(unacknowledgedCommand);
+                } else {
+                    server._reply(unacknowledgedCommand);
+                }
+                it = unacknowledgedCommands.erase(it);
+            }
+        }
 
         // If anything was in the stand down queue, move it back to the main queue.
         if (nodeState != SQLiteNode::STANDINGDOWN) {
             while (server._standDownQueue.size()) {
-                server._commandQueue.push(server._standDownQueue.pop());
+                BedrockCommand command = server._standDownQueue.pop();
+                server._standDownHold.remove(command);
+                server._commandQueue.push(move(command));
             }
         } else if (preUpdateState != SQLiteNode::STANDINGDOWN) {
             // Otherwise,if we just started standing down, discard any commands that had been scheduled in the future.
@@ -338,8 +448,9 @@ void BedrockServer::sync(SData& args,
         // If we started a commit, and one's not in progress, then we've finished it and we'll take that command and
         // stick it back in the appropriate queue.
         if (committingCommand && !server._syncNode->commitInProgress()) {
-            // Record the time spent.
+            // Record the time spent, and the resources used.
             command.stopTiming(BedrockCommand::COMMIT_SYNC);
+            commitAccount.reset();
 
             // We're done with the commit, we unlock our mutex and decrement our counter.
             server._syncThreadCommitMutex.unlock();
@@ -419,6 +530,11 @@ void BedrockServer::sync(SData& args,
                 server._syncNode->broadcast(_generateCrashMessage(&command));
             });
 
+            // Don't peek, process, or escalate a command nobody's waiting for any more.
+            if (server._discardIfAbandoned(command)) {
+                continue;
+            }
+
             // And now we'll decide how to handle it.
             if (nodeState == SQLiteNode::MASTERING || nodeState == SQLiteNode::STANDINGDOWN) {
 
@@ -475,7 +591,9 @@ void BedrockServer::sync(SData& args,
                     SINFO("[performance] Sync thread beginning committing command " << command.request.methodLine);
                     // START TIMING.
                     command.startTiming(BedrockCommand::COMMIT_SYNC);
-                    server._syncNode->startCommit(command.writeConsistency);
+                    commitAccount = make_unique<BedrockCore::AutoAccount>(db, command.processedBy,
+                                                                          command.request.getVerb());
+                    server._syncNode->startCommit(command.writeConsistency, command.request["traceID"]);
 
                     // And we'll start the next main loop.
                     // NOTE: This will cause us to read from the network again. This, in theory, is fine, but we saw
@@ -567,6 +685,8 @@ void BedrockServer::sync(SData& args,
     // Release our handle to this pointer. Any other functions that are still using it will keep the object alive
     // until they return.
     server._syncNode = nullptr;
+    server._publishSyncStatus(nullptr);
+    db.setCommitCountListener(nullptr);
 
     // We're really done, store our flag so main() can be aware.
     server._syncThreadComplete.store(true);
@@ -578,20 +698,66 @@ void BedrockServer::worker(SData& args,
                            atomic<string>& masterVersion,
                            CommandQueue& syncNodeQueuedCommands,
                            CommandQueue& syncNodeCompletedCommands,
+                           CommandQueue& syncNodeUnacknowledgedCommands,
                            BedrockServer& server,
                            int threadId,
                            int threadCount)
 {
     SInitialize("worker" + to_string(threadId));
-    SQLite db(args["-db"], args.calc("-cacheSize"), false, args.calc("-maxJournalSize"), threadId, threadCount - 1, args["-synchronous"]);
-    BedrockCore core(db, server);
+    if (args.isSet("-workerCPUs")) {
+        SSetThreadAffinity(args["-workerCPUs"]);
+    }
 
+    // Workers that aren't part of the active pool don't keep a DB handle open. Each time this one is needed, it opens
+    // one, and closes it again when it's parked.
+    while (server._waitForWorkerSlot(threadId)) {
+        SQLite db(args["-db"], _getCacheSizePerHandle(args, threadCount), false, args.calc("-maxJournalSize"),
+                  threadId, threadCount - 1, args["-synchronous"]);
+        if (args.calc64("-mmapSize")) {
+            db.setMmapSize(args.calc64("-mmapSize") * 1024 * 1024);
+        }
+        if (args.calcU64("-groupCommitWindow")) {
+            // Worker commits share WAL syncs rather than each doing their own. The sync thread's commits don't wait.
+            db.enableGroupCommit(args.calcU64("-groupCommitWindow"));
+        }
+        BedrockCore core(db, server);
+        if (!_workerLoop(args, replicationState, upgradeInProgress, masterVersion, syncNodeQueuedCommands,
+                         syncNodeCompletedCommands, syncNodeUnacknowledgedCommands, server, threadId, db, core)) {
+            return;
+        }
+        SINFO("Parking worker, " << server._activeWorkerThreads.load() << " workers active.");
+    }
+}
+
+bool BedrockServer::_workerLoop(SData& args,
+                                atomic<SQLiteNode::State>& replicationState,
+                                atomic<bool>& upgradeInProgress,
+                                atomic<string>& masterVersion,
+                                CommandQueue& syncNodeQueuedCommands,
+                                CommandQueue& syncNodeCompletedCommands,
+                                CommandQueue& syncNodeUnacknowledgedCommands,
+                                BedrockServer& server,
+                                int threadId,
+                                SQLite& db,
+                                BedrockCore& core)
+{
     // Command to work on. This default command is replaced when we find work to do.
     BedrockCommand command;
 
+    // When we last warmed up our page cache, see `_warmUpCache`.
+    uint64_t lastWarmUp = 0;
+
     // We just run this loop looking for commands to process forever. There's a check for appropriate exit conditions
     // at the bottom, which will cause our loop and thus this thread to exit when that becomes true.
     while (true) {
+        // The first worker is always active, and sizes the pool for the rest. If this one's no longer needed, it's
+        // parked between commands.
+        if (threadId == 0) {
+            server._scaleWorkerPool();
+        } else if (threadId >= server._activeWorkerThreads.load()) {
+            return true;
+        }
+
         try {
             // Set a signal handler function that we can call even if we die early with no command.
             SSetSignalHandlerDieFunc([&](){
@@ -603,6 +769,7 @@ void BedrockServer::worker(SData& args,
             // this, as it can spend up to a second finding out that there is no command to dequeue, which makes our
             // count wrong while we wait.
             command = server._commandQueue.getSynchronized(1000000, server._commandsInProgress);
+            server._workerCommandCount++;
 
             SAUTOPREFIX(command.request["requestID"]);
             SINFO("[performance] Dequeued command " << command.request.methodLine << " in worker, "
@@ -636,6 +803,22 @@ void BedrockServer::worker(SData& args,
                 continue;
             }
 
+            // If the slave that escalated this has already given up on it, there's no point running it.
+            if (command.initiatingPeerID && command.deadline && STimeNow() >= command.deadline) {
+                SINFO("Discarding escalated command '" << command.request.methodLine << "', its deadline passed while "
+                      << "it was queued.");
+                command.response.methodLine = "555 Timeout waiting for master";
+                command.complete = true;
+                syncNodeCompletedCommands.push(move(command));
+                continue;
+            }
+
+            // Likewise, if the client that sent this has disconnected or given up on it, it's not worth running. This
+            // is also where commands that were waiting for a future commit are checked, as they come back through here.
+            if (server._discardIfAbandoned(command)) {
+                continue;
+            }
+
             // If this was a command initiated by a peer as part of a cluster operation, then we process it separately
             // and respond immediately. This allows SQLiteNode to offload read-only operations to worker threads.
             if (SQLiteNode::peekPeerCommand(server._syncNode.get(), db, command)) {
@@ -655,7 +838,7 @@ void BedrockServer::worker(SData& args,
                     SWARN("Sync thread shut down while were waiting for it to come up. Discarding command '"
                           << command.request.methodLine << "'.");
                     server._commandsInProgress--;
-                    return;
+                    return false;
                 }
 
                 // This sleep call is pretty ugly, but it should almost never happen. We're accepting the potential
@@ -664,22 +847,70 @@ void BedrockServer::worker(SData& args,
                 usleep(10000);
             }
 
+            // A command with `maxStalenessMS` can be answered from our own database as long as we're no more than
+            // that far behind master. If we're further behind, it waits until we have everything master had when we
+            // noticed, which we do by turning it into a `minCommitCount` for the check below.
+            if (command.request.isSet("maxStalenessMS") && replicationState.load() == SQLiteNode::SLAVING) {
+                auto _syncNodeCopy = server._syncNode;
+                const uint64_t lag = _syncNodeCopy ? _syncNodeCopy->getReplicationLagUS() : 0;
+                if (lag > command.request.calcU64("maxStalenessMS") * STIME_US_PER_MS) {
+                    const uint64_t masterCommitCount = _syncNodeCopy->getMasterCommitCount();
+                    SINFO("Command (" << command.request.methodLine << ") allows " << command.request["maxStalenessMS"]
+                          << "ms staleness, but we're " << lag / STIME_US_PER_MS << "ms behind master. Waiting for commit "
+                          << masterCommitCount << ".");
+                    command.request.erase("maxStalenessMS");
+                    command.request["minCommitCount"] = SToStr(max(masterCommitCount,
+                                                                   command.request.calcU64("minCommitCount")));
+                }
+            }
+
             // If this command is dependent on a commitCount newer than what we have (maybe it's a follow-up to a
-            // command that was escalated to master), we'll set it aside for later processing. When the sync node
-            // finishes its update loop, it will re-queue any of these commands that are no longer blocked on our
-            // updated commit count.
+            // command that was escalated to master), we'll set it aside for later processing. It's re-queued as soon
+            // as the commit it's waiting for lands. `minCommitCount` is the same thing.
             uint64_t commitCount = db.getCommitCount();
-            uint64_t commandCommitCount = command.request.calcU64("commitCount");
+            uint64_t commandCommitCount = max(command.request.calcU64("commitCount"),
+                                              command.request.calcU64("minCommitCount"));
             if (commandCommitCount > commitCount) {
                 SAUTOLOCK(server._futureCommitCommandMutex);
-                auto newQueueSize = server._futureCommitCommands.size() + 1;
-                SINFO("Command (" << command.request.methodLine << ") depends on future commit(" << commandCommitCount
-                      << "), Currently at: " << commitCount << ", storing for later. Queue size: " << newQueueSize);
-                server._futureCommitCommands.insert(make_pair(commandCommitCount, move(command)));
-                if (newQueueSize > 100) {
-                    SHMMM("server._futureCommitCommands.size() == " << newQueueSize);
+
+                // Check again now that we have the lock, as the commit may have landed (and looked for waiting
+                // commands) since we last looked.
+                commitCount = db.getCommitCount();
+                if (commandCommitCount > commitCount) {
+                    auto newQueueSize = server._futureCommitCommands.size() + 1;
+                    SINFO("Command (" << command.request.methodLine << ") depends on future commit("
+                          << commandCommitCount << "), Currently at: " << commitCount
+                          << ", storing for later. Queue size: " << newQueueSize);
+                    if (newQueueSize > 100) {
+                        SHMMM("server._futureCommitCommands.size() == " << newQueueSize);
+                    }
+
+                    // If we're holding as many of these as we're allowed, the oldest may give up its place.
+                    if (server._expireHeldCommands && server._futureCommitHold.full()) {
+                        auto oldest = server._futureCommitCommands.begin();
+                        for (auto it = oldest; it != server._futureCommitCommands.end(); it++) {
+                            if (it->second.creationTime < oldest->second.creationTime) {
+                                oldest = it;
+                            }
+                        }
+                        BedrockCommand expired = move(oldest->second);
+                        server._futureCommitCommands.erase(oldest);
+                        server._futureCommitHold.remove(expired);
+                        server._futureCommitHold.expired++;
+                        SWARN("Holding " << newQueueSize - 1 << " commands for future commits, giving up on the "
+                              << "oldest, '" << expired.request.methodLine << "'.");
+                        expired.response.methodLine = "555 Timeout waiting for commit";
+                        expired.complete = true;
+                        if (expired.initiatingPeerID) {
+                            syncNodeCompletedCommands.push(move(expired));
+                        } else {
+                            server._reply(expired);
+                        }
+                    }
+                    server._futureCommitHold.add(command);
+                    server._futureCommitCommands.insert(make_pair(commandCommitCount, move(command)));
+                    continue;
                 }
-                continue;
             }
 
             // OK, so this is the state right now, which isn't necessarily anything in particular, because the sync
@@ -736,11 +967,15 @@ void BedrockServer::worker(SData& args,
 
             // We'll retry on conflict up to this many times.
             int retry = server._maxConflictRetries.load();
+            const string verb = command.request.getVerb();
 
             while (retry) {
                 // Block if a checkpoint is happening so we don't interrupt it.
                 db.waitForCheckpoint();
 
+                // If commands like this one have been conflicting, wait for any others that write the same tables.
+                list<unique_lock<mutex>> conflictLanes = server._lockConflictLanes(verb);
+
                 // If the command doesn't already have an httpsRequest from a previous peek attempt, try peeking it
                 // now. We don't duplicate peeks for commands that make https requests.
                 // If peek succeeds, then it's finished, and all we need to do is respond to the command at the bottom.
@@ -749,6 +984,19 @@ void BedrockServer::worker(SData& args,
                 if (!command.httpsRequests.size()) {
                     peekResult = core.peekCommand(command);
                     calledPeek = true;
+
+                    // A plugin can take a command it can't do anything with yet, rather than have it processed, and
+                    // give it back to us when it can. Until then, it's not in progress as far as we're concerned.
+                    if (!peekResult && !command.initiatingPeerID && command.request.isSet("HeldBy")) {
+                        const string& heldBy = command.request["HeldBy"];
+                        BedrockPlugin* plugin =
+                            BedrockPlugin::getPluginByName(SContains(heldBy, ":") ? SBefore(heldBy, ":") : heldBy);
+                        if (plugin && plugin->holdCommand(command)) {
+                            core.rollback();
+                            server._commandsInProgress--;
+                            break;
+                        }
+                    }
                 }
 
                 if (!calledPeek || !peekResult) {
@@ -792,6 +1040,9 @@ void BedrockServer::worker(SData& args,
                         canWriteParallel =
                             (_blacklistedParallelCommands.find(command.request.methodLine) == _blacklistedParallelCommands.end());
                     }
+                    if (canWriteParallel) {
+                        canWriteParallel = !server._isAutoBlacklisted(command.request.methodLine);
+                    }
 
                     // We need to have multi-write enabled, the command needs to not be explicitly blacklisted, and it
                     // needs to not be automatically blacklisted.
@@ -799,7 +1050,7 @@ void BedrockServer::worker(SData& args,
                         server._suppressMultiWrite.load() ||
                         state != SQLiteNode::MASTERING    ||
                         command.onlyProcessOnSyncThread   ||
-                        command.writeConsistency != SQLiteNode::ASYNC)
+                        (command.writeConsistency != SQLiteNode::ASYNC && !server._multiWriteQuorumEnabled))
                     {
                         // Roll back the transaction, it'll get re-run in the sync thread.
                         core.rollback();
@@ -816,6 +1067,8 @@ void BedrockServer::worker(SData& args,
                     } else {
                         // In this case, there's nothing blocking us from processing this in a worker, so let's try it.
                         if (core.processCommand(command)) {
+                            const set<string> writtenTables = db.getWrittenTables();
+
                             // If processCommand returned true, then we need to do a commit. Otherwise, the command is
                             // done, and we just need to respond. Before we commit, we need to grab the sync thread
                             // lock. Because the sync thread grabs an exclusive lock on this wrapping any transactions
@@ -827,6 +1080,15 @@ void BedrockServer::worker(SData& args,
                             // conflict as long as we don't commit while it's performing a transaction. This is scoped
                             // to the minimum time required.
                             bool commitSuccess = false;
+
+                            // A command that needs ONE or QUORUM consistency is committed here like any other, but
+                            // isn't answered until enough peers have committed it too. We ask for that before
+                            // committing, so the sync thread can't send this transaction to peers without asking them
+                            // to acknowledge it.
+                            const bool acknowledge = command.writeConsistency != SQLiteNode::ASYNC;
+                            if (acknowledge) {
+                                SQLiteNode::acknowledgementsRequested++;
+                            }
                             {
                                 uint64_t preLockTime = STimeNow();
                                 shared_lock<decltype(server._syncThreadCommitMutex)> lock1(server._syncThreadCommitMutex);
@@ -853,7 +1115,12 @@ void BedrockServer::worker(SData& args,
                                     core.rollback();
                                 } else {
                                     BedrockCore::AutoTimer(command, BedrockCommand::COMMIT_WORKER);
+                                    BedrockCore::AutoAccount account(db, command.processedBy, verb);
                                     commitSuccess = core.commit();
+                                    server._recordCommitAttempt(command.request.methodLine, !commitSuccess);
+                                    if (!commitSuccess) {
+                                        server._recordConflict(verb, writtenTables);
+                                    }
                                 }
                             }
                             if (commitSuccess) {
@@ -862,7 +1129,16 @@ void BedrockServer::worker(SData& args,
                                 // mark it as complete. We add the currentCommit count here as well.
                                 command.response["commitCount"] = to_string(db.getCommitCount());
                                 command.complete = true;
+
+                                // The sync thread will respond once peers have this.
+                                if (acknowledge) {
+                                    syncNodeUnacknowledgedCommands.push(move(command));
+                                    break;
+                                }
                             } else {
+                                if (acknowledge) {
+                                    SQLiteNode::acknowledgementsRequested--;
+                                }
                                 SINFO("Conflict or state change committing " << command.request.methodLine
                                       << " on worker thread with " << retry << " retries remaining.");
                             }
@@ -899,18 +1175,95 @@ void BedrockServer::worker(SData& args,
             // If the sync node has shut down, we can return now, there will be no more work to do.
             if  (server._shutdownState.load() == DONE) {
                 SINFO("No commands found in queue and DONE.");
-                return;
+                return false;
             }
+
+            // Otherwise, we've got time to get ready in case we're promoted.
+            server._warmUpCache(db, lastWarmUp);
         }
 
         // If we hit the timeout, doesn't matter if we've got work to do. Exit.
         if (server._gracefulShutdownTimeout.ringing()) {
             SINFO("_shutdownState is DONE and we've timed out, exiting worker.");
-            return;
+            return false;
         }
     }
 }
 
+void BedrockServer::_warmUpCache(SQLite& db, uint64_t& lastWarmUp) {
+    const SQLiteNode::State state = _replicationState.load();
+    const uint64_t now = STimeNow();
+    if (!_warmUpIntervalUS || (state != SQLiteNode::SLAVING && state != SQLiteNode::WAITING) ||
+        now < lastWarmUp + _warmUpIntervalUS) {
+        return;
+    }
+    lastWarmUp = now;
+
+    // Reading the rows is enough to pull their pages into this handle's cache. We don't need the results.
+    size_t rows = 0;
+    for (BedrockPlugin* plugin : plugins) {
+        for (const string& query : plugin->getWarmUpQueries()) {
+            SQResult result;
+            if (!db.read(query, result)) {
+                SWARN("Warm-up query for plugin " << plugin->getName() << " failed: " << query);
+                continue;
+            }
+            rows += result.size();
+        }
+    }
+    SINFO("Warmed up page cache with " << rows << " rows in " << (STimeNow() - now) / STIME_US_PER_MS << "ms.");
+}
+
+bool BedrockServer::_waitForWorkerSlot(int threadId) {
+    unique_lock<mutex> lock(_workerPoolMutex);
+    while (threadId >= _activeWorkerThreads.load()) {
+        if (_shutdownState.load() == DONE || _gracefulShutdownTimeout.ringing()) {
+            return false;
+        }
+        _workerPoolCondition.wait_for(lock, chrono::seconds(1));
+    }
+    return true;
+}
+
+void BedrockServer::_scaleWorkerPool() {
+    const uint64_t now = STimeNow();
+    if (_minWorkerThreads == _maxWorkerThreads || now < _workerPoolScaledAt + WORKER_POOL_SCALE_INTERVAL_US) {
+        return;
+    }
+    const uint64_t commands = _workerCommandCount.load() - _workerPoolCommands;
+    const uint64_t conflicts = SQLite::commitConflicts.load() - _workerPoolConflicts;
+    _workerPoolScaledAt = now;
+    _workerPoolCommands += commands;
+    _workerPoolConflicts += conflicts;
+
+    const int active = _activeWorkerThreads.load();
+    const size_t queued = _commandQueue.size();
+    const bool conflicting = conflicts >= WORKER_POOL_MIN_CONFLICTS && conflicts * WORKER_POOL_CONFLICT_RATIO > commands;
+    int target = active;
+    if (queued > (size_t)active && !conflicting) {
+        // Grow quickly, up to doubling at a time, but not past what the backlog can use.
+        target = min(_maxWorkerThreads, active + (int)min(queued - active, (size_t)active));
+    } else if (!queued || conflicting) {
+        // Shrink slowly, as a worker that's parked has to reopen its DB handle to come back.
+        target = max(_minWorkerThreads, active - 1);
+    }
+    if (target != active) {
+        SINFO("Resizing worker pool from " << active << " to " << target << " workers, with " << queued
+              << " commands queued, and " << conflicts << " conflicts in " << commands << " commands.");
+        lock_guard<mutex> lock(_workerPoolMutex);
+        _activeWorkerThreads = target;
+        _workerPoolCondition.notify_all();
+    }
+}
+
+int BedrockServer::_getCacheSizePerHandle(const SData& args, int workerThreads) {
+    if (!args.isSet("-cacheBudget")) {
+        return args.calc("-cacheSize");
+    }
+    const int handles = 1 + workerThreads + max(0, args.calc("-slaveApplyThreads"));
+    return max(1, args.calc("-cacheBudget") / handles);
+}
+
 bool BedrockServer::_handleIfStatusOrControlCommand(BedrockCommand& command) {
     if (_isStatusCommand(command)) {
         _commandsInProgress++;
@@ -934,49 +1287,153 @@ bool BedrockServer::_handleIfStatusOrControlCommand(BedrockCommand& command) {
 }
 
 bool BedrockServer::_wouldCrash(const BedrockCommand& command) {
+    // Typically, there are no crash commands at all, and we don't need to look any further.
+    if (!_hasCrashCommands.load()) {
+        return false;
+    }
+
     // Get a shared lock so that all the workers can look at this map simultaneously.
     shared_lock<decltype(_crashCommandMutex)> lock(_crashCommandMutex);
-
-    // Typically, this map is empty and this returns no results.
-    auto commandIt = _crashCommands.find(command.request.methodLine);
-    if (commandIt == _crashCommands.end()) {
+    auto matcherIt = _crashMatchers.find(command.request.methodLine);
+    if (matcherIt == _crashMatchers.end()) {
         return false;
     }
+    const CrashMatcher& matcher = matcherIt->second;
+    if (matcher.matchesAll) {
+        return true;
+    }
 
-    // Look at each crash-inducing command that has the same methodLine.
-    for (const STable& values : commandIt->second) {
-
-        // These are all of the keys that need to match to kill this command.
-        bool isMatch = true;
-        for (auto& pair : values) {
-            // We skip Content-Length, as it's added automatically when serializing commands.
-            if (SIEquals(pair.first, "Content-Length")) {
-                continue;
+    // Count how many of each crash command's name/value pairs this command has. If it has all of them for any one crash
+    // command, we think it'll crash.
+    vector<size_t> matched(matcher.required.size(), 0);
+    for (const auto& pair : command.request.nameValueMap) {
+        auto nameIt = matcher.index.find(SToLower(pair.first));
+        if (nameIt == matcher.index.end()) {
+            continue;
+        }
+        auto valueIt = nameIt->second.find(pair.second);
+        if (valueIt == nameIt->second.end()) {
+            continue;
+        }
+        for (size_t crashCommand : valueIt->second) {
+            if (++matched[crashCommand] == matcher.required[crashCommand]) {
+                return true;
             }
+        }
+    }
+    return false;
+}
 
-            // See if our current command even has the blacklisted key.
-            auto it = command.request.nameValueMap.find(pair.first);
-            if (it ==  command.request.nameValueMap.end()) {
-                // If we didn't find it, the command's not sufficiently similar, and is not blacklisted.
-                isMatch = false;
-                break;
-            }
+void BedrockServer::_addCrashMatcher(const string& methodLine, const STable& values) {
+    CrashMatcher& matcher = _crashMatchers[methodLine];
+    const size_t crashCommand = matcher.required.size();
+    size_t required = 0;
+    for (const auto& pair : values) {
+        // We skip Content-Length, as it's added automatically when serializing commands.
+        if (SIEquals(pair.first, "Content-Length")) {
+            continue;
+        }
+        matcher.index[SToLower(pair.first)][pair.second].push_back(crashCommand);
+        required++;
+    }
+    matcher.required.push_back(required);
 
-            // At this point, we must have the same key, but if it doesn't have the same value, then it doesn't match.
-            if (it->second != pair.second) {
-                isMatch = false;
-                break;
-            }
+    // A crash command with nothing to match but its methodLine matches every command with that methodLine.
+    if (!required) {
+        matcher.matchesAll = true;
+    }
+}
+
+const size_t BedrockServer::AUTO_BLACKLIST_WINDOW_SECONDS;
+const int BedrockServer::AUTO_BLACKLIST_MIN_ATTEMPTS = 20;
+const double BedrockServer::AUTO_BLACKLIST_CONFLICT_RATE = 0.5;
+
+void BedrockServer::_recordCommitAttempt(const string& methodLine, bool conflicted) {
+    const uint64_t now = STimeNow();
+    const uint64_t second = now / STIME_US_PER_S;
+    lock_guard<mutex> lock(_commitAttemptsMutex);
+    CommitAttempts& commitAttempts = _commitAttempts[methodLine];
+    CommitAttempts::Bucket& bucket = commitAttempts.buckets[second % AUTO_BLACKLIST_WINDOW_SECONDS];
+    if (bucket.second != second) {
+        bucket = CommitAttempts::Bucket();
+        bucket.second = second;
+    }
+    bucket.attempts++;
+    bucket.conflicts += conflicted;
+    if (!conflicted || commitAttempts.blacklistedUntil > now) {
+        return;
+    }
+
+    // Add up the window, skipping any buckets too old to be in it.
+    int attempts = 0;
+    int conflicts = 0;
+    for (const auto& b : commitAttempts.buckets) {
+        if (b.second + AUTO_BLACKLIST_WINDOW_SECONDS > second) {
+            attempts += b.attempts;
+            conflicts += b.conflicts;
         }
+    }
+    if (attempts >= AUTO_BLACKLIST_MIN_ATTEMPTS && conflicts > attempts * AUTO_BLACKLIST_CONFLICT_RATE) {
+        SINFO("[performance] " << conflicts << " of " << attempts << " recent commits of " << methodLine
+              << " conflicted, sending it to the sync thread for " << AUTO_BLACKLIST_WINDOW_SECONDS << "s.");
+        commitAttempts.blacklistedUntil = now + AUTO_BLACKLIST_WINDOW_SECONDS * STIME_US_PER_S;
+    }
+}
 
-        // If we got through the whole list and everything was a match, then this is a match, we think it'll crash.
-        if (isMatch) {
-            return true;
+bool BedrockServer::_isAutoBlacklisted(const string& methodLine) {
+    lock_guard<mutex> lock(_commitAttemptsMutex);
+    auto it = _commitAttempts.find(methodLine);
+    return it != _commitAttempts.end() && it->second.blacklistedUntil > STimeNow();
+}
+
+list<string> BedrockServer::_getAutoBlacklist() {
+    list<string> blacklist;
+    const uint64_t now = STimeNow();
+    lock_guard<mutex> lock(_commitAttemptsMutex);
+    for (const auto& entry : _commitAttempts) {
+        if (entry.second.blacklistedUntil > now) {
+            blacklist.push_back(entry.first);
         }
     }
+    return blacklist;
+}
 
-    // If nothing in our range returned true, then this command looks fine.
-    return false;
+const size_t BedrockServer::CONFLICT_LANES = 64;
+const uint64_t BedrockServer::CONFLICT_LANE_DURATION = STIME_US_PER_M;
+
+void BedrockServer::_recordConflict(const string& verb, const set<string>& tables) {
+    lock_guard<mutex> lock(_conflictingVerbsMutex);
+    ConflictingVerb& conflictingVerb = _conflictingVerbs[verb];
+    if (conflictingVerb.tables.empty()) {
+        SINFO("[performance] " << verb << " conflicted writing " << SComposeList(tables) << ", running it in lanes.");
+    }
+    conflictingVerb.tables.insert(tables.begin(), tables.end());
+    conflictingVerb.lastConflict = STimeNow();
+}
+
+list<unique_lock<mutex>> BedrockServer::_lockConflictLanes(const string& verb) {
+    // Find the lanes for this verb's tables. A set keeps them in order, so that everyone locks them in the same order.
+    set<size_t> lanes;
+    {
+        lock_guard<mutex> lock(_conflictingVerbsMutex);
+        auto it = _conflictingVerbs.find(verb);
+        if (it == _conflictingVerbs.end()) {
+            return {};
+        }
+        if (it->second.lastConflict + CONFLICT_LANE_DURATION < STimeNow()) {
+            // It's been long enough that we'll try this without lanes again.
+            _conflictingVerbs.erase(it);
+            return {};
+        }
+        for (const string& table : it->second.tables) {
+            lanes.insert(hash<string>()(table) % CONFLICT_LANES);
+        }
+    }
+    list<unique_lock<mutex>> locks;
+    for (size_t lane : lanes) {
+        locks.emplace_back(_conflictLanes[lane]);
+    }
+    return locks;
 }
 
 void BedrockServer::_resetServer() {
@@ -995,13 +1452,20 @@ void BedrockServer::_resetServer() {
 }
 
 BedrockServer::BedrockServer(const SData& args)
-  : SQLiteServer(""), _args(args), _requestCount(0), _replicationState(SQLiteNode::SEARCHING),
-    _upgradeInProgress(false), _suppressCommandPort(false), _suppressCommandPortManualOverride(false),
+  : SQLiteServer(""), _args(args), _requestCount(0), _shedCommandCount(0), _abandonedCommandCount(0),
+    _replicationState(SQLiteNode::SEARCHING), _upgradeInProgress(false), _suppressCommandPort(false),
+    _suppressCommandPortManualOverride(false),
     _syncThreadComplete(false), _syncNode(nullptr), _suppressMultiWrite(true), _shutdownState(RUNNING),
-    _multiWriteEnabled(args.test("-enableMultiWrite")), _shouldBackup(false), _detach(args.isSet("-bootstrap")),
-    _controlPort(nullptr), _commandPort(nullptr), _maxConflictRetries(3)
+    _multiWriteEnabled(args.test("-enableMultiWrite")), _multiWriteQuorumEnabled(args.test("-enableMultiWriteQuorum")),
+    _shouldBackup(false), _backupRunning(false), _backupCancel(false), _detach(args.isSet("-bootstrap")),
+    _controlPort(nullptr), _commandPort(nullptr), _ioThreadsExit(false), _lastChance(0), _maxConflictRetries(3),
+    _conflictLanes(CONFLICT_LANES), _httpsThreadExit(false), _hasCrashCommands(false)
 {
     _version = SVERSION;
+    _minWorkerThreads = 0;
+    _maxWorkerThreads = 0;
+    _activeWorkerThreads = 0;
+    _workerCommandCount = 0;
 
     // Output the list of plugins.
     map<string, BedrockPlugin*> registeredPluginMap;
@@ -1061,6 +1525,79 @@ BedrockServer::BedrockServer(const SData& args)
         }
     }
 
+    // Load shedding limits, as comma-separated `priority:limit` pairs.
+    auto parseShedLimits = [&](const string& name, uint64_t multiplier, auto& limits) {
+        for (const string& limit : SParseList(args[name])) {
+            list<string> parts = SParseList(limit, ':');
+            if (parts.size() != 2) {
+                SERROR("Invalid " << name << " limit '" << limit << "', expected 'priority:limit'.");
+            }
+            limits[SToInt(parts.front())] = SToUInt64(parts.back()) * multiplier;
+            SINFO("Shedding commands at priority " << parts.front() << " or below at " << name << " " << parts.back());
+        }
+    };
+    parseShedLimits("-shedDepth", 1, _shedDepthLimits);
+    parseShedLimits("-shedAge", STIME_US_PER_MS, _shedAgeLimitsUS);
+
+    // Limits on what each of the places commands wait can hold, as comma-separated `area:limit` pairs.
+    _expireHeldCommands = SIEquals(args["-heldCommandPolicy"], "expire");
+    map<string, uint64_t> maxHeldCommands;
+    map<string, uint64_t> maxHeldBytes;
+    auto parseHeldLimits = [&](const string& name, map<string, uint64_t>& limits) {
+        for (const string& limit : SParseList(args[name])) {
+            list<string> parts = SParseList(limit, ':');
+            if (parts.size() != 2) {
+                SERROR("Invalid " << name << " limit '" << limit << "', expected 'area:limit'.");
+            }
+            limits[parts.front()] = SToUInt64(parts.back());
+        }
+    };
+    parseHeldLimits("-maxHeldCommands", maxHeldCommands);
+    parseHeldLimits("-maxHeldBytes", maxHeldBytes);
+    for (auto limits : {maxHeldCommands, maxHeldBytes}) {
+        for (auto& limit : limits) {
+            if (!SContains(set<string>{"escalated", "futureCommit", "https", "standDown", "responses"}, limit.first)) {
+                SERROR("Unknown area '" << limit.first << "' in held command limits.");
+            }
+        }
+    }
+    _maxEscalatedCount = maxHeldCommands["escalated"];
+    _maxEscalatedBytes = maxHeldBytes["escalated"];
+    _futureCommitHold.setLimits(maxHeldCommands["futureCommit"], maxHeldBytes["futureCommit"]);
+    _httpsHold.setLimits(maxHeldCommands["https"], maxHeldBytes["https"]);
+    _standDownHold.setLimits(maxHeldCommands["standDown"], maxHeldBytes["standDown"]);
+    _responseHold.setLimits(maxHeldCommands["responses"], maxHeldBytes["responses"]);
+
+    // How often idle workers warm up their page caches while we aren't master, in case we're promoted.
+    _warmUpIntervalUS = args.calcU64("-warmUpInterval") * STIME_US_PER_S;
+
+    // Trace one in this many client commands.
+    _traceSampleRate = args.calcU64("-traceSampleRate");
+
+    // Keep the last of the slow queries, with their query plans, for `GetSlowQueries`.
+    SSlowQueryLogConfigure(args.calcU64("-slowQueryLogSize"), max(args.calc("-slowQuerySampleRate"), 1),
+                           args.isSet("-slowQueryThreshold") ? args.calcU64("-slowQueryThreshold") * STIME_US_PER_MS
+                                                             : UINT64_MAX);
+
+    // Keep the responses to peeked commands that plugins let us cache, if there's room for any.
+    BedrockCore::setPeekCacheSize(args.calcU64("-peekCacheSize"));
+
+    // Switch the command queue to fair queuing if it's been configured, before anything can be queued.
+    if (args.isSet("-queueWeights") || args.isSet("-queueFairness")) {
+        map<int, uint64_t> weights;
+        for (const string& weight : SParseList(args["-queueWeights"])) {
+            list<string> parts = SParseList(weight, ':');
+            if (parts.size() != 2) {
+                SERROR("Invalid -queueWeights weight '" << weight << "', expected 'priority:weight'.");
+            }
+            weights[SToInt(parts.front())] = SToUInt64(parts.back());
+        }
+        const string flowKey = args.isSet("-queueFairness") ? args["-queueFairness"] : "source";
+        SINFO("Fair queuing commands by priority and " << flowKey << ", with weights '" << args["-queueWeights"]
+              << "'.");
+        _commandQueue.setFairQueuing(weights, flowKey);
+    }
+
     // Allow sending control commands when the server's not MASTERING/SLAVING.
     SINFO("Opening control port on '" << _args["-controlPort"] << "'");
     _controlPort = openPort(_args["-controlPort"]);
@@ -1080,18 +1617,47 @@ BedrockServer::BedrockServer(const SData& args)
                      ref(_masterVersion),
                      ref(_syncNodeQueuedCommands),
                      ref(*this));
+
+    // Start any I/O threads. They don't listen on anything until the command port is opened.
+    int ioThreads = max(0, args.calc("-ioThreads"));
+    for (int threadID = 0; threadID < ioThreads; threadID++) {
+        _ioThreads.emplace_back();
+        _ioThreads.back().ioThread = thread(&BedrockServer::_ioThreadLoop, this, ref(_ioThreads.back()), threadID);
+    }
+
+    // And the thread that handles plugins' outgoing HTTPS requests.
+    _httpsThread = thread(&BedrockServer::_httpsThreadLoop, this);
 }
 
 BedrockServer::~BedrockServer() {
+    // Abandon any live backup that's still running, it'd be incomplete anyway.
+    _backupCancel.store(true);
+    if (_backupThread.joinable()) {
+        _backupThread.join();
+    }
+
     // Shut down the sync thread, (which will shut down worker threads in turn).
     SINFO("Closing sync thread '" << _syncThreadName << "'");
     _syncThread.join();
+
+    // Then the I/O threads, which close their own sockets on the way out.
+    _ioThreadsExit.store(true);
+    for (auto& io : _ioThreads) {
+        io.ioThread.join();
+    }
+    _httpsThreadExit.store(true);
+    _httpsWakeQueue.push(true);
+    _httpsThread.join();
     SINFO("Threads closed.");
 
     // Close any sockets that are still open. We wait until the sync thread has completed to do this, as until it's
     // finished, it may keep writing to these sockets.
-    if (_socketIDMap.size()) {
-        SWARN("Still have " << _socketIDMap.size() << " entries in _socketIDMap.");
+    size_t pendingSockets = 0;
+    for (auto& shard : _socketShards) {
+        pendingSockets += shard.sockets.size();
+    }
+    if (pendingSockets) {
+        SWARN("Still have " << pendingSockets << " sockets waiting for responses.");
     }
 
     if (socketList.size()) {
@@ -1145,16 +1711,22 @@ bool BedrockServer::shutdownComplete() {
 }
 
 void BedrockServer::prePoll(fd_map& fdm) {
-    SAUTOLOCK(_socketIDMutex);
     STCPServer::prePoll(fdm);
+    _ioStatusCommands.prePoll(fdm);
 }
 
 void BedrockServer::postPoll(fd_map& fdm, uint64_t& nextActivity) {
-    // Let the base class do its thing. We lock around this because we allow worker threads to modify the sockets (by
-    // writing to them, but this can truncate send buffers).
-    {
-        SAUTOLOCK(_socketIDMutex);
-        STCPServer::postPoll(fdm);
+    // Let the base class do its thing. Workers can write to these sockets at the same time, but sockets lock themselves
+    // around sending and receiving.
+    STCPServer::postPoll(fdm);
+    _ioStatusCommands.postPoll(fdm, 100);
+
+    // Publish what's queued for `Status`.
+    const uint64_t now = STimeNow();
+    if (now >= _queuedCommandStatusPublished + STATUS_PUBLISH_INTERVAL_US) {
+        atomic_store(&_queuedCommandStatus, shared_ptr<const list<string>>(
+            make_shared<list<string>>(_commandQueue.getRequestMethodLines())));
+        _queuedCommandStatusPublished = now;
     }
 
     // Open the port the first time we enter a command-processing state
@@ -1181,7 +1753,15 @@ void BedrockServer::postPoll(fd_map& fdm, uint64_t& nextActivity) {
         // Open the port
         if (!_commandPort) {
             SINFO("Ready to process commands, opening command port on '" << _args["-serverHost"] << "'");
-            _commandPort = openPort(_args["-serverHost"]);
+            if (_ioThreads.empty()) {
+                _commandPort = openPort(_args["-serverHost"]);
+            } else {
+                // Each I/O thread listens on its own socket bound to the same address, and the kernel spreads new
+                // connections across them.
+                for (auto& io : _ioThreads) {
+                    _commandPort = io.server.openPort(_args["-serverHost"], true);
+                }
+            }
         }
         if (!_controlPort) {
             SINFO("Opening control port on '" << _args["-controlPort"] << "'");
@@ -1243,144 +1823,262 @@ void BedrockServer::postPoll(fd_map& fdm, uint64_t& nextActivity) {
     // Time the end of the accept section.
     uint64_t acceptEndTime = STimeNow();
 
+    // Any status or control commands that the I/O threads read get handled here, as they can change the server's
+    // state.
+    for (BedrockCommand& command : _ioStatusCommands.popAll()) {
+        _handleIfStatusOrControlCommand(command);
+    }
+
+    // Process any new activity from incoming sockets.
+    _readRequests(*this, false, deserializationAttempts, deserializedRequests);
+
+    // Log the timing of this loop.
+    uint64_t readElapsedMS = (STimeNow() - acceptEndTime) / 1000;
+    SINFO("Read from " << socketList.size() << " sockets, attempted to deserialize " << deserializationAttempts
+          << " commands, " << deserializedRequests << " were complete and deserialized in " << readElapsedMS << "ms.");
+
+    // If any plugin timers are firing, let the plugins know.
+    for (auto plugin : plugins) {
+        for (SStopwatch* timer : plugin->timers) {
+            if (timer->ding()) {
+                plugin->timerFired(timer);
+            }
+        }
+    }
+
+    // If we've been told to start shutting down, we'll set the lastChance timer. This is a timestamp, after which
+    // we'll start giving up on any sockets that don't seem to be giving us any data. The case for this is that once we
+    // start shutting down, we'll close any sockets when we respond to a command on them, and we'll stop accepting any
+    // new sockets, but if existing sockets just sit around giving us nothing, we need to figure out some way to handle
+    // them. We'll wait 5 seconds and then start killing them.
+    if (_shutdownState.load() == START_SHUTDOWN) {
+        if (!_lastChance.load()) {
+            _lastChance.store(STimeNow() + 5 * 1'000'000); // 5 seconds from now.
+        }
+
+        // Sockets owned by I/O threads count too. Those threads close whatever they have left once we move past
+        // START_SHUTDOWN.
+        size_t ioSockets = 0;
+        for (auto& io : _ioThreads) {
+            ioSockets += io.socketCount.load();
+        }
+
+        // If we've run out of sockets or hit our timeout, we'll increment _shutdownState.
+        if ((socketList.empty() && !ioSockets) || _gracefulShutdownTimeout.ringing()) {
+            _lastChance.store(0);
+
+            // We empty the socket list here, we will no longer allow new requests to come in, as the sync node can
+            // shutdown any time after here, and we'll have no way to handle new requests.
+            if (socketList.size()) {
+                SINFO("Killing " << socketList.size() << " remaining sockets at graceful shutdown timeout.");
+                while(socketList.size()) {
+                    auto s = socketList.front();
+                    _forgetSocket(s->id);
+                    closeSocket(s);
+                }
+            }
+            _shutdownState.store(CLIENTS_RESPONDED);
+        }
+    }
+}
+
+void BedrockServer::_readRequests(STCPManager& manager, bool ioThread, int& deserializationAttempts,
+                                  int& deserializedRequests) {
     // Process any new activity from incoming sockets. In order to not modify the socket list while we're iterating
     // over it, we'll keep a list of sockets that need closing.
     list<STCPManager::Socket*> socketsToClose;
 
-    // This is a timestamp, after which we'll start giving up on any sockets that don't seem to be giving us any data.
-    // The case for this is that once we start shutting down, we'll close any sockets when we respond to a command on
-    // them, and we'll stop accepting any new sockets, but if existing sockets just sit around giving us nothing, we
-    // need to figure out some way to handle them. We'll wait 5 seconds and then start killing them.
-    static uint64_t lastChance = 0;
-    for (auto s : socketList) {
+    const uint64_t lastChance = _lastChance.load();
+    for (auto s : manager.socketList) {
         switch (s->state.load()) {
             case STCPManager::Socket::CLOSED:
             {
-                // TODO: Cancel any outstanding commands initiated by this socket. This isn't critical, and is an
-                // optimization. Otherwise, they'll continue to get processed to completion, and will just never be
-                // able to have their responses returned.
-                SAUTOLOCK(_socketIDMutex);
-                _socketIDMap.erase(s->id);
+                // Once the socket's gone from its map, any of its commands that haven't started yet are dropped
+                // before they're run (see `_discardIfAbandoned`). Those already running finish, but aren't answered.
+                _forgetSocket(s->id);
                 socketsToClose.push_back(s);
+                BedrockPlugin* plugin = static_cast<BedrockPlugin*>(s->data);
+                if (plugin) {
+                    plugin->onPortClose(s);
+                }
             }
             break;
             case STCPManager::Socket::CONNECTED:
             {
-                {
-                    SAUTOLOCK(_socketIDMutex);
-                    if (s->recvBuffer.empty()) {
-                        // If nothing's been received, break early.
-                        if (_shutdownState.load() != RUNNING && lastChance && lastChance < STimeNow() && _socketIDMap.find(s->id) == _socketIDMap.end()) {
-                            // If we're shutting down and past our lastChance timeout, we start killing these.
-                            SINFO("Closing socket " << s->id << " with no data and no pending command: shutting down.");
-                            socketsToClose.push_back(s);
-                        }
-                        break;
-                    } else {
-                        // Otherwise, we'll see if there's any activity on this socket. Currently, we don't handle clients
-                        // pipelining requests well. We process commands in no particular order, so we can't dequeue two
-                        // requests off the same socket at one time, or we don't guarantee their return order, thus we just
-                        // wait and will try again later.
-                        auto socketIt = _socketIDMap.find(s->id);
-                        if (socketIt != _socketIDMap.end()) {
+                // Clients may pipeline requests, so we keep reading until we run out of complete requests on this
+                // socket, or it has as many outstanding as we allow.
+                while (true) {
+                    {
+                        SocketShard& shard = _getSocketShard(s->id);
+                        SAUTOLOCK(shard.mutex);
+                        auto socketIt = shard.sockets.find(s->id);
+                        if (s->recvBuffer.empty()) {
+                            // If nothing's been received, break early.
+                            if (_shutdownState.load() != RUNNING && lastChance && lastChance < STimeNow() && socketIt == shard.sockets.end()) {
+                                // If we're shutting down and past our lastChance timeout, we start killing these.
+                                SINFO("Closing socket " << s->id << " with no data and no pending command: shutting down.");
+                                socketsToClose.push_back(s);
+                            }
                             break;
+                        } else if (socketIt != shard.sockets.end()) {
+                            // Otherwise, there are already commands outstanding on this socket. We'll read more as long
+                            // as we can keep their responses in order, which we can't do for plugins (they send their
+                            // own responses), or after a request that asked us to close the connection.
+                            const PendingSocket& pending = socketIt->second;
+                            if (s->data || pending.closing ||
+                                pending.nextSequence - pending.nextReply >= MAX_PIPELINED_REQUESTS) {
+                                break;
+                            }
                         }
                     }
-                }
-
-                // If there's a request, we'll dequeue it (but only the first one).
-                SData request;
 
-                // If the socket is owned by a plugin, we let the plugin populate our request.
-                BedrockPlugin* plugin = static_cast<BedrockPlugin*>(s->data);
-                if (plugin) {
-                    // Call the plugin's handler.
-                    plugin->onPortRecv(s, request);
-                    if (!request.empty()) {
-                        // If it populated our request, then we'll save the plugin name so we can handle the response.
-                        request["plugin"] = plugin->getName();
+                    // If there's a request, we'll dequeue it.
+                    SData request;
+
+                    // If the socket is owned by a plugin, we let the plugin populate our request.
+                    BedrockPlugin* plugin = static_cast<BedrockPlugin*>(s->data);
+                    if (plugin) {
+                        // Call the plugin's handler.
+                        plugin->onPortRecv(s, request);
+                        if (!request.empty()) {
+                            // If it populated our request, then we'll save the plugin name so we can handle the response.
+                            request["plugin"] = plugin->getName();
+                        }
+                    } else {
+                        // Otherwise, handle any default request.
+                        int requestSize = request.deserialize(s->recvBuffer);
+                        SConsumeFront(s->recvBuffer, requestSize);
+                        deserializationAttempts++;
                     }
-                } else {
-                    // Otherwise, handle any default request.
-                    int requestSize = request.deserialize(s->recvBuffer);
-                    SConsumeFront(s->recvBuffer, requestSize);
-                    deserializationAttempts++;
-                }
 
-                // If we have a populated request, from either a plugin or our default handling, we'll queue up the
-                // command.
-                if (!request.empty()) {
-                    // If there's no ID for this request, let's add one.
-                    _addRequestID(request);
-                    SAUTOPREFIX(request["requestID"]);
-                    deserializedRequests++;
-                    // Either shut down the socket or store it so we can eventually sync out the response.
-                    if (SIEquals(request["Connection"], "forget") ||
-                        (uint64_t)request.calc64("commandExecuteTime") > STimeNow()) {
-                        // Respond immediately to make it clear we successfully queued it, but don't add to the socket
-                        // map as we don't care about the answer.
-                        SINFO("Firing and forgetting '" << request.methodLine << "'");
-                        SData response("202 Successfully queued");
-                        if (_shutdownState.load() != RUNNING) {
-                            response["Connection"] = "close";
-                        }
-                        s->send(response.serialize());
+                    // If we have a populated request, from either a plugin or our default handling, we'll queue up the
+                    // command.
+                    if (!request.empty()) {
+                        // If there's no ID for this request, let's add one.
+                        _addRequestID(request);
+                        SAUTOPREFIX(request["requestID"]);
 
-                        // If we're shutting down, discard this command, we won't wait for the future.
-                        if (_shutdownState.load() != RUNNING) {
-                            SINFO("Not queuing future command '" << request.methodLine << "' while shutting down.");
-                            break;
+                        // Trace a sample of the commands clients send us, unless they've asked for a trace already.
+                        if (_traceSampleRate && !request.isSet("traceID") && SRandom::rand64() % _traceSampleRate == 0) {
+                            request["traceID"] = SToHex(SRandom::rand64());
                         }
-                    } else {
-                        SINFO("Waiting for '" << request.methodLine << "' to complete.");
-                        SAUTOLOCK(_socketIDMutex);
-                        _socketIDMap[s->id] = s;
-                    }
+                        deserializedRequests++;
+                        // Create a command.
+                        BedrockCommand command(request);
+
+                        // If we're overloaded, and this command is low enough priority to be shed, we'll answer it
+                        // right away instead of queuing it. It still gets its place in line on the socket, so that
+                        // its response is in order with any others, even if it was meant to be fire-and-forget.
+                        const bool shed = _shouldShed(command);
+
+                        // Either shut down the socket or store it so we can eventually sync out the response.
+                        bool waitingForResponse = false;
+                        uint64_t sequence = 0;
+                        if (!shed && (SIEquals(request["Connection"], "forget") ||
+                                      (uint64_t)request.calc64("commandExecuteTime") > STimeNow())) {
+                            // Respond immediately to make it clear we successfully queued it, but don't add to the socket
+                            // map as we don't care about the answer.
+                            SINFO("Firing and forgetting '" << request.methodLine << "'");
+                            SData response("202 Successfully queued");
+                            if (_shutdownState.load() != RUNNING) {
+                                response["Connection"] = "close";
+                            }
 
-                    // Create a command.
-                    BedrockCommand command(request);
+                            // If there are earlier requests on this socket still running, this response has to wait
+                            // its turn behind them.
+                            SocketShard& shard = _getSocketShard(s->id);
+                            SAUTOLOCK(shard.mutex);
+                            auto socketIt = shard.sockets.find(s->id);
+                            if (socketIt == shard.sockets.end()) {
+                                s->send(response.serialize());
+                            } else {
+                                PendingSocket& pending = socketIt->second;
+                                string& serialized = pending.completed[pending.nextSequence++];
+                                serialized = response.serialize();
+                                _responseHold.add(serialized.size());
+                            }
 
-                    // Get the source ip of the command.
-                    char *ip = inet_ntoa(s->addr.sin_addr);
-                    if (ip != "127.0.0.1"s) {
-                        // We only add this if it's not localhost because existing code expects commands that come from
-                        // localhost to have it blank.
-                        command.request["_source"] = ip;
-                    }
+                            // If we're shutting down, discard this command, we won't wait for the future.
+                            if (_shutdownState.load() != RUNNING) {
+                                SINFO("Not queuing future command '" << request.methodLine << "' while shutting down.");
+                                break;
+                            }
+                        } else {
+                            SINFO("Waiting for '" << request.methodLine << "' to complete.");
+                            SocketShard& shard = _getSocketShard(s->id);
+                            SAUTOLOCK(shard.mutex);
+                            PendingSocket& pending = shard.sockets.emplace(s->id, PendingSocket(s)).first->second;
+                            sequence = pending.nextSequence++;
+                            waitingForResponse = true;
+                            if (SIEquals(request["Connection"], "close")) {
+                                pending.closing = true;
+                            }
+                        }
 
-                    if (command.writeConsistency != SQLiteNode::QUORUM
-                        && _syncCommands.find(command.request.methodLine) != _syncCommands.end()) {
+                        // Get the source ip of the command.
+                        char ip[INET_ADDRSTRLEN];
+                        inet_ntop(AF_INET, &s->addr.sin_addr, ip, INET_ADDRSTRLEN);
+                        if (ip != "127.0.0.1"s) {
+                            // We only add this if it's not localhost because existing code expects commands that come from
+                            // localhost to have it blank.
+                            command.request["_source"] = ip;
+                        }
 
-                        command.writeConsistency = SQLiteNode::QUORUM;
-                        SINFO("Forcing QUORUM consistency for command " << command.request.methodLine);
-                    }
+                        if (command.writeConsistency != SQLiteNode::QUORUM
+                            && _syncCommands.find(command.request.methodLine) != _syncCommands.end()) {
 
-                    // This is important! All commands passed through the entire cluster must have unique IDs, or they
-                    // won't get routed properly from slave to master and back.
-                    command.id = _args["-nodeName"] + "#" + to_string(_requestCount++);
+                            command.writeConsistency = SQLiteNode::QUORUM;
+                            SINFO("Forcing QUORUM consistency for command " << command.request.methodLine);
+                        }
 
-                    // And we and keep track of the client that initiated this command, so we can respond later, except
-                    // if we received connection:forget in which case we don't respond later
-                    command.initiatingClientID = SIEquals(request["Connection"], "forget") ? -1 : s->id;
+                        // This is important! All commands passed through the entire cluster must have unique IDs, or they
+                        // won't get routed properly from slave to master and back.
+                        command.id = _args["-nodeName"] + "#" + to_string(_requestCount++);
+
+                        // And we and keep track of the client that initiated this command, so we can respond later, except
+                        // if we already responded above, in which case we don't respond later. The sequence number is
+                        // where this response goes among any others pipelined on the same socket.
+                        command.initiatingClientID = waitingForResponse ? s->id : -1;
+                        command.initiatingClientSequence = sequence;
+
+                        // A client that's told us how long it will wait for a response gets a 555 rather than having
+                        // its command run after that. This deadline also goes with the command if it's escalated.
+                        if (waitingForResponse && request.isSet("clientTimeout")) {
+                            const uint64_t clientTimeoutUS = request.calcU64("clientTimeout") * STIME_US_PER_MS;
+                            command.deadline = command.creationTime + clientTimeoutUS;
+                        }
 
-                    // If it's a status or control command, we handle it specially there. If not, we'll queue it for
-                    // later processing.
-                    if (!_handleIfStatusOrControlCommand(command)) {
-                        auto _syncNodeCopy = _syncNode;
-                        if (_syncNodeCopy && _syncNodeCopy->getState() == SQLiteNode::STANDINGDOWN) {
-                            _standDownQueue.push(move(command));
-                        } else {
-                            SINFO("Queued new '" << command.request.methodLine << "' command from local client, with "
-                                  << _commandQueue.size() << " commands already queued.");
-                            _commandQueue.push(move(command));
+                        // If it's a status or control command, we handle it specially there (on the main thread). If not,
+                        // we'll queue it for later processing.
+                        if (shed) {
+                            SINFO("Shedding '" << command.request.methodLine << "' at priority " << command.priority
+                                  << ", with " << _commandQueue.size() << " commands already queued.");
+                            _shedCommandCount++;
+                            _commandsInProgress++;
+                            command.response.methodLine = "503 Server overloaded";
+                            _reply(command);
+                        } else if (ioThread && (_isStatusCommand(command) || _isControlCommand(command))) {
+                            _ioStatusCommands.push(move(command));
+                        } else if (!_handleIfStatusOrControlCommand(command)) {
+                            auto _syncNodeCopy = _syncNode;
+                            if (_syncNodeCopy && _syncNodeCopy->getState() == SQLiteNode::STANDINGDOWN) {
+                                _standDownHold.add(command);
+                                _standDownQueue.push(move(command));
+                            } else {
+                                SINFO("Queued new '" << command.request.methodLine << "' command from local client, with "
+                                      << _commandQueue.size() << " commands already queued.");
+                                _commandQueue.push(move(command));
+                            }
                         }
-                    }
-                } else {
-                    SAUTOLOCK(_socketIDMutex);
-                    // If we weren't able to deserialize a complete request, and we're shutting down, give up.
-                    if (_shutdownState.load() != RUNNING && lastChance && lastChance < STimeNow() && _socketIDMap.find(s->id) == _socketIDMap.end()) {
-                        SINFO("Closing socket " << s->id << " with incomplete data and no pending command: shutting down.");
-                        socketsToClose.push_back(s);
+                    } else {
+                        SocketShard& shard = _getSocketShard(s->id);
+                        SAUTOLOCK(shard.mutex);
+                        // If we weren't able to deserialize a complete request, and we're shutting down, give up.
+                        if (_shutdownState.load() != RUNNING && lastChance && lastChance < STimeNow() && !SContains(shard.sockets, s->id)) {
+                            SINFO("Closing socket " << s->id << " with incomplete data and no pending command: shutting down.");
+                            socketsToClose.push_back(s);
+                        }
+                        break;
                     }
                 }
             }
@@ -1399,53 +2097,13 @@ void BedrockServer::postPoll(fd_map& fdm, uint64_t& nextActivity) {
         }
     }
 
-    // Log the timing of this loop.
-    uint64_t readElapsedMS = (STimeNow() - acceptEndTime) / 1000;
-    SINFO("Read from " << socketList.size() << " sockets, attempted to deserialize " << deserializationAttempts
-          << " commands, " << deserializedRequests << " were complete and deserialized in " << readElapsedMS << "ms.");
-
     // Now we can close any sockets that we need to.
     for (auto s: socketsToClose) {
-        closeSocket(s);
-    }
-
-    // If any plugin timers are firing, let the plugins know.
-    for (auto plugin : plugins) {
-        for (SStopwatch* timer : plugin->timers) {
-            if (timer->ding()) {
-                plugin->timerFired(timer);
-            }
-        }
-    }
-
-    // If we've been told to start shutting down, we'll set the lastChance timer.
-    if (_shutdownState.load() == START_SHUTDOWN) {
-        if (!lastChance) {
-            lastChance = STimeNow() + 5 * 1'000'000; // 5 seconds from now.
-        }
-        // If we've run out of sockets or hit our timeout, we'll increment _shutdownState.
-        if (socketList.empty() || _gracefulShutdownTimeout.ringing()) {
-            lastChance = 0;
-
-            // We empty the socket list here, we will no longer allow new requests to come in, as the sync node can
-            // shutdown any time after here, and we'll have no way to handle new requests.
-            if (socketList.size()) {
-                SAUTOLOCK(_socketIDMutex);
-                SINFO("Killing " << socketList.size() << " remaining sockets at graceful shutdown timeout.");
-                while(socketList.size()) {
-                    auto s = socketList.front();
-                    _socketIDMap.erase(s->id);
-                    closeSocket(s);
-                }
-            }
-            _shutdownState.store(CLIENTS_RESPONDED);
-        }
+        manager.closeSocket(s);
     }
 }
 
 void BedrockServer::_reply(BedrockCommand& command) {
-    SAUTOLOCK(_socketIDMutex);
-
     // Finalize timing info even for commands we won't respond to (this makes this data available in logs).
     command.finalizeTimingInfo();
 
@@ -1456,8 +2114,12 @@ void BedrockServer::_reply(BedrockCommand& command) {
     }
 
     // Do we have a socket for this command?
-    auto socketIt = _socketIDMap.find(command.initiatingClientID);
-    if (socketIt != _socketIDMap.end()) {
+    SocketShard& shard = _getSocketShard(command.initiatingClientID);
+    SAUTOLOCK(shard.mutex);
+    auto socketIt = shard.sockets.find(command.initiatingClientID);
+    if (socketIt != shard.sockets.end()) {
+        PendingSocket& pending = socketIt->second;
+        Socket* socket = pending.socket;
         command.response["nodeName"] = _args["-nodeName"];
 
         // Is a plugin handling this command? If so, it gets to send the response.
@@ -1469,27 +2131,53 @@ void BedrockServer::_reply(BedrockCommand& command) {
         }
 
         if (!pluginName.empty()) {
-            // Let the plugin handle it
+            // Let the plugin handle it. We only ever have one command outstanding on a plugin's socket, so this is
+            // always next in line.
             SINFO("Plugin '" << pluginName << "' handling response '" << command.response.methodLine
                   << "' to request '" << command.request.methodLine << "'");
             BedrockPlugin* plugin = BedrockPlugin::getPluginByName(pluginName);
             if (plugin) {
-                plugin->onPortRequestComplete(command, socketIt->second);
+                plugin->onPortRequestComplete(command, socket);
             } else {
                 SERROR("Couldn't find plugin '" << pluginName << ".");
             }
+            pending.nextReply++;
+        } else if (command.initiatingClientSequence != pending.nextReply) {
+            // An earlier request on this socket hasn't finished yet, so this response waits for it.
+            SINFO("Holding response to '" << command.request.methodLine << "' until "
+                  << (command.initiatingClientSequence - pending.nextReply) << " earlier requests complete.");
+            string& serialized = pending.completed[command.initiatingClientSequence];
+            serialized = command.response.serialize();
+            _responseHold.add(serialized.size());
         } else {
-            // Otherwise we send the standard response.
-            socketIt->second->send(command.response.serialize());
+            // Otherwise we send the standard response. When we can, the headers and content go out separately, so a
+            // large response body isn't copied into a second string just to be written to the socket.
+            const string headers = command.response.serializeHeaders();
+            if (headers.empty()) {
+                socket->send(command.response.serialize());
+            } else {
+                socket->send(headers, command.response.content);
+            }
+            pending.nextReply++;
         }
 
-        // If `Connection: close` was set, shut down the socket, in case the caller ignores us.
-        if (SIEquals(command.request["Connection"], "close") || _shutdownState.load() != RUNNING) {
-            shutdownSocket(socketIt->second, SHUT_RDWR);
+        // Send any responses that were waiting on this one.
+        while (!pending.completed.empty() && pending.completed.begin()->first == pending.nextReply) {
+            socket->send(pending.completed.begin()->second);
+            _responseHold.remove(pending.completed.begin()->second.size());
+            pending.completed.erase(pending.completed.begin());
+            pending.nextReply++;
         }
 
         // We only keep track of sockets with pending commands.
-        _socketIDMap.erase(socketIt);
+        if (pending.nextReply == pending.nextSequence) {
+            // If `Connection: close` was set, shut down the socket, in case the caller ignores us. Nothing is read
+            // after a request like that, so once it's been answered, the socket has nothing left to send.
+            if (pending.closing || _shutdownState.load() != RUNNING) {
+                shutdownSocket(socket, SHUT_RDWR);
+            }
+            shard.sockets.erase(socketIt);
+        }
     }
     else if (!SIEquals(command.request["Connection"], "forget")) {
         SINFO("No socket to reply for: '" << command.request.methodLine << "' #" << command.initiatingClientID);
@@ -1518,36 +2206,149 @@ void BedrockServer::suppressCommandPort(const string& reason, bool suppress, boo
             _portPluginMap.clear();
             _commandPort = nullptr;
         }
+        for (auto& io : _ioThreads) {
+            io.server.closePorts();
+        }
     } else {
         // Clearing past suppression, but don't reopen (It's always safe to close, but not always safe to open).
         SHMMM("Clearing command port suppression");
     }
 }
 
+bool BedrockServer::_discardIfAbandoned(BedrockCommand& command) {
+    if (command.initiatingClientID <= 0 || command.complete || command.httpsRequests.size()) {
+        return false;
+    }
+    {
+        SocketShard& shard = _getSocketShard(command.initiatingClientID);
+        SAUTOLOCK(shard.mutex);
+        if (!SContains(shard.sockets, (uint64_t)command.initiatingClientID)) {
+            SINFO("Discarding '" << command.request.methodLine << "', its client disconnected while it was queued.");
+            _abandonedCommandCount++;
+            _commandsInProgress--;
+            return true;
+        }
+    }
+    if (command.deadline && STimeNow() >= command.deadline) {
+        SINFO("Discarding '" << command.request.methodLine << "', its clientTimeout passed while it was queued.");
+        _abandonedCommandCount++;
+        command.response.methodLine = "555 Timeout";
+        command.complete = true;
+        _reply(command);
+        return true;
+    }
+    return false;
+}
+
+void BedrockServer::_forgetSocket(uint64_t socketID) {
+    SocketShard& shard = _getSocketShard(socketID);
+    SAUTOLOCK(shard.mutex);
+    auto socketIt = shard.sockets.find(socketID);
+    if (socketIt == shard.sockets.end()) {
+        return;
+    }
+    for (auto& response : socketIt->second.completed) {
+        _responseHold.remove(response.second.size());
+    }
+    shard.sockets.erase(socketIt);
+}
+
+bool BedrockServer::_shouldShed(BedrockCommand& command) {
+    // Find the strictest limits that apply at this command's priority: those listed for it or any higher priority.
+    auto depthIt = _shedDepthLimits.lower_bound(command.priority);
+    auto ageIt = _shedAgeLimitsUS.lower_bound(command.priority);
+
+    // Any full hold sheds commands at every priority, unless it makes room for them itself by expiring its oldest.
+    auto syncNode = _syncNode;
+    bool holdFull = false;
+    for (auto& hold : _getHolds(syncNode.get())) {
+        const bool expires = _expireHeldCommands && (hold.first == "escalated" || hold.first == "futureCommit");
+        if (hold.second->full() && !expires) {
+            holdFull = true;
+            break;
+        }
+    }
+    if (!holdFull && depthIt == _shedDepthLimits.end() && ageIt == _shedAgeLimitsUS.end()) {
+        return false;
+    }
+
+    // Status and control commands are how an operator finds out what's going on, so they're never shed.
+    if (_isStatusCommand(command) || _isControlCommand(command)) {
+        return false;
+    }
+    if (holdFull) {
+        return true;
+    }
+    if (depthIt != _shedDepthLimits.end()) {
+        const size_t depth = _commandQueue.size() + _syncNodeQueuedCommands.size();
+        for (auto it = depthIt; it != _shedDepthLimits.end(); it++) {
+            if (depth >= it->second) {
+                return true;
+            }
+        }
+    }
+    for (auto it = ageIt; it != _shedAgeLimitsUS.end(); it++) {
+        if (_commandQueue.getRecentWaitUS(it->first) >= it->second) {
+            return true;
+        }
+    }
+    return false;
+}
+
+list<pair<string, const SQLiteCommandHold*>> BedrockServer::_getHolds(const SQLiteNode* node) {
+    list<pair<string, const SQLiteCommandHold*>> holds = {
+        {"futureCommit", &_futureCommitHold},
+        {"https", &_httpsHold},
+        {"standDown", &_standDownHold},
+        {"responses", &_responseHold},
+    };
+    if (node) {
+        holds.emplace_front("escalated", &node->getEscalatedHold());
+    }
+    return holds;
+}
+
 bool BedrockServer::_isStatusCommand(BedrockCommand& command) {
     if (SIEquals(command.request.methodLine, STATUS_IS_SLAVE)          ||
         SIEquals(command.request.methodLine, STATUS_HANDLING_COMMANDS) ||
         SIEquals(command.request.methodLine, STATUS_PING)              ||
         SIEquals(command.request.methodLine, STATUS_STATUS)            ||
         SIEquals(command.request.methodLine, STATUS_BLACKLIST)         ||
-        SIEquals(command.request.methodLine, STATUS_MULTIWRITE)) {
+        SIEquals(command.request.methodLine, STATUS_MULTIWRITE)        ||
+        SIEquals(command.request.methodLine, STATUS_TIMING)            ||
+        SIEquals(command.request.methodLine, STATUS_TRACES)            ||
+        SIEquals(command.request.methodLine, STATUS_SLOW_QUERIES)      ||
+        SIEquals(command.request.methodLine, STATUS_METRICS)) {
         return true;
     }
     return false;
 }
 
 list<STable> BedrockServer::getPeerInfo() {
-    SAUTOLOCK(_syncMutex);
-    list<STable> peerData;
-    auto _syncNodeCopy = _syncNode;
-    if (_syncNodeCopy) {
-        for (SQLiteNode::Peer* peer : _syncNodeCopy->peerList) {
-            peerData.emplace_back(peer->nameValueMap);
-            peerData.back()["host"] = peer->host;
-            peerData.back()["name"] = peer->name;
-        }
+    auto status = atomic_load(&_syncStatus);
+    return status ? status->peers : list<STable>();
+}
+
+void BedrockServer::_publishSyncStatus(SQLiteNode* node) {
+    auto status = make_shared<SyncStatus>();
+    if (node) {
+        status->available = true;
+        status->commitCount = node->getCommitCount();
+        status->cacheHits = node->getCacheHits();
+        status->cacheMisses = node->getCacheMisses();
+        status->priority = node->getPriority();
+        for (SQLiteNode::Peer* peer : node->peerList) {
+            status->peers.emplace_back(peer->nameValueMap);
+            status->peers.back()["host"] = peer->host;
+            status->peers.back()["name"] = peer->name;
+        }
+        status->escalatedCommands = node->getEscalatedCommandRequestMethodLines();
+        _syncNodeQueuedCommands.each([&status](auto& item){
+            status->queuedCommands.push_back(item.request.methodLine);
+        });
     }
-    return peerData;
+    atomic_store(&_syncStatus, shared_ptr<const SyncStatus>(move(status)));
+    _syncStatusPublished = STimeNow();
 }
 
 void BedrockServer::setDetach(bool detach) {
@@ -1624,52 +2425,63 @@ void BedrockServer::_status(BedrockCommand& command) {
             content["crashCommands"] = totalCount;
         }
 
+        // How many workers are currently in the pool.
+        content["activeWorkerThreads"] = to_string(_activeWorkerThreads.load());
+
+        // How many commands have been turned away because we were overloaded.
+        content["shedCommands"] = to_string(_shedCommandCount.load());
+
+        // How many commands were dropped because their clients had disconnected or timed out.
+        content["abandonedCommands"] = to_string(_abandonedCommandCount.load());
+
+        // The current or last live backup, if there's been one.
+        {
+            lock_guard<mutex> lock(_backupMutex);
+            if (!_backupStatus.empty()) {
+                content["backup"] = SComposeJSONObject(_backupStatus);
+            }
+        }
+
+        // How often queries have had to wait on a locked database.
+        content["busyRetries"] = to_string(SQueryBusyRetryCount());
+        content["busyWaitUS"] = to_string(SQueryBusyWaitUS());
+
+        // What each plugin, and each verb it handles, has cost us.
+        content["resourceUsage"] = SComposeJSONObject(BedrockCore::getResourceUsage());
+
         // On master, return the current multi-write blacklists.
         if (state == SQLiteNode::MASTERING) {
             // Both of these need to be in the correct state for multi-write to be enabled.
             bool multiWriteOn =  _multiWriteEnabled.load() && !_suppressMultiWrite;
             content["multiWriteEnabled"] = multiWriteOn ? "true" : "false";
             content["multiWriteManualBlacklist"] = SComposeJSONArray(_blacklistedParallelCommands);
+            content["multiWriteAutoBlacklist"] = SComposeJSONArray(_getAutoBlacklist());
         }
 
-        // We read from syncNode internal state here, so we lock to make sure that this doesn't conflict with the sync
-        // thread.
-        list<STable> peerData = getPeerInfo();
-        list<string> escalated;
-        {
-            SAUTOLOCK(_syncMutex);
-
-            // There's no syncNode when the server is detached, so we can't get this data.
-            auto _syncNodeCopy = _syncNode;
-            if (_syncNodeCopy) {
-                content["syncNodeAvailable"] = "true";
-                // Set some information about this node.
-                content["CommitCount"] = to_string(_syncNodeCopy->getCommitCount());
-                content["priority"] = to_string(_syncNodeCopy->getPriority());
-
-                // Get any escalated commands that are waiting to be processed.
-                escalated = _syncNodeCopy->getEscalatedCommandRequestMethodLines();
-            } else {
-                content["syncNodeAvailable"] = "false";
-            }
-        }
-
-        // Coalesce all of the peer data into one value to return.
+        // What we know of the sync node and the queues comes from the snapshots the sync and main threads publish, so
+        // this doesn't have to wait on either of them. There's no sync node when the server is detached, so there's
+        // nothing to report for it then.
+        auto syncStatus = atomic_load(&_syncStatus);
         list<string> peerList;
-        for (const STable& peerTable : peerData) {
-            peerList.push_back(SComposeJSONObject(peerTable));
+        if (syncStatus && syncStatus->available) {
+            content["syncNodeAvailable"] = "true";
+            content["CommitCount"] = to_string(syncStatus->commitCount);
+            content["cacheHits"] = to_string(syncStatus->cacheHits);
+            content["cacheMisses"] = to_string(syncStatus->cacheMisses);
+            content["priority"] = to_string(syncStatus->priority);
+            for (const STable& peerTable : syncStatus->peers) {
+                peerList.push_back(SComposeJSONObject(peerTable));
+            }
+            content["syncThreadQueuedCommandList"] = SComposeJSONArray(syncStatus->queuedCommands);
+            content["escalatedCommandList"]        = SComposeJSONArray(syncStatus->escalatedCommands);
+        } else {
+            content["syncNodeAvailable"] = "false";
+            content["syncThreadQueuedCommandList"] = "[]";
+            content["escalatedCommandList"]        = "[]";
         }
-
-        // We can use the `each` functionality to pass a lambda that will grab each method line in
-        // `_syncNodeQueuedCommands`.
-        list<string> syncNodeQueuedMethods;
-        _syncNodeQueuedCommands.each([&syncNodeQueuedMethods](auto& item){
-            syncNodeQueuedMethods.push_back(item.request.methodLine);
-        });
+        auto queuedCommands = atomic_load(&_queuedCommandStatus);
         content["peerList"]                    = SComposeJSONArray(peerList);
-        content["queuedCommandList"]           = SComposeJSONArray(_commandQueue.getRequestMethodLines());
-        content["syncThreadQueuedCommandList"] = SComposeJSONArray(syncNodeQueuedMethods);
-        content["escalatedCommandList"]        = SComposeJSONArray(escalated);
+        content["queuedCommandList"]           = queuedCommands ? SComposeJSONArray(*queuedCommands) : "[]";
 
         // Done, compose the response.
         response.methodLine = "200 OK";
@@ -1704,6 +2516,132 @@ void BedrockServer::_status(BedrockCommand& command) {
             response.methodLine = "500 Must Specify 'Enable'";
         }
     }
+
+    // Latency percentiles and throughput for each command verb, so these don't need to be scraped from the logs.
+    else if (SIEquals(request.methodLine, STATUS_TIMING)) {
+        response.methodLine = "200 OK";
+        response.content = SComposeJSONObject(BedrockCommand::getTimingStats());
+    }
+
+    // The spans this node has recorded for traced commands, optionally only those for a given `traceID`.
+    else if (SIEquals(request.methodLine, STATUS_TRACES)) {
+        list<string> spans;
+        for (auto& span : SQLiteCommand::getTraceSpans(request["traceID"])) {
+            span["nodeName"] = _args["-nodeName"];
+            spans.push_back(SComposeJSONObject(span));
+        }
+        STable content;
+        content["spans"] = SComposeJSONArray(spans);
+        response.methodLine = "200 OK";
+        response.content = SComposeJSONObject(content);
+    }
+
+    // The slow queries this node has kept, with their query plans and the commands that ran them.
+    else if (SIEquals(request.methodLine, STATUS_SLOW_QUERIES)) {
+        list<string> queries;
+        for (const auto& query : SSlowQueryLogGet()) {
+            queries.push_back(SComposeJSONObject(query));
+        }
+        STable content;
+        content["queries"] = SComposeJSONArray(queries);
+        response.methodLine = "200 OK";
+        response.content = SComposeJSONObject(content);
+    }
+
+    // Prometheus-style metrics. Everything here is read from counters and gauges that are kept up to date as we go,
+    // so this is cheap enough to scrape frequently.
+    else if (SIEquals(request.methodLine, STATUS_METRICS)) {
+        response.methodLine = "HTTP/1.1 200 OK";
+        response["Content-Type"] = "text/plain; version=0.0.4";
+        response.content = _composeMetrics();
+    }
+}
+
+string BedrockServer::_composeMetrics() {
+    ostringstream out;
+    auto metric = [&out](const string& name, const string& type, const string& help,
+                         const list<pair<string, string>>& samples) {
+        out << "# HELP " << name << " " << help << "\n";
+        out << "# TYPE " << name << " " << type << "\n";
+        for (const auto& sample : samples) {
+            out << name << sample.first << " " << sample.second << "\n";
+        }
+    };
+    auto seconds = [](uint64_t us) {
+        return SToStr((double)us / STIME_US_PER_S);
+    };
+
+    metric("bedrock_commit_lock_wait_seconds_total", "counter", "Time spent waiting for the commit lock.",
+           {{"", seconds(SQLite::g_commitLock.getTotalWaitUS())}});
+    metric("bedrock_commit_lock_hold_seconds_total", "counter", "Time spent holding the commit lock.",
+           {{"", seconds(SQLite::g_commitLock.getTotalLockUS())}});
+    metric("bedrock_commit_lock_acquisitions_total", "counter", "Number of times the commit lock was acquired.",
+           {{"", SToStr(SQLite::g_commitLock.getAcquisitions())}});
+    auto quantiles = [&seconds](const SHistogram& histogram) {
+        return list<pair<string, string>>{
+            {"{quantile=\"0.5\"}", seconds(histogram.percentile(50))},
+            {"{quantile=\"0.99\"}", seconds(histogram.percentile(99))},
+            {"{quantile=\"0.999\"}", seconds(histogram.percentile(99.9))},
+        };
+    };
+    metric("bedrock_commit_lock_wait_seconds", "summary", "Sampled time spent waiting for the commit lock.",
+           quantiles(SQLite::g_commitLock.getWaitHistogram()));
+    metric("bedrock_commit_lock_hold_seconds", "summary", "Sampled time spent holding the commit lock.",
+           quantiles(SQLite::g_commitLock.getHoldHistogram()));
+    metric("bedrock_commit_conflicts_total", "counter", "Commits that failed because they conflicted with another.",
+           {{"", SToStr(SQLite::commitConflicts.load())}});
+    metric("bedrock_checkpoints_total", "counter", "Number of WAL checkpoints run.",
+           {{"{type=\"passive\"}", SToStr(SQLite::passiveCheckpoints.load())},
+            {"{type=\"full\"}", SToStr(SQLite::fullCheckpoints.load())}});
+    metric("bedrock_checkpoint_seconds_total", "counter", "Time spent running WAL checkpoints.",
+           {{"{type=\"passive\"}", seconds(SQLite::passiveCheckpointUS.load())},
+            {"{type=\"full\"}", seconds(SQLite::fullCheckpointUS.load())}});
+    metric("bedrock_log_dropped_lines_total", "counter", "Log lines dropped because a thread's log buffer was full.",
+           {{"", SToStr(SLogDroppedLines())}});
+    metric("bedrock_command_queue_depth", "gauge", "Commands waiting for a worker.",
+           {{"", SToStr(_commandQueue.size())}});
+    metric("bedrock_sync_queue_depth", "gauge", "Commands waiting for the sync thread.",
+           {{"", SToStr(_syncNodeQueuedCommands.size())}});
+    metric("bedrock_shed_commands_total", "counter", "Commands rejected with a 503 because the node was overloaded.",
+           {{"", SToStr(_shedCommandCount.load())}});
+    metric("bedrock_abandoned_commands_total", "counter",
+           "Commands dropped before running because their clients had disconnected or timed out.",
+           {{"", SToStr(_abandonedCommandCount.load())}});
+    metric("bedrock_commands_in_progress", "gauge", "Commands accepted but not yet replied to.",
+           {{"", SToStr(_commandsInProgress.load())}});
+    auto syncNode = _syncNode;
+    list<pair<string, string>> heldCommands, heldBytes, expiredCommands;
+    for (auto& hold : _getHolds(syncNode.get())) {
+        const string label = "{area=\"" + hold.first + "\"}";
+        heldCommands.emplace_back(label, SToStr(hold.second->count()));
+        heldBytes.emplace_back(label, SToStr(hold.second->bytes()));
+        expiredCommands.emplace_back(label, SToStr(hold.second->expired.load()));
+    }
+    metric("bedrock_held_commands", "gauge", "Commands held waiting on something other than a worker.", heldCommands);
+    metric("bedrock_held_bytes", "gauge", "Approximate bytes taken by held commands.", heldBytes);
+    metric("bedrock_held_commands_expired_total", "counter", "Held commands answered with a 555 to make room.",
+           expiredCommands);
+    metric("bedrock_mastering", "gauge", "1 if this node is master.",
+           {{"", _replicationState.load() == SQLiteNode::MASTERING ? "1" : "0"}});
+
+    // Replication lag is how many commits each peer is behind us, as of the last state it reported.
+    auto syncStatus = atomic_load(&_syncStatus);
+    const uint64_t commitCount = syncStatus ? syncStatus->commitCount : 0;
+    list<pair<string, string>> lag;
+    for (const STable& peer : syncStatus ? syncStatus->peers : list<STable>()) {
+        // Peers we haven't heard from yet don't have a commit count to compare.
+        auto it = peer.find("CommitCount");
+        if (it == peer.end()) {
+            continue;
+        }
+        uint64_t peerCommitCount = SToUInt64(it->second);
+        lag.emplace_back("{peer=\"" + peer.at("name") + "\"}",
+                         SToStr(commitCount > peerCommitCount ? commitCount - peerCommitCount : 0));
+    }
+    metric("bedrock_commit_count", "counter", "The number of commits in this node's database.",
+           {{"", SToStr(commitCount)}});
+    metric("bedrock_peer_replication_lag_commits", "gauge", "How many commits each peer is behind this node.", lag);
+    return out.str();
 }
 
 bool BedrockServer::_isControlCommand(BedrockCommand& command) {
@@ -1724,7 +2662,41 @@ bool BedrockServer::_isControlCommand(BedrockCommand& command) {
 void BedrockServer::_control(BedrockCommand& command) {
     SData& response = command.response;
     response.methodLine = "200 OK";
-    if (SIEquals(command.request.methodLine, "BeginBackup")) {
+    if (SIEquals(command.request.methodLine, "BeginBackup") && command.request.test("live")) {
+        // Copy the database on a thread of our own, without detaching. With `since`, only the commits after that
+        // one are copied, as an incremental backup on top of an earlier one.
+        const string dbFile = basename((char*)_args["-db"].c_str());
+        const bool incremental = command.request.isSet("since");
+        const uint64_t since = command.request.calcU64("since");
+        string path = command.request["path"];
+        if (path.empty()) {
+            path = "/var/tmp/" + dbFile + (incremental ? ".since" + to_string(since) : "");
+        }
+        const uint64_t bytesPerSecond = command.request.isSet("bytesPerSecond") ?
+                                        command.request.calcU64("bytesPerSecond") :
+                                        _args.calcU64("-backupBytesPerSecond");
+        lock_guard<mutex> lock(_backupMutex);
+        if (_backupRunning) {
+            response.methodLine = "409 Backup already running";
+        } else if (!_maxWorkerThreads) {
+            response.methodLine = "503 Database not open";
+        } else {
+            if (_backupThread.joinable()) {
+                _backupThread.join();
+            }
+            _backupRunning = true;
+            _backupStatus.clear();
+            _backupStatus["state"] = "running";
+            _backupStatus["path"] = path;
+            _backupStatus["started"] = to_string(STimeNow());
+            if (incremental) {
+                _backupStatus["since"] = to_string(since);
+            }
+            _backupThread = thread(&BedrockServer::_backup, this, path, incremental, since, bytesPerSecond);
+            response.methodLine = "202 Backup started";
+            response["path"] = path;
+        }
+    } else if (SIEquals(command.request.methodLine, "BeginBackup")) {
         _shouldBackup = true;
         _beginShutdown("Detach", true);
     } else if (SIEquals(command.request.methodLine, "SuppressCommandPort")) {
@@ -1734,6 +2706,8 @@ void BedrockServer::_control(BedrockCommand& command) {
     } else if (SIEquals(command.request.methodLine, "ClearCrashCommands")) {
         unique_lock<decltype(_crashCommandMutex)> lock(_crashCommandMutex);
         _crashCommands.clear();
+        _crashMatchers.clear();
+        _hasCrashCommands = false;
     } else if (SIEquals(command.request.methodLine, "Detach")) {
         response.methodLine = "203 DETACHING";
         _beginShutdown("Detach", true);
@@ -1790,7 +2764,7 @@ void BedrockServer::_prePollPlugins(fd_map& fdm) {
     }
 }
 
-void BedrockServer::_postPollPlugins(fd_map& fdm, uint64_t nextActivity) {
+void BedrockServer::_postPollPlugins(fd_map& fdm, uint64_t& nextActivity) {
     for (auto plugin : plugins) {
         for (auto manager : plugin->httpsManagers) {
             list<SHTTPSManager::Transaction*> completedHTTPSRequests;
@@ -1834,6 +2808,9 @@ void BedrockServer::_beginShutdown(const string& reason, bool detach) {
             closePorts();
             _controlPort = nullptr;
         }
+        for (auto& io : _ioThreads) {
+            io.server.closePorts();
+        }
         _portPluginMap.clear();
         _commandPort = nullptr;
         _shutdownState.store(START_SHUTDOWN);
@@ -1845,6 +2822,30 @@ bool BedrockServer::shouldBackup() {
     return _shouldBackup;
 }
 
+void BedrockServer::_backup(string path, bool incremental, uint64_t since, uint64_t bytesPerSecond) {
+    SInitialize("backup");
+    SINFO("Starting " << (incremental ? "incremental " : "") << "live backup to '" << path << "'"
+          << (bytesPerSecond ? " at " + to_string(bytesPerSecond) + " bytes/s." : "."));
+
+    // This handle only reads, but it needs to know about every journal table to find the commits in them.
+    const int maxJournalTableID = _maxWorkerThreads + max(0, _args.calc("-slaveApplyThreads")) - 1;
+    uint64_t commitCount = 0;
+    bool success = false;
+    {
+        SQLite db(_args["-db"], _getCacheSizePerHandle(_args, _maxWorkerThreads), false, _args.calc("-maxJournalSize"),
+                  -1, maxJournalTableID, _args["-synchronous"]);
+        success = incremental ? db.createIncrementalBackup(path, since, bytesPerSecond, commitCount, &_backupCancel)
+                              : db.createSnapshot(path, bytesPerSecond, &commitCount, &_backupCancel);
+    }
+    SINFO("Live backup to '" << path << "' " << (success ? "complete" : "failed") << " at commit #" << commitCount);
+
+    lock_guard<mutex> lock(_backupMutex);
+    _backupStatus["state"] = success ? "complete" : "failed";
+    _backupStatus["commitCount"] = to_string(commitCount);
+    _backupStatus["finished"] = to_string(STimeNow());
+    _backupRunning = false;
+}
+
 SData BedrockServer::_generateCrashMessage(const BedrockCommand* command) {
     SData message("CRASH_COMMAND");
     SData subMessage(command->request.methodLine);
@@ -1888,6 +2889,20 @@ void BedrockServer::onNodeLogin(SQLiteNode::Peer* peer)
     }
 }
 
+void BedrockServer::_requeueFutureCommitCommands(uint64_t commitCount) {
+    SAUTOLOCK(_futureCommitCommandMutex);
+    auto it = _futureCommitCommands.begin();
+    while (it != _futureCommitCommands.end() && (it->first <= commitCount || _shutdownState.load() != RUNNING)) {
+        SINFO("Returning command (" << it->second.request.methodLine << ") waiting on commit " << it->first
+              << " to queue, now have commit " << commitCount);
+        _futureCommitHold.remove(it->second);
+        _commandQueue.push(move(it->second));
+        _commandsInProgress--;
+        it++;
+    }
+    _futureCommitCommands.erase(_futureCommitCommands.begin(), it);
+}
+
 void BedrockServer::_finishPeerCommand(BedrockCommand& command) {
     // See if we're supposed to forget this command (because the slave is not listening for a response).
     auto it = command.request.nameValueMap.find("Connection");
@@ -1921,6 +2936,51 @@ void BedrockServer::_acceptSockets() {
     }
 }
 
+void BedrockServer::_ioThreadLoop(IOThread& io, int threadID) {
+    SInitialize("io" + to_string(threadID));
+    while (!_ioThreadsExit.load()) {
+        // Wait for activity on our sockets. Workers can write to these sockets at any time, and anything they can't
+        // send immediately waits for our next loop, so we don't wait long. We don't need their shards' locks for this,
+        // as sockets lock themselves around sending and receiving, and only this thread ever adds or removes them.
+        fd_map fdm;
+        io.server.prePoll(fdm);
+        S_poll(fdm, 100'000);
+        io.server.postPoll(fdm);
+
+        // Once the main thread is done waiting for clients during shutdown, we drop whatever we still have.
+        SHUTDOWN_STATE state = _shutdownState.load();
+        if (state != RUNNING && state != START_SHUTDOWN) {
+            if (io.server.socketList.size()) {
+                SINFO("Killing " << io.server.socketList.size() << " remaining sockets at shutdown.");
+                while (io.server.socketList.size()) {
+                    auto s = io.server.socketList.front();
+                    _forgetSocket(s->id);
+                    io.server.closeSocket(s);
+                }
+            }
+        } else {
+            // Accept any new connections, and then read and queue whatever requests they've sent.
+            while (io.server.acceptSocket()) {}
+            int deserializationAttempts = 0;
+            int deserializedRequests = 0;
+            _readRequests(io.server, true, deserializationAttempts, deserializedRequests);
+            if (deserializedRequests) {
+                SINFO("Read from " << io.server.socketList.size() << " sockets, attempted to deserialize "
+                      << deserializationAttempts << " commands, " << deserializedRequests << " were complete.");
+            }
+        }
+        io.socketCount.store(io.server.socketList.size());
+    }
+
+    // Close our port and anything that's still connected.
+    io.server.closePorts();
+    while (io.server.socketList.size()) {
+        auto s = io.server.socketList.front();
+        _forgetSocket(s->id);
+        io.server.closeSocket(s);
+    }
+}
+
 void BedrockServer::waitForHTTPS(BedrockCommand&& command) {
     lock_guard<mutex> lock(_httpsCommandMutex);
 
@@ -1929,11 +2989,33 @@ void BedrockServer::waitForHTTPS(BedrockCommand&& command) {
 
     // And we keep it in a set of all commands with outstanding HTTPS requests.
     _outstandingHTTPSCommands.insert(commandPtr);
+    _httpsHold.add(*commandPtr);
 
     // Insert each request pointing at the given object.
     for (auto request : commandPtr->httpsRequests) {
         _outstandingHTTPSRequests.emplace(make_pair(request, commandPtr));
     }
+
+    // Have the HTTPS thread start watching these requests' sockets.
+    _httpsWakeQueue.push(true);
+}
+
+void BedrockServer::_httpsThreadLoop() {
+    SInitialize("https");
+    uint64_t nextActivity = STimeNow();
+    while (!_httpsThreadExit.load()) {
+        fd_map fdm;
+        _prePollPlugins(fdm);
+        _httpsWakeQueue.prePoll(fdm);
+        const uint64_t now = STimeNow();
+        S_poll(fdm, max(nextActivity, now) - now);
+        nextActivity = STimeNow() + STIME_US_PER_S;
+
+        // We only use the wake queue to interrupt `poll`, so we don't care what's in it.
+        _httpsWakeQueue.postPoll(fdm);
+        _httpsWakeQueue.popAll();
+        _postPollPlugins(fdm, nextActivity);
+    }
 }
 
 int BedrockServer::finishWaitingForHTTPS(list<SHTTPSManager::Transaction*>& completedHTTPSRequests) {
@@ -1952,6 +3034,7 @@ int BedrockServer::finishWaitingForHTTPS(list<SHTTPSManager::Transaction*>& comp
             // I guess it's still here! Is it done?
             if (commandPtr->areHttpsRequestsComplete()) {
                 // If so, add it back to the main queue, erase its entry in _outstandingHTTPSCommands, and delete it.
+                _httpsHold.remove(*commandPtr);
                 _commandQueue.push(move(*commandPtr));
                 _outstandingHTTPSCommands.erase(commandPtrIt);
                 delete commandPtr;
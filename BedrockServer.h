@@ -1,9 +1,11 @@
 #pragma once
+#include <unordered_map>
 #include <libstuff/libstuff.h>
 #include <sqlitecluster/SQLiteNode.h>
 #include <sqlitecluster/SQLiteServer.h>
 #include "BedrockPlugin.h"
 #include "BedrockCommandQueue.h"
+class BedrockCore;
 
 class BedrockServer : public SQLiteServer {
   public:
@@ -114,6 +116,11 @@ class BedrockServer : public SQLiteServer {
     // full 60 seconds, and then we'll just die with no responses. Effectively, the sever `kill -9`'s itself here,
     // leaving clients hanging with no cleanup.
     //
+    // (Escalated commands now have a deadline, from `-escalationTimeout` or their own `timeout`, after which the slave
+    // answers them with a 555, and once we start shutting down, that's brought forward to
+    // ESCALATION_SHUTDOWN_MARGIN_US before the timeout. So a slave now answers every client before the timeout,
+    // unless its own workers are the ones holding it up.)
+    //
     // On master, this state could be catastrophic, though master doesn't need to worry about a lack of timeouts on
     // escalations, so let's look at a different case - a command running a custom query that takes longer than our 60
     // second timeout. There will be a local client waiting for the response to this command, so the same criteria
@@ -164,6 +171,10 @@ class BedrockServer : public SQLiteServer {
     // SQLiteNode API.
     void acceptCommand(SQLiteCommand&& command, bool isNew = true);
 
+    // Accept a batch of commands from an SQLiteNode, as with `acceptCommand`, queueing them all at once.
+    // SQLiteNode API.
+    void acceptCommands(list<SQLiteCommand>&& commands, bool isNew = true);
+
     // Cancel a command.
     // SQLiteNode API.
     void cancelCommand(const string& commandID);
@@ -179,6 +190,9 @@ class BedrockServer : public SQLiteServer {
     // Returns true when everything's ready to shutdown.
     bool shutdownComplete();
 
+    // Returns true once we've started shutting down.
+    bool isShuttingDown() const { return _shutdownState.load() != RUNNING; }
+
     // Exposes the replication state to plugins.
     SQLiteNode::State getState() const { return _replicationState.load(); }
 
@@ -196,8 +210,8 @@ class BedrockServer : public SQLiteServer {
     // Returns whether or not this server was configured to backup.
     bool shouldBackup();
 
-    // Returns a copy of the internal state of the sync node's peers. This can be empty if there are no peers, or no
-    // sync node.
+    // Returns a copy of the internal state of the sync node's peers, as last published by the sync thread. This can be
+    // empty if there are no peers, or no sync node.
     list<STable> getPeerInfo();
 
     // Send a command to all of our peers. It will be wrapped appropriately.
@@ -221,22 +235,93 @@ class BedrockServer : public SQLiteServer {
     BedrockCommandQueue _commandQueue;
 
     // Each time we read a new request from a client, we give it a unique ID.
-    uint64_t _requestCount;
-
-    // Each time we read a command off a socket, we put the socket in this map, so that we can respond to it when the
-    // command completes. We remove the socket from the map when we reply to the command, even if the socket is still
-    // open. It will be re-inserted in this set when another command is read from it.
-    map <uint64_t, Socket*> _socketIDMap;
-
-    // The above _socketIDMap is modified by multiple threads, so we lock this mutex around operations that access it.
-    // We don't need to lock around access to the base class's `socketList` because we carefully control access to it
-    // to the main thread.
-    // The only functions that access `socketList` are prePoll, postPoll, openSocket, and closeSocket, in STCPManager,
-    // and acceptSocket in STCPServer.
-    // prePoll and postPoll are only ever called by the main thread.
-    // openSocket is never called by bedrockServer (it is called in SHTTPSManager and STCPNode).
-    // closeSocket and acceptSocket are only called inside postPoll.
-    recursive_mutex _socketIDMutex;
+    atomic<uint64_t> _requestCount;
+
+    // Load shedding limits, by priority. A command at or below one of these priorities is answered with `503 Server
+    // overloaded` instead of being queued when the total number of queued commands reaches the depth limit, or when
+    // commands at or below that priority have recently waited at least the age limit. Set with `-shedDepth` and
+    // `-shedAge`, and only read after construction.
+    map<int, size_t> _shedDepthLimits;
+    map<int, uint64_t> _shedAgeLimitsUS;
+
+    // The number of commands shed so far, reported by `Status`.
+    atomic<uint64_t> _shedCommandCount;
+
+    // The number of commands dropped or timed out by `_discardIfAbandoned`, reported by `Status`.
+    atomic<uint64_t> _abandonedCommandCount;
+
+    // Returns true if the given command should be shed rather than queued, according to the limits above, or because
+    // one of the holds below is full.
+    bool _shouldShed(BedrockCommand& command);
+
+    // Counts of the commands held in each place they wait on something other than a worker, and the bytes they take:
+    // the future commit map, the set waiting on HTTPS requests, the stand down queue, and responses held behind
+    // earlier ones on a pipelined socket. The sync node keeps its own for commands escalated to master. Each can be
+    // bounded with `-maxHeldCommands` and `-maxHeldBytes`, and while any of them is full, new commands are shed. With
+    // `-heldCommandPolicy expire`, a full future commit map or escalation map instead answers its oldest command with
+    // a 555 to make room.
+    SQLiteCommandHold _futureCommitHold;
+    SQLiteCommandHold _httpsHold;
+    SQLiteCommandHold _standDownHold;
+    SQLiteCommandHold _responseHold;
+    bool _expireHeldCommands;
+
+    // The limits for the sync node's escalated commands, passed on when it's created.
+    uint64_t _maxEscalatedCount;
+    uint64_t _maxEscalatedBytes;
+
+    // Returns each of the holds above by the name it's configured and reported by, including `node`'s, if given.
+    list<pair<string, const SQLiteCommandHold*>> _getHolds(const SQLiteNode* node);
+
+    // The most requests a client can pipeline on a single socket before we stop reading from it until some of them
+    // have been answered.
+    static constexpr uint64_t MAX_PIPELINED_REQUESTS = 100;
+
+    // The outstanding commands for a single socket. Clients can pipeline requests, so each request read from the socket
+    // is numbered in order, and responses are sent back in that same order. A response that's ready before an earlier
+    // one is serialized and held in `completed` until it's next.
+    struct PendingSocket {
+        PendingSocket(Socket* s) : socket(s), nextSequence(0), nextReply(0), closing(false) { }
+        Socket* socket;
+
+        // The sequence number for the next request we read, and the sequence number of the next response to send.
+        uint64_t nextSequence;
+        uint64_t nextReply;
+
+        // Serialized responses waiting on earlier ones, by sequence number.
+        map<uint64_t, string> completed;
+
+        // Set when a request asks for `Connection: close`. We don't read any more requests after that one.
+        bool closing;
+    };
+
+    // Each time we read a command off a socket, we put the socket in a map, so that we can respond to it when the
+    // command completes. We remove the socket from the map once we've replied to all of its commands, even if the
+    // socket is still open. It will be re-inserted in the map when another command is read from it.
+    //
+    // Every worker looks up its command's socket here to reply, so rather than one map behind one lock, sockets are
+    // spread over SOCKET_SHARDS maps by ID, each with its own lock, and workers only contend when they're replying on
+    // sockets in the same shard. A socket is only removed from its map (and only then closed) with its shard locked,
+    // so a worker that finds it there can use it until it unlocks. Sending doesn't need any of these, as sockets lock
+    // themselves around sending and receiving: anything a worker can't send right away waits in the socket's buffer
+    // for the thread that owns it (the main thread or an I/O thread) to send on its next poll, and only that thread
+    // ever adds sockets to, or removes them from, its `socketList`.
+    static constexpr size_t SOCKET_SHARDS = 16;
+    struct SocketShard {
+        recursive_mutex mutex;
+        map<uint64_t, PendingSocket> sockets;
+    };
+    SocketShard _socketShards[SOCKET_SHARDS];
+    SocketShard& _getSocketShard(uint64_t socketID) { return _socketShards[socketID % SOCKET_SHARDS]; }
+
+    // Removes a socket that's closing from its map, along with any responses it was still holding.
+    void _forgetSocket(uint64_t socketID);
+
+    // A client's command is only worth running while someone is waiting for its response. If the client's socket has
+    // closed, this drops the command without a reply, and if the `clientTimeout` it sent has passed, this answers it
+    // with a 555. Either way it returns true, and the command shouldn't be run. Commands that have started HTTPS
+    // requests are always kept, as those requests may already have had their effect.
+    bool _discardIfAbandoned(BedrockCommand& command);
 
     // This is the replication state of the sync node. It's updated after every SQLiteNode::update() iteration. A
     // reference to this object is passed to the sync thread to allow this update.
@@ -274,7 +359,7 @@ class BedrockServer : public SQLiteServer {
 
     // Iterate across all of our plugins and call `prePoll` and `postPoll` on any httpsManagers they've created.
     void _prePollPlugins(fd_map& fdm);
-    void _postPollPlugins(fd_map& fdm, uint64_t nextActivity);
+    void _postPollPlugins(fd_map& fdm, uint64_t& nextActivity);
 
     // Resets the server state so when the sync node restarts it is as if the BedrockServer object was just created.
     void _resetServer();
@@ -303,10 +388,28 @@ class BedrockServer : public SQLiteServer {
                        atomic<string>& masterVersion,
                        CommandQueue& syncNodeQueuedCommands,
                        CommandQueue& syncNodeCompletedCommands,
+                       CommandQueue& syncNodeUnacknowledgedCommands,
                        BedrockServer& server,
                        int threadId,
                        int threadCount);
 
+    // Runs a worker's command processing loop on its DB handle. Returns true when the worker has been parked and
+    // should close its handle until it's needed again, or false when it should exit.
+    static bool _workerLoop(SData& args,
+                            atomic<SQLiteNode::State>& _replicationState,
+                            atomic<bool>& upgradeInProgress,
+                            atomic<string>& masterVersion,
+                            CommandQueue& syncNodeQueuedCommands,
+                            CommandQueue& syncNodeCompletedCommands,
+                            CommandQueue& syncNodeUnacknowledgedCommands,
+                            BedrockServer& server,
+                            int threadId,
+                            SQLite& db,
+                            BedrockCore& core);
+
+    // Returns the body for the metrics status command, in the Prometheus text format.
+    string _composeMetrics();
+
     // Send a reply for a completed command back to the initiating client. If the `originator` of the command is set,
     // then this is an error, as the command should have been sent back to a peer.
     void _reply(BedrockCommand&);
@@ -318,6 +421,10 @@ class BedrockServer : public SQLiteServer {
     static constexpr auto STATUS_STATUS            = "Status";
     static constexpr auto STATUS_BLACKLIST         = "SetParallelCommandBlacklist";
     static constexpr auto STATUS_MULTIWRITE        = "EnableMultiWrite";
+    static constexpr auto STATUS_TIMING            = "TimingStats";
+    static constexpr auto STATUS_TRACES            = "GetTraces";
+    static constexpr auto STATUS_SLOW_QUERIES      = "GetSlowQueries";
+    static constexpr auto STATUS_METRICS           = "GET /metrics HTTP/1.1";
 
     // This makes the sync node available to worker threads, so that they can write to it's sockets, and query it for
     // data (such as in the Status command). Because this is a shared pointer, the underlying object can't be deleted
@@ -326,9 +433,37 @@ class BedrockServer : public SQLiteServer {
     // object.
     shared_ptr<SQLiteNode> _syncNode;
 
-    // Because status will access internal sync node data, we lock in both places that will access the pointer above.
+    // The sync thread holds this except while it polls, so that other threads (like `broadcastCommand`) can use the
+    // sync node's internals while it isn't.
     recursive_mutex _syncMutex;
 
+    // What `Status` reports about the sync node and its queue, as of the last time the sync thread published it.
+    struct SyncStatus {
+        bool available = false;
+        uint64_t commitCount = 0;
+        uint64_t cacheHits = 0;
+        uint64_t cacheMisses = 0;
+        int priority = 0;
+        list<STable> peers;
+        list<string> escalatedCommands;
+        list<string> queuedCommands;
+    };
+
+    // Health checks ask for `Status` many times a second, so rather than have each one take `_syncMutex` (which the
+    // sync thread holds for all but its poll) and walk the queues, the sync thread publishes the above, and the main
+    // thread the method lines in `_commandQueue`, for it to read. Each snapshot is never changed once published, only
+    // replaced with `atomic_store`, so a reader can `atomic_load` it and use it without any lock. They're published
+    // at most every STATUS_PUBLISH_INTERVAL_US, so walking the queues doesn't cost more than it did, and also as soon
+    // as the node changes state.
+    static constexpr uint64_t STATUS_PUBLISH_INTERVAL_US = 100 * STIME_US_PER_MS;
+    shared_ptr<const SyncStatus> _syncStatus;
+    shared_ptr<const list<string>> _queuedCommandStatus;
+    uint64_t _syncStatusPublished = 0;
+    uint64_t _queuedCommandStatusPublished = 0;
+
+    // Publishes `_syncStatus` from `node` (or nullptr, once it's gone). Only called by the sync thread.
+    void _publishSyncStatus(SQLiteNode* node);
+
     // Functions for checking for and responding to status and control commands.
     bool _isStatusCommand(BedrockCommand& command);
     void _status(BedrockCommand& command);
@@ -342,10 +477,52 @@ class BedrockServer : public SQLiteServer {
     // This stars the server shutting down.
     void _beginShutdown(const string& reason, bool detach = false);
 
+    // Once we start shutting down, we give up on any command we've escalated this long before the graceful shutdown
+    // timeout, leaving time to answer it and for the sync node to shut down.
+    static constexpr int64_t ESCALATION_SHUTDOWN_MARGIN_US = 10 * STIME_US_PER_S;
+
     // This counts the number of commands currently being processed (which might not be in any of our queues). We use
     // this value to prevent us from standing down until this value is 0 and our main queue is empty.
     atomic<int> _commandsInProgress;
 
+    // The worker pool. Workers with IDs at or above `_activeWorkerThreads` are parked: they close their DB handles and
+    // wait on `_workerPoolCondition` until the pool grows to include them. With `-minWorkerThreads`, the first worker
+    // resizes the pool between `_minWorkerThreads` and `_maxWorkerThreads` about once a second, growing it while
+    // commands are backing up, and shrinking it when there's nothing queued, or when enough commits conflict that more
+    // workers would only get in each other's way. Otherwise, every worker is always active.
+    int _minWorkerThreads;
+    int _maxWorkerThreads;
+    atomic<int> _activeWorkerThreads;
+    mutex _workerPoolMutex;
+    condition_variable _workerPoolCondition;
+    static constexpr uint64_t WORKER_POOL_SCALE_INTERVAL_US = STIME_US_PER_S;
+    static constexpr uint64_t WORKER_POOL_MIN_CONFLICTS = 10;
+    static constexpr uint64_t WORKER_POOL_CONFLICT_RATIO = 4;
+
+    // The number of commands workers have dequeued, and the state as of when the pool was last resized. Only the
+    // first worker uses the latter.
+    atomic<uint64_t> _workerCommandCount;
+    uint64_t _workerPoolScaledAt;
+    uint64_t _workerPoolCommands;
+    uint64_t _workerPoolConflicts;
+
+    // Resizes the worker pool if it's time to, as above.
+    void _scaleWorkerPool();
+
+    // If we're SLAVING or WAITING, and it's been at least `-warmUpInterval` seconds since `lastWarmUp`, runs every
+    // plugin's warm-up queries on `db`, so that its page cache holds what we'd need first if we became master. Called
+    // by idle workers, each with its own `lastWarmUp`.
+    void _warmUpCache(SQLite& db, uint64_t& lastWarmUp);
+    uint64_t _warmUpIntervalUS;
+
+    // With `-traceSampleRate N`, one in N commands read from clients is given a random `traceID`, so it records trace
+    // spans on each node it passes through. 0 traces only commands that arrive with their own `traceID`.
+    uint64_t _traceSampleRate;
+
+    // Waits until the given worker is part of the active pool, and returns true, or returns false if it should exit
+    // instead.
+    bool _waitForWorkerSlot(int threadId);
+
     // This is a map of commit counts in the future to commands that depend on them. We can receive a command that
     // depends on a future commit if we're a slave that's behind master, and a client makes two requests, one to a node
     // more current than ourselves, and a following request to us. We'll move these commands to this special map until
@@ -353,6 +530,10 @@ class BedrockServer : public SQLiteServer {
     multimap<uint64_t, BedrockCommand> _futureCommitCommands;
     recursive_mutex _futureCommitCommandMutex;
 
+    // Moves every command in `_futureCommitCommands` that's waiting on `commitCount` or earlier (or all of them, if
+    // we're shutting down) back to the main command queue. Called whenever a commit lands, on the committing thread.
+    void _requeueFutureCommitCommands(uint64_t commitCount);
+
     // This is a shared mutex. It can be locked by many readers at once, but if the writer (the sync thread) locks it,
     // no other thread can access it. It's locked by the sync thread immediately before starting a transaction, and
     // unlocked afterward. Workers do the same, so that they won't try to start a new transaction while the sync thread
@@ -379,17 +560,107 @@ class BedrockServer : public SQLiteServer {
     // Flag indicating whether multi-write is enabled.
     atomic<bool> _multiWriteEnabled;
 
+    // Flag indicating whether workers can also commit commands that need ONE or QUORUM consistency. These are answered
+    // once enough peers have acknowledged committing them, rather than going through the sync thread one at a time.
+    // Every node in the cluster needs to be new enough to acknowledge commits before this is turned on.
+    bool _multiWriteQuorumEnabled;
+
     // Set this to cause a backup to run in detached mode
     bool _shouldBackup;
+
+    // A live backup, started by `BeginBackup` with `live: true`, runs on its own thread with its own DB handle, while
+    // we carry on serving commands. Only one runs at a time. `_backupStatus` describes the current or last one, for
+    // `Status`, and is protected by `_backupMutex`.
+    void _backup(string path, bool incremental, uint64_t since, uint64_t bytesPerSecond);
+    thread _backupThread;
+    atomic<bool> _backupRunning;
+    atomic<bool> _backupCancel;
+    mutex _backupMutex;
+    STable _backupStatus;
     atomic<bool> _detach;
 
-    // Pointers to the ports on which we accept commands.
+    // Pointers to the ports on which we accept commands. If we have I/O threads, `_commandPort` is one of theirs, and
+    // only tells us that the command port is open.
     Port* _controlPort;
     Port* _commandPort;
 
+    // When `-ioThreads` is set, each of these threads opens its own copy of the command port (bound with
+    // SO_REUSEPORT, so the kernel spreads new connections between them), and accepts, reads, and queues commands from
+    // its own sockets. The main thread then only handles the control port, plugin ports, and node state.
+    struct IOThread {
+        IOThread() : server(""), socketCount(0) { }
+        STCPServer server;
+        thread ioThread;
+
+        // How many sockets this thread has open, so the main thread can tell when clients are done during shutdown.
+        atomic<size_t> socketCount;
+    };
+    list<IOThread> _ioThreads;
+    atomic<bool> _ioThreadsExit;
+
+    // The body of each I/O thread.
+    void _ioThreadLoop(IOThread& io, int threadID);
+
+    // Status and control commands that I/O threads read are passed to the main thread to handle, as they can change
+    // the state of the server.
+    CommandQueue _ioStatusCommands;
+
+    // Once we start shutting down, this is the time after which we close idle sockets. Zero while we're running.
+    atomic<uint64_t> _lastChance;
+
+    // Reads and queues any complete requests from `manager`'s sockets, and closes any of them that are finished. This
+    // runs on the main thread for the sockets it accepts, and on each I/O thread (with `ioThread` set) for its own.
+    void _readRequests(STCPManager& manager, bool ioThread, int& deserializationAttempts, int& deserializedRequests);
+
     // The maximum number of conflicts we'll accept before forwarding a command to the sync thread.
     atomic<int> _maxConflictRetries;
 
+    // Workers run commands of a verb that's conflicted in the last CONFLICT_LANE_DURATION in "lanes", one for each
+    // table it writes (hashed into CONFLICT_LANES), so that commands likely to conflict with each other take turns
+    // rather than all redoing their work, and commands that write other tables don't wait on them at all.
+    static const size_t CONFLICT_LANES;
+    static const uint64_t CONFLICT_LANE_DURATION;
+    struct ConflictingVerb {
+        set<string> tables;
+        uint64_t lastConflict;
+    };
+    map<string, ConflictingVerb> _conflictingVerbs;
+    mutex _conflictingVerbsMutex;
+    vector<mutex> _conflictLanes;
+
+    // Commands are also automatically blacklisted from parallel writes, by methodLine, when more than
+    // AUTO_BLACKLIST_CONFLICT_RATE of at least AUTO_BLACKLIST_MIN_ATTEMPTS worker commits over the last
+    // AUTO_BLACKLIST_WINDOW_SECONDS have conflicted. They stay blacklisted for that long, by which point the attempts
+    // that got them blacklisted have aged out, and they're tried in parallel again. Counts are kept in one bucket per
+    // second of the window.
+    static const size_t AUTO_BLACKLIST_WINDOW_SECONDS = 10;
+    static const int AUTO_BLACKLIST_MIN_ATTEMPTS;
+    static const double AUTO_BLACKLIST_CONFLICT_RATE;
+    struct CommitAttempts {
+        struct Bucket {
+            uint64_t second = 0;
+            int attempts = 0;
+            int conflicts = 0;
+        };
+        Bucket buckets[AUTO_BLACKLIST_WINDOW_SECONDS];
+        uint64_t blacklistedUntil = 0;
+    };
+    map<string, CommitAttempts> _commitAttempts;
+    mutex _commitAttemptsMutex;
+
+    // Records a worker's attempt to commit a command, blacklisting the command if it's conflicting too often.
+    void _recordCommitAttempt(const string& methodLine, bool conflicted);
+
+    // Returns whether a command is currently automatically blacklisted, and the list of all that are.
+    bool _isAutoBlacklisted(const string& methodLine);
+    list<string> _getAutoBlacklist();
+
+    // Records that a command of this verb conflicted when it tried to commit a transaction writing these tables.
+    void _recordConflict(const string& verb, const set<string>& tables);
+
+    // Locks the lanes a command of this verb should run in, if any, returning the locks to hold while it runs.
+    list<unique_lock<mutex>> _lockConflictLanes(const string& verb);
+
     // This is a map of HTTPS requests to the commands that contain them. We use this to quickly look up commands when
     // their HTTPS requests finish and move them back to the main queue.
     map<SHTTPSManager::Transaction*, BedrockCommand*> _outstandingHTTPSRequests;
@@ -399,6 +670,14 @@ class BedrockServer : public SQLiteServer {
     // copy of each command, even if it has multiple requests.
     set<BedrockCommand*> _outstandingHTTPSCommands;
 
+    // Plugins' HTTPS managers are polled on their own thread, which moves commands back to the main queue as their
+    // requests complete, so slow external services can't hold up the sync thread. `waitForHTTPS` pushes to
+    // `_httpsWakeQueue` so this thread starts polling any new sockets right away.
+    thread _httpsThread;
+    atomic<bool> _httpsThreadExit;
+    SSynchronizedQueue<bool> _httpsWakeQueue;
+    void _httpsThreadLoop();
+
     // Takes a command that has an outstanding HTTPS request and saves it in _outstandingHTTPSCommands until its HTTPS
     // requests are complete.
     void waitForHTTPS(BedrockCommand&& command);
@@ -428,6 +707,23 @@ class BedrockServer : public SQLiteServer {
     // particular command for it count as a match likely to cause a crash.
     map<string, set<STable>> _crashCommands;
 
+    // The same crash-causing commands, compiled for matching against every command we dequeue. For each methodLine,
+    // `index` maps each (lowercased) name and value to the commands that require that pair, so checking a command
+    // takes one hash lookup per header, however many crash commands there are. `required` is the number of pairs each
+    // crash command needs to match.
+    struct CrashMatcher {
+        vector<size_t> required;
+        unordered_map<string, unordered_map<string, vector<size_t>>> index;
+        bool matchesAll = false;
+    };
+    unordered_map<string, CrashMatcher> _crashMatchers;
+
+    // Whether there are any crash commands at all, so that in the usual case, we can skip the mutex entirely.
+    atomic<bool> _hasCrashCommands;
+
+    // Adds a crash command to `_crashMatchers`. Must be called with a unique lock on `_crashCommandMutex`.
+    void _addCrashMatcher(const string& methodLine, const STable& values);
+
     // Returns whether or not the command was a status or control command. If it was, it will have already been handled
     // and responded to upon return
     bool _handleIfStatusOrControlCommand(BedrockCommand& command);
@@ -439,4 +735,12 @@ class BedrockServer : public SQLiteServer {
     static SData _generateCrashMessage(const BedrockCommand* command);
 
     static void _addRequestID(SData& request);
+
+    // Returns the page cache size (in KB) for each of our DB handles. With `-cacheBudget`, that total is split evenly
+    // across the sync thread's handle, each worker's, and each slave apply thread's. Otherwise, each gets `-cacheSize`.
+    static int _getCacheSizePerHandle(const SData& args, int workerThreads);
+
+    // Does everything `acceptCommand` does to a command before queueing it, and returns whether it should be treated
+    // as new.
+    bool _prepareAcceptedCommand(SQLiteCommand& command, bool isNew);
 };
@@ -20,7 +20,7 @@ string& SData::operator[](const string& name) {
 // --------------------------------------------------------------------------
 string SData::operator[](const string& name) const {
     // This version takes care not to create an entry if none is present
-    STable::const_iterator it = nameValueMap.find(name);
+    auto it = nameValueMap.find(name);
     if (it == nameValueMap.end()) {
         return "";
     } else {
@@ -52,7 +52,7 @@ void SData::merge(const STable& rhs) {
 void SData::merge(const SData& rhs) {
     // Combine two SData into one
     // **FIXME: What do we do with the content?  Where do we use this?
-    merge(rhs.nameValueMap);
+    nameValueMap.insert(rhs.nameValueMap.begin(), rhs.nameValueMap.end());
 }
 
 // --------------------------------------------------------------------------
@@ -76,7 +76,7 @@ int SData::calc(const string& name) const {
 // --------------------------------------------------------------------------
 int64_t SData::calc64(const string& name) const {
     // Return as a 64-bit value
-    STable::const_iterator it = nameValueMap.find(name);
+    auto it = nameValueMap.find(name);
     if (it == nameValueMap.end()) {
         return 0;
     } else {
@@ -87,7 +87,7 @@ int64_t SData::calc64(const string& name) const {
 // --------------------------------------------------------------------------
 uint64_t SData::calcU64(const string& name) const {
     // Return as an unsigned 64-bit value
-    STable::const_iterator it = nameValueMap.find(name);
+    auto it = nameValueMap.find(name);
     if (it == nameValueMap.end()) {
         return 0;
     } else {
@@ -110,8 +110,13 @@ string SData::getVerb() const {
 
 // --------------------------------------------------------------------------
 void SData::serialize(ostringstream& out) const {
-    // Serializes this to an ostringstream
-    out << SComposeHTTP(methodLine, nameValueMap, content);
+    // Serializes this to an ostringstream. Unless it's compressed, the content is written straight from our own copy.
+    const string headers = serializeHeaders();
+    if (headers.empty()) {
+        out << serialize();
+    } else {
+        out << headers << content;
+    }
 }
 
 // --------------------------------------------------------------------------
@@ -120,6 +125,16 @@ string SData::serialize() const {
     return SComposeHTTP(methodLine, nameValueMap, content);
 }
 
+// --------------------------------------------------------------------------
+void SData::serialize(string& buffer) const {
+    SComposeHTTP(buffer, methodLine, nameValueMap, content);
+}
+
+// --------------------------------------------------------------------------
+string SData::serializeHeaders() const {
+    return SComposeHTTPHeaders(methodLine, nameValueMap, content);
+}
+
 // --------------------------------------------------------------------------
 int SData::deserialize(const string& rhs) {
     // Deserializes from a string
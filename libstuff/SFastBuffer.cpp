@@ -0,0 +1,54 @@
+#include <libstuff/libstuff.h>
+
+SFastBuffer::SFastBuffer() : _front(0) { }
+
+SFastBuffer::SFastBuffer(const string& rhs) : _front(0), _data(rhs) { }
+
+bool SFastBuffer::empty() const {
+    return size() == 0;
+}
+
+size_t SFastBuffer::size() const {
+    return _data.size() - _front;
+}
+
+const char* SFastBuffer::c_str() const {
+    return _data.c_str() + _front;
+}
+
+void SFastBuffer::clear() {
+    _front = 0;
+    _data.clear();
+}
+
+void SFastBuffer::consumeFront(size_t bytes) {
+    _front += min(bytes, size());
+
+    // Once everything's consumed, we can just start over. Otherwise, we only move the remaining data down once it's
+    // no bigger than what we've consumed, so each byte is moved at most once for every byte consumed before it.
+    if (_front == _data.size()) {
+        clear();
+    } else if (_front >= _data.size() - _front) {
+        _data.erase(0, _front);
+        _front = 0;
+    }
+}
+
+void SFastBuffer::append(const char* buffer, size_t bytes) {
+    _data.append(buffer, bytes);
+}
+
+SFastBuffer& SFastBuffer::operator+=(const string& rhs) {
+    _data += rhs;
+    return *this;
+}
+
+SFastBuffer& SFastBuffer::operator=(const string& rhs) {
+    _front = 0;
+    _data = rhs;
+    return *this;
+}
+
+SFastBuffer::operator string() const {
+    return _data.substr(_front);
+}
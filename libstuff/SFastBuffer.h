@@ -0,0 +1,31 @@
+#pragma once
+
+// A string buffer that can be consumed from the front cheaply, for use as a send buffer. Consuming just advances an
+// offset into the underlying string, and the consumed part is only discarded once it's at least as large as what's
+// left. This means a large buffer that's sent a little at a time isn't copied down over and over as it drains.
+class SFastBuffer {
+  public:
+    SFastBuffer();
+    SFastBuffer(const string& rhs);
+
+    // The unconsumed part of the buffer.
+    bool empty() const;
+    size_t size() const;
+    const char* c_str() const;
+
+    void clear();
+
+    // Removes `bytes` from the front of the buffer.
+    void consumeFront(size_t bytes);
+
+    void append(const char* buffer, size_t bytes);
+    SFastBuffer& operator+=(const string& rhs);
+    SFastBuffer& operator=(const string& rhs);
+
+    // Returns a copy of the unconsumed part of the buffer.
+    operator string() const;
+
+  private:
+    size_t _front;
+    string _data;
+};
@@ -0,0 +1,113 @@
+#include "libstuff.h"
+
+SFlatTable::SFlatTable(const STable& table) {
+    *this = table;
+}
+
+SFlatTable& SFlatTable::operator=(const STable& table) {
+    // An STable is already in our order, so there's nothing to sort.
+    clear();
+    reserve(table.size());
+    for (const auto& entry : table) {
+        _entries.emplace_back(entry.first, entry.second);
+        _hashes.push_back(_hash(entry.first));
+    }
+    return *this;
+}
+
+void SFlatTable::clear() {
+    _entries.clear();
+    _hashes.clear();
+}
+
+void SFlatTable::reserve(size_t entries) {
+    _entries.reserve(entries);
+    _hashes.reserve(entries);
+}
+
+SFlatTable::iterator SFlatTable::find(const string& name) {
+    return _entries.begin() + _index(name, _hash(name));
+}
+
+SFlatTable::const_iterator SFlatTable::find(const string& name) const {
+    return _entries.begin() + _index(name, _hash(name));
+}
+
+SString& SFlatTable::at(const string& name) {
+    auto it = find(name);
+    if (it == end()) {
+        throw out_of_range("SFlatTable::at");
+    }
+    return it->second;
+}
+
+const SString& SFlatTable::at(const string& name) const {
+    auto it = find(name);
+    if (it == end()) {
+        throw out_of_range("SFlatTable::at");
+    }
+    return it->second;
+}
+
+SString& SFlatTable::operator[](const string& name) {
+    auto it = find(name);
+    if (it == end()) {
+        it = _insert(value_type(name, SString())).first;
+    }
+    return it->second;
+}
+
+size_t SFlatTable::erase(const string& name) {
+    auto it = find(name);
+    if (it == end()) {
+        return 0;
+    }
+    erase(it);
+    return 1;
+}
+
+SFlatTable::iterator SFlatTable::erase(const_iterator it) {
+    _hashes.erase(_hashes.begin() + (it - _entries.cbegin()));
+    return _entries.erase(it);
+}
+
+uint32_t SFlatTable::_hash(const string& name) {
+    // FNV-1a over the folded name.
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : name) {
+        hash = (hash ^ STableComp::fold(c)) * 16777619u;
+    }
+    return hash;
+}
+
+size_t SFlatTable::_index(const string& name, uint32_t hash) const {
+    static const STableComp comp;
+    if (_entries.size() <= LINEAR_LIMIT) {
+        for (size_t i = 0; i < _hashes.size(); i++) {
+            if (_hashes[i] == hash && !comp(name, _entries[i].first) && !comp(_entries[i].first, name)) {
+                return i;
+            }
+        }
+        return _entries.size();
+    }
+    auto it = lower_bound(_entries.begin(), _entries.end(), name,
+                          [](const value_type& entry, const string& name) { return comp(entry.first, name); });
+    if (it != _entries.end() && !comp(name, it->first)) {
+        return it - _entries.begin();
+    }
+    return _entries.size();
+}
+
+pair<SFlatTable::iterator, bool> SFlatTable::_insert(value_type&& entry) {
+    static const STableComp comp;
+    const uint32_t hash = _hash(entry.first);
+    const size_t existing = _index(entry.first, hash);
+    if (existing != _entries.size()) {
+        return make_pair(_entries.begin() + existing, false);
+    }
+    auto it = lower_bound(_entries.begin(), _entries.end(), entry.first,
+                          [](const value_type& entry, const string& name) { return comp(entry.first, name); });
+    const size_t index = it - _entries.begin();
+    _hashes.insert(_hashes.begin() + index, hash);
+    return make_pair(_entries.insert(it, move(entry)), true);
+}
@@ -1,5 +1,8 @@
 #include "libstuff.h"
 
+const size_t SHTTPSManager::MAX_IDLE_SOCKETS_PER_HOST = 8;
+const uint64_t SHTTPSManager::IDLE_SOCKET_TIMEOUT = 30 * STIME_US_PER_S;
+
 SHTTPSManager::SHTTPSManager()
 { }
 
@@ -19,6 +22,11 @@ SHTTPSManager::~SHTTPSManager() {
     while (!_completedTransactionList.empty()) {
         closeTransaction(_completedTransactionList.front());
     }
+    for (auto& host : _idleSockets) {
+        for (auto& idle : host.second) {
+            closeSocket(idle.first);
+        }
+    }
 }
 
 void SHTTPSManager::closeTransaction(Transaction* transaction) {
@@ -31,7 +39,14 @@ void SHTTPSManager::closeTransaction(Transaction* transaction) {
     _activeTransactionList.remove(transaction);
     _completedTransactionList.remove(transaction);
     if (transaction->s) {
-        closeSocket(transaction->s);
+        // Keep the socket for the next request to the same host, if it's still good for one.
+        if (transaction->keepAlive && transaction->s->state.load() == Socket::CONNECTED &&
+            transaction->s->recvBuffer.empty() && transaction->s->sendBufferEmpty() &&
+            _idleSockets[transaction->connection].size() < MAX_IDLE_SOCKETS_PER_HOST) {
+            _idleSockets[transaction->connection].emplace_back(transaction->s, STimeNow());
+        } else {
+            closeSocket(transaction->s);
+        }
     }
     transaction->s = nullptr;
     delete transaction;
@@ -81,6 +96,7 @@ void SHTTPSManager::postPoll(fd_map& fdm, uint64_t& nextActivity, list<SHTTPSMan
 
     // Let the base class do its thing
     STCPManager::postPoll(fdm);
+    _closeStaleIdleSockets();
 
     // Update each of the active requests
     uint64_t now = STimeNow();
@@ -96,6 +112,15 @@ void SHTTPSManager::postPoll(fd_map& fdm, uint64_t& nextActivity, list<SHTTPSMan
             // Consume how much we read.
             SConsumeFront(active->s->recvBuffer, size);
 
+            // The connection can be reused if both ends spoke HTTP/1.1 without asking to close it, and the response
+            // said exactly how long it was and was all there was to read.
+            active->keepAlive = !active->connection.empty() && active->s->recvBuffer.empty() &&
+                                active->fullResponse.isSet("Content-Length") &&
+                                SStartsWith(active->fullResponse.methodLine, "HTTP/1.1") &&
+                                !SIEquals(active->fullResponse["Connection"], "close") &&
+                                SEndsWith(active->fullRequest.methodLine, "HTTP/1.1") &&
+                                !SIEquals(active->fullRequest["Connection"], "close");
+
             // 200OK or any content?
             active->finished = now;
             if (SContains(active->fullResponse.methodLine, " 200 ") || active->fullResponse.content.size()) {
@@ -140,7 +165,8 @@ SHTTPSManager::Transaction::Transaction(SHTTPSManager& owner_) :
     created(STimeNow()),
     finished(0),
     response(0),
-    owner(owner_)
+    owner(owner_),
+    keepAlive(false)
 { }
 
 SHTTPSManager::Transaction::~Transaction() {
@@ -170,9 +196,15 @@ SHTTPSManager::Transaction* SHTTPSManager::_httpsSend(const string& url, const S
         host += ":443";
     }
 
-    // If this is going to be an https transaction, create a certificate and give it to the socket.
-    SX509* x509 = SStartsWith(url, "https://") ? SX509Open(_pem, _srvCrt, _caCrt) : nullptr;
-    Socket* s = openSocket(host, x509);
+    // Reuse an idle connection to this host if we have one. If not, open one, and if this is going to be an https
+    // transaction, create a certificate and give it to the socket.
+    const bool https = SStartsWith(url, "https://");
+    const string connection = (https ? "https://" : "http://") + host;
+    Socket* s = _getIdleSocket(connection);
+    if (!s) {
+        SX509* x509 = https ? SX509Open(_pem, _srvCrt, _caCrt) : nullptr;
+        s = openSocket(host, x509);
+    }
     if (!s) {
         return _createErrorTransaction();
     }
@@ -181,6 +213,7 @@ SHTTPSManager::Transaction* SHTTPSManager::_httpsSend(const string& url, const S
     Transaction* transaction = new Transaction(*this);
     transaction->s = s;
     transaction->fullRequest = request;
+    transaction->connection = connection;
 
     // Ship it.
     transaction->s->send(request.serialize());
@@ -191,6 +224,49 @@ SHTTPSManager::Transaction* SHTTPSManager::_httpsSend(const string& url, const S
     return transaction;
 }
 
+SHTTPSManager::Socket* SHTTPSManager::_getIdleSocket(const string& connection) {
+    SAUTOLOCK(_listMutex);
+    auto it = _idleSockets.find(connection);
+    if (it == _idleSockets.end()) {
+        return nullptr;
+    }
+
+    // Take the most recently used one, skipping any the other end has closed since.
+    while (!it->second.empty()) {
+        Socket* s = it->second.back().first;
+        it->second.pop_back();
+        if (s->state.load() == Socket::CONNECTED && s->recvBuffer.empty()) {
+            SINFO("Reusing connection to '" << connection << "'.");
+            return s;
+        }
+        closeSocket(s);
+    }
+    return nullptr;
+}
+
+void SHTTPSManager::_closeStaleIdleSockets() {
+    SAUTOLOCK(_listMutex);
+    uint64_t now = STimeNow();
+    for (auto host = _idleSockets.begin(); host != _idleSockets.end();) {
+        auto& idle = host->second;
+        for (auto it = idle.begin(); it != idle.end();) {
+            // Anything arriving on an idle socket means the server is closing it, or worse.
+            Socket* s = it->first;
+            if (s->state.load() != Socket::CONNECTED || !s->recvBuffer.empty() || now > it->second + IDLE_SOCKET_TIMEOUT) {
+                closeSocket(s);
+                it = idle.erase(it);
+            } else {
+                it++;
+            }
+        }
+        if (idle.empty()) {
+            host = _idleSockets.erase(host);
+        } else {
+            host++;
+        }
+    }
+}
+
 bool SHTTPSManager::_onRecv(Transaction* transaction)
 {
     transaction->response = getHTTPResponseCode(transaction->fullResponse.methodLine);
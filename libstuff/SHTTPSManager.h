@@ -16,6 +16,11 @@ class SHTTPSManager : public STCPManager {
         int response;
         STable values;
         SHTTPSManager& owner;
+
+        // The scheme and host this transaction's socket is connected to, and whether the socket can be used for
+        // another request once this transaction is closed.
+        string connection;
+        bool keepAlive;
     };
 
     // Constructor/Destructor
@@ -44,6 +49,12 @@ class SHTTPSManager : public STCPManager {
     const string _srvCrt;
     const string _caCrt;
 
+    // Sockets are kept open after a transaction that ended with a complete HTTP/1.1 response on a connection neither
+    // side asked to close, and reused for the next request to the same scheme and host, which saves a TCP and TLS
+    // handshake per request. We keep at most this many idle sockets per host, for at most this long.
+    static const size_t MAX_IDLE_SOCKETS_PER_HOST;
+    static const uint64_t IDLE_SOCKET_TIMEOUT;
+
     // Methods
     Transaction* _httpsSend(const string& url, const SData& request);
     Transaction* _createErrorTransaction();
@@ -52,6 +63,15 @@ class SHTTPSManager : public STCPManager {
     list<Transaction*> _activeTransactionList;
     list<Transaction*> _completedTransactionList;
 
+    // Idle sockets by scheme and host, each with the time it became idle, most recently used last.
+    map<string, list<pair<Socket*, uint64_t>>> _idleSockets;
+
+    // Returns an idle socket connected to `connection` and removes it from the pool, or null if there isn't one.
+    Socket* _getIdleSocket(const string& connection);
+
+    // Closes any idle sockets that have timed out, or that the other end has closed.
+    void _closeStaleIdleSockets();
+
     // SHTTPSManager operations are thread-safe, we lock around any accesses to our transaction lists, so that
     // multiple threads can add/remove from them.
     recursive_mutex _listMutex;
@@ -0,0 +1,92 @@
+#include <libstuff/libstuff.h>
+#include "SHistogram.h"
+
+constexpr int SHistogram::SUB_BUCKET_BITS;
+constexpr int SHistogram::SUB_BUCKETS;
+constexpr int SHistogram::MAX_BITS;
+constexpr int SHistogram::BUCKET_COUNT;
+
+SHistogram::SHistogram() : _count(0), _max(0) {
+    for (auto& bucket : _buckets) {
+        bucket.store(0, memory_order_relaxed);
+    }
+}
+
+int SHistogram::_bucketIndex(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+
+    // Everything at or past the largest bucket goes in the largest bucket.
+    int highBit = 63 - __builtin_clzll(value);
+    if (highBit > MAX_BITS) {
+        return BUCKET_COUNT - 1;
+    }
+
+    // Each power of two gets SUB_BUCKETS buckets, picked by the bits just below the highest one.
+    int shift = highBit - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + (int)((value >> shift) - SUB_BUCKETS);
+}
+
+uint64_t SHistogram::_bucketUpperBound(int index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    int shift = index / SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+    return low + (1ull << shift) - 1;
+}
+
+void SHistogram::record(uint64_t value) {
+    // There's only one writer, so plain loads and stores are enough, and are cheaper than atomic increments. They're
+    // still atomic so that readers never see torn values.
+    atomic<uint64_t>& bucket = _buckets[_bucketIndex(value)];
+    bucket.store(bucket.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    _count.store(_count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    if (value > _max.load(memory_order_relaxed)) {
+        _max.store(value, memory_order_relaxed);
+    }
+}
+
+void SHistogram::merge(const SHistogram& other) {
+    for (int i = 0; i < BUCKET_COUNT; i++) {
+        _buckets[i].fetch_add(other._buckets[i].load(memory_order_relaxed), memory_order_relaxed);
+    }
+    _count.fetch_add(other._count.load(memory_order_relaxed), memory_order_relaxed);
+    uint64_t otherMax = other._max.load(memory_order_relaxed);
+    if (otherMax > _max.load(memory_order_relaxed)) {
+        _max.store(otherMax, memory_order_relaxed);
+    }
+}
+
+uint64_t SHistogram::count() const {
+    return _count.load(memory_order_relaxed);
+}
+
+uint64_t SHistogram::max() const {
+    return _max.load(memory_order_relaxed);
+}
+
+uint64_t SHistogram::percentile(double percent) const {
+    // Find the first bucket at which we've seen at least `percent` of all values. We sum the buckets rather than using
+    // `_count`, as a writer may have updated one and not the other yet.
+    uint64_t total = 0;
+    for (const auto& bucket : _buckets) {
+        total += bucket.load(memory_order_relaxed);
+    }
+    if (!total) {
+        return 0;
+    }
+    uint64_t target = (uint64_t)ceil(total * percent / 100.0);
+    if (!target) {
+        target = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKET_COUNT; i++) {
+        seen += _buckets[i].load(memory_order_relaxed);
+        if (seen >= target) {
+            return min(_bucketUpperBound(i), max());
+        }
+    }
+    return max();
+}
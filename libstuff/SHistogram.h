@@ -0,0 +1,45 @@
+#pragma once
+
+// A histogram of non-negative integers (typically microsecond durations), in the style of an HDR histogram: values are
+// counted in buckets that are exact below 16, and above that split each power of two into 16 equal parts, so any value
+// read back out is within about 6% of what was recorded. Values beyond the largest bucket are counted in it.
+//
+// Recording is lock-free, but only one thread may record into a given histogram at a time. Any number of threads can
+// read it (or merge it into another histogram) while that happens, and will see a slightly stale but consistent-enough
+// view.
+class SHistogram {
+  public:
+    SHistogram();
+
+    // Explicitly delete copy constructor, use `merge` to combine histograms.
+    SHistogram(const SHistogram& other) = delete;
+
+    // Counts one occurrence of `value`.
+    void record(uint64_t value);
+
+    // Adds all of the counts from `other` into this histogram.
+    void merge(const SHistogram& other);
+
+    // Number of values recorded, and the largest of them.
+    uint64_t count() const;
+    uint64_t max() const;
+
+    // Returns the value at the given percentile (0-100]. This is the upper bound of the bucket that contains it, but
+    // never more than `max()`. Returns 0 for an empty histogram.
+    uint64_t percentile(double percent) const;
+
+  private:
+    static constexpr int SUB_BUCKET_BITS = 4;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+
+    // The largest bucket starts at 2^36, which is about 19 hours in microseconds.
+    static constexpr int MAX_BITS = 36;
+    static constexpr int BUCKET_COUNT = (MAX_BITS - SUB_BUCKET_BITS + 2) * SUB_BUCKETS;
+
+    static int _bucketIndex(uint64_t value);
+    static uint64_t _bucketUpperBound(int index);
+
+    atomic<uint64_t> _buckets[BUCKET_COUNT];
+    atomic<uint64_t> _count;
+    atomic<uint64_t> _max;
+};
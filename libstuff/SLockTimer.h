@@ -2,10 +2,16 @@
 
 // A class for monitoring the amount of time spent in a given lock.
 // To work properly, it requires that the lock is always accessed via this wrapper.
+//
+// This wraps the hottest lock in the system, so it's built to add as little as possible to each acquisition: it reads
+// the clock once before and once after locking, and once on unlocking, and all of its bookkeeping is done while the
+// lock is held, so it needs no synchronization of its own. Each thread gets its own slot for per-thread totals, found
+// through a thread-local pointer rather than a lookup by name. Totals are exact, and wait and hold times are sampled
+// into histograms (every `sampleInterval`th acquisition) for percentiles.
 template<typename LOCKTYPE>
 class SLockTimer : public SPerformanceTimer {
   public:
-    SLockTimer(string description, LOCKTYPE& lock, uint64_t logIntervalSeconds = 10);
+    SLockTimer(string description, LOCKTYPE& lock, uint64_t logIntervalSeconds = 10, uint64_t sampleInterval = 16);
     ~SLockTimer();
 
     // Wrappers around calls to the equivalent functions for the underlying lock, but with timing info added.
@@ -15,105 +21,202 @@ class SLockTimer : public SPerformanceTimer {
     // We override the base class log function.
     virtual void log();
 
+    // Running totals since startup, safe to read from any thread: microseconds spent waiting for and holding the
+    // lock, and the number of times it's been acquired (not counting recursive acquisitions).
+    uint64_t getTotalWaitUS() const { return _totalWaitUS.load(); }
+    uint64_t getTotalLockUS() const { return _totalLockUS.load(); }
+    uint64_t getAcquisitions() const { return _acquisitions.load(); }
+
+    // Sampled distributions of wait and hold times, in microseconds, since startup. Safe to read from any thread.
+    const SHistogram& getWaitHistogram() const { return _waitHistogram; }
+    const SHistogram& getHoldHistogram() const { return _holdHistogram; }
+
+    // Total wait and hold time in microseconds for each thread that's used this lock, by thread name.
+    map<string, pair<uint64_t, uint64_t>> getPerThreadTotals();
+
   private:
-    atomic<int> _lockCount;
+    // Each thread's totals. These are only written while holding `_lock`.
+    struct ThreadSlot {
+        ThreadSlot(const string& name)
+          : threadID(this_thread::get_id()), threadName(name), waitUS(0), lockUS(0), loggedWaitUS(0), loggedLockUS(0)
+        { }
+        thread::id threadID;
+        string threadName;
+        atomic<uint64_t> waitUS;
+        atomic<uint64_t> lockUS;
+
+        // What had been logged as of the last call to `log`, so it can report just the latest period.
+        uint64_t loggedWaitUS;
+        uint64_t loggedLockUS;
+    };
+
+    // Returns the calling thread's slot, creating it the first time.
+    ThreadSlot& _slotForThisThread();
+
+    // A monotonic clock in microseconds. This is served from the vDSO on Linux, so it doesn't make a system call.
+    static uint64_t _now();
+
+    atomic<uint64_t> _totalWaitUS;
+    atomic<uint64_t> _totalLockUS;
+    atomic<uint64_t> _acquisitions;
+    SHistogram _waitHistogram;
+    SHistogram _holdHistogram;
+    uint64_t _sampleInterval;
+
+    // The following are only accessed while holding `_lock`.
+    int _lockCount;
+    uint64_t _acquiredAt;
+    ThreadSlot* _holderSlot;
+    uint64_t _lastLogTime;
+
     LOCKTYPE& _lock;
 
-    // Each thread keeps it's own counter of wait and lock time.
-    map<string, pair<int,int>> _perThreadTiming;
+    // All of the thread slots, which live as long as this object. `_slotsMutex` protects the list itself.
+    list<ThreadSlot> _slots;
+    mutex _slotsMutex;
 };
 
 template<typename LOCKTYPE>
-SLockTimer<LOCKTYPE>::SLockTimer(string description, LOCKTYPE& lock, uint64_t logIntervalSeconds)
-  : SPerformanceTimer(description, false, logIntervalSeconds), _lockCount(0), _lock(lock)
+SLockTimer<LOCKTYPE>::SLockTimer(string description, LOCKTYPE& lock, uint64_t logIntervalSeconds,
+                                 uint64_t sampleInterval)
+  : SPerformanceTimer(description, false, logIntervalSeconds), _totalWaitUS(0), _totalLockUS(0), _acquisitions(0),
+    _sampleInterval(sampleInterval ? sampleInterval : 1), _lockCount(0), _acquiredAt(0), _holderSlot(nullptr),
+    _lastLogTime(0), _lock(lock)
 { }
 
 template<typename LOCKTYPE>
 SLockTimer<LOCKTYPE>::~SLockTimer() {
 }
 
+template<typename LOCKTYPE>
+uint64_t SLockTimer<LOCKTYPE>::_now() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * STIME_US_PER_S + now.tv_nsec / 1000;
+}
+
+template<typename LOCKTYPE>
+typename SLockTimer<LOCKTYPE>::ThreadSlot& SLockTimer<LOCKTYPE>::_slotForThisThread() {
+    // Each thread remembers its slot for the last timer it used, which is almost always the only one.
+    static thread_local pair<SLockTimer*, ThreadSlot*> cached(nullptr, nullptr);
+    if (cached.first != this) {
+        lock_guard<mutex> lock(_slotsMutex);
+        ThreadSlot* slot = nullptr;
+        for (ThreadSlot& existing : _slots) {
+            if (existing.threadID == this_thread::get_id()) {
+                slot = &existing;
+                break;
+            }
+        }
+        if (!slot) {
+            _slots.emplace_back(SThreadLogName);
+            slot = &_slots.back();
+        }
+        cached = make_pair(this, slot);
+    }
+    return *cached.second;
+}
+
 template<typename LOCKTYPE>
 void SLockTimer<LOCKTYPE>::lock()
 {
-    uint64_t waitStart = STimeNow();
+    uint64_t waitStart = _now();
     _lock.lock();
-    uint64_t waitEnd = STimeNow();
-
-    // We atomically increment the counter, and only start the timer if we were the first to do so, in the case
-    // we're calling this recursively.
-    int count = _lockCount.fetch_add(1);
-    if (!count) {
-        uint64_t waitElapsed = waitEnd - waitStart;
-
-        // We're locking, go ahead and update the per-thread map. This is already synchronized behind `_lock`, so no
-        // need to grab a second mutex.
-        auto it = _perThreadTiming.find(SThreadLogName);
-        if (it == _perThreadTiming.end()) {
-            // We didn't find an entry for this thread name, so we'll insert one with the calculated wait time, and a
-            // lock time of 0.
-            _perThreadTiming.emplace(make_pair(SThreadLogName, make_pair((waitElapsed), 0)));
-        } else {
-            // We already have an entry, add to the wait time.
-            it->second.first += (waitElapsed);
+
+    // We only time the outermost acquisition, in the case we're calling this recursively. We're holding the lock from
+    // here on, so none of this needs any further synchronization.
+    if (!_lockCount++) {
+        _acquiredAt = _now();
+        uint64_t waitElapsed = _acquiredAt - waitStart;
+        _holderSlot = &_slotForThisThread();
+        _holderSlot->waitUS.store(_holderSlot->waitUS.load(memory_order_relaxed) + waitElapsed, memory_order_relaxed);
+        _totalWaitUS.store(_totalWaitUS.load(memory_order_relaxed) + waitElapsed, memory_order_relaxed);
+        uint64_t acquisitions = _acquisitions.load(memory_order_relaxed) + 1;
+        _acquisitions.store(acquisitions, memory_order_relaxed);
+        if (acquisitions % _sampleInterval == 0) {
+            _waitHistogram.record(waitElapsed);
+        }
+        if (!_lastLogTime) {
+            _lastLogTime = _acquiredAt;
         }
-        start();
     }
 }
 
 template<typename LOCKTYPE>
 void SLockTimer<LOCKTYPE>::unlock()
 {
-    int count = _lockCount.fetch_sub(1);
-
-    // Count contains the value just before our decrement. If it was 1, that means we're now at a lock count of 0, and
-    // can stop the timer.
-    if (count == 1) {
-        stop();
-        uint64_t lockElapsed = _lastStop - _lastStart;
-
-        // We're still holding `_lock`, so no further synchronization is required for the per-thread map.
-        auto it = _perThreadTiming.find(SThreadLogName);
-        if (it != _perThreadTiming.end()) {
-            // We already have an entry, add to the lock time.
-            it->second.second += lockElapsed;
+    // If this is the outermost unlock, we record how long we held the lock before releasing it.
+    if (!--_lockCount) {
+        uint64_t now = _now();
+        uint64_t lockElapsed = now - _acquiredAt;
+        if (_holderSlot) {
+            _holderSlot->lockUS.store(_holderSlot->lockUS.load(memory_order_relaxed) + lockElapsed,
+                                      memory_order_relaxed);
         } else {
             SWARN("Unlocking without ever locking.");
         }
+        _totalLockUS.store(_totalLockUS.load(memory_order_relaxed) + lockElapsed, memory_order_relaxed);
+        if (_acquisitions.load(memory_order_relaxed) % _sampleInterval == 0) {
+            _holdHistogram.record(lockElapsed);
+        }
+        _holderSlot = nullptr;
+
+        // Every log period, log the latest numbers.
+        if (_lastLogTime + _logPeriod < now) {
+            log();
+            _lastLogTime = now;
+        }
     }
     _lock.unlock();
 }
 
+template<typename LOCKTYPE>
+map<string, pair<uint64_t, uint64_t>> SLockTimer<LOCKTYPE>::getPerThreadTotals() {
+    map<string, pair<uint64_t, uint64_t>> totals;
+    lock_guard<mutex> lock(_slotsMutex);
+    for (const ThreadSlot& slot : _slots) {
+        auto& total = totals[slot.threadName];
+        total.first += slot.waitUS.load(memory_order_relaxed);
+        total.second += slot.lockUS.load(memory_order_relaxed);
+    }
+    return totals;
+}
+
 template<typename LOCKTYPE>
 void SLockTimer<LOCKTYPE>::log() {
 
-    // When called inside `stop()`, as by the base class, this is thread safe as it's protected by `_lock`. When called
-    // from anywhere else, it's up to the caller to protect this!
+    // When called inside `unlock()`, this is thread safe as it's protected by `_lock`. When called from anywhere
+    // else, it's up to the caller to protect this!
+    uint64_t elapsed = _now() - _lastLogTime;
+    if (!_lastLogTime || !elapsed) {
+        return;
+    }
 
-    for (auto& pair : _perThreadTiming) {
-        uint64_t waitTime = pair.second.first;
-        uint64_t lockTime = pair.second.second;
-        uint64_t freeTime = _timeLogged + _timeNotLogged - waitTime - lockTime;
+    lock_guard<mutex> lock(_slotsMutex);
+    for (ThreadSlot& slot : _slots) {
+        uint64_t totalWait = slot.waitUS.load(memory_order_relaxed);
+        uint64_t totalLock = slot.lockUS.load(memory_order_relaxed);
+        uint64_t waitTime = totalWait - slot.loggedWaitUS;
+        uint64_t lockTime = totalLock - slot.loggedLockUS;
+        slot.loggedWaitUS = totalWait;
+        slot.loggedLockUS = totalLock;
+
+        // Skip threads that haven't touched the lock this period.
+        if (!waitTime && !lockTime) {
+            continue;
+        }
+        uint64_t freeTime = elapsed - waitTime - lockTime;
 
         // Catch overflow.
-        if (_timeLogged + _timeNotLogged < waitTime + lockTime) {
+        if (elapsed < waitTime + lockTime) {
             freeTime = 0;
         }
 
-        string threadName = pair.first;
-
         // Compute the percentage of time we've been busy since the last log period started, as a friendly floating point
         // number with two decimal places.
-        double lockPercent = 0;
-        double waitPercent = 0;
-        double freePercent = 0;
-        if (_reverse) {
-            // we don't handle `reverse` for SLockTimer.
-            SWARN("`reverse` flag incorrectly specified for SLockTimer.");
-        } else {
-            lockPercent = 100.0 * ((double)lockTime / (_timeLogged + _timeNotLogged));
-            waitPercent = 100.0 * ((double)waitTime / (_timeLogged + _timeNotLogged));
-            freePercent = 100.0 * ((double)freeTime / (_timeLogged + _timeNotLogged));
-        }
+        double lockPercent = 100.0 * ((double)lockTime / elapsed);
+        double waitPercent = 100.0 * ((double)waitTime / elapsed);
+        double freePercent = 100.0 * ((double)freeTime / elapsed);
         char lockBuffer[7] = {0};
         snprintf(lockBuffer, 7, "%.2f", lockPercent);
         char waitBuffer[7] = {0};
@@ -122,17 +225,16 @@ void SLockTimer<LOCKTYPE>::log() {
         snprintf(freeBuffer, 7, "%.2f", freePercent);
 
         // Log both raw numbers and our friendly lockPercent.
-        SINFO("[performance] " << _description << ", thread: " << threadName << ". Wait/Lock/Free " << waitTime/1000 << "/"
+        SINFO("[performance] " << _description << ", thread: " << slot.threadName << ". Wait/Lock/Free " << waitTime/1000 << "/"
               << lockTime/1000 << "/" << freeTime/1000 << "ms, " << waitBuffer << "/" << lockBuffer << "/" << freeBuffer
               << "%.");
-
-        // Reset the counters.
-        pair.second.first = 0;
-        pair.second.second = 0;
     }
 
-    // Call the base class log function as well.
-    SPerformanceTimer::log();
+    // And the distributions since startup.
+    SINFO("[performance] " << _description << ", " << _acquisitions.load() << " acquisitions. Wait p50/p99/max "
+          << _waitHistogram.percentile(50) << "/" << _waitHistogram.percentile(99) << "/" << _waitHistogram.max()
+          << "us, hold p50/p99/max " << _holdHistogram.percentile(50) << "/" << _holdHistogram.percentile(99) << "/"
+          << _holdHistogram.max() << "us.");
 }
 
 template<typename TIMERTYPE> 
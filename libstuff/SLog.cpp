@@ -1,10 +1,149 @@
 #include "libstuff.h"
 #include <execinfo.h> // for backtrace*
+#include <memory>
 
 // --------------------------------------------------------------------------
 // Global logging state; unsynchronized but shared between all threads
 int _g_SLogMask = LOG_WARNING;
 
+// --------------------------------------------------------------------------
+// Asynchronous logging state. Each thread that logs gets a single-producer, single-consumer ring of lines, and the
+// logger thread is the only consumer. Producers never block: if their ring is full, the line is dropped and counted.
+struct SLogRing {
+    SLogRing(size_t size, const string& name) : lines(size), threadName(name) { }
+    vector<string> lines;
+    atomic<size_t> head{0};
+    atomic<size_t> tail{0};
+    atomic<uint64_t> dropped{0};
+
+    // Only touched by whoever holds _SLogDrainMutex.
+    uint64_t reportedDropped = 0;
+    string threadName;
+};
+
+static atomic<bool> _SLogAsync(false);
+static atomic<bool> _SLogExit(false);
+static atomic<uint64_t> _SLogDropped(0);
+static size_t _SLogRingSize = 0;
+static thread _SLogThread;
+static mutex _SLogStartStopMutex;
+static timed_mutex _SLogDrainMutex;
+static mutex _SLogRingsMutex;
+static list<shared_ptr<SLogRing>> _SLogRings;
+static thread_local shared_ptr<SLogRing> _SLogThreadRing;
+
+// Writes out everything currently queued. Must be called with _SLogDrainMutex held. Returns the number of lines written.
+static size_t _SLogDrain() {
+    list<shared_ptr<SLogRing>> rings;
+    {
+        lock_guard<mutex> lock(_SLogRingsMutex);
+        rings = _SLogRings;
+    }
+    size_t written = 0;
+    for (auto& ring : rings) {
+        const size_t head = ring->head.load(memory_order_acquire);
+        size_t tail = ring->tail.load(memory_order_relaxed);
+        for (; tail != head; tail++) {
+            string line;
+            swap(line, ring->lines[tail % ring->lines.size()]);
+            syslog(LOG_WARNING, "%s", line.c_str());
+            written++;
+        }
+        ring->tail.store(tail, memory_order_release);
+        const uint64_t dropped = ring->dropped.load(memory_order_relaxed);
+        if (dropped != ring->reportedDropped) {
+            const string warning = "[warn] Log buffer for thread '" + ring->threadName + "' overflowed, dropped "
+                                   + SToStr(dropped - ring->reportedDropped) + " lines.";
+            syslog(LOG_WARNING, "%s", warning.c_str());
+            ring->reportedDropped = dropped;
+        }
+    }
+
+    // Forget rings whose threads have exited once they're empty. The list we copied above still holds a reference,
+    // hence comparing against 2.
+    lock_guard<mutex> lock(_SLogRingsMutex);
+    for (auto it = _SLogRings.begin(); it != _SLogRings.end();) {
+        if (it->use_count() == 2 && (*it)->head.load() == (*it)->tail.load()) {
+            it = _SLogRings.erase(it);
+        } else {
+            it++;
+        }
+    }
+    return written;
+}
+
+static void _SLogLoop() {
+    while (true) {
+        const bool exiting = _SLogExit.load();
+        size_t written;
+        {
+            lock_guard<timed_mutex> lock(_SLogDrainMutex);
+            written = _SLogDrain();
+        }
+        if (exiting) {
+            break;
+        }
+        if (!written) {
+            this_thread::sleep_for(chrono::milliseconds(5));
+        }
+    }
+}
+
+void SLogStartAsync(size_t linesPerThread) {
+    lock_guard<mutex> lock(_SLogStartStopMutex);
+    if (_SLogAsync) {
+        return;
+    }
+    _SLogRingSize = max(linesPerThread, (size_t)1);
+    _SLogExit = false;
+    _SLogThread = thread(_SLogLoop);
+    _SLogAsync = true;
+}
+
+void SLogStopAsync() {
+    lock_guard<mutex> lock(_SLogStartStopMutex);
+    if (!_SLogAsync) {
+        return;
+    }
+    _SLogAsync = false;
+    _SLogExit = true;
+    _SLogThread.join();
+}
+
+void SLogFlush() {
+    // This is called on the way to aborting, possibly from a signal handler, so we don't wait forever on a logger
+    // thread that may itself be the one that crashed.
+    unique_lock<timed_mutex> lock(_SLogDrainMutex, chrono::seconds(1));
+    if (lock.owns_lock()) {
+        _SLogDrain();
+    }
+}
+
+uint64_t SLogDroppedLines() {
+    return _SLogDropped.load();
+}
+
+void SLogLine(string&& line) {
+    if (!_SLogAsync.load(memory_order_relaxed)) {
+        syslog(LOG_WARNING, "%s", line.c_str());
+        return;
+    }
+    if (!_SLogThreadRing) {
+        _SLogThreadRing = make_shared<SLogRing>(_SLogRingSize, SThreadLogName);
+        lock_guard<mutex> lock(_SLogRingsMutex);
+        _SLogRings.push_back(_SLogThreadRing);
+    }
+    SLogRing& ring = *_SLogThreadRing;
+    const size_t head = ring.head.load(memory_order_relaxed);
+    if (head - ring.tail.load(memory_order_acquire) >= ring.lines.size()) {
+        ring.dropped.fetch_add(1, memory_order_relaxed);
+        _SLogDropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    ring.lines[head % ring.lines.size()] = move(line);
+    ring.head.store(head + 1, memory_order_release);
+}
+
 // --------------------------------------------------------------------------
 void SLogStackTrace() {
     // Output the symbols to the log
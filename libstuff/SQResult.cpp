@@ -2,33 +2,154 @@
 #include "SQResult.h"
 
 string SQResult::serializeToJSON() const {
-    // Just output as a simple object
-    // **NOTE: This probably isn't super fast, but could be easily optimized
-    //         if it ever became necessary.
-    STable output;
-    output["headers"] = SComposeJSONArray(headers);
-    vector<string> jsonRows;
-    for (size_t c = 0; c < rows.size(); ++c)
-        jsonRows.push_back(SComposeJSONArray(rows[c]));
-    output["rows"] = SComposeJSONArray(jsonRows);
-    return SComposeJSONObject(output);
+    return serialize("json");
 }
 
 string SQResult::serializeToText() const {
-    // Just output as human readable text
-    // **NOTE: This could be prettied up *a lot*
-    string output = SComposeList(headers, " | ") + "\n";
-    for (size_t c = 0; c < rows.size(); ++c)
-        output += SComposeList(rows[c], " | ") + "\n";
-    return output;
+    return serialize("text");
 }
 
 string SQResult::serialize(const string& format) const {
-    // Output the appropriate type
-    if (SIEquals(format, "json"))
-        return serializeToJSON();
-    else
-        return serializeToText();
+    string output;
+    SQResultWriter writer(format, output);
+    writer.writeHeaders(headers);
+    for (const vector<string>& row : rows) {
+        writer.writeRow(row);
+    }
+    writer.finish();
+    return output;
+}
+
+SQResultWriter::SQResultWriter(const string& format, string& output)
+  : _format(SIEquals(format, "json") ? JSON : SIEquals(format, "binary") ? BINARY : TEXT), _output(output),
+    _start(output.size()), _wroteHeaders(false), _rowCount(0) {
+}
+
+void SQResultWriter::writeHeaders(const vector<string>& headers) {
+    SASSERT(!_wroteHeaders);
+    _wroteHeaders = true;
+    if (_format == JSON) {
+        // A simple object, written out piece by piece. This is exactly what SComposeJSONObject would produce with
+        // "headers" and "rows" as keys.
+        _output += "{\"headers\":" + SComposeJSONArray(headers) + ",\"rows\":[";
+    } else if (_format == BINARY) {
+        _writeUInt(headers.size(), 4);
+        for (const string& header : headers) {
+            _writeString(header.data(), header.size());
+        }
+    } else {
+        // Just human readable text
+        // **NOTE: This could be prettied up *a lot*
+        _output += SComposeList(headers, " | ") + "\n";
+    }
+}
+
+void SQResultWriter::writeRow(const vector<string>& row) {
+    SASSERT(_wroteHeaders);
+    if (_format == JSON) {
+        if (_rowCount) {
+            _output += ",";
+        }
+        // Same as SComposeJSONArray, but written straight into the output.
+        _output += '[';
+        for (size_t i = 0; i < row.size(); i++) {
+            if (i) {
+                _output += ',';
+            }
+            SComposeJSON(_output, row[i]);
+        }
+        _output += ']';
+    } else if (_format == BINARY) {
+        for (const string& value : row) {
+            _output += (char)SQLITE_TEXT;
+            _writeString(value.data(), value.size());
+        }
+    } else {
+        _output += SComposeList(row, " | ") + "\n";
+    }
+    _rowCount++;
+}
+
+void SQResultWriter::writeHeaders(sqlite3_stmt* statement) {
+    const int columns = sqlite3_column_count(statement);
+    vector<string> headers;
+    headers.reserve(columns);
+    for (int c = 0; c < columns; ++c) {
+        const char* name = sqlite3_column_name(statement, c);
+        headers.push_back(name ? name : "");
+    }
+    writeHeaders(headers);
+}
+
+void SQResultWriter::writeRow(sqlite3_stmt* statement) {
+    const int columns = sqlite3_column_count(statement);
+    if (_format != BINARY) {
+        // Everything's text in the other formats (and NULL is empty).
+        vector<string> row;
+        row.reserve(columns);
+        for (int c = 0; c < columns; ++c) {
+            const char* value = (const char*)sqlite3_column_text(statement, c);
+            row.emplace_back(value ? string(value, sqlite3_column_bytes(statement, c)) : "");
+        }
+        writeRow(row);
+        return;
+    }
+    SASSERT(_wroteHeaders);
+    for (int c = 0; c < columns; ++c) {
+        const int type = sqlite3_column_type(statement, c);
+        _output += (char)type;
+        switch (type) {
+            case SQLITE_INTEGER:
+                _writeUInt(sqlite3_column_int64(statement, c), 8);
+                break;
+            case SQLITE_FLOAT: {
+                const double value = sqlite3_column_double(statement, c);
+                uint64_t bits;
+                memcpy(&bits, &value, sizeof(bits));
+                _writeUInt(bits, 8);
+                break;
+            }
+            case SQLITE_NULL:
+                break;
+            default: {
+                // Text or blob. Ask for the value before its size, which is what sqlite's documentation suggests.
+                const char* value = (const char*)(type == SQLITE_BLOB ? sqlite3_column_blob(statement, c)
+                                                                      : sqlite3_column_text(statement, c));
+                _writeString(value, sqlite3_column_bytes(statement, c));
+                break;
+            }
+        }
+    }
+    _rowCount++;
+}
+
+void SQResultWriter::finish() {
+    // A query with no rows never tells us its columns, so it has empty headers.
+    if (!_wroteHeaders) {
+        writeHeaders(vector<string>());
+    }
+    if (_format == JSON) {
+        _output += "]}";
+    }
+}
+
+void SQResultWriter::reset() {
+    _output.resize(_start);
+    _wroteHeaders = false;
+    _rowCount = 0;
+}
+
+void SQResultWriter::_writeUInt(uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        _output += (char)(value >> (8 * i));
+    }
+}
+
+void SQResultWriter::_writeString(const char* value, size_t size) {
+    _writeUInt(size, 4);
+    if (size) {
+        _output.append(value, size);
+    }
 }
 
 bool SQResult::deserialize(const string& json) {
@@ -76,3 +197,194 @@ bool SQResult::deserialize(const string& json) {
     clear();
     return false;
 }
+
+bool SQResult::deserializeBinary(const string& data) {
+    // Reset ourselves to start
+    clear();
+
+    // Each of these reads from the front of what's left, failing if there isn't enough.
+    const char* ptr = data.data();
+    const char* end = ptr + data.size();
+    auto readUInt = [&](int bytes) {
+        if (end - ptr < bytes) {
+            STHROW("Truncated");
+        }
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; i++) {
+            value |= (uint64_t)(unsigned char)*ptr++ << (8 * i);
+        }
+        return value;
+    };
+    auto readString = [&]() {
+        const uint64_t size = readUInt(4);
+        if ((uint64_t)(end - ptr) < size) {
+            STHROW("Truncated");
+        }
+        string value(ptr, size);
+        ptr += size;
+        return value;
+    };
+
+    try {
+        const uint64_t columns = readUInt(4);
+        for (uint64_t c = 0; c < columns; c++) {
+            headers.push_back(readString());
+        }
+        while (columns && ptr < end) {
+            rows.emplace_back();
+            vector<string>& row = rows.back();
+            row.reserve(columns);
+            for (uint64_t c = 0; c < columns; c++) {
+                const int type = (int)readUInt(1);
+                switch (type) {
+                    case SQLITE_INTEGER:
+                        row.push_back(SToStr((int64_t)readUInt(8)));
+                        break;
+                    case SQLITE_FLOAT: {
+                        // Formatted the way sqlite formats floats as text.
+                        const uint64_t bits = readUInt(8);
+                        double value;
+                        memcpy(&value, &bits, sizeof(value));
+                        char buffer[32];
+                        sqlite3_snprintf(sizeof(buffer), buffer, "%!.15g", value);
+                        row.push_back(buffer);
+                        break;
+                    }
+                    case SQLITE_NULL:
+                        row.emplace_back();
+                        break;
+                    case SQLITE_TEXT:
+                    case SQLITE_BLOB:
+                        row.push_back(readString());
+                        break;
+                    default:
+                        STHROW("Unknown type " + SToStr(type));
+                }
+            }
+        }
+
+        // Success!
+        return true;
+    } catch (const SException& e) {
+        SDEBUG("Failed to deserialize binary SQResult (" << e.what() << ")");
+    }
+
+    // Failed, reset and report failure
+    clear();
+    return false;
+}
+
+bool SQTypedResult::isNull(size_t row, size_t column) const {
+    return _cell(row, column).type == SQLITE_NULL;
+}
+
+int64_t SQTypedResult::getInt64(size_t row, size_t column) const {
+    const Cell& cell = _cell(row, column);
+    switch (cell.type) {
+        case SQLITE_INTEGER:
+            return cell.integer;
+        case SQLITE_FLOAT:
+            return (int64_t)cell.real;
+        case SQLITE_NULL:
+            return 0;
+        default:
+            return SToInt64(string(_arena, cell.offset, cell.size));
+    }
+}
+
+double SQTypedResult::getDouble(size_t row, size_t column) const {
+    const Cell& cell = _cell(row, column);
+    switch (cell.type) {
+        case SQLITE_INTEGER:
+            return (double)cell.integer;
+        case SQLITE_FLOAT:
+            return cell.real;
+        case SQLITE_NULL:
+            return 0.0;
+        default:
+            return atof(string(_arena, cell.offset, cell.size).c_str());
+    }
+}
+
+string SQTypedResult::getString(size_t row, size_t column) const {
+    const Cell& cell = _cell(row, column);
+    switch (cell.type) {
+        case SQLITE_INTEGER:
+            return SToStr(cell.integer);
+        case SQLITE_FLOAT: {
+            // Formatted the way sqlite formats floats as text.
+            char buffer[32];
+            sqlite3_snprintf(sizeof(buffer), buffer, "%!.15g", cell.real);
+            return buffer;
+        }
+        case SQLITE_NULL:
+            return "";
+        default:
+            return string(_arena, cell.offset, cell.size);
+    }
+}
+
+const char* SQTypedResult::data(size_t row, size_t column) const {
+    const Cell& cell = _cell(row, column);
+    if (cell.type != SQLITE_TEXT && cell.type != SQLITE_BLOB) {
+        return "";
+    }
+    return _arena.data() + cell.offset;
+}
+
+size_t SQTypedResult::bytes(size_t row, size_t column) const {
+    const Cell& cell = _cell(row, column);
+    return (cell.type == SQLITE_TEXT || cell.type == SQLITE_BLOB) ? cell.size : 0;
+}
+
+void SQTypedResult::clear() {
+    headers.clear();
+    _columns = 0;
+    _rows = 0;
+    _cells.clear();
+    _arena.clear();
+}
+
+void SQTypedResult::appendRow(sqlite3_stmt* statement) {
+    if (!_rows) {
+        _columns = sqlite3_column_count(statement);
+        headers.reserve(_columns);
+        for (size_t c = 0; c < _columns; ++c) {
+            const char* name = sqlite3_column_name(statement, c);
+            headers.push_back(name ? name : "");
+        }
+
+        // Start with room for a reasonable number of rows, so small results don't grow at all.
+        _cells.reserve(_columns * 64);
+        _arena.reserve(4096);
+    }
+    for (size_t c = 0; c < _columns; ++c) {
+        Cell cell;
+        cell.type = sqlite3_column_type(statement, c);
+        cell.size = 0;
+        switch (cell.type) {
+            case SQLITE_INTEGER:
+                cell.integer = sqlite3_column_int64(statement, c);
+                break;
+            case SQLITE_FLOAT:
+                cell.real = sqlite3_column_double(statement, c);
+                break;
+            case SQLITE_NULL:
+                cell.integer = 0;
+                break;
+            default: {
+                // Text or blob. Ask for the value before its size, which is what sqlite's documentation suggests.
+                const char* value = (const char*)(cell.type == SQLITE_BLOB ? sqlite3_column_blob(statement, c)
+                                                                           : sqlite3_column_text(statement, c));
+                cell.size = sqlite3_column_bytes(statement, c);
+                cell.offset = _arena.size();
+                if (cell.size) {
+                    _arena.append(value, cell.size);
+                }
+                break;
+            }
+        }
+        _cells.push_back(cell);
+    }
+    _rows++;
+}
@@ -1,9 +1,12 @@
 #pragma once
 // Can't include libstuff.h here because it'd be circular.
+#include <cstdint>
 #include <string>
 #include <vector>
 using namespace std;
 
+struct sqlite3_stmt;
+
 class SQResult {
   public:
     // Attributes
@@ -31,4 +34,106 @@ class SQResult {
 
     // Deserializers
     bool deserialize(const string& json);
+
+    // Reads the "binary" format (see SQResultWriter). Values come back as the same text sqlite would've given for
+    // them, with NULLs as empty strings.
+    bool deserializeBinary(const string& data);
+};
+
+// A query result that keeps sqlite's types. Integers and floats are stored as numbers, and all text and blobs are
+// stored back to back in a single buffer, so collecting a result costs a handful of allocations however many cells it
+// has. Use this rather than SQResult for queries that return a lot of rows.
+class SQTypedResult {
+  public:
+    SQTypedResult() : _columns(0), _rows(0) { }
+
+    // Attributes
+    vector<string> headers;
+
+    // Accessors
+    inline bool empty() const { return !_rows; }
+    inline size_t size() const { return _rows; }
+    inline size_t columns() const { return _columns; }
+
+    // The sqlite type of a cell (SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT, SQLITE_BLOB or SQLITE_NULL).
+    inline int type(size_t row, size_t column) const { return _cell(row, column).type; }
+    bool isNull(size_t row, size_t column) const;
+
+    // Returns a cell converted the way sqlite would convert it: NULL is 0, and text is read as a number.
+    int64_t getInt64(size_t row, size_t column) const;
+    double getDouble(size_t row, size_t column) const;
+
+    // Returns a cell as the same text SQResult would have for it, with NULLs as empty strings.
+    string getString(size_t row, size_t column) const;
+
+    // The raw bytes of a text or blob cell, without copying them. Empty for anything else.
+    const char* data(size_t row, size_t column) const;
+    size_t bytes(size_t row, size_t column) const;
+
+    // Mutators
+    void clear();
+
+    // Appends the current row of a statement that's just been stepped. The first row also sets the headers.
+    void appendRow(sqlite3_stmt* statement);
+
+  private:
+    struct Cell {
+        int type;
+        union {
+            int64_t integer;
+            double real;
+            size_t offset;
+        };
+        size_t size;
+    };
+    inline const Cell& _cell(size_t row, size_t column) const { return _cells[row * _columns + column]; }
+
+    size_t _columns;
+    size_t _rows;
+    vector<Cell> _cells;
+    string _arena;
+};
+
+// Serializes a result one row at a time, appending to an output string. This produces the same thing as
+// SQResult::serialize(), but lets a caller stepping through a query write each row as it comes rather than holding
+// the whole result in memory first.
+//
+// Besides "json" and "text", this can write "binary", which keeps sqlite's types rather than turning every value into
+// text. It's a 32 bit column count, then each column name, then every cell of every row in order. Each cell is a one
+// byte sqlite type (SQLITE_INTEGER, etc) followed by its value: 8 bytes for an integer or float, nothing for NULL,
+// and otherwise a length-prefixed string. Lengths are 32 bits, and all numbers are little-endian.
+class SQResultWriter {
+  public:
+    // Appends to `output`, in the given format (see SQResult::serialize).
+    SQResultWriter(const string& format, string& output);
+
+    // Write the column names. This must be called once, before any rows.
+    void writeHeaders(const vector<string>& headers);
+    inline bool wroteHeaders() const { return _wroteHeaders; }
+
+    // Write the next row.
+    void writeRow(const vector<string>& row);
+
+    // Write the headers or current row of a statement that's just been stepped, keeping each value's type in binary.
+    void writeHeaders(sqlite3_stmt* statement);
+    void writeRow(sqlite3_stmt* statement);
+
+    // Completes the output. Nothing else can be written after this.
+    void finish();
+
+    // Discards everything written so far, so the result can be written again from the start.
+    void reset();
+
+  private:
+    enum Format {TEXT, JSON, BINARY};
+
+    // Append the parts of the binary format.
+    void _writeUInt(uint64_t value, int bytes);
+    void _writeString(const char* value, size_t size);
+
+    Format _format;
+    string& _output;
+    size_t _start;
+    bool _wroteHeaders;
+    size_t _rowCount;
 };
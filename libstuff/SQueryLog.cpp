@@ -0,0 +1,418 @@
+#include "libstuff.h"
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <unordered_set>
+
+// --------------------------------------------------------------------------
+// The query log is a binary file, written in native byte order, made of two kinds of records after an 8 byte header:
+//
+//   'T' <uint64 fingerprint> <uint32 length> <length bytes of text>
+//   'Q' <uint64 time> <uint64 elapsed> <uint64 file fingerprint> <uint64 query fingerprint> <int32 result>
+//
+// A 'T' record gives the text for a fingerprint, and is written by each thread the first time it logs that text, so
+// the text always comes before the queries that refer to it. Queries are logged by fingerprint, so a statement run a
+// million times only has its text in the log once per thread.
+static const char _SQueryLogMagic[8] = {'B', 'Q', 'L', 'O', 'G', '\0', '\0', '\1'};
+
+// Each thread that logs a query gets its own buffer, so logging only takes a lock no other thread is waiting on. The
+// writer thread swaps each buffer out and writes it to the file.
+struct SQueryLogBuffer {
+    mutex bufferMutex;
+    string data;
+
+    // The fingerprints whose text this thread has already written to the current log, and which log that was.
+    unordered_set<uint64_t> written;
+    uint64_t generation = 0;
+
+    // Counts queries for sampling.
+    uint64_t count = 0;
+};
+
+// A thread forgets which texts it's written after this many, and writes them again as they come up, so the full text
+// mode doesn't grow without limit.
+static const size_t SQUERYLOG_MAX_WRITTEN = 100000;
+
+// Buffers bigger than this are written without waiting for the next pass of the writer thread.
+static const size_t SQUERYLOG_FLUSH_SIZE = 1024 * 1024;
+
+static atomic<bool> _SQueryLogEnabled(false);
+static atomic<bool> _SQueryLogExit(false);
+static atomic<uint64_t> _SQueryLogGeneration(0);
+static int _SQueryLogSampleEvery = 1;
+static bool _SQueryLogFullText = false;
+static FILE* _SQueryLogFP = nullptr;
+static thread _SQueryLogThread;
+static mutex _SQueryLogOpenCloseMutex;
+static mutex _SQueryLogWriteMutex;
+static mutex _SQueryLogBuffersMutex;
+static list<shared_ptr<SQueryLogBuffer>> _SQueryLogBuffers;
+static thread_local shared_ptr<SQueryLogBuffer> _SQueryLogThreadBuffer;
+
+template <typename T>
+static void _SQueryLogAppend(string& data, const T& value) {
+    data.append((const char*)&value, sizeof(value));
+}
+
+template <typename T>
+static bool _SQueryLogRead(istream& in, T& value) {
+    return (bool)in.read((char*)&value, sizeof(value));
+}
+
+static uint64_t _SQueryLogHash(const string& text) {
+    // FNV-1a.
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : text) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Reduces `sql` to the shape of its statement: string and numeric literals become `?`, and runs of whitespace become
+// a single space, so queries that differ only in their values get the same fingerprint.
+static void _SQueryLogNormalize(const string& sql, string& normalized) {
+    normalized.clear();
+    const size_t length = sql.size();
+    for (size_t i = 0; i < length; i++) {
+        const char c = sql[i];
+        if (c == '\'') {
+            // Skip to the closing quote, where two quotes in a row are an escaped quote.
+            for (i++; i < length; i++) {
+                if (sql[i] == '\'') {
+                    if (i + 1 < length && sql[i + 1] == '\'') {
+                        i++;
+                    } else {
+                        break;
+                    }
+                }
+            }
+            normalized += '?';
+        } else if (isdigit((unsigned char)c) &&
+                   (normalized.empty() || !(isalnum((unsigned char)normalized.back()) || normalized.back() == '_'))) {
+            // A number, rather than digits in a name.
+            while (i + 1 < length && (isalnum((unsigned char)sql[i + 1]) || sql[i + 1] == '.')) {
+                i++;
+            }
+            normalized += '?';
+        } else if (isspace((unsigned char)c)) {
+            if (!normalized.empty() && normalized.back() != ' ') {
+                normalized += ' ';
+            }
+        } else {
+            normalized += c;
+        }
+    }
+    if (!normalized.empty() && normalized.back() == ' ') {
+        normalized.pop_back();
+    }
+}
+
+// Adds a 'T' record to `buffer` for `text` if this thread hasn't already written one to this log, and returns its
+// fingerprint. Must be called with the buffer's mutex held.
+static uint64_t _SQueryLogText(SQueryLogBuffer& buffer, const string& text) {
+    const uint64_t fingerprint = _SQueryLogHash(text);
+    if (buffer.written.size() >= SQUERYLOG_MAX_WRITTEN) {
+        buffer.written.clear();
+    }
+    if (buffer.written.insert(fingerprint).second) {
+        buffer.data += 'T';
+        _SQueryLogAppend(buffer.data, fingerprint);
+        _SQueryLogAppend(buffer.data, (uint32_t)text.size());
+        buffer.data += text;
+    }
+    return fingerprint;
+}
+
+// Writes out everything buffered so far. Must be called with _SQueryLogWriteMutex held.
+static void _SQueryLogDrain() {
+    list<shared_ptr<SQueryLogBuffer>> buffers;
+    {
+        lock_guard<mutex> lock(_SQueryLogBuffersMutex);
+        buffers = _SQueryLogBuffers;
+    }
+    string data;
+    for (auto& buffer : buffers) {
+        {
+            lock_guard<mutex> lock(buffer->bufferMutex);
+            swap(data, buffer->data);
+        }
+        if (!data.empty()) {
+            SASSERT(fwrite(data.c_str(), 1, data.size(), _SQueryLogFP) == data.size());
+            data.clear();
+        }
+    }
+    fflush(_SQueryLogFP);
+
+    // Forget the buffers of threads that have exited, once they're empty. The list we copied above still holds a
+    // reference, hence comparing against 2.
+    lock_guard<mutex> lock(_SQueryLogBuffersMutex);
+    for (auto it = _SQueryLogBuffers.begin(); it != _SQueryLogBuffers.end();) {
+        if (it->use_count() == 2) {
+            lock_guard<mutex> bufferLock((*it)->bufferMutex);
+            if ((*it)->data.empty()) {
+                it = _SQueryLogBuffers.erase(it);
+                continue;
+            }
+        }
+        it++;
+    }
+}
+
+static void _SQueryLogLoop() {
+    SInitialize("queryLog");
+    while (!_SQueryLogExit.load()) {
+        {
+            lock_guard<mutex> lock(_SQueryLogWriteMutex);
+            _SQueryLogDrain();
+        }
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+}
+
+// --------------------------------------------------------------------------
+void SQueryLogOpen(const string& logFilename, int sampleEvery, bool fullText) {
+    lock_guard<mutex> lock(_SQueryLogOpenCloseMutex);
+    if (_SQueryLogEnabled) {
+        SHMMM("Attempting to open query log '" << logFilename << "' but a log is already open, ignoring.");
+        return;
+    }
+
+    // Create a new logfile from scratch, replacing anything already there.
+    SINFO("Opening query log '" << logFilename << "', logging one in " << sampleEvery << " queries"
+          << (fullText ? " with their full text." : " by fingerprint."));
+    _SQueryLogFP = fopen(logFilename.c_str(), "w");
+    SASSERT(_SQueryLogFP);
+    SASSERT(fwrite(_SQueryLogMagic, 1, sizeof(_SQueryLogMagic), _SQueryLogFP) == sizeof(_SQueryLogMagic));
+
+    // Every thread has to write the text for its fingerprints again in a new log.
+    _SQueryLogSampleEvery = max(sampleEvery, 1);
+    _SQueryLogFullText = fullText;
+    _SQueryLogGeneration++;
+    _SQueryLogExit = false;
+    _SQueryLogThread = thread(_SQueryLogLoop);
+    _SQueryLogEnabled = true;
+}
+
+// --------------------------------------------------------------------------
+void SQueryLogClose() {
+    lock_guard<mutex> lock(_SQueryLogOpenCloseMutex);
+    if (!_SQueryLogEnabled) {
+        SHMMM("Trying to close query log but not open, ignoring.");
+        return;
+    }
+
+    // Anything a thread is adding to its buffer right now has been added by the time we can lock it to drain it, and
+    // nothing is added after that.
+    SINFO("Closing query log...");
+    _SQueryLogEnabled = false;
+    _SQueryLogExit = true;
+    _SQueryLogThread.join();
+    lock_guard<mutex> writeLock(_SQueryLogWriteMutex);
+    _SQueryLogDrain();
+    fclose(_SQueryLogFP);
+    _SQueryLogFP = nullptr;
+    SINFO("Closed query log");
+}
+
+// --------------------------------------------------------------------------
+bool SQueryLogIsOpen() {
+    return _SQueryLogEnabled.load(memory_order_relaxed);
+}
+
+// --------------------------------------------------------------------------
+void SQueryLogRecord(sqlite3* db, const string& sql, uint64_t elapsed, int result) {
+    if (!_SQueryLogEnabled.load(memory_order_relaxed)) {
+        return;
+    }
+    if (!_SQueryLogThreadBuffer) {
+        _SQueryLogThreadBuffer = make_shared<SQueryLogBuffer>();
+        lock_guard<mutex> lock(_SQueryLogBuffersMutex);
+        _SQueryLogBuffers.push_back(_SQueryLogThreadBuffer);
+    }
+    SQueryLogBuffer& buffer = *_SQueryLogThreadBuffer;
+    if (buffer.count++ % _SQueryLogSampleEvery) {
+        return;
+    }
+
+    // Work out the text outside the lock; it only guards against the writer thread.
+    static thread_local string text;
+    if (_SQueryLogFullText) {
+        text = STrim(sql);
+    } else {
+        _SQueryLogNormalize(sql, text);
+    }
+    const char* filename = sqlite3_db_filename(db, "main");
+
+    lock_guard<mutex> lock(buffer.bufferMutex);
+    if (!_SQueryLogEnabled.load()) {
+        return;
+    }
+    const uint64_t generation = _SQueryLogGeneration.load();
+    if (buffer.generation != generation) {
+        buffer.written.clear();
+        buffer.generation = generation;
+    }
+    const uint64_t fileFingerprint = _SQueryLogText(buffer, filename ? filename : "");
+    const uint64_t queryFingerprint = _SQueryLogText(buffer, text);
+    buffer.data += 'Q';
+    _SQueryLogAppend(buffer.data, STimeNow());
+    _SQueryLogAppend(buffer.data, elapsed);
+    _SQueryLogAppend(buffer.data, fileFingerprint);
+    _SQueryLogAppend(buffer.data, queryFingerprint);
+    _SQueryLogAppend(buffer.data, (int32_t)result);
+
+    // Don't let a busy thread build up too much between passes of the writer thread. The writer locks each buffer
+    // while holding the write lock, so we only try for it here, and leave it to the writer if it's busy.
+    if (buffer.data.size() >= SQUERYLOG_FLUSH_SIZE) {
+        unique_lock<mutex> writeLock(_SQueryLogWriteMutex, try_to_lock);
+        if (writeLock.owns_lock() && _SQueryLogFP) {
+            SASSERT(fwrite(buffer.data.c_str(), 1, buffer.data.size(), _SQueryLogFP) == buffer.data.size());
+            buffer.data.clear();
+        }
+    }
+}
+
+// --------------------------------------------------------------------------
+bool SQueryLogToCSV(const string& logFilename, ostream& out) {
+    ifstream in(logFilename, ios::binary);
+    char magic[sizeof(_SQueryLogMagic)];
+    if (!in.read(magic, sizeof(magic)) || memcmp(magic, _SQueryLogMagic, sizeof(magic))) {
+        return false;
+    }
+    out << "filename, query, elapsed, time, result\n";
+    map<uint64_t, string> texts;
+    char type;
+    while (in.get(type)) {
+        if (type == 'T') {
+            uint64_t fingerprint;
+            uint32_t length;
+            if (!_SQueryLogRead(in, fingerprint) || !_SQueryLogRead(in, length)) {
+                return false;
+            }
+            string text(length, '\0');
+            if (!in.read(&text[0], length)) {
+                return false;
+            }
+            texts[fingerprint] = move(text);
+        } else if (type == 'Q') {
+            uint64_t time, elapsed, fileFingerprint, queryFingerprint;
+            int32_t result;
+            if (!_SQueryLogRead(in, time) || !_SQueryLogRead(in, elapsed) || !_SQueryLogRead(in, fileFingerprint) ||
+                !_SQueryLogRead(in, queryFingerprint) || !_SQueryLogRead(in, result)) {
+                return false;
+            }
+            out << "\"" << SEscape(texts[fileFingerprint], "\"", '"') << "\", \""
+                << SEscape(texts[queryFingerprint], "\"", '"') << "\", " << elapsed << ", " << time << ", " << result
+                << "\n";
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// --------------------------------------------------------------------------
+thread_local SQueryOrigin SThreadQueryOrigin;
+
+static atomic<size_t> _SSlowQueryLogMax(0);
+static atomic<int> _SSlowQueryLogSampleEvery(1);
+static atomic<uint64_t> _SSlowQueryLogThresholdUS(UINT64_MAX);
+static atomic<uint64_t> _SSlowQueryLogCount(0);
+static mutex _SSlowQueryLogMutex;
+static deque<STable> _SSlowQueryLog;
+
+// Returns `EXPLAIN QUERY PLAN` for each statement in `sql`, one line per step of the plan, indented under its parent.
+// This only prepares and explains the statements, so nothing in `sql` is run again. Anything that can't be explained
+// (for instance, a statement that refers to a table an earlier statement in `sql` created) is skipped.
+static string _SSlowQueryLogPlan(sqlite3* db, const string& sql) {
+    string plan;
+    const char* next = sql.c_str();
+    const char* end = next + sql.size();
+    while (next < end) {
+        sqlite3_stmt* statement = nullptr;
+        if (sqlite3_prepare_v2(db, next, end - next, &statement, &next) != SQLITE_OK || !statement) {
+            break;
+        }
+        const string explain = "EXPLAIN QUERY PLAN "s + sqlite3_sql(statement);
+        sqlite3_finalize(statement);
+        sqlite3_stmt* explainStatement = nullptr;
+        if (sqlite3_prepare_v2(db, explain.c_str(), explain.size(), &explainStatement, nullptr) != SQLITE_OK ||
+            !explainStatement) {
+            continue;
+        }
+
+        // Each row is (id, parent, notused, detail), with each step's parent coming before it.
+        map<int, int> depths;
+        while (sqlite3_step(explainStatement) == SQLITE_ROW) {
+            const int id = sqlite3_column_int(explainStatement, 0);
+            const int parent = sqlite3_column_int(explainStatement, 1);
+            const char* detail = (const char*)sqlite3_column_text(explainStatement, 3);
+            const auto parentDepth = depths.find(parent);
+            const int depth = parentDepth == depths.end() ? 0 : parentDepth->second + 1;
+            depths[id] = depth;
+            plan += string(depth * 2, ' ') + (detail ? detail : "") + "\n";
+        }
+        sqlite3_finalize(explainStatement);
+    }
+    return plan;
+}
+
+// --------------------------------------------------------------------------
+void SSlowQueryLogConfigure(size_t maxQueries, int sampleEvery, uint64_t thresholdUS) {
+    SINFO("Keeping the last " << maxQueries << " slow queries, sampling one in " << max(sampleEvery, 1)
+          << (thresholdUS == UINT64_MAX ? "." : ", slower than " + SToStr(thresholdUS) + "us."));
+    lock_guard<mutex> lock(_SSlowQueryLogMutex);
+    _SSlowQueryLogMax = maxQueries;
+    _SSlowQueryLogSampleEvery = max(sampleEvery, 1);
+    _SSlowQueryLogThresholdUS = thresholdUS;
+    while (_SSlowQueryLog.size() > maxQueries) {
+        _SSlowQueryLog.pop_front();
+    }
+}
+
+// --------------------------------------------------------------------------
+void SSlowQueryLogRecord(sqlite3* db, const string& sql, uint64_t elapsed, int64_t warnThreshold, int result,
+                         const SQueryStats& stats) {
+    if (!_SSlowQueryLogMax.load(memory_order_relaxed)) {
+        return;
+    }
+    const uint64_t threshold = min(_SSlowQueryLogThresholdUS.load(memory_order_relaxed),
+                                   (uint64_t)max(warnThreshold, (int64_t)0));
+    if (elapsed <= threshold || _SSlowQueryLogCount++ % _SSlowQueryLogSampleEvery.load(memory_order_relaxed)) {
+        return;
+    }
+
+    // Explaining the query is the expensive part, so it's done before taking the lock.
+    string normalized;
+    _SQueryLogNormalize(sql, normalized);
+    STable query;
+    query["time"] = STimeNow();
+    query["elapsed"] = elapsed;
+    query["query"] = normalized;
+    query["plan"] = _SSlowQueryLogPlan(db, sql);
+    query["result"] = result;
+    query["vmSteps"] = stats.vmSteps;
+    query["fullScanSteps"] = stats.fullScanSteps;
+    query["sorts"] = stats.sorts;
+    query["autoIndexes"] = stats.autoIndexes;
+    query["rows"] = stats.rows;
+    query["command"] = SThreadQueryOrigin.command;
+    query["requestID"] = SThreadQueryOrigin.requestID;
+    const char* filename = sqlite3_db_filename(db, "main");
+    query["filename"] = filename ? filename : "";
+
+    lock_guard<mutex> lock(_SSlowQueryLogMutex);
+    if (!_SSlowQueryLogMax) {
+        return;
+    }
+    _SSlowQueryLog.push_back(move(query));
+    while (_SSlowQueryLog.size() > _SSlowQueryLogMax) {
+        _SSlowQueryLog.pop_front();
+    }
+}
+
+// --------------------------------------------------------------------------
+list<STable> SSlowQueryLogGet() {
+    lock_guard<mutex> lock(_SSlowQueryLogMutex);
+    return list<STable>(_SSlowQueryLog.begin(), _SSlowQueryLog.end());
+}
@@ -7,6 +7,7 @@ class SRandom {
     static string randStr(uint& length);
 
   private:
-    static mt19937_64 _generator;
-    static uniform_int_distribution<uint64_t> _distribution64;
+    // Each thread gets its own generator, so that threads can ask for random numbers at the same time.
+    static thread_local mt19937_64 _generator;
+    static thread_local uniform_int_distribution<uint64_t> _distribution64;
 };
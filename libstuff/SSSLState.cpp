@@ -151,6 +151,19 @@ int SSSLSend(SSSLState* ssl, const string& buffer) {
     return SSSLSend(ssl, buffer.c_str(), (int)buffer.size());
 }
 
+// --------------------------------------------------------------------------
+// Sends as much of a buffer as the socket will take, returning how much that was in `totalSent`, and whether the
+// socket is still alive. mbedtls writes at most one record per call, so we keep going until it can't make progress,
+// rather than sending a single record per poll loop.
+static bool _SSSLSendAsMuchAsPossible(SSSLState* ssl, const char* buffer, size_t length, size_t& totalSent) {
+    totalSent = 0;
+    int numSent = 0;
+    while (totalSent < length && (numSent = SSSLSend(ssl, buffer + totalSent, (int)(length - totalSent))) > 0) {
+        totalSent += numSent;
+    }
+    return (numSent != -1);
+}
+
 // --------------------------------------------------------------------------
 bool SSSLSendConsume(SSSLState* ssl, string& sendBuffer) {
     // Send as much as we can and return whether the socket is still alive
@@ -158,14 +171,32 @@ bool SSSLSendConsume(SSSLState* ssl, string& sendBuffer) {
         return true;
     }
 
-    // Nothing to send, assume we're alive
-    int numSent = SSSLSend(ssl, sendBuffer);
-    if (numSent > 0) {
-        SConsumeFront(sendBuffer, numSent);
+    // Consume everything that went at once, rather than a record at a time
+    size_t totalSent = 0;
+    const bool alive = _SSSLSendAsMuchAsPossible(ssl, sendBuffer.data(), sendBuffer.size(), totalSent);
+    if (totalSent) {
+        SConsumeFront(sendBuffer, totalSent);
     }
 
     // Done!
-    return (numSent != -1);
+    return alive;
+}
+
+// --------------------------------------------------------------------------
+bool SSSLSendConsume(SSSLState* ssl, SFastBuffer& sendBuffer) {
+    // Send as much as we can and return whether the socket is still alive
+    if (sendBuffer.empty()) {
+        return true;
+    }
+
+    size_t totalSent = 0;
+    const bool alive = _SSSLSendAsMuchAsPossible(ssl, sendBuffer.c_str(), sendBuffer.size(), totalSent);
+    if (totalSent) {
+        sendBuffer.consumeFront(totalSent);
+    }
+
+    // Done!
+    return alive;
 }
 
 // --------------------------------------------------------------------------
@@ -20,6 +20,7 @@ extern SSSLState* SSSLOpen(int s, SX509* x509);
 extern int SSSLSend(SSSLState* ssl, const char* buffer, int length);
 extern int SSSLSend(SSSLState* ssl, const string& buffer);
 extern bool SSSLSendConsume(SSSLState* ssl, string& sendBuffer);
+extern bool SSSLSendConsume(SSSLState* ssl, SFastBuffer& sendBuffer);
 extern bool SSSLSendAll(SSSLState* ssl, const string& buffer);
 extern int SSSLRecv(SSSLState* ssl, char* buffer, int length);
 extern bool SSSLRecvAppend(SSSLState* ssl, string& recvBuffer);
@@ -172,6 +172,7 @@ void _SSignal_StackTrace(int signum, siginfo_t *info, void *ucontext) {
             SSignalHandlerDieFunc();
             SSignalHandlerDieFunc = [](){};
             SWARN("DIE function returned, aborting (if not done).");
+            SLogFlush();
         }
 
         // If we weren't already in ABORT, we'll call that. The second call will skip the above callstack generation.
@@ -1,4 +1,6 @@
 #pragma once
+#include <deque>
+#include <sys/eventfd.h>
 
 template <typename T>
 class SSynchronizedQueue {
@@ -11,7 +13,10 @@ class SSynchronizedQueue {
     SSynchronizedQueue(const SSynchronizedQueue& other) = delete;
 
     // This queue can be watched by a `poll` loop. These functions are called with an fd_map to prepare for/handle
-    // activity from polling.
+    // activity from polling. The queue's fd is readable when something's been pushed since the last `postPoll` that
+    // saw it. Pushing to a queue that's already been signaled doesn't signal it again, so a consumer that doesn't get
+    // everything off the queue after `postPoll` is re-signaled by `pop` instead. `bytesToRead` is ignored, and only
+    // remains for compatibility.
     void prePoll(fd_map& fdm);
     void postPoll(fd_map& fdm, int bytesToRead = 1);
 
@@ -25,6 +30,9 @@ class SSynchronizedQueue {
     // Get an item off the queue.
     T pop();
 
+    // Get every item off the queue at once, in order, or an empty deque if there's nothing queued.
+    deque<T> popAll();
+
     // Push an item onto the queue, by move.
     void push(T&& rhs);
 
@@ -35,47 +43,77 @@ class SSynchronizedQueue {
     void each(const function<void (T&)> f);
 
   protected:
-    list<T> _queue;
-    mutable recursive_mutex _queueMutex;
-    int _pipeFD[2] = {-1, -1};
+    // Called with `_queueMutex` held on each item as it's pushed, and on each item as it's popped. These do nothing
+    // unless specialized.
+    void _pushed(T& item) { }
+    void _popped(T& item) { }
+
+    // Called with `_queueMutex` held when the queue has something in it a consumer might not know about. Returns true
+    // if the caller needs to signal `_eventFD` once it's released the lock.
+    bool _needsSignal();
+
+    // Wakes any poller.
+    void _signal();
+
+    deque<T> _queue;
+    mutable mutex _queueMutex;
+    int _eventFD = -1;
+
+    // True from when we decide to signal `_eventFD` until `postPoll` reads it, so that we signal it once, however
+    // many items are pushed in the meantime.
+    bool _signaled = false;
 };
 
 template<typename T>
 SSynchronizedQueue<T>::SSynchronizedQueue() {
-    // Open up a pipe for communication and set the non-blocking reads.
-    SASSERT(0 == pipe(_pipeFD));
-    int flags = fcntl(_pipeFD[0], F_GETFL, 0);
-    fcntl(_pipeFD[0], F_SETFL, flags | O_NONBLOCK);
+    // The eventfd's counter is non-zero, and so it's readable, from when it's signaled until it's read.
+    _eventFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    SASSERT(_eventFD != -1);
 }
 
 template<typename T>
 SSynchronizedQueue<T>::~SSynchronizedQueue() {
-    if (_pipeFD[0] != -1) {
-        close(_pipeFD[0]);
-    }
-    if (_pipeFD[1] != -1) {
-        close(_pipeFD[0]);
+    if (_eventFD != -1) {
+        S_close(_eventFD);
     }
 }
 
 template<typename T>
 void SSynchronizedQueue<T>::prePoll(fd_map& fdm) {
-    // Put the read-side of the pipe into the fd set.
-    // **NOTE: This is *not* synchronized.  All threads use the same pipes. All threads use *different* fd_maps, though
-    //         so we don't have to worry about contention inside FDSet.
-    SFDset(fdm, _pipeFD[0], SREADEVTS);
+    // Put the eventfd into the fd set.
+    // **NOTE: This is *not* synchronized.  All threads use the same eventfd. All threads use *different* fd_maps,
+    //         though so we don't have to worry about contention inside FDSet.
+    SFDset(fdm, _eventFD, SREADEVTS);
 }
 
 template<typename T>
 void SSynchronizedQueue<T>::postPoll(fd_map& fdm, int bytesToRead) {
-    // Caller determines the bytes to read.  If a consumer can only process one item then it will only read 1 byte. If
-    // the pipe has more data to read it will continue to "fire" so other threads also subscribing will pick up work.
-    if (SFDAnySet(fdm, _pipeFD[0], SREADEVTS)) {
-        char readbuffer[bytesToRead];
-        read(_pipeFD[0], readbuffer, sizeof(readbuffer));
+    // Reading resets the counter, so this clears every signal since the last read at once. The caller is expected to
+    // look at the queue after this, and anything it leaves there is signaled again when it next pops.
+    if (SFDAnySet(fdm, _eventFD, SREADEVTS)) {
+        SAUTOLOCK(_queueMutex);
+        uint64_t count;
+        if (read(_eventFD, &count, sizeof(count)) == sizeof(count)) {
+            _signaled = false;
+        }
     }
 }
 
+template<typename T>
+bool SSynchronizedQueue<T>::_needsSignal() {
+    if (_signaled) {
+        return false;
+    }
+    _signaled = true;
+    return true;
+}
+
+template<typename T>
+void SSynchronizedQueue<T>::_signal() {
+    const uint64_t one = 1;
+    SASSERT(write(_eventFD, &one, sizeof(one)) == sizeof(one));
+}
+
 template<typename T>
 bool SSynchronizedQueue<T>::empty() const {
     SAUTOLOCK(_queueMutex);
@@ -93,24 +131,48 @@ const T& SSynchronizedQueue<T>::front() const {
 
 template<typename T>
 T SSynchronizedQueue<T>::pop() {
+    unique_lock<mutex> lock(_queueMutex);
+    if (_queue.empty()) {
+        throw out_of_range("No commands");
+    }
+    T item = move(_queue.front());
+    _queue.pop_front();
+    _popped(item);
+
+    // If the consumer has already seen the signal, it may not look again without another one.
+    const bool signal = !_queue.empty() && _needsSignal();
+    lock.unlock();
+    if (signal) {
+        _signal();
+    }
+    return item;
+}
+
+template<typename T>
+deque<T> SSynchronizedQueue<T>::popAll() {
+    deque<T> items;
     SAUTOLOCK(_queueMutex);
-    if (!_queue.empty()) {
-        T item = move(_queue.front());
-        _queue.pop_front();
-        return item;
+    items.swap(_queue);
+    for (T& item : items) {
+        _popped(item);
     }
-    throw out_of_range("No commands");
+    return items;
 }
 
 template<typename T>
 void SSynchronizedQueue<T>::push(T&& rhs) {
-    SAUTOLOCK(_queueMutex);
-    // Just add to the queue
-    _queue.push_back(move(rhs));
+    bool signal = false;
+    {
+        SAUTOLOCK(_queueMutex);
+        _queue.push_back(move(rhs));
+        _pushed(_queue.back());
+        signal = _needsSignal();
+    }
 
-    // Write arbitrary buffer to the pipe so any subscribers will be awoken.
-    // **NOTE: 1 byte so write is atomic.
-    SASSERT(write(_pipeFD[1], "A", 1));
+    // Signal without the lock, so that a consumer woken by this doesn't immediately wait for it.
+    if (signal) {
+        _signal();
+    }
 }
 
 template<typename T>
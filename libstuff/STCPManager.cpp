@@ -1,4 +1,10 @@
 #include "libstuff.h"
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
 atomic<uint64_t> STCPManager::Socket::socketCount(1);
 
@@ -222,7 +228,7 @@ STCPManager::Socket::Socket(int sock, STCPManager::Socket::State state_, SX509*
 { }
 
 STCPManager::Socket::~Socket() {
-    ::close(s);
+    S_close(s);
     if (ssl) {
         SSSLClose(ssl);
     }
@@ -267,13 +273,42 @@ bool STCPManager::Socket::send() {
 }
 
 bool STCPManager::Socket::send(const string& buffer) {
+    return send(buffer, "");
+}
+
+bool STCPManager::Socket::send(const string& header, const string& content) {
     lock_guard<decltype(sendRecvMutex)> lock(sendRecvMutex);
 
     // If the socket's in a valid state for sending, append to the sendBuffer, otherwise warn
     if (state.load() < Socket::State::SHUTTINGDOWN) {
-        sendBuffer += buffer;
+        // If we're connected without SSL and there's nothing queued ahead of this, we can write it directly, and
+        // avoid copying anything the socket accepts right away into the buffer.
+        size_t sent = 0;
+        if (state.load() == Socket::CONNECTED && !ssl && s > 0 && sendBuffer.empty()) {
+            iovec parts[2] = {{(void*)header.data(), header.size()}, {(void*)content.data(), content.size()}};
+            msghdr message = {};
+            message.msg_iov = parts;
+            message.msg_iovlen = content.empty() ? 1 : 2;
+            ssize_t result = sendmsg(s, &message, MSG_NOSIGNAL);
+            if (result > 0) {
+                sent = result;
+                lastSendTime = STimeNow();
+            } else if (result < 0 && !SCheckNetworkErrorType("sendmsg", SGetPeerName(s), errno)) {
+                return false;
+            }
+        }
+
+        // Buffer whatever's left.
+        if (sent < header.size()) {
+            sendBuffer.append(header.data() + sent, header.size() - sent);
+            sendBuffer.append(content.data(), content.size());
+        } else {
+            size_t contentSent = sent - header.size();
+            sendBuffer.append(content.data() + contentSent, content.size() - contentSent);
+        }
     } else if (!sendBuffer.empty()) {
-        SWARN("Not appending to sendBuffer in socket state " << state.load() << ", tried to send: " << buffer);
+        SWARN("Not appending to sendBuffer in socket state " << state.load() << ", tried to send: " << header
+              << content);
     }
 
     // Send anything we've got.
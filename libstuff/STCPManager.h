@@ -22,6 +22,10 @@ struct STCPManager {
         void* data;
         bool send();
         bool send(const string& buffer);
+
+        // Sends `header` followed by `content`. If nothing is already waiting to be sent, this writes both straight
+        // to the socket in one call, without concatenating them, and only buffers what the socket didn't accept.
+        bool send(const string& header, const string& content);
         bool recv();
         uint64_t id;
 
@@ -36,7 +40,7 @@ struct STCPManager {
         // This is private because it's used by our synchronized send() functions. This requires it to only
         // be accessed through the (also synchronized) wrapper functions above.
         // NOTE: Currently there's no synchronization around `recvBuffer`. It can only be accessed by one thread.
-        string sendBuffer;
+        SFastBuffer sendBuffer;
 
         // Each socket owns it's own SX509 object to avoid thread-safety issues reading/writing the same certificate in
         // the underlying ssl code. Once assigned, the socket owns this object for it's lifetime and will delete it
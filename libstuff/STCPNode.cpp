@@ -4,7 +4,7 @@
 #define SLOGPREFIX "{" << name << "} "
 
 STCPNode::STCPNode(const string& name_, const string& host, const uint64_t recvTimeout_)
-    : STCPServer(host), name(name_), recvTimeout(recvTimeout_) {
+    : STCPServer(host), name(name_), recvTimeout(recvTimeout_), heartbeatInterval(0) {
 }
 
 STCPNode::~STCPNode() {
@@ -93,7 +93,7 @@ void STCPNode::postPoll(fd_map& fdm, uint64_t& nextActivity) {
                             if (!peer->s) {
                                 // Attach to this peer and LOGIN
                                 PINFO("Attaching incoming socket");
-                                peer->s = socket;
+                                peer->setSocket(socket);
                                 peer->failedConnections = 0;
                                 acceptedSocketList.erase(socketIt);
                                 foundIt = true;
@@ -150,18 +150,41 @@ void STCPNode::postPoll(fd_map& fdm, uint64_t& nextActivity) {
                         STHROW("Timed Out!");
                     }
 
-                    // Send PINGs 5s before the socket times out
-                    if (STimeNow() - peer->s->lastSendTime > recvTimeout - 5 * STIME_US_PER_S) {
+                    if (heartbeatInterval) {
+                        // A peer that has missed this many heartbeats may never answer a shutdown either, so we don't
+                        // wait for its socket to close before we treat it as gone.
+                        if (peer->s->lastRecvTime + heartbeatInterval * HEARTBEAT_MISSES < STimeNow()) {
+                            PHMMM("No heartbeat for " << (STimeNow() - peer->s->lastRecvTime) / 1000
+                                  << "ms, dropping connection.");
+                            _onDisconnect(peer);
+                            peer->closeSocket(this);
+                            peer->reset();
+                            peer->nextReconnect = STimeNow() + heartbeatInterval;
+                            nextActivity = min(nextActivity, peer->nextReconnect);
+                            break;
+                        }
+
+                        // Every PING is answered with a PONG, so this keeps traffic coming back from every peer.
+                        if (STimeNow() - peer->lastPingTime >= heartbeatInterval) {
+                            _sendPING(peer);
+                        }
+                        nextActivity = min(nextActivity, peer->lastPingTime + heartbeatInterval);
+                    } else if (STimeNow() - peer->s->lastSendTime > recvTimeout - 5 * STIME_US_PER_S) {
+                        // Send PINGs 5s before the socket times out
                         // Let's not delay on flushing the PING PONG exchanges
                         // in case we get blocked before we get to flush later.
                         SINFO("Sending PING to peer '" << peer->name << "'");
                         _sendPING(peer);
                     }
 
-                    // Process all messages
-                    while ((messageSize = message.deserialize(peer->s->recvBuffer))) {
+                    // Process all messages. We parse them in place and consume everything we've parsed at the end,
+                    // rather than shifting the rest of the buffer down after every message.
+                    size_t consumed = 0;
+                    while ((messageSize = message.deserialize(peer->s->recvBuffer.c_str() + consumed,
+                                                              (int)(peer->s->recvBuffer.size() - consumed)))) {
                         // Which message?
-                        SConsumeFront(peer->s->recvBuffer, messageSize);
+                        consumed += messageSize;
+                        _decompress(message);
                         PDEBUG("Received '" << message.methodLine << "'.");
                         if (SIEquals(message.methodLine, "PING")) {
                             // Let's not delay on flushing the PING PONG
@@ -169,7 +192,7 @@ void STCPNode::postPoll(fd_map& fdm, uint64_t& nextActivity) {
                             // get to flush later.  Pass back the remote
                             // timestamp of the PING such that the remote
                             // host can calculate latency.
-                            SINFO("Received PING from peer '" << peer->name << "'. Sending PONG.");
+                            SDEBUG("Received PING from peer '" << peer->name << "'. Sending PONG.");
                             SData pong("PONG");
                             pong["Timestamp"] = message["Timestamp"];
                             peer->s->send(pong.serialize());
@@ -179,12 +202,13 @@ void STCPNode::postPoll(fd_map& fdm, uint64_t& nextActivity) {
                             // for this to be 0 (it's in us), we rely on it being non-zero in order to connect to
                             // peers.
                             peer->latency = max(STimeNow() - message.calc64("Timestamp"), 1ul);
-                            SINFO("Received PONG from peer '" << peer->name << "' (" << peer->latency/1000 << "ms latency)");
+                            SDEBUG("Received PONG from peer '" << peer->name << "' (" << peer->latency/1000 << "ms latency)");
                         } else {
                             // Not a PING or PONG; pass to the child class
                             _onMESSAGE(peer, message);
                         }
                     }
+                    SConsumeFront(peer->s->recvBuffer, consumed);
                 } catch (const SException& e) {
                     // Warn if the message is set. Otherwise, the error is that we got no message (we timed out), just
                     // reconnect without complaining about it.
@@ -229,10 +253,19 @@ void STCPNode::postPoll(fd_map& fdm, uint64_t& nextActivity) {
         } else {
             // Not connected, is it time to try again?
             if (STimeNow() > peer->nextReconnect) {
+                // Don't wait on DNS here, it would hold up every other peer. If the peer's address isn't known yet,
+                // it's looked up in the background while we check back in a second.
+                if (!SHostIsResolved(peer->host)) {
+                    PINFO("Waiting for DNS before reconnecting");
+                    peer->nextReconnect = STimeNow() + STIME_US_PER_S;
+                    nextActivity = min(nextActivity, peer->nextReconnect);
+                    continue;
+                }
+
                 // Try again
                 PINFO("Retrying the connection");
                 peer->reset();
-                peer->s = openSocket(peer->host);
+                peer->setSocket(openSocket(peer->host));
                 if (peer->s) {
                     // Try to log in now.  Send a PING immediately after so we
                     // can get a fast estimate of latency.
@@ -261,12 +294,50 @@ void STCPNode::_sendPING(Peer* peer) {
     SData ping("PING");
     ping["Timestamp"] = SToStr(STimeNow());
     peer->s->send(ping.serialize());
+    peer->lastPingTime = STimeNow();
+}
+
+void STCPNode::_decompress(SData& message) {
+    auto it = message.nameValueMap.find("Content-Encoding");
+    if (it != message.nameValueMap.end() && SIEquals(it->second, "gzip")) {
+        message.nameValueMap.erase(it);
+        if (!message.content.empty()) {
+            message.content = SGUnzip(message.content);
+            if (message.content.empty()) {
+                STHROW("failed to decompress message");
+            }
+        }
+    }
+}
+
+string STCPNode::Peer::serialize(const SData& message) const {
+    string compressed = serializeCompressed(message, message.content);
+    return compressed.empty() ? message.serialize() : compressed;
+}
+
+string STCPNode::Peer::serializeCompressed(const SData& message, const string& content) const {
+    if (supportsCompression.load() && content.size() >= MIN_COMPRESSED_SIZE) {
+        // This is on the replication path, so we use the fastest compression level rather than SComposeHTTP's default.
+        SFlatTable headers = message.nameValueMap;
+        headers["Content-Encoding"] = "gzip";
+        string buffer = SComposeHTTP(message.methodLine, headers, content, 1);
+
+        // If it didn't compress, SComposeHTTP left the content as it is, and the whole message is bigger than it. The
+        // caller can send that without concatenating it, so we don't return it.
+        if (buffer.size() < content.size()) {
+            return buffer;
+        }
+    }
+    return "";
 }
 
 void STCPNode::Peer::sendMessage(const SData& message) {
+    // Serializing (and compressing) a large message can take a while, so we do it before locking, to not hold up
+    // anything closing the socket in the meantime.
+    const string serialized = serialize(message);
     lock_guard<decltype(socketMutex)> lock(socketMutex);
     if (s) {
-        s->send(message.serialize());
+        s->send(serialized);
     } else {
         SWARN("Tried to send " << message.methodLine << " to peer, but not available.");
     }
@@ -277,6 +348,7 @@ void STCPNode::Peer::closeSocket(STCPManager* manager) {
     if (s) {
         manager->closeSocket(s);
         s = nullptr;
+        closedConnections++;
     } else {
         SWARN("Peer " << name << " has no socket.");
     }
@@ -1,6 +1,8 @@
 #pragma once
 
 struct STCPNode : public STCPServer {
+    friend class STCPNodeTester;
+
     // Begins listening for connections on a given port
     STCPNode(const string& name, const string& host, const uint64_t recvTimeout_ = STIME_US_PER_M);
     virtual ~STCPNode();
@@ -19,22 +21,45 @@ struct STCPNode : public STCPServer {
         string host;
         STable params;
         uint64_t latency;
+        uint64_t lastPingTime;
         uint64_t nextReconnect;
         uint64_t id;
         int failedConnections;
 
+        // Set when the peer tells us it can decompress messages we send it. This is atomic because messages can be
+        // sent to a peer from any thread.
+        atomic<bool> supportsCompression;
+
+        // How many times this peer's socket has been closed, so a message queued to send on one connection can tell
+        // if it's been replaced by the time it's sent.
+        atomic<uint64_t> closedConnections;
+
+        // Messages with less content than this aren't worth compressing.
+        static constexpr size_t MIN_COMPRESSED_SIZE = 1024;
+
         // Helper methods
         Peer(const string& name_, const string& host_, const STable& params_, uint64_t id_)
-          : name(name_), host(host_), params(params_), latency(0), nextReconnect(0), id(id_),
-            failedConnections(0), s(nullptr)
+          : name(name_), host(host_), params(params_), latency(0), lastPingTime(0), nextReconnect(0), id(id_),
+            failedConnections(0), supportsCompression(false), closedConnections(0), s(nullptr)
         { }
         bool connected() { return (s && s->state.load() == STCPManager::Socket::CONNECTED); }
         void reset() {
             clear();
-            s = nullptr;
+            setSocket(nullptr);
             latency = 0;
+            lastPingTime = 0;
+            supportsCompression = false;
         }
 
+        // Serializes a message to send to this peer, compressing its content if the peer supports it and there's
+        // enough of it to be worth it.
+        string serialize(const SData& message) const;
+
+        // Like `serialize`, but with `content` in place of the message's own, and only if it compresses: returns an
+        // empty string if this peer doesn't support compression or it wouldn't make the message smaller. This lets
+        // a caller send the headers and an uncompressed content separately, without ever concatenating them.
+        string serializeCompressed(const SData& message, const string& content) const;
+
         // Close the peer's socket. This is synchronized so that you can safely call closeSocket and sendMessage on
         // different threads.
         void closeSocket(STCPManager* manager);
@@ -42,6 +67,13 @@ struct STCPNode : public STCPServer {
         // Send a message to this peer.
         void sendMessage(const SData& message);
 
+        // Replaces the peer's socket. Messages can be sent from other threads, which read `s` while holding
+        // `socketMutex`, so every change to it is made under that lock too.
+        void setSocket(Socket* socket) {
+            lock_guard<decltype(socketMutex)> lock(socketMutex);
+            s = socket;
+        }
+
       private:
         Socket* s;
         recursive_mutex socketMutex;
@@ -53,6 +85,12 @@ struct STCPNode : public STCPServer {
     // Attributes
     string name;
     uint64_t recvTimeout;
+
+    // If set, we PING every peer this often, and drop the connection to any peer we haven't heard from in
+    // HEARTBEAT_MISSES of these, rather than waiting out recvTimeout. This is how we notice quickly that a peer has
+    // gone away without closing its socket.
+    uint64_t heartbeatInterval;
+    static constexpr int HEARTBEAT_MISSES = 4;
     vector<Peer*> peerList;
     list<Socket*> acceptedSocketList;
 
@@ -78,4 +116,7 @@ struct STCPNode : public STCPServer {
 
     // Helper functions
     void _sendPING(Peer* peer);
+
+    // Decompresses the content of a message received from a peer, if it was sent compressed.
+    static void _decompress(SData& message);
 };
@@ -12,12 +12,12 @@ STCPServer::~STCPServer() {
     closePorts();
 }
 
-STCPServer::Port* STCPServer::openPort(const string& host) {
+STCPServer::Port* STCPServer::openPort(const string& host, bool reusePort) {
     // Open a port on the requested host
     SASSERT(SHostIsValid(host));
     Port port;
     port.host = host;
-    port.s = S_socket(host, true, true, false);
+    port.s = S_socket(host, true, true, false, reusePort);
     SASSERT(port.s >= 0);
     lock_guard <decltype(portListMutex)> lock(portListMutex);
     list<Port>::iterator portIt = portList.insert(portList.end(), port);
@@ -33,7 +33,7 @@ void STCPServer::closePorts(list<Port*> except) {
         while (it != portList.end()) {
             if  (find(except.begin(), except.end(), &(*it)) == except.end()) {
                 // Close this port
-                ::close(it->s);
+                S_close(it->s);
                 SINFO("Close ports closing " << it->host << ".");
                 it = portList.erase(it);
             } else {
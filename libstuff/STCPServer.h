@@ -16,8 +16,8 @@ struct STCPServer : public STCPManager {
     // Destructor
     virtual ~STCPServer();
 
-    // Begins listening on a new port
-    Port* openPort(const string& host);
+    // Begins listening on a new port. Set `reusePort` to share the address with other servers listening on it.
+    Port* openPort(const string& host, bool reusePort = false);
 
     // Closes all open ports, allowing for exceptions.
     void closePorts(list<Port*> except = {});
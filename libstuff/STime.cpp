@@ -17,6 +17,31 @@ string SComposeTime(const string& format, uint64_t when) {
     return string(buf, length);
 }
 
+// --------------------------------------------------------------------------
+static thread_local uint64_t _g_currentTimeSecond = 0;
+static thread_local string _g_currentTimeString;
+
+const string& SCurrentTimeString() {
+    const uint64_t now = STimeNow();
+    if (now / STIME_US_PER_S != _g_currentTimeSecond || _g_currentTimeString.empty()) {
+        _g_currentTimeSecond = now / STIME_US_PER_S;
+        _g_currentTimeString = SComposeTime("%Y-%m-%d %H:%M:%S", now);
+    }
+    return _g_currentTimeString;
+}
+
+// --------------------------------------------------------------------------
+string SCURRENT_TIMESTAMP() {
+    // There's nothing to escape in a formatted timestamp, so we can just quote it.
+    const string& now = SCurrentTimeString();
+    string quoted;
+    quoted.reserve(now.size() + 2);
+    quoted += '\'';
+    quoted += now;
+    quoted += '\'';
+    return quoted;
+}
+
 // --------------------------------------------------------------------------
 int SDaysInMonth(int year, int month) {
     // 30 days hath September...
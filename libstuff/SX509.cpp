@@ -1,6 +1,27 @@
 #include "libstuff.h"
 #include <mbedtls/certs.h>
 
+// The most closed certificates we keep for any one set of credentials.
+static const size_t SX509_MAX_POOLED = 64;
+
+// Closed certificates, by the credentials they were parsed from. These are function statics so that certificates can
+// be opened and closed regardless of static initialization order.
+static mutex& _SX509PoolMutex() {
+    static mutex poolMutex;
+    return poolMutex;
+}
+static map<string, list<SX509*>>& _SX509Pool() {
+    static map<string, list<SX509*>> pool;
+    return pool;
+}
+
+// --------------------------------------------------------------------------
+static void _SX509Free(SX509* x509) {
+    mbedtls_x509_crt_free(&x509->srvcert);
+    mbedtls_pk_free(&x509->pk);
+    delete x509;
+}
+
 // --------------------------------------------------------------------------
 SX509* SX509Open() {
     // Initialize with defaults
@@ -14,6 +35,18 @@ SX509* SX509Open(const string& pem, const string& srvCrt, const string& caCrt) {
     const char* srvCrtPtr = (srvCrt.empty() ? mbedtls_test_srv_crt : srvCrt.c_str());
     const char* caCrtPtr = (caCrt.empty() ? mbedtls_test_ca_crt : caCrt.c_str());
 
+    // Re-use a previously parsed certificate if we have one.
+    string credentials = string(pemPtr) + '\0' + srvCrtPtr + '\0' + caCrtPtr;
+    {
+        lock_guard<mutex> lock(_SX509PoolMutex());
+        auto it = _SX509Pool().find(credentials);
+        if (it != _SX509Pool().end() && !it->second.empty()) {
+            SX509* x509 = it->second.back();
+            it->second.pop_back();
+            return x509;
+        }
+    }
+
     // Just create a fake certificate from the PolarSSL defaults
     SX509* x509 = new SX509;
     mbedtls_x509_crt_init(&(x509->srvcert));
@@ -29,19 +62,26 @@ SX509* SX509Open(const string& pem, const string& srvCrt, const string& caCrt) {
         if (mbedtls_x509_crt_parse(&x509->srvcert, (unsigned char*)caCrtPtr, (int)strlen(caCrtPtr) + 1)) {
             STHROW("parsing CA certificate");
         }
+        x509->credentials = move(credentials);
         return x509;
     } catch (const SException& e) {
         // Failed
         SWARN("X509 creation failed while '" << e.what() << "', cancelling.");
-        SX509Close(x509);
+        _SX509Free(x509);
         return 0;
     }
 }
 
 // --------------------------------------------------------------------------
 void SX509Close(SX509* x509) {
-    // Clean up
-    mbedtls_x509_crt_free(&x509->srvcert);
-    mbedtls_pk_free(&x509->pk);
-    delete x509;
+    // Return it to the pool for the next socket, unless the pool is already full.
+    {
+        lock_guard<mutex> lock(_SX509PoolMutex());
+        list<SX509*>& pooled = _SX509Pool()[x509->credentials];
+        if (pooled.size() < SX509_MAX_POOLED) {
+            pooled.push_back(x509);
+            return;
+        }
+    }
+    _SX509Free(x509);
 }
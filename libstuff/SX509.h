@@ -7,9 +7,14 @@ struct SX509 {
     // Attributes
     mbedtls_x509_crt srvcert;
     mbedtls_pk_context pk;
+
+    // The credentials this was parsed from, used to return it to the right pool when closed.
+    string credentials;
 };
 
-// X509 Certificates
+// X509 Certificates. Each certificate is only ever used by one socket at a time, as the key isn't safe to use from
+// more than one thread at once. Parsing the key and certificates is expensive though, so closed certificates are kept
+// in a pool and handed out again by the next SX509Open with the same credentials, rather than parsed again.
 extern SX509* SX509Open();
 extern SX509* SX509Open(const string& pem, const string& srvCrt, const string& caCrt);
 extern void SX509Close(SX509* x509);
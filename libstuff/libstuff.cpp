@@ -16,6 +16,12 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <dirent.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #ifdef __APPLE__
 // Apple specific tweaks
 #include <sys/types.h>
@@ -74,6 +80,53 @@ void SInitialize(string threadName, const char* processName) {
     SInitializeSignals();
 }
 
+// Adds the CPUs in `cpuList` to `cpus`, returning false if any of them aren't valid.
+static bool _SParseCPUList(const string& cpuList, cpu_set_t& cpus) {
+    for (const string& item : SParseList(cpuList)) {
+        if (SStartsWith(item, "node")) {
+            // The kernel lists the CPUs on each NUMA node in the same format.
+            const string nodeCPUs = STrim(SFileLoad("/sys/devices/system/node/" + item + "/cpulist"));
+            if (nodeCPUs.empty() || !_SParseCPUList(nodeCPUs, cpus)) {
+                return false;
+            }
+            continue;
+        }
+        const size_t dash = item.find('-');
+        const string firstCPU = item.substr(0, dash);
+        const string lastCPU = dash == string::npos ? firstCPU : item.substr(dash + 1);
+        for (const string& cpu : {firstCPU, lastCPU}) {
+            if (cpu.empty() || cpu.size() > 6 || cpu.find_first_not_of("0123456789") != string::npos) {
+                return false;
+            }
+        }
+        const int first = SToInt(firstCPU);
+        const int last = SToInt(lastCPU);
+        if (last < first || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, &cpus);
+        }
+    }
+    return true;
+}
+
+bool SSetThreadAffinity(const string& cpuList) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (!_SParseCPUList(cpuList, cpus) || !CPU_COUNT(&cpus)) {
+        SWARN("Invalid CPU list '" << cpuList << "', not setting thread affinity.");
+        return false;
+    }
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (error) {
+        SWARN("Couldn't set thread affinity to '" << cpuList << "': " << strerror(error));
+        return false;
+    }
+    SINFO("Pinned thread to CPUs '" << cpuList << "'.");
+    return true;
+}
+
 // Thread-local log prefix
 void SLogSetThreadPrefix(const string& logPrefix) {
     SThreadLogPrefix = logPrefix;
@@ -268,44 +321,84 @@ string SStrip(const string& lhs, const string& chars, bool charsAreSafe) {
 }
 
 // --------------------------------------------------------------------------
-string SEscape(const char* lhs, const string& unsafe, char escaper) {
-    // Escape all unsafe characters
-    string working;
-    while (*lhs) {
-        // Insert an escape if an unsafe characater
-        if (unsafe.find(*lhs) != string::npos || *lhs == escaper) {
-            // Insert the escape
-            const char& c = *lhs;
-            working += escaper;
-            if (c == '\b')
-                working += 'b';
-            else if (c == '\f')
-                working += 'f';
-            else if (c == '\n')
-                working += 'n';
-            else if (c == '\r')
-                working += 'r';
-            else if (c == '\t')
-                working += 't';
-            else if (c > 0x00 && c < 0x20) {
-                char utfCode[6] = {0};
-                sprintf(utfCode, "u%04x", c);
-                working += utfCode;
-            } else
-                working += c;
-        } else {
-            // Insert as normal
-            working += *lhs;
+void SAppendEscaped(string& out, const char* lhs, const string& unsafe, char escaper) {
+    // Look characters up in a table rather than searching `unsafe` for each one.
+    bool isUnsafe[256] = {};
+    for (char c : unsafe) {
+        isUnsafe[(unsigned char)c] = true;
+    }
+    isUnsafe[(unsigned char)escaper] = true;
+
+    // A NUL ends the string, as it always has.
+    isUnsafe[0] = true;
+    while (true) {
+        // Copy everything up to the next unsafe character at once.
+        const char* safe = lhs;
+        while (!isUnsafe[(unsigned char)*lhs]) {
+            ++lhs;
         }
+        out.append(safe, lhs - safe);
+        if (!*lhs) {
+            return;
+        }
+
+        // Insert the escape
+        const char& c = *lhs;
+        out += escaper;
+        if (c == '\b')
+            out += 'b';
+        else if (c == '\f')
+            out += 'f';
+        else if (c == '\n')
+            out += 'n';
+        else if (c == '\r')
+            out += 'r';
+        else if (c == '\t')
+            out += 't';
+        else if (c > 0x00 && c < 0x20) {
+            char utfCode[6] = {0};
+            sprintf(utfCode, "u%04x", c);
+            out += utfCode;
+        } else
+            out += c;
         ++lhs;
     }
+}
+
+// --------------------------------------------------------------------------
+string SEscape(const char* lhs, const string& unsafe, char escaper) {
+    string working;
+    SAppendEscaped(working, lhs, unsafe, escaper);
     return working;
 }
 
+// --------------------------------------------------------------------------
+void SAppendQuoted(string& out, const char* val) {
+    // Quotes are escaped by doubling them, and nothing else needs escaping, so we can let memchr find them.
+    const size_t length = strlen(val);
+    const char* end = val + length;
+    out.reserve(out.size() + length + 2);
+    out += '\'';
+    while (const char* quote = (const char*)memchr(val, '\'', end - val)) {
+        out.append(val, quote - val + 1);
+        out += '\'';
+        val = quote + 1;
+    }
+    out.append(val, end - val);
+    out += '\'';
+}
+
 // --------------------------------------------------------------------------
 string SUnescape(const char* lhs, char escaper) {
-    // Fix all escaped values
-    string working;
+    // Most strings have nothing escaped, and can be returned as they are.
+    const char* firstEscape = strchr(lhs, escaper);
+    if (!firstEscape || !escaper) {
+        return lhs;
+    }
+
+    // Otherwise, copy everything before the first escape at once, and fix all escaped values from there.
+    string working(lhs, firstEscape - lhs);
+    lhs = firstEscape;
     for (; *lhs; ++lhs) {
         // Insert an escape if an unsafe characater
         if (*lhs == escaper && *(lhs + 1)) // Make sure there's another
@@ -629,7 +722,9 @@ void _SParseHTTP_GetUpToEnd(const char* start, const char* end, string& out) {
 }
 
 // --------------------------------------------------------------------------
-int SParseHTTP(const char* buffer, size_t length, string& methodLine, STable& nameValueMap, string& content) {
+// Parses into either an STable or an SFlatTable, which share the interface used here.
+template <class Table>
+static int _SParseHTTP(const char* buffer, size_t length, string& methodLine, Table& nameValueMap, string& content) {
     // Clear the output
     methodLine.clear();
     nameValueMap.clear();
@@ -684,9 +779,9 @@ int SParseHTTP(const char* buffer, size_t length, string& methodLine, STable& na
                     int headerLength = (int)(parseEnd - buffer);
 
                     // If there is no content-length, just return the length of the headers
-                    int contentLength = (SContains(nameValueMap, "Content-Length")
-                                             ? atoi(nameValueMap["Content-Length"].c_str())
-                                             : 0);
+                    auto contentLengthIt = nameValueMap.find("Content-Length");
+                    int contentLength =
+                        (contentLengthIt != nameValueMap.end() ? atoi(contentLengthIt->second.c_str()) : 0);
                     if (!contentLength)
                         return headerLength;
 
@@ -700,8 +795,7 @@ int SParseHTTP(const char* buffer, size_t length, string& methodLine, STable& na
                     }
 
                     // We have enough data -- copy it and return the full length
-                    content.resize(contentLength);
-                    memcpy(&content[0], parseEnd, contentLength);
+                    content.assign(parseEnd, contentLength);
                     return (headerLength + contentLength);
                 }
 
@@ -720,16 +814,28 @@ int SParseHTTP(const char* buffer, size_t length, string& methodLine, STable& na
 
             // Is it a new chunk?
             else if (isChunked) {
-                // Get the chunk length and ignore the optional stuff after the optional semicolon.
-                string chunkHeader;
-                _SParseHTTP_GetUpToEnd(lineStart, lineEnd, chunkHeader);
-                const string& hexChunkLength = SContains(chunkHeader, ";") ? SBefore(chunkHeader, ";") : chunkHeader;
+                // Get the chunk length and ignore the optional stuff after the optional semicolon. We parse this in
+                // place, as this runs for every chunk.
+                const char* hexStart = lineStart;
+                const char* hexEnd = lineEnd;
+                while (hexStart < hexEnd && *hexStart == ' ')
+                    ++hexStart;
+                while (hexEnd > hexStart && *(hexEnd - 1) == ' ')
+                    --hexEnd;
+                const char* semicolon = (const char*)memchr(hexStart, ';', hexEnd - hexStart);
+                if (semicolon)
+                    hexEnd = semicolon;
+                bool isHex = hexEnd > hexStart && hexEnd - hexStart <= 8;
+                int chunkLength = 0;
+                for (const char* c = hexStart; isHex && c < hexEnd; ++c) {
+                    isHex = isxdigit(*c);
+                    chunkLength = (chunkLength << 4) | (isdigit(*c) ? *c - '0' : tolower(*c) - 'a' + 10);
+                }
 
                 // If valid hex number, then we have a chunk.
-                if (SREMatch("^[a-fA-F0-9]{1,8}$", hexChunkLength)) {
+                if (isHex) {
                     // Get the chunk length.
                     isHeaderOrFooter = false;
-                    int chunkLength = (int)SFromHex(hexChunkLength);
                     if (chunkLength) {
                         // Verify that we can get the entire chunk.
                         const char* chunkStart = lineEnd + 2; // skipping the \r\n.
@@ -778,23 +884,26 @@ int SParseHTTP(const char* buffer, size_t length, string& methodLine, STable& na
                             ++valueStart;
                         while (*(valueEnd - 1) == ' ')
                             --valueEnd;
-                        int valueLength = (int)(valueEnd - valueStart);
-                        string value;
-                        if (valueLength > 0) {
-                            // Copy the value
-                            value.resize(valueLength);
-                            memcpy(&value[0], valueStart, valueLength);
-                        }
+                        size_t valueLength = valueEnd > valueStart ? valueEnd - valueStart : 0;
 
                         // Store the result.  If there's something already
                         // there just override, with the exception of
                         // Set-Cookie: generate a crappy list with 0xFF
                         // separation.  (See SComposeHTTP for explanation.)
-                        STable::iterator it = nameValueMap.find(name);
-                        if (it == nameValueMap.end() || !SIEquals(name, "Set-Cookie"))
-                            nameValueMap[name] = SUnescape(value); // strip any slash-escaping
-                        else
-                            nameValueMap[name] = it->second + S_COOKIE_SEPARATOR + value;
+                        // Values are copied straight from the buffer into
+                        // the table, without an intermediate string.
+                        auto it = nameValueMap.find(name);
+                        if (it != nameValueMap.end() && SIEquals(name, "Set-Cookie")) {
+                            it->second += S_COOKIE_SEPARATOR;
+                            it->second.append(valueStart, valueLength);
+                        } else {
+                            if (it == nameValueMap.end())
+                                it = nameValueMap.emplace(name, SString()).first;
+                            if (memchr(valueStart, '\\', valueLength))
+                                it->second = SUnescape(string(valueStart, valueLength)); // strip any slash-escaping
+                            else
+                                it->second.assign(valueStart, valueLength);
+                        }
                     }
                 }
             }
@@ -821,6 +930,14 @@ int SParseHTTP(const char* buffer, size_t length, string& methodLine, STable& na
     return 0;
 }
 
+int SParseHTTP(const char* buffer, size_t length, string& methodLine, STable& nameValueMap, string& content) {
+    return _SParseHTTP(buffer, length, methodLine, nameValueMap, content);
+}
+
+int SParseHTTP(const char* buffer, size_t length, string& methodLine, SFlatTable& nameValueMap, string& content) {
+    return _SParseHTTP(buffer, length, methodLine, nameValueMap, content);
+}
+
 // --------------------------------------------------------------------------
 bool SParseRequestMethodLine(const string& methodLine, string& method, string& uri) {
     // Clear the input
@@ -987,13 +1104,30 @@ bool SParseURIPath(const char* buffer, int length, string& path, STable& nameVal
 }
 
 // --------------------------------------------------------------------------
-void SComposeHTTP(string& buffer, const string& methodLine, const STable& nameValueMap, const string& content) {
+// Returns about how many bytes composing this message will take, so that the buffer can be sized once up front. Escaped
+// values and split cookies can make it a little longer, which just costs a reallocation.
+template <class Table>
+static size_t _SComposeHTTPSize(const string& methodLine, const Table& nameValueMap, const string& content) {
+    // The method line, "Content-Length: <20 digits>", and each of their line endings and the blank line.
+    size_t size = methodLine.size() + 16 + 20 + 6 + content.size();
+    for (const auto& item : nameValueMap) {
+        size += item.first.size() + item.second.size() + 4;
+    }
+    return size;
+}
+
+// --------------------------------------------------------------------------
+// Appends the method line and headers, except for Content-Length, and returns whether the caller asked for the content
+// to be gzipped.
+template <class Table>
+static bool _SComposeHTTPHeaderLines(string& buffer, const string& methodLine, const Table& nameValueMap,
+                                     const string& content) {
     bool tryGzip = false;
 
     // Just walk across and compose a valid HTTP-like message
-    buffer.clear();
-    buffer += methodLine + "\r\n";
-    for (pair<string, string> item : nameValueMap) {
+    buffer += methodLine;
+    buffer += "\r\n";
+    for (const auto& item : nameValueMap) {
         if (SIEquals("Set-Cookie", item.first)) {
             // Parse this list and generate a separate cookie for each.
             // Technically, this shouldn't be necessary: RFC2109 section 4.2.2
@@ -1002,33 +1136,84 @@ void SComposeHTTP(string& buffer, const string& methodLine, const STable& nameVa
             list<string> cookieList;
             SParseList(item.second, cookieList, S_COOKIE_SEPARATOR); // A bit of a hack, yuck
             for (string& cookie : cookieList) {
-                buffer += "Set-Cookie: " + cookie + "\r\n";
+                buffer += "Set-Cookie: ";
+                buffer += cookie;
+                buffer += "\r\n";
             }
         } else if (SIEquals("Content-Length", item.first)) {
             // Ignore Content-Length; will be generated fresh later
         } else if (SIEquals("Content-Encoding", item.first) && SIEquals("gzip", item.second)) {
             tryGzip = !content.empty();
         } else {
-            buffer += item.first + ": " + SEscape(item.second, "\r\n\t") + "\r\n";
+            buffer += item.first;
+            buffer += ": ";
+            SAppendEscaped(buffer, item.second.c_str(), "\r\n\t");
+            buffer += "\r\n";
         }
     }
+    return tryGzip;
+}
+
+// --------------------------------------------------------------------------
+// Appends the Content-Length header and the blank line that ends the headers.
+static void _SComposeHTTPContentLength(string& buffer, size_t contentLength) {
+    // Always add a Content-Length, even if no content, so there is no ambiguity
+    char digits[21];
+    buffer += "Content-Length: ";
+    buffer.append(digits, snprintf(digits, sizeof(digits), "%zu", contentLength));
+    buffer += "\r\n\r\n";
+}
 
-    const string gzipContent = tryGzip ? SGZip(content) : "";
-    const bool gzipSuccess = !gzipContent.empty();
+// --------------------------------------------------------------------------
+template <class Table>
+static void _SComposeHTTP(string& buffer, const string& methodLine, const Table& nameValueMap, const string& content,
+                          int gzipLevel) {
+    buffer.reserve(buffer.size() + _SComposeHTTPSize(methodLine, nameValueMap, content));
+    const bool tryGzip = _SComposeHTTPHeaderLines(buffer, methodLine, nameValueMap, content);
+    const string gzipContent = tryGzip ? SGZip(content, gzipLevel) : "";
+    const bool gzipSuccess = !gzipContent.empty() && gzipContent.size() < content.size();
     const string& finalContent = gzipSuccess ? gzipContent : content;
 
     if (gzipSuccess) {
         buffer += "Content-Encoding: gzip\r\n";
     }
 
-    // Always add a Content-Length, even if no content, so there is no ambiguity
-    buffer += "Content-Length: " + SToStr(finalContent.size()) + "\r\n";
-
     // Finish the message and add the content, if any
-    buffer += "\r\n";
+    _SComposeHTTPContentLength(buffer, finalContent.size());
     buffer += finalContent;
 }
 
+void SComposeHTTP(string& buffer, const string& methodLine, const STable& nameValueMap, const string& content,
+                  int gzipLevel) {
+    _SComposeHTTP(buffer, methodLine, nameValueMap, content, gzipLevel);
+}
+
+void SComposeHTTP(string& buffer, const string& methodLine, const SFlatTable& nameValueMap, const string& content,
+                  int gzipLevel) {
+    _SComposeHTTP(buffer, methodLine, nameValueMap, content, gzipLevel);
+}
+
+// --------------------------------------------------------------------------
+template <class Table>
+static string _SComposeHTTPHeaders(const string& methodLine, const Table& nameValueMap, const string& content) {
+    string buffer;
+    buffer.reserve(_SComposeHTTPSize(methodLine, nameValueMap, "") + 1);
+    if (_SComposeHTTPHeaderLines(buffer, methodLine, nameValueMap, content)) {
+        // Compression replaces the content, so it can't be sent separately.
+        return "";
+    }
+    _SComposeHTTPContentLength(buffer, content.size());
+    return buffer;
+}
+
+string SComposeHTTPHeaders(const string& methodLine, const STable& nameValueMap, const string& content) {
+    return _SComposeHTTPHeaders(methodLine, nameValueMap, content);
+}
+
+string SComposeHTTPHeaders(const string& methodLine, const SFlatTable& nameValueMap, const string& content) {
+    return _SComposeHTTPHeaders(methodLine, nameValueMap, content);
+}
+
 // --------------------------------------------------------------------------
 string SComposePOST(const STable& nameValueMap) {
     // Accumulate and convert
@@ -1133,20 +1318,141 @@ string SDecodeURIComponent(const char* buffer, int length) {
 // --------------------------------------------------------------------------
 extern const char* _SParseJSONValue(const char* ptr, const char* end, string& value, bool populateValue);
 
-string SToJSON(const string& value, const bool forceString) {
+// Returns a pointer to the first character in [ptr, end) that has to be escaped in a JSON string (a control
+// character, DEL, '"', '\\' or '/'), or `end` if there isn't one. With SSE2 we check 16 characters at a time.
+static const char* _SFindJSONEscape(const char* ptr, const char* end) {
+#ifdef __SSE2__
+    const __m128i control = _mm_set1_epi8(0x1f);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i slash = _mm_set1_epi8('/');
+    for (; end - ptr >= 16; ptr += 16) {
+        const __m128i chunk = _mm_loadu_si128((const __m128i*)ptr);
+
+        // Unsigned `chunk <= 0x1f` is the same as `max(chunk, 0x1f) == 0x1f`.
+        __m128i found = _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control);
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, del));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, quote));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, backslash));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, slash));
+        const int mask = _mm_movemask_epi8(found);
+        if (mask) {
+            return ptr + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; ptr < end; ++ptr) {
+        const unsigned char c = *ptr;
+        if (c < 0x20 || c == 0x7f || c == '"' || c == '\\' || c == '/') {
+            break;
+        }
+    }
+    return ptr;
+}
+
+// Returns a pointer to the first '"', '\\' or null in [ptr, end), or `end` if there isn't one.
+static const char* _SFindJSONStringEnd(const char* ptr, const char* end) {
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i null = _mm_setzero_si128();
+    for (; end - ptr >= 16; ptr += 16) {
+        const __m128i chunk = _mm_loadu_si128((const __m128i*)ptr);
+        __m128i found = _mm_cmpeq_epi8(chunk, quote);
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, backslash));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, null));
+        const int mask = _mm_movemask_epi8(found);
+        if (mask) {
+            return ptr + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (ptr < end && *ptr != '"' && *ptr != '\\' && *ptr) {
+        ++ptr;
+    }
+    return ptr;
+}
+
+// Appends `value` to `out` as a quoted JSON string. Like SEscape, this stops at the first null.
+static void _SComposeJSONString(string& out, const string& value) {
+    out.reserve(out.size() + value.size() + 2);
+    out += '"';
+    const char* ptr = value.data();
+    const char* end = ptr + value.size();
+    while (ptr < end) {
+        const char* special = _SFindJSONEscape(ptr, end);
+        out.append(ptr, special - ptr);
+        if (special == end || !*special) {
+            break;
+        }
+        const char c = *special;
+        out += '\\';
+        if (c == '\b')
+            out += 'b';
+        else if (c == '\f')
+            out += 'f';
+        else if (c == '\n')
+            out += 'n';
+        else if (c == '\r')
+            out += 'r';
+        else if (c == '\t')
+            out += 't';
+        else if (c > 0x00 && c < 0x20) {
+            char utfCode[6] = {0};
+            sprintf(utfCode, "u%04x", c);
+            out += utfCode;
+        } else
+            out += c;
+        ptr = special + 1;
+    }
+    out += '"';
+}
+
+// Returns true if `value` is exactly how SToStr would print some int64_t.
+static bool _SIsJSONInteger(const string& value) {
+    const char* digits = value.c_str();
+    size_t length = value.size();
+    const bool negative = length && *digits == '-';
+    if (negative) {
+        ++digits;
+        --length;
+    }
+    if (!length || length > 19 || (*digits == '0' && (length > 1 || negative))) {
+        return false;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (!isdigit(digits[i])) {
+            return false;
+        }
+    }
+
+    // Only 19 digit numbers can be out of range, and those compare like strings.
+    return length < 19 || strcmp(digits, negative ? "9223372036854775808" : "9223372036854775807") <= 0;
+}
+
+void SComposeJSON(string& out, const string& value, const bool forceString) {
     // Is it an integer?
-    if (SToStr(SToInt64(value.c_str())) == value)
-        return value;
+    if (_SIsJSONInteger(value)) {
+        out += value;
+        return;
+    }
 
     // Is it boolean?
-    if (SIEquals(value, "true"))
-        return "true";
-    if (SIEquals(value, "false"))
-        return "false";
+    if (SIEquals(value, "true")) {
+        out += "true";
+        return;
+    }
+    if (SIEquals(value, "false")) {
+        out += "false";
+        return;
+    }
 
     // Is it null?
-    if (SIEquals(value, "null"))
-        return "null";
+    if (SIEquals(value, "null")) {
+        out += "null";
+        return;
+    }
 
     // Is it already a JSON array or object?
     if (!forceString && value.size() >= 2 &&
@@ -1156,29 +1462,44 @@ string SToJSON(const string& value, const bool forceString) {
         const char* ptr = value.c_str();
         const char* end = ptr + value.size();
         const char* parseEnd = _SParseJSONValue(ptr, end, ignore, false);
-        if (parseEnd == end) // Parsed it all.
-            return value;
+        if (parseEnd == end) { // Parsed it all.
+            out += value;
+            return;
+        }
     }
 
     // Otherwise, it's a string -- escape and return
     // We need to escape all control characters in the string, not just the
     // white-space control characters.
-    return "\"" + SEscape(value, "\x01\x02\x03\x04\x05\x06\x07\b\t\n\x0b\f\r\x0e\x0f\x10\x11"
-                                 "\x12\x13\x14\x15\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f\x7f\"\\/",
-                          '\\') +
-           "\"";
+    _SComposeJSONString(out, value);
+}
+
+string SToJSON(const string& value, const bool forceString) {
+    string working;
+    SComposeJSON(working, value, forceString);
+    return working;
 }
 
 // --------------------------------------------------------------------------
-string SComposeJSONObject(const STable& nameValueMap, const bool forceString) {
-    if (nameValueMap.empty())
-        return "{}";
-    string working = "{";
-    for (pair<string, string> item : nameValueMap) {
-        working += "\"" + item.first + "\":" + SToJSON(item.second, forceString) + ",";
+void SComposeJSON(string& out, const STable& nameValueMap, const bool forceString) {
+    if (nameValueMap.empty()) {
+        out += "{}";
+        return;
     }
-    working.resize(working.size() - 1);
-    working += "}";
+    out += '{';
+    for (const auto& item : nameValueMap) {
+        out += '"';
+        out += item.first;
+        out += "\":";
+        SComposeJSON(out, item.second, forceString);
+        out += ',';
+    }
+    out.back() = '}';
+}
+
+string SComposeJSONObject(const STable& nameValueMap, const bool forceString) {
+    string working;
+    SComposeJSON(working, nameValueMap, forceString);
     return working;
 }
 
@@ -1218,21 +1539,28 @@ const char* _SParseJSONString(const char* ptr, const char* end, string& out, boo
     _JSONWS();
     _JSONTEST('"');
     const char* strStart = ptr;
-    for (; ptr < end && *ptr; ++ptr) {
-        // Found the end of this string
-        if (*ptr == '"')
-            break;
+    bool escaped = false;
+    while (true) {
+        ptr = _SFindJSONStringEnd(ptr, end);
 
         // We want to skip all escaped characters so we don't mistakenly count
         // an escaped double-quote as the actual end.
-        else if (*ptr == '\\')
-            ++ptr;
+        if (ptr < end && *ptr == '\\') {
+            escaped = true;
+            ptr += 2;
+            continue;
+        }
+        break;
     }
     _JSONTEST('"');
 
     if (populateOut) {
-        string strOut(strStart, ptr - strStart - 1);
-        out += SUnescape(strOut.c_str(), '\\');
+        if (escaped) {
+            string strOut(strStart, ptr - strStart - 1);
+            out += SUnescape(strOut.c_str(), '\\');
+        } else {
+            out.append(strStart, ptr - strStart - 1);
+        }
     }
     return ptr;
 }
@@ -1444,7 +1772,7 @@ list<string> SParseJSONArray(const string& array) {
 }
 
 // --------------------------------------------------------------------------
-string SGZip(const string& content) {
+string SGZip(const string& content, int level) {
     z_stream stream;
 
     stream.zalloc = Z_NULL;
@@ -1462,7 +1790,7 @@ string SGZip(const string& content) {
     stream.avail_out = bufferSize;
     stream.next_out = outBuffer;
 
-    int status = deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS | GZIP_ENCODING, MAX_MEM_LEVEL,
+    int status = deflateInit2(&stream, level, Z_DEFLATED, MAX_WBITS | GZIP_ENCODING, MAX_MEM_LEVEL,
                               Z_DEFAULT_STRATEGY);
 
     if (status != Z_OK) {
@@ -1547,7 +1875,130 @@ string SGUnzip (const string& content) {
 /////////////////////////////////////////////////////////////////////////////
 
 // --------------------------------------------------------------------------
-int S_socket(const string& host, bool isTCP, bool isPort, bool isBlocking) {
+// Looks up the IPv4 address of `domain`. Returns 0 if it can't be resolved.
+static uint32_t _SLookupDomain(const string& domain) {
+    uint64_t start = STimeNow();
+
+    // Allocate and initialize addrinfo structures.
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    struct addrinfo* resolved = nullptr;
+
+    // Set up the hints.
+    hints.ai_family = AF_INET; // IPv4
+    hints.ai_socktype = SOCK_STREAM;
+
+    // Do the initialization.
+    int result = getaddrinfo(domain.c_str(), nullptr, &hints, &resolved);
+    SINFO("DNS lookup took " << (STimeNow() - start) / 1000 << "ms for '" << domain << "'.");
+
+    // There was a problem.
+    if (result || !resolved) {
+        freeaddrinfo(resolved);
+        SWARN("Can't resolve '" << domain << "', error #" << result << " (" << gai_strerror(result) << ").");
+        return 0;
+    }
+
+    // Grab the resolved address.
+    sockaddr_in* addr = (sockaddr_in*)resolved->ai_addr;
+    uint32_t ip = addr->sin_addr.s_addr;
+    char plainTextIP[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr->sin_addr, plainTextIP, INET_ADDRSTRLEN);
+    SINFO("Resolved " << domain << " to ip: " << plainTextIP << ".");
+
+    // Done resolving.
+    freeaddrinfo(resolved);
+    return ip;
+}
+
+// The shared DNS cache. It's allocated once and never freed, so background lookups that are still running when the
+// process exits don't touch a destroyed cache.
+struct SDNSCache {
+    struct Entry {
+        // The resolved address, or 0 if the last lookup failed.
+        uint32_t ip = 0;
+
+        // When this entry should be looked up again.
+        uint64_t expires = 0;
+
+        // True while a lookup for this name is running, so we only ever run one at a time.
+        bool resolving = false;
+    };
+
+    mutex lock;
+    map<string, Entry> entries;
+
+    static SDNSCache& get() {
+        static SDNSCache* cache = new SDNSCache();
+        return *cache;
+    }
+
+    // Records the result of a lookup.
+    void store(const string& domain, uint32_t ip) {
+        lock_guard<mutex> guard(lock);
+        Entry& entry = entries[domain];
+        entry.ip = ip;
+        entry.expires = STimeNow() + (ip ? SDNS_CACHE_TTL_US : SDNS_NEGATIVE_TTL_US);
+        entry.resolving = false;
+    }
+
+    // Starts looking up `domain` on a new thread, unless that's already happening. Must be called with `lock` held.
+    void refresh(const string& domain, Entry& entry) {
+        if (entry.resolving) {
+            return;
+        }
+        entry.resolving = true;
+        thread([this, domain]() {
+            SInitialize("dns");
+            store(domain, _SLookupDomain(domain));
+        }).detach();
+    }
+};
+
+// Returns the address of `domain` from the cache, looking it up (and waiting for it) if it's not there.
+static uint32_t _SResolveDomain(const string& domain) {
+    SDNSCache& cache = SDNSCache::get();
+    {
+        lock_guard<mutex> guard(cache.lock);
+        auto it = cache.entries.find(domain);
+        if (it != cache.entries.end() && (it->second.ip || STimeNow() < it->second.expires)) {
+            // We have an answer, though if it's expired, we get a new one for next time.
+            if (STimeNow() >= it->second.expires) {
+                cache.refresh(domain, it->second);
+            }
+            return it->second.ip;
+        }
+    }
+
+    // We've never resolved this, or the last try failed long enough ago to try again.
+    uint32_t ip = _SLookupDomain(domain);
+    cache.store(domain, ip);
+    return ip;
+}
+
+// --------------------------------------------------------------------------
+bool SHostIsResolved(const string& host) {
+    string domain;
+    uint16_t port = 0;
+    if (!SParseHost(host, domain, port)) {
+        return false;
+    }
+    unsigned int ip = inet_addr(domain.c_str());
+    if (ip && ip != INADDR_NONE) {
+        return true;
+    }
+
+    SDNSCache& cache = SDNSCache::get();
+    lock_guard<mutex> guard(cache.lock);
+    SDNSCache::Entry& entry = cache.entries[domain];
+    if (STimeNow() >= entry.expires) {
+        cache.refresh(domain, entry);
+    }
+    return entry.ip;
+}
+
+// --------------------------------------------------------------------------
+int S_socket(const string& host, bool isTCP, bool isPort, bool isBlocking, bool reusePort) {
     // Try to set up the socket
     int s = 0;
     try {
@@ -1558,39 +2009,13 @@ int S_socket(const string& host, bool isTCP, bool isPort, bool isBlocking) {
             STHROW("invalid host: " + host);
         }
 
-        // Is the domain just a raw IP?
+        // Is the domain just a raw IP? If not, resolve it.
         unsigned int ip = inet_addr(domain.c_str());
         if (!ip || ip == INADDR_NONE) {
-            // Nope -- resolve the domain
-            uint64_t start = STimeNow();
-
-            // Allocate and initialize addrinfo structures.
-            struct addrinfo hints;
-            memset(&hints, 0, sizeof hints);
-            struct addrinfo* resolved = nullptr;
-
-            // Set up the hints.
-            hints.ai_family = AF_INET; // IPv4
-            hints.ai_socktype = SOCK_STREAM;
-
-            // Do the initialization.
-            int result = getaddrinfo(domain.c_str(), to_string(port).c_str(), &hints, &resolved);
-            SINFO("DNS lookup took " << (STimeNow() - start) / 1000 << "ms for '" << domain << "'.");
-
-            // There was a problem.
-            if (result || !resolved) {
-                freeaddrinfo(resolved);
-                STHROW("can't resolve host error no#" + result);
+            ip = _SResolveDomain(domain);
+            if (!ip) {
+                STHROW("can't resolve host");
             }
-            // Grab the resolved address.
-            sockaddr_in* addr = (sockaddr_in*)resolved->ai_addr;
-            ip = addr->sin_addr.s_addr;
-            char plainTextIP[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &addr->sin_addr, plainTextIP, INET_ADDRSTRLEN);
-            SINFO("Resolved " << domain << " to ip: " << plainTextIP << ".");
-
-            // Done resolving.
-            freeaddrinfo(resolved);
         }
 
         // Open a socket
@@ -1615,6 +2040,13 @@ int S_socket(const string& host, bool isTCP, bool isPort, bool isBlocking) {
             u_long enable = 1;
             if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char*)&enable, sizeof(enable)))
                 STHROW("couldn't set REUSEADDR");
+#ifdef SO_REUSEPORT
+            if (reusePort && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (char*)&enable, sizeof(enable)))
+                STHROW("couldn't set REUSEPORT");
+#else
+            if (reusePort)
+                STHROW("REUSEPORT unsupported");
+#endif
 
             // Bind to the configured port
             sockaddr_in addr;
@@ -1811,34 +2243,52 @@ bool SCheckNetworkErrorType(const string& logPrefix, const string& peer, int err
 // the socket is still alive when done.
 bool S_recvappend(int s, string& recvBuffer) {
     SASSERT(s);
-    // Figure out if this socket is blocking or non-blocking
-    int flags = fcntl(s, F_GETFL);
-    bool blocking = !(flags & O_NONBLOCK);
-
-    // Keep trying to receive as long as we can
-    char buffer[4096];
-    int totalRecv = 0;
+    // Keep trying to receive as long as we can. Only the first read can block
+    // (if the socket is blocking), so we don't need to ask which it is. A read
+    // that doesn't fill the buffer has emptied the socket, so rather than make
+    // another call just to be told there's nothing left, we stop there; poll
+    // will tell us when there's more.
+    char buffer[64 * 1024];
     ssize_t numRecv = 0;
-    sockaddr_in fromAddr;
-    socklen_t fromAddrLen = sizeof(fromAddr);
-    while ((numRecv = recvfrom(s, buffer, sizeof(buffer), 0, (sockaddr*)&fromAddr, &fromAddrLen)) > 0) {
+    int flags = 0;
+    while ((numRecv = recv(s, buffer, sizeof(buffer), flags)) > 0) {
         // Got some more data
         recvBuffer.append(buffer, numRecv);
-        totalRecv += numRecv;
-
-        // If this is a blocking socket, don't try again, once is enough
-        if (blocking)
+        if (numRecv < (ssize_t)sizeof(buffer)) {
             return true; // We're still alive
+        }
+        flags = MSG_DONTWAIT;
     }
 
     // See how we finished
     if (numRecv == 0) {
         return false; // Graceful shutdown; socket closed
     }
-    // Some kind of error -- what happened?
-    stringstream addrStr;
-    addrStr << fromAddr;
-    return SCheckNetworkErrorType("recv", addrStr.str(), S_errno);
+    // Some kind of error -- what happened? (Take errno before looking up the
+    // peer, which can overwrite it.)
+    const int error = S_errno;
+    return SCheckNetworkErrorType("recv", SGetPeerName(s), error);
+}
+
+// --------------------------------------------------------------------------
+bool S_sendconsume(int s, SFastBuffer& sendBuffer) {
+    SASSERT(s);
+    // If empty, nothing to do
+    if (sendBuffer.empty())
+        return true; // Assume no error, still alive
+
+    // Send as much as we can
+    ssize_t numSent = send(s, sendBuffer.c_str(), sendBuffer.size(), MSG_NOSIGNAL);
+    if (numSent > 0)
+        sendBuffer.consumeFront(numSent);
+
+    // Exit of no error
+    if (numSent >= 0) {
+        return true; // No error; still alive
+    }
+
+    // Error, what kind?
+    return SCheckNetworkErrorType("send", SGetPeerName(s), S_errno);
 }
 
 // --------------------------------------------------------------------------
@@ -1882,6 +2332,119 @@ bool SFDAnySet(fd_map& fdm, int socket, short evts) {
     return fd.revents & evts;
 }
 
+#ifdef __linux__
+// Each thread that calls S_poll gets its own epoll instance, along with the events each descriptor is currently
+// registered for, so each call only has to tell the kernel about what's changed since the last one.
+struct SEpollState {
+    SEpollState();
+    ~SEpollState();
+
+    int epollFD;
+
+    // Locked by S_close, which can be called from any thread.
+    mutex registeredMutex;
+    map<int, uint32_t> registered;
+
+    // Every thread's state, so that S_close can remove closed descriptors from all of them.
+    static mutex allStatesMutex;
+    static set<SEpollState*> allStates;
+};
+mutex SEpollState::allStatesMutex;
+set<SEpollState*> SEpollState::allStates;
+
+SEpollState::SEpollState() : epollFD(epoll_create1(EPOLL_CLOEXEC)) {
+    if (epollFD < 0) {
+        SWARN("Couldn't create epoll instance, error: " << strerror(S_errno) << ", falling back to poll.");
+    }
+    lock_guard<mutex> lock(allStatesMutex);
+    allStates.insert(this);
+}
+
+SEpollState::~SEpollState() {
+    {
+        lock_guard<mutex> lock(allStatesMutex);
+        allStates.erase(this);
+    }
+    if (epollFD >= 0) {
+        close(epollFD);
+    }
+}
+
+static int _S_epoll(SEpollState& state, fd_map& fdm, uint64_t timeout) {
+    // Walk our registrations and the requested events together (both are sorted by descriptor), and update epoll
+    // with anything that's been added, changed, or removed. The event bits for poll and epoll are the same on Linux.
+    {
+        lock_guard<mutex> lock(state.registeredMutex);
+        auto requested = fdm.begin();
+        auto registered = state.registered.begin();
+        while (requested != fdm.end() || registered != state.registered.end()) {
+            bool onlyRequested = registered == state.registered.end() ||
+                                 (requested != fdm.end() && requested->first < registered->first);
+            if (onlyRequested) {
+                // New descriptor. It may still be registered if it was closed without S_close while a duplicate of it
+                // remained open, in which case we just update it.
+                requested->second.revents = 0;
+                epoll_event event = {(uint32_t)requested->second.events, {}};
+                event.data.fd = requested->first;
+                if (epoll_ctl(state.epollFD, EPOLL_CTL_ADD, requested->first, &event) && errno == EEXIST) {
+                    epoll_ctl(state.epollFD, EPOLL_CTL_MOD, requested->first, &event);
+                }
+                state.registered.emplace_hint(registered, requested->first, (uint32_t)requested->second.events);
+                requested++;
+            } else if (requested == fdm.end() || registered->first < requested->first) {
+                // We're not interested in this one anymore. If it's already been closed, there's nothing to remove.
+                epoll_ctl(state.epollFD, EPOLL_CTL_DEL, registered->first, nullptr);
+                registered = state.registered.erase(registered);
+            } else {
+                // Already registered, update it if the events have changed.
+                requested->second.revents = 0;
+                uint32_t events = (uint32_t)requested->second.events;
+                if (events != registered->second) {
+                    epoll_event event = {events, {}};
+                    event.data.fd = requested->first;
+                    if (epoll_ctl(state.epollFD, EPOLL_CTL_MOD, requested->first, &event) && errno == ENOENT) {
+                        epoll_ctl(state.epollFD, EPOLL_CTL_ADD, requested->first, &event);
+                    }
+                    registered->second = events;
+                }
+                requested++;
+                registered++;
+            }
+        }
+    }
+
+    // Wait for events, and report only the descriptors that have any. Timeout is specified in microseconds, but epoll
+    // uses milliseconds, so we divide by 1000.
+    vector<epoll_event> events(max(fdm.size(), (size_t)1));
+    int returnValue = epoll_wait(state.epollFD, &events[0], (int)events.size(), int(timeout / 1000));
+    for (int i = 0; i < returnValue; i++) {
+        auto it = fdm.find(events[i].data.fd);
+        if (it != fdm.end()) {
+            it->second.revents = (short)events[i].events;
+        }
+    }
+    if (returnValue == -1) {
+        SWARN("Poll failed with response '" << strerror(S_errno) << "' (#" << S_errno << "), ignoring");
+    }
+    return returnValue;
+}
+#endif
+
+void S_close(int s) {
+#ifdef __linux__
+    // Closing a descriptor removes it from every epoll instance, so we forget about it before closing it, which
+    // guarantees that if its number is reused, it'll be registered again as new.
+    {
+        lock_guard<mutex> lock(SEpollState::allStatesMutex);
+        for (SEpollState* state : SEpollState::allStates) {
+            lock_guard<mutex> stateLock(state->registeredMutex);
+            state->registered.erase(s);
+        }
+    }
+#endif
+    close(s);
+}
+
 // --------------------------------------------------------------------------
 int S_poll(fd_map& fdm, uint64_t timeout) {
     // Why doesn't this function lock around our fd_map, you might ask? Because in the existing bedrock architecture,
@@ -1889,6 +2452,12 @@ int S_poll(fd_map& fdm, uint64_t timeout) {
     // here. The only place they share resources is around a bedrock MessageQueue, which does its own locking. If we
     // ever want to allow multiple threads to manipulate a shared fd_map directly, then we need locking in the related
     // functions.
+#ifdef __linux__
+    static thread_local SEpollState state;
+    if (state.epollFD >= 0) {
+        return _S_epoll(state, fdm, timeout);
+    }
+#endif
 
     // Build a vector we can use to pass data to poll().
     vector<pollfd> pollvec;
@@ -2281,106 +2850,88 @@ string SQList(const string& val, bool integersOnly) {
 }
 
 // --------------------------------------------------------------------------
-// Begins logging all queries to a logging database
-FILE* _g_sQueryLogFP = nullptr;
-extern void SQueryLogOpen(const string& logFilename) {
-    // Make sure it's not already open
-    if (_g_sQueryLogFP) {
-        // Already open
-        SHMMM("Attempting to open query log '" << logFilename << "' but a log is already open, ignoring.");
-    } else {
-        // Create a new logfile from scratch, replacing anything already there.
-        // Note that we first open to a local variable so we can write the
-        // schema line first, without another thread logging overtop of it
-        SINFO("Opening query log '" << logFilename << "'");
-        FILE* fp = fopen(logFilename.c_str(), "w");
-        SASSERT(fp);
-        const string& schema = "filename, query, elapsed\n";
-        SASSERT(fwrite(schema.c_str(), 1, schema.size(), fp) == schema.size());
+static thread_local uint64_t _g_SQueryVMSteps = 0;
 
-        // Assign to the global variable so other threads can start using it
-        _g_sQueryLogFP = fp;
-    }
-}
+// What the query this thread is running has counted so far, for the slow query log.
+static thread_local SQueryStats _g_SQueryStats;
 
-// --------------------------------------------------------------------------
-void SQueryLogClose() {
-    // Is it even open?
-    if (!_g_sQueryLogFP) {
-        // Not open
-        SHMMM("Trying to close query log but not open, ignoring.");
-    } else {
-        // Clear the global variable and wait a second, in case it's being called right now
-        SINFO("Closing query log...");
-        FILE* fp = _g_sQueryLogFP;
-        _g_sQueryLogFP = nullptr;
-        this_thread::sleep_for(chrono::seconds(1));
+uint64_t SQueryVMSteps() {
+    return _g_SQueryVMSteps;
+}
 
-        // Close it
-        fclose(fp);
-        SINFO("Closed query log");
-    }
+// Adds what `statement` has counted since this was last called for it to the current query's stats, and its steps to
+// this thread's total.
+static void _SQueryCountStats(sqlite3_stmt* statement) {
+    const uint64_t vmSteps = sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_VM_STEP, 1);
+    _g_SQueryVMSteps += vmSteps;
+    _g_SQueryStats.vmSteps += vmSteps;
+    _g_SQueryStats.fullScanSteps += sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+    _g_SQueryStats.sorts += sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_SORT, 1);
+    _g_SQueryStats.autoIndexes += sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_AUTOINDEX, 1);
 }
 
 // --------------------------------------------------------------------------
-// Called by SQLite in response to query
-static int _SQueryCallback(void* data, int argc, char** argv, char** colNames) {
-    // If we haven't already recorded the headers, do so now
-    SQResult& result = *(SQResult*)data;
+// Adds the row `statement` is on to `result`, with NULLs as empty strings, recording the headers first if this is the
+// first row.
+static void _SQueryAppendRow(sqlite3_stmt* statement, SQResult& result) {
+    const int columns = sqlite3_column_count(statement);
     if (result.headers.empty()) {
-        for (int c = 0; c < argc; ++c) {
-            result.headers.push_back(colNames[c] ? colNames[c] : "");
+        for (int c = 0; c < columns; ++c) {
+            const char* name = sqlite3_column_name(statement, c);
+            result.headers.push_back(name ? name : "");
         }
     }
-
-    // Record the result (and check for NULLs)
-    result.rows.resize(result.size() + 1);
-    for (int c = 0; c < argc; ++c) {
-        result.rows.back().push_back(argv[c] ? argv[c] : "");
+    result.rows.emplace_back();
+    vector<string>& row = result.rows.back();
+    row.reserve(columns);
+    for (int c = 0; c < columns; ++c) {
+        const char* value = (const char*)sqlite3_column_text(statement, c);
+        row.emplace_back(value ? string(value, sqlite3_column_bytes(statement, c)) : "");
     }
-    return 0;
 }
 
 // --------------------------------------------------------------------------
-// Executes a SQLite query
-int SQuery(sqlite3* db, const char* e, const string& sql, SQResult& result, int64_t warnThreshold, bool skipWarn) {
-#define MAX_TRIES 3
-    // Execute the query and get the results
-    uint64_t startTime = STimeNow();
-    int error = 0;
-    int extErr = 0;
-    for (int tries = 0; tries < MAX_TRIES; tries++) {
-        result.clear();
-        SDEBUG(sql);
-        error = sqlite3_exec(db, sql.c_str(), _SQueryCallback, &result, 0);
-        extErr = sqlite3_extended_errcode(db);
-        if (error != SQLITE_BUSY || extErr == SQLITE_BUSY_SNAPSHOT) {
+// Runs each statement in `sql` in turn, calling `onRow` for every row. This is what sqlite3_exec does, but stepping
+// the statements ourselves lets the caller see each value's type.
+static int _SQueryStep(sqlite3* db, const string& sql, const function<void(sqlite3_stmt*)>& onRow) {
+    const char* next = sql.c_str();
+    const char* end = next + sql.size();
+    while (next < end) {
+        sqlite3_stmt* statement = nullptr;
+        int error = sqlite3_prepare_v2(db, next, end - next, &statement, &next);
+        if (error) {
+            return error;
+        }
+        if (!statement) {
+            // Nothing left but whitespace or comments.
             break;
         }
-        SWARN("sqlite3_exec returned SQLITE_BUSY on try #"
-              << (tries + 1) << " of " << MAX_TRIES << ". "
-              << "Extended error code: " << sqlite3_extended_errcode(db) << ". "
-              << (((tries + 1) < MAX_TRIES) ? "Sleeping 1 second and re-trying." : "No more retries."));
-
-        // Avoid the sleep after the last try.
-        if ((tries + 1) < MAX_TRIES) {
-            sleep(1);
+        while ((error = sqlite3_step(statement)) == SQLITE_ROW) {
+            _g_SQueryStats.rows++;
+            onRow(statement);
+        }
+        _SQueryCountStats(statement);
+        sqlite3_finalize(statement);
+        if (error != SQLITE_DONE) {
+            return error;
         }
     }
-    uint64_t elapsed = STimeNow() - startTime;
+    return SQLITE_OK;
+}
 
+// --------------------------------------------------------------------------
+// Common bookkeeping after running a query: slow query warnings, the query log, and error reporting. Returns the
+// result code that SQuery should return.
+static int _SQueryFinish(sqlite3* db, const char* e, const string& sql, uint64_t elapsed, int error, int extErr,
+                         int64_t warnThreshold, bool skipWarn) {
     // Warn if it took longer than the specified threshold
     if ((int64_t)elapsed > warnThreshold)
         SWARN("Slow query (" << elapsed / 1000 << "ms) " << sql.length() << ": " << sql.substr(0, 150));
 
     // Log this if enabled
-    if (_g_sQueryLogFP) {
-        // Log this query as an SQL statement ready for insertion
-        const string& dbFilename = sqlite3_db_filename(db, "main");
-        const string& csvRow =
-            "\"" + dbFilename + "\", " + "\"" + SEscape(STrim(sql), "\"", '"') + "\", " + SToStr(elapsed) + "\n";
-        SASSERT(fwrite(csvRow.c_str(), 1, csvRow.size(), _g_sQueryLogFP) == csvRow.size());
-    }
+    SQueryLogRecord(db, sql, elapsed, extErr == SQLITE_BUSY_SNAPSHOT ? extErr : error);
+    SSlowQueryLogRecord(db, sql, elapsed, warnThreshold, extErr == SQLITE_BUSY_SNAPSHOT ? extErr : error,
+                        _g_SQueryStats);
 
     // Only OK and commit conflicts are allowed without warning.
     if (error != SQLITE_OK && extErr != SQLITE_BUSY_SNAPSHOT) {
@@ -2397,6 +2948,143 @@ int SQuery(sqlite3* db, const char* e, const string& sql, SQResult& result, int6
     return error;
 }
 
+// --------------------------------------------------------------------------
+static thread_local uint64_t _g_SQueryBusyDeadline = 0;
+static thread_local uint64_t _g_SQueryBusyHandlerStart = 0;
+static atomic<uint64_t> _g_SQueryBusyRetryCount(0);
+static atomic<uint64_t> _g_SQueryBusyWaitUS(0);
+
+void SQuerySetBusyDeadline(uint64_t deadline) {
+    _g_SQueryBusyDeadline = deadline;
+}
+
+uint64_t SQueryBusyRetryCount() {
+    return _g_SQueryBusyRetryCount.load();
+}
+
+uint64_t SQueryBusyWaitUS() {
+    return _g_SQueryBusyWaitUS.load();
+}
+
+// Sleeps before retry number `attempt` (counting from zero) of something that started at `start` and got SQLITE_BUSY.
+// Returns false, without sleeping, if the deadline has passed and it shouldn't be retried.
+static bool _SQueryBusyBackoff(uint64_t start, int attempt) {
+    const uint64_t deadline = _g_SQueryBusyDeadline ? _g_SQueryBusyDeadline : start + SQUERY_BUSY_TIMEOUT_US;
+    const uint64_t now = STimeNow();
+    if (now >= deadline) {
+        return false;
+    }
+    uint64_t backoff = SQUERY_BUSY_BACKOFF_MAX_US;
+    if (attempt < 20) {
+        backoff = min(backoff, (uint64_t)SQUERY_BUSY_BACKOFF_MIN_US << attempt);
+    }
+    backoff = min(backoff, deadline - now);
+    usleep(backoff);
+    _g_SQueryBusyRetryCount++;
+    _g_SQueryBusyWaitUS += backoff;
+    return true;
+}
+
+int SQueryBusyHandler(void* arg, int count) {
+    // sqlite counts from zero again for each lock it waits on.
+    if (count == 0) {
+        _g_SQueryBusyHandlerStart = STimeNow();
+    }
+    return _SQueryBusyBackoff(_g_SQueryBusyHandlerStart, count);
+}
+
+// --------------------------------------------------------------------------
+// Executes a SQLite query with `run`, retrying if the database is busy. `run` starts over from scratch each time,
+// discarding anything from a previous try.
+static int _SQueryExec(sqlite3* db, const char* e, const string& sql, const function<int()>& run,
+                       int64_t warnThreshold, bool skipWarn) {
+    // Execute the query and get the results
+    uint64_t startTime = STimeNow();
+    int error = 0;
+    int extErr = 0;
+    _g_SQueryStats = SQueryStats();
+    for (int tries = 0;; tries++) {
+        SDEBUG(sql);
+        error = run();
+        extErr = sqlite3_extended_errcode(db);
+        if (error != SQLITE_BUSY || extErr == SQLITE_BUSY_SNAPSHOT) {
+            break;
+        }
+        if (!_SQueryBusyBackoff(startTime, tries)) {
+            SWARN("Query returned SQLITE_BUSY on try #" << (tries + 1) << " after " << (STimeNow() - startTime) / 1000
+                  << "ms. Extended error code: " << extErr << ". No more retries.");
+            break;
+        }
+    }
+    return _SQueryFinish(db, e, sql, STimeNow() - startTime, error, extErr, warnThreshold, skipWarn);
+}
+
+// --------------------------------------------------------------------------
+// Executes a SQLite query
+int SQuery(sqlite3* db, const char* e, const string& sql, SQResult& result, int64_t warnThreshold, bool skipWarn) {
+    return _SQueryExec(db, e, sql, [&]() {
+        result.clear();
+        return _SQueryStep(db, sql, [&](sqlite3_stmt* statement) { _SQueryAppendRow(statement, result); });
+    }, warnThreshold, skipWarn);
+}
+
+// --------------------------------------------------------------------------
+// Executes a SQLite query, writing out each row as it comes
+int SQuery(sqlite3* db, const char* e, const string& sql, SQResultWriter& output, int64_t warnThreshold,
+           bool skipWarn) {
+    return _SQueryExec(db, e, sql, [&]() {
+        output.reset();
+        return _SQueryStep(db, sql, [&](sqlite3_stmt* statement) {
+            if (!output.wroteHeaders()) {
+                output.writeHeaders(statement);
+            }
+            output.writeRow(statement);
+        });
+    }, warnThreshold, skipWarn);
+}
+
+// --------------------------------------------------------------------------
+// Executes a SQLite query, keeping each value's type
+int SQuery(sqlite3* db, const char* e, const string& sql, SQTypedResult& result, int64_t warnThreshold,
+           bool skipWarn) {
+    return _SQueryExec(db, e, sql, [&]() {
+        result.clear();
+        return _SQueryStep(db, sql, [&](sqlite3_stmt* statement) { result.appendRow(statement); });
+    }, warnThreshold, skipWarn);
+}
+
+// --------------------------------------------------------------------------
+// Executes an already prepared (and bound) SQLite statement, and resets it so that it can be run again.
+int SQuery(sqlite3* db, const char* e, sqlite3_stmt* statement, SQResult& result, int64_t warnThreshold, bool skipWarn) {
+    uint64_t startTime = STimeNow();
+    int error = 0;
+    int extErr = 0;
+    _g_SQueryStats = SQueryStats();
+    for (int tries = 0;; tries++) {
+        result.clear();
+        SDEBUG(sqlite3_sql(statement));
+        while ((error = sqlite3_step(statement)) == SQLITE_ROW) {
+            _g_SQueryStats.rows++;
+            _SQueryAppendRow(statement, result);
+        }
+        if (error == SQLITE_DONE) {
+            error = SQLITE_OK;
+        }
+        extErr = sqlite3_extended_errcode(db);
+        _SQueryCountStats(statement);
+        sqlite3_reset(statement);
+        if (error != SQLITE_BUSY || extErr == SQLITE_BUSY_SNAPSHOT) {
+            break;
+        }
+        if (!_SQueryBusyBackoff(startTime, tries)) {
+            SWARN("sqlite3_step returned SQLITE_BUSY on try #" << (tries + 1) << " after "
+                  << (STimeNow() - startTime) / 1000 << "ms. Extended error code: " << extErr << ". No more retries.");
+            break;
+        }
+    }
+    return _SQueryFinish(db, e, sqlite3_sql(statement), STimeNow() - startTime, error, extErr, warnThreshold, skipWarn);
+}
+
 // --------------------------------------------------------------------------
 // Creates a table, if not there, or verifies it's defined correctly
 bool SQVerifyTable(sqlite3* db, const string& tableName, const string& sql) {
@@ -28,6 +28,7 @@
 #include <iostream>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <random>
 #include <set>
@@ -46,6 +47,10 @@ void SInitialize(string threadName = "", const char* processName = 0);
 
 void SSetSignalHandlerDieFunc(function<void()>&& func);
 
+// Pins the calling thread to the given CPUs: a comma-separated list of CPU numbers, ranges like `0-7`, and `nodeN`
+// for every CPU on NUMA node N. Returns false, leaving the thread's affinity alone, if the list is empty or invalid.
+bool SSetThreadAffinity(const string& cpuList);
+
 // --------------------------------------------------------------------------
 // Assertion stuff
 // --------------------------------------------------------------------------
@@ -89,15 +94,25 @@ void SSetSignalHandlerDieFunc(function<void()>&& func);
 // See: http://stackoverflow.com/questions/1801892/making-mapfind-operation-case-insensitive
 class STableComp : binary_function<string, string, bool> {
   public:
+    // This runs for every lookup in every STable, so rather than calling `tolower` (which goes through the locale) on
+    // both characters at every position, we fold ASCII case inline and stop at the first difference. This orders keys
+    // exactly as `tolower` does in the "C" locale.
     bool operator()(const string& s1, const string& s2) const {
-        return lexicographical_compare(s1.begin(), s1.end(), s2.begin(), s2.end(), nocase_compare());
+        const unsigned char* c1 = (const unsigned char*)s1.data();
+        const unsigned char* c2 = (const unsigned char*)s2.data();
+        const size_t length = s1.size() < s2.size() ? s1.size() : s2.size();
+        for (size_t i = 0; i < length; i++) {
+            const unsigned char folded1 = fold(c1[i]);
+            const unsigned char folded2 = fold(c2[i]);
+            if (folded1 != folded2) {
+                return folded1 < folded2;
+            }
+        }
+        return s1.size() < s2.size();
     }
 
-  private:
-    class nocase_compare : public binary_function<unsigned char, unsigned char, bool> {
-      public:
-        bool operator()(const unsigned char& c1, const unsigned char& c2) const { return tolower(c1) < tolower(c2); }
-    };
+    // Folds one character of a key the way the comparison does.
+    static unsigned char fold(unsigned char c) { return (unsigned char)(c - 'A') < 26 ? c + ('a' - 'A') : c; }
 };
 
 // An SString is just a string with special assignment operators so that we get automatic conversion from arithmetic
@@ -139,6 +154,78 @@ class SString : public string {
 
 typedef map<string, SString, STableComp> STable;
 
+// A table with the same keys, ordering and interface as STable, for the small tables of headers every SData carries.
+// Rather than a tree of separately allocated nodes, the entries are kept in one vector, in the order STable would keep
+// them, so iterating either gives the same result. Next to each entry is a hash of its case-folded name, so a lookup
+// folds the name it's given once and then compares hashes, instead of folding both names at every step of a tree
+// search. Tables larger than LINEAR_LIMIT are searched by bisection instead.
+//
+// Unlike STable, adding or removing an entry invalidates iterators and references into the table.
+class SFlatTable {
+  public:
+    typedef string key_type;
+    typedef SString mapped_type;
+    typedef pair<string, SString> value_type;
+    typedef vector<value_type>::iterator iterator;
+    typedef vector<value_type>::const_iterator const_iterator;
+    typedef size_t size_type;
+
+    // Beyond this many entries, lookups bisect rather than scanning the hashes.
+    static const size_t LINEAR_LIMIT = 32;
+
+    SFlatTable() { }
+    SFlatTable(const STable& table);
+    SFlatTable& operator=(const STable& table);
+    operator STable() const { return STable(_entries.begin(), _entries.end()); }
+
+    iterator begin() { return _entries.begin(); }
+    iterator end() { return _entries.end(); }
+    const_iterator begin() const { return _entries.begin(); }
+    const_iterator end() const { return _entries.end(); }
+    bool empty() const { return _entries.empty(); }
+    size_t size() const { return _entries.size(); }
+    void clear();
+    void reserve(size_t entries);
+
+    iterator find(const string& name);
+    const_iterator find(const string& name) const;
+    size_t count(const string& name) const { return find(name) != end(); }
+
+    // Throws out_of_range if there's no entry for `name`.
+    SString& at(const string& name);
+    const SString& at(const string& name) const;
+
+    // Returns the value for `name`, adding an empty one if there's none yet.
+    SString& operator[](const string& name);
+
+    // Like `map::emplace`, this leaves an existing entry alone, and returns it with false.
+    template <typename... Args>
+    pair<iterator, bool> emplace(Args&&... args) { return _insert(value_type(forward<Args>(args)...)); }
+    pair<iterator, bool> insert(const value_type& entry) { return _insert(value_type(entry)); }
+    template <typename InputIt>
+    void insert(InputIt first, InputIt last) {
+        for (; first != last; ++first) {
+            _insert(value_type(first->first, first->second));
+        }
+    }
+
+    size_t erase(const string& name);
+    iterator erase(const_iterator it);
+
+  private:
+    // Returns the hash of `name` with its case folded.
+    static uint32_t _hash(const string& name);
+
+    // Returns the index of the entry for `name`, which hashes to `hash`, or `size()` if there isn't one.
+    size_t _index(const string& name, uint32_t hash) const;
+
+    // Adds `entry` where it belongs, unless there's already an entry with its name.
+    pair<iterator, bool> _insert(value_type&& entry);
+
+    vector<value_type> _entries;
+    vector<uint32_t> _hashes;
+};
+
 // An SException is an exception class that can represent an HTTP-like response, with a method line, headers, and a
 // body. The STHROW and STHROW_STACK macros will create an SException that logs it's file and line of creation, and
 // optionally, a stack trace at the same time. They can take, 1, 2, or all 3 of the components of an HTTP response
@@ -175,7 +262,7 @@ class SException : public exception {
 struct SData {
     // Public attributes
     string methodLine;
-    STable nameValueMap;
+    SFlatTable nameValueMap;
     string content;
 
     // Constructors
@@ -220,6 +307,13 @@ struct SData {
     // Serialization
     void serialize(ostringstream& out) const;
     string serialize() const;
+
+    // Appends the same thing `serialize()` returns to `buffer`, without building it in a string of its own first.
+    void serialize(string& buffer) const;
+
+    // Returns just the method line and headers of `serialize()`, for sending ahead of `content` without concatenating
+    // the two. Empty if the content would be compressed, in which case this needs to be sent with `serialize()`.
+    string serializeHeaders() const;
     int deserialize(const string& rhs);
     int deserialize(const char* buffer, int length);
 
@@ -315,6 +409,17 @@ inline void SLogLevel(int level) {
 // Stack trace logging
 void SLogStackTrace();
 
+// By default every log line is written to syslog on the thread that logs it. Once SLogStartAsync is called, lines are
+// instead queued in a per-thread ring of `linesPerThread` lines and written by a background thread, so a slow syslog
+// can't stall the caller. If a thread's ring is full, its lines are dropped (and counted) rather than waiting.
+// SLogStopAsync writes out anything still queued and goes back to logging synchronously. SLogFlush writes out
+// anything queued without stopping, and is meant for use right before aborting.
+void SLogStartAsync(size_t linesPerThread = 4096);
+void SLogStopAsync();
+void SLogFlush();
+uint64_t SLogDroppedLines();
+void SLogLine(string&& line);
+
 #define SWHEREAMI                                                                                                      \
     SThreadLogPrefix + "(" + basename((char*)__FILE__) + ":" + SToStr(__LINE__) + ") " + __FUNCTION__ + " [" + SThreadLogName \
                    + "] "
@@ -330,7 +435,7 @@ void SLogStackTrace();
             __out << _MSG_ << endl;                                                                                    \
             const string& __s = __out.str();                                                                           \
             for (int __i = 0; __i < (int)__s.size(); __i += 1500)                                                      \
-                syslog(LOG_WARNING, "%s", (SWHEREAMI + __s.substr(__i, 1500).c_str()).c_str());                        \
+                SLogLine(SWHEREAMI + __s.substr(__i, 1500));                                                           \
         }                                                                                                              \
     } while (false)
 
@@ -345,6 +450,7 @@ void SLogStackTrace();
     do {                                                                                                               \
         SSYSLOG(LOG_ERR, "[eror] " << SLOGPREFIX << _MSG_);                                               \
         SLogStackTrace();                                                                                              \
+        SLogFlush();                                                                                                   \
         fflush(stdout);                                                                                                \
         abort();                                                                                                       \
     } while (false)
@@ -475,6 +581,9 @@ inline bool SContains(const string& haystack, char needle) { return haystack.fin
 inline bool SContains(const STable& nameValueMap, const string& name) {
     return (nameValueMap.find(name) != nameValueMap.end());
 }
+inline bool SContains(const SFlatTable& nameValueMap, const string& name) {
+    return (nameValueMap.find(name) != nameValueMap.end());
+}
 
 // General testing functions
 inline bool SIEquals(const string& lhs, const string& rhs) { return !strcasecmp(lhs.c_str(), rhs.c_str()); }
@@ -510,6 +619,9 @@ string SEscape(const char* lhs, const string& unsafe, char escaper);
 inline string SEscape(const string& lhs, const string& unsafe, char escaper = '\\') {
     return SEscape(lhs.c_str(), unsafe, escaper);
 }
+
+// Like SEscape, but appends the escaped value to `out` rather than returning a new string.
+void SAppendEscaped(string& out, const char* lhs, const string& unsafe, char escaper = '\\');
 string SUnescape(const char* lhs, char escaper);
 inline string SUnescape(const string& lhs, char escaper = '\\') { return SUnescape(lhs.c_str(), escaper); }
 inline string SStripTrim(const string& lhs) { return STrim(SStrip(lhs)); }
@@ -562,9 +674,13 @@ inline void SAppend(string& lhs, const string& rhs) { lhs += rhs; }
 // HTTP message management
 #define S_COOKIE_SEPARATOR ((char)0xFF)
 int SParseHTTP(const char* buffer, size_t length, string& methodLine, STable& nameValueMap, string& content);
+int SParseHTTP(const char* buffer, size_t length, string& methodLine, SFlatTable& nameValueMap, string& content);
 inline int SParseHTTP(const string& buffer, string& methodLine, STable& nameValueMap, string& content) {
     return SParseHTTP(buffer.c_str(), (int)buffer.size(), methodLine, nameValueMap, content);
 }
+inline int SParseHTTP(const string& buffer, string& methodLine, SFlatTable& nameValueMap, string& content) {
+    return SParseHTTP(buffer.c_str(), (int)buffer.size(), methodLine, nameValueMap, content);
+}
 bool SParseRequestMethodLine(const string& methodLine, string& method, string& uri);
 bool SParseResponseMethodLine(const string& methodLine, string& protocol, int& code, string& reason);
 bool SParseURI(const char* buffer, int length, string& host, string& path);
@@ -575,10 +691,28 @@ bool SParseURIPath(const char* buffer, int length, string& path, STable& nameVal
 inline bool SParseURIPath(const string& uri, string& path, STable& nameValueMap) {
     return SParseURIPath(uri.c_str(), (int)uri.size(), path, nameValueMap);
 }
-void SComposeHTTP(string& buffer, const string& methodLine, const STable& nameValueMap, const string& content);
-inline string SComposeHTTP(const string& methodLine, const STable& nameValueMap, const string& content) {
+// Appends a whole message to `buffer`, sizing it once for everything that gets written, so a caller can compose several
+// messages into one buffer, or reuse one buffer for many. If the headers ask for gzip encoding, the content is
+// compressed at `gzipLevel`, and sent as it is (without the Content-Encoding header) if that doesn't make it smaller.
+void SComposeHTTP(string& buffer, const string& methodLine, const STable& nameValueMap, const string& content,
+                  int gzipLevel = 9);
+void SComposeHTTP(string& buffer, const string& methodLine, const SFlatTable& nameValueMap, const string& content,
+                  int gzipLevel = 9);
+// Composes just the method line and headers (through the blank line) for a message with the given content, so that the
+// content can be sent after them without being copied into the same string. Returns an empty string if the headers ask
+// for gzip encoding, in which case the content has to be compressed and the whole message composed with SComposeHTTP.
+string SComposeHTTPHeaders(const string& methodLine, const STable& nameValueMap, const string& content);
+string SComposeHTTPHeaders(const string& methodLine, const SFlatTable& nameValueMap, const string& content);
+inline string SComposeHTTP(const string& methodLine, const STable& nameValueMap, const string& content,
+                           int gzipLevel = 9) {
     string buffer;
-    SComposeHTTP(buffer, methodLine, nameValueMap, content);
+    SComposeHTTP(buffer, methodLine, nameValueMap, content, gzipLevel);
+    return buffer;
+}
+inline string SComposeHTTP(const string& methodLine, const SFlatTable& nameValueMap, const string& content,
+                           int gzipLevel = 9) {
+    string buffer;
+    SComposeHTTP(buffer, methodLine, nameValueMap, content, gzipLevel);
     return buffer;
 }
 string SComposePOST(const STable& nameValueMap);
@@ -636,17 +770,22 @@ template <typename T> string SComposeList(const T& valueList, const string& sepa
 // JSON message management
 string SToJSON(const string& value, const bool forceString = false);
 
+// These append the JSON for a value (as SToJSON) or an object (as SComposeJSONObject) to `out`, so a response can be
+// built up in a single buffer.
+void SComposeJSON(string& out, const string& value, const bool forceString = false);
+void SComposeJSON(string& out, const STable& nameValueMap, const bool forceString = false);
+
 template <typename T>
 string SComposeJSONArray(const T& valueList) {
     if (valueList.empty()) {
         return "[]";
     }
     string working = "[";
-    for (auto value : valueList) {
-        working += SToJSON(value) + ",";
+    for (const auto& value : valueList) {
+        SComposeJSON(working, value);
+        working += ',';
     }
-    working.resize(working.size() - 1);
-    working += "]";
+    working.back() = ']';
     return working;
 }
 
@@ -682,7 +821,19 @@ void SFDset(fd_map& fdm, int socket, short evts);
 bool SFDAnySet(fd_map& fdm, int socket, short evts);
 
 // Socket helpers
-int S_socket(const string& host, bool isTCP, bool isPort, bool isBlocking);
+// If `reusePort` is set on a port, several sockets can listen on the same address, and the kernel spreads incoming
+// connections across them.
+int S_socket(const string& host, bool isTCP, bool isPort, bool isBlocking, bool reusePort = false);
+
+// S_socket resolves domain names through a cache shared by the whole process. Since getaddrinfo doesn't tell us the
+// record's TTL, addresses are kept for SDNS_CACHE_TTL_US and failures for SDNS_NEGATIVE_TTL_US. An expired address is
+// still used while it's refreshed in the background, so only the first lookup of a name ever blocks.
+#define SDNS_CACHE_TTL_US (60 * STIME_US_PER_S)
+#define SDNS_NEGATIVE_TTL_US (5 * STIME_US_PER_S)
+
+// Returns true if a socket can be opened to `host` without waiting on DNS, because it's an IP address or its address is
+// cached. Otherwise, starts resolving it in the background and returns false, so the caller can try again shortly.
+bool SHostIsResolved(const string& host);
 int S_accept(int port, sockaddr_in& fromAddr, bool isBlocking);
 ssize_t S_recvfrom(int s, char* recvBuffer, int recvBufferSize, sockaddr_in& fromAddr);
 bool S_recvappend(int s, string& recvBuffer);
@@ -692,8 +843,18 @@ inline string S_recv(int s) {
     return buf;
 }
 bool S_sendconsume(int s, string& sendBuffer);
+class SFastBuffer;
+bool S_sendconsume(int s, SFastBuffer& sendBuffer);
+
+// Waits up to `timeout` microseconds for any of the events in `fdm`, and sets `revents` for each socket. On Linux, this
+// uses a per-thread epoll instance that keeps sockets registered between calls, so the kernel only does work for
+// sockets whose events changed or that are ready, rather than for every socket on every call.
 int S_poll(fd_map& fdm, uint64_t timeout);
 
+// Closes a file descriptor that may have been passed to S_poll. Anything that's been polled needs to be closed this
+// way, so that if its number is reused for a new socket, that socket gets registered with epoll.
+void S_close(int s);
+
 // Network helpers
 string SGetHostName();
 string SGetPeerName(int s);
@@ -745,7 +906,13 @@ string SAESDecryptNoStrip(const string& buffer, const size_t& bufferSize, const
 // --------------------------------------------------------------------------
 #include "sqlite3.h"
 #include "SQResult.h"
-inline string SQ(const char* val) { return "'" + SEscape(val, "'", '\'') + "'"; }
+// Appends `val` to `out` as a quoted SQL string literal, which is what SQ returns.
+void SAppendQuoted(string& out, const char* val);
+inline string SQ(const char* val) {
+    string quoted;
+    SAppendQuoted(quoted, val);
+    return quoted;
+}
 inline string SQ(const string& val) { return SQ(val.c_str()); }
 inline string SQ(int val) { return SToStr(val); }
 inline string SQ(unsigned val) { return SToStr(val); }
@@ -762,8 +929,77 @@ template <typename Container> string SQList(const Container& valueList) {
     return SComposeList(safeValues);
 }
 
-void SQueryLogOpen(const string& logFilename);
+// The query log records queries run through SQuery to a binary file, from a background thread, with each thread
+// buffering its own records so logging doesn't wait on the disk or on other threads. Only one in every `sampleEvery`
+// queries on each thread is logged. Queries are identified by fingerprint: by default, the statement with its literal
+// values replaced by `?`, so each distinct statement's text is only logged once, or with `fullText`, the query as it
+// was run. SQueryLogToCSV turns a log back into CSV, and returns false if the file isn't a query log or is truncated.
+void SQueryLogOpen(const string& logFilename, int sampleEvery = 1, bool fullText = false);
 void SQueryLogClose();
+bool SQueryLogIsOpen();
+void SQueryLogRecord(sqlite3* db, const string& sql, uint64_t elapsed, int result);
+bool SQueryLogToCSV(const string& logFilename, ostream& out);
+
+// What sqlite counted while running the statements of a single query: virtual machine steps, rows stepped through in
+// full table scans, sorts, automatic indexes built, and rows returned.
+struct SQueryStats {
+    uint64_t vmSteps = 0;
+    uint64_t fullScanSteps = 0;
+    uint64_t sorts = 0;
+    uint64_t autoIndexes = 0;
+    uint64_t rows = 0;
+};
+
+// The command a thread is running queries for, which the slow query log records with each query. SAutoQueryOrigin
+// sets it for its scope.
+struct SQueryOrigin {
+    string command;
+    string requestID;
+};
+extern thread_local SQueryOrigin SThreadQueryOrigin;
+
+struct SAutoQueryOrigin {
+    SAutoQueryOrigin(const string& command, const string& requestID) : _oldOrigin(move(SThreadQueryOrigin)) {
+        SThreadQueryOrigin.command = command;
+        SThreadQueryOrigin.requestID = requestID;
+    }
+    ~SAutoQueryOrigin() { SThreadQueryOrigin = move(_oldOrigin); }
+
+  private:
+    SQueryOrigin _oldOrigin;
+};
+
+// The slow query log keeps the last `maxQueries` queries that took longer than `thresholdUS` (or their own warning
+// threshold, if lower), sampling one in every `sampleEvery` of them. Each is kept with its normalized statement, its
+// `EXPLAIN QUERY PLAN`, its SQueryStats, and the SQueryOrigin it ran for. It's off until configured, and a
+// `maxQueries` of 0 turns it off again. SSlowQueryLogGet returns what's been kept, oldest first.
+void SSlowQueryLogConfigure(size_t maxQueries, int sampleEvery = 1, uint64_t thresholdUS = UINT64_MAX);
+void SSlowQueryLogRecord(sqlite3* db, const string& sql, uint64_t elapsed, int64_t warnThreshold, int result,
+                         const SQueryStats& stats);
+list<STable> SSlowQueryLogGet();
+
+// When a query gets SQLITE_BUSY, it's retried with an exponential backoff that starts at SQUERY_BUSY_BACKOFF_MIN_US and
+// doubles up to SQUERY_BUSY_BACKOFF_MAX_US. It stops at the calling thread's busy deadline, or SQUERY_BUSY_TIMEOUT_US
+// after the query started if the thread has no deadline.
+#define SQUERY_BUSY_BACKOFF_MIN_US 10
+#define SQUERY_BUSY_BACKOFF_MAX_US (10 * STIME_US_PER_MS)
+#define SQUERY_BUSY_TIMEOUT_US STIME_US_PER_S
+
+// Sets the time (in microseconds since the epoch) after which queries on this thread stop retrying on SQLITE_BUSY.
+// Zero clears it, going back to SQUERY_BUSY_TIMEOUT_US per query.
+void SQuerySetBusyDeadline(uint64_t deadline);
+
+// A handler for sqlite3_busy_handler that uses the same backoff and deadline, so sqlite retries a lock itself before
+// returning SQLITE_BUSY.
+int SQueryBusyHandler(void* arg, int count);
+
+// The number of times any thread has backed off because of SQLITE_BUSY, and the total time spent doing so.
+uint64_t SQueryBusyRetryCount();
+uint64_t SQueryBusyWaitUS();
+
+// The number of sqlite virtual machine steps run by queries on this thread since it started. Take the difference
+// between two calls to see what the queries in between cost.
+uint64_t SQueryVMSteps();
 
 // Returns an SQLite result code.
 int SQuery(sqlite3* db, const char* e, const string& sql, SQResult& result,
@@ -773,18 +1009,39 @@ inline int SQuery(sqlite3* db, const char* e, const string& sql, int64_t warnThr
     return SQuery(db, e, sql, ignore, warnThreshold, skipWarn);
 }
 
+// Like the above, but each row is written to `output` as it's returned, rather than collected into a result. The
+// caller finishes the writer once this succeeds.
+int SQuery(sqlite3* db, const char* e, const string& sql, SQResultWriter& output,
+           int64_t warnThreshold = 2000 * STIME_US_PER_MS, bool skipWarn = false);
+
+// Like the first, but collects the result with each value's type, without a string per cell.
+int SQuery(sqlite3* db, const char* e, const string& sql, SQTypedResult& result,
+           int64_t warnThreshold = 2000 * STIME_US_PER_MS, bool skipWarn = false);
+
+// Runs a statement that's already been prepared and bound, then resets it so it can be re-used. Returns an SQLite
+// result code.
+int SQuery(sqlite3* db, const char* e, sqlite3_stmt* statement, SQResult& result,
+           int64_t warnThreshold = 2000 * STIME_US_PER_MS, bool skipWarn = false);
+
 bool SQVerifyTable(sqlite3* db, const string& tableName, const string& sql);
 bool SQVerifyTableExists(sqlite3* db, const string& tableName);
 
 // --------------------------------------------------------------------------
 inline string STIMESTAMP(uint64_t when) { return SQ(SComposeTime("%Y-%m-%d %H:%M:%S", when)); }
-inline string SCURRENT_TIMESTAMP() { return STIMESTAMP(STimeNow()); }
+
+// Returns the current time as 'YYYY-MM-DD HH:MM:SS', unquoted, suitable for binding as a query parameter so that the
+// query text doesn't change from one second to the next. It's formatted at most once a second on each thread.
+const string& SCurrentTimeString();
+
+// Like STIMESTAMP(STimeNow()), but from the same per-thread cache as `SCurrentTimeString`.
+string SCURRENT_TIMESTAMP();
 
 // --------------------------------------------------------------------------
 // Miscellaneous stuff
 // --------------------------------------------------------------------------
 // Compression
-string SGZip(const string& content);
+// `level` is the zlib compression level, from 1 (fastest) to 9 (smallest).
+string SGZip(const string& content, int level = 9);
 string SGUnzip(const string& content);
 
 // Command-line helpers
@@ -854,6 +1111,7 @@ struct STestTimer {
 // Networking stuff
 // --------------------------------------------------------------------------
 // Networking includes
+#include "SFastBuffer.h"
 #include "SX509.h"
 #include "SSSLState.h"
 #include "STCPManager.h"
@@ -863,6 +1121,7 @@ struct STestTimer {
 
 // Other libstuff headers.
 #include "SRandom.h"
+#include "SHistogram.h"
 #include "SPerformanceTimer.h"
 #include "SLockTimer.h"
 #include "SSynchronizedQueue.h"
@@ -178,12 +178,21 @@ int main(int argc, char* argv[]) {
         cout << SVERSION << endl;
         return 0;
     }
+    if (args.isSet("-queryLogToCSV")) {
+        // Convert a binary query log to CSV on stdout
+        if (!SQueryLogToCSV(args["-queryLogToCSV"], cout)) {
+            cerr << "Couldn't read query log '" << args["-queryLogToCSV"] << "'." << endl;
+            return 1;
+        }
+        return 0;
+    }
     if (args.isSet("-h") || args.isSet("-?") || args.isSet("-help")) {
         // Ouput very basic documentation
         cout << "Usage:" << endl;
         cout << "------" << endl;
         cout << "bedrock [-? | -h | -help]" << endl;
         cout << "bedrock -version" << endl;
+        cout << "bedrock -queryLogToCSV <filename>" << endl;
         cout << "bedrock [-clean] [-v] [-db <filename>] [-serverHost <host:port>] [-nodeHost <host:port>] [-nodeName "
                 "<name>] [-peerList <list>] [-priority <value>] [-plugins <list>] [-cacheSize <kb>] [-workerThreads <#>] "
                 "[-versionOverride <version>]"
@@ -193,10 +202,21 @@ int main(int argc, char* argv[]) {
         cout << "----------------" << endl;
         cout << "-?, -h, -help               Outputs instructions and exits" << endl;
         cout << "-version                    Outputs version and exits" << endl;
+        cout << "-queryLogToCSV <filename>   Outputs a binary query log as CSV and exits" << endl;
         cout << "-v                          Enables verbose logging" << endl;
         cout << "-q                          Enables quiet logging" << endl;
         cout << "-clean                      Recreate a new database from scratch" << endl;
+        cout << "-syncLogging                Write log lines to syslog on the thread that logs them, rather than "
+                "queuing them for a background logging thread"
+             << endl;
         cout << "-enableMultiWrite           Enable multi-write mode (default: true)" << endl;
+        cout << "-enableMultiWriteQuorum     Also commit ONE and QUORUM commands in workers (default: false)" << endl;
+        cout << "-fastFailover               Heartbeat peers to notice within a second when one is gone, and bound the "
+                "time spent standing up, standing down and searching to seconds"
+             << endl;
+        cout << "-changesetReplication       While master, replicate the rows each commit changed rather than its "
+                "queries, if every peer supports it"
+             << endl;
         cout << "-versionOverride <version>  Pretends to be a different version when talking to peers" << endl;
         cout << "-db             <filename>  Use a database with the given name (default 'bedrock.db')" << endl;
         cout
@@ -207,17 +227,85 @@ int main(int argc, char* argv[]) {
         cout << "-nodeHost       <host:port> Listen on this host:port for connections from other nodes" << endl;
         cout << "-peerList       <list>      See below" << endl;
         cout << "-priority       <value>     See '-peerList Details' below (defaults to 100)" << endl;
+        cout << "-replicateFrom  <name>      On a permaslave (priority 0), subscribe to this slave rather than the master "
+                "and receive the master's commits from it"
+             << endl;
         cout << "-plugins        <list>      Enable these plugins (defaults to 'db,jobs,cache,mysql')" << endl;
         cout << "-cacheSize      <kb>        number of KB to allocate for a page cache (defaults to 1GB)" << endl;
+        cout << "-cacheBudget    <kb>        Total KB of page cache to split evenly across every DB handle, in place of "
+                "-cacheSize for each"
+             << endl;
+        cout << "-mmapSize       <mb>        Read up to this many MB of the database through a memory map shared by every "
+                "DB handle (default 0, disabled)"
+             << endl;
         cout << "-workerThreads  <#>         Number of worker threads to start (min 1, defaults to # of cores)" << endl;
-        cout << "-queryLog       <filename>  Set the query log filename (default 'queryLog.csv', SIGUSR2/SIGQUIT to "
+        cout << "-minWorkerThreads <#>       Keep as few as this many worker threads active, adding more up to "
+                "-workerThreads as commands back up (default: all of them, always)"
+             << endl;
+        cout << "-workerCPUs     <list>      Pin worker threads to these CPUs, as CPU numbers, ranges like '0-7', or "
+                "'nodeN' for every CPU on NUMA node N"
+             << endl;
+        cout << "-syncCPUs       <list>      Pin the sync thread to these CPUs, in the same format as -workerCPUs" << endl;
+        cout << "-warmUpInterval <s>         While not master, have idle workers read the data plugins expect to need "
+                "first after promotion this often, to keep their page caches warm (default 0, disabled)"
+             << endl;
+        cout << "-peekCacheSize  <#>         Keep up to this many responses to read commands that plugins allow caching, "
+                "until a commit changes what they read (default 0, disabled)"
+             << endl;
+        cout << "-slaveApplyThreads <#>      Number of threads that apply transactions from master in parallel while "
+                "slaving (default 0, the sync thread does it)"
+             << endl;
+        cout << "-ioThreads      <#>         Number of threads to accept and read client connections on the command port "
+                "(default 0, the main thread does it)"
+             << endl;
+        cout << "-queryLog       <filename>  Set the query log filename (default 'queryLog.bin', SIGUSR2/SIGQUIT to "
                 "enable/disable)"
              << endl;
         cout << "-maxJournalSize <#commits>  Number of commits to retain in the historical journal (default 1000000)"
              << endl;
+        cout << "-backupBytesPerSecond <#>   Limit live backups (BeginBackup with 'live: true') to this rate, to "
+                "leave disk bandwidth for commands (default 0, unlimited)"
+             << endl;
         cout << "-synchronous    <value>     Set the PRAGMA schema.synchronous "
                 "(defaults see https://sqlite.org/pragma.html#pragma_synchronous)"
              << endl;
+        cout << "-groupCommitWindow <us>     Gather worker commits made within this many microseconds into a single "
+                "WAL sync (default 0, disabled)"
+             << endl;
+        cout << "-shedDepth      <list>      Reject commands at or below each priority with a 503 once this many "
+                "commands are queued, as 'priority:depth,...' (default none)"
+             << endl;
+        cout << "-shedAge        <list>      Reject commands at or below each priority with a 503 once commands at those "
+                "priorities have waited this long in the queue, as 'priority:ms,...' (default none)"
+             << endl;
+        cout << "-maxHeldCommands <list>     Limit how many commands each area holds while they wait, as "
+                "'area:count,...', for areas escalated, futureCommit, https, standDown, and responses (default none)"
+             << endl;
+        cout << "-maxHeldBytes   <list>      Limit the bytes each area's held commands take, as 'area:bytes,...' "
+                "(default none)"
+             << endl;
+        cout << "-escalationTimeout <ms>     Answer a command escalated to master with a 555 if it isn't done this long "
+                "after it arrived, unless it has its own 'clientTimeout' (default 30000, 0 for no limit)"
+             << endl;
+        cout << "-heldCommandPolicy <policy> 'shed' new commands with a 503 while any area is full (the default), or "
+                "'expire' the oldest escalated or futureCommit command with a 555 to make room"
+             << endl;
+        cout << "-queueWeights   <list>      Share workers between priorities in proportion to these weights instead of "
+                "strictly by priority, as 'priority:weight,...' (unlisted priorities weigh 1)"
+             << endl;
+        cout << "-queueFairness  <key>       With -queueWeights, also share workers within each priority between "
+                "commands by 'verb', 'source' address (the default), or the value of the named request header"
+             << endl;
+        cout << "-traceSampleRate <#>        Trace one in this many client commands across escalation and replication, "
+                "see 'GetTraces' (default 0, only commands sent with a 'traceID')"
+             << endl;
+        cout << "-slowQueryLogSize <#>       Keep this many of the latest slow queries, with their query plans, see "
+                "'GetSlowQueries' (default 100, 0 disables)"
+             << endl;
+        cout << "-slowQuerySampleRate <#>    Keep one in this many slow queries (default 1, all of them)" << endl;
+        cout << "-slowQueryThreshold <ms>    Keep queries slower than this, as well as those slow enough to warn about "
+                "(default, only those)"
+             << endl;
         cout << endl;
         cout << "Quick Start Tips:" << endl;
         cout << "-----------------" << endl;
@@ -257,6 +345,12 @@ int main(int argc, char* argv[]) {
         SLogLevel(LOG_WARNING);
     }
 
+    // Unless asked not to, hand log lines off to a background thread so that a slow syslog can't stall a worker
+    // that's holding the commit lock.
+    if (!args.isSet("-syncLogging")) {
+        SLogStartAsync();
+    }
+
 // Set the defaults
 #define SETDEFAULT(_NAME_, _VAL_)                                                                                      \
     do {                                                                                                               \
@@ -272,7 +366,9 @@ int main(int argc, char* argv[]) {
     SETDEFAULT("-plugins", "db,jobs,cache,mysql");
     SETDEFAULT("-priority", "100");
     SETDEFAULT("-maxJournalSize", "1000000");
-    SETDEFAULT("-queryLog", "queryLog.csv");
+    SETDEFAULT("-queryLog", "queryLog.bin");
+    SETDEFAULT("-slowQueryLogSize", "100");
+    SETDEFAULT("-escalationTimeout", "30000");
     SETDEFAULT("-enableMultiWrite", "true");
 
     args["-plugins"] = SComposeList(loadPlugins(args));
@@ -329,5 +425,6 @@ int main(int argc, char* argv[]) {
 
     // All done
     SINFO("Graceful process shutdown complete");
+    SLogStopAsync();
     return 0;
 }
@@ -1,4 +1,11 @@
 #include "Cache.h"
+#include "../BedrockServer.h"
+
+// ==========================================================================
+// Returns the current time in seconds, which is what the `expires` column holds.
+static int64_t _nowSeconds() {
+    return STimeNow() / STIME_US_PER_S;
+}
 
 // ==========================================================================
 BedrockPlugin_Cache::LRUMap::LRUMap() {
@@ -7,54 +14,235 @@ BedrockPlugin_Cache::LRUMap::LRUMap() {
 
 // ==========================================================================
 BedrockPlugin_Cache::LRUMap::~LRUMap() {
-    // Just delete all the entries
-    while (!empty()) {
-        // Pop it off
-        popLRU();
-    }
+    // The shards clean themselves up
 }
 
 // ==========================================================================
 bool BedrockPlugin_Cache::LRUMap::empty() {
-    // Both the map and list are the same size, so check either
-    SAUTOLOCK(_mutex);
-    return _lruList.empty();
+    return !_size.load();
 }
 
 // ==========================================================================
 void BedrockPlugin_Cache::LRUMap::pushMRU(const string& name) {
-    // See if if it's already there
-    SAUTOLOCK(_mutex);
-    map<string, Entry*>::iterator mapIt = _lruMap.find(name);
-    if (mapIt == _lruMap.end()) {
-        // Not in the map -- add a new entry
-        Entry* entry = new Entry;
-        entry->name = name;
-
-        // Insert into the map and list, retaining iterators to both
-        entry->mapIt = _lruMap.insert(std::pair<string, Entry*>(name, entry)).first;
-        entry->listIt = _lruList.insert(_lruList.end(), entry);
+    Shard& shard = _shards[hash<string>()(name) % SHARDS];
+    {
+        // If it's already there, just mark it as used
+        shared_lock<shared_timed_mutex> lock(shard.shardMutex);
+        auto it = shard.slotsByName.find(name);
+        if (it != shard.slotsByName.end()) {
+            shard.slots[it->second].used.store(true, memory_order_relaxed);
+            return;
+        }
+    }
+
+    // Not in the map -- add a new entry, unless someone beat us to it
+    unique_lock<shared_timed_mutex> lock(shard.shardMutex);
+    auto it = shard.slotsByName.find(name);
+    if (it != shard.slotsByName.end()) {
+        shard.slots[it->second].used.store(true, memory_order_relaxed);
+        return;
+    }
+    size_t index;
+    if (shard.freeSlots.empty()) {
+        index = shard.slots.size();
+        shard.slots.emplace_back();
     } else {
-        // Already in the map, just move to the end of the list
-        Entry* entry = mapIt->second;
-        _lruList.erase(entry->listIt);
-        entry->listIt = _lruList.insert(_lruList.end(), entry);
+        index = shard.freeSlots.back();
+        shard.freeSlots.pop_back();
     }
+    Slot& slot = shard.slots[index];
+    slot.name = name;
+    slot.used.store(true, memory_order_relaxed);
+    slot.inUse = true;
+    shard.slotsByName.emplace(name, index);
+    _size++;
 }
 
 // ==========================================================================
 string BedrockPlugin_Cache::LRUMap::popLRU() {
-    // Make sure we're not empty
-    SAUTOLOCK(_mutex);
-    SASSERT(!empty());
-
-    // Take the first item off the list
-    Entry* entry = _lruList.front();
-    _lruList.erase(entry->listIt);
-    _lruMap.erase(entry->mapIt);
-    string nameCopy = entry->name;
-    delete entry;
-    return nameCopy;
+    // Take the next entry from the next shard that has any
+    for (size_t i = 0; i < SHARDS; i++) {
+        Shard& shard = _shards[_nextShard++ % SHARDS];
+        unique_lock<shared_timed_mutex> lock(shard.shardMutex);
+        if (!shard.slotsByName.empty()) {
+            return _evict(shard);
+        }
+    }
+
+    // It's empty
+    return "";
+}
+
+// ==========================================================================
+string BedrockPlugin_Cache::LRUMap::_evict(Shard& shard) {
+    // Sweep round, giving everything that's been used since we last passed it a second chance. This ends within two
+    // passes, as the first clears every flag.
+    while (true) {
+        if (shard.hand >= shard.slots.size()) {
+            shard.hand = 0;
+        }
+        Slot& slot = shard.slots[shard.hand++];
+        if (!slot.inUse) {
+            continue;
+        }
+        if (slot.used.exchange(false, memory_order_relaxed)) {
+            continue;
+        }
+        return _free(shard, shard.hand - 1);
+    }
+}
+
+// ==========================================================================
+void BedrockPlugin_Cache::LRUMap::erase(const string& name) {
+    Shard& shard = _shards[hash<string>()(name) % SHARDS];
+    unique_lock<shared_timed_mutex> lock(shard.shardMutex);
+    auto it = shard.slotsByName.find(name);
+    if (it != shard.slotsByName.end()) {
+        _free(shard, it->second);
+    }
+}
+
+// ==========================================================================
+list<string> BedrockPlugin_Cache::LRUMap::getRecentlyUsed(size_t maxNames) {
+    // Take an even share from each shard, as names are spread across them by hash anyway.
+    list<string> names;
+    const size_t perShard = max(maxNames / SHARDS, (size_t)1);
+    for (Shard& shard : _shards) {
+        shared_lock<shared_timed_mutex> lock(shard.shardMutex);
+        size_t found = 0;
+        for (const Slot& slot : shard.slots) {
+            if (found >= perShard || names.size() >= maxNames) {
+                break;
+            }
+            if (slot.inUse && slot.used.load(memory_order_relaxed)) {
+                names.push_back(slot.name);
+                found++;
+            }
+        }
+    }
+    return names;
+}
+
+// ==========================================================================
+string BedrockPlugin_Cache::LRUMap::_free(Shard& shard, size_t index) {
+    Slot& slot = shard.slots[index];
+    string name = move(slot.name);
+    slot.name.clear();
+    slot.inUse = false;
+    slot.used.store(false, memory_order_relaxed);
+    shard.slotsByName.erase(name);
+    shard.freeSlots.push_back(index);
+    _size--;
+    return name;
+}
+
+// ==========================================================================
+bool BedrockPlugin_Cache::MemoryTier::get(const string& name, string& value, bool& compressed) {
+    if (!enabled()) {
+        return false;
+    }
+    Shard& shard = _getShard(name);
+    lock_guard<mutex> lock(shard.shardMutex);
+    auto it = shard.byName.find(name);
+    if (it == shard.byName.end()) {
+        return false;
+    }
+    if (it->second->expires && it->second->expires <= _nowSeconds()) {
+        _erase(shard, it->second);
+        return false;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    value = it->second->value;
+    compressed = it->second->compressed;
+    return true;
+}
+
+// ==========================================================================
+void BedrockPlugin_Cache::MemoryTier::put(const string& name, int64_t rowID, const string& value, bool compressed,
+                                          int64_t expires, uint64_t epoch) {
+    const size_t size = name.size() + value.size();
+    if (!enabled() || size > _maxShardSize) {
+        return;
+    }
+    Shard& shard = _getShard(name);
+    lock_guard<mutex> lock(shard.shardMutex);
+
+    // This is checked under the shard's lock, and onCommitted bumps the epoch before it takes any shard's lock, so
+    // either we see the new epoch here, or the entry we add will be there for onCommitted to remove.
+    if (_epoch.load() != epoch) {
+        return;
+    }
+    auto existing = shard.byName.find(name);
+    if (existing != shard.byName.end()) {
+        _erase(shard, existing->second);
+    }
+    shard.lru.push_front({name, value, rowID, compressed, expires});
+    shard.byName[name] = shard.lru.begin();
+    shard.byRowID[rowID] = shard.lru.begin();
+    shard.size += size;
+    while (shard.size > _maxShardSize) {
+        _erase(shard, prev(shard.lru.end()));
+    }
+}
+
+// ==========================================================================
+void BedrockPlugin_Cache::MemoryTier::onCommitted(SQLite& db, const set<int64_t>* rowIDs) {
+    _epoch++;
+    if (!enabled()) {
+        return;
+    }
+
+    // Overwriting a name with INSERT OR REPLACE deletes its old row without sqlite reporting it, and gives the new row
+    // a new rowid, so an entry can't be found by rowid once its name's been written again. Instead, we look up the
+    // names in any rows that were inserted or updated, and drop whatever we have for those names. Deleted rows are
+    // gone, so those are still dropped by rowid.
+    list<string> names;
+    if (rowIDs && !rowIDs->empty()) {
+        list<string> ids;
+        for (int64_t rowID : *rowIDs) {
+            ids.push_back(SToStr(rowID));
+        }
+        SQResult result;
+        if (db.read("SELECT name FROM cache WHERE rowid IN (" + SComposeList(ids) + ");", result)) {
+            for (const auto& row : result.rows) {
+                names.push_back(row[0]);
+            }
+        } else {
+            rowIDs = nullptr;
+        }
+    }
+    for (Shard& shard : _shards) {
+        lock_guard<mutex> lock(shard.shardMutex);
+        if (!rowIDs) {
+            shard.lru.clear();
+            shard.byName.clear();
+            shard.byRowID.clear();
+            shard.size = 0;
+            continue;
+        }
+        for (int64_t rowID : *rowIDs) {
+            auto it = shard.byRowID.find(rowID);
+            if (it != shard.byRowID.end()) {
+                _erase(shard, it->second);
+            }
+        }
+    }
+    for (const string& name : names) {
+        Shard& shard = _getShard(name);
+        lock_guard<mutex> lock(shard.shardMutex);
+        auto it = shard.byName.find(name);
+        if (it != shard.byName.end()) {
+            _erase(shard, it->second);
+        }
+    }
+}
+
+// ==========================================================================
+void BedrockPlugin_Cache::MemoryTier::_erase(Shard& shard, list<Entry>::iterator it) {
+    shard.size -= it->name.size() + it->value.size();
+    shard.byName.erase(it->name);
+    shard.byRowID.erase(it->rowID);
+    shard.lru.erase(it);
 }
 
 // ==========================================================================
@@ -69,17 +257,58 @@ BedrockPlugin_Cache::~BedrockPlugin_Cache() {
     // Nothing to clean up
 }
 
+// ==========================================================================
+// Returns a WHERE condition matching cache names against a GLOB pattern. A pattern with no wildcards, or that's a
+// literal prefix followed by a single "*", is matched as a primary key lookup or range instead, which sqlite always
+// serves from the index. Anything else has to scan.
+static string _composeNameMatch(const string& pattern) {
+    const size_t wildcard = pattern.find_first_of("*?[");
+    if (wildcard == string::npos) {
+        return "name = " + SQ(pattern);
+    }
+    if (wildcard && wildcard == pattern.size() - 1 && pattern[wildcard] == '*') {
+        // Names sort bytewise, so everything starting with the prefix is between it and the prefix with its last byte
+        // incremented (dropping any bytes that can't be).
+        const string prefix = pattern.substr(0, wildcard);
+        string end = prefix;
+        while (!end.empty() && (unsigned char)end.back() == 0xFF) {
+            end.pop_back();
+        }
+        if (end.empty()) {
+            return "name >= " + SQ(prefix);
+        }
+        end.back()++;
+        return "name >= " + SQ(prefix) + " AND name < " + SQ(end);
+    }
+    return "name GLOB " + SQ(pattern);
+}
+
+// ==========================================================================
+// Unzips a value read from the cache if it was stored compressed.
+static void _decodeValue(string& value, bool compressed) {
+    if (compressed) {
+        value = SGUnzip(value);
+    }
+}
+
+// ==========================================================================
+// Parses a size like "16GB" from the command line, returning it in bytes.
+static int64_t _parseSize(const string& size) {
+    const string& upperSize = SToUpper(size);
+    int64_t bytes = SToInt64(upperSize);
+    if (SEndsWith(upperSize, "KB"))
+        bytes *= 1024;
+    if (SEndsWith(upperSize, "MB"))
+        bytes *= 1024 * 1024;
+    if (SEndsWith(upperSize, "GB"))
+        bytes *= 1024 * 1024 * 1024;
+    return bytes;
+}
+
 // ==========================================================================
 void BedrockPlugin_Cache::initialize(const SData& args, BedrockServer& server) {
     // Check the configuration
-    const string& maxCache = SToUpper(args["-cache.max"]);
-    int64_t maxCacheSize = SToInt64(maxCache);
-    if (SEndsWith(maxCache, "KB"))
-        maxCacheSize *= 1024;
-    if (SEndsWith(maxCache, "MB"))
-        maxCacheSize *= 1024 * 1024;
-    if (SEndsWith(maxCache, "GB"))
-        maxCacheSize *= 1024 * 1024 * 1024;
+    int64_t maxCacheSize = _parseSize(args["-cache.max"]);
     if (!maxCacheSize) {
         // Provide a default
         SINFO("No -cache.max specified, defaulting to 16GB");
@@ -91,6 +320,32 @@ void BedrockPlugin_Cache::initialize(const SData& args, BedrockServer& server) {
     // Save this in a class constant, to enable us to access it safely in an
     // unsynchronized manner from other threads.
     *((int64_t*)&_maxCacheSize) = maxCacheSize;
+
+    // Optionally keep recently read values in memory, too.
+    const int64_t memorySize = _parseSize(args["-cache.memory"]);
+    if (memorySize > 0) {
+        SINFO("Keeping up to " << memorySize << " bytes of the cache in memory");
+        _memoryTier.setMaxSize(memorySize);
+    }
+
+    // Optionally compress large values.
+    _compressAbove = max(_parseSize(args["-cache.compressAbove"]), (int64_t)0);
+    if (_compressAbove) {
+        SINFO("Compressing cache values over " << _compressAbove << " bytes");
+    }
+
+    // Expired entries are deleted in batches on a timer.
+    _server = &server;
+    _expireBatchSize = args.isSet("-cache.expireBatchSize") ? max(args.calc64("-cache.expireBatchSize"), (int64_t)1) : 1000;
+    timers.insert(&_expireTimer);
+
+    // We can be initialized more than once, but should only listen for commits once.
+    if (!_listening) {
+        _listening = true;
+        SQLite::addCommitListener("cache", [this](SQLite& db, const set<int64_t>* rowIDs) {
+            _memoryTier.onCommitted(db, rowIDs);
+        });
+    }
 }
 
 #undef SLOGPREFIX
@@ -98,16 +353,25 @@ void BedrockPlugin_Cache::initialize(const SData& args, BedrockServer& server) {
 
 // ==========================================================================
 void BedrockPlugin_Cache::upgradeDatabase(SQLite& db) {
-    // Create or verify the cache table
+    // Create or verify the cache table. Tables from before entries could expire get the column added, rather than
+    // losing what's in them.
+    const string& cacheSQL = db.read("SELECT sql FROM sqlite_master WHERE type='table' AND name='cache';");
+    if (!cacheSQL.empty() && !SContains(cacheSQL, "expires")) {
+        db.addColumn("cache", "expires", "INTEGER NOT NULL DEFAULT 0");
+    }
     bool ignore;
     while (!db.verifyTable("cache", "CREATE TABLE cache ( "
-                                    "name  TEXT NOT NULL PRIMARY KEY, "
-                                    "value BLOB NOT NULL ) ",
+                                    "name    TEXT NOT NULL PRIMARY KEY, "
+                                    "value   BLOB NOT NULL, "
+                                    "expires INTEGER NOT NULL DEFAULT 0 ) ",
                            ignore)) {
         // Drop and rebuild the table
         SASSERT(db.write("DROP TABLE cache;"));
     }
 
+    // Only entries that expire are indexed, for ExpireCache to find.
+    SASSERT(db.write("CREATE INDEX IF NOT EXISTS cacheExpires ON cache ( expires ) WHERE expires > 0;"));
+
     // Add a one row, one column table to keep track of the current size of the cache
     SASSERT(db.verifyTable("cacheSize", "CREATE TABLE cacheSize ( size INTEGER )", ignore));
     SQResult result;
@@ -144,7 +408,8 @@ bool BedrockPlugin_Cache::peekCommand(SQLite& db, BedrockCommand& command) {
     if (SIEquals(request.getVerb(), "ReadCache")) {
         // - ReadCache( name )
         //
-        //     Looks up the cached value corresponding to a name, if any.
+        //     Looks up the cached value corresponding to a name, if any. Entries that have expired aren't found, even
+        //     before ExpireCache gets round to deleting them.
         //
         //     Parameters:
         //     - name - name pattern with which to search the cache (in GLOB syntax)
@@ -158,14 +423,34 @@ bool BedrockPlugin_Cache::peekCommand(SQLite& db, BedrockCommand& command) {
         verifyAttributeSize(request, "name", 1, MAX_SIZE_SMALL);
         const string& name = request["name"];
 
-        // Get the list
+        // An exact name can be served from memory if we have it, and is otherwise a primary key lookup, with the
+        // value kept in memory for next time. Note that the epoch has to be taken before this transaction's first read,
+        // which is where sqlite starts its snapshot, for `put` to know whether the value could be stale; nothing before
+        // us in peek reads the database for ReadCache.
         SQResult result;
-        if (!db.read("SELECT name, value "
-                     "FROM cache "
-                     "WHERE name GLOB " +
-                         SQ(name) + " "
-                                    "LIMIT 1;",
-                     result)) {
+        bool compressed = false;
+        if (name.find_first_of("*?[") == string::npos) {
+            if (_memoryTier.get(name, response.content, compressed)) {
+                response["name"] = name;
+                _lruMap.pushMRU(name);
+                _decodeValue(response.content, compressed);
+                return true;
+            }
+            const uint64_t epoch = _memoryTier.getEpoch();
+            if (!db.read("SELECT name, value, typeof(value) = 'blob', rowid, expires FROM cache WHERE name = ?;", {name}, result)) {
+                STHROW("502 Query failed");
+            }
+            if (!result.empty()) {
+                const int64_t expires = SToInt64(result[0][4]);
+                if (expires && expires <= _nowSeconds()) {
+                    result.clear();
+                } else {
+                    _memoryTier.put(name, SToInt64(result[0][3]), result[0][1], result[0][2] == "1", expires, epoch);
+                    result[0].resize(3);
+                }
+            }
+        } else if (!db.read("SELECT name, value, typeof(value) = 'blob' FROM cache WHERE " + _composeNameMatch(name) + " "
+                            "AND (expires = 0 OR expires > " + SQ(_nowSeconds()) + ") LIMIT 1;", result)) {
             STHROW("502 Query failed");
         }
 
@@ -175,9 +460,10 @@ bool BedrockPlugin_Cache::peekCommand(SQLite& db, BedrockCommand& command) {
             STHROW("404 No match found");
         } else {
             // Return that item
-            SASSERT(result[0].size() == 2);
+            SASSERT(result[0].size() == 3);
             response["name"] = result[0][0];
-            response.content = result[0][1];
+            response.content = move(result[0][1]);
+            _decodeValue(response.content, result[0][2] == "1");
 
             // Update the LRU Map
             _lruMap.pushMRU(response["name"]);
@@ -185,10 +471,41 @@ bool BedrockPlugin_Cache::peekCommand(SQLite& db, BedrockCommand& command) {
         }
     }
 
+    // ----------------------------------------------------------------------
+    else if (SIEquals(request.getVerb(), "ExpireCache")) {
+        // If nothing has expired there's nothing to write, so don't bother the sync thread.
+        SQResult result;
+        if (!db.read("SELECT 1 FROM cache WHERE expires > 0 AND expires <= " + SQ(_nowSeconds()) + " LIMIT 1;", result)) {
+            STHROW("502 Query failed");
+        }
+        if (result.empty()) {
+            _expireTimer.alarmDuration = EXPIRE_INTERVAL;
+            response["expired"] = "0";
+            return true;
+        }
+        return false;
+    }
+
     // Didn't recognize this command
     return false;
 }
 
+// ==========================================================================
+bool BedrockPlugin_Cache::shouldCoalescePeek(const BedrockCommand& command) {
+    // The first of several identical reads marks the name as used for all of them.
+    return SIEquals(command.request.getVerb(), "ReadCache");
+}
+
+// ==========================================================================
+list<string> BedrockPlugin_Cache::getWarmUpQueries() {
+    // The names this node has read recently are the ones its clients are likely to want from it as master, too.
+    list<string> names = _lruMap.getRecentlyUsed(CACHE_WARM_UP_NAMES);
+    if (names.empty()) {
+        return {};
+    }
+    return {"SELECT name, value FROM cache WHERE name IN (" + SQList(names) + ");"};
+}
+
 // ==========================================================================
 bool BedrockPlugin_Cache::processCommand(SQLite& db, BedrockCommand& command) {
     // Pull out some helpful variables
@@ -210,8 +527,12 @@ bool BedrockPlugin_Cache::processCommand(SQLite& db, BedrockCommand& command) {
         //     - value          - Raw data to associate with this value, as a request header (1MB max) or content body
         //     (64MB max)
         //     - invalidateName - A name pattern to erase from the cache (optional)
+        //     - ttl            - Seconds after which the value expires (optional, default never)
         //
         verifyAttributeSize(request, "name", 1, MAX_SIZE_SMALL);
+        if (request.isSet("ttl") && request.calc64("ttl") <= 0) {
+            STHROW("402 Invalid ttl");
+        }
         const string& valueHeader = request["value"];
         if (!valueHeader.empty()) {
             // Value is provided via the header -- make sure it's not too long
@@ -228,39 +549,62 @@ bool BedrockPlugin_Cache::processCommand(SQLite& db, BedrockCommand& command) {
             STHROW("402 Missing value header or content body");
         }
 
+        // Compress the value if it's big enough to be worth it, and it helps.
+        const string& name = request["name"];
+        const string* value = valueHeader.empty() ? &request.content : &valueHeader;
+        string compressed;
+        if (_compressAbove && (int64_t)value->size() > _compressAbove) {
+            compressed = SGZip(*value);
+            if (compressed.size() < value->size()) {
+                value = &compressed;
+            } else {
+                compressed.clear();
+            }
+        }
+
         // Make sure we're not trying to cache something larger than the cache itself
-        int64_t contentSize = valueHeader.empty() ? request.content.size() : valueHeader.size();
+        int64_t contentSize = value->size();
         if (contentSize > _maxCacheSize) {
             // Just refuse
             STHROW("402 Content larger than the cache itself");
         }
 
-        // Optionally invalidate other entries in the cache at the same time.
-        // Note that we will leave these items in the lruMap in memory, but
-        // that's non-harmful.
+        // Optionally invalidate other entries in the cache at the same time. We find out what they are first, so they
+        // can be dropped from the lruMap too, and so there's nothing to write if there aren't any.
         if (!request["invalidateName"].empty()) {
-            if (!db.write("DELETE FROM cache WHERE name GLOB " + SQ(request["invalidateName"]) + ";"))
+            const string& invalidateMatch = _composeNameMatch(request["invalidateName"]);
+            SQResult invalidated;
+            if (!db.read("SELECT name FROM cache WHERE " + invalidateMatch + ";", invalidated))
                 STHROW("502 Query failed (invalidating)");
+            if (!invalidated.empty()) {
+                if (!db.write("DELETE FROM cache WHERE " + invalidateMatch + ";"))
+                    STHROW("502 Query failed (invalidating)");
+                for (const auto& row : invalidated.rows) {
+                    _lruMap.erase(row[0]);
+                }
+            }
         }
 
         // Clear out room for the new object
         while (SToInt64(db.read("SELECT size FROM cacheSize;")) + contentSize > _maxCacheSize) {
             // Find the least recently used (LRU) item if there is one.  (If the server was recently restarted,
             // its LRU might not be fully populated.)
-            const string& name = (_lruMap.empty() ? db.read("SELECT name FROM cache LIMIT 1") : _lruMap.popLRU());
+            string name = _lruMap.popLRU();
+            if (name.empty()) {
+                name = db.read("SELECT name FROM cache LIMIT 1");
+            }
             SASSERT(!name.empty());
 
             // Delete it
-            if (!db.write("DELETE FROM cache WHERE name=" + SQ(name) + ";"))
+            if (!db.write("DELETE FROM cache WHERE name=?;", {name}))
                 STHROW("502 Query failed (deleting)");
         }
 
-        // Insert the new entry
-        const string& name = request["name"];
-        const string& safeValue = SQ(valueHeader.empty() ? request.content : valueHeader);
-        if (!db.write("INSERT OR REPLACE INTO cache ( name, value ) "
-                      "VALUES( " +
-                      SQ(name) + ", " + safeValue + " );"))
+        // Insert the new entry. A compressed value is bound as a BLOB, which is how we know to unzip it. The expiry
+        // time is worked out here, so every node stores the same one.
+        const int64_t expires = request.isSet("ttl") ? _nowSeconds() + request.calc64("ttl") : 0;
+        if (!db.write("INSERT OR REPLACE INTO cache ( name, value, expires ) VALUES( ?, ?, " + SQ(expires) + " );",
+                      {name, *value}, compressed.empty() ? set<size_t>() : set<size_t>{1}))
             STHROW("502 Query failed (inserting)");
 
         // Writing is a form of "use", so this is the new MRU.  Note that we're
@@ -271,7 +615,55 @@ bool BedrockPlugin_Cache::processCommand(SQLite& db, BedrockCommand& command) {
         return true; // Successfully processed
     }
 
+    // ----------------------------------------------------------------------
+    else if (SIEquals(request.getVerb(), "ExpireCache")) {
+        // - ExpireCache()
+        //
+        //     Deletes up to -cache.expireBatchSize entries whose ttl has passed. The master queues this on a timer,
+        //     and sooner while there's a backlog.
+        //
+        //     Returns:
+        //     - expired - The number of entries deleted
+        //
+        SQResult result;
+        if (!db.read("SELECT name FROM cache WHERE expires > 0 AND expires <= " + SQ(_nowSeconds()) + " "
+                     "LIMIT " + SQ(_expireBatchSize) + ";",
+                     result)) {
+            STHROW("502 Query failed");
+        }
+        list<string> names;
+        for (const auto& row : result.rows) {
+            names.push_back(row[0]);
+        }
+        if (!names.empty() && !db.write("DELETE FROM cache WHERE name IN (" + SQList(names) + ");")) {
+            STHROW("502 Query failed (expiring)");
+        }
+        for (const string& name : names) {
+            _lruMap.erase(name);
+        }
+        SINFO("Expired " << names.size() << " cache entries.");
+
+        // Come back sooner if there's more to do.
+        _expireTimer.alarmDuration = (int64_t)names.size() < _expireBatchSize ? EXPIRE_INTERVAL : EXPIRE_BACKLOG_INTERVAL;
+        command.response["expired"] = SToStr(names.size());
+        return true;
+    }
+
     // Didn't recognize this command
     return false;
 }
 
+// ==========================================================================
+void BedrockPlugin_Cache::timerFired(SStopwatch* timer) {
+    if (timer != &_expireTimer) {
+        return;
+    }
+
+    // Like any other write, expiring goes through the command queue at low priority, and only the master queues it.
+    if (_server && !_server->isShuttingDown() && _server->getState() == SQLiteNode::MASTERING) {
+        SQLiteCommand command(SData("ExpireCache"));
+        command.request["priority"] = SToStr(BedrockCommand::PRIORITY_LOW);
+        command.initiatingClientID = -1;
+        _server->acceptCommand(move(command), true);
+    }
+}
@@ -1,4 +1,6 @@
 #include <libstuff/libstuff.h>
+#include <deque>
+#include <unordered_map>
 #include "../BedrockPlugin.h"
 
 // Declare the class we're going to implement below
@@ -14,9 +16,15 @@ class BedrockPlugin_Cache : public BedrockPlugin {
     virtual void upgradeDatabase(SQLite& db);
     virtual bool peekCommand(SQLite& db, BedrockCommand& command);
     virtual bool processCommand(SQLite& db, BedrockCommand& command);
+    virtual list<string> getWarmUpQueries();
+    virtual bool shouldCoalescePeek(const BedrockCommand& command);
+    virtual void timerFired(SStopwatch* timer);
 
   private:
-    // Bedrock Cache LRU map
+    // Bedrock Cache LRU map. This tracks which names have been used most recently, so we know which to evict when the
+    // cache is full. It's approximated with the CLOCK algorithm, split into shards by a hash of the name: marking a
+    // name that's already tracked as used only sets a flag under a shared lock, so the workers doing it on every read
+    // don't serialize on each other, and don't allocate.
     class LRUMap {
       public:
         // Constructor / Destructor
@@ -29,25 +37,119 @@ class BedrockPlugin_Cache : public BedrockPlugin {
         // Mark a name as being the most recently used (MRU)
         void pushMRU(const string& name);
 
-        // Remove the name that is the least recently used (LRU)
+        // Stop tracking a name, if we are
+        void erase(const string& name);
+
+        // Returns up to `maxNames` names that have been used since the clock hand last passed them.
+        list<string> getRecentlyUsed(size_t maxNames);
+
+        // Remove the name that is the least recently used (LRU), or return an empty string if there isn't one. This is
+        // approximate: each call takes a name from the next shard in turn, the first one its clock hand finds that
+        // hasn't been used since the hand last passed it.
         string popLRU();
 
       private:
-        // A single entry being tracked
-        struct Entry {
-            // Attributes
+        static const size_t SHARDS = 16;
+
+        // A single entry being tracked. Slots are reused once they're freed.
+        struct Slot {
             string name;
-            list<Entry*>::iterator listIt;
-            map<string, Entry*>::iterator mapIt;
+            atomic<bool> used{false};
+            bool inUse = false;
         };
+        struct Shard {
+            shared_timed_mutex shardMutex;
+            deque<Slot> slots;
+            unordered_map<string, size_t> slotsByName;
+            vector<size_t> freeSlots;
+            size_t hand = 0;
+        };
+
+        // Evicts the next entry found by a shard's clock hand. Caller holds the shard's unique lock.
+        string _evict(Shard& shard);
+
+        // Frees a slot, returning the name it held. Caller holds the shard's unique lock.
+        string _free(Shard& shard, size_t index);
 
         // Attributes
-        recursive_mutex _mutex;
-        list<Entry*> _lruList;
-        map<string, Entry*> _lruMap;
+        Shard _shards[SHARDS];
+        atomic<size_t> _size{0};
+        atomic<size_t> _nextShard{0};
+    };
+
+    // Values recently read, kept in memory so that an exact-name ReadCache doesn't need to touch the database
+    // (`-cache.memory`, off by default). It's split into shards by a hash of the name, each with its own lock, hash map
+    // and LRU list, and is kept in step with the `cache` table by a commit listener that drops any entry whose row
+    // changes, or whose name is written again.
+    class MemoryTier {
+      public:
+        // Sets the most the tier can hold, in bytes of names and values. 0 disables it.
+        void setMaxSize(size_t maxSize) { _maxShardSize = maxSize / SHARDS; }
+        bool enabled() const { return _maxShardSize; }
+
+        // Looks up a value by exact name, marking it as the most recently used if it's found. `compressed` is set if
+        // the value is stored gzipped. A value that has expired is dropped instead.
+        bool get(const string& name, string& value, bool& compressed);
+
+        // Returns a token to pass to `put`, taken before reading the value from the database.
+        uint64_t getEpoch() const { return _epoch.load(); }
+
+        // Adds a value read from the database at `rowID`, which expires at `expires` (0 for never). If anything in the
+        // cache table has been committed since `epoch` was taken, the value may already be out of date, so it isn't
+        // added.
+        void put(const string& name, int64_t rowID, const string& value, bool compressed, int64_t expires,
+                 uint64_t epoch);
+
+        // Called with the rows that have changed when a transaction is committed (or nullptr if they all might have).
+        // Entries are dropped both by rowid and by the names in the changed rows, which are read from `db`.
+        void onCommitted(SQLite& db, const set<int64_t>* rowIDs);
+
+      private:
+        static const size_t SHARDS = 16;
+        struct Entry {
+            string name;
+            string value;
+            int64_t rowID;
+            bool compressed;
+            int64_t expires;
+        };
+        struct Shard {
+            mutex shardMutex;
+            list<Entry> lru; // Most recently used first.
+            unordered_map<string, list<Entry>::iterator> byName;
+            unordered_map<int64_t, list<Entry>::iterator> byRowID;
+            size_t size = 0;
+        };
+
+        Shard& _getShard(const string& name) { return _shards[hash<string>()(name) % SHARDS]; }
+
+        // Removes an entry from its shard. Caller holds the shard's lock.
+        void _erase(Shard& shard, list<Entry>::iterator it);
+
+        Shard _shards[SHARDS];
+        size_t _maxShardSize = 0;
+        atomic<uint64_t> _epoch{0};
     };
 
     // Constants
     const int64_t _maxCacheSize;
+
+    // Values bigger than this are stored gzipped, as BLOBs, where that makes them smaller (`-cache.compressAbove`, 0
+    // disables it). Uncompressed values are stored as text, so the type of a value tells us which it is.
+    int64_t _compressAbove = 0;
+
+    // How many recently used names are read to warm up the page cache, see `getWarmUpQueries`.
+    static const size_t CACHE_WARM_UP_NAMES = 1000;
+
+    // Entries written with a `ttl` are deleted by ExpireCache once they've expired, which `_expireTimer` queues every
+    // EXPIRE_INTERVAL, or every EXPIRE_BACKLOG_INTERVAL while each pass finds a full batch. Until then, reads skip them.
+    static constexpr uint64_t EXPIRE_INTERVAL = 60 * STIME_US_PER_S;
+    static constexpr uint64_t EXPIRE_BACKLOG_INTERVAL = STIME_US_PER_S;
+    int64_t _expireBatchSize = 1000;
+    SStopwatch _expireTimer{EXPIRE_INTERVAL};
+
     LRUMap _lruMap;
+    MemoryTier _memoryTier;
+    BedrockServer* _server = nullptr;
+    bool _listening = false;
 };
@@ -3,6 +3,36 @@
 #undef SLOGPREFIX
 #define SLOGPREFIX "{" << _args["-nodeName"] << ":" << getName() << "} "
 
+void BedrockPlugin_DB::initialize(const SData& args, BedrockServer& server) {
+    _args = args;
+
+    // We can be initialized more than once, but should only listen for commits to each table once.
+    for (const string& table : SParseList(args["-db.merkleTables"])) {
+        if (_merkleTrees.count(table)) {
+            continue;
+        }
+        SINFO("Keeping a Merkle tree over '" << table << "'");
+        SQLiteMerkleTree* tree = new SQLiteMerkleTree(table);
+        _merkleTrees[table].reset(tree);
+        SQLite::addCommitListener(table, [tree](SQLite& db, const set<int64_t>* rowIDs) {
+            tree->invalidate(rowIDs, db.getCommitCount());
+        });
+    }
+}
+
+bool BedrockPlugin_DB::shouldCachePeek(const BedrockCommand& command) {
+    // Only the caller knows whether its queries depend on anything besides the database (i.e., the time), so it has to
+    // ask for caching.
+    const string verb = command.request.getVerb();
+    return (SIEquals(verb, "Query") || SIEquals(verb, "QueryBatch")) && command.request.test("cacheable");
+}
+
+bool BedrockPlugin_DB::shouldCoalescePeek(const BedrockCommand& command) {
+    // Identical queries at the same moment get the same answer, whatever they depend on.
+    const string verb = command.request.getVerb();
+    return SIEquals(verb, "Query") || SIEquals(verb, "QueryBatch");
+}
+
 bool BedrockPlugin_DB::peekCommand(SQLite& db, BedrockCommand& command) {
     // Pull out some helpful variables
     SData& request = command.request;
@@ -72,12 +102,14 @@ bool BedrockPlugin_DB::peekCommand(SQLite& db, BedrockCommand& command) {
             return false;
         }
 
-        // Attempt the read-only query
-        SQResult result;
+        // Attempt the read-only query, writing the result straight into the response in whatever format was asked
+        // for, rather than collecting it all first and then serializing a second copy.
+        SQResultWriter output(request["Format"], response.content);
         int preChangeCount = db.getChangeCount();
-        if (!db.read(query, result)) {
+        if (!db.read(query, output)) {
             // Query failed
             SALERT("Query failed: '" << query << "'");
+            response.content.clear();
             response["error"] = db.getLastError();
             STHROW("502 Query failed");
         }
@@ -93,9 +125,88 @@ bool BedrockPlugin_DB::peekCommand(SQLite& db, BedrockCommand& command) {
                    << "and must be recovered from backup or peer.  Offending query: '" << query << "'");
         }
 
-        // Worked!  What format do we want the output?
-        response.content = result.serialize(request["Format"]);
+        // Worked!
+        output.finish();
         return true; // Successfully peeked
+    } else if (SIEquals(request.getVerb(), "QueryBatch")) {
+        // - QueryBatch( queries, query0, query1, ..., [format] )
+        //
+        //     Runs several read-only queries in the same snapshot, appending each result to the content in turn.
+        //     Each result's size is returned as "query<N>Size", and if a query fails, its error is returned as
+        //     "query<N>Error" rather than failing the others.
+        //
+        const int queries = request.calc("queries");
+        if (queries < 1 || queries > MAX_QUERY_BATCH) {
+            STHROW("402 Invalid queries");
+        }
+        for (int i = 0; i < queries; i++) {
+            const string name = "query" + SToStr(i);
+            verifyAttributeSize(request, name, 1, MAX_SIZE_QUERY);
+            const string& upperQuery = SToUpper(STrim(request[name]));
+            if (!SStartsWith(upperQuery, "SELECT ") || !SEndsWith(upperQuery, ";")) {
+                SALERT("Batch aborted, '" << request[name] << "' isn't a read-only query.");
+                STHROW("502 Query aborted");
+            }
+        }
+
+        int preChangeCount = db.getChangeCount();
+        for (int i = 0; i < queries; i++) {
+            const string name = "query" + SToStr(i);
+            const size_t start = response.content.size();
+            SQResultWriter output(request["format"], response.content);
+            if (db.read(request[name], output)) {
+                output.finish();
+            } else {
+                SINFO("Query " << i << " in batch failed: '" << request[name] << "'");
+                output.reset();
+                response[name + "Error"] = db.getLastError();
+            }
+            response[name + "Size"] = SToStr(response.content.size() - start);
+        }
+        if (preChangeCount != db.getChangeCount()) {
+            SERROR("Read query actually managed to write; database is corrupt "
+                   << "and must be recovered from backup or peer.  Offending batch: '" << request.serialize() << "'");
+        }
+        return true;
+    } else if (SIEquals(request.getVerb(), "GetTableHashes")) {
+        // - GetTableHashes( table, [level, index] )
+        //
+        //     Returns the hash of one node of the Merkle tree over `table`, which needs to be in `-db.merkleTables`,
+        //     and the hash of each of its children as a JSON object in the content, by index. Without `level` and
+        //     `index`, this is the root. Asking two peers at the same "commitCount" for the same node, and then for
+        //     each child whose hashes differ, finds the rows that differ between them with one request per level.
+        //     At level 0, "firstRowID" and "lastRowID" are the rows that differ.
+        //
+        verifyAttributeSize(request, "table", 1, MAX_SIZE_SMALL);
+        auto it = _merkleTrees.find(request["table"]);
+        if (it == _merkleTrees.end()) {
+            STHROW("404 No Merkle tree for table");
+        }
+        const int level = request.isSet("level") ? request.calc("level") : -1;
+        if (request.isSet("level") && (level < 0 || !request.isSet("index"))) {
+            STHROW("402 Invalid level");
+        }
+        SQLiteMerkleTree::Node node;
+        if (!it->second->getNode(db, level, request.calcU64("index"), node)) {
+            STHROW("503 Couldn't hash table, try again");
+        }
+        if (node.level > max(node.height, 0)) {
+            STHROW("402 Invalid level");
+        }
+        const pair<int64_t, int64_t> range = SQLiteMerkleTree::getRange(node.level, node.index);
+        response["commitCount"] = SToStr(node.commitCount);
+        response["height"] = SToStr(node.height);
+        response["level"] = SToStr(node.level);
+        response["index"] = SToStr(node.index);
+        response["hash"] = node.hash;
+        response["firstRowID"] = SToStr(range.first);
+        response["lastRowID"] = SToStr(range.second);
+        STable children;
+        for (const auto& child : node.children) {
+            children[SToStr(child.first)] = child.second;
+        }
+        response.content = SComposeJSONObject(children);
+        return true;
     }
 
     // Didn't recognize this command
@@ -1,15 +1,25 @@
 #include <libstuff/libstuff.h>
 #include "../BedrockPlugin.h"
+#include <sqlitecluster/SQLiteMerkleTree.h>
 
 // Declare the class we're going to implement below
 class BedrockPlugin_DB : public BedrockPlugin {
   public:
+    // The most queries a single QueryBatch can run.
+    static constexpr int MAX_QUERY_BATCH = 100;
+
     virtual string getName() { return "DB"; }
-    virtual void initialize(const SData& args, BedrockServer& server) { _args = args; }
+    virtual void initialize(const SData& args, BedrockServer& server);
     virtual bool peekCommand(SQLite& db, BedrockCommand& command);
     virtual bool processCommand(SQLite& db, BedrockCommand& command);
+    virtual bool shouldCachePeek(const BedrockCommand& command);
+    virtual bool shouldCoalescePeek(const BedrockCommand& command);
 
   private:
     // Attributes
     SData _args;
+
+    // A Merkle tree over each table in `-db.merkleTables`, kept up to date by a commit listener on it, for
+    // `GetTableHashes`. These are created once, and never removed, as the listeners have no way to be.
+    map<string, unique_ptr<SQLiteMerkleTree>> _merkleTrees;
 };
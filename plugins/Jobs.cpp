@@ -1,10 +1,17 @@
 #include "Jobs.h"
+#include "../BedrockServer.h"
 
 #undef SLOGPREFIX
 #define SLOGPREFIX "{" << getName() << "} "
 
 #define JOBS_DEFAULT_PRIORITY 500
 
+// How long a GetJob(s) with "Connection: wait" waits for a job if it doesn't specify a timeout.
+#define JOBS_DEFAULT_WAIT_MS 30'000
+
+// How many of the next jobs to run in each shard get read to warm up the page cache, see `getWarmUpQueries`.
+#define JOBS_WARM_UP_JOBS 1000
+
 // Disable noop mode for the lifetime of this object.
 class scopedDisableNoopMode {
   public:
@@ -26,33 +33,256 @@ class scopedDisableNoopMode {
 
 // ==========================================================================
 void BedrockPlugin_Jobs::upgradeDatabase(SQLite& db) {
-    // Create or verify the jobs table
+    // Create or verify the jobs table for each shard
     bool ignore;
-    SASSERT(db.verifyTable("jobs",
-                           "CREATE TABLE jobs ( "
-                               "created     TIMESTAMP NOT NULL, "
-                               "jobID       INTEGER NOT NULL PRIMARY KEY, "
-                               "state       TEXT NOT NULL, "
-                               "name        TEXT NOT NULL, "
-                               "nextRun     TIMESTAMP NOT NULL, "
-                               "lastRun     TIMESTAMP, "
-                               "repeat      TEXT NOT NULL, "
-                               "data        TEXT NOT NULL, "
-                               "priority    INTEGER NOT NULL DEFAULT " + SToStr(JOBS_DEFAULT_PRIORITY) + ", "
-                               "parentJobID INTEGER NOT NULL DEFAULT 0, "
-                               "retryAfter  TEXT NOT NULL DEFAULT \"\")",
+    for (int shard = 0; shard < _shardCount; shard++) {
+        const string table = _getJobsTable(shard);
+        SASSERT(db.verifyTable(table,
+                               "CREATE TABLE " + table + " ( "
+                                   "created     TIMESTAMP NOT NULL, "
+                                   "jobID       INTEGER NOT NULL PRIMARY KEY, "
+                                   "state       TEXT NOT NULL, "
+                                   "name        TEXT NOT NULL, "
+                                   "nextRun     TIMESTAMP NOT NULL, "
+                                   "lastRun     TIMESTAMP, "
+                                   "repeat      TEXT NOT NULL, "
+                                   "data        TEXT NOT NULL, "
+                                   "priority    INTEGER NOT NULL DEFAULT " + SToStr(JOBS_DEFAULT_PRIORITY) + ", "
+                                   "parentJobID INTEGER NOT NULL DEFAULT 0, "
+                                   "retryAfter  TEXT NOT NULL DEFAULT \"\")",
+                               ignore));
+
+        // These indexes are not used by the Bedrock::Jobs plugin, but provided for easy analysis
+        // using the Bedrock::DB plugin.
+        SASSERT(db.write("CREATE INDEX IF NOT EXISTS " + table + "Name     ON " + table + " ( name     );"));
+        SASSERT(db.write("CREATE INDEX IF NOT EXISTS " + table + "ParentJobIDState ON " + table + " ( parentJobID, state ) WHERE parentJobID IS NOT NULL;"));
+        SASSERT(db.write("CREATE INDEX IF NOT EXISTS " + table + "StatePriorityNextRunName ON " + table + " ( state, priority, nextRun, name );"));
+    }
+
+    // Keep a count of each parent's children in each state, so finishing or resuming a parent doesn't have to look
+    // through them. Each jobs table has triggers that update it, so it stays right whatever writes to the jobs (even
+    // the DB plugin). Rows are removed once a parent has no children left.
+    SASSERT(db.verifyTable("jobChildCounts",
+                           "CREATE TABLE jobChildCounts ( "
+                               "parentJobID INTEGER NOT NULL PRIMARY KEY, "
+                               "pending     INTEGER NOT NULL DEFAULT 0, "
+                               "paused      INTEGER NOT NULL DEFAULT 0, "
+                               "finished    INTEGER NOT NULL DEFAULT 0, "
+                               "cancelled   INTEGER NOT NULL DEFAULT 0)",
                            ignore));
+    auto countChild = [](const string& row, const string& sign) {
+        return "UPDATE jobChildCounts SET "
+                   "pending = pending " + sign + " (" + row + ".state IN ('QUEUED', 'RUNQUEUED', 'RUNNING')), "
+                   "paused = paused " + sign + " (" + row + ".state = 'PAUSED'), "
+                   "finished = finished " + sign + " (" + row + ".state = 'FINISHED'), "
+                   "cancelled = cancelled " + sign + " (" + row + ".state = 'CANCELLED') "
+               "WHERE parentJobID = " + row + ".parentJobID; ";
+    };
+    const string addParent = "INSERT OR IGNORE INTO jobChildCounts ( parentJobID ) "
+                             "SELECT NEW.parentJobID WHERE NEW.parentJobID != 0; ";
+    const string removeParent = "DELETE FROM jobChildCounts WHERE parentJobID = OLD.parentJobID "
+                                "AND pending = 0 AND paused = 0 AND finished = 0 AND cancelled = 0; ";
+    bool rebuildChildCounts = false;
+    for (int shard = 0; shard < _shardCount; shard++) {
+        const string table = _getJobsTable(shard);
+        if (db.read("SELECT 1 FROM sqlite_master WHERE type='trigger' AND name=" + SQ(table + "ChildCountsOnUpdate") + ";").empty()) {
+            rebuildChildCounts = true;
+        }
+        SASSERT(db.write("CREATE TRIGGER IF NOT EXISTS " + table + "ChildCountsOnInsert AFTER INSERT ON " + table + " "
+                         "WHEN NEW.parentJobID != 0 "
+                         "BEGIN " + addParent + countChild("NEW", "+") + "END;"));
+        SASSERT(db.write("CREATE TRIGGER IF NOT EXISTS " + table + "ChildCountsOnDelete AFTER DELETE ON " + table + " "
+                         "WHEN OLD.parentJobID != 0 "
+                         "BEGIN " + countChild("OLD", "-") + removeParent + "END;"));
+        SASSERT(db.write("CREATE TRIGGER IF NOT EXISTS " + table + "ChildCountsOnUpdate AFTER UPDATE OF state, parentJobID ON " + table + " "
+                         "WHEN OLD.parentJobID != 0 OR NEW.parentJobID != 0 "
+                         "BEGIN " + countChild("OLD", "-") + removeParent + addParent + countChild("NEW", "+") + "END;"));
+    }
 
-    // These indexes are not used by the Bedrock::Jobs plugin, but provided for easy analysis
-    // using the Bedrock::DB plugin.
-    SASSERT(db.write("CREATE INDEX IF NOT EXISTS jobsName     ON jobs ( name     );"));
-    SASSERT(db.write("CREATE INDEX IF NOT EXISTS jobsParentJobIDState ON jobs ( parentJobID, state ) WHERE parentJobID IS NOT NULL;"));
-    SASSERT(db.write("CREATE INDEX IF NOT EXISTS jobsStatePriorityNextRunName ON jobs ( state, priority, nextRun, name );"));
+    // Purged jobs are moved here, if we're archiving them. It has the same columns as the jobs tables, but no indexes,
+    // as nothing reads it but people looking into old jobs.
+    if (_archivePurged) {
+        SASSERT(db.verifyTable("jobsArchive",
+                               "CREATE TABLE jobsArchive ( "
+                                   "created     TIMESTAMP NOT NULL, "
+                                   "jobID       INTEGER NOT NULL PRIMARY KEY, "
+                                   "state       TEXT NOT NULL, "
+                                   "name        TEXT NOT NULL, "
+                                   "nextRun     TIMESTAMP NOT NULL, "
+                                   "lastRun     TIMESTAMP, "
+                                   "repeat      TEXT NOT NULL, "
+                                   "data        TEXT NOT NULL, "
+                                   "priority    INTEGER NOT NULL DEFAULT " + SToStr(JOBS_DEFAULT_PRIORITY) + ", "
+                                   "parentJobID INTEGER NOT NULL DEFAULT 0, "
+                                   "retryAfter  TEXT NOT NULL DEFAULT \"\")",
+                               ignore));
+    }
 
-    SQResult nextIDResult;
-    db.read("SELECT MAX(jobID) FROM jobs;", nextIDResult);
-    lastJobID = nextIDResult.empty() ? 1 : SToInt64(nextIDResult[0][0]);
-    SINFO("Initializing jobs plugin, last jobID used is " << SToStr(lastJobID));
+    // If the shard layout has changed, some jobs will be in the wrong table. Move them to the right one, and drop the
+    // tables of any shards we no longer have once they're empty.
+    SQResult shardTables;
+    SASSERT(db.read("SELECT name FROM sqlite_master WHERE type='table' AND name GLOB 'jobs_[0-9]*';", shardTables));
+    map<int, string> tables = {{0, "jobs"}};
+    for (const auto& row : shardTables.rows) {
+        tables[SToInt(row[0].substr(5))] = row[0];
+    }
+    for (const auto& table : tables) {
+        SQResult names;
+        SASSERT(db.read("SELECT DISTINCT name FROM " + table.second + ";", names));
+        map<int, list<string>> misplaced;
+        for (const auto& row : names.rows) {
+            const int shard = _getShard(row[0]);
+            if (shard != table.first) {
+                misplaced[shard].push_back(row[0]);
+            }
+        }
+        for (const auto& names : misplaced) {
+            SINFO("Moving jobs named " << SComposeList(names.second) << " from " << table.second << " to "
+                  << _getJobsTable(names.first));
+            const string where = " WHERE name IN (" + SQList(names.second) + ");";
+            SASSERT(db.write("INSERT INTO " + _getJobsTable(names.first) + " SELECT * FROM " + table.second + where));
+            SASSERT(db.write("DELETE FROM " + table.second + where));
+        }
+        if (table.first >= _shardCount) {
+            SINFO("Dropping " << table.second << ", which is no longer a shard.");
+            SASSERT(db.write("DROP TABLE " + table.second + ";"));
+        }
+    }
+
+    // The first time a table gets its triggers, count the children it already has.
+    if (rebuildChildCounts) {
+        SINFO("Counting child jobs.");
+        SASSERT(db.write("DELETE FROM jobChildCounts;"));
+        SASSERT(db.write("INSERT INTO jobChildCounts "
+                         "SELECT parentJobID, "
+                             "SUM(state IN ('QUEUED', 'RUNQUEUED', 'RUNNING')), "
+                             "SUM(state = 'PAUSED'), "
+                             "SUM(state = 'FINISHED'), "
+                             "SUM(state = 'CANCELLED') "
+                         "FROM " + _getJobsSource(_getAllShards()) + " "
+                         "WHERE parentJobID != 0 "
+                         "GROUP BY parentJobID;"));
+    }
+
+    int64_t maxJobID = 0;
+    for (int shard = 0; shard < _shardCount; shard++) {
+        maxJobID = max(maxJobID, SToInt64(db.read("SELECT MAX(jobID) FROM " + _getJobsTable(shard) + ";")));
+    }
+    lastJobID = maxJobID / _shardCount;
+    SINFO("Initializing jobs plugin, last jobID used is " << SToStr(maxJobID));
+}
+
+// ==========================================================================
+void BedrockPlugin_Jobs::initialize(const SData& args, BedrockServer& server) {
+    // We hand held commands back to whichever server we were last initialized with.
+    _server = &server;
+    timers.insert(&_waiterTimer);
+
+    // Read the shard layout
+    _shardCount = max(args.calc("-jobs.shards"), 1);
+    _shardMap.clear();
+    for (const string& entry : SParseList(args["-jobs.shardMap"])) {
+        const size_t colon = entry.rfind(':');
+        const int shard = colon == string::npos ? -1 : SToInt(entry.substr(colon + 1));
+        if (shard < 0 || shard >= _shardCount) {
+            SERROR("Invalid -jobs.shardMap entry '" << entry << "' for " << _shardCount << " shards, aborting.");
+        }
+        _shardMap[entry.substr(0, colon)] = shard;
+    }
+    if (_shardCount > 1) {
+        SINFO("Splitting jobs across " << _shardCount << " tables, " << _shardMap.size() << " names mapped explicitly.");
+    }
+
+    // Read the retention policy for finished jobs
+    _retentionHours = max(args.calc("-jobs.retentionHours"), 0);
+    _purgeBatchSize = args.isSet("-jobs.purgeBatchSize") ? max(args.calc("-jobs.purgeBatchSize"), 1) : 1000;
+    _archivePurged = args.test("-jobs.archive");
+    if (_retentionHours) {
+        SINFO((_archivePurged ? "Archiving" : "Deleting") << " finished jobs after " << _retentionHours << " hours, "
+              << _purgeBatchSize << " at a time.");
+        timers.insert(&_purgeTimer);
+    }
+
+    // We can be initialized more than once, but should only listen for commits once.
+    if (!_listening) {
+        _listening = true;
+        for (int shard = 0; shard < _shardCount; shard++) {
+            SQLite::addCommitListener(_getJobsTable(shard), [this, shard](SQLite& db, const set<int64_t>* jobIDs) {
+                _onJobsCommitted(db, shard, jobIDs);
+            });
+        }
+    }
+}
+
+// ==========================================================================
+int BedrockPlugin_Jobs::_getShard(const string& name) const {
+    if (_shardCount == 1) {
+        return 0;
+    }
+    auto it = _shardMap.find(name);
+    if (it != _shardMap.end()) {
+        return it->second;
+    }
+
+    // This has to put a name in the same place on every node and every version, so we can't use std::hash. This is
+    // 32-bit FNV-1a.
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : name) {
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash % _shardCount;
+}
+
+// ==========================================================================
+set<int> BedrockPlugin_Jobs::_getShards(const string& name, const list<string>& nameList) const {
+    if (nameList.size() > 1 || name.find_first_of("*?[") == string::npos) {
+        set<int> shards;
+        for (const string& jobName : (nameList.size() > 1 ? nameList : list<string>{name})) {
+            shards.insert(_getShard(jobName));
+        }
+        return shards;
+    }
+    return _getAllShards();
+}
+
+// ==========================================================================
+set<int> BedrockPlugin_Jobs::_getAllShards() const {
+    set<int> shards;
+    for (int shard = 0; shard < _shardCount; shard++) {
+        shards.insert(shard);
+    }
+    return shards;
+}
+
+// ==========================================================================
+string BedrockPlugin_Jobs::_getJobsSource(const set<int>& shards) const {
+    if (shards.size() == 1) {
+        return _getJobsTable(*shards.begin());
+    }
+    list<string> selects;
+    for (int shard : shards) {
+        selects.push_back("SELECT * FROM " + _getJobsTable(shard));
+    }
+    return "(" + SComposeList(selects, " UNION ALL ") + ")";
+}
+
+// ==========================================================================
+string BedrockPlugin_Jobs::_findJobsTable(SQLite& db, int64_t jobID) {
+    const int expected = ((jobID % _shardCount) + _shardCount) % _shardCount;
+    if (_shardCount == 1) {
+        return _getJobsTable(expected);
+    }
+    for (int i = 0; i < _shardCount; i++) {
+        const string table = _getJobsTable((expected + i) % _shardCount);
+        SQResult result;
+        if (!db.read("SELECT 1 FROM " + table + " WHERE jobID=" + SQ(jobID) + ";", result)) {
+            STHROW("502 Select failed");
+        }
+        if (!result.empty()) {
+            return table;
+        }
+    }
+    return _getJobsTable(expected);
 }
 
 // ==========================================================================
@@ -83,7 +313,7 @@ bool BedrockPlugin_Jobs::peekCommand(SQLite& db, BedrockCommand& command) {
         //     - name - list of name patterns of jobs to match. If only one name is passed, you can use '*' to match any job.
         //     - numResults - maximum number of jobs to dequeue
         //     - connection - (optional) If "wait" will pause up to "timeout" for a match
-        //     - timeout - (optional) maximum time (in ms) to wait, default forever
+        //     - timeout - (optional) maximum time (in ms) to wait, default 30s
         //
         //     Returns:
         //     - 200 - OK
@@ -109,15 +339,20 @@ bool BedrockPlugin_Jobs::peekCommand(SQLite& db, BedrockCommand& command) {
         SQResult result;
         const list<string> nameList = SParseList(request["name"]);
         bool mockRequest = command.request.isSet("mockRequest") || command.request.isSet("getMockedJobs");
-        if (!db.read("SELECT 1 "
-                     "FROM jobs "
-                     "WHERE state in ('QUEUED', 'RUNQUEUED') "
-                        "AND priority IN (0, 500, 1000) "
-                        "AND " + SCURRENT_TIMESTAMP() + ">=nextRun "
-                        "AND name " + (nameList.size() > 1 ? "IN (" + SQList(nameList) + ")" : "GLOB " + SQ(request["name"])) + " " + 
-                        string(!mockRequest ? " AND JSON_EXTRACT(data, '$.mockRequest') IS NULL " : "") +
-                     "LIMIT 1;",
-                     result)) {
+        list<string> readyJobIDs;
+        if (_getReadyJobIDs(request["name"], nameList, mockRequest, 1, readyJobIDs)) {
+            if (!readyJobIDs.empty()) {
+                result.rows.push_back({"1"});
+            }
+        } else if (!db.read("SELECT 1 "
+                            "FROM " + _getJobsSource(_getShards(request["name"], nameList)) + " "
+                            "WHERE state in ('QUEUED', 'RUNQUEUED') "
+                               "AND priority IN (0, 500, 1000) "
+                               "AND ?>=nextRun "
+                               "AND name " + (nameList.size() > 1 ? "IN (" + SQList(nameList) + ")" : "GLOB " + SQ(request["name"])) + " " +
+                               string(!mockRequest ? " AND JSON_EXTRACT(data, '$.mockRequest') IS NULL " : "") +
+                            "LIMIT 1;",
+                            {SCurrentTimeString()}, result)) {
             STHROW("502 Query failed");
         }
 
@@ -128,7 +363,7 @@ bool BedrockPlugin_Jobs::peekCommand(SQLite& db, BedrockCommand& command) {
             // job.
             if (SIEquals(request["Connection"], "wait")) {
                 // Place a hold on this request waiting for new jobs in this
-                // state.
+                // state. `holdCommand` takes it from here.
                 SINFO("No results found and 'Connection: wait'; placing request on hold until we get a new job "
                       "matching name '"
                       << request["name"] << "'");
@@ -172,7 +407,7 @@ bool BedrockPlugin_Jobs::peekCommand(SQLite& db, BedrockCommand& command) {
         // Verify there is a job like this
         SQResult result;
         if (!db.read("SELECT created, jobID, state, name, nextRun, lastRun, repeat, data "
-                     "FROM jobs "
+                     "FROM " + _findJobsTable(db, request.calc64("jobID")) + " "
                      "WHERE jobID=" + SQ(request.calc64("jobID")) + ";",
                      result)) {
             STHROW("502 Select failed");
@@ -260,7 +495,7 @@ bool BedrockPlugin_Jobs::peekCommand(SQLite& db, BedrockCommand& command) {
             if (parentJobID) {
                 SINFO("parentJobID passed, checking existing job with ID " << parentJobID);
                 SQResult result;
-                if (!db.read("SELECT state, retryAfter, data FROM jobs WHERE jobID=" + SQ(parentJobID) + ";", result)) {
+                if (!db.read("SELECT state, retryAfter, data FROM " + _findJobsTable(db, parentJobID) + " WHERE jobID=" + SQ(parentJobID) + ";", result)) {
                     STHROW("502 Select failed");
                 }
                 if (result.empty()) {
@@ -298,7 +533,7 @@ bool BedrockPlugin_Jobs::peekCommand(SQLite& db, BedrockCommand& command) {
                       << (command.request.isSet("mockRequest") ? "true" : "false"));
                 string operation = command.request.isSet("mockRequest") ? "IS NOT" : "IS";
                 if (!db.read("SELECT jobID, data "
-                             "FROM jobs "
+                             "FROM " + _getJobsTable(_getShard(job["name"])) + " "
                              "WHERE name=" + SQ(job["name"]) +
                              "  AND JSON_EXTRACT(data, '$.mockRequest') " + operation + " NULL;",
                              result)) {
@@ -336,8 +571,8 @@ bool BedrockPlugin_Jobs::peekCommand(SQLite& db, BedrockCommand& command) {
 
         SQResult result;
         if (!db.read("SELECT j.state, GROUP_CONCAT(jj.jobID), j.parentJobID "
-                     "FROM jobs j "
-                     "LEFT JOIN jobs jj ON jj.parentJobID = j.jobID "
+                     "FROM " + _findJobsTable(db, jobID) + " j "
+                     "LEFT JOIN " + _getJobsSource(_getAllShards()) + " jj ON jj.parentJobID = j.jobID "
                      "WHERE j.jobID=" + SQ(jobID) + " "
                      "GROUP BY j.jobID;",
                      result)) {
@@ -478,7 +713,7 @@ bool BedrockPlugin_Jobs::processCommand(SQLite& db, BedrockCommand& command) {
                       << (command.request.isSet("mockRequest") ? "true" : "false"));
                 string operation = command.request.isSet("mockRequest") ? "IS NOT" : "IS";
                 if (!db.read("SELECT jobID, data "
-                             "FROM jobs "
+                             "FROM " + _getJobsTable(_getShard(job["name"])) + " "
                              "WHERE name=" + SQ(job["name"]) +
                              "  AND JSON_EXTRACT(data, '$.mockRequest') " + operation + " NULL;",
                              result)) {
@@ -542,7 +777,7 @@ bool BedrockPlugin_Jobs::processCommand(SQLite& db, BedrockCommand& command) {
             int64_t parentJobID = SContains(job, "parentJobID") ? SToInt(job["parentJobID"]) : 0;
             if (parentJobID) {
                 SQResult result;
-                if (!db.read("SELECT state, parentJobID, data FROM jobs WHERE jobID=" + SQ(parentJobID) + ";", result)) {
+                if (!db.read("SELECT state, parentJobID, data FROM " + _findJobsTable(db, parentJobID) + " WHERE jobID=" + SQ(parentJobID) + ";", result)) {
                     STHROW("502 Select failed");
                 }
                 if (result.empty()) {
@@ -567,9 +802,10 @@ bool BedrockPlugin_Jobs::processCommand(SQLite& db, BedrockCommand& command) {
             }
 
             // Are we creating a new job, or updating an existing job?
+            const int shard = _getShard(job["name"]);
             if (updateJobID) {
                 // Update the existing job.
-                if(!db.writeIdempotent("UPDATE jobs SET "
+                if(!db.writeIdempotent("UPDATE " + _getJobsTable(shard) + " SET "
                                          "repeat   = " + SQ(SToUpper(job["repeat"])) + ", " +
                                          "data     = JSON_PATCH(data, " + safeData + "), " +
                                          "priority = " + SQ(priority) + " " +
@@ -594,7 +830,7 @@ bool BedrockPlugin_Jobs::processCommand(SQLite& db, BedrockCommand& command) {
                 // in the QUEUED state.
                 auto initialState = "QUEUED";
                 if (parentJobID) {
-                    auto parentState = db.read("SELECT state FROM jobs WHERE jobID=" + SQ(parentJobID) + ";");
+                    auto parentState = db.read("SELECT state FROM " + _findJobsTable(db, parentJobID) + " WHERE jobID=" + SQ(parentJobID) + ";");
                     if (SIEquals(parentState, "RUNNING")) {
                         initialState = "PAUSED";
                     }
@@ -604,9 +840,9 @@ bool BedrockPlugin_Jobs::processCommand(SQLite& db, BedrockCommand& command) {
                 const string& safeRetryAfter = SContains(job, "retryAfter") && !job["retryAfter"].empty() ? SQ(job["retryAfter"]) : SQ("");
 
                 // Create this new job with a new generated ID
-                const int jobIDToUse = ++lastJobID;
+                const int64_t jobIDToUse = _allocateJobID(shard);
                 SINFO("Next jobID to be used " << jobIDToUse);
-                if (!db.writeIdempotent("INSERT INTO jobs ( jobID, created, state, name, nextRun, repeat, data, priority, parentJobID, retryAfter ) "
+                if (!db.writeIdempotent("INSERT INTO " + _getJobsTable(shard) + " ( jobID, created, state, name, nextRun, repeat, data, priority, parentJobID, retryAfter ) "
                          "VALUES( " +
                             SQ(jobIDToUse) + ", " +
                             SCURRENT_TIMESTAMP() + ", " +
@@ -635,9 +871,7 @@ bool BedrockPlugin_Jobs::processCommand(SQLite& db, BedrockCommand& command) {
 
         content["jobIDs"] = SComposeJSONArray(jobIDs);
 
-        // Release workers waiting on this state
-        // TODO: No "HeldBy" anymore. If a plugin wants to hold a command, it should own it until it's done.
-        // node->clearCommandHolds("Jobs:" + request["name"]);
+        // Anyone waiting on these jobs is woken when they're committed, by `_onJobsCommitted`.
 
         return true; // Successfully processed
     }
@@ -645,54 +879,74 @@ bool BedrockPlugin_Jobs::processCommand(SQLite& db, BedrockCommand& command) {
     // ----------------------------------------------------------------------
     else if (SIEquals(requestVerb, "GetJob") || SIEquals(requestVerb, "GetJobs")) {
         // If we're here it's because peekCommand found some data; re-execute
-        // the query for real now.  However, this time we will order by
+        // the query for real now.  If the ready job index is available, it
+        // gives us the candidates directly.  Otherwise, we order by
         // priority.  We do this as three separate queries so we only have one
         // unbounded column in each query.  Additionally, we wrap each inner
         // query in a "SELECT *" such that we can have an "ORDER BY" and
         // "LIMIT" *before* we UNION ALL them together.  Looks gnarly, but it
         // works!
-        SQResult result;
+        SQTypedResult result;
         const list<string> nameList = SParseList(request["name"]);
         string safeNumResults = SQ(max(request.calc("numResults"),1));
         bool mockRequest = command.request.isSet("mockRequest") || command.request.isSet("getMockedJobs");
-        string selectQuery =
-            "SELECT jobID, name, data, parentJobID, retryAfter, created FROM ( "
-                "SELECT * FROM ("
-                    "SELECT jobID, name, data, priority, parentJobID, retryAfter, created "
-                    "FROM jobs "
-                    "WHERE state IN ('QUEUED', 'RUNQUEUED') "
-                        "AND priority=1000 "
-                        "AND " + SCURRENT_TIMESTAMP() + ">=nextRun "
-                        "AND name " + (nameList.size() > 1 ? "IN (" + SQList(nameList) + ")" : "GLOB " + SQ(request["name"])) + " " +
-                        string(!mockRequest ? " AND JSON_EXTRACT(data, '$.mockRequest') IS NULL " : "") +
-                    "ORDER BY nextRun ASC LIMIT " + safeNumResults +
-                ") "
-            "UNION ALL "
-                "SELECT * FROM ("
-                    "SELECT jobID, name, data, priority, parentJobID, retryAfter, created "
-                    "FROM jobs "
-                    "WHERE state IN ('QUEUED', 'RUNQUEUED') "
-                        "AND priority=500 "
-                        "AND " + SCURRENT_TIMESTAMP() + ">=nextRun "
-                        "AND name " + (nameList.size() > 1 ? "IN (" + SQList(nameList) + ")" : "GLOB " + SQ(request["name"])) + " " +
-                        string(!mockRequest ? " AND JSON_EXTRACT(data, '$.mockRequest') IS NULL " : "") +
-                    "ORDER BY nextRun ASC LIMIT " + safeNumResults +
-                ") "
-            "UNION ALL "
-                "SELECT * FROM ("
-                    "SELECT jobID, name, data, priority, parentJobID, retryAfter, created "
-                    "FROM jobs "
-                    "WHERE state IN ('QUEUED', 'RUNQUEUED') "
-                        "AND priority=0 "
-                        "AND " + SCURRENT_TIMESTAMP() + ">=nextRun "
-                        "AND name " + (nameList.size() > 1 ? "IN (" + SQList(nameList) + ")" : "GLOB " + SQ(request["name"])) + " " +
+        list<string> readyJobIDs;
+        string selectQuery;
+        const string jobsSource = _getJobsSource(_getShards(request["name"], nameList));
+        if (_getReadyJobIDs(request["name"], nameList, mockRequest, max(request.calc("numResults"), 1), readyJobIDs)) {
+            // The index tells us which jobs to take, but it's as of the latest commit, not our transaction, so we make
+            // sure they're still runnable here.
+            if (!readyJobIDs.empty()) {
+                selectQuery =
+                    "SELECT jobID, name, data, parentJobID, retryAfter, created "
+                    "FROM " + jobsSource + " "
+                    "WHERE jobID IN (" + SQList(readyJobIDs) + ") "
+                        "AND state IN ('QUEUED', 'RUNQUEUED') "
+                        "AND priority IN (0, 500, 1000) "
+                        "AND " + SCURRENT_TIMESTAMP() + ">=nextRun " +
                         string(!mockRequest ? " AND JSON_EXTRACT(data, '$.mockRequest') IS NULL " : "") +
-                    "ORDER BY nextRun ASC LIMIT " + safeNumResults +
+                    "ORDER BY priority DESC, nextRun ASC;";
+            }
+        } else {
+            selectQuery =
+                "SELECT jobID, name, data, parentJobID, retryAfter, created FROM ( "
+                    "SELECT * FROM ("
+                        "SELECT jobID, name, data, priority, parentJobID, retryAfter, created "
+                        "FROM " + jobsSource + " "
+                        "WHERE state IN ('QUEUED', 'RUNQUEUED') "
+                            "AND priority=1000 "
+                            "AND " + SCURRENT_TIMESTAMP() + ">=nextRun "
+                            "AND name " + (nameList.size() > 1 ? "IN (" + SQList(nameList) + ")" : "GLOB " + SQ(request["name"])) + " " +
+                            string(!mockRequest ? " AND JSON_EXTRACT(data, '$.mockRequest') IS NULL " : "") +
+                        "ORDER BY nextRun ASC LIMIT " + safeNumResults +
+                    ") "
+                "UNION ALL "
+                    "SELECT * FROM ("
+                        "SELECT jobID, name, data, priority, parentJobID, retryAfter, created "
+                        "FROM " + jobsSource + " "
+                        "WHERE state IN ('QUEUED', 'RUNQUEUED') "
+                            "AND priority=500 "
+                            "AND " + SCURRENT_TIMESTAMP() + ">=nextRun "
+                            "AND name " + (nameList.size() > 1 ? "IN (" + SQList(nameList) + ")" : "GLOB " + SQ(request["name"])) + " " +
+                            string(!mockRequest ? " AND JSON_EXTRACT(data, '$.mockRequest') IS NULL " : "") +
+                        "ORDER BY nextRun ASC LIMIT " + safeNumResults +
+                    ") "
+                "UNION ALL "
+                    "SELECT * FROM ("
+                        "SELECT jobID, name, data, priority, parentJobID, retryAfter, created "
+                        "FROM " + jobsSource + " "
+                        "WHERE state IN ('QUEUED', 'RUNQUEUED') "
+                            "AND priority=0 "
+                            "AND " + SCURRENT_TIMESTAMP() + ">=nextRun "
+                            "AND name " + (nameList.size() > 1 ? "IN (" + SQList(nameList) + ")" : "GLOB " + SQ(request["name"])) + " " +
+                            string(!mockRequest ? " AND JSON_EXTRACT(data, '$.mockRequest') IS NULL " : "") +
+                        "ORDER BY nextRun ASC LIMIT " + safeNumResults +
+                    ") "
                 ") "
-            ") "
-            "ORDER BY priority DESC "
-            "LIMIT " + safeNumResults + ";";
-        if (!db.read(selectQuery, result)) {
+                "ORDER BY priority DESC "
+                "LIMIT " + safeNumResults + ";";
+        }
+        if (!selectQuery.empty() && !db.read(selectQuery, result)) {
             STHROW("502 Query failed");
         }
 
@@ -710,52 +964,99 @@ bool BedrockPlugin_Jobs::processCommand(SQLite& db, BedrockCommand& command) {
         // There should only be at most one result if GetJob
         SASSERT(!SIEquals(requestVerb, "GetJob") || result.size()<=1);
 
-        // Prepare to update the rows, while also creating all the child objects
-        list<string> nonRetriableJobs;
-        list<STable> retriableJobs;
+        // Look up the parents' data and the finished child jobs for every result at once, rather than with a query
+        // per job.
+        set<string> parentJobIDs;
+        list<string> resultJobIDs;
+        for (size_t c = 0; c < result.size(); ++c) {
+            if (result.getInt64(c, 3)) {
+                parentJobIDs.insert(result.getString(c, 3));
+            }
+            if (result.getString(c, 4).empty()) {
+                resultJobIDs.push_back(result.getString(c, 0));
+            }
+        }
+        map<string, string> parentData;
+        if (!parentJobIDs.empty()) {
+            SQResult parents;
+            if (!db.read("SELECT jobID, data FROM " + _getJobsSource(_getAllShards()) + " WHERE jobID IN (" + SQList(parentJobIDs) + ");", parents)) {
+                STHROW("502 Failed to select parent jobs");
+            }
+            for (const auto& row : parents.rows) {
+                parentData[row[0]] = row[1];
+            }
+        }
+        map<string, list<vector<string>>> childJobsByParent;
+        if (!resultJobIDs.empty()) {
+            // Most jobs aren't parents, so only look for the children of those that have some finished or cancelled.
+            SQResult parentsWithChildren;
+            if (!db.read("SELECT parentJobID FROM jobChildCounts "
+                         "WHERE parentJobID IN (" + SQList(resultJobIDs) + ") AND finished + cancelled > 0;",
+                         parentsWithChildren)) {
+                STHROW("502 Failed to select child job counts");
+            }
+            resultJobIDs.clear();
+            for (const auto& row : parentsWithChildren.rows) {
+                resultJobIDs.push_back(row[0]);
+            }
+        }
+        if (!resultJobIDs.empty()) {
+            SQResult childJobs;
+            if (!db.read("SELECT parentJobID, jobID, data, state FROM " + _getJobsSource(_getAllShards()) + " "
+                         "WHERE parentJobID IN (" + SQList(resultJobIDs) + ") AND state IN ('FINISHED', 'CANCELLED');",
+                         childJobs)) {
+                STHROW("502 Failed to select finished child jobs");
+            }
+            for (auto& row : childJobs.rows) {
+                childJobsByParent[row[0]].push_back(move(row));
+            }
+        }
+
+        // Prepare to update the rows, while also creating all the child objects. The jobs to update are grouped by the
+        // shard they're in.
+        map<int, list<string>> nonRetriableJobs;
+        map<int, list<string>> retriableJobs;
         list<string> jobList;
         for (size_t c=0; c<result.size(); ++c) {
-            SASSERT(result[c].size() == 6); // jobID, name, data, parentJobID, retryAfter, created
+            SASSERT(result.columns() == 6); // jobID, name, data, parentJobID, retryAfter, created
 
             // Add this object to our output
             STable job;
-            SINFO("Returning jobID " << result[c][0] << " from " << requestVerb);
-            job["jobID"] = result[c][0];
-            job["name"] = result[c][1];
-            job["data"] = result[c][2];
-            job["created"] = result[c][5];
-            int64_t parentJobID = SToInt64(result[c][3]);
+            const string jobID = result.getString(c, 0);
+            const string name = result.getString(c, 1);
+            SINFO("Returning jobID " << jobID << " from " << requestVerb);
+            job["jobID"] = jobID;
+            job["name"] = name;
+            job["data"] = result.getString(c, 2);
+            job["created"] = result.getString(c, 5);
+            int64_t parentJobID = result.getInt64(c, 3);
 
             if (parentJobID) {
                 // Has a parent job, add the parent data
                 job["parentJobID"] = SToStr(parentJobID);;
-                job["parentData"] = db.read("SELECT data FROM jobs WHERE jobID=" + SQ(parentJobID) + ";");
+                job["parentData"] = parentData[SToStr(parentJobID)];
             }
 
             // Add jobID to the respective list depending on if retryAfter is set
-            if (result[c][4] != "") {
-                job["retryAfter"] = result[c][4];
-                retriableJobs.push_back(job);
+            if (!result.getString(c, 4).empty()) {
+                job["retryAfter"] = result.getString(c, 4);
+                retriableJobs[_getShard(name)].push_back(jobID);
             } else {
-                nonRetriableJobs.push_back(result[c][0]);
+                nonRetriableJobs[_getShard(name)].push_back(jobID);
 
                 // Only non-retryable jobs can have children so see if this job has any
                 // FINISHED/CANCELLED child jobs, indicating it is being resumed
-                SQResult childJobs;
-                if (!db.read("SELECT jobID, data, state FROM jobs WHERE parentJobID=" + result[c][0] + " AND state IN ('FINISHED', 'CANCELLED');", childJobs)) {
-                    STHROW("502 Failed to select finished child jobs");
-                }
-
-                if (!childJobs.empty()) {
+                auto childJobs = childJobsByParent.find(jobID);
+                if (childJobs != childJobsByParent.end()) {
                     // Add associative arrays of all children depending on their states
                     list<string> finishedChildJobArray;
                     list<string> cancelledChildJobArray;
-                    for (auto row : childJobs.rows) {
+                    for (const auto& row : childJobs->second) {
                         STable childJob;
-                        childJob["jobID"] = row[0];
-                        childJob["data"] = row[1];
+                        childJob["jobID"] = row[1];
+                        childJob["data"] = row[2];
 
-                        if (row[2] ==  "FINISHED") {
+                        if (row[3] ==  "FINISHED") {
                             finishedChildJobArray.push_back(SComposeJSONObject(childJob));
                         } else {
                             cancelledChildJobArray.push_back(SComposeJSONObject(childJob));
@@ -770,29 +1071,29 @@ bool BedrockPlugin_Jobs::processCommand(SQLite& db, BedrockCommand& command) {
         }
 
         // Update jobs without retryAfter
-        if (!nonRetriableJobs.empty()) {
-            SINFO("Updating jobs without retryAfter " << SComposeList(nonRetriableJobs));
-            string updateQuery = "UPDATE jobs "
+        for (const auto& jobIDs : nonRetriableJobs) {
+            SINFO("Updating jobs without retryAfter " << SComposeList(jobIDs.second));
+            string updateQuery = "UPDATE " + _getJobsTable(jobIDs.first) + " "
                                  "SET state='RUNNING', "
                                      "lastRun=" + SCURRENT_TIMESTAMP() + " "
-                                 "WHERE jobID IN (" + SQList(nonRetriableJobs) + ");";
+                                 "WHERE jobID IN (" + SQList(jobIDs.second) + ");";
             if (!db.writeIdempotent(updateQuery)) {
                 STHROW("502 Update failed");
             }
         }
 
-        // Update jobs with retryAfter
-        if (!retriableJobs.empty()) {
-            SINFO("Updating jobs with retryAfter");
-            for (auto job : retriableJobs) {
-                string updateQuery = "UPDATE jobs "
-                                     "SET state='RUNQUEUED', "
-                                         "lastRun=" + SCURRENT_TIMESTAMP() + ", "
-                                         "nextRun=DATETIME(" + SCURRENT_TIMESTAMP() + ", " + SQ(job["retryAfter"]) + ") "
-                                     "WHERE jobID = " + SQ(job["jobID"]) + ";";
-                if (!db.writeIdempotent(updateQuery)) {
-                    STHROW("502 Update failed");
-                }
+        // Update jobs with retryAfter. Each job's own retryAfter column is used to compute its nextRun, so the whole
+        // batch is a single statement per shard no matter how many jobs were claimed. The jobIDs are listed explicitly so
+        // that the journaled query does exactly the same thing when it's replayed on peers.
+        for (const auto& jobIDs : retriableJobs) {
+            SINFO("Updating jobs with retryAfter " << SComposeList(jobIDs.second));
+            string updateQuery = "UPDATE " + _getJobsTable(jobIDs.first) + " "
+                                 "SET state='RUNQUEUED', "
+                                     "lastRun=" + SCURRENT_TIMESTAMP() + ", "
+                                     "nextRun=DATETIME(" + SCURRENT_TIMESTAMP() + ", retryAfter) "
+                                 "WHERE jobID IN (" + SQList(jobIDs.second) + ");";
+            if (!db.writeIdempotent(updateQuery)) {
+                STHROW("502 Update failed");
             }
         }
 
@@ -835,9 +1136,10 @@ bool BedrockPlugin_Jobs::processCommand(SQLite& db, BedrockCommand& command) {
         }
 
         // Verify there is a job like this
+        const string table = _findJobsTable(db, request.calc64("jobID"));
         SQResult result;
         if (!db.read("SELECT jobID, nextRun, lastRun "
-                     "FROM jobs "
+                     "FROM " + table + " "
                      "WHERE jobID=" + SQ(request.calc64("jobID")) + ";",
                      result)) {
             STHROW("502 Select failed");
@@ -853,7 +1155,7 @@ bool BedrockPlugin_Jobs::processCommand(SQLite& db, BedrockCommand& command) {
         const string& newNextRun = request.isSet("repeat") ? _constructNextRunDATETIME(nextRun, lastRun, request["repeat"]) : "";
 
         // Update the data
-        if (!db.writeIdempotent("UPDATE jobs "
+        if (!db.writeIdempotent("UPDATE " + table + " "
                                 "SET data=" +
                                 SQ(request["data"]) + " " +
                                 (request.isSet("repeat") ? ", repeat=" + SQ(SToUpper(request["repeat"])) : "") +
@@ -899,166 +1201,72 @@ bool BedrockPlugin_Jobs::processCommand(SQLite& db, BedrockCommand& command) {
         //     - data   - Data to associate with this finsihed job
         //
         verifyAttributeInt64(request, "jobID", 1);
-        int64_t jobID = request.calc64("jobID");
-
-        // Verify there is a job like this and it's running
-        SQResult result;
-        if (!db.read("SELECT state, nextRun, lastRun, repeat, parentJobID, json_extract(data, '$.mockRequest') "
-                     "FROM jobs "
-                     "WHERE jobID=" + SQ(jobID) + ";",
-                     result)) {
-            STHROW("502 Select failed");
-        }
-        if (result.empty()) {
-            STHROW("404 No job with this jobID");
-        }
-
-        const string& state = result[0][0];
-        const string& nextRun = result[0][1];
-        const string& lastRun = result[0][2];
-        string repeat = result[0][3];
-        int64_t parentJobID = SToInt(result[0][4]);
-        bool mockRequest = result[0][5] == "1";
-
-        // Make sure we're finishing a job that's actually running
-        if (state != "RUNNING" && state != "RUNQUEUED" && !mockRequest) {
-            SINFO("Trying to finish job#" << jobID << ", but isn't RUNNING or RUNQUEUED (" << state << ")");
-            STHROW("405 Can only retry/finish RUNNING and RUNQUEUED jobs");
-        }
-
-        // If we have a parent, make sure it is PAUSED.  This is to just
-        // double-check that child jobs aren't somehow running in parallel to
-        // the parent.
-        if (parentJobID) {
-            auto parentState = db.read("SELECT state FROM jobs WHERE jobID=" + SQ(parentJobID) + ";");
-            if (!SIEquals(parentState, "PAUSED")) {
-                SINFO("Trying to finish/retry job#" << jobID << ", but parent isn't PAUSED (" << parentState << ")");
-                STHROW("405 Can only retry/finish child job when parent is PAUSED");
-            }
-        }
-
-        // Delete any FINISHED/CANCELLED child jobs, but leave any PAUSED children alone (as those will signal that
-        // we just want to re-PAUSE this job so those new children can run)
-        if (!db.writeIdempotent("DELETE FROM jobs WHERE parentJobID=" + SQ(jobID) + " AND state IN ('FINISHED', 'CANCELLED');")) {
-            STHROW("502 Failed deleting finished/cancelled child jobs");
-        }
-
-        // If we've been asked to update the data, let's do that
-        auto data = request["data"];
-        if (!data.empty()) {
-            // See if the new data says it's mocked.
-            STable newData = SParseJSONObject(data);
-            bool newMocked = newData.find("mockRequest") != newData.end();
-
-            // If both sets of data don't match each other, this is an error, we don't know who to trust.
-            // We don't worry about the state of the request header for mockRequest here, as we expect that the Bedrock
-            // client won't always set it when finishing or retrying a job. We'll just use what's in the data.
-            if (mockRequest != newMocked) {
-                SWARN("Not updating mockRequest field of job data.");
-                STHROW("500 Mock Mismatch");
-            }
-
-            // Update the data to the new value.
-            if (!db.writeIdempotent("UPDATE jobs SET data=" + SQ(data) + " WHERE jobID=" + SQ(jobID) + ";")) {
-                STHROW("502 Failed to update job data");
-            }
-        }
-
-        // If we are finishing a job that has child jobs, set its state to paused.
-        if (SIEquals(requestVerb, "FinishJob") && _hasPendingChildJobs(db, jobID)) {
-            // Update the parent job to PAUSED
-            SINFO("Job has child jobs, PAUSING parent, QUEUING children");
-            if (!db.writeIdempotent("UPDATE jobs SET state='PAUSED' WHERE jobID=" + SQ(jobID) + ";")) {
-                STHROW("502 Parent update failed");
-            }
+        _finishOrRetryJob(db, SIEquals(requestVerb, "RetryJob"), request.calc64("jobID"), request);
 
-            // Also un-pause any child jobs such that they can run
-            if (!db.writeIdempotent("UPDATE jobs SET state='QUEUED' "
-                          "WHERE state='PAUSED' "
-                            "AND parentJobID=" + SQ(jobID) + ";")) {
-                STHROW("502 Child update failed");
-            }
-
-            // All done processing this command
-            return true;
-        }
+        // Successfully processed
+        return true;
+    }
 
-        // If this is RetryJob and we want to update the name, let's do that
-        const string& name = request["name"];
-        if (!name.empty() && SIEquals(requestVerb, "RetryJob")) {
-            if (!db.writeIdempotent("UPDATE jobs SET name=" + SQ(name) + " WHERE jobID=" + SQ(jobID) + ";")) {
-                STHROW("502 Failed to update job name");
-            }
+    // ----------------------------------------------------------------------
+    else if (SIEquals(requestVerb, "RetryJobs") || SIEquals(requestVerb, "FinishJobs") ||
+             SIEquals(requestVerb, "DeleteJobs")) {
+        // - RetryJobs( jobs )
+        // - FinishJobs( jobs )
+        // - DeleteJobs( jobs )
+        //
+        //     Retries, finishes or deletes a list of jobs in one transaction, as though each had been passed to
+        //     RetryJob, FinishJob or DeleteJob in turn. A job that can't be retried, finished or deleted is left as it
+        //     was, and doesn't stop the others.
+        //
+        //     Parameters:
+        //     - jobs (json array): objects with the parameters RetryJob, FinishJob or DeleteJob takes for each job
+        //
+        //     Returns:
+        //     - results - array with an object for each job, in the order given, with its `jobID` and the `result`
+        //                 it would have got on its own (eg, "200 OK" or "404 No job with this jobID")
+        //
+        list<string> multipleJobs = SParseJSONArray(request["jobs"]);
+        if (multipleJobs.empty()) {
+            STHROW("401 Invalid JSON");
         }
-
-        string safeNewNextRun = "";
-        // If this is set to repeat, get the nextRun value
-        if (!repeat.empty()) {
-            safeNewNextRun = _constructNextRunDATETIME(nextRun, lastRun, repeat);
-        } else if (SIEquals(requestVerb, "RetryJob")) {
-            const string& newNextRun = request["nextRun"];
-
-            if (newNextRun.empty()) {
-                SINFO("nextRun isn't set, using delay");
-                int64_t delay = request.calc64("delay");
-                if (delay < 0) {
-                    STHROW("402 Must specify a non-negative delay when retrying");
-                }
-                repeat = "FINISHED, +" + SToStr(delay) + " SECONDS";
-                safeNewNextRun = _constructNextRunDATETIME(nextRun, lastRun, repeat);
-                if (safeNewNextRun.empty()) {
-                    STHROW("402 Malformed delay");
-                }
-            } else {
-                safeNewNextRun = SQ(newNextRun);
+        list<SData> jobRequests;
+        for (auto& job : multipleJobs) {
+            jobRequests.emplace_back();
+            jobRequests.back().nameValueMap = SParseJSONObject(job);
+            if (jobRequests.back().nameValueMap.empty()) {
+                STHROW("401 Invalid JSON");
             }
         }
 
-        // The job is set to be rescheduled.
-        if (!safeNewNextRun.empty()) {
-            // The "nextRun" at this point is still
-            // storing the last time this job was *scheduled* to be run;
-            // lastRun contains when it was *actually* run.
-            SINFO("Rescheduling job#" << jobID << ": " << safeNewNextRun);
-
-            // Update this job
-            if (!db.writeIdempotent("UPDATE jobs SET nextRun=" + safeNewNextRun + ", state='QUEUED' WHERE jobID=" + SQ(jobID) + ";")) {
-                STHROW("502 Update failed");
-            }
-        } else {
-            // We are done with this job.  What do we do with it?
-            SASSERT(!SIEquals(requestVerb, "RetryJob"));
-            if (parentJobID) {
-                // This is a child job.  Mark it as finished.
-                if (!db.writeIdempotent("UPDATE jobs SET state='FINISHED' WHERE jobID=" + SQ(jobID) + ";")) {
-                    STHROW("502 Failed to mark job as FINISHED");
-                }
-
-                // Resume the parent if this is the last pending child
-                if (!_hasPendingChildJobs(db, parentJobID)) {
-                    SINFO("Job has parentJobID: " + SToStr(parentJobID) +
-                          " and no other pending children, resuming parent job");
-                    if (!db.writeIdempotent("UPDATE jobs SET state='QUEUED' where jobID=" + SQ(parentJobID) + ";")) {
-                        STHROW("502 Update failed");
-                    }
-                }
-            } else {
-                // This is a standalone (not a child) job; delete it.
-                if (!db.writeIdempotent("DELETE FROM jobs WHERE jobID=" + SQ(jobID) + ";")) {
-                    STHROW("502 Delete failed");
+        vector<string> results;
+        for (auto& jobRequest : jobRequests) {
+            STable result;
+            result["jobID"] = jobRequest["jobID"];
+            try {
+                verifyAttributeInt64(jobRequest, "jobID", 1);
+                if (SIEquals(requestVerb, "DeleteJobs")) {
+                    _deleteJob(db, jobRequest.calc64("jobID"));
+                } else {
+                    _finishOrRetryJob(db, SIEquals(requestVerb, "RetryJobs"), jobRequest.calc64("jobID"), jobRequest);
                 }
-
-                // At this point, all child jobs should already be deleted, but
-                // let's double check.
-                if (!db.read("SELECT 1 FROM jobs WHERE parentJobID=" + SQ(jobID) + " LIMIT 1;").empty()) {
-                    SWARN("Child jobs still exist when deleting parent job, ignoring.");
+                result["result"] = "200 OK";
+            } catch (const SException& e) {
+                // A failed query can leave a job half done, so that fails the whole command. Anything else is
+                // thrown before the job is touched.
+                if (SStartsWith(e.method, "502")) {
+                    throw;
                 }
+                SINFO("Couldn't " << requestVerb << " job#" << jobRequest["jobID"] << ": " << e.method);
+                result["result"] = e.method;
             }
+            results.push_back(SComposeJSONObject(result));
         }
+        content["results"] = SComposeJSONArray(results);
 
         // Successfully processed
         return true;
     }
+
     // ----------------------------------------------------------------------
     else if (SIEquals(request.methodLine, "CancelJob")) {
         // - CancelJob (jobID)
@@ -1071,29 +1279,24 @@ bool BedrockPlugin_Jobs::processCommand(SQLite& db, BedrockCommand& command) {
         int64_t jobID = request.calc64("jobID");
 
         // Cancel the job
-        if (!db.writeIdempotent("UPDATE jobs SET state='CANCELLED' WHERE jobID=" + SQ(jobID) + ";")) {
+        const string table = _findJobsTable(db, jobID);
+        if (!db.writeIdempotent("UPDATE " + table + " SET state='CANCELLED' WHERE jobID=" + SQ(jobID) + ";")) {
             STHROW("502 Failed to update job data");
         }
 
         // If this was the last queued child, resume the parent
         SQResult result;
         if (!db.read("SELECT parentJobID "
-                     "FROM jobs "
+                     "FROM " + table + " "
                      "WHERE jobID=" + SQ(jobID) + ";",
                      result)) {
             STHROW("502 Select failed");
         }
-        const string& safeParentJobID = SQ(result[0][0]);
-        if (!db.read("SELECT count(1) "
-                     "FROM jobs "
-                     "WHERE parentJobID=" + safeParentJobID + " AND "
-                       "state IN ('QUEUED', 'RUNQUEUED', 'RUNNING');",
-                     result)) {
-            STHROW("502 Select failed");
-        }
-        if (SToInt(result[0][0]) == 0) {
+        const int64_t parentJobID = SToInt64(result[0][0]);
+        const string& safeParentJobID = SQ(parentJobID);
+        if (parentJobID && !_getChildJobCounts(db, parentJobID).pending) {
             SINFO("Cancelled last QUEUED child, resuming the parent: " << safeParentJobID);
-            if (!db.writeIdempotent("UPDATE jobs SET state='QUEUED' WHERE jobID=" + safeParentJobID + ";")) {
+            if (!db.writeIdempotent("UPDATE " + _findJobsTable(db, parentJobID) + " SET state='QUEUED' WHERE jobID=" + safeParentJobID + ";")) {
                 STHROW("502 Failed to update job data");
             }
         }
@@ -1116,9 +1319,10 @@ bool BedrockPlugin_Jobs::processCommand(SQLite& db, BedrockCommand& command) {
         verifyAttributeInt64(request, "jobID", 1);
 
         // Verify there is a job like this and it's running
+        const string table = _findJobsTable(db, request.calc64("jobID"));
         SQResult result;
         if (!db.read("SELECT state, nextRun, lastRun, repeat "
-                     "FROM jobs "
+                     "FROM " + table + " "
                      "WHERE jobID=" + SQ(request.calc64("jobID")) + ";",
                      result)) {
             STHROW("502 Select failed");
@@ -1145,7 +1349,7 @@ bool BedrockPlugin_Jobs::processCommand(SQLite& db, BedrockCommand& command) {
         updateList.push_back("state='FAILED'");
 
         // Update this job
-        if (!db.writeIdempotent("UPDATE jobs SET " + SComposeList(updateList) + "WHERE jobID=" + SQ(request.calc64("jobID")) + ";")) {
+        if (!db.writeIdempotent("UPDATE " + table + " SET " + SComposeList(updateList) + "WHERE jobID=" + SQ(request.calc64("jobID")) + ";")) {
             STHROW("502 Fail failed");
         }
 
@@ -1164,33 +1368,67 @@ bool BedrockPlugin_Jobs::processCommand(SQLite& db, BedrockCommand& command) {
         //     - jobID - ID of the job to delete
         //
         verifyAttributeInt64(request, "jobID", 1);
+        _deleteJob(db, request.calc64("jobID"));
 
-        // Verify there is a job like this and it's not running
-        SQResult result;
-        if (!db.read("SELECT state "
-                     "FROM jobs "
-                     "WHERE jobID=" + SQ(request.calc64("jobID")) + ";",
-                     result)) {
-            STHROW("502 Select failed");
-        }
-        if (result.empty()) {
-            STHROW("404 No job with this jobID");
-        }
-        if (result[0][0] == "RUNNING") {
-            STHROW("405 Can't delete a RUNNING job");
-        }
-        if (result[0][0] == "PAUSED") {
-            STHROW("405 Can't delete a parent jobs with children running");
-        }
+        // Successfully processed
+        return true;
+    }
 
-        // Delete the job
-        if (!db.writeIdempotent("DELETE FROM jobs "
-                      "WHERE jobID=" +
-                      SQ(request.calc64("jobID")) + ";")) {
-            STHROW("502 Delete failed");
+    // ----------------------------------------------------------------------
+    else if (SIEquals(requestVerb, "PurgeJobs")) {
+        // - PurgeJobs()
+        //
+        //     Deletes (or, with -jobs.archive, moves to `jobsArchive`) up to -jobs.purgeBatchSize FINISHED, CANCELLED
+        //     and FAILED jobs that haven't run in -jobs.retentionHours. Children are only purged once their parent is
+        //     gone, as a parent reads its finished children when it resumes. The master queues this on a timer, and
+        //     sooner while there's a backlog. Does nothing if -jobs.retentionHours isn't set.
+        //
+        //     Returns:
+        //     - purged - The number of jobs purged
+        //
+        list<string> jobIDs;
+        if (_retentionHours) {
+            const string cutoff = "DATETIME(" + SCURRENT_TIMESTAMP() + ", " + SQ("-" + SToStr(_retentionHours) + " HOURS") + ")";
+            list<string> noParent;
+            for (int shard : _getAllShards()) {
+                noParent.push_back("NOT EXISTS (SELECT 1 FROM " + _getJobsTable(shard) + " WHERE jobID = j.parentJobID)");
+            }
+            for (int shard : _getAllShards()) {
+                if ((int)jobIDs.size() >= _purgeBatchSize) {
+                    break;
+                }
+                const string table = _getJobsTable(shard);
+                SQResult result;
+                if (!db.read("SELECT jobID FROM " + table + " j "
+                             "WHERE state IN ('FINISHED', 'CANCELLED', 'FAILED') "
+                               "AND COALESCE(lastRun, created) < " + cutoff + " "
+                               "AND (parentJobID = 0 OR (" + SComposeList(noParent, " AND ") + ")) "
+                             "LIMIT " + SToStr(_purgeBatchSize - (int)jobIDs.size()) + ";",
+                             result)) {
+                    STHROW("502 Select failed");
+                }
+                if (result.empty()) {
+                    continue;
+                }
+                list<string> shardJobIDs;
+                for (const auto& row : result.rows) {
+                    shardJobIDs.push_back(row[0]);
+                }
+                const string where = " WHERE jobID IN (" + SQList(shardJobIDs) + ");";
+                if (_archivePurged && !db.writeIdempotent("INSERT OR REPLACE INTO jobsArchive SELECT * FROM " + table + where)) {
+                    STHROW("502 Failed to archive jobs");
+                }
+                if (!db.writeIdempotent("DELETE FROM " + table + where)) {
+                    STHROW("502 Failed to purge jobs");
+                }
+                jobIDs.splice(jobIDs.end(), shardJobIDs);
+            }
+            SINFO("Purged " << jobIDs.size() << " finished jobs.");
         }
 
-        // Successfully processed
+        // Come back sooner if there's more to do.
+        _purgeTimer.alarmDuration = (int)jobIDs.size() < _purgeBatchSize ? PURGE_INTERVAL : PURGE_BACKLOG_INTERVAL;
+        content["purged"] = SToStr(jobIDs.size());
         return true;
     }
 
@@ -1254,16 +1492,230 @@ string BedrockPlugin_Jobs::_constructNextRunDATETIME(const string& lastScheduled
 bool BedrockPlugin_Jobs::_hasPendingChildJobs(SQLite& db, int64_t jobID) {
     // Returns true if there are any children of this jobID in a "pending" (eg,
     // running or yet to run) state
+    const ChildJobCounts counts = _getChildJobCounts(db, jobID);
+    return counts.pending || counts.paused;
+}
+
+BedrockPlugin_Jobs::ChildJobCounts BedrockPlugin_Jobs::_getChildJobCounts(SQLite& db, int64_t jobID) {
     SQResult result;
-    if (!db.read("SELECT 1 "
-                 "FROM jobs "
-                 "WHERE parentJobID = " + SQ(jobID) + " " +
-                 " AND state IN ('QUEUED', 'RUNQUEUED', 'RUNNING', 'PAUSED') "
-                 "LIMIT 1;",
+    if (!db.read("SELECT pending, paused, finished, cancelled FROM jobChildCounts WHERE parentJobID = " + SQ(jobID) + ";",
                  result)) {
         STHROW("502 Select failed");
     }
-    return !result.empty();
+    ChildJobCounts counts;
+    if (!result.empty()) {
+        counts.pending = SToInt64(result[0][0]);
+        counts.paused = SToInt64(result[0][1]);
+        counts.finished = SToInt64(result[0][2]);
+        counts.cancelled = SToInt64(result[0][3]);
+    }
+    return counts;
+}
+
+void BedrockPlugin_Jobs::_finishOrRetryJob(SQLite& db, bool retry, int64_t jobID, const SData& request) {
+    // Verify there is a job like this and it's running
+    string table = _findJobsTable(db, jobID);
+    SQResult result;
+    if (!db.read("SELECT state, nextRun, lastRun, repeat, parentJobID, json_extract(data, '$.mockRequest') "
+                 "FROM " + table + " "
+                 "WHERE jobID=" + SQ(jobID) + ";",
+                 result)) {
+        STHROW("502 Select failed");
+    }
+    if (result.empty()) {
+        STHROW("404 No job with this jobID");
+    }
+
+    const string& state = result[0][0];
+    const string& nextRun = result[0][1];
+    const string& lastRun = result[0][2];
+    string repeat = result[0][3];
+    int64_t parentJobID = SToInt(result[0][4]);
+    bool mockRequest = result[0][5] == "1";
+
+    // Make sure we're finishing a job that's actually running
+    if (state != "RUNNING" && state != "RUNQUEUED" && !mockRequest) {
+        SINFO("Trying to finish job#" << jobID << ", but isn't RUNNING or RUNQUEUED (" << state << ")");
+        STHROW("405 Can only retry/finish RUNNING and RUNQUEUED jobs");
+    }
+
+    // If we have a parent, make sure it is PAUSED.  This is to just
+    // double-check that child jobs aren't somehow running in parallel to
+    // the parent.
+    const string parentTable = parentJobID ? _findJobsTable(db, parentJobID) : "";
+    if (parentJobID) {
+        auto parentState = db.read("SELECT state FROM " + parentTable + " WHERE jobID=" + SQ(parentJobID) + ";");
+        if (!SIEquals(parentState, "PAUSED")) {
+            SINFO("Trying to finish/retry job#" << jobID << ", but parent isn't PAUSED (" << parentState << ")");
+            STHROW("405 Can only retry/finish child job when parent is PAUSED");
+        }
+    }
+
+    // If we've been asked to update the data, make sure we can before changing anything.
+    const string& data = request["data"];
+    if (!data.empty()) {
+        // See if the new data says it's mocked.
+        STable newData = SParseJSONObject(data);
+        bool newMocked = newData.find("mockRequest") != newData.end();
+
+        // If both sets of data don't match each other, this is an error, we don't know who to trust.
+        // We don't worry about the state of the request header for mockRequest here, as we expect that the Bedrock
+        // client won't always set it when finishing or retrying a job. We'll just use what's in the data.
+        if (mockRequest != newMocked) {
+            SWARN("Not updating mockRequest field of job data.");
+            STHROW("500 Mock Mismatch");
+        }
+    }
+
+    string safeNewNextRun = "";
+    // If this is set to repeat, get the nextRun value
+    if (!repeat.empty()) {
+        safeNewNextRun = _constructNextRunDATETIME(nextRun, lastRun, repeat);
+    } else if (retry) {
+        const string& newNextRun = request["nextRun"];
+
+        if (newNextRun.empty()) {
+            SINFO("nextRun isn't set, using delay");
+            int64_t delay = request.calc64("delay");
+            if (delay < 0) {
+                STHROW("402 Must specify a non-negative delay when retrying");
+            }
+            repeat = "FINISHED, +" + SToStr(delay) + " SECONDS";
+            safeNewNextRun = _constructNextRunDATETIME(nextRun, lastRun, repeat);
+            if (safeNewNextRun.empty()) {
+                STHROW("402 Malformed delay");
+            }
+        } else {
+            safeNewNextRun = SQ(newNextRun);
+        }
+    }
+
+    // Everything that can reject this job has been checked, so from here on, anything thrown is a failed query.
+    // Delete any FINISHED/CANCELLED child jobs, but leave any PAUSED children alone (as those will signal that
+    // we just want to re-PAUSE this job so those new children can run). Children can be in any shard.
+    const ChildJobCounts childCounts = _getChildJobCounts(db, jobID);
+    if (childCounts.finished || childCounts.cancelled) {
+        for (int shard : _getAllShards()) {
+            if (!db.writeIdempotent("DELETE FROM " + _getJobsTable(shard) + " WHERE parentJobID=" + SQ(jobID) + " AND state IN ('FINISHED', 'CANCELLED');")) {
+                STHROW("502 Failed deleting finished/cancelled child jobs");
+            }
+        }
+    }
+
+    // Update the data to the new value.
+    if (!data.empty()) {
+        if (!db.writeIdempotent("UPDATE " + table + " SET data=" + SQ(data) + " WHERE jobID=" + SQ(jobID) + ";")) {
+            STHROW("502 Failed to update job data");
+        }
+    }
+
+    // If we are finishing a job that has child jobs, set its state to paused.
+    if (!retry && (childCounts.pending || childCounts.paused)) {
+        // Update the parent job to PAUSED
+        SINFO("Job has child jobs, PAUSING parent, QUEUING children");
+        if (!db.writeIdempotent("UPDATE " + table + " SET state='PAUSED' WHERE jobID=" + SQ(jobID) + ";")) {
+            STHROW("502 Parent update failed");
+        }
+
+        // Also un-pause any child jobs such that they can run
+        for (int shard : _getAllShards()) {
+            if (!db.writeIdempotent("UPDATE " + _getJobsTable(shard) + " SET state='QUEUED' "
+                          "WHERE state='PAUSED' "
+                            "AND parentJobID=" + SQ(jobID) + ";")) {
+                STHROW("502 Child update failed");
+            }
+        }
+
+        // All done with this job
+        return;
+    }
+
+    // If this is RetryJob and we want to update the name, let's do that
+    const string& name = request["name"];
+    if (!name.empty() && retry) {
+        // If the new name belongs in another shard, the job moves there.
+        const string newTable = _getJobsTable(_getShard(name));
+        if (newTable != table) {
+            if (!db.writeIdempotent("INSERT INTO " + newTable + " SELECT * FROM " + table + " WHERE jobID=" + SQ(jobID) + ";") ||
+                !db.writeIdempotent("DELETE FROM " + table + " WHERE jobID=" + SQ(jobID) + ";")) {
+                STHROW("502 Failed to move job");
+            }
+            table = newTable;
+        }
+        if (!db.writeIdempotent("UPDATE " + table + " SET name=" + SQ(name) + " WHERE jobID=" + SQ(jobID) + ";")) {
+            STHROW("502 Failed to update job name");
+        }
+    }
+
+    // The job is set to be rescheduled.
+    if (!safeNewNextRun.empty()) {
+        // The "nextRun" at this point is still
+        // storing the last time this job was *scheduled* to be run;
+        // lastRun contains when it was *actually* run.
+        SINFO("Rescheduling job#" << jobID << ": " << safeNewNextRun);
+
+        // Update this job
+        if (!db.writeIdempotent("UPDATE " + table + " SET nextRun=" + safeNewNextRun + ", state='QUEUED' WHERE jobID=" + SQ(jobID) + ";")) {
+            STHROW("502 Update failed");
+        }
+    } else {
+        // We are done with this job.  What do we do with it?
+        SASSERT(!retry);
+        if (parentJobID) {
+            // This is a child job.  Mark it as finished.
+            if (!db.writeIdempotent("UPDATE " + table + " SET state='FINISHED' WHERE jobID=" + SQ(jobID) + ";")) {
+                STHROW("502 Failed to mark job as FINISHED");
+            }
+
+            // Resume the parent if this is the last pending child
+            if (!_hasPendingChildJobs(db, parentJobID)) {
+                SINFO("Job has parentJobID: " + SToStr(parentJobID) +
+                      " and no other pending children, resuming parent job");
+                if (!db.writeIdempotent("UPDATE " + parentTable + " SET state='QUEUED' where jobID=" + SQ(parentJobID) + ";")) {
+                    STHROW("502 Update failed");
+                }
+            }
+        } else {
+            // This is a standalone (not a child) job; delete it.
+            if (!db.writeIdempotent("DELETE FROM " + table + " WHERE jobID=" + SQ(jobID) + ";")) {
+                STHROW("502 Delete failed");
+            }
+
+            // At this point, all child jobs should already be deleted, but
+            // let's double check.
+            if (!db.read("SELECT 1 FROM jobChildCounts WHERE parentJobID=" + SQ(jobID) + ";").empty()) {
+                SWARN("Child jobs still exist when deleting parent job, ignoring.");
+            }
+        }
+    }
+}
+
+void BedrockPlugin_Jobs::_deleteJob(SQLite& db, int64_t jobID) {
+    // Verify there is a job like this and it's not running
+    const string table = _findJobsTable(db, jobID);
+    SQResult result;
+    if (!db.read("SELECT state "
+                 "FROM " + table + " "
+                 "WHERE jobID=" + SQ(jobID) + ";",
+                 result)) {
+        STHROW("502 Select failed");
+    }
+    if (result.empty()) {
+        STHROW("404 No job with this jobID");
+    }
+    if (result[0][0] == "RUNNING") {
+        STHROW("405 Can't delete a RUNNING job");
+    }
+    if (result[0][0] == "PAUSED") {
+        STHROW("405 Can't delete a parent jobs with children running");
+    }
+
+    // Delete the job
+    if (!db.writeIdempotent("DELETE FROM " + table + " "
+                  "WHERE jobID=" +
+                  SQ(jobID) + ";")) {
+        STHROW("502 Delete failed");
+    }
 }
 
 bool BedrockPlugin_Jobs::_isValidSQLiteDateModifier(const string& modifier) {
@@ -1289,3 +1741,375 @@ bool BedrockPlugin_Jobs::_isValidSQLiteDateModifier(const string& modifier) {
     // Matched all parts, valid syntax
     return true;
 }
+
+// ==========================================================================
+// Converts a timestamp as stored in `jobs` to microseconds since the epoch, or 0 if it can't be parsed.
+static uint64_t _parseJobTimestamp(const string& timestamp) {
+    // A firstRun can be given as just a date.
+    struct tm time = {};
+    if (!strptime(timestamp.c_str(), "%Y-%m-%d %H:%M:%S", &time) && !strptime(timestamp.c_str(), "%Y-%m-%d", &time)) {
+        return 0;
+    }
+    return (uint64_t)timegm(&time) * STIME_US_PER_S;
+}
+
+// ==========================================================================
+void BedrockPlugin_Jobs::_onJobsCommitted(SQLite& db, int shard, const set<int64_t>* jobIDs) {
+    // When a snapshot is restored, every shard's listener is told, but the index only needs rebuilding once.
+    if (!jobIDs && shard) {
+        return;
+    }
+    auto readyJobsQuery = [this](int readShard) {
+        return "SELECT jobID, name, priority, nextRun, JSON_EXTRACT(data, '$.mockRequest') IS NOT NULL "
+               "FROM " + _getJobsTable(readShard) + " "
+               "WHERE state IN ('QUEUED', 'RUNQUEUED') "
+                 "AND priority IN (0, 500, 1000) ";
+    };
+    SQResult result;
+    const string now = SComposeTime("%Y-%m-%d %H:%M:%S", STimeNow());
+    {
+        unique_lock<decltype(_readyJobsMutex)> lock(_readyJobsMutex);
+        if (!jobIDs || !_readyJobsValid) {
+            // Build the whole index from scratch, this is served by each table's StatePriorityNextRunName index.
+            _readyJobsValid = false;
+            _readyJobsByID.clear();
+            _readyJobs.clear();
+            _upcomingJobs.clear();
+            uint64_t start = STimeNow();
+            for (int readShard : _getAllShards()) {
+                SQResult shardResult;
+                if (!db.read(readyJobsQuery(readShard) + ";", shardResult)) {
+                    SWARN("Couldn't read ready jobs, will try again at the next commit.");
+                    return;
+                }
+                _addReadyJobs(shardResult, readShard, now);
+                result.rows.insert(result.rows.end(), shardResult.rows.begin(), shardResult.rows.end());
+            }
+            _readyJobsValid = true;
+            SINFO("Built ready job index of " << result.size() << " jobs in " << ((STimeNow() - start) / 1000) << "ms.");
+        } else {
+            // Forget each job that changed in this shard, and then add back the ones that are still ready. A job that
+            // moved here from another shard in the same commit may already have been re-added by that shard's
+            // listener, so it's only forgotten if the index still has it here.
+            list<string> changedJobIDs;
+            for (int64_t jobID : *jobIDs) {
+                changedJobIDs.push_back(SToStr(jobID));
+                auto it = _readyJobsByID.find(jobID);
+                if (it != _readyJobsByID.end() && it->second.shard == shard) {
+                    _forgetReadyJob(jobID);
+                }
+            }
+            if (!db.read(readyJobsQuery(shard) + "AND jobID IN (" + SQList(changedJobIDs) + ");", result)) {
+                // We don't know what these jobs look like now, so the index can't be trusted until it's rebuilt.
+                SWARN("Couldn't read changed jobs, rebuilding ready job index at the next commit.");
+                _readyJobsValid = false;
+                return;
+            }
+            _addReadyJobs(result, shard, now);
+        }
+    }
+
+    // Let anyone waiting for these jobs know about the ones they can run now. The rest are in _upcomingJobs, and
+    // timerFired will tell them when they're due.
+    map<string, size_t> runnable;
+    for (const auto& row : result.rows) {
+        if (row[3] <= now) {
+            runnable[row[1]]++;
+        }
+    }
+    if (!runnable.empty()) {
+        _wakeWaiters(runnable);
+    }
+}
+
+// ==========================================================================
+void BedrockPlugin_Jobs::_addReadyJobs(const SQResult& result, int shard, const string& now) {
+    for (const auto& row : result.rows) {
+        const int64_t jobID = SToInt64(row[0]);
+        _forgetReadyJob(jobID);
+        ReadyJob job = {row[1], SToInt64(row[2]), row[3], row[4] == "1", shard};
+        _readyJobs[job.name][job.priority].emplace(job.nextRun, jobID);
+        if (job.nextRun > now) {
+            _upcomingJobs.emplace(_parseJobTimestamp(job.nextRun), jobID);
+        }
+        _readyJobsByID[jobID] = move(job);
+    }
+}
+
+// ==========================================================================
+void BedrockPlugin_Jobs::_forgetReadyJob(int64_t jobID) {
+    auto it = _readyJobsByID.find(jobID);
+    if (it == _readyJobsByID.end()) {
+        return;
+    }
+    auto byPriority = _readyJobs.find(it->second.name);
+    auto entries = byPriority->second.find(it->second.priority);
+    entries->second.erase(make_pair(it->second.nextRun, jobID));
+    _upcomingJobs.erase(make_pair(_parseJobTimestamp(it->second.nextRun), jobID));
+    if (entries->second.empty()) {
+        byPriority->second.erase(entries);
+        if (byPriority->second.empty()) {
+            _readyJobs.erase(byPriority);
+        }
+    }
+    _readyJobsByID.erase(it);
+}
+
+// ==========================================================================
+list<const BedrockPlugin_Jobs::ReadyJobsByPriority*> BedrockPlugin_Jobs::_matchReadyJobs(const string& name,
+                                                                                      const list<string>& nameList) {
+    // As with the query, a list of names is matched exactly, and a single name is a GLOB pattern.
+    list<const ReadyJobsByPriority*> matches;
+    if (nameList.size() > 1 || name.find_first_of("*?[") == string::npos) {
+        for (const string& jobName : (nameList.size() > 1 ? nameList : list<string>{name})) {
+            auto it = _readyJobs.find(jobName);
+            if (it != _readyJobs.end()) {
+                matches.push_back(&it->second);
+            }
+        }
+    } else {
+        for (const auto& entry : _readyJobs) {
+            if (!sqlite3_strglob(name.c_str(), entry.first.c_str())) {
+                matches.push_back(&entry.second);
+            }
+        }
+    }
+    return matches;
+}
+
+// ==========================================================================
+bool BedrockPlugin_Jobs::_getReadyJobIDs(const string& name, const list<string>& nameList, bool includeMocked,
+                                         size_t limit, list<string>& jobIDs) {
+    shared_lock<decltype(_readyJobsMutex)> lock(_readyJobsMutex);
+    if (!_readyJobsValid) {
+        return false;
+    }
+    const list<const ReadyJobsByPriority*> matches = _matchReadyJobs(name, nameList);
+
+    // Then, highest priority first, we take the earliest runnable jobs at that priority across all of the names.
+    const string now = SComposeTime("%Y-%m-%d %H:%M:%S", STimeNow());
+    for (int64_t priority : {1000, 500, 0}) {
+        const size_t remaining = limit - jobIDs.size();
+        vector<pair<string, int64_t>> candidates;
+        for (auto byPriority : matches) {
+            auto entries = byPriority->find(priority);
+            if (entries == byPriority->end()) {
+                continue;
+            }
+            size_t taken = 0;
+            for (const auto& entry : entries->second) {
+                if (taken == remaining || entry.first > now) {
+                    break;
+                }
+                if (includeMocked || !_readyJobsByID.at(entry.second).mocked) {
+                    candidates.push_back(entry);
+                    taken++;
+                }
+            }
+        }
+        sort(candidates.begin(), candidates.end());
+        for (size_t i = 0; i < candidates.size() && i < remaining; i++) {
+            jobIDs.push_back(SToStr(candidates[i].second));
+        }
+        if (jobIDs.size() == limit) {
+            break;
+        }
+    }
+    return true;
+}
+
+// ==========================================================================
+bool BedrockPlugin_Jobs::holdCommand(BedrockCommand& command) {
+    // Once we're shutting down, there's no point waiting for more work.
+    if (!_server || _server->isShuttingDown()) {
+        return false;
+    }
+    SData& request = command.request;
+    const list<string> nameList = SParseList(request["name"]);
+    const uint64_t now = STimeNow();
+
+    // A command can be held and woken several times before it finds a job, but its timeout counts from when it was
+    // first received.
+    const uint64_t timeoutMS = request.isSet("timeout") ? request.calcU64("timeout") : JOBS_DEFAULT_WAIT_MS;
+    const uint64_t deadline = command.creationTime + timeoutMS * STIME_US_PER_MS;
+    if (deadline <= now) {
+        command.response.methodLine = "303 Timeout";
+        command.complete = true;
+        _server->acceptCommand(move(command), true);
+        return true;
+    }
+    request.erase("HeldBy");
+
+    // We hold the waiters lock while we look for jobs, so that any job committed after we look can't be missed: its
+    // commit has to wait for the lock to wake us.
+    lock_guard<mutex> lock(_waitersMutex);
+    list<string> readyJobIDs;
+    const bool mockRequest = request.isSet("mockRequest") || request.isSet("getMockedJobs");
+    uint64_t nextCheck = deadline;
+    if (!_getReadyJobIDs(request["name"], nameList, mockRequest, 1, readyJobIDs)) {
+        // Without the index, all we can do is look again in a second.
+        nextCheck = min(deadline, now + STIME_US_PER_S);
+    } else if (!readyJobIDs.empty()) {
+        // A job was committed or came due since we peeked, and our transaction couldn't see it. Go look again.
+        SINFO("Job became available while placing hold on '" << request["name"] << "', re-queuing.");
+        _server->acceptCommand(move(command), true);
+        return true;
+    }
+
+    uint64_t waiterID = ++_lastWaiterID;
+    if (nameList.size() > 1 || request["name"].find_first_of("*?[") == string::npos) {
+        for (const string& name : (nameList.size() > 1 ? nameList : list<string>{request["name"]})) {
+            _waitersByName[name].push_back(waiterID);
+        }
+    } else {
+        _patternWaiters.push_back(waiterID);
+    }
+    _waiterChecks.emplace(nextCheck, waiterID);
+    _waiters.emplace(waiterID, Waiter{move(command), deadline, nextCheck});
+    SINFO("Holding waiter #" << waiterID << " for '" << request["name"] << "' for up to " << ((deadline - now) / 1000)
+          << "ms, " << _waiters.size() << " waiting.");
+    return true;
+}
+
+// ==========================================================================
+uint64_t BedrockPlugin_Jobs::_findWaiter(const string& jobName) {
+    // Waiters for this exact name are in the order they started waiting, so the first one is the earliest of those,
+    // but it may not be earlier than a pattern waiter.
+    uint64_t earliest = 0;
+    auto byName = _waitersByName.find(jobName);
+    if (byName != _waitersByName.end()) {
+        while (!byName->second.empty() && !_waiters.count(byName->second.front())) {
+            byName->second.pop_front();
+        }
+        if (byName->second.empty()) {
+            _waitersByName.erase(byName);
+        } else {
+            earliest = byName->second.front();
+        }
+    }
+    for (auto it = _patternWaiters.begin(); it != _patternWaiters.end();) {
+        auto waiter = _waiters.find(*it);
+        if (waiter == _waiters.end()) {
+            it = _patternWaiters.erase(it);
+            continue;
+        }
+        if (!sqlite3_strglob(waiter->second.command.request["name"].c_str(), jobName.c_str())) {
+            if (!earliest || *it < earliest) {
+                earliest = *it;
+            }
+            break;
+        }
+        it++;
+    }
+    return earliest;
+}
+
+// ==========================================================================
+BedrockCommand BedrockPlugin_Jobs::_removeWaiter(uint64_t waiterID) {
+    // This waiter's IDs in _waitersByName, _patternWaiters, and _waiterChecks are cleaned up as they're found.
+    auto it = _waiters.find(waiterID);
+    BedrockCommand command(move(it->second.command));
+    _waiters.erase(it);
+    return command;
+}
+
+// ==========================================================================
+void BedrockPlugin_Jobs::_wakeWaiters(const map<string, size_t>& runnable) {
+    list<BedrockCommand> woken;
+    {
+        lock_guard<mutex> lock(_waitersMutex);
+        if (_waiters.empty()) {
+            return;
+        }
+        for (const auto& job : runnable) {
+            for (size_t i = 0; i < job.second; i++) {
+                uint64_t waiterID = _findWaiter(job.first);
+                if (!waiterID) {
+                    break;
+                }
+                woken.push_back(_removeWaiter(waiterID));
+            }
+        }
+    }
+    for (auto& command : woken) {
+        SINFO("Waking waiter for '" << command.request["name"] << "'.");
+        _server->acceptCommand(move(command), true);
+    }
+}
+
+// ==========================================================================
+list<string> BedrockPlugin_Jobs::getWarmUpQueries() {
+    // The first thing a new master does is hand out the jobs that are due next, so those rows, and the index that
+    // finds them, are what we want to have in cache.
+    list<string> queries;
+    for (int shard = 0; shard < _shardCount; shard++) {
+        queries.push_back("SELECT jobID, name, data, priority, nextRun, parentJobID, retryAfter, created "
+                          "FROM " + _getJobsTable(shard) + " "
+                          "WHERE state IN ('QUEUED', 'RUNQUEUED') "
+                          "ORDER BY priority DESC, nextRun ASC "
+                          "LIMIT " + SToStr(JOBS_WARM_UP_JOBS) + ";");
+    }
+    return queries;
+}
+
+// ==========================================================================
+void BedrockPlugin_Jobs::timerFired(SStopwatch* timer) {
+    if (timer == &_purgeTimer) {
+        // Purging is a write like any other, so it goes through the command queue at low priority, where it waits
+        // its turn behind client commands, rather than taking the commit lock itself. Only the master queues it, so
+        // there's one purge at a time across the cluster.
+        if (_server && !_server->isShuttingDown() && _server->getState() == SQLiteNode::MASTERING) {
+            SQLiteCommand command(SData("PurgeJobs"));
+            command.request["priority"] = SToStr(BedrockCommand::PRIORITY_LOW);
+            command.initiatingClientID = -1;
+            _server->acceptCommand(move(command), true);
+        }
+        return;
+    }
+    if (timer != &_waiterTimer) {
+        return;
+    }
+
+    // Wake a waiter for each job that's come due since we last looked.
+    map<string, size_t> runnable;
+    {
+        unique_lock<decltype(_readyJobsMutex)> lock(_readyJobsMutex);
+        const uint64_t now = STimeNow();
+        while (!_upcomingJobs.empty() && _upcomingJobs.begin()->first <= now) {
+            runnable[_readyJobsByID.at(_upcomingJobs.begin()->second).name]++;
+            _upcomingJobs.erase(_upcomingJobs.begin());
+        }
+    }
+    if (!runnable.empty()) {
+        _wakeWaiters(runnable);
+    }
+
+    list<BedrockCommand> woken;
+    {
+        lock_guard<mutex> lock(_waitersMutex);
+        const uint64_t now = STimeNow();
+        const bool shuttingDown = _server && _server->isShuttingDown();
+        while (!_waiterChecks.empty() && (shuttingDown || _waiterChecks.begin()->first <= now)) {
+            const uint64_t checkTime = _waiterChecks.begin()->first;
+            const uint64_t waiterID = _waiterChecks.begin()->second;
+            _waiterChecks.erase(_waiterChecks.begin());
+            auto waiter = _waiters.find(waiterID);
+            if (waiter == _waiters.end()) {
+                // Already woken.
+                continue;
+            }
+            const bool timedOut = checkTime >= waiter->second.deadline;
+            woken.push_back(_removeWaiter(waiterID));
+            if (timedOut) {
+                woken.back().response.methodLine = "303 Timeout";
+                woken.back().complete = true;
+            }
+        }
+    }
+    for (auto& command : woken) {
+        if (command.complete) {
+            SINFO("Waiter for '" << command.request["name"] << "' timed out.");
+        }
+        _server->acceptCommand(move(command), true);
+    }
+}
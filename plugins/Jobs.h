@@ -6,16 +6,145 @@ class BedrockPlugin_Jobs : public BedrockPlugin {
   public:
     // Implement base class interface
     virtual string getName() { return "Jobs"; }
+    virtual void initialize(const SData& args, BedrockServer& server);
     virtual void upgradeDatabase(SQLite& db);
     virtual bool peekCommand(SQLite& db, BedrockCommand& command);
     virtual bool processCommand(SQLite& db, BedrockCommand& command);
+    virtual bool holdCommand(BedrockCommand& command);
+    virtual void timerFired(SStopwatch* timer);
+    virtual list<string> getWarmUpQueries();
 
   private:
+    // The last jobID sequence number used. See _allocateJobID.
     atomic<uint64_t> lastJobID;
 
+    // Jobs can be split across several tables (`-jobs.shards`, default 1), so that busy job names don't contend with
+    // quiet ones on the same pages. Each job lives in the table for its name: `-jobs.shardMap` can pin names to shards
+    // ("name:shard, ..."), and any other name is placed by a hash of it. Shard 0 is `jobs` itself, and any other shard
+    // N is `jobs_N`. Every node in a cluster must use the same layout. Changing it moves existing jobs to their new
+    // tables on the next upgradeDatabase.
+    int _shardCount = 1;
+    map<string, int> _shardMap;
+
+    // Returns the table for a shard, and the shard for a job name.
+    string _getJobsTable(int shard) const { return shard ? "jobs_" + SToStr(shard) : "jobs"; }
+    int _getShard(const string& name) const;
+
+    // Returns the shards that could hold jobs matching GetJob(s)' `name`: those of each name in a list, or all of them
+    // for a pattern.
+    set<int> _getShards(const string& name, const list<string>& nameList) const;
+    set<int> _getAllShards() const;
+
+    // Returns something that can be selected from to read the jobs in all of `shards`: the table itself for a single
+    // shard, or a UNION ALL of the tables.
+    string _getJobsSource(const set<int>& shards) const;
+
+    // Returns the table holding `jobID`. New jobIDs are allocated so that `jobID % _shardCount` is their shard, but
+    // jobs created under another layout keep their IDs when they move, so if it's not there, the other shards are
+    // checked too. If it's not anywhere, the table it would be in is returned.
+    string _findJobsTable(SQLite& db, int64_t jobID);
+
+    // Allocates a new jobID for a job in `shard`.
+    int64_t _allocateJobID(int shard) { return (int64_t)(++lastJobID) * _shardCount + shard; }
+
+    // An in-memory index of the jobs GetJob(s) can return (QUEUED or RUNQUEUED, with priority 0, 500 or 1000), by
+    // name, then priority, then (nextRun, jobID), so candidates can be found without scanning `jobs`. It's kept in step
+    // with the database by a commit listener on each jobs table, and built in full on the first commit after startup
+    // (or after a snapshot is restored). Until it's built, GetJob(s) query the jobs tables directly.
+    struct ReadyJob {
+        string name;
+        int64_t priority;
+        string nextRun;
+        bool mocked;
+        int shard;
+    };
+    shared_timed_mutex _readyJobsMutex;
+    bool _readyJobsValid = false;
+    bool _listening = false;
+    map<int64_t, ReadyJob> _readyJobsByID;
+    map<string, map<int64_t, set<pair<string, int64_t>>>> _readyJobs;
+
+    // Commit listener for the table of each shard, this updates the index above.
+    void _onJobsCommitted(SQLite& db, int shard, const set<int64_t>* jobIDs);
+
+    // Adds the jobs in `result` (jobID, name, priority, nextRun, mocked) read from `shard` to the index, replacing any
+    // existing entries for them. Those due after `now` are also added to _upcomingJobs. Caller holds the lock.
+    void _addReadyJobs(const SQResult& result, int shard, const string& now);
+
+    // Removes a job from the index, if it's there. Caller holds the lock.
+    void _forgetReadyJob(int64_t jobID);
+
+    // Returns the entries in the index for each job name matching GetJob(s)' `name`. Caller holds the lock.
+    typedef map<int64_t, set<pair<string, int64_t>>> ReadyJobsByPriority;
+    list<const ReadyJobsByPriority*> _matchReadyJobs(const string& name, const list<string>& nameList);
+
+    // Looks up to `limit` runnable jobs matching GetJob(s)' `name` in the index, in the order they should be returned.
+    // `nameList` is `name` parsed as a list. Returns false if the index isn't available yet.
+    bool _getReadyJobIDs(const string& name, const list<string>& nameList, bool includeMocked, size_t limit,
+                         list<string>& jobIDs);
+
+    // The jobs in the index that aren't due yet, as (nextRun, jobID), earliest first, kept in step with the index.
+    // timerFired takes them off as they come due and wakes a waiter for each, so a job scheduled for the future costs
+    // nothing until then, and nobody has to poll for it. Guarded by _readyJobsMutex.
+    set<pair<uint64_t, int64_t>> _upcomingJobs;
+
+    // GetJob(s) commands with "Connection: wait" that found nothing to do. Rather than being peeked over and over, they
+    // wait here, costing nothing, until a job they might take is committed or comes due, or they time out. Each waiter
+    // is checked at `nextCheck`: if that's its deadline, it's replied to with a timeout, otherwise (if the index wasn't
+    // available to say when to wake it) it's re-queued to peek again. Waiters asking for a list of names are found through `_waitersByName`, and those asking for a
+    // pattern through `_patternWaiters`; both are cleaned of waiters that have been removed as they're searched.
+    struct Waiter {
+        BedrockCommand command;
+        uint64_t deadline;
+        uint64_t nextCheck;
+    };
+    mutex _waitersMutex;
+    uint64_t _lastWaiterID = 0;
+    map<uint64_t, Waiter> _waiters;
+    map<string, list<uint64_t>> _waitersByName;
+    list<uint64_t> _patternWaiters;
+    multimap<uint64_t, uint64_t> _waiterChecks;
+    SStopwatch _waiterTimer{100 * STIME_US_PER_MS};
+    BedrockServer* _server = nullptr;
+
+    // Terminal jobs that haven't run for `_retentionHours` are purged by PurgeJobs, which `_purgeTimer` queues every
+    // PURGE_INTERVAL, or every PURGE_BACKLOG_INTERVAL while each purge finds a full batch. 0 hours disables this.
+    static constexpr uint64_t PURGE_INTERVAL = 60 * STIME_US_PER_S;
+    static constexpr uint64_t PURGE_BACKLOG_INTERVAL = STIME_US_PER_S;
+    int _retentionHours = 0;
+    int _purgeBatchSize = 1000;
+    bool _archivePurged = false;
+    SStopwatch _purgeTimer{PURGE_INTERVAL};
+
+    // Called with the number of jobs that have just become runnable, by name. Wakes one waiter for each of them.
+    void _wakeWaiters(const map<string, size_t>& runnable);
+
+    // Returns the ID of the earliest waiter that would take a job called `jobName`, or 0 if there isn't one. Caller
+    // holds _waitersMutex.
+    uint64_t _findWaiter(const string& jobName);
+
+    // Removes a waiter, returning its command. Caller holds _waitersMutex.
+    BedrockCommand _removeWaiter(uint64_t waiterID);
+
     // Helper functions
     string _constructNextRunDATETIME(const string& lastScheduled, const string& lastRun, const string& repeat);
     bool _validateRepeat(const string& repeat) { return !_constructNextRunDATETIME("", "", repeat).empty(); }
     bool _hasPendingChildJobs(SQLite& db, int64_t jobID);
+
+    // The number of children a job has in each state, from `jobChildCounts`, which triggers on each jobs table keep in
+    // step with every write to it. `pending` counts QUEUED, RUNQUEUED and RUNNING children.
+    struct ChildJobCounts {
+        int64_t pending = 0;
+        int64_t paused = 0;
+        int64_t finished = 0;
+        int64_t cancelled = 0;
+    };
+    ChildJobCounts _getChildJobCounts(SQLite& db, int64_t jobID);
+
+    // Carry out FinishJob (or RetryJob, if `retry`) or DeleteJob for one job, with the parameters in `request`. Each
+    // of these checks everything that could reject the job before changing anything, so if one throws anything but
+    // a 502 (a failed query), the job is untouched.
+    void _finishOrRetryJob(SQLite& db, bool retry, int64_t jobID, const SData& request);
+    void _deleteJob(SQLite& db, int64_t jobID);
     bool _isValidSQLiteDateModifier(const string& modifier);
 };
@@ -87,7 +87,8 @@ string MySQLPacket::serializeHandshake() {
     uint32_t CLIENT_LONG_PASSWORD = 0x00000001;
     uint32_t CLIENT_PROTOCOL_41   = 0x00000200;
     uint32_t CLIENT_PLUGIN_AUTH   = 0x00080000;
-    uint32_t capability_flags = CLIENT_LONG_PASSWORD | CLIENT_PROTOCOL_41 | CLIENT_PLUGIN_AUTH;
+    uint32_t capability_flags = CLIENT_LONG_PASSWORD | CLIENT_PROTOCOL_41 | CLIENT_PLUGIN_AUTH |
+                                MYSQL_CLIENT_MULTI_STATEMENTS | MYSQL_CLIENT_MULTI_RESULTS;
 
     uint16_t capability_flags_1 = (const unsigned short)(capability_flags);
     uint16_t capability_flags_2 = (const unsigned short)(capability_flags >> 16);
@@ -119,91 +120,307 @@ string MySQLPacket::serializeHandshake() {
     return handshake.serialize();
 }
 
-string MySQLPacket::serializeQueryResponse(int sequenceID, const SQResult& result) {
+// Starts a packet at the end of `out`, leaving room for its header, and returns where it starts.
+static size_t _startPacket(string& out) {
+    const size_t start = out.size();
+    out.append(4, '\0');
+    return start;
+}
+
+// Fills in the header of the packet started at `start`, now that its payload has been appended.
+static void _finishPacket(string& out, size_t start, uint8_t sequenceID) {
+    uint32_t payloadLength = out.size() - start - 4;
+    memcpy(&out[start], &payloadLength, 3);
+    out[start + 3] = sequenceID;
+}
+
+// Appends a MySQL length-encoded string without building it separately first.
+static void _appendLenEncStr(string& out, const char* value, size_t size) {
+    out += MySQLPacket::lenEncInt(size);
+    out.append(value, size);
+}
+
+// Appends a column definition packet.
+// See: https://dev.mysql.com/doc/internals/en/com-query-response.html#packet-Protocol::ColumnDefinition41
+static void _appendColumn(string& out, uint8_t sequenceID, const string& name, uint16_t characterSet,
+                          uint32_t length, uint8_t type, uint16_t flags, uint8_t decimals) {
+    const size_t start = _startPacket(out);
+    out += MySQLPacket::lenEncStr("def");     // catalog (lenenc_str) -- catalog (always "def")
+    out += MySQLPacket::lenEncStr("unknown"); // schema (lenenc_str) -- schema-name
+    out += MySQLPacket::lenEncStr("unknown"); // table (lenenc_str) -- virtual table-name
+    out += MySQLPacket::lenEncStr("unknown"); // org_table (lenenc_str) -- physical table-name
+    out += MySQLPacket::lenEncStr(name);      // name (lenenc_str) -- virtual column name
+    out += MySQLPacket::lenEncStr(name);      // org_name (lenenc_str) -- physical column name
+
+    uint8_t next_length = 0x0c;
+    SAppend(out, &next_length, 1);  // next_length (lenenc_int) -- length of the following fields (always 0x0c)
+    SAppend(out, &characterSet, 2); // character_set (2) -- is the column character set and is defined in Protocol::CharacterSet.
+    SAppend(out, &length, 4);       // column_length (4) -- maximum length of the field
+    SAppend(out, &type, 1);         // column_type (1) -- type of the column as defined in Column Type
+    SAppend(out, &flags, 2);        // flags (2) -- flags
+    SAppend(out, &decimals, 1);     // decimals (1) -- max shown decimal digits, 0x00 for integers and static strings
+    uint16_t filler = 0;
+    SAppend(out, &filler, 2);       // filler (to pad to 0x0c)
+    _finishPacket(out, start, sequenceID);
+}
+
+// Appends an EOF packet, which ends the column definitions, and then the rows, of a result set.
+static void _appendEOF(string& out, uint8_t sequenceID, uint16_t status = 0) {
+    const size_t start = _startPacket(out);
+    SAppend(out, "\xFE", 1); // EOF
+    uint16_t warnings = 0;
+    SAppend(out, &warnings, 2); // warnings
+    SAppend(out, &status, 2);   // status_flags
+    _finishPacket(out, start, sequenceID);
+}
+
+// Formats a float the way sqlite does when it's read as text.
+static string _formatDouble(double value) {
+    char buffer[32];
+    sqlite3_snprintf(sizeof(buffer), buffer, "%!.15g", value);
+    return buffer;
+}
+
+string MySQLPacket::serializeQueryResponse(int sequenceID, const SQResult& result, bool binaryProtocol) {
     // Add the response
     string sendBuffer;
 
     // First the column count
-    MySQLPacket columnCount;
-    columnCount.sequenceID = ++sequenceID;
-    columnCount.payload = lenEncInt(result.headers.size());
-    sendBuffer += columnCount.serialize();
-
-    // Add all the columns
-    for (const auto& header : result.headers) {
-        // Now a column description
-        MySQLPacket column;
-        column.sequenceID = ++sequenceID;
-        column.payload += lenEncStr("def");     // catalog (lenenc_str) -- catalog (always "def")
-        column.payload += lenEncStr("unknown"); // schema (lenenc_str) -- schema-name
-        column.payload += lenEncStr("unknown"); // table (lenenc_str) -- virtual table-name
-        column.payload += lenEncStr("unknown"); // org_table (lenenc_str) -- physical table-name
-        column.payload += lenEncStr(header);    // name (lenenc_str) -- virtual column name
-        column.payload += lenEncStr(header);    // org_name (lenenc_str) -- physical column name
-
-        uint8_t next_length = 0x0c;
-        SAppend(column.payload, &next_length, 1); // next_length (lenenc_int) -- length of the following fields (always 0x0c)
-
-        uint16_t latin1_swedish_ci = 0x08;
-        SAppend(column.payload, &latin1_swedish_ci, 2); // character_set (2) -- is the column character set and is defined in Protocol::CharacterSet.
-
-        uint32_t colLength = 1024;
-        SAppend(column.payload, &colLength, 4); // column_length (4) -- maximum length of the field
-
-        //uint8_t colType = 0; // Decimal;
-        uint8_t colType = 254; // string.
-        SAppend(column.payload, &colType, 1); // column_type (1) -- type of the column as defined in Column Type
-
-        uint16_t flags = 0;
-        SAppend(column.payload, &flags, 2); // flags (2) -- flags
-
-        uint8_t decimals = 0;
-        SAppend(column.payload, &decimals, 1); // decimals (1) -- max shown decimal digits, 0x00 for integers and static strings
-
-        uint16_t filler = 0;
-        SAppend(column.payload, &filler, 2); // filler (to pad to 0x0c)
-
-        sendBuffer += column.serialize();
+    size_t start = _startPacket(sendBuffer);
+    sendBuffer += lenEncInt(result.headers.size());
+    _finishPacket(sendBuffer, start, ++sequenceID);
+
+    // Add all the columns. Everything in an SQResult is text, so that's how we describe them.
+    for (size_t c = 0; c < result.headers.size(); c++) {
+        uint32_t length = 0;
+        for (const auto& row : result.rows) {
+            length = max(length, (uint32_t)row[c].size());
+        }
+        _appendColumn(sendBuffer, ++sequenceID, result.headers[c], MYSQL_CHARSET_UTF8, length,
+                      MYSQL_TYPE_VAR_STRING, 0, 0);
     }
 
     // EOF packet to signal no more columns
-    MySQLPacket eofPacket;
-    eofPacket.sequenceID = ++sequenceID;
-    SAppend(eofPacket.payload, "\xFE", 1); // EOF
-    uint32_t zero = 0;
-    SAppend(eofPacket.payload, &zero, 4); // EOF
-    sendBuffer += eofPacket.serialize();
-
-    // Add all the rows
+    _appendEOF(sendBuffer, ++sequenceID);
+
+    // Add all the rows. In the binary protocol, each row starts with a header and a bitmap of which values are NULL,
+    // of which there are none here.
     for (const auto& row : result.rows) {
-        // Now the row
-        MySQLPacket rowPacket;
-        rowPacket.sequenceID = ++sequenceID;
+        start = _startPacket(sendBuffer);
+        if (binaryProtocol) {
+            sendBuffer.append(1 + (result.headers.size() + 9) / 8, '\0');
+        }
         for (const auto& cell : row) {
-            rowPacket.payload += lenEncStr(cell);
+            _appendLenEncStr(sendBuffer, cell.data(), cell.size());
         }
-        SAppend(rowPacket.payload, "\xFE", 1); // EOF
-        sendBuffer += rowPacket.serialize();
+        _finishPacket(sendBuffer, start, ++sequenceID);
     }
 
     // Finish with another EOF packet
-    eofPacket.sequenceID = ++sequenceID;
-    sendBuffer += eofPacket.serialize();
+    _appendEOF(sendBuffer, ++sequenceID);
 
     // Done!
     return sendBuffer;
 }
 
-string MySQLPacket::serializeOK(int sequenceID) {
+bool MySQLPacket::serializeBinaryResult(int& sequenceID, const char* data, size_t size, bool binaryProtocol,
+                                        bool moreResults, string& output) {
+    // Each of these reads from the front of what's left, failing if there isn't enough.
+    const char* ptr = data;
+    const char* end = ptr + size;
+    auto readUInt = [&](int bytes) {
+        if (end - ptr < bytes) {
+            STHROW("Truncated");
+        }
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; i++) {
+            value |= (uint64_t)(unsigned char)*ptr++ << (8 * i);
+        }
+        return value;
+    };
+    auto readString = [&](const char*& value) {
+        const uint64_t size = readUInt(4);
+        if ((uint64_t)(end - ptr) < size) {
+            STHROW("Truncated");
+        }
+        value = ptr;
+        ptr += size;
+        return size;
+    };
+
+    const size_t outputStart = output.size();
+    const int sequenceStart = sequenceID;
+    try {
+        vector<string> headers(readUInt(4));
+        for (string& header : headers) {
+            const char* value;
+            const uint64_t size = readString(value);
+            header.assign(value, size);
+        }
+        const size_t columns = headers.size();
+
+        // sqlite types values rather than columns, so we make a first pass over the rows to find out what's in each
+        // column. If every value (besides NULLs) has the same type, we describe the column as that type. Otherwise,
+        // we fall back to a string, and convert any numbers in it to text. Along the way, we find out how long the
+        // longest value in each column is.
+        const char* rowsStart = ptr;
+        vector<int> types(columns, SQLITE_NULL);
+        vector<uint32_t> lengths(columns, 0);
+        while (columns && ptr < end) {
+            for (size_t c = 0; c < columns; c++) {
+                const int type = (int)readUInt(1);
+                uint64_t length = 0;
+                switch (type) {
+                    case SQLITE_INTEGER:
+                        readUInt(8);
+                        length = 20;
+                        break;
+                    case SQLITE_FLOAT:
+                        readUInt(8);
+                        length = 22;
+                        break;
+                    case SQLITE_NULL:
+                        break;
+                    case SQLITE_TEXT:
+                    case SQLITE_BLOB: {
+                        const char* value;
+                        length = readString(value);
+                        break;
+                    }
+                    default:
+                        STHROW("Unknown type " + SToStr(type));
+                }
+                if (type != SQLITE_NULL) {
+                    types[c] = (types[c] == SQLITE_NULL || types[c] == type) ? type : SQLITE_TEXT;
+                }
+                lengths[c] = max(lengths[c], (uint32_t)min(length, (uint64_t)UINT32_MAX));
+            }
+        }
+
+        // Now the column count, and a description of each column.
+        size_t start = _startPacket(output);
+        output += lenEncInt(columns);
+        _finishPacket(output, start, ++sequenceID);
+        for (size_t c = 0; c < columns; c++) {
+            switch (types[c]) {
+                case SQLITE_INTEGER:
+                    _appendColumn(output, ++sequenceID, headers[c], MYSQL_CHARSET_BINARY, lengths[c],
+                                  MYSQL_TYPE_LONGLONG, MYSQL_FLAG_BINARY | MYSQL_FLAG_NUM, 0);
+                    break;
+                case SQLITE_FLOAT:
+                    _appendColumn(output, ++sequenceID, headers[c], MYSQL_CHARSET_BINARY, lengths[c],
+                                  MYSQL_TYPE_DOUBLE, MYSQL_FLAG_BINARY | MYSQL_FLAG_NUM, 0x1f);
+                    break;
+                case SQLITE_BLOB:
+                    _appendColumn(output, ++sequenceID, headers[c], MYSQL_CHARSET_BINARY, lengths[c],
+                                  MYSQL_TYPE_BLOB, MYSQL_FLAG_BINARY | MYSQL_FLAG_BLOB, 0);
+                    break;
+                default:
+                    // Text, or a column with nothing but NULLs in it.
+                    types[c] = SQLITE_TEXT;
+                    _appendColumn(output, ++sequenceID, headers[c], MYSQL_CHARSET_UTF8, lengths[c],
+                                  MYSQL_TYPE_VAR_STRING, 0, 0);
+                    break;
+            }
+        }
+        _appendEOF(output, ++sequenceID);
+
+        // Then a second pass to write each row, straight from the data into its packet.
+        ptr = rowsStart;
+        const size_t nullBitmapSize = (columns + 9) / 8;
+        while (columns && ptr < end) {
+            start = _startPacket(output);
+            size_t nullBitmap = 0;
+            if (binaryProtocol) {
+                // A header, then a bitmap with a bit set for each NULL, offset by two bits.
+                output += '\0';
+                nullBitmap = output.size();
+                output.append(nullBitmapSize, '\0');
+            }
+            for (size_t c = 0; c < columns; c++) {
+                const int type = (int)readUInt(1);
+                switch (type) {
+                    case SQLITE_INTEGER: {
+                        const uint64_t value = readUInt(8);
+                        if (binaryProtocol && types[c] == SQLITE_INTEGER) {
+                            SAppend(output, &value, 8);
+                        } else {
+                            output += lenEncStr(SToStr((int64_t)value));
+                        }
+                        break;
+                    }
+                    case SQLITE_FLOAT: {
+                        const uint64_t bits = readUInt(8);
+                        if (binaryProtocol && types[c] == SQLITE_FLOAT) {
+                            SAppend(output, &bits, 8);
+                        } else {
+                            double value;
+                            memcpy(&value, &bits, sizeof(value));
+                            output += lenEncStr(_formatDouble(value));
+                        }
+                        break;
+                    }
+                    case SQLITE_NULL:
+                        if (binaryProtocol) {
+                            output[nullBitmap + (c + 2) / 8] |= (char)(1 << ((c + 2) % 8));
+                        } else {
+                            SAppend(output, "\xFB", 1);
+                        }
+                        break;
+                    default: {
+                        const char* value;
+                        const uint64_t size = readString(value);
+                        _appendLenEncStr(output, value, size);
+                        break;
+                    }
+                }
+            }
+            _finishPacket(output, start, ++sequenceID);
+        }
+
+        // Finish with another EOF packet, which says whether another result follows.
+        _appendEOF(output, ++sequenceID, moreResults ? MYSQL_SERVER_MORE_RESULTS_EXISTS : 0);
+    } catch (const SException& e) {
+        output.resize(outputStart);
+        sequenceID = sequenceStart;
+        return false;
+    }
+    return true;
+}
+
+string MySQLPacket::serializePrepareOK(int sequenceID, uint32_t statementID, uint16_t params) {
+    string sendBuffer;
+    size_t start = _startPacket(sendBuffer);
+    SAppend(sendBuffer, "\x00", 1);         // status (OK)
+    SAppend(sendBuffer, &statementID, 4);   // statement_id
+    uint16_t columns = 0;
+    SAppend(sendBuffer, &columns, 2);       // num_columns
+    SAppend(sendBuffer, &params, 2);        // num_params
+    SAppend(sendBuffer, "\x00", 1);         // reserved_1
+    uint16_t warnings = 0;
+    SAppend(sendBuffer, &warnings, 2);      // warning_count
+    _finishPacket(sendBuffer, start, ++sequenceID);
+
+    // We don't know the types of the parameters until they're sent, so we describe them all as strings.
+    if (params) {
+        for (uint16_t p = 0; p < params; p++) {
+            _appendColumn(sendBuffer, ++sequenceID, "?", MYSQL_CHARSET_BINARY, 0, MYSQL_TYPE_VAR_STRING, 0, 0);
+        }
+        _appendEOF(sendBuffer, ++sequenceID);
+    }
+    return sendBuffer;
+}
+
+string MySQLPacket::serializeOK(int sequenceID, uint64_t affectedRows, uint64_t lastInsertID, bool moreResults) {
     // Just fill out the packet
     MySQLPacket ok;
     ok.sequenceID = sequenceID + 1;
-    ok.payload += lenEncInt(0); // OK
-    ok.payload += lenEncInt(0); // Affected rows
-    ok.payload += lenEncInt(0); // Last insert ID
+    ok.payload += lenEncInt(0);            // OK
+    ok.payload += lenEncInt(affectedRows); // Affected rows
+    ok.payload += lenEncInt(lastInsertID); // Last insert ID
 
-    uint16_t SERVER_STATUS_AUTOCOMMIT = 0x0002;
-    SAppend(ok.payload, &SERVER_STATUS_AUTOCOMMIT, 2); // status_flags
+    uint16_t status = MYSQL_SERVER_STATUS_AUTOCOMMIT | (moreResults ? MYSQL_SERVER_MORE_RESULTS_EXISTS : 0);
+    SAppend(ok.payload, &status, 2); // status_flags
     uint16_t WARNING_COUNT = 0x0;
     SAppend(ok.payload, &WARNING_COUNT, 2); // required for protocol 4.1
 
@@ -228,94 +445,177 @@ void BedrockPlugin_MySQL::onPortAccept(STCPManager::Socket* s) {
 }
 
 void BedrockPlugin_MySQL::onPortRecv(STCPManager::Socket* s, SData& request) {
-    // Get any new MySQL requests
+    // Find this socket's connection. Only this socket's I/O thread ever uses it, so we only need the lock to find it.
+    Connection* connectionPtr;
+    {
+        lock_guard<mutex> lock(_connectionMutex);
+        connectionPtr = &_connections[s->id];
+    }
+    Connection& connection = *connectionPtr;
+
+    // Get any new MySQL requests. We can only hand back one request at a time, so once a packet turns into one, we
+    // leave anything after it in the buffer until that request has been answered. The exception is reads: as long as
+    // the packets that follow are reads too, we add them to the same request, so they're all run as a single batch in
+    // one snapshot, rather than each paying for a trip through the command queue.
+    struct BatchedRead {
+        string query;
+        int sequenceID;
+        int packet;
+        bool binaryProtocol;
+    };
+    vector<BatchedRead> batch;
+    int batchedPackets = 0;
     int packetSize = 0;
     MySQLPacket packet;
-    while ((packetSize = packet.deserialize(s->recvBuffer))) {
+    while (request.empty() && (packetSize = packet.deserialize(s->recvBuffer))) {
         // Got a packet, process it
         SDEBUG("Received command #" << (int)packet.sequenceID << ": '" << SToHex(packet.serialize()) << "'");
-        SConsumeFront(s->recvBuffer, packetSize);
-        switch (packet.payload[0]) {
-        case 3: { // COM_QUERY
-            // Decode the query
-            string query = STrim(packet.payload.substr(1, packet.payload.size() - 1));
-            if (!SEndsWith(query, ";")) {
-                // We translate our query to one we can pass to `DB`, for which this is mandatory.
-                query += ";";
+        const char command = packet.payload.empty() ? 0 : packet.payload[0];
+        if (!connection.authenticated) {
+            // The first packet is the response to our handshake, which starts with the client's capabilities. We
+            // don't support authentication, so we accept it whatever it says.
+            SConsumeFront(s->recvBuffer, packetSize);
+            if (packet.payload.size() >= 4) {
+                memcpy(&connection.capabilities, &packet.payload[0], 4);
             }
-            // JDBC Does this.
-            if (SStartsWith(query, "/*")) {
-                auto index = query.find("*/");
-                if (index != query.npos) {
-                    query = query.substr(index + 2);
-                }
+            connection.authenticated = true;
+            SINFO("Client connected with capabilities " << SToHex(connection.capabilities, 8));
+            s->send(MySQLPacket::serializeOK(packet.sequenceID));
+            continue;
+        }
+
+        // See if this packet is made up only of reads we can run in a batch.
+        vector<string> statements;
+        vector<string> reads;
+        PreparedStatement* statement = nullptr;
+        if (command == 3) { // COM_QUERY
+            statements = _splitStatements(connection, packet.payload.substr(1));
+            if (all_of(statements.begin(), statements.end(), _isBatchableRead)) {
+                reads = statements;
             }
-            SINFO("Processing query '" << query << "'");
-
-            // See if it's asking for a global variable
-            string varName;
-            string regExp = "^(?:(?:SELECT\\s+)?@@(?:\\w+\\.)?|SHOW VARIABLES LIKE ')(\\w+).*$";
-            if (pcrecpp::RE(regExp, pcrecpp::RE_Options().set_caseless(true)).FullMatch(query, &varName)) {
-                // Loop across and look for it
-                SQResult result;
-                result.headers.push_back(varName);
-                for (int c = 0; c < MYSQL_NUM_VARIABLES; ++c) {
-                    if (SIEquals(g_MySQLVariables[c][0], varName)) {
-                        // Found it!
-                        SINFO("Returning variable '" << varName << "'='" << g_MySQLVariables[c][1] << "'");
-                        result.rows.resize(1);
-                        result.rows[0].push_back(g_MySQLVariables[c][1]);
-                        break;
+        } else if (command == 0x17 && packet.payload.size() >= 5) { // COM_STMT_EXECUTE
+            uint32_t statementID;
+            memcpy(&statementID, &packet.payload[1], 4);
+            auto it = connection.statements.find(statementID);
+            if (it != connection.statements.end()) {
+                statement = &it->second;
+                const string query = _bindParameters(*statement, packet.payload);
+                if (!query.empty()) {
+                    statements.push_back(_normalizeQuery(query));
+                    if (_isBatchableRead(statements.back())) {
+                        reads = statements;
                     }
                 }
-                if (result.rows.empty()) {
-                    SHMMM("Couldn't find variable '" << varName << "', returning empty.");
+            }
+        }
+        if (!reads.empty() && batch.size() + reads.size() <= MYSQL_MAX_BATCH) {
+            SConsumeFront(s->recvBuffer, packetSize);
+            if (statement) {
+                statement->longData.clear();
+            }
+            for (string& read : reads) {
+                batch.push_back({move(read), packet.sequenceID, batchedPackets, command == 0x17});
+            }
+            batchedPackets++;
+            continue;
+        }
+        if (batchedPackets) {
+            // This has to wait until the batch we've got so far has been answered.
+            break;
+        }
+
+        SConsumeFront(s->recvBuffer, packetSize);
+        switch (command) {
+        case 3: { // COM_QUERY
+            _processQuery(s, packet.sequenceID, statements, false, request);
+            break;
+        }
+
+        case 0x16: { // COM_STMT_PREPARE
+            // We substitute the parameters into the query ourselves when it's executed, so all we need to know now is
+            // where they go.
+            PreparedStatement prepared;
+            prepared.query = STrim(packet.payload.substr(1));
+            prepared.placeholders = _findUnquoted(prepared.query, '?');
+            if (prepared.placeholders.size() > UINT16_MAX) {
+                s->send(MySQLPacket::serializeERR(packet.sequenceID, 1390, "Too many placeholders"));
+                break;
+            }
+            const uint16_t params = prepared.placeholders.size();
+            uint32_t statementID;
+            {
+                lock_guard<mutex> lock(_connectionMutex);
+                statementID = _nextStatementID++;
+            }
+            connection.statements[statementID] = move(prepared);
+            SINFO("Prepared statement #" << statementID << " with " << params << " parameters.");
+            s->send(MySQLPacket::serializePrepareOK(packet.sequenceID, statementID, params));
+            break;
+        }
+
+        case 0x17: { // COM_STMT_EXECUTE
+            if (!statement) {
+                SHMMM("Asked to execute unknown statement.");
+                s->send(MySQLPacket::serializeERR(packet.sequenceID, 1243, "Unknown prepared statement handler"));
+            } else if (statements.empty()) {
+                SHMMM("Couldn't bind parameters for statement.");
+                s->send(MySQLPacket::serializeERR(packet.sequenceID, 1210, "Incorrect arguments to EXECUTE"));
+            } else {
+                statement->longData.clear();
+                _processQuery(s, packet.sequenceID, statements, true, request);
+            }
+            break;
+        }
+
+        case 0x18: { // COM_STMT_SEND_LONG_DATA
+            // Appends to a parameter of the next execution. There's no response to this.
+            if (packet.payload.size() >= 7) {
+                uint32_t statementID;
+                uint16_t param;
+                memcpy(&statementID, &packet.payload[1], 4);
+                memcpy(&param, &packet.payload[5], 2);
+                auto it = connection.statements.find(statementID);
+                if (it != connection.statements.end()) {
+                    it->second.longData[param].append(packet.payload, 7, string::npos);
                 }
-                s->send(MySQLPacket::serializeQueryResponse(packet.sequenceID, result));
-            } else if (SIEquals(query, "SHOW VARIABLES;")) {
-                // Return the variable list
-                SINFO("Responding with fake variable list");
-                SQResult result;
-                result.headers.push_back("Variable Name");
-                result.headers.push_back("Value");
-                for (int c = 0; c < MYSQL_NUM_VARIABLES; ++c) {
-                    result.rows.resize(result.rows.size() + 1);
-                    result.rows.back().resize(2);
-                    result.rows.back()[0] = g_MySQLVariables[c][0];
-                    result.rows.back()[1] = g_MySQLVariables[c][1];
+            }
+            break;
+        }
+
+        case 0x19: { // COM_STMT_CLOSE
+            // There's no response to this either.
+            if (packet.payload.size() >= 5) {
+                uint32_t statementID;
+                memcpy(&statementID, &packet.payload[1], 4);
+                connection.statements.erase(statementID);
+            }
+            break;
+        }
+
+        case 0x1a: { // COM_STMT_RESET
+            // Drops any long data sent for the next execution.
+            if (packet.payload.size() >= 5) {
+                uint32_t statementID;
+                memcpy(&statementID, &packet.payload[1], 4);
+                auto it = connection.statements.find(statementID);
+                if (it != connection.statements.end()) {
+                    it->second.longData.clear();
                 }
-                s->send(MySQLPacket::serializeQueryResponse(packet.sequenceID, result));
-            } else if (SIEquals(query, "SHOW DATABASES;")) {
-                // Return a fake "main" database
-                SINFO("Responding with fake database list");
-                SQResult result;
-                result.headers.push_back("Database");
-                result.rows.resize(1);
-                result.rows.back().push_back("main");
-                s->send(MySQLPacket::serializeQueryResponse(packet.sequenceID, result));
-            } else if (SIEquals(query, "SHOW /*!50002 FULL*/ TABLES;")) {
-                // Return an empty list of tables
-                SINFO("Responding with fake table list");
-                SQResult result;
-                result.headers.push_back("Tables");
-                s->send(MySQLPacket::serializeQueryResponse(packet.sequenceID, result));
-            } else if (SContains(query, "information_schema")) {
-                // Return an empty set
-                SINFO("Responding with empty routine list");
-                SQResult result;
-                s->send(MySQLPacket::serializeQueryResponse(packet.sequenceID, result));
-            } else if (SStartsWith(SToUpper(query), "SET ") || SStartsWith(SToUpper(query), "USE ")
-                       || SIEquals(query, "ROLLBACK;")) {
-                // Ignore
-                SINFO("Responding OK to SET/USE/ROLLBACK query.");
-                s->send(MySQLPacket::serializeOK(packet.sequenceID));
+            }
+            s->send(MySQLPacket::serializeOK(packet.sequenceID));
+            break;
+        }
+
+        case 0x1b: { // COM_SET_OPTION
+            // Turns multi-statement queries on (0) or off (1), and is answered with EOF.
+            if (packet.payload.size() >= 3 && packet.payload[1] == 0) {
+                connection.capabilities |= MYSQL_CLIENT_MULTI_STATEMENTS;
             } else {
-                // Transform this into an internal request
-                request.methodLine = "Query";
-                request["format"] = "json";
-                request["sequenceID"] = SToStr(packet.sequenceID);
-                request["query"] = query;
+                connection.capabilities &= ~MYSQL_CLIENT_MULTI_STATEMENTS;
             }
+            string sendBuffer;
+            _appendEOF(sendBuffer, packet.sequenceID + 1);
+            s->send(sendBuffer);
             break;
         }
 
@@ -327,27 +627,469 @@ void BedrockPlugin_MySQL::onPortRecv(STCPManager::Socket* s, SData& request) {
         }
         }
     }
+
+    // Turn the reads we've collected into a request. A single one is just a query.
+    if (batch.size() == 1) {
+        _processQuery(s, batch[0].sequenceID, {batch[0].query}, batch[0].binaryProtocol, request);
+    } else if (batch.size() > 1) {
+        SINFO("Batching " << batch.size() << " reads from " << batchedPackets << " packets.");
+        request.methodLine = "QueryBatch";
+        request["format"] = "binary";
+        request["queries"] = SToStr(batch.size());
+        for (size_t i = 0; i < batch.size(); i++) {
+            const string name = "query" + SToStr(i);
+            request[name] = batch[i].query;
+            request[name + "SequenceID"] = SToStr(batch[i].sequenceID);
+            request[name + "Packet"] = SToStr(batch[i].packet);
+            if (batch[i].binaryProtocol) {
+                request[name + "BinaryProtocol"] = "true";
+            }
+        }
+    }
+}
+
+void BedrockPlugin_MySQL::onPortClose(STCPManager::Socket* s) {
+    lock_guard<mutex> lock(_connectionMutex);
+    _connections.erase(s->id);
+}
+
+string BedrockPlugin_MySQL::_normalizeQuery(const string& rawQuery) {
+    string query = STrim(rawQuery);
+    if (!SEndsWith(query, ";")) {
+        // We translate our query to one we can pass to `DB`, for which this is mandatory.
+        query += ";";
+    }
+    // JDBC Does this.
+    if (SStartsWith(query, "/*")) {
+        auto index = query.find("*/");
+        if (index != query.npos) {
+            query = query.substr(index + 2);
+        }
+    }
+    return query;
+}
+
+vector<string> BedrockPlugin_MySQL::_splitStatements(const Connection& connection, const string& query) {
+    vector<string> statements;
+    if (connection.capabilities & MYSQL_CLIENT_MULTI_STATEMENTS) {
+        size_t start = 0;
+        vector<size_t> ends = _findUnquoted(query, ';');
+        ends.push_back(query.size());
+        for (size_t end : ends) {
+            const string statement = STrim(query.substr(start, end - start));
+            if (!statement.empty()) {
+                statements.push_back(_normalizeQuery(statement));
+            }
+            start = end + 1;
+        }
+    }
+    if (statements.empty()) {
+        statements.push_back(_normalizeQuery(query));
+    }
+    return statements;
+}
+
+bool BedrockPlugin_MySQL::_isBatchableRead(const string& query) {
+    SQResult result;
+    return SStartsWith(SToUpper(query.substr(0, 7)), "SELECT ") && _answerLocally(query, result) == NOT_LOCAL;
+}
+
+BedrockPlugin_MySQL::LocalAnswer BedrockPlugin_MySQL::_answerLocally(const string& query, SQResult& result) {
+    // This is also used to check whether a query can be batched, so it doesn't log anything itself.
+    // See if it's asking for a global variable
+    string varName;
+    string regExp = "^(?:(?:SELECT\\s+)?@@(?:\\w+\\.)?|SHOW VARIABLES LIKE ')(\\w+).*$";
+    if (pcrecpp::RE(regExp, pcrecpp::RE_Options().set_caseless(true)).FullMatch(query, &varName)) {
+        // Loop across and look for it
+        result.headers.push_back(varName);
+        for (int c = 0; c < MYSQL_NUM_VARIABLES; ++c) {
+            if (SIEquals(g_MySQLVariables[c][0], varName)) {
+                // Found it!
+                result.rows.resize(1);
+                result.rows[0].push_back(g_MySQLVariables[c][1]);
+                break;
+            }
+        }
+        return LOCAL_RESULT;
+    } else if (SIEquals(query, "SHOW VARIABLES;")) {
+        // Return the variable list
+        result.headers.push_back("Variable Name");
+        result.headers.push_back("Value");
+        for (int c = 0; c < MYSQL_NUM_VARIABLES; ++c) {
+            result.rows.resize(result.rows.size() + 1);
+            result.rows.back().resize(2);
+            result.rows.back()[0] = g_MySQLVariables[c][0];
+            result.rows.back()[1] = g_MySQLVariables[c][1];
+        }
+        return LOCAL_RESULT;
+    } else if (SIEquals(query, "SHOW DATABASES;")) {
+        // Return a fake "main" database
+        result.headers.push_back("Database");
+        result.rows.resize(1);
+        result.rows.back().push_back("main");
+        return LOCAL_RESULT;
+    } else if (SIEquals(query, "SHOW /*!50002 FULL*/ TABLES;")) {
+        // Return an empty list of tables
+        result.headers.push_back("Tables");
+        return LOCAL_RESULT;
+    } else if (SContains(query, "information_schema")) {
+        // Return an empty set
+        return LOCAL_RESULT;
+    } else if (SStartsWith(SToUpper(query), "SET ") || SStartsWith(SToUpper(query), "USE ")
+               || SIEquals(query, "ROLLBACK;")) {
+        // Ignore
+        return LOCAL_OK;
+    }
+    return NOT_LOCAL;
+}
+
+void BedrockPlugin_MySQL::_processQuery(STCPManager::Socket* s, int sequenceID, const vector<string>& statements,
+                                         bool binaryProtocol, SData& request) {
+    if (statements.size() == 1) {
+        const string& query = statements.front();
+        SINFO("Processing query '" << query << "'");
+        SQResult result;
+        switch (_answerLocally(query, result)) {
+            case LOCAL_RESULT:
+                SINFO("Responding with local result of " << result.rows.size() << " rows.");
+                s->send(MySQLPacket::serializeQueryResponse(sequenceID, result, binaryProtocol));
+                return;
+            case LOCAL_OK:
+                SINFO("Responding OK to SET/USE/ROLLBACK query.");
+                s->send(MySQLPacket::serializeOK(sequenceID));
+                return;
+            case NOT_LOCAL:
+                break;
+        }
+
+        // Transform this into an internal request. We ask for the binary format, so we get each value with its
+        // sqlite type, and can describe the columns with real types.
+        request.methodLine = "Query";
+        request["format"] = "binary";
+        request["sequenceID"] = SToStr(sequenceID);
+        request["query"] = query;
+        if (binaryProtocol) {
+            request["binaryProtocol"] = "true";
+        }
+        return;
+    }
+
+    // Several statements in one query. If they were all reads, they'd have been batched (unless there were too many),
+    // so these should all be writes, which we run together as a single query in one transaction, answering each with
+    // OK.
+    if (all_of(statements.begin(), statements.end(), _isBatchableRead)) {
+        SHMMM("Too many statements in multi-statement query.");
+        s->send(MySQLPacket::serializeERR(sequenceID, 1295, "Too many statements in one query"));
+        return;
+    }
+    for (const string& statement : statements) {
+        SQResult result;
+        if (SStartsWith(SToUpper(statement.substr(0, 7)), "SELECT ") || _answerLocally(statement, result) != NOT_LOCAL) {
+            SHMMM("Can't run multi-statement query mixing reads and writes.");
+            s->send(MySQLPacket::serializeERR(sequenceID, 1295,
+                                              "Multiple statements must be either all reads or all writes"));
+            return;
+        }
+    }
+    SINFO("Processing " << statements.size() << " statements as one query.");
+    request.methodLine = "Query";
+    request["format"] = "binary";
+    request["sequenceID"] = SToStr(sequenceID);
+    request["query"] = SComposeList(statements, "\n");
+    request["statements"] = SToStr(statements.size());
+}
+
+string BedrockPlugin_MySQL::_bindParameters(PreparedStatement& statement, const string& payload) {
+    // The payload starts with the command, statement_id (4), flags (1), and iteration_count (4).
+    const size_t params = statement.placeholders.size();
+    size_t offset = 10;
+    auto readUInt = [&](int bytes) {
+        if (payload.size() - min(offset, payload.size()) < (size_t)bytes) {
+            STHROW("Truncated");
+        }
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; i++) {
+            value |= (uint64_t)(unsigned char)payload[offset++] << (8 * i);
+        }
+        return value;
+    };
+    auto readLenEncInt = [&]() {
+        const uint64_t first = readUInt(1);
+        switch (first) {
+            case 0xFC: return readUInt(2);
+            case 0xFD: return readUInt(3);
+            case 0xFE: return readUInt(8);
+            default:   return first;
+        }
+    };
+    auto readString = [&]() {
+        const uint64_t size = readLenEncInt();
+        if (payload.size() - offset < size) {
+            STHROW("Truncated");
+        }
+        string value = payload.substr(offset, size);
+        offset += size;
+        return value;
+    };
+
+    // Turns a string parameter into a literal. Blobs are written as hex, so they can hold anything.
+    auto stringLiteral = [](uint8_t type, const string& value) {
+        if (type == MYSQL_TYPE_TINY_BLOB || type == MYSQL_TYPE_MEDIUM_BLOB || type == MYSQL_TYPE_LONG_BLOB ||
+            type == MYSQL_TYPE_BLOB) {
+            return "X'" + SToHex(value) + "'";
+        }
+        return SQ(value);
+    };
+
+    vector<string> values;
+    try {
+        if (params) {
+            // A bitmap of which parameters are NULL, and then, if they've changed, the type of every parameter.
+            string nullBitmap = payload.substr(min(offset, payload.size()), (params + 7) / 8);
+            if (nullBitmap.size() != (params + 7) / 8) {
+                STHROW("Truncated");
+            }
+            offset += nullBitmap.size();
+            if (readUInt(1)) {
+                statement.types.resize(params);
+                for (uint16_t& type : statement.types) {
+                    type = readUInt(2);
+                }
+            }
+            if (statement.types.size() != params) {
+                STHROW("No parameter types");
+            }
+
+            for (size_t p = 0; p < params; p++) {
+                const uint8_t type = statement.types[p] & 0xFF;
+                const bool isUnsigned = statement.types[p] & 0x8000;
+                auto longData = statement.longData.find(p);
+                if (nullBitmap[p / 8] & (1 << (p % 8))) {
+                    values.push_back("NULL");
+                } else if (longData != statement.longData.end()) {
+                    values.push_back(stringLiteral(type, longData->second));
+                } else {
+                    switch (type) {
+                        case MYSQL_TYPE_NULL:
+                            values.push_back("NULL");
+                            break;
+                        case MYSQL_TYPE_TINY:
+                        case MYSQL_TYPE_SHORT:
+                        case MYSQL_TYPE_YEAR:
+                        case MYSQL_TYPE_LONG:
+                        case MYSQL_TYPE_INT24:
+                        case MYSQL_TYPE_LONGLONG: {
+                            const int bytes = type == MYSQL_TYPE_TINY ? 1 :
+                                              (type == MYSQL_TYPE_SHORT || type == MYSQL_TYPE_YEAR) ? 2 :
+                                              type == MYSQL_TYPE_LONGLONG ? 8 : 4;
+                            uint64_t value = readUInt(bytes);
+                            if (isUnsigned) {
+                                values.push_back(SToStr(value));
+                            } else {
+                                // Sign extend from however many bytes we read.
+                                const int shift = 64 - 8 * bytes;
+                                values.push_back(SToStr((int64_t)(value << shift) >> shift));
+                            }
+                            break;
+                        }
+                        case MYSQL_TYPE_FLOAT: {
+                            const uint32_t bits = readUInt(4);
+                            float value;
+                            memcpy(&value, &bits, sizeof(value));
+                            values.push_back(_formatDouble(value));
+                            break;
+                        }
+                        case MYSQL_TYPE_DOUBLE: {
+                            const uint64_t bits = readUInt(8);
+                            double value;
+                            memcpy(&value, &bits, sizeof(value));
+                            values.push_back(_formatDouble(value));
+                            break;
+                        }
+                        case MYSQL_TYPE_DATE:
+                        case MYSQL_TYPE_DATETIME:
+                        case MYSQL_TYPE_TIMESTAMP: {
+                            // A length, then as many of year (2), month, day, hour, minute, second, and
+                            // microseconds (4) as aren't zero.
+                            const uint64_t length = readUInt(1);
+                            int year = 0, month = 0, day = 0, hour = 0, minute = 0, second = 0;
+                            if (length >= 4) {
+                                year = readUInt(2);
+                                month = readUInt(1);
+                                day = readUInt(1);
+                            }
+                            if (length >= 7) {
+                                hour = readUInt(1);
+                                minute = readUInt(1);
+                                second = readUInt(1);
+                            }
+                            if (length >= 11) {
+                                readUInt(4);
+                            }
+                            char buffer[32];
+                            if (type == MYSQL_TYPE_DATE) {
+                                snprintf(buffer, sizeof(buffer), "%04d-%02d-%02d", year, month, day);
+                            } else {
+                                snprintf(buffer, sizeof(buffer), "%04d-%02d-%02d %02d:%02d:%02d", year, month, day,
+                                         hour, minute, second);
+                            }
+                            values.push_back(SQ(buffer));
+                            break;
+                        }
+                        case MYSQL_TYPE_TIME: {
+                            // A length, then a sign, days (4), hours, minutes, seconds, and microseconds (4).
+                            const uint64_t length = readUInt(1);
+                            bool negative = false;
+                            uint64_t hours = 0, minutes = 0, seconds = 0;
+                            if (length >= 8) {
+                                negative = readUInt(1);
+                                hours = readUInt(4) * 24;
+                                hours += readUInt(1);
+                                minutes = readUInt(1);
+                                seconds = readUInt(1);
+                            }
+                            if (length >= 12) {
+                                readUInt(4);
+                            }
+                            char buffer[32];
+                            snprintf(buffer, sizeof(buffer), "%s%02llu:%02llu:%02llu", negative ? "-" : "",
+                                     (unsigned long long)hours, (unsigned long long)minutes,
+                                     (unsigned long long)seconds);
+                            values.push_back(SQ(buffer));
+                            break;
+                        }
+                        default:
+                            // Everything else (strings, decimals, blobs, etc) is sent as a length-encoded string.
+                            values.push_back(stringLiteral(type, readString()));
+                            break;
+                    }
+                }
+            }
+        }
+    } catch (const SException& e) {
+        return "";
+    }
+
+    // Now put the values in place of the placeholders.
+    string query;
+    size_t last = 0;
+    for (size_t p = 0; p < params; p++) {
+        query.append(statement.query, last, statement.placeholders[p] - last);
+        query += values[p];
+        last = statement.placeholders[p] + 1;
+    }
+    query.append(statement.query, last, string::npos);
+    return query;
+}
+
+vector<size_t> BedrockPlugin_MySQL::_findUnquoted(const string& query, char target) {
+    vector<size_t> found;
+    for (size_t i = 0; i < query.size(); i++) {
+        const char c = query[i];
+        if (c == '\'' || c == '"' || c == '`') {
+            // Skip to the end of the string or identifier. A doubled quote is an escaped one, which this handles by
+            // ending the string and immediately starting another. Inside strings (but not identifiers), MySQL clients
+            // also escape characters with a backslash by default.
+            for (i++; i < query.size() && query[i] != c; i++) {
+                if (query[i] == '\\' && c != '`') {
+                    i++;
+                }
+            }
+        } else if (c == '#' || (c == '-' && i + 1 < query.size() && query[i + 1] == '-' &&
+                                (i + 2 == query.size() || isspace((unsigned char)query[i + 2])))) {
+            // A comment to the end of the line. MySQL only takes "--" as one when it's followed by whitespace, so that
+            // `1--1` is still arithmetic.
+            const size_t close = query.find('\n', i);
+            i = close == string::npos ? query.size() : close;
+        } else if (c == '/' && i + 1 < query.size() && query[i + 1] == '*') {
+            const size_t close = query.find("*/", i + 2);
+            i = close == string::npos ? query.size() : close + 1;
+        } else if (c == target) {
+            found.push_back(i);
+        }
+    }
+    return found;
 }
 
 void BedrockPlugin_MySQL::onPortRequestComplete(const BedrockCommand& command, STCPManager::Socket* s) {
-    // Only one request supported: Query.
-    SASSERT(SIEquals(command.request.methodLine, "Query"));
-    SASSERT(command.request.isSet("sequenceID"));
-    if (SToInt(command.response.methodLine) == 200) {
+    const SData& request = command.request;
+    const SData& response = command.response;
+    const bool succeeded = SToInt(response.methodLine) == 200;
+    if (SIEquals(request.methodLine, "QueryBatch")) {
+        // Answer each packet in the batch in turn. The results of a multi-statement query follow each other in one
+        // response, each but the last saying there's more to come, and stop at the first one that failed.
+        const int queries = request.calc("queries");
+        string sendBuffer;
+        size_t offset = 0;
+        int sequenceID = 0;
+        bool packetFailed = false;
+        for (int i = 0; i < queries; i++) {
+            const string name = "query" + SToStr(i);
+            const int packet = request.calc(name + "Packet");
+            const bool first = !i || request.calc("query" + SToStr(i - 1) + "Packet") != packet;
+            const bool last = i == queries - 1 || request.calc("query" + SToStr(i + 1) + "Packet") != packet;
+            if (first) {
+                sequenceID = request.calc(name + "SequenceID");
+                packetFailed = false;
+            }
+            if (!succeeded) {
+                // The whole batch failed, so every packet gets the error.
+                if (first) {
+                    sendBuffer += MySQLPacket::serializeERR(sequenceID, SToInt(response.methodLine),
+                                                            response["error"]);
+                }
+                continue;
+            }
+            const size_t size = min((size_t)response.calcU64(name + "Size"), response.content.size() - offset);
+            const char* data = response.content.data() + offset;
+            offset += size;
+            if (packetFailed) {
+                continue;
+            }
+            if (response.isSet(name + "Error")) {
+                sendBuffer += MySQLPacket::serializeERR(sequenceID, 502, response[name + "Error"]);
+                packetFailed = true;
+            } else if (!MySQLPacket::serializeBinaryResult(sequenceID, data, size, request.test(name + "BinaryProtocol"),
+                                                           !last, sendBuffer)) {
+                SWARN("Couldn't parse result of '" << request[name] << "'");
+                sendBuffer += MySQLPacket::serializeERR(sequenceID, 500, "Couldn't parse result");
+                packetFailed = true;
+            }
+        }
+        s->send(sendBuffer);
+        return;
+    }
+
+    // Otherwise, it's a single Query.
+    SASSERT(SIEquals(request.methodLine, "Query"));
+    SASSERT(request.isSet("sequenceID"));
+    int sequenceID = request.calc("sequenceID");
+    if (succeeded) {
         // Success!  Were there any results?
-        if (command.response.content.empty()) {
-            // Just send OK
-            s->send(MySQLPacket::serializeOK(command.request.calc("sequenceID")));
+        if (response.content.empty()) {
+            // Just send OK, once for each statement if there were several.
+            const int statements = max(1, request.calc("statements"));
+            string sendBuffer;
+            for (int i = 0; i < statements; i++) {
+                const bool last = i == statements - 1;
+                sendBuffer += MySQLPacket::serializeOK(sequenceID + i, 0,
+                                                       last ? SToUInt64(response["lastInsertRowID"]) : 0, !last);
+            }
+            s->send(sendBuffer);
         } else {
-            // Convert the JSON response from Bedrock::DB into MySQL protocol
-            SQResult result;
-            SASSERT(command.response.content.empty() || result.deserialize(command.response.content));
-            s->send(MySQLPacket::serializeQueryResponse(command.request.calc("sequenceID"), result));
+            // Convert the binary response from Bedrock::DB into MySQL protocol
+            string sendBuffer;
+            if (MySQLPacket::serializeBinaryResult(sequenceID, response.content.data(), response.content.size(),
+                                                   request.test("binaryProtocol"), false, sendBuffer)) {
+                s->send(sendBuffer);
+            } else {
+                SWARN("Couldn't parse result of '" << request["query"] << "'");
+                s->send(MySQLPacket::serializeERR(sequenceID, 500, "Couldn't parse result"));
+            }
         }
     } else {
         // Failure -- pass along the message
-        s->send(MySQLPacket::serializeERR(command.request.calc("sequenceID"), SToInt(command.response.methodLine),
-                                          command.response["error"]));
+        s->send(MySQLPacket::serializeERR(sequenceID, SToInt(response.methodLine), response["error"]));
     }
 }
 
@@ -4,6 +4,43 @@
 #define MYSQL_NUM_VARIABLES 292
 extern const char* g_MySQLVariables[MYSQL_NUM_VARIABLES][2];
 
+// Column types, as sent in column definitions and COM_STMT_EXECUTE.
+// See: https://dev.mysql.com/doc/internals/en/com-query-response.html#column-type
+#define MYSQL_TYPE_TINY        0x01
+#define MYSQL_TYPE_SHORT       0x02
+#define MYSQL_TYPE_LONG        0x03
+#define MYSQL_TYPE_FLOAT       0x04
+#define MYSQL_TYPE_DOUBLE      0x05
+#define MYSQL_TYPE_NULL        0x06
+#define MYSQL_TYPE_TIMESTAMP   0x07
+#define MYSQL_TYPE_LONGLONG    0x08
+#define MYSQL_TYPE_INT24       0x09
+#define MYSQL_TYPE_DATE        0x0a
+#define MYSQL_TYPE_TIME        0x0b
+#define MYSQL_TYPE_DATETIME    0x0c
+#define MYSQL_TYPE_YEAR        0x0d
+#define MYSQL_TYPE_TINY_BLOB   0xf9
+#define MYSQL_TYPE_MEDIUM_BLOB 0xfa
+#define MYSQL_TYPE_LONG_BLOB   0xfb
+#define MYSQL_TYPE_BLOB        0xfc
+#define MYSQL_TYPE_VAR_STRING  0xfd
+
+// Column flags, and the character sets we describe columns with.
+#define MYSQL_FLAG_BLOB        0x0010
+#define MYSQL_FLAG_BINARY      0x0080
+#define MYSQL_FLAG_NUM         0x8000
+#define MYSQL_CHARSET_UTF8     33 // utf8_general_ci
+#define MYSQL_CHARSET_BINARY   63
+
+// Capability and status flags for multi-statement queries.
+#define MYSQL_CLIENT_MULTI_STATEMENTS    0x00010000
+#define MYSQL_CLIENT_MULTI_RESULTS       0x00020000
+#define MYSQL_SERVER_STATUS_AUTOCOMMIT   0x0002
+#define MYSQL_SERVER_MORE_RESULTS_EXISTS 0x0008
+
+// The most queries we'll combine into a single batched read.
+#define MYSQL_MAX_BATCH 64
+
 /**
   * Simple convenience structure to construct MySQL packets
   */
@@ -64,16 +101,48 @@ struct MySQLPacket {
      * @param result     The results of the query we were asked to execte
      * @return           A series of MySQL packets ready to be sent to the client
      */
-    static string serializeQueryResponse(int sequenceID, const SQResult& result);
+    static string serializeQueryResponse(int sequenceID, const SQResult& result, bool binaryProtocol = false);
+
+    /**
+     * Creates the packets used to respond to a COM_QUERY or COM_STMT_EXECUTE request from a result in the "binary"
+     * format written by SQResultWriter. Each column is described with the MySQL type matching the sqlite values in it,
+     * and rows are written directly from `data` without building an intermediate result.
+     * See: https://dev.mysql.com/doc/internals/en/binary-protocol-resultset.html
+     *
+     * @param sequenceID     The sequenceID of the last packet sent or received, updated to the last one written
+     * @param data           The result, as written by SQResultWriter("binary", ...)
+     * @param size           The size of the result
+     * @param binaryProtocol True to write rows in the binary protocol used by COM_STMT_EXECUTE, false for text
+     * @param moreResults    True if this is one of several results for a multi-statement query, and not the last
+     * @param output         The string to append the packets to
+     * @return               False if `data` couldn't be parsed
+     */
+    static bool serializeBinaryResult(int& sequenceID, const char* data, size_t size, bool binaryProtocol,
+                                      bool moreResults, string& output);
+
+    /**
+     * Creates the packets used to respond to a COM_STMT_PREPARE request
+     * See: https://dev.mysql.com/doc/internals/en/com-stmt-prepare-response.html
+     *
+     * @param sequenceID  The sequenceID of the request we are responding to
+     * @param statementID The ID the client will use to refer to this statement
+     * @param params      The number of placeholders in the statement
+     * @return            A series of MySQL packets ready to be sent to the client
+     */
+    static string serializePrepareOK(int sequenceID, uint32_t statementID, uint16_t params);
 
     /**
      * Creatse a standard OK packet
      * See: https://dev.mysql.com/doc/internals/en/packet-OK_Packet.html
      *
-     * @param sequenceID The sequenceID of the request we are responding to
-     * @return           The OK packet to be sent to the client
+     * @param sequenceID   The sequenceID of the request we are responding to
+     * @param affectedRows The number of rows changed by the request
+     * @param lastInsertID The rowid of the last row inserted by the request
+     * @param moreResults  True if this is one of several results for a multi-statement query, and not the last
+     * @return             The OK packet to be sent to the client
      */
-    static string serializeOK(int sequenceID);
+    static string serializeOK(int sequenceID, uint64_t affectedRows = 0, uint64_t lastInsertID = 0,
+                              bool moreResults = false);
 
     /**
      * Sends ERR
@@ -91,6 +160,8 @@ struct MySQLPacket {
  * Declare the class we're going to implement below
  */
 class BedrockPlugin_MySQL : public BedrockPlugin {
+    friend class MySQLTester;
+
   public:
     // Indicate which functions we are implementing
     virtual string getName() { return "MySQL"; }
@@ -101,8 +172,93 @@ class BedrockPlugin_MySQL : public BedrockPlugin {
     virtual void onPortAccept(STCPManager::Socket* s);
     virtual void onPortRecv(STCPManager::Socket* s, SData& request);
     virtual void onPortRequestComplete(const BedrockCommand& command, STCPManager::Socket* s);
+    virtual void onPortClose(STCPManager::Socket* s);
 
   private:
+    // A statement prepared with COM_STMT_PREPARE.
+    struct PreparedStatement {
+        // The query, and the offset of each '?' placeholder in it.
+        string query;
+        vector<size_t> placeholders;
+
+        // The parameter types sent with the last COM_STMT_EXECUTE, which the client only sends when they change.
+        vector<uint16_t> types;
+
+        // Parameter values sent in pieces by COM_STMT_SEND_LONG_DATA, used by the next COM_STMT_EXECUTE.
+        map<uint16_t, string> longData;
+    };
+
+    // Everything we keep for a single client connection.
+    struct Connection {
+        // Whether we've received the client's handshake response yet, and the capabilities it asked for in it.
+        bool authenticated = false;
+        uint32_t capabilities = 0;
+
+        // Prepared statements by ID.
+        map<uint32_t, PreparedStatement> statements;
+    };
+
+    // How a query can be answered without going to the DB plugin.
+    enum LocalAnswer {NOT_LOCAL, LOCAL_RESULT, LOCAL_OK};
+
+    /**
+     * Answers queries for variables and schema information, which clients send to find out about the server, and
+     * ignores the settings they change but we don't support.
+     *
+     * @param query  The query, as returned by _normalizeQuery
+     * @param result Set to the result to send, for LOCAL_RESULT
+     * @return       Whether and how the query was answered
+     */
+    static LocalAnswer _answerLocally(const string& query, SQResult& result);
+
+    // Trims a query, strips any leading comment, and makes sure it ends in ';' as the DB plugin requires.
+    static string _normalizeQuery(const string& query);
+
+    // Returns true for queries we can run as part of a batched read: a SELECT that isn't answered locally.
+    static bool _isBatchableRead(const string& query);
+
+    /**
+     * Splits the query of a COM_QUERY into its statements, if the client has multi-statement queries enabled.
+     *
+     * @param connection The connection the query came from
+     * @param query      The query, as sent
+     * @return           The normalized statements, of which there's always at least one
+     */
+    static vector<string> _splitStatements(const Connection& connection, const string& query);
+
+    /**
+     * Handles a query sent with COM_QUERY, or a prepared statement with its parameters filled in by COM_STMT_EXECUTE.
+     * Queries for variables and schema information are answered directly. Anything else is turned into a `Query`
+     * request for the DB plugin.
+     *
+     * @param s              The socket the query came from
+     * @param sequenceID     The sequenceID of the packet with the query
+     * @param statements     The statements to run, as returned by _splitStatements
+     * @param binaryProtocol True if the response should be in the binary protocol used by COM_STMT_EXECUTE
+     * @param request        Set to the `Query` request to queue, if there is one
+     */
+    void _processQuery(STCPManager::Socket* s, int sequenceID, const vector<string>& statements, bool binaryProtocol,
+                       SData& request);
+
+    /**
+     * Fills in the placeholders of a prepared statement with the parameters of a COM_STMT_EXECUTE packet.
+     * See: https://dev.mysql.com/doc/internals/en/com-stmt-execute.html
+     *
+     * @param statement The statement being executed
+     * @param payload   The COM_STMT_EXECUTE payload
+     * @return          The query to run, or an empty string if the payload couldn't be parsed
+     */
+    static string _bindParameters(PreparedStatement& statement, const string& payload);
+
+    // Returns the offset of each `c` in `query` that's not part of a string, identifier, or comment. Strings may
+    // escape their quotes by doubling them or with a backslash, as MySQL clients do by default.
+    static vector<size_t> _findUnquoted(const string& query, char c);
+
     // Attributes
     SData _args;
+
+    // Connections by socket ID, dropped when their socket closes.
+    mutex _connectionMutex;
+    map<uint64_t, Connection> _connections;
+    uint32_t _nextStatementID = 1;
 };
@@ -3,6 +3,19 @@
 
 #define DBINFO(_MSG_) SINFO("{" << _filename << "} " << _MSG_)
 
+// The number of prepared statements we'll keep cached per handle before discarding the least recently used ones.
+#define MAX_CACHED_STATEMENTS 100
+
+// The number of commits read or written at a time when creating or applying an incremental backup.
+#define INCREMENTAL_BACKUP_CHUNK 1000
+
+// Journaled changesets start with this, which isn't valid SQL, so that a peer too old to apply one fails loudly rather
+// than skipping it. The rest is the changeset in base64, followed by a semicolon like any other journal entry.
+#define CHANGESET_PREFIX "CHANGESET "
+
+// Changesets larger than this are journaled as their queries instead, which are likely to be much smaller.
+#define MAX_CHANGESET_SIZE (16 * 1024 * 1024)
+
 // Globally shared mutex for locking around commits and creating/destroying instances.
 recursive_mutex SQLite::_commitLock;
 
@@ -14,11 +27,69 @@ SLockTimer<recursive_mutex> SQLite::g_commitLock("Commit Lock", SQLite::_commitL
 
 atomic<int> SQLite::passiveCheckpointPageMin(2500); // Approx 10mb
 atomic<int> SQLite::fullCheckpointPageMin(25000); // Approx 100mb (pages are assumed to be 4kb)
+atomic<uint64_t> SQLite::passiveCheckpoints(0);
+atomic<uint64_t> SQLite::passiveCheckpointUS(0);
+atomic<uint64_t> SQLite::fullCheckpoints(0);
+atomic<uint64_t> SQLite::fullCheckpointUS(0);
+atomic<uint64_t> SQLite::commitConflicts(0);
+atomic<bool> SQLite::_writeTrackingEnabled(false);
+const int SQLite::HASH_VERSION_MAX;
+
+// Handles with a timed operation in progress, by deadline. A single thread sleeps until the earliest of these and sets
+// its flag, so checking for a timeout on the query path is just a load rather than a clock read.
+static mutex _deadlineMutex;
+static condition_variable _deadlineCV;
+static multimap<uint64_t, atomic<bool>*> _deadlines;
+static bool _deadlineThreadStarted = false;
+
+static void _deadlineLoop() {
+    SInitialize("deadlines");
+    unique_lock<mutex> lock(_deadlineMutex);
+    while (true) {
+        if (_deadlines.empty()) {
+            _deadlineCV.wait(lock);
+            continue;
+        }
+        uint64_t now = STimeNow();
+        auto it = _deadlines.begin();
+        if (it->first > now) {
+            // Woken early by a new, earlier deadline, or by one being removed, we just go around again.
+            _deadlineCV.wait_for(lock, chrono::microseconds(it->first - now));
+            continue;
+        }
+        it->second->store(true);
+        _deadlines.erase(it);
+    }
+}
+
+static void _deadlineAdd(uint64_t deadline, atomic<bool>* flag) {
+    lock_guard<mutex> lock(_deadlineMutex);
+    if (!_deadlineThreadStarted) {
+        // This lives for the life of the process, as any handle could start timing at any point.
+        thread(_deadlineLoop).detach();
+        _deadlineThreadStarted = true;
+    }
+    auto it = _deadlines.emplace(deadline, flag);
+    if (it == _deadlines.begin()) {
+        _deadlineCV.notify_one();
+    }
+}
+
+static void _deadlineRemove(uint64_t deadline, atomic<bool>* flag) {
+    lock_guard<mutex> lock(_deadlineMutex);
+    auto range = _deadlines.equal_range(deadline);
+    for (auto it = range.first; it != range.second; it++) {
+        if (it->second == flag) {
+            _deadlines.erase(it);
+            return;
+        }
+    }
+}
 
 SQLite::SQLite(const string& filename, int cacheSize, bool enableFullCheckpoints, int maxJournalSize, int journalTable,
                int maxRequiredJournalTableID, const string& synchronous) :
-    whitelist(nullptr),
     _maxJournalSize(maxJournalSize),
+    _uncommittedJournalTrim(0),
     _insideTransaction(false),
     _beginElapsed(0),
     _readElapsed(0),
@@ -26,12 +97,26 @@ SQLite::SQLite(const string& filename, int cacheSize, bool enableFullCheckpoints
     _prepareElapsed(0),
     _commitElapsed(0),
     _rollbackElapsed(0),
+    _pagesRead(0),
+    _commitLockedAt(0),
+    _commitLockHeldUS(0),
+    _authorizerRegistered(false),
+    _schemaChanged(false),
+    _whitelist(nullptr),
     _enableRewrite(false),
     _currentlyRunningRewritten(false),
+    _trackReads(false),
+    _lastWrittenTable(nullptr),
     _timeoutLimit(0),
+    _timedOut(false),
     _autoRolledBack(false),
     _noopUpdateMode(false),
-    _enableFullCheckpoints(enableFullCheckpoints)
+    _enableFullCheckpoints(enableFullCheckpoints),
+    _preparedTransactionCount(0),
+    _groupCommitWindow(0),
+    _session(nullptr),
+    _sessionFallback(false),
+    _changesetSchemaVersion(0)
 {
     // Perform sanity checks.
     SASSERT(!filename.empty());
@@ -99,8 +184,9 @@ SQLite::SQLite(const string& filename, int cacheSize, bool enableFullCheckpoints
     const int DB_WRITE_OPEN_FLAGS = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX;
     SASSERT(!sqlite3_open_v2(filename.c_str(), &_db, DB_WRITE_OPEN_FLAGS, NULL));
 
-    // Set a one-second timeout for automatic retries in case of SQLITE_BUSY.
-    sqlite3_busy_timeout(_db, 1000);
+    // Retry locks with a short backoff in case of SQLITE_BUSY, until the current command's deadline (see `startTiming`)
+    // or for one second.
+    sqlite3_busy_handler(_db, SQueryBusyHandler, nullptr);
 
     // WAL is what allows simultaneous read/writing.
     SASSERT(!SQuery(_db, "enabling write ahead logging", "PRAGMA journal_mode = WAL;"));
@@ -122,6 +208,9 @@ SQLite::SQLite(const string& filename, int cacheSize, bool enableFullCheckpoints
     // Do our own checkpointing.
     sqlite3_wal_hook(_db, _sqliteWALCallback, this);
 
+    // Track which tables (and, if someone's listening for them, rows) each transaction changes.
+    sqlite3_update_hook(_db, _sqliteUpdateCallback, this);
+
     // Update the cache. -size means KB; +size means pages
     SINFO("Setting cache_size to " << cacheSize << "KB");
     SQuery(_db, "increasing cache size", "PRAGMA cache_size = -" + SQ(cacheSize) + ";");
@@ -150,24 +239,30 @@ SQLite::SQLite(const string& filename, int cacheSize, bool enableFullCheckpoints
     }
 
     // We keep track of the number of rows in the journal, so that we can delete old entries when we're over our size
-    // limit.
-    // We want the min of all journal tables.
-    string minQuery = _getJournalQuery({"SELECT MIN(id) AS id FROM"}, true);
-    minQuery = "SELECT MIN(id) AS id FROM (" + minQuery + ")";
+    // limit. The initializer looks up how far back the journals go, and everyone else reuses that, as with many handles
+    // and many journal tables, looking it up on each would be a query across every table for every handle.
+    if (initializer) {
+        // We want the min of all journal tables.
+        string minQuery = _getJournalQuery({"SELECT MIN(id) AS id FROM"}, true);
+        minQuery = "SELECT MIN(id) AS id FROM (" + minQuery + ")";
 
-    // And the max.
-    string maxQuery = _getJournalQuery({"SELECT MAX(id) AS id FROM"}, true);
-    maxQuery = "SELECT MAX(id) AS id FROM (" + maxQuery + ")";
+        // And the max.
+        string maxQuery = _getJournalQuery({"SELECT MAX(id) AS id FROM"}, true);
+        maxQuery = "SELECT MAX(id) AS id FROM (" + maxQuery + ")";
 
-    // Look up the min and max values in the database.
-    SQResult result;
-    SASSERT(!SQuery(_db, "getting commit min", minQuery, result));
-    uint64_t min = SToUInt64(result[0][0]);
-    SASSERT(!SQuery(_db, "getting commit max", maxQuery, result));
-    uint64_t max = SToUInt64(result[0][0]);
+        // Look up the min and max values in the database.
+        SQResult result;
+        SASSERT(!SQuery(_db, "getting commit min", minQuery, result));
+        uint64_t min = SToUInt64(result[0][0]);
+        SASSERT(!SQuery(_db, "getting commit max", maxQuery, result));
+        uint64_t max = SToUInt64(result[0][0]);
+        _sharedData->_initialJournalMin = min;
+        SINFO("Journals span " << (max - min) << " commits.");
+    }
 
-    // And save the difference as the size of the journal.
-    _journalSize = max - min;
+    // Nothing older than the oldest row in any journal can be left in ours, so that's as far as we've trimmed.
+    const uint64_t min = _sharedData->_initialJournalMin;
+    _journalTrimmedThrough = min ? min - 1 : 0;
 
     // Now that the DB's all up and running, we can load our global data from it, if we're the initializer thread.
     if (initializer) {
@@ -186,26 +281,76 @@ SQLite::SQLite(const string& filename, int cacheSize, bool enableFullCheckpoints
         }
     }
 
-    // Register the authorizer callback which allows callers to whitelist particular data in the DB.
-    sqlite3_set_authorizer(_db, _sqliteAuthorizerCallback, this);
-
     // I tested and found that we could set about 10,000,000 and the number of steps to run and get a callback once a
-    // second. This is set to be a bit more granular than that, which is probably adequate.
-    sqlite3_progress_handler(_db, 1'000'000, _progressHandlerCallback, this);
+    // second. The callback only loads a flag set by the deadline thread, so we can afford to call it often enough to
+    // stop a query within about a millisecond of its deadline.
+    sqlite3_progress_handler(_db, 10'000, _progressHandlerCallback, this);
+}
+
+map<string, list<SQLite::CommitListener>>& SQLite::_commitListeners() {
+    static map<string, list<CommitListener>> listeners;
+    return listeners;
+}
+
+void SQLite::addCommitListener(const string& table, CommitListener listener) {
+    _commitListeners()[table].push_back(move(listener));
+}
+
+void SQLite::setCommitCountListener(CommitCountListener listener) {
+    SQLITE_COMMIT_AUTOLOCK;
+    _sharedData->commitCountListener = move(listener);
+}
+
+void SQLite::_sqliteUpdateCallback(void* data, int operation, const char* dbName, const char* table,
+                                   sqlite3_int64 rowID) {
+    if (strcmp(dbName, "main")) {
+        return;
+    }
+    SQLite* sqlite = static_cast<SQLite*>(data);
+    if (table != sqlite->_lastWrittenTable) {
+        sqlite->_lastWrittenTable = table;
+        sqlite->_writtenTables.emplace(table);
+    }
+    if (_commitListeners().empty()) {
+        return;
+    }
+    auto it = _commitListeners().find(table);
+    if (it != _commitListeners().end()) {
+        sqlite->_changedRows[it->first].insert(rowID);
+    }
+}
+
+void SQLite::_notifyCommitListeners(const map<string, set<int64_t>>* changedRows) {
+    // Whatever command committed may be about to run out of time, but a listener's reads aren't part of it, and
+    // throwing out of them would leave the listener half-updated.
+    uint64_t timeoutLimit = _timeoutLimit;
+    _timeoutLimit = 0;
+    for (auto& table : _commitListeners()) {
+        const set<int64_t>* rowIDs = nullptr;
+        if (changedRows) {
+            auto it = changedRows->find(table.first);
+            if (it == changedRows->end()) {
+                continue;
+            }
+            rowIDs = &it->second;
+        }
+        for (auto& listener : table.second) {
+            try {
+                listener(*this, rowIDs);
+            } catch (const exception& e) {
+                SWARN("Commit listener for table '" << table.first << "' threw: " << e.what());
+            }
+        }
+    }
+    _timeoutLimit = timeoutLimit;
 }
 
 int SQLite::_progressHandlerCallback(void* arg) {
     SQLite* sqlite = static_cast<SQLite*>(arg);
-    uint64_t now = STimeNow();
-    if (sqlite->_timeoutLimit && now > sqlite->_timeoutLimit) {
-        // Timeout! We don't throw here, we let `read` and `write` do it so we don't throw out of the middle of a
-        // sqlite3 operation.
-        sqlite->_timeoutError = now - sqlite->_timeoutStart;
 
-        // Return non-zero causes sqlite to interrupt the operation.
-        return 1;
-    }
-    return 0;
+    // Timeout! We don't throw here, we let `read` and `write` do it (in `_checkTiming`) so we don't throw out of the
+    // middle of a sqlite3 operation. Returning non-zero causes sqlite to interrupt the operation.
+    return sqlite->_timeoutLimit && sqlite->_timedOut.load(memory_order_relaxed);
 }
 
 void SQLite::_sqliteLogCallback(void* pArg, int iErrCode, const char* zMsg) {
@@ -222,13 +367,14 @@ int SQLite::_sqliteWALCallback(void* data, sqlite3* db, const char* dbName, int
             SINFO("[checkpoint] skipping checkpoint with " << pageCount
                   << " pages in WAL file (checkpoint every " << passive << " pages).");
         } else {
-            int walSizeFrames = 0;
-            int framesCheckpointed = 0;
-            uint64_t start = STimeNow();
-            int result = sqlite3_wal_checkpoint_v2(db, dbName, SQLITE_CHECKPOINT_PASSIVE, &walSizeFrames, &framesCheckpointed);
-            SINFO("[checkpoint] passive checkpoint complete with " << pageCount
-                  << " pages in WAL file. Result: " << result << ". Total frames checkpointed: "
-                  << framesCheckpointed << " of " << walSizeFrames << " in " << ((STimeNow() - start) / 1000) << "ms.");
+            // Hand this off to the checkpoint thread, starting it if this is the first one.
+            SharedData* sharedData = object->_sharedData;
+            lock_guard<mutex> lock(sharedData->checkpointMutex);
+            if (!sharedData->checkpointThread.joinable()) {
+                sharedData->checkpointThread = thread(_passiveCheckpointThread, sharedData, object->_filename);
+            }
+            sharedData->checkpointPagesPending = pageCount;
+            sharedData->checkpointCV.notify_one();
         }
     } else {
         // If we get here, then full checkpoints are enabled, and we have enough pages in the WAL file to perform one.
@@ -276,9 +422,12 @@ int SQLite::_sqliteWALCallback(void* data, sqlite3* db, const char* dbName, int
                     int walSizeFrames = 0;
                     int framesCheckpointed = 0;
                     int result = sqlite3_wal_checkpoint_v2(object->_db, dbNameCopy.c_str(), SQLITE_CHECKPOINT_RESTART, &walSizeFrames, &framesCheckpointed);
+                    uint64_t elapsed = STimeNow() - checkpointStart;
+                    fullCheckpoints++;
+                    fullCheckpointUS += elapsed;
                     SINFO("[checkpoint] restart checkpoint complete. Result: " << result << ". Total frames checkpointed: "
                           << framesCheckpointed << " of " << walSizeFrames
-                          << " in " << ((STimeNow() - checkpointStart) / 1000) << "ms.");
+                          << " in " << (elapsed / 1000) << "ms.");
 
                     // We're done. Unlock and anyone can start a new transaction.
                     object->_sharedData->blockNewTransactionsMutex.unlock();
@@ -294,6 +443,41 @@ int SQLite::_sqliteWALCallback(void* data, sqlite3* db, const char* dbName, int
     return SQLITE_OK;
 }
 
+void SQLite::_passiveCheckpointThread(SharedData* data, string filename) {
+    SInitialize("checkpoint");
+    sqlite3* db = nullptr;
+    if (sqlite3_open_v2(filename.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL)) {
+        SWARN("[checkpoint] Couldn't open '" << filename << "' for checkpointing: " << sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+    unique_lock<mutex> lock(data->checkpointMutex);
+    while (true) {
+        data->checkpointCV.wait(lock, [data]() { return data->checkpointThreadExit || data->checkpointPagesPending; });
+        if (data->checkpointThreadExit) {
+            break;
+        }
+        int pageCount = data->checkpointPagesPending;
+        data->checkpointPagesPending = 0;
+        lock.unlock();
+
+        // A passive checkpoint copies as much of the WAL as it can without waiting on any reader or writer.
+        int walSizeFrames = 0;
+        int framesCheckpointed = 0;
+        uint64_t start = STimeNow();
+        int result = sqlite3_wal_checkpoint_v2(db, nullptr, SQLITE_CHECKPOINT_PASSIVE, &walSizeFrames, &framesCheckpointed);
+        uint64_t elapsed = STimeNow() - start;
+        passiveCheckpoints++;
+        passiveCheckpointUS += elapsed;
+        SINFO("[checkpoint] passive checkpoint complete with " << pageCount
+              << " pages in WAL file. Result: " << result << ". Total frames checkpointed: "
+              << framesCheckpointed << " of " << walSizeFrames << " in " << (elapsed / 1000) << "ms.");
+        lock.lock();
+    }
+    lock.unlock();
+    sqlite3_close(db);
+}
+
 string SQLite::_getJournalQuery(const list<string>& queryParts, bool append) {
     list<string> queries;
     for (const string& name : _sharedData->_journalNames) {
@@ -313,6 +497,11 @@ string SQLite::_getJournalTableName(int journalTableID) {
 }
 
 SQLite::~SQLite() {
+    // Don't leave the deadline thread holding a pointer to us.
+    if (_timeoutLimit) {
+        _deadlineRemove(_timeoutLimit, &_timedOut);
+    }
+
     // Lock around changes to the global shared list.
     SQLITE_COMMIT_AUTOLOCK;
     
@@ -332,6 +521,10 @@ SQLite::~SQLite() {
         rollback();
     }
 
+    // sqlite3_close fails if there are any unfinalized statements or sessions on the handle.
+    _endSession();
+    _clearStatementCache();
+
     // Finally, Close the DB.
     DBINFO("Closing database '" << _filename << ".");
     SASSERTWARN(_uncommittedQuery.empty());
@@ -343,6 +536,70 @@ void SQLite::waitForCheckpoint() {
     lock_guard<mutex> lock(_sharedData->blockNewTransactionsMutex);
 }
 
+void SQLite::setMmapSize(int64_t bytes) {
+    SASSERT(!_insideTransaction);
+    SINFO("Setting mmap_size to " << bytes << " bytes");
+    SASSERT(!SQuery(_db, "setting mmap size", "PRAGMA mmap_size = " + SQ(bytes) + ";"));
+}
+
+void SQLite::_updateCacheStats() {
+    int hits = 0;
+    int misses = 0;
+    int ignore = 0;
+    sqlite3_db_status(_db, SQLITE_DBSTATUS_CACHE_HIT, &hits, &ignore, 1);
+    sqlite3_db_status(_db, SQLITE_DBSTATUS_CACHE_MISS, &misses, &ignore, 1);
+    _sharedData->cacheHits += hits;
+    _sharedData->cacheMisses += misses;
+    _pagesRead += misses;
+}
+
+void SQLite::enableGroupCommit(uint64_t windowUS) {
+    SASSERT(!_insideTransaction);
+    SASSERT(windowUS);
+
+    // In WAL mode, NORMAL syncs on checkpoints but not commits, which leaves syncing commits to us.
+    SASSERT(!SQuery(_db, "disabling commit syncs for group commit", "PRAGMA synchronous = NORMAL;"));
+    _groupCommitWindow = windowUS;
+    DBINFO("Group commit enabled with a " << windowUS << "us window.");
+}
+
+void SQLite::_waitForGroupSync(uint64_t commitCount) {
+    unique_lock<mutex> lock(_sharedData->syncMutex);
+    while (_sharedData->syncedCommitCount < commitCount) {
+        if (_sharedData->syncInProgress) {
+            // Somebody else is syncing. Their sync may or may not include our commit, so we check again when they're
+            // done.
+            _sharedData->syncCV.wait(lock);
+            continue;
+        }
+
+        // Nobody is syncing, so we do it. We wait out the window first to give other commits a chance to join us.
+        _sharedData->syncInProgress = true;
+        lock.unlock();
+        this_thread::sleep_for(chrono::microseconds(_groupCommitWindow));
+
+        // Every commit through this count has finished writing to the WAL, so syncing the WAL now makes all of them
+        // durable. Syncing any handle to the file flushes it regardless of which connection wrote it. Checkpoints
+        // sync the database file themselves, so commits that have been checkpointed out of the WAL are covered too.
+        const uint64_t syncThrough = _sharedData->_commitCount.load();
+        uint64_t before = STimeNow();
+        sqlite3_file* pWal = 0;
+        sqlite3_file_control(_db, "main", SQLITE_FCNTL_JOURNAL_POINTER, &pWal);
+        int result = (pWal && pWal->pMethods) ? pWal->pMethods->xSync(pWal, SQLITE_SYNC_NORMAL) : SQLITE_ERROR;
+        if (result != SQLITE_OK) {
+            // These commits are already visible to everyone, and we can't take them back, so continuing without
+            // knowing whether they're on disk isn't safe.
+            SERROR("Unable to sync WAL for group commit through #" << syncThrough << ", error: " << result);
+        }
+        SINFO("Group commit synced WAL through #" << syncThrough << " in " << ((STimeNow() - before) / 1000) << "ms.");
+
+        lock.lock();
+        _sharedData->syncInProgress = false;
+        _sharedData->syncedCommitCount = max(_sharedData->syncedCommitCount, syncThrough);
+        _sharedData->syncCV.notify_all();
+    }
+}
+
 bool SQLite::beginTransaction() {
     SASSERT(!_insideTransaction);
     SASSERT(_uncommittedHash.empty());
@@ -353,9 +610,15 @@ bool SQLite::beginTransaction() {
     }
     _sharedData->blockNewTransactionsCV.notify_one();
     SDEBUG("Beginning transaction");
+    if (_writeTrackingEnabled.load()) {
+        _registerAuthorizer();
+    }
     uint64_t before = STimeNow();
     _insideTransaction = !SQuery(_db, "starting db transaction", "BEGIN TRANSACTION");
     _beginElapsed = STimeNow() - before;
+    if (_insideTransaction) {
+        _beginSession();
+    }
     _readElapsed = 0;
     _writeElapsed = 0;
     _prepareElapsed = 0;
@@ -374,9 +637,15 @@ bool SQLite::beginConcurrentTransaction() {
     }
     _sharedData->blockNewTransactionsCV.notify_one();
     SDEBUG("[concurrent] Beginning transaction");
+    if (_writeTrackingEnabled.load()) {
+        _registerAuthorizer();
+    }
     uint64_t before = STimeNow();
     _insideTransaction = !SQuery(_db, "starting db transaction", "BEGIN CONCURRENT");
     _beginElapsed = STimeNow() - before;
+    if (_insideTransaction) {
+        _beginSession();
+    }
     _readElapsed = 0;
     _writeElapsed = 0;
     _prepareElapsed = 0;
@@ -452,11 +721,125 @@ bool SQLite::read(const string& query, SQResult& result) {
     return queryResult;
 }
 
+bool SQLite::read(const string& query, SQResultWriter& output) {
+    uint64_t before = STimeNow();
+    bool queryResult = !SQuery(_db, "read only query", query, output);
+    _checkTiming("timeout in SQLite::read"s);
+    _readElapsed += STimeNow() - before;
+    return queryResult;
+}
+
+bool SQLite::read(const string& query, SQTypedResult& result) {
+    uint64_t before = STimeNow();
+    bool queryResult = !SQuery(_db, "read only query", query, result);
+    _checkTiming("timeout in SQLite::read"s);
+    _readElapsed += STimeNow() - before;
+    return queryResult;
+}
+
+bool SQLite::read(const string& query, const list<string>& params, SQResult& result) {
+    uint64_t before = STimeNow();
+    bool queryResult = false;
+    sqlite3_stmt* statement = _getStatement(query, params);
+    if (statement) {
+        queryResult = !SQuery(_db, "read only query", statement, result);
+        _releaseStatement(query, statement);
+    }
+    _checkTiming("timeout in SQLite::read"s);
+    _readElapsed += STimeNow() - before;
+    return queryResult;
+}
+
+sqlite3_stmt* SQLite::_getStatement(const string& query, const list<string>& params, const set<size_t>& blobParams) {
+    // Both query re-writing and the whitelist are implemented in the authorizer, which sqlite only calls when a
+    // statement is prepared, not each time it's run. We can't re-use statements in either of those modes, so we
+    // prepare a fresh one that _releaseStatement will finalize.
+    const bool useCache = !_whitelist && !_enableRewrite && !_trackReads;
+    sqlite3_stmt* statement = nullptr;
+    auto cacheIt = useCache ? _statementCache.find(query) : _statementCache.end();
+    if (cacheIt != _statementCache.end()) {
+        // Move this statement to the front of the list, as it's now the most recently used.
+        _statementList.splice(_statementList.begin(), _statementList, cacheIt->second);
+        statement = cacheIt->second->statement;
+        sqlite3_clear_bindings(statement);
+        _writtenTables.insert(cacheIt->second->writtenTables.begin(), cacheIt->second->writtenTables.end());
+    } else {
+        _preparedWrites.clear();
+        int error = sqlite3_prepare_v2(_db, query.c_str(), query.size(), &statement, nullptr);
+        if (error || !statement) {
+            // A denial from the rewrite handler is expected, the caller will run the re-written query.
+            if (!_enableRewrite || error != SQLITE_AUTH) {
+                SWARN("Couldn't prepare statement, error #" << error << " (" << sqlite3_errmsg(_db) << "): " << query);
+            }
+            sqlite3_finalize(statement);
+            return nullptr;
+        }
+        if (useCache) {
+            _statementList.push_front({query, statement, move(_preparedWrites)});
+            _statementCache[query] = _statementList.begin();
+            _preparedWrites.clear();
+
+            // If we've exceeded our cache size, discard the least recently used statement.
+            if (_statementList.size() > MAX_CACHED_STATEMENTS) {
+                sqlite3_finalize(_statementList.back().statement);
+                _statementCache.erase(_statementList.back().query);
+                _statementList.pop_back();
+            }
+        }
+    }
+
+    // Bind our parameters, in order.
+    int index = 1;
+    for (const string& param : params) {
+        const int error = blobParams.count(index - 1)
+                          ? sqlite3_bind_blob(statement, index, param.data(), param.size(), SQLITE_TRANSIENT)
+                          : sqlite3_bind_text(statement, index, param.c_str(), param.size(), SQLITE_TRANSIENT);
+        if (error) {
+            SWARN("Couldn't bind parameter #" << index << " (" << sqlite3_errmsg(_db) << "): " << query);
+            _releaseStatement(query, statement);
+            return nullptr;
+        }
+        index++;
+    }
+    if (index - 1 != sqlite3_bind_parameter_count(statement)) {
+        SWARN("Got " << (index - 1) << " parameters for " << sqlite3_bind_parameter_count(statement)
+              << " placeholders: " << query);
+        _releaseStatement(query, statement);
+        return nullptr;
+    }
+    return statement;
+}
+
+void SQLite::_releaseStatement(const string& query, sqlite3_stmt* statement) {
+    // Cached statements stay around to be re-used, anything else is done now.
+    auto cacheIt = _statementCache.find(query);
+    if (cacheIt == _statementCache.end() || cacheIt->second->statement != statement) {
+        sqlite3_finalize(statement);
+    }
+}
+
+void SQLite::_clearStatementCache() {
+    for (auto& entry : _statementList) {
+        sqlite3_finalize(entry.statement);
+    }
+    _statementList.clear();
+    _statementCache.clear();
+}
+
+uint64_t SQLite::_getSchemaVersion() {
+    SQResult results;
+    sqlite3_stmt* statement = _getStatement("PRAGMA schema_version;", {});
+    SASSERT(statement);
+    SASSERT(!SQuery(_db, "looking up schema version", statement, results));
+    _releaseStatement("PRAGMA schema_version;", statement);
+    SASSERT(!results.empty() && !results[0].empty());
+    return SToUInt64(results[0][0]);
+}
+
 void SQLite::_checkTiming(const string& error) {
     if (_timeoutLimit) {
-        uint64_t now = STimeNow();
-        if (now > _timeoutLimit) {
-            _timeoutError = now - _timeoutStart;
+        if (_timedOut.load(memory_order_relaxed)) {
+            _timeoutError = STimeNow() - _timeoutStart;
         }
         if (_timeoutError) {
             uint64_t time = _timeoutError;
@@ -487,10 +870,22 @@ bool SQLite::write(const string& query) {
     return _writeIdempotent(query);
 }
 
+bool SQLite::write(const string& query, const list<string>& params, const set<size_t>& blobParams) {
+    if (_noopUpdateMode) {
+        SALERT("Non-idempotent write in _noopUpdateMode. Query: " << query);
+        return true;
+    }
+    return _writeIdempotent(query, params, blobParams);
+}
+
 bool SQLite::writeIdempotent(const string& query) {
     return _writeIdempotent(query);
 }
 
+bool SQLite::writeIdempotent(const string& query, const list<string>& params, const set<size_t>& blobParams) {
+    return _writeIdempotent(query, params, blobParams);
+}
+
 bool SQLite::writeUnmodified(const string& query) {
     return _writeIdempotent(query, true);
 }
@@ -498,13 +893,20 @@ bool SQLite::writeUnmodified(const string& query) {
 bool SQLite::_writeIdempotent(const string& query, bool alwaysKeepQueries) {
     SASSERT(_insideTransaction);
     SASSERT(query.empty() || SEndsWith(query, ";"));                        // Must finish everything with semicolon
+
+    // Queries we're told to keep as they are came from a peer, and are journaled exactly as we got them, so there's no
+    // point in recording a changeset of our own.
+    if (alwaysKeepQueries) {
+        _endSession();
+        _sessionFallback = true;
+        if (SStartsWith(query, CHANGESET_PREFIX)) {
+            return _applyChangeset(query);
+        }
+    }
     SASSERTWARN(SToUpper(query).find("CURRENT_TIMESTAMP") == string::npos); // Else will be replayed wrong
 
     // First, check our current state
-    SQResult results;
-    SASSERT(!SQuery(_db, "looking up schema version", "PRAGMA schema_version;", results));
-    SASSERT(!results.empty() && !results[0].empty());
-    uint64_t schemaBefore = SToUInt64(results[0][0]);
+    uint64_t schemaBefore = _getSchemaVersion();
     uint64_t changesBefore = sqlite3_total_changes(_db);
 
     // Try to execute the query
@@ -533,11 +935,18 @@ bool SQLite::_writeIdempotent(const string& query, bool alwaysKeepQueries) {
     }
 
     // See if the query changed anything
-    SASSERT(!SQuery(_db, "looking up schema version", "PRAGMA schema_version;", results));
-    SASSERT(!results.empty() && !results[0].empty());
-    uint64_t schemaAfter = SToUInt64(results[0][0]);
+    uint64_t schemaAfter = _getSchemaVersion();
     uint64_t changesAfter = sqlite3_total_changes(_db);
 
+    // sqlite will re-prepare statements that are invalidated by a schema change on their next run, but there's no
+    // point in holding onto them when this handle is the one that changed the schema. Sessions don't record schema
+    // changes, so this transaction can't be journaled as a changeset.
+    if (schemaAfter > schemaBefore) {
+        _clearStatementCache();
+        _sessionFallback = true;
+        _schemaChanged = true;
+    }
+
     // If something changed, or we're always keeping queries, then save this.
     if (alwaysKeepQueries || (schemaAfter > schemaBefore) || (changesAfter > changesBefore)) {
         _uncommittedQuery += usedRewrittenQuery ? _rewrittenQuery : query;
@@ -545,12 +954,206 @@ bool SQLite::_writeIdempotent(const string& query, bool alwaysKeepQueries) {
     return true;
 }
 
+bool SQLite::_writeIdempotent(const string& query, const list<string>& params, const set<size_t>& blobParams) {
+    SASSERT(_insideTransaction);
+    SASSERTWARN(SToUpper(query).find("CURRENT_TIMESTAMP") == string::npos); // Else will be replayed wrong
+
+    // First, check our current state
+    uint64_t schemaBefore = _getSchemaVersion();
+    uint64_t changesBefore = sqlite3_total_changes(_db);
+
+    // Try to execute the query. What we record in the journal is the query with all of its values expanded, so that
+    // peers don't need to know anything about the parameters.
+    uint64_t before = STimeNow();
+    bool result = false;
+    string journalQuery;
+    sqlite3_stmt* statement = _getStatement(query, params, blobParams);
+    if (statement) {
+        char* expanded = sqlite3_expanded_sql(statement);
+        if (expanded) {
+            journalQuery = expanded;
+            sqlite3_free(expanded);
+            SQResult ignore;
+            result = !SQuery(_db, "read/write transaction", statement, ignore);
+        } else {
+            SWARN("Couldn't expand parameterized query: " << query);
+        }
+        _releaseStatement(query, statement);
+    } else if (_enableRewrite && sqlite3_errcode(_db) == SQLITE_AUTH) {
+        // The rewrite handler denied this query, run the re-written query in its place.
+        _currentlyRunningRewritten = true;
+        SASSERT(SEndsWith(_rewrittenQuery, ";"));
+        result = !SQuery(_db, "read/write transaction", _rewrittenQuery);
+        journalQuery = _rewrittenQuery;
+        _currentlyRunningRewritten = false;
+    }
+    _checkTiming("timeout in SQLite::write"s);
+    _writeElapsed += STimeNow() - before;
+    if (!result) {
+        return false;
+    }
+
+    // See if the query changed anything
+    uint64_t schemaAfter = _getSchemaVersion();
+    uint64_t changesAfter = sqlite3_total_changes(_db);
+    if (schemaAfter > schemaBefore) {
+        _clearStatementCache();
+        _sessionFallback = true;
+        _schemaChanged = true;
+    }
+
+    // If something changed, then save this. Journal queries are always terminated with a semicolon.
+    if ((schemaAfter > schemaBefore) || (changesAfter > changesBefore)) {
+        if (!SEndsWith(journalQuery, ";")) {
+            journalQuery += ";";
+        }
+        _uncommittedQuery += journalQuery;
+    }
+    return true;
+}
+
+string SQLite::getTransactionHash(const string& previousHash, const string& query, int version) {
+    if (version >= 2) {
+        return SToHex(SHashSHA256(previousHash + SHashSHA256(query)));
+    }
+    return SToHex(SHashSHA1(previousHash + query));
+}
+
+void SQLite::setHashVersion(int version) {
+    version = max(1, min(version, HASH_VERSION_MAX));
+    if (_sharedData->hashVersion.exchange(version) != version) {
+        SINFO("Now preparing commits with hash version " << version << ".");
+    }
+}
+
+void SQLite::setChangesets(bool enable) {
+    if (_sharedData->changesets.exchange(enable) != enable) {
+        SINFO("Now journaling new commits as " << (enable ? "changesets" : "queries") << ".");
+    }
+}
+
+void SQLite::_beginSession() {
+    _sessionTables.clear();
+    _sessionFallback = false;
+    if (!_sharedData->changesets.load()) {
+        return;
+    }
+    if (sqlite3session_create(_db, "main", &_session) != SQLITE_OK) {
+        SWARN("Couldn't create session, journaling queries: " << sqlite3_errmsg(_db));
+        _session = nullptr;
+        return;
+    }
+    sqlite3session_table_filter(_session, _sessionTableFilter, this);
+    if (sqlite3session_attach(_session, nullptr) != SQLITE_OK) {
+        SWARN("Couldn't attach session, journaling queries: " << sqlite3_errmsg(_db));
+        _endSession();
+    }
+}
+
+void SQLite::_endSession() {
+    if (_session) {
+        sqlite3session_delete(_session);
+        _session = nullptr;
+    }
+}
+
+int SQLite::_sessionTableFilter(void* data, const char* table) {
+    SQLite* db = static_cast<SQLite*>(data);
+    for (const string& journal : db->_sharedData->_journalNames) {
+        if (journal == table) {
+            return 0;
+        }
+    }
+    db->_sessionTables.insert(table);
+    return 1;
+}
+
+void SQLite::_journalChangeset() {
+    if (!_session) {
+        return;
+    }
+
+    // Sessions ignore rows in tables without a primary key, and applying a changeset runs triggers again on top of
+    // the changes they made the first time, so any table like that means journaling the queries. We look each table
+    // up once per schema version.
+    if (!_sessionFallback && !_uncommittedQuery.empty()) {
+        const uint64_t schemaVersion = _getSchemaVersion();
+        if (schemaVersion != _changesetSchemaVersion) {
+            _changesetTables.clear();
+            _changesetSchemaVersion = schemaVersion;
+        }
+        for (const string& table : _sessionTables) {
+            auto it = _changesetTables.find(table);
+            if (it == _changesetTables.end()) {
+                SQResult columns, triggers;
+                bool supported = !SQuery(_db, "checking table for changesets", "PRAGMA table_info(" + SQ(table) + ");",
+                                         columns) &&
+                                 !SQuery(_db, "checking table for changesets",
+                                         "SELECT 1 FROM sqlite_master WHERE type = 'trigger' AND tbl_name = " +
+                                         SQ(table) + " LIMIT 1;", triggers) &&
+                                 triggers.empty();
+                bool hasPrimaryKey = false;
+                for (const auto& column : columns.rows) {
+                    hasPrimaryKey = hasPrimaryKey || (column.size() > 5 && column[5] != "0");
+                }
+                it = _changesetTables.emplace(table, supported && hasPrimaryKey).first;
+            }
+            if (!it->second) {
+                _sessionFallback = true;
+                break;
+            }
+        }
+    }
+    if (!_sessionFallback && !_uncommittedQuery.empty()) {
+        int size = 0;
+        void* changeset = nullptr;
+        if (sqlite3session_changeset(_session, &size, &changeset) == SQLITE_OK && size > 0 &&
+            size <= MAX_CHANGESET_SIZE) {
+            _uncommittedQuery = CHANGESET_PREFIX + SEncodeBase64((unsigned char*)changeset, size) + ";";
+        }
+        sqlite3_free(changeset);
+    }
+    _endSession();
+}
+
+bool SQLite::_applyChangeset(const string& query) {
+    const size_t prefixSize = strlen(CHANGESET_PREFIX);
+    const string changeset = SDecodeBase64(query.substr(prefixSize, query.size() - prefixSize - 1));
+
+    // Any conflict means our database doesn't match the one the changeset was recorded on, so we give up on it, the
+    // same as if a query had failed. The changeset runs in a savepoint, so nothing it did is left behind.
+    auto onConflict = [](void*, int conflict, sqlite3_changeset_iter*) {
+        SWARN("Changeset conflict #" << conflict << ", aborting.");
+        return SQLITE_CHANGESET_ABORT;
+    };
+    uint64_t before = STimeNow();
+    int result = sqlite3changeset_apply(_db, changeset.size(), (void*)changeset.data(), nullptr, onConflict, nullptr);
+    _writeElapsed += STimeNow() - before;
+    if (result != SQLITE_OK) {
+        SWARN("Couldn't apply changeset, error #" << result << " (" << sqlite3_errmsg(_db) << ").");
+        return false;
+    }
+    _uncommittedQuery += query;
+    return true;
+}
+
 bool SQLite::prepare() {
     SASSERT(_insideTransaction);
 
+    // If we've been recording this transaction's changes, they're what we journal.
+    _journalChangeset();
+
+    // With version 2 hashes, the query is hashed on its own, so we can do it now before anyone has to wait on us.
+    const int hashVersion = _sharedData->hashVersion.load();
+    const string queryDigest = hashVersion >= 2 ? SHashSHA256(_uncommittedQuery) : "";
+
+    // Same for trimming the journal, which only we write to.
+    _trimJournal();
+
     // We lock this here, so that we can guarantee the order in which commits show up in the database.
     g_commitLock.lock();
     _mutexLocked = true;
+    _commitLockedAt = STimeNow();
 
     // Now that we've locked anybody else from committing, look up the state of the database.
     string committedQuery, committedHash;
@@ -558,16 +1161,28 @@ bool SQLite::prepare() {
 
     // Queue up the journal entry
     string lastCommittedHash = getCommittedHash();
-    _uncommittedHash = SToHex(SHashSHA1(lastCommittedHash + _uncommittedQuery));
+    if (hashVersion >= 2) {
+        _uncommittedHash = SToHex(SHashSHA256(lastCommittedHash + queryDigest));
+    } else {
+        _uncommittedHash = SToHex(SHashSHA1(lastCommittedHash + _uncommittedQuery));
+    }
     uint64_t before = STimeNow();
 
-    // Crete our query.
-    string query = "INSERT INTO " + _journalName + " VALUES (" + SQ(commitCount + 1) + ", " + SQ(_uncommittedQuery) + ", " + SQ(_uncommittedHash) + " )";
+    // Crete our query. This runs on every commit, so we use a cached statement rather than escaping the entire
+    // transaction into a new query string each time.
+    const string query = "INSERT INTO " + _journalName + " VALUES (?, ?, ?);";
+    sqlite3_stmt* statement = _getStatement(query, {SToStr(commitCount + 1), _uncommittedQuery, _uncommittedHash});
 
     // These are the values we're currently operating on, until we either commit or rollback.
     _sharedData->_inFlightTransactions[commitCount + 1] = make_pair(_uncommittedQuery, _uncommittedHash);
+    _preparedTransactionCount = 1;
 
-    int result = SQuery(_db, "updating journal", query);
+    int result = SQLITE_ERROR;
+    if (statement) {
+        SQResult ignore;
+        result = SQuery(_db, "updating journal", statement, ignore);
+        _releaseStatement(query, statement);
+    }
     _prepareElapsed += STimeNow() - before;
     if (result) {
         // Couldn't insert into the journal; roll back the original commit
@@ -583,33 +1198,35 @@ bool SQLite::prepare() {
     return true;
 }
 
+void SQLite::_trimJournal() {
+    // Trim the journal a segment at a time, rather than a few rows with every commit. Once the journal has grown
+    // past its maximum size, one ranged delete on the primary key drops everything older than the newest
+    // `_maxJournalSize` commits. Only this handle writes to its journal, so this can't conflict with other threads,
+    // and can run before taking the commit lock so that nobody else waits on it. While other transactions are
+    // running, we let the journal grow a few more segments first, so trimming happens in larger batches when things
+    // are quieter. As we know exactly where we trimmed to, there's no need to look up the new bounds afterward.
+    const uint64_t newestID = _sharedData->_commitCount.load();
+    const uint64_t segmentSize = _maxJournalSize / 100 + 1;
+    const uint64_t allowance = segmentSize * (_sharedData->currentTransactionCount.load() > 1 ? 10 : 1);
+    if (newestID <= _journalTrimmedThrough + _maxJournalSize + allowance) {
+        return;
+    }
+    uint64_t before = STimeNow();
+    const string query = "DELETE FROM " + _journalName + " WHERE id <= ?;";
+    sqlite3_stmt* statement = _getStatement(query, {SToStr(newestID - _maxJournalSize)});
+    SASSERT(statement);
+    SQResult ignore;
+    SASSERT(!SQuery(_db, "Deleting oldest journal segment", statement, ignore));
+    _releaseStatement(query, statement);
+    _uncommittedJournalTrim = newestID - _maxJournalSize;
+    _writeElapsed += STimeNow() - before;
+}
+
 int SQLite::commit() {
     SASSERT(_insideTransaction);
     SASSERT(!_uncommittedHash.empty()); // Must prepare first
     int result = 0;
 
-    // Do we need to truncate as we go?
-    uint64_t newJournalSize = _journalSize + 1;
-    if (newJournalSize > _maxJournalSize) {
-        // Delete the oldest entry
-        uint64_t before = STimeNow();
-        string query = "DELETE FROM " + _journalName + " "
-                       "WHERE id < (SELECT MAX(id) FROM " + _journalName + ") - " + SQ(_maxJournalSize) + " "
-                       "LIMIT 10";
-        SASSERT(!SQuery(_db, "Deleting oldest journal rows", query));
-
-        // Figure out the new journal size.
-        SQResult result;
-        SASSERT(!SQuery(_db, "getting commit min", "SELECT MIN(id) AS id FROM " + _journalName, result));
-        uint64_t min = SToUInt64(result[0][0]);
-        SASSERT(!SQuery(_db, "getting commit max", "SELECT MAX(id) AS id FROM " + _journalName, result));
-        uint64_t max = SToUInt64(result[0][0]);
-        newJournalSize = max - min;
-
-        // Log timing info.
-        _writeElapsed += STimeNow() - before;
-    }
-
     // Make sure one is ready to commit
     SDEBUG("Committing transaction");
 
@@ -639,9 +1256,17 @@ int SQLite::commit() {
     SASSERT(result == SQLITE_OK || result == SQLITE_BUSY_SNAPSHOT);
     if (result == SQLITE_OK) {
         _commitElapsed += STimeNow() - before;
-        _journalSize = newJournalSize;
-        _sharedData->_commitCount++;
-        _sharedData->_committedTransactionIDs.insert(_sharedData->_commitCount.load());
+        _updateCacheStats();
+        if (_uncommittedJournalTrim) {
+            _journalTrimmedThrough = _uncommittedJournalTrim;
+            _uncommittedJournalTrim = 0;
+        }
+        for (uint64_t i = 0; i < _preparedTransactionCount; i++) {
+            _sharedData->_commitCount++;
+            _sharedData->_committedTransactionIDs.insert(_sharedData->_commitCount.load());
+        }
+        _preparedTransactionCount = 0;
+        const uint64_t commitCount = _sharedData->_commitCount.load();
         _sharedData->_lastCommittedHash.store(_uncommittedHash);
         SDEBUG("Commit successful (" << _sharedData->_commitCount.load() << "), releasing commitLock.");
         _insideTransaction = false;
@@ -653,8 +1278,38 @@ int SQLite::commit() {
             _sharedData->currentTransactionCount--;
         }
         _sharedData->blockNewTransactionsCV.notify_one();
+        if (_schemaChanged) {
+            lock_guard<mutex> lock(_sharedData->tablesChangedAtMutex);
+            _sharedData->allTablesChangedAt = commitCount;
+        } else if (!_writtenTables.empty()) {
+            lock_guard<mutex> lock(_sharedData->tablesChangedAtMutex);
+            for (const string& table : _writtenTables) {
+                _sharedData->tablesChangedAt[table] = commitCount;
+            }
+        }
+        _writtenTables.clear();
+        _schemaChanged = false;
+        _lastWrittenTable = nullptr;
+        if (!_changedRows.empty()) {
+            map<string, set<int64_t>> changedRows;
+            swap(changedRows, _changedRows);
+            _notifyCommitListeners(&changedRows);
+        }
+        if (_sharedData->commitCountListener) {
+            _sharedData->commitCountListener(commitCount);
+        }
+        _commitLockHeldUS += STimeNow() - _commitLockedAt;
         g_commitLock.unlock();
+
+        // With group commit, our commit isn't durable until the WAL is synced, which we wait for outside of the commit
+        // lock so that other commits can join the same sync.
+        if (_groupCommitWindow) {
+            uint64_t beforeSync = STimeNow();
+            _waitForGroupSync(commitCount);
+            _commitElapsed += STimeNow() - beforeSync;
+        }
     } else {
+        commitConflicts++;
         SINFO("Commit failed, waiting for rollback.");
     }
 
@@ -663,6 +1318,67 @@ int SQLite::commit() {
     return result;
 }
 
+bool SQLite::commitBatch(const list<pair<string, string>>& transactions) {
+    SASSERT(!transactions.empty());
+    if (!beginTransaction()) {
+        return false;
+    }
+    _trimJournal();
+
+    // Hold the commit lock for the whole batch, exactly as `prepare` would for a single transaction.
+    g_commitLock.lock();
+    _mutexLocked = true;
+    _commitLockedAt = STimeNow();
+    uint64_t commitCount = _sharedData->_commitCount.load();
+    string hash = getCommittedHash();
+    const string query = "INSERT INTO " + _journalName + " VALUES (?, ?, ?);";
+    for (const auto& transaction : transactions) {
+        // Run this transaction's query, and verify that it chains onto the previous hash the way our peer says it
+        // should.
+        if (!_writeIdempotent(transaction.first, true)) {
+            SWARN("Unable to apply batched transaction #" << (commitCount + 1) << ", rolling back batch.");
+            rollback();
+            return false;
+        }
+        hash = getTransactionHash(hash, _uncommittedQuery, getHashVersion(transaction.second));
+        if (hash != transaction.second) {
+            SWARN("Hash mismatch applying batched transaction #" << (commitCount + 1) << ", rolling back batch.");
+            rollback();
+            return false;
+        }
+
+        // Add its journal row.
+        commitCount++;
+        uint64_t before = STimeNow();
+        sqlite3_stmt* statement = _getStatement(query, {SToStr(commitCount), _uncommittedQuery, hash});
+        int result = SQLITE_ERROR;
+        if (statement) {
+            SQResult ignore;
+            result = SQuery(_db, "updating journal", statement, ignore);
+            _releaseStatement(query, statement);
+        }
+        _prepareElapsed += STimeNow() - before;
+        if (result) {
+            SWARN("Unable to journal batched transaction #" << commitCount << ", got result: " << result
+                  << ". Rolling back batch.");
+            rollback();
+            return false;
+        }
+        _sharedData->_inFlightTransactions[commitCount] = make_pair(_uncommittedQuery, hash);
+        _uncommittedQuery.clear();
+    }
+
+    // Everything checks out, commit the lot.
+    _uncommittedHash = hash;
+    _preparedTransactionCount = transactions.size();
+    SINFO("Committing batch of " << transactions.size() << " transactions ending at #" << commitCount << ".");
+    if (commit() != SQLITE_OK) {
+        rollback();
+        return false;
+    }
+    return true;
+}
+
 map<uint64_t, pair<string,string>> SQLite::getCommittedTransactions() {
     SQLITE_COMMIT_AUTOLOCK;
 
@@ -704,8 +1420,16 @@ void SQLite::rollback() {
         }
 
         // Finally done with this.
+        _endSession();
+        _updateCacheStats();
         _insideTransaction = false;
+        _preparedTransactionCount = 0;
+        _changedRows.clear();
+        _writtenTables.clear();
+        _schemaChanged = false;
+        _lastWrittenTable = nullptr;
         _uncommittedHash.clear();
+        _uncommittedJournalTrim = 0;
         if (_uncommittedQuery.size()) {
             SINFO("Rollback successful.");
         }
@@ -715,6 +1439,7 @@ void SQLite::rollback() {
         // ever having called `prepare`, which would have locked our mutex.
         if (_mutexLocked) {
             _mutexLocked = false;
+            _commitLockHeldUS += STimeNow() - _commitLockedAt;
             g_commitLock.unlock();
         }
         {
@@ -739,6 +1464,16 @@ uint64_t SQLite::getLastTransactionTiming(uint64_t& begin, uint64_t& read, uint6
     return begin + read + write + prepare + commit + rollback;
 }
 
+SQLite::ResourceUsage SQLite::getResourceUsage() {
+    // Cache misses are reset each time `_updateCacheStats` collects them, but pages written never are.
+    int misses = 0;
+    int written = 0;
+    int ignore = 0;
+    sqlite3_db_status(_db, SQLITE_DBSTATUS_CACHE_MISS, &misses, &ignore, 0);
+    sqlite3_db_status(_db, SQLITE_DBSTATUS_CACHE_WRITE, &written, &ignore, 0);
+    return {_pagesRead + misses, (uint64_t)written, SQueryVMSteps(), _commitLockHeldUS};
+}
+
 bool SQLite::getCommit(uint64_t id, string& query, string& hash) {
     // TODO: This can fail if called after `BEGIN TRANSACTION`, if the id we want to look up was committed by another
     // thread. We may or may never need to handle this case.
@@ -776,6 +1511,255 @@ bool SQLite::getCommits(uint64_t fromIndex, uint64_t toIndex, SQResult& result)
     return !SQuery(_db, "getting commits", query, result);
 }
 
+uint64_t SQLite::getOldestCommit() {
+    string query = _getJournalQuery({"SELECT MIN(id) AS minID FROM"}, true);
+    query = "SELECT MAX(minID) FROM (" + query + ")";
+    SQResult result;
+    SASSERT(!SQuery(_db, "getting oldest commit", query, result));
+    if (result.empty() || result[0].empty()) {
+        return 0;
+    }
+    return SToUInt64(result[0][0]);
+}
+
+bool SQLite::createSnapshot(const string& path, uint64_t bytesPerSecond, uint64_t* commitCount,
+                            const atomic<bool>* cancel) {
+    SASSERT(!_insideTransaction);
+    if (SFileExists(path) && !SFileDelete(path)) {
+        SWARN("Couldn't remove old snapshot '" << path << "'.");
+        return false;
+    }
+    sqlite3* snapshot = nullptr;
+    if (sqlite3_open_v2(path.c_str(), &snapshot, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL)) {
+        SWARN("Couldn't open snapshot '" << path << "': " << sqlite3_errmsg(snapshot));
+        sqlite3_close(snapshot);
+        return false;
+    }
+
+    // We hold a single read transaction on our database for the duration of the copy, even across throttled steps,
+    // so the snapshot is consistent, and the journal in it matches its contents exactly. The first read in it is where
+    // its view of the database starts, so that's where the commit count comes from.
+    uint64_t start = STimeNow();
+    int result = SQLITE_ERROR;
+    SQResult lastCommit;
+    if (SQuery(_db, "starting snapshot", "BEGIN TRANSACTION;") ||
+        SQuery(_db, "starting snapshot",
+               "SELECT MAX(maxID) FROM (" + _getJournalQuery({"SELECT MAX(id) AS maxID FROM"}, true) + ")",
+               lastCommit)) {
+        SWARN("Couldn't start snapshot '" << path << "'.");
+        SQuery(_db, "ending snapshot", "ROLLBACK;");
+        sqlite3_close(snapshot);
+        return false;
+    }
+    if (commitCount) {
+        *commitCount = lastCommit.empty() || lastCommit[0].empty() ? 0 : SToUInt64(lastCommit[0][0]);
+    }
+
+    // Without a budget, we copy everything in one step. Otherwise, we copy about a tenth of a second's worth of pages
+    // at a time, and wait between steps until we're back within it.
+    int pagesPerStep = -1;
+    uint64_t pageSize = 0;
+    if (bytesPerSecond) {
+        SQResult pageSizeResult;
+        SQuery(_db, "getting page size", "PRAGMA page_size;", pageSizeResult);
+        pageSize = max(pageSizeResult.empty() ? 0 : SToUInt64(pageSizeResult[0][0]), (uint64_t)512);
+        pagesPerStep = (int)max(bytesPerSecond / 10 / pageSize, (uint64_t)1);
+    }
+    sqlite3_backup* backup = sqlite3_backup_init(snapshot, "main", _db, "main");
+    if (backup) {
+        while (true) {
+            if (cancel && cancel->load()) {
+                SINFO("Snapshot '" << path << "' cancelled.");
+                result = SQLITE_ABORT;
+                break;
+            }
+            result = sqlite3_backup_step(backup, pagesPerStep);
+            if (result != SQLITE_OK && result != SQLITE_BUSY && result != SQLITE_LOCKED) {
+                break;
+            }
+            if (pageSize) {
+                const uint64_t copied = (uint64_t)(sqlite3_backup_pagecount(backup) - sqlite3_backup_remaining(backup))
+                                        * pageSize;
+                const uint64_t due = start + copied * STIME_US_PER_S / bytesPerSecond;
+                const uint64_t now = STimeNow();
+                if (due > now) {
+                    usleep(due - now);
+                }
+            }
+        }
+        sqlite3_backup_finish(backup);
+    }
+    SQuery(_db, "ending snapshot", "ROLLBACK;");
+    if (result != SQLITE_DONE) {
+        SWARN("Couldn't create snapshot '" << path << "', error #" << result << " (" << sqlite3_errmsg(snapshot) << ").");
+    } else {
+        DBINFO("Created snapshot '" << path << "' in " << ((STimeNow() - start) / 1000) << "ms.");
+    }
+    sqlite3_close(snapshot);
+    return result == SQLITE_DONE;
+}
+
+bool SQLite::createIncrementalBackup(const string& path, uint64_t fromCommit, uint64_t bytesPerSecond,
+                                     uint64_t& commitCount, const atomic<bool>* cancel) {
+    SASSERT(!_insideTransaction);
+    commitCount = getCommitCount();
+    if (fromCommit < commitCount && getOldestCommit() > fromCommit + 1) {
+        SWARN("Can't create incremental backup from commit #" << fromCommit << ", the oldest in the journal is #"
+              << getOldestCommit() << ".");
+        return false;
+    }
+    if (SFileExists(path) && !SFileDelete(path)) {
+        SWARN("Couldn't remove old incremental backup '" << path << "'.");
+        return false;
+    }
+    sqlite3* backup = nullptr;
+    if (sqlite3_open_v2(path.c_str(), &backup, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL) ||
+        SQuery(backup, "creating incremental backup",
+               "CREATE TABLE commits (id INTEGER PRIMARY KEY, hash TEXT NOT NULL, query TEXT NOT NULL);")) {
+        SWARN("Couldn't create incremental backup '" << path << "': " << sqlite3_errmsg(backup));
+        sqlite3_close(backup);
+        return false;
+    }
+
+    // We copy the commits across in chunks, so we never hold many in memory, throttling as we go.
+    const uint64_t start = STimeNow();
+    uint64_t bytes = 0;
+    bool success = !SQuery(backup, "writing incremental backup", "BEGIN TRANSACTION;");
+    for (uint64_t from = fromCommit + 1; success && from <= commitCount; from += (uint64_t)INCREMENTAL_BACKUP_CHUNK) {
+        if (cancel && cancel->load()) {
+            SINFO("Incremental backup '" << path << "' cancelled.");
+            success = false;
+            break;
+        }
+        const uint64_t to = min(from + (uint64_t)INCREMENTAL_BACKUP_CHUNK - 1, commitCount);
+        SQResult commits;
+        if (!getCommits(from, to, commits) || commits.size() != to - from + 1) {
+            SWARN("Couldn't read commits #" << from << "-" << to << " for incremental backup.");
+            success = false;
+            break;
+        }
+        string insert = "INSERT INTO commits VALUES ";
+        for (size_t i = 0; i < commits.size(); i++) {
+            insert += (i ? ", (" : "(") + SQ(from + i) + ", " + SQ(commits[i][0]) + ", " + SQ(commits[i][1]) + ")";
+            bytes += commits[i][1].size();
+        }
+        success = !SQuery(backup, "writing incremental backup", insert + ";");
+        if (bytesPerSecond) {
+            const uint64_t due = start + bytes * STIME_US_PER_S / bytesPerSecond;
+            const uint64_t now = STimeNow();
+            if (due > now) {
+                usleep(due - now);
+            }
+        }
+    }
+    success = success && !SQuery(backup, "writing incremental backup", "COMMIT;");
+    sqlite3_close(backup);
+    if (success) {
+        DBINFO("Created incremental backup '" << path << "' of commits #" << (fromCommit + 1) << "-" << commitCount
+               << " in " << ((STimeNow() - start) / 1000) << "ms.");
+    }
+    return success;
+}
+
+bool SQLite::applyIncrementalBackup(const string& path) {
+    SASSERT(!_insideTransaction);
+    sqlite3* backup = nullptr;
+    if (sqlite3_open_v2(path.c_str(), &backup, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL)) {
+        SWARN("Couldn't open incremental backup '" << path << "': " << sqlite3_errmsg(backup));
+        sqlite3_close(backup);
+        return false;
+    }
+
+    // Any commits we already have are skipped, so the same backup can safely be applied twice.
+    bool success = true;
+    while (success) {
+        const uint64_t next = getCommitCount() + 1;
+        SQResult commits;
+        if (SQuery(backup, "reading incremental backup",
+                   "SELECT id, hash, query FROM commits WHERE id >= " + SQ(next) + " ORDER BY id LIMIT " +
+                   SQ(INCREMENTAL_BACKUP_CHUNK) + ";", commits)) {
+            success = false;
+            break;
+        }
+        if (commits.empty()) {
+            break;
+        }
+        if (SToUInt64(commits[0][0]) != next) {
+            SWARN("Incremental backup '" << path << "' starts at commit #" << commits[0][0] << ", but we need #"
+                  << next << ".");
+            success = false;
+            break;
+        }
+        list<pair<string, string>> transactions;
+        for (auto& row : commits.rows) {
+            transactions.emplace_back(move(row[2]), move(row[1]));
+        }
+        success = commitBatch(transactions);
+    }
+    sqlite3_close(backup);
+    return success;
+}
+
+bool SQLite::restoreSnapshot(const string& path) {
+    SASSERT(!_insideTransaction);
+    sqlite3* snapshot = nullptr;
+    if (sqlite3_open_v2(path.c_str(), &snapshot, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL)) {
+        SWARN("Couldn't open snapshot '" << path << "': " << sqlite3_errmsg(snapshot));
+        sqlite3_close(snapshot);
+        return false;
+    }
+
+    // Nobody can commit while we replace the database out from under them.
+    SQLITE_COMMIT_AUTOLOCK;
+    uint64_t start = STimeNow();
+    int result = SQLITE_ERROR;
+    sqlite3_backup* backup = sqlite3_backup_init(_db, "main", snapshot, "main");
+    if (backup) {
+        // Our busy timeout applies to each attempt here, so a few retries covers another handle finishing a read.
+        for (int tries = 0; tries < 10; tries++) {
+            result = sqlite3_backup_step(backup, -1);
+            if (result != SQLITE_BUSY && result != SQLITE_LOCKED) {
+                break;
+            }
+        }
+        sqlite3_backup_finish(backup);
+    }
+    sqlite3_close(snapshot);
+    if (result != SQLITE_DONE) {
+        SWARN("Couldn't restore snapshot '" << path << "', error #" << result << " (" << sqlite3_errmsg(_db) << ").");
+        return false;
+    }
+
+    // Our statements were prepared against the old schema.
+    _clearStatementCache();
+
+    // The snapshot replaced our journal tables with the ones from the peer that created it, so make sure the ones we
+    // expect to write to still exist.
+    for (const string& name : _sharedData->_journalNames) {
+        SQVerifyTable(_db, name, "CREATE TABLE " + name + " ( id INTEGER PRIMARY KEY, query TEXT, hash TEXT )");
+    }
+
+    // And now we pick up from wherever the snapshot left off.
+    uint64_t commitCount = _getCommitCount();
+    string lastCommittedHash, ignore;
+    getCommit(commitCount, ignore, lastCommittedHash);
+    _sharedData->_commitCount.store(commitCount);
+    _sharedData->_lastCommittedHash.store(lastCommittedHash);
+    _sharedData->_committedTransactionIDs.clear();
+    _sharedData->_inFlightTransactions.clear();
+    {
+        lock_guard<mutex> lock(_sharedData->tablesChangedAtMutex);
+        _sharedData->allTablesChangedAt = commitCount;
+    }
+    _notifyCommitListeners(nullptr);
+    if (_sharedData->commitCountListener) {
+        _sharedData->commitCountListener(commitCount);
+    }
+    DBINFO("Restored snapshot '" << path << "' at commit #" << commitCount << " (" << lastCommittedHash << ") in "
+           << ((STimeNow() - start) / 1000) << "ms.");
+    return true;
+}
+
 int64_t SQLite::getLastInsertRowID() {
     // Make sure it *does* happen after an INSERT, but not with a IGNORE
     SASSERTWARN(SContains(_uncommittedQuery, "INSERT") || SContains(_uncommittedQuery, "REPLACE"));
@@ -806,6 +1790,29 @@ size_t SQLite::getLastWriteChangeCount() {
 
 void SQLite::enableRewrite(bool enable) {
     _enableRewrite = enable;
+    if (enable) {
+        _registerAuthorizer();
+    }
+}
+
+void SQLite::setWhitelist(const Whitelist* whitelist) {
+    _whitelist = whitelist;
+    if (whitelist) {
+        _registerAuthorizer();
+    }
+}
+
+void SQLite::enableWriteTracking() {
+    _writeTrackingEnabled.store(true);
+}
+
+void SQLite::_registerAuthorizer() {
+    if (!_authorizerRegistered) {
+        // Anything in the statement cache was prepared without the authorizer, so doesn't know what it writes.
+        _clearStatementCache();
+        sqlite3_set_authorizer(_db, _sqliteAuthorizerCallback, this);
+        _authorizerRegistered = true;
+    }
 }
 
 void SQLite::setRewriteHandler(bool (*handler)(int, const char*, string&)) {
@@ -826,8 +1833,36 @@ int SQLite::_authorize(int actionCode, const char* table, const char* column) {
         return SQLITE_DENY;
     }
 
+    if (_trackReads && actionCode == SQLITE_READ && table) {
+        _readTables.emplace(table);
+    }
+
+    switch (actionCode) {
+        case SQLITE_INSERT:
+        case SQLITE_UPDATE:
+        case SQLITE_DELETE:
+            if (table) {
+                _writtenTables.emplace(table);
+                _preparedWrites.emplace(table);
+            }
+            break;
+        case SQLITE_CREATE_INDEX:
+        case SQLITE_CREATE_TABLE:
+        case SQLITE_CREATE_TRIGGER:
+        case SQLITE_CREATE_VIEW:
+        case SQLITE_CREATE_VTABLE:
+        case SQLITE_DROP_INDEX:
+        case SQLITE_DROP_TABLE:
+        case SQLITE_DROP_TRIGGER:
+        case SQLITE_DROP_VIEW:
+        case SQLITE_DROP_VTABLE:
+        case SQLITE_ALTER_TABLE:
+            _schemaChanged = true;
+            break;
+    }
+
     // If the whitelist isn't set, we always return OK.
-    if (!whitelist) {
+    if (!_whitelist) {
         return SQLITE_OK;
     }
 
@@ -889,8 +1924,8 @@ int SQLite::_authorize(int actionCode, const char* table, const char* column) {
         case SQLITE_READ:
         {
             // See if there's an entry in the whitelist for this table.
-            auto tableIt = whitelist->find(table);
-            if (tableIt != whitelist->end()) {
+            auto tableIt = _whitelist->find(table);
+            if (tableIt != _whitelist->end()) {
                 // If so, see if there's an entry for this column.
                 auto columnIt = tableIt->second.find(column);
                 if (columnIt != tableIt->second.end()) {
@@ -907,16 +1942,52 @@ int SQLite::_authorize(int actionCode, const char* table, const char* column) {
     return SQLITE_DENY;
 }
 
+void SQLite::startReadTracking() {
+    _registerAuthorizer();
+    _readTables.clear();
+    _trackReads = true;
+}
+
+set<string> SQLite::stopReadTracking() {
+    _trackReads = false;
+    set<string> tables;
+    swap(tables, _readTables);
+    return tables;
+}
+
+uint64_t SQLite::getTablesChangedAt(const set<string>& tables) const {
+    lock_guard<mutex> lock(_sharedData->tablesChangedAtMutex);
+    uint64_t changedAt = _sharedData->allTablesChangedAt;
+    for (const string& table : tables) {
+        auto it = _sharedData->tablesChangedAt.find(table);
+        if (it != _sharedData->tablesChangedAt.end()) {
+            changedAt = max(changedAt, it->second);
+        }
+    }
+    return changedAt;
+}
+
 void SQLite::startTiming(uint64_t timeLimitUS) {
+    if (_timeoutLimit) {
+        _deadlineRemove(_timeoutLimit, &_timedOut);
+    }
     _timeoutStart = STimeNow();
     _timeoutLimit = _timeoutStart + timeLimitUS;
     _timeoutError = 0;
+    _timedOut = false;
+    _deadlineAdd(_timeoutLimit, &_timedOut);
+    SQuerySetBusyDeadline(_timeoutLimit);
 }
 
 void SQLite::resetTiming() {
+    if (_timeoutLimit) {
+        _deadlineRemove(_timeoutLimit, &_timedOut);
+    }
+    _timedOut = false;
     _timeoutLimit = 0;
     _timeoutStart = 0;
     _timeoutError = 0;
+    SQuerySetBusyDeadline(0);
 }
 
 void SQLite::setUpdateNoopMode(bool enabled) {
@@ -941,5 +2012,22 @@ bool SQLite::getUpdateNoopMode() const {
 }
 
 SQLite::SharedData::SharedData() :
-currentTransactionCount(0)
+currentTransactionCount(0),
+syncedCommitCount(0),
+syncInProgress(false),
+hashVersion(1),
+changesets(false),
+checkpointPagesPending(0),
+checkpointThreadExit(false)
 { }
+
+SQLite::SharedData::~SharedData() {
+    {
+        lock_guard<mutex> lock(checkpointMutex);
+        checkpointThreadExit = true;
+    }
+    checkpointCV.notify_all();
+    if (checkpointThread.joinable()) {
+        checkpointThread.join();
+    }
+}
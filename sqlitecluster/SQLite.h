@@ -45,9 +45,22 @@ class SQLite {
     // success, and fills the 'result' with the result of the query.
     bool read(const string& query, SQResult& result);
 
+    // Performs a read-only query, writing each row to `output` as it's returned instead of collecting them, so a large
+    // result is only ever held once, in its serialized form. The caller finishes `output` on success.
+    bool read(const string& query, SQResultWriter& output);
+
+    // Performs a read-only query, keeping each value's type (see SQTypedResult). Cheaper than an SQResult for queries
+    // that return a lot of rows.
+    bool read(const string& query, SQTypedResult& result);
+
     // Performs a read-only query (eg, SELECT) that returns a single value.
     string read(const string& query);
 
+    // Performs a read-only query with each '?' in the query bound, in order, to a value from `params`. The statement
+    // is prepared once and cached on this handle, so running the same query again skips parsing and planning it.
+    // Values are bound as text, and so are converted by column affinity when compared against numeric columns.
+    bool read(const string& query, const list<string>& params, SQResult& result);
+
     // Begins a new transaction. Returns true on success.
     bool beginTransaction();
 
@@ -67,10 +80,17 @@ class SQLite {
     // If we're in noop-update mode, this call alerts and performs no write, but returns as if it had completed.
     bool write(const string& query);
 
+    // Parameterized version of `write`, binding values as in the parameterized `read`. The query recorded in the
+    // journal has the bound values expanded into it, so peers replay it exactly as they would the unbound version.
+    // The values at the (0-based) positions in `blobParams` are bound as BLOBs instead, for binary data that may
+    // contain NULs; these are expanded as hex literals.
+    bool write(const string& query, const list<string>& params, const set<size_t>& blobParams = {});
+
     // This is the same as `write` except it runs successfully without any warnings or errors in noop-update mode.
     // It's intended to be used for `mockRequest` enabled commands, such that we only run a version of them that's
     // known to be repeatable. What counts as repeatable is up to the individual command.
     bool writeIdempotent(const string& query);
+    bool writeIdempotent(const string& query, const list<string>& params, const set<size_t>& blobParams = {});
 
     // This runs a query completely unchanged, always adding it to the uncommitted query, such that it will be recorded
     // in the journal even if it had no effect on the database. This lets replicated or synchronized queries be added
@@ -111,16 +131,53 @@ class SQLite {
     // Commits the current transaction to disk. Returns an sqlite3 result code.
     int commit();
 
+    // Applies a series of transactions received from a peer, given as (query, hash) pairs, in a single database
+    // transaction. Each one still gets its own journal row and commit count, exactly as if it had been committed by
+    // itself, and its hash is verified as it's applied. This saves taking the commit lock and syncing the WAL once
+    // per transaction. If any query fails or any hash doesn't match, the whole batch is rolled back and this returns
+    // false, so that the caller can apply them individually to find the offending transaction.
+    bool commitBatch(const list<pair<string, string>>& transactions);
+
     // Cancels the current transaction and rolls it back
     void rollback();
 
     // Returns the total number of changes on this database
     int getChangeCount() { return sqlite3_total_changes(_db); }
 
+    // Returns the names of the tables the current transaction has written to so far.
+    const set<string>& getWrittenTables() const { return _writtenTables; }
+
+    // The update hook only sees rows changed in rowid tables, and misses deletes done by the truncate optimization and
+    // schema changes entirely. Once this is called, every handle in the process registers the authorizer when it next
+    // begins a transaction, and the authorizer records each table a statement writes to, or that the schema changed.
+    // Anything that relies on `getTablesChangedAt` being exact should call this before it's first used.
+    static void enableWriteTracking();
+
+    // Between these calls, the names of the tables read by each query are collected, and `stopReadTracking` returns
+    // them. sqlite only tells us what a statement reads when it's prepared, so statements aren't reused from the
+    // statement cache in the meantime.
+    void startReadTracking();
+    set<string> stopReadTracking();
+
+    // Returns the commit count of the most recent commit to this database, from any handle, that changed rows in any
+    // of `tables`, or 0 if none has since it was opened. Restoring a snapshot counts as changing every table.
+    uint64_t getTablesChangedAt(const set<string>& tables) const;
+
     // Returns the timing of the last command
     uint64_t getLastTransactionTiming(uint64_t& begin, uint64_t& read, uint64_t& write, uint64_t& prepare,
                                       uint64_t& commit, uint64_t& rollback);
 
+    // What this handle has used since it was opened: pages read into its page cache (cache misses), pages it's
+    // written, and how long it's held the commit lock, along with the VM steps run by queries on the calling thread.
+    // Subtract one of these taken before some work from one taken after to see what the work cost.
+    struct ResourceUsage {
+        uint64_t pagesRead;
+        uint64_t pagesWritten;
+        uint64_t vmSteps;
+        uint64_t commitLockUS;
+    };
+    ResourceUsage getResourceUsage();
+
     // Returns the number of changes that were performed in the last query.
     size_t getLastWriteChangeCount();
 
@@ -128,7 +185,11 @@ class SQLite {
     // database.
     uint64_t getCommitCount();
 
-    // Returns the current state of the database, as a SHA1 hash of all queries committed.
+    // Returns the highest commit ID visible to the current transaction, which can be behind `getCommitCount` if other
+    // handles have committed since it started. Outside of a transaction, this is the same as `getCommitCount`.
+    uint64_t getSnapshotCommitCount() { return _getCommitCount(); }
+
+    // Returns the current state of the database, as a chained hash of all queries committed.
     string getCommittedHash();
 
     // Returns what the new state will be of the database if the current transaction is committed.
@@ -154,7 +215,37 @@ class SQLite {
     // Looks up a range of commits
     bool getCommits(uint64_t fromIndex, uint64_t toIndex, SQResult& result);
 
-    // Start a timing operation, that will time out after the given number of microseconds.
+    // Returns the oldest commit from which every later commit is still in the journal. Journal tables are truncated
+    // independently, so this is the newest of their oldest rows. Peers further behind than this can't be caught up
+    // from the journal, and need a snapshot instead.
+    uint64_t getOldestCommit();
+
+    // Writes a consistent copy of the entire database to `path`, using the sqlite backup API. This can't be called
+    // inside a transaction. Returns true on success. With `bytesPerSecond`, the copy is made a few pages at a time, no
+    // faster than that, while we keep serving other handles. If `commitCount` is given, it's set to the last commit in
+    // the copy. If `cancel` is given and becomes true, the copy is abandoned, and this returns false.
+    bool createSnapshot(const string& path, uint64_t bytesPerSecond = 0, uint64_t* commitCount = nullptr,
+                        const atomic<bool>* cancel = nullptr);
+
+    // Writes every commit after `fromCommit` to a new database at `path`, as an incremental backup that brings a copy
+    // of this database as of `fromCommit` up to date with `applyIncrementalBackup`. Returns false if any of those
+    // commits are no longer in the journal, in which case a full snapshot is needed instead. `bytesPerSecond`,
+    // `commitCount`, and `cancel` are as for `createSnapshot`.
+    bool createIncrementalBackup(const string& path, uint64_t fromCommit, uint64_t bytesPerSecond,
+                                 uint64_t& commitCount, const atomic<bool>* cancel = nullptr);
+
+    // Applies an incremental backup written by `createIncrementalBackup` to this database, which needs to be at or
+    // after the commit the backup was made from. Each commit's hash is verified as it's applied. This can't be called
+    // inside a transaction. Returns true on success.
+    bool applyIncrementalBackup(const string& path);
+
+    // Replaces the entire contents of the database with the snapshot at `path` (as written by createSnapshot), and
+    // reloads our commit count and hash from it. Other handles to the same file will see the new contents on their
+    // next transaction. This can't be called inside a transaction. Returns true on success.
+    bool restoreSnapshot(const string& path);
+
+    // Start a timing operation, that will time out after the given number of microseconds. Queries on this thread stop
+    // retrying on SQLITE_BUSY at the same time (see `SQuerySetBusyDeadline`).
     void startTiming(uint64_t timeLimitUS);
 
     // Reset timing after finishing a timed operation.
@@ -165,20 +256,93 @@ class SQLite {
     // out to peers.
     map<uint64_t, pair<string,string>> getCommittedTransactions();
 
-    // The whitelist is either nullptr, in which case the feature is disabled, or it's a map of table names to sets of
-    // column names that are allowed for reading. Using whitelist at all put the database handle into a more
-    // restrictive access mode that will deny access for write operations and other potentially risky operations, even
-    // in the case that a specific table/column are not being directly requested.
-    map<string, set<string>>* whitelist;
+    // A map of table names to the sets of column names in them that are allowed for reading. Its comparisons are
+    // transparent, so the authorizer can look up the names sqlite gives it without copying them into strings first.
+    typedef map<string, set<string, less<>>, less<>> Whitelist;
+
+    // Sets the whitelist, or nullptr (the default) to disable the feature. Using a whitelist at all puts the database
+    // handle into a more restrictive access mode that will deny access for write operations and other potentially
+    // risky operations, even in the case that a specific table/column are not being directly requested. The whitelist
+    // isn't copied, so it should be built once and kept for as long as it might be set.
+    void setWhitelist(const Whitelist* whitelist);
 
     // Call before starting a transaction to make sure we don't interrupt a checkpoint operation.
     void waitForCheckpoint();
 
+    // Enables group commit for this handle. Its commits are written to the WAL without syncing it (as with
+    // `PRAGMA synchronous = NORMAL`), and `commit()` then waits until the WAL has been synced by a single thread on
+    // behalf of every commit made within `windowUS` microseconds of each other, before returning. Commits are still
+    // made in order under the commit lock, so the journal ordering is unchanged. Call this before the first
+    // transaction on this handle.
+    void enableGroupCommit(uint64_t windowUS);
+
+    // Lets this handle read up to `bytes` of the database through a memory map (`PRAGMA mmap_size`) rather than copying
+    // pages into its own cache. Mapped pages live in the OS page cache, which every handle shares, so this is a way to
+    // give many handles a large cache without each of them holding its own copy. Call this before the first
+    // transaction on this handle.
+    void setMmapSize(int64_t bytes);
+
+    // Returns the number of page cache hits and misses across every handle for this database since it was opened.
+    // Each handle adds its own at the end of each transaction.
+    uint64_t getCacheHits() const { return _sharedData->cacheHits.load(); }
+    uint64_t getCacheMisses() const { return _sharedData->cacheMisses.load(); }
+
     // These are the minimum thresholds for the WAL file, in pages, that will cause us to trigger either a full or
-    // passive checkpoint. They're public, non-const, and atomic so that they can be configured on the fly.
+    // passive checkpoint. They're public, non-const, and atomic so that they can be configured on the fly. Passive
+    // checkpoints run in the background without blocking anyone, and normally keep the WAL well below
+    // `fullCheckpointPageMin`, which acts as a hard cap: only once the WAL passes it (i.e., because long-running
+    // readers kept passive checkpoints from finishing) do we block new transactions for a full checkpoint.
     static atomic<int> passiveCheckpointPageMin;
     static atomic<int> fullCheckpointPageMin;
-    
+
+    // Running totals across every database in this process, for reporting metrics: how many checkpoints of each type
+    // have run and how long they took in total, and how many commits have failed because they conflicted with another.
+    static atomic<uint64_t> passiveCheckpoints;
+    static atomic<uint64_t> passiveCheckpointUS;
+    static atomic<uint64_t> fullCheckpoints;
+    static atomic<uint64_t> fullCheckpointUS;
+    static atomic<uint64_t> commitConflicts;
+
+    // A commit listener is called after each transaction that changed rows in the table it's watching is committed,
+    // with the rowids that were inserted, updated or deleted in that table. It's called on the committing thread,
+    // outside of any transaction but with the commit lock still held, so reads on `db` see exactly the state as of
+    // that commit, and nothing else can commit until it returns. `rowIDs` is null if the whole table may have changed
+    // (i.e., a snapshot was restored). Listeners need to be added before any SQLite objects are created.
+    typedef function<void(SQLite& db, const set<int64_t>* rowIDs)> CommitListener;
+    static void addCommitListener(const string& table, CommitListener listener);
+
+    // A commit count listener is called after every commit to this database, from any handle, with the new commit
+    // count, and after a snapshot is restored. Like commit listeners, it's called on the committing thread with the
+    // commit lock held. There's one per database, and setting it (or clearing it with nullptr) takes the commit lock,
+    // so it can be changed while other threads are committing.
+    typedef function<void(uint64_t commitCount)> CommitCountListener;
+    void setCommitCountListener(CommitCountListener listener);
+
+    // Each commit's hash chains onto the hash of the commit before it. Version 1 is the SHA1 of the previous hash
+    // followed by the whole query, which means hashing the entire query while holding the commit lock. Version 2 is
+    // the SHA256 of the previous hash followed by the SHA256 of the query, so the query can be hashed before taking
+    // the lock and only a short string is hashed under it. Version 2 hashes are 64 hex digits rather than 40, so the
+    // version that produced any hash can be told from its length.
+    static const int HASH_VERSION_MAX = 2;
+    static int getHashVersion(const string& hash) { return hash.size() == 64 ? 2 : 1; }
+
+    // Returns the hash of a transaction running `query` on top of the commit with `previousHash`.
+    static string getTransactionHash(const string& previousHash, const string& query, int version);
+
+    // Sets the hash version that subsequent commits to this database use, for all handles to it. Defaults to 1, the
+    // cluster raises it once every peer supports a newer version.
+    void setHashVersion(int version);
+    int getHashVersion() { return _sharedData->hashVersion.load(); }
+
+    // While enabled, for every handle to this database, transactions record the rows they change with the sqlite
+    // session extension, and `prepare` journals those changes as a changeset in place of the queries that made them.
+    // Peers then apply the changed rows directly, rather than running the queries again. A transaction keeps its
+    // queries if it changes the schema, or writes to a table a changeset can't fully describe (one without a primary
+    // key, or with triggers, which would run again as the changeset is applied). `writeUnmodified` applies either
+    // format, so this only needs every peer to be new enough to recognize changesets.
+    void setChangesets(bool enable);
+    bool getChangesets() { return _sharedData->changesets.load(); }
+
   private:
 
     // This structure contains all of the data that's shared between a set of SQLite objects that share the same
@@ -198,9 +362,27 @@ class SQLite {
         // though this atomic integer. getCommitCount() returns the value of this variable.
         atomic<uint64_t> _commitCount;
 
+        // Set with `setCommitCountListener`, and protected by the commit lock.
+        CommitCountListener commitCountListener;
+
         // Names of journal tables for this database.
         list<string> _journalNames;
 
+        // The commit count at which each table last had rows changed, and at which a snapshot was last restored. See
+        // `getTablesChangedAt`.
+        map<string, uint64_t> tablesChangedAt;
+        uint64_t allTablesChangedAt = 0;
+        mutex tablesChangedAtMutex;
+
+        // Page cache statistics from `sqlite3_db_status`, added up across every handle. See `getCacheHits`.
+        atomic<uint64_t> cacheHits{0};
+        atomic<uint64_t> cacheMisses{0};
+
+        // The lowest ID in any journal table when the database was opened. Handles opened later start from this
+        // rather than each looking it up across every journal table. It only gets stale in the safe direction, as it
+        // just tells a handle how much of its journal it can assume has been trimmed.
+        uint64_t _initialJournalMin = 0;
+
         // Explanation: Why do we keep a list of outstanding transactions, instead of just looking them up when we need
         // them (i.e., look up all transaction with an ID greater than the last one sent to peers when we need to send them
         // to peers)?
@@ -261,6 +443,33 @@ class SQLite {
         // This contains a list of all the valid objects for this data. This lets the checkpoint thread bail out early
         // if the SQLite object that initiated it has been deleted since it started.
         set<SQLite*> validObjects;
+
+        // Group commit state, protected by `syncMutex`. `syncedCommitCount` is the highest commit known to be synced
+        // to disk, and `syncInProgress` is set while one thread is gathering and syncing commits for everyone waiting
+        // on `syncCV`.
+        mutex syncMutex;
+        condition_variable syncCV;
+        uint64_t syncedCommitCount;
+        bool syncInProgress;
+
+        // The hash version new commits are prepared with, see `setHashVersion`.
+        atomic<int> hashVersion;
+
+        // Whether new commits are journaled as changesets, see `setChangesets`.
+        atomic<bool> changesets;
+
+        // Destructor. Stops the checkpoint thread.
+        ~SharedData();
+
+        // Passive checkpoints run on `checkpointThread`, with its own connection to the database, so that the commit that
+        // crosses `passiveCheckpointPageMin` doesn't have to wait on one. Committing threads set
+        // `checkpointPagesPending` to the size of the WAL and notify `checkpointCV`, protected by `checkpointMutex`.
+        // Requests that arrive while a checkpoint is running are merged into the next one.
+        thread checkpointThread;
+        mutex checkpointMutex;
+        condition_variable checkpointCV;
+        int checkpointPagesPending;
+        bool checkpointThreadExit;
     };
 
     // We have designed this so that multiple threads can write to multiple journals simultaneously, but we want
@@ -287,11 +496,20 @@ class SQLite {
     // Returns the name of a journal table based on it's index.
     static string _getJournalTableName(int journalTableID);
 
+    // Waits until every commit through `commitCount` has been synced to disk, syncing the WAL ourselves if no other
+    // thread is already doing so. Only used with group commit.
+    void _waitForGroupSync(uint64_t commitCount);
+
+    // Deletes the oldest segment of our journal as part of the current transaction, once it's grown far enough past
+    // `_maxJournalSize`. Called before taking the commit lock.
+    void _trimJournal();
+
     // Attributes
     sqlite3* _db;
     string _filename;
-    uint64_t _journalSize;
+    uint64_t _journalTrimmedThrough; // Every row in our journal with an id at or below this has been deleted.
     uint64_t _maxJournalSize;
+    uint64_t _uncommittedJournalTrim; // Where the current transaction trims our journal through, if it does.
     bool _insideTransaction;
     string _uncommittedQuery;
     string _uncommittedHash;
@@ -307,6 +525,12 @@ class SQLite {
     uint64_t _commitElapsed;
     uint64_t _rollbackElapsed;
 
+    // For `getResourceUsage`: page cache misses already passed on to `_sharedData` by `_updateCacheStats`, when we
+    // last locked the commit lock, and the total time we've held it.
+    uint64_t _pagesRead;
+    uint64_t _commitLockedAt;
+    uint64_t _commitLockHeldUS;
+
     // We keep track of whether we've locked the global mutex so that we know whether or not we need to unlock it when
     // we call `rollback`.
     bool _mutexLocked;
@@ -316,6 +540,35 @@ class SQLite {
     uint64_t _getCommitCount();
 
     bool _writeIdempotent(const string& query, bool alwaysKeepQueries = false);
+    bool _writeIdempotent(const string& query, const list<string>& params, const set<size_t>& blobParams = {});
+
+    // Returns a prepared statement for `query` with `params` bound to it, from our statement cache if we have one, or
+    // newly prepared (and added to the cache) otherwise. Returns nullptr if the query can't be prepared or bound.
+    sqlite3_stmt* _getStatement(const string& query, const list<string>& params, const set<size_t>& blobParams = {});
+
+    // Finalizes `statement` unless it belongs to our cache, in which case it's kept to be run again.
+    void _releaseStatement(const string& query, sqlite3_stmt* statement);
+
+    // Finalizes and removes every statement in our cache. Called when the schema changes, and on destruction, as
+    // sqlite won't close a handle with outstanding statements.
+    void _clearStatementCache();
+
+    // Adds this handle's page cache hits and misses since the last call to the totals in `_sharedData`.
+    void _updateCacheStats();
+
+    // Returns the current schema version, which lets us detect that a write changed the schema.
+    uint64_t _getSchemaVersion();
+
+    // Cache of prepared statements for this handle, keyed on query text. The list is ordered from most to least
+    // recently used, and the map points into it, so lookups and bumps to the front are constant time. The authorizer
+    // isn't called when a cached statement is re-run, so each one keeps the tables it was prepared to write to.
+    struct CachedStatement {
+        string query;
+        sqlite3_stmt* statement;
+        set<string> writtenTables;
+    };
+    list<CachedStatement> _statementList;
+    map<string, list<CachedStatement>::iterator> _statementCache;
 
     // Constructs a UNION query from a list of 'query parts' over each of our journal tables.
     // Fore each table, queryParts will be joined with that table's name as a separator. I.e., if you have a tables
@@ -341,6 +594,24 @@ class SQLite {
     // Callback function that we'll register for authorizing queries in sqlite.
     static int _sqliteAuthorizerCallback(void*, int, const char*, const char*, const char*, const char*);
 
+    // sqlite calls the authorizer for every action of every statement it prepares, so it's only registered once
+    // something needs it: re-writing, read or write tracking, or a whitelist. It's left registered after that, as
+    // registering or removing it makes sqlite re-prepare every statement in the cache.
+    bool _authorizerRegistered;
+    void _registerAuthorizer();
+
+    // Set by `enableWriteTracking`.
+    static atomic<bool> _writeTrackingEnabled;
+
+    // While the authorizer is registered, it adds the tables each statement writes to both `_writtenTables` and
+    // `_preparedWrites`, which `_getStatement` clears before each prepare so it can save them with cached statements.
+    // Any DDL, or a write that bumps the schema version, sets `_schemaChanged`, and committing then counts every table
+    // as changed.
+    set<string> _preparedWrites;
+    bool _schemaChanged;
+
+    const Whitelist* _whitelist;
+
     // The following variables maintain the state required around automatically re-writing queries.
 
     // If true, we'll attempt query re-writing.
@@ -355,15 +626,41 @@ class SQLite {
     // Causes the current query to skip re-write checking if it's already a re-written query.
     bool _currentlyRunningRewritten;
 
+    // While `_trackReads` is set, the authorizer adds every table a query reads to `_readTables`.
+    bool _trackReads;
+    set<string> _readTables;
+
     // Handles running checkpointing operations.
     static int _sqliteWALCallback(void* data, sqlite3* db, const char* dbName, int pageCount);
 
+    // Body of `SharedData::checkpointThread`, runs passive checkpoints on `filename` until told to exit.
+    static void _passiveCheckpointThread(SharedData* data, string filename);
+
+    // Every registered commit listener, by table name. This is a function rather than a static member so that plugins
+    // can add listeners regardless of static initialization order.
+    static map<string, list<CommitListener>>& _commitListeners();
+
+    // Records the rows changed in watched tables by the current transaction in `_changedRows`, and the tables it's
+    // changed in `_writtenTables`. `_lastWrittenTable` saves looking up the same table for every row.
+    static void _sqliteUpdateCallback(void* data, int operation, const char* dbName, const char* table,
+                                      sqlite3_int64 rowID);
+    map<string, set<int64_t>> _changedRows;
+    set<string> _writtenTables;
+    const char* _lastWrittenTable;
+
+    // Calls the commit listeners for each table in `changedRows`, or for every table if `changedRows` is null.
+    void _notifyCommitListeners(const map<string, set<int64_t>>* changedRows);
+
     // Callback function for progress tracking.
     static int _progressHandlerCallback(void* arg);
     uint64_t _timeoutLimit;
     uint64_t _timeoutStart;
     uint64_t _timeoutError;
 
+    // Set by the shared deadline thread once `_timeoutLimit` has passed, so the progress handler and `_checkTiming`
+    // don't need to read the clock to notice.
+    atomic<bool> _timedOut;
+
     // Check the timing of the current query and throw if the limit's exceeded.
     void _checkTiming(const string& error);
 
@@ -381,4 +678,37 @@ class SQLite {
     bool _noopUpdateMode;
 
     bool _enableFullCheckpoints;
+
+    // The number of journal rows the current transaction will add when committed. This is one after `prepare`, and
+    // the size of the batch in `commitBatch`.
+    uint64_t _preparedTransactionCount;
+
+    // The group commit window, in microseconds, or 0 if group commit is disabled for this handle.
+    uint64_t _groupCommitWindow;
+
+    // The session recording the current transaction's changes while changesets are enabled, or null. `_sessionTables`
+    // is every table it's seen a change to, and `_sessionFallback` is set once the transaction does anything a
+    // changeset can't represent, so that its queries are journaled instead.
+    sqlite3_session* _session;
+    set<string> _sessionTables;
+    bool _sessionFallback;
+
+    // Whether each table's changes can be journaled as a changeset, as of schema version `_changesetSchemaVersion`.
+    map<string, bool> _changesetTables;
+    uint64_t _changesetSchemaVersion;
+
+    // Starts a session for a new transaction, if changesets are enabled, and deletes it again.
+    void _beginSession();
+    void _endSession();
+
+    // Called by sqlite the first time the session sees a change to each table. Journal tables aren't recorded.
+    static int _sessionTableFilter(void* data, const char* table);
+
+    // Called by `prepare` to replace `_uncommittedQuery` with the changeset recorded by the current session, if it
+    // represents everything the transaction did.
+    void _journalChangeset();
+
+    // Applies a journaled changeset as part of the current transaction, failing if any row it changes isn't exactly
+    // as it was on the peer that recorded it.
+    bool _applyChangeset(const string& query);
 };
@@ -3,6 +3,7 @@
 SQLiteCommand::SQLiteCommand(SData&& _request) : 
     initiatingPeerID(0),
     initiatingClientID(0),
+    initiatingClientSequence(0),
     request(move(_request)),
     writeConsistency(SQLiteNode::ASYNC),
     complete(false),
@@ -36,8 +37,39 @@ SQLiteCommand::SQLiteCommand(SData&& _request) :
 SQLiteCommand::SQLiteCommand() :
     initiatingPeerID(0),
     initiatingClientID(0),
+    initiatingClientSequence(0),
     writeConsistency(SQLiteNode::ASYNC),
     complete(false),
     escalationTimeUS(0),
     creationTime(STimeNow())
 { }
+
+mutex SQLiteCommand::_traceMutex;
+deque<STable> SQLiteCommand::_traceSpans;
+
+void SQLiteCommand::recordTraceSpan(const string& traceID, const string& name, uint64_t start, STable&& fields) {
+    if (traceID.empty()) {
+        return;
+    }
+    fields["traceID"] = traceID;
+    fields["name"] = name;
+    fields["start"] = start;
+    fields["duration"] = STimeNow() - start;
+    SINFO("Trace " << traceID << " span '" << name << "' took " << fields["duration"] << "us.");
+    lock_guard<mutex> lock(_traceMutex);
+    _traceSpans.push_back(move(fields));
+    if (_traceSpans.size() > MAX_TRACE_SPANS) {
+        _traceSpans.pop_front();
+    }
+}
+
+list<STable> SQLiteCommand::getTraceSpans(const string& traceID) {
+    list<STable> spans;
+    lock_guard<mutex> lock(_traceMutex);
+    for (const auto& span : _traceSpans) {
+        if (traceID.empty() || span.at("traceID") == traceID) {
+            spans.push_back(span);
+        }
+    }
+    return spans;
+}
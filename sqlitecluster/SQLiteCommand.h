@@ -19,6 +19,10 @@ class SQLiteCommand {
     // can't respond to.
     int64_t initiatingClientID;
 
+    // Clients can pipeline several requests on one connection. This is the position of this command's request among
+    // those read from `initiatingClientID`, so that responses can be returned in the same order.
+    uint64_t initiatingClientSequence;
+
     // Each command is given a unique id that can be serialized and passed back and forth across nodes. Its id must be
     // uniquely identifiable for cases where, for instance, two peers escalate commands to the master, and master will
     // need to  respond to them.
@@ -52,6 +56,13 @@ class SQLiteCommand {
     // slave to master.
     uint64_t creationTime;
 
+    // What this command was counted as by the SQLiteCommandHold it's in, so the same is taken off when it leaves.
+    uint64_t heldBytes = 0;
+
+    // If set, when (by this server's clock) an escalated command should be given up on. A slave answers it with a 555
+    // and stops waiting for it, and a master that hasn't started it yet doesn't.
+    uint64_t deadline = 0;
+
     // Construct that takes a request object.
     SQLiteCommand(SData&& _request);
 
@@ -66,4 +77,21 @@ class SQLiteCommand {
 
     // Destructor.
     ~SQLiteCommand() {}
+
+    // Commands with a `traceID` request header are traced: each node they pass through records a span for each step
+    // it takes on them (eg, "command" on the slave and the master it escalated to, "distributedCommit" on the master,
+    // and "replicate" on each slave that applied the resulting transaction), all with the same `traceID`. Only the
+    // most recent spans are kept, in memory.
+    static constexpr size_t MAX_TRACE_SPANS = 10000;
+
+    // Records a span called `name` for `traceID`, that started at `start` and ends now, with any other `fields` the
+    // caller wants to note. Does nothing if `traceID` is empty.
+    static void recordTraceSpan(const string& traceID, const string& name, uint64_t start, STable&& fields = {});
+
+    // Returns the recorded spans, oldest first, or just those for `traceID` if it's given.
+    static list<STable> getTraceSpans(const string& traceID = "");
+
+  private:
+    static mutex _traceMutex;
+    static deque<STable> _traceSpans;
 };
@@ -0,0 +1,43 @@
+#include <libstuff/libstuff.h>
+#include "SQLiteCommandHold.h"
+#include "SQLiteCommand.h"
+
+void SQLiteCommandHold::add(SQLiteCommand& command) {
+    // The request is most of what a waiting command holds on to.
+    uint64_t size = command.request.methodLine.size() + command.request.content.size();
+    for (const auto& header : command.request.nameValueMap) {
+        size += header.first.size() + header.second.size();
+    }
+    command.heldBytes = size;
+    add(size);
+}
+
+void SQLiteCommandHold::remove(const SQLiteCommand& command) {
+    remove(command.heldBytes);
+}
+
+void SQLiteCommandHold::add(uint64_t bytes) {
+    _count++;
+    _bytes += bytes;
+}
+
+void SQLiteCommandHold::remove(uint64_t bytes) {
+    _count--;
+    _bytes -= bytes;
+}
+
+void SQLiteCommandHold::clear() {
+    _count = 0;
+    _bytes = 0;
+}
+
+void SQLiteCommandHold::setLimits(uint64_t maxCount, uint64_t maxBytes) {
+    _maxCount = maxCount;
+    _maxBytes = maxBytes;
+}
+
+bool SQLiteCommandHold::full() const {
+    const uint64_t maxCount = _maxCount.load();
+    const uint64_t maxBytes = _maxBytes.load();
+    return (maxCount && _count.load() >= maxCount) || (maxBytes && _bytes.load() >= maxBytes);
+}
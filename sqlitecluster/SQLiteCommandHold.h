@@ -0,0 +1,41 @@
+#pragma once
+class SQLiteCommand;
+
+// Keeps count of the commands held in one of the places they wait on something else (the master, a future commit, an
+// HTTPS request, and so on), and roughly how many bytes their requests take, so that each of these can be reported
+// and bounded without walking it. The counts are atomic, so any thread can read them, but each hold should only be
+// changed under whatever lock guards the container it counts. Limits of 0 are no limit.
+class SQLiteCommandHold {
+  public:
+    // Counts `command` as held, noting its size in `command.heldBytes`.
+    void add(SQLiteCommand& command);
+
+    // Stops counting `command`, which must have been added.
+    void remove(const SQLiteCommand& command);
+
+    // The same, for something held that isn't a command, like a serialized response, of the given size.
+    void add(uint64_t bytes);
+    void remove(uint64_t bytes);
+
+    // Stops counting everything, when the container is emptied at once.
+    void clear();
+
+    uint64_t count() const { return _count.load(); }
+    uint64_t bytes() const { return _bytes.load(); }
+
+    void setLimits(uint64_t maxCount, uint64_t maxBytes);
+    uint64_t maxCount() const { return _maxCount.load(); }
+    uint64_t maxBytes() const { return _maxBytes.load(); }
+
+    // True if the hold is at or over either of its limits.
+    bool full() const;
+
+    // The number of commands answered with an error to make room, rather than waiting for whatever they were held for.
+    atomic<uint64_t> expired{0};
+
+  private:
+    atomic<uint64_t> _count{0};
+    atomic<uint64_t> _bytes{0};
+    atomic<uint64_t> _maxCount{0};
+    atomic<uint64_t> _maxBytes{0};
+};
@@ -0,0 +1,191 @@
+#include <libstuff/libstuff.h>
+#include "SQLiteMerkleTree.h"
+#include "SQLite.h"
+
+SQLiteMerkleTree::SQLiteMerkleTree(const string& table)
+  : _table(table), _rebuild(true), _rebuildCommitCount(0), _refreshedCommitCount(0)
+{ }
+
+void SQLiteMerkleTree::invalidate(const set<int64_t>* rowIDs, uint64_t commitCount) {
+    lock_guard<mutex> lock(_mutex);
+    if (!rowIDs) {
+        _rebuild = true;
+        _rebuildCommitCount = max(_rebuildCommitCount, commitCount);
+        return;
+    }
+    for (int64_t rowID : *rowIDs) {
+        const uint64_t leaf = _getLeaf(rowID);
+        auto result = _changedLeaves.emplace(leaf, make_pair(commitCount, commitCount));
+        if (result.second) {
+            _invalidateAncestors(leaf);
+        } else {
+            result.first->second.second = max(result.first->second.second, commitCount);
+        }
+    }
+}
+
+bool SQLiteMerkleTree::getNode(SQLite& db, int level, uint64_t index, Node& node) {
+    lock_guard<mutex> lock(_mutex);
+    node.commitCount = _refresh(db);
+    if (!node.commitCount) {
+        return false;
+    }
+    uint64_t rootIndex = 0;
+    node.height = _getRoot(rootIndex);
+    node.level = level < 0 ? max(node.height, 0) : level;
+    node.index = level < 0 ? rootIndex : index;
+    if (node.height >= 0 && node.level <= LAST_LEVEL) {
+        node.hash = _getHash(node.level, node.index);
+        node.children = _getChildren(node.level, node.index);
+    }
+    return true;
+}
+
+uint64_t SQLiteMerkleTree::_refresh(SQLite& db) {
+    // This is the first read in most transactions, so this is where its snapshot starts. A database with no commits
+    // has no tables to hash, so 0 can't be a real answer.
+    const uint64_t commitCount = db.getSnapshotCommitCount();
+    if (commitCount < _refreshedCommitCount) {
+        SINFO("Merkle tree for '" << _table << "' is at commit #" << _refreshedCommitCount << ", newer than #"
+              << commitCount << ".");
+        return 0;
+    }
+
+    // From here on, any leaf we hash is as of this snapshot, even if we don't get through all of them.
+    _refreshedCommitCount = commitCount;
+
+    // The first time, or after the whole table's changed, every leaf with rows in it needs hashing. Rows changed
+    // after our snapshot are still marked as changed, for next time.
+    if (_rebuild) {
+        SQResult result;
+        if (!db.read("SELECT DISTINCT rowid >> " + SQ(LEAF_BITS) + " FROM " + _table + ";", result)) {
+            SWARN("Couldn't find rows in '" << _table << "' for its Merkle tree.");
+            return 0;
+        }
+        _leaves.clear();
+        _nodes.clear();
+        for (const auto& row : result.rows) {
+            _changedLeaves[(uint64_t)SToInt64(row[0]) + LEAF_OFFSET].first = 0;
+        }
+        _rebuild = _rebuildCommitCount > commitCount;
+    }
+
+    // Now hash every leaf changed as of our snapshot. Any that's also changed since then is still changed as of the
+    // commit after our snapshot, which is no later than when that happened.
+    const string query = "SELECT rowid, * FROM " + _table + " WHERE rowid BETWEEN ? AND ? ORDER BY rowid;";
+    size_t hashed = 0;
+    for (auto it = _changedLeaves.begin(); it != _changedLeaves.end();) {
+        if (it->second.first > commitCount) {
+            it++;
+            continue;
+        }
+        const pair<int64_t, int64_t> range = getRange(0, it->first);
+        SQResult result;
+        if (!db.read(query, {SToStr(range.first), SToStr(range.second)}, result)) {
+            SWARN("Couldn't read rows " << range.first << "-" << range.second << " of '" << _table << "'.");
+            return 0;
+        }
+        if (result.empty()) {
+            _leaves.erase(it->first);
+        } else {
+            // Each value is prefixed with its length, so that no two different rows serialize the same way.
+            string rows;
+            for (const auto& row : result.rows) {
+                for (const string& value : row) {
+                    rows += SToStr(value.size()) + ":" + value;
+                }
+                rows += "\n";
+            }
+            _leaves[it->first] = SToHex(SHashSHA256(rows));
+        }
+        _invalidateAncestors(it->first);
+        hashed++;
+        if (it->second.second > commitCount) {
+            it->second.first = commitCount + 1;
+            it++;
+        } else {
+            it = _changedLeaves.erase(it);
+        }
+    }
+    if (hashed) {
+        SINFO("Hashed " << hashed << " leaves of the Merkle tree for '" << _table << "' as of commit #" << commitCount);
+    }
+    return commitCount;
+}
+
+int SQLiteMerkleTree::_getRoot(uint64_t& index) {
+    if (_leaves.empty()) {
+        return -1;
+    }
+    const uint64_t first = _leaves.begin()->first;
+    const uint64_t last = _leaves.rbegin()->first;
+    int level = 0;
+    while ((first >> (level * FANOUT_BITS)) != (last >> (level * FANOUT_BITS))) {
+        level++;
+    }
+    index = first >> (level * FANOUT_BITS);
+    return level;
+}
+
+map<uint64_t, string> SQLiteMerkleTree::_getChildren(int level, uint64_t index) {
+    map<uint64_t, string> children;
+    if (level <= 0 || level > LAST_LEVEL) {
+        return children;
+    }
+
+    // Find the children that exist from the leaves under this node, skipping from each child to the next.
+    const int childShift = (level - 1) * FANOUT_BITS;
+    const uint64_t firstLeaf = index << (level * FANOUT_BITS);
+    auto it = _leaves.lower_bound(firstLeaf);
+    while (it != _leaves.end() && (it->first >> (level * FANOUT_BITS)) == index) {
+        const uint64_t child = it->first >> childShift;
+        children[child] = _getHash(level - 1, child);
+        it = _leaves.lower_bound((child + 1) << childShift);
+    }
+    return children;
+}
+
+pair<int64_t, int64_t> SQLiteMerkleTree::getRange(int level, uint64_t index) {
+    const int shift = level * FANOUT_BITS;
+    const uint64_t firstLeaf = index << shift;
+    const uint64_t lastLeaf = min(((index + 1) << shift) - 1, 2 * LEAF_OFFSET - 1);
+    const int64_t first = ((int64_t)firstLeaf - (int64_t)LEAF_OFFSET) * (1ll << LEAF_BITS);
+    const int64_t last = ((int64_t)lastLeaf - (int64_t)LEAF_OFFSET) * (1ll << LEAF_BITS) + ((1ll << LEAF_BITS) - 1);
+    return make_pair(first, last);
+}
+
+void SQLiteMerkleTree::_invalidateAncestors(uint64_t leaf) {
+    for (int level = 1; level <= LAST_LEVEL; level++) {
+        if (!_nodes.erase(make_pair(level, leaf >> (level * FANOUT_BITS)))) {
+            // Nothing above a node that isn't cached can be cached either.
+            break;
+        }
+    }
+}
+
+string SQLiteMerkleTree::_getHash(int level, uint64_t index) {
+    if (level == 0) {
+        auto it = _leaves.find(index);
+        return it == _leaves.end() ? "" : it->second;
+    }
+    auto it = _nodes.find(make_pair(level, index));
+    if (it != _nodes.end()) {
+        return it->second;
+    }
+
+    // A node's hash covers each of its children's index and hash, so that moving rows between children changes it.
+    string children;
+    const int childShift = (level - 1) * FANOUT_BITS;
+    auto leafIt = _leaves.lower_bound(index << (level * FANOUT_BITS));
+    while (leafIt != _leaves.end() && (leafIt->first >> (level * FANOUT_BITS)) == index) {
+        const uint64_t child = leafIt->first >> childShift;
+        children += SToStr(child) + ":" + _getHash(level - 1, child) + "\n";
+        leafIt = _leaves.lower_bound((child + 1) << childShift);
+    }
+    if (children.empty()) {
+        return "";
+    }
+    const string hash = SToHex(SHashSHA256(children));
+    _nodes[make_pair(level, index)] = hash;
+    return hash;
+}
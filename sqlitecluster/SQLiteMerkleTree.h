@@ -0,0 +1,85 @@
+#pragma once
+class SQLite;
+
+// A Merkle tree over the rows of one table, by rowid, so that two nodes can find the rows that differ between their
+// copies of it by comparing a few hashes at each level, rather than every row. Each leaf covers 2^LEAF_BITS
+// consecutive rowids, and each node above it covers 2^FANOUT_BITS nodes of the level below. Only nodes that cover at
+// least one row exist.
+//
+// Leaves are hashed from the table the first time they're needed, and then kept until a commit changes a row they
+// cover, so once the tree is built, bringing it up to date only re-reads the leaves that have changed. All of this is
+// thread-safe.
+class SQLiteMerkleTree {
+  public:
+    static constexpr int LEAF_BITS = 10;
+    static constexpr int FANOUT_BITS = 4;
+
+    SQLiteMerkleTree(const string& table);
+
+    // Marks the leaves covering `rowIDs` as changed as of `commitCount`, or the whole table if `rowIDs` is null. This
+    // is meant to be called from a commit listener on the table, so it does no more than note what's changed.
+    void invalidate(const set<int64_t>* rowIDs, uint64_t commitCount);
+
+    // One node of the tree, as of `commitCount`. Leaves are at level 0, and the root, which covers every row, is at
+    // level `height`, which is -1 for an empty table. `hash` is empty for a node that covers no rows, and `children`
+    // has the hash of each child that covers any, by index.
+    struct Node {
+        uint64_t commitCount = 0;
+        int height = -1;
+        int level = -1;
+        uint64_t index = 0;
+        string hash;
+        map<uint64_t, string> children;
+    };
+
+    // Brings the tree up to date with the snapshot of the current transaction on `db`, and describes node `index` at
+    // `level` as of that snapshot, or the root if `level` is negative. Returns false if the table can't be read, or
+    // the tree is already newer than the snapshot, in which case the caller can try again in a new transaction.
+    bool getNode(SQLite& db, int level, uint64_t index, Node& node);
+
+    // Returns the first and last rowid that node `index` at `level` covers.
+    static pair<int64_t, int64_t> getRange(int level, uint64_t index);
+
+  private:
+    // Leaves are numbered from the lowest possible rowid, so that the index of any node's ancestor is just a shift
+    // of its own, and every rowid fits in a tree LAST_LEVEL levels high.
+    static constexpr uint64_t LEAF_OFFSET = 1ull << (63 - LEAF_BITS);
+    static constexpr int LAST_LEVEL = (64 - LEAF_BITS + FANOUT_BITS - 1) / FANOUT_BITS;
+    static uint64_t _getLeaf(int64_t rowID) { return (uint64_t)(rowID >> LEAF_BITS) + LEAF_OFFSET; }
+
+    // The rest of these require `_mutex`.
+
+    // Drops the cached hash of every ancestor of `leaf`.
+    void _invalidateAncestors(uint64_t leaf);
+
+    // Re-hashes every leaf changed as of the current transaction's snapshot, and returns the commit count of that
+    // snapshot, or 0 if we couldn't.
+    uint64_t _refresh(SQLite& db);
+
+    // Returns the level of the root, and sets `index` to its index, or returns -1 if the table is empty.
+    int _getRoot(uint64_t& index);
+
+    // Returns the hash of node `index` at `level`, computing and caching it if need be.
+    string _getHash(int level, uint64_t index);
+
+    // Returns the hash of each child of node `index` at `level`, by index.
+    map<uint64_t, string> _getChildren(int level, uint64_t index);
+
+    // Every leaf hashed from the table, and every node above them that's been asked for since its leaves changed.
+    const string _table;
+    mutex _mutex;
+    map<uint64_t, string> _leaves;
+    map<pair<int, uint64_t>, string> _nodes;
+
+    // The leaves that have changed since they were hashed, each with the first and last commits that changed it. A
+    // leaf first changed by commit N or earlier needs hashing again before the tree is current as of commit N.
+    map<uint64_t, pair<uint64_t, uint64_t>> _changedLeaves;
+
+    // Set when every leaf needs finding again, with the last commit that changed the whole table.
+    bool _rebuild;
+    uint64_t _rebuildCommitCount;
+
+    // The commit as of which the tree was last brought up to date. It never moves backward, as leaves hashed as of
+    // a later commit may not match an earlier one.
+    uint64_t _refreshedCommitCount;
+};
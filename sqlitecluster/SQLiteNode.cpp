@@ -27,8 +27,22 @@
 // Initializations for static vars.
 const uint64_t SQLiteNode::SQL_NODE_DEFAULT_RECV_TIMEOUT = STIME_US_PER_M * 5;
 const uint64_t SQLiteNode::SQL_NODE_SYNCHRONIZING_RECV_TIMEOUT = STIME_US_PER_M;
+const size_t SQLiteNode::SQL_NODE_SYNCHRONIZE_BATCH_COMMITS = 1000;
+const size_t SQLiteNode::SQL_NODE_SYNCHRONIZE_BATCH_BYTES = 10 * 1024 * 1024;
+const size_t SQLiteNode::SQL_NODE_SYNCHRONIZE_PIPELINE_DEPTH = 4;
+const uint64_t SQLiteNode::SQL_NODE_SYNCHRONIZE_TARGET_LATENCY = STIME_US_PER_S;
+const size_t SQLiteNode::SQL_NODE_SYNCHRONIZE_MAX_CHUNK_BYTES = 10 * 1024 * 1024;
+const size_t SQLiteNode::SQL_NODE_SNAPSHOT_CHUNK_BYTES = 4 * 1024 * 1024;
+const uint64_t SQLiteNode::SQL_NODE_SNAPSHOT_THRESHOLD = 1000000;
+const uint64_t SQLiteNode::SQL_NODE_SNAPSHOT_RECV_TIMEOUT = STIME_US_PER_H;
+const uint64_t SQLiteNode::SQL_NODE_SNAPSHOT_SERVE_TIMEOUT = STIME_US_PER_H;
+const uint64_t SQLiteNode::SQL_NODE_HEARTBEAT_INTERVAL = STIME_US_PER_MS * 250;
+const uint64_t SQLiteNode::SQL_NODE_FAST_FAILOVER_TIMEOUT = STIME_US_PER_S * 5;
 atomic<bool> SQLiteNode::unsentTransactions(false);
+atomic<int> SQLiteNode::acknowledgementsRequested(0);
 uint64_t SQLiteNode::_lastSentTransactionID = 0;
+mutex SQLiteNode::_servedSnapshotsMutex;
+map<string, uint64_t> SQLiteNode::_servedSnapshots;
 
 const string SQLiteNode::stateNames[] = {"SEARCHING",
                                          "SYNCHRONIZING",
@@ -53,11 +67,31 @@ SQLiteNode::SQLiteNode(SQLiteServer& server, SQLite& db, const string& name, con
     _priority = priority;
     _state = SEARCHING;
     _syncPeer = nullptr;
+    _synchronizeRequestedThrough = 0;
+    _synchronizeChunkCommits = 100;
+    _synchronizeBytesPerCommit = 0;
+    _snapshotOffset = 0;
     _masterPeer = nullptr;
+    _upstreamPeer = nullptr;
+    _fastFailover = false;
+    _changesetReplication = false;
     _stateTimeout = STimeNow() + firstTimeout;
     _version = version;
     _commitsSinceCheckpoint = 0;
     _quorumCheckpoint = quorumCheckpoint;
+    _commitStartTime = 0;
+    _replicateTraceStart = 0;
+    _masterCommitCount = 0;
+    _behindMasterSince = 0;
+    _applyInProgress = 0;
+    _applyExit = false;
+    _applyFailed = false;
+    _applyQueuedThrough = 0;
+    _applyAcknowledge = false;
+    _applyLastAcknowledged = 0;
+    _sendInProgress = false;
+    _sendExit = false;
+    _sendThread = thread(&SQLiteNode::_sendThreadLoop, this);
 
     // Get this party started
     _changeState(SEARCHING);
@@ -81,9 +115,206 @@ SQLiteNode::~SQLiteNode() {
     // Make sure it's a clean shutdown
     SASSERTWARN(_escalatedCommandMap.empty());
     SASSERTWARN(!commitInProgress());
+
+    // Stop any apply threads before their handles are destroyed.
+    {
+        lock_guard<mutex> lock(_applyMutex);
+        _applyExit = true;
+    }
+    _applyCV.notify_all();
+    for (auto& applyThread : _applyThreads) {
+        applyThread.join();
+    }
+
+    // The send thread finishes sending what's queued first, while the peers' sockets are still open.
+    {
+        lock_guard<mutex> lock(_sendMutex);
+        _sendExit = true;
+    }
+    _sendCV.notify_all();
+    _sendThread.join();
+}
+
+void SQLiteNode::enableParallelApply(const string& filename, int cacheSize, int maxJournalSize, int firstJournalTable,
+                                     int threads, const string& synchronous, int64_t mmapSize) {
+    SASSERT(_applyThreads.empty());
+    for (int i = 0; i < threads; i++) {
+        _applyDBs.emplace_back(filename, cacheSize, false, maxJournalSize, firstJournalTable + i,
+                               firstJournalTable + threads - 1, synchronous);
+        if (mmapSize) {
+            _applyDBs.back().setMmapSize(mmapSize);
+        }
+    }
+    int threadID = 0;
+    for (auto& db : _applyDBs) {
+        _applyThreads.emplace_back(&SQLiteNode::_applyThreadLoop, this, ref(db), threadID++);
+    }
+    SINFO("Applying ASYNC transactions on " << threads << " threads while slaving.");
+}
+
+void SQLiteNode::_applyThreadLoop(SQLite& db, int threadID) {
+    SInitialize("apply" + to_string(threadID));
+    while (true) {
+        PendingApply apply;
+        {
+            unique_lock<mutex> lock(_applyMutex);
+            _applyCV.wait(lock, [this]() { return _applyExit || !_applyQueue.empty(); });
+            if (_applyExit) {
+                break;
+            }
+            apply = move(_applyQueue.front());
+            _applyQueue.pop_front();
+            _applyInProgress++;
+        }
+
+        // The first attempt runs alongside other threads. If it conflicts with something committed ahead of it, the
+        // second attempt runs once it's our turn, when nothing else can commit, so it can't conflict again.
+        bool success = false;
+        for (int attempt = 0; attempt < 2 && !success && !_applyFailed.load(); attempt++) {
+            if (!db.beginConcurrentTransaction()) {
+                break;
+            }
+            bool written = db.writeUnmodified(apply.query);
+
+            // Wait for every earlier transaction to be committed.
+            {
+                unique_lock<mutex> lock(_applyMutex);
+                _applyCV.wait(lock, [&]() {
+                    return _applyExit || _applyFailed.load() || db.getCommitCount() + 1 >= apply.commitCount;
+                });
+            }
+            if (_applyExit || _applyFailed.load() || db.getCommitCount() + 1 != apply.commitCount) {
+                db.rollback();
+                break;
+            }
+            if (!written) {
+                // A changeset fails to apply if a row it changes was also changed by a transaction committed ahead of
+                // it, after our snapshot, so that's worth trying again in order, like any other conflict.
+                db.rollback();
+                continue;
+            }
+            db.setHashVersion(SQLite::getHashVersion(apply.hash));
+            if (!db.prepare()) {
+                break;
+            }
+            if (db.getUncommittedHash() != apply.hash) {
+                SWARN("New hash mismatch applying transaction #" << apply.commitCount << ": ours='"
+                      << db.getUncommittedHash() << "', master's='" << apply.hash << "'.");
+                db.rollback();
+                break;
+            }
+            if (db.commit() == SQLITE_OK) {
+                success = true;
+            } else {
+                SINFO("Transaction #" << apply.commitCount << " conflicted, applying again in order.");
+                db.rollback();
+            }
+        }
+        if (!success && !_applyExit) {
+            SWARN("Couldn't apply transaction #" << apply.commitCount << ", dropping the rest of the queue.");
+            _applyFailed.store(true);
+        }
+        _recordReplicateSpan(apply.traceID, apply.received, apply.commitCount, success, true);
+        {
+            lock_guard<mutex> lock(_applyMutex);
+            _applyInProgress--;
+            if (_applyFailed.load()) {
+                _applyQueue.clear();
+            }
+        }
+        _applyCV.notify_all();
+        _applyNotifications.push(true);
+    }
 }
 
-void SQLiteNode::startCommit(ConsistencyLevel consistency)
+void SQLiteNode::_recordReplicateSpan(const string& traceID, uint64_t start, uint64_t commitCount, bool succeeded,
+                                      bool applyThread) {
+    if (traceID.empty()) {
+        return;
+    }
+    STable span;
+    span["commitCount"] = commitCount;
+    span["succeeded"] = succeeded;
+    span["applyThread"] = applyThread;
+    SQLiteCommand::recordTraceSpan(traceID, "replicate", start, move(span));
+}
+
+void SQLiteNode::_waitForApplies() {
+    unique_lock<mutex> lock(_applyMutex);
+    _applyCV.wait(lock, [this]() { return _applyQueue.empty() && !_applyInProgress; });
+}
+
+void SQLiteNode::enableFastFailover() {
+    _fastFailover = true;
+    heartbeatInterval = SQL_NODE_HEARTBEAT_INTERVAL;
+}
+
+void SQLiteNode::enableChangesetReplication() {
+    _changesetReplication = true;
+}
+
+void SQLiteNode::setUpstreamPeer(const string& peerName) {
+    if (_priority) {
+        SWARN("Only permaslaves can replicate from another slave, ignoring upstream peer '" << peerName << "'.");
+        return;
+    }
+    _upstreamName = peerName;
+}
+
+uint64_t SQLiteNode::getReplicationLagUS() {
+    if (_db.getCommitCount() >= _masterCommitCount.load()) {
+        return 0;
+    }
+    const uint64_t behindSince = _behindMasterSince.load();
+    return behindSince ? STimeNow() - behindSince : 0;
+}
+
+void SQLiteNode::prePoll(fd_map& fdm) {
+    _flushEscalations();
+    STCPNode::prePoll(fdm);
+    _applyNotifications.prePoll(fdm);
+    _sendNotifications.prePoll(fdm);
+}
+
+void SQLiteNode::postPoll(fd_map& fdm, uint64_t& nextActivity) {
+    STCPNode::postPoll(fdm, nextActivity);
+
+    // Once we've caught up with our master, we're no longer behind it until we hear about something newer.
+    if (_behindMasterSince.load() && _db.getCommitCount() >= _masterCommitCount.load()) {
+        _behindMasterSince.store(0);
+    }
+
+    // See if our apply threads have done anything.
+    _applyNotifications.postPoll(fdm);
+    _applyNotifications.popAll();
+    _sendNotifications.postPoll(fdm);
+    _sendNotifications.popAll();
+    _expireEscalations(nextActivity);
+    _expireServedSnapshots(nextActivity);
+    if (_state != SLAVING || !_masterPeer) {
+        return;
+    }
+    if (_applyFailed.load()) {
+        // Start over from whatever we managed to commit.
+        SWARN("Failed to apply a transaction from master, reconnecting.");
+        _waitForApplies();
+        _applyFailed.store(false);
+        _reconnectPeer(_replicationPeer());
+        return;
+    }
+    _relayTransactions();
+    if (_applyAcknowledge && _priority && _db.getCommitCount() > _applyLastAcknowledged) {
+        SData acknowledge("ACKNOWLEDGE_TRANSACTION");
+        acknowledge["CommitCount"] = SToStr(_db.getCommitCount());
+        _sendToPeer(_masterPeer, acknowledge);
+        _applyLastAcknowledged = _db.getCommitCount();
+        if (_applyLastAcknowledged >= _applyQueuedThrough) {
+            _applyAcknowledge = false;
+        }
+    }
+}
+
+void SQLiteNode::startCommit(ConsistencyLevel consistency, const string& traceID)
 {
     // Verify we're not already committing something, and then record that we have begun. This doesn't actually *do*
     // anything, but `update()` will pick up the state in its next invocation and start the actual commit.
@@ -92,6 +323,25 @@ void SQLiteNode::startCommit(ConsistencyLevel consistency)
             _commitState == CommitState::FAILED);
     _commitState = CommitState::WAITING;
     _commitConsistency = consistency;
+    _commitTraceID = traceID;
+}
+
+uint64_t SQLiteNode::getAcknowledgedCommitCount(ConsistencyLevel consistency)
+{
+    // Collect what each full peer has acknowledged, highest first.
+    vector<uint64_t> acknowledged;
+    for (auto peer : peerList) {
+        if (peer->params["Permaslave"] != "true") {
+            acknowledged.push_back(SToUInt64((*peer)["AcknowledgedCommitCount"]));
+        }
+    }
+    if (consistency == ASYNC || acknowledged.empty()) {
+        return _db.getCommitCount();
+    }
+    sort(acknowledged.begin(), acknowledged.end(), greater<uint64_t>());
+
+    // ONE needs any peer, and QUORUM needs half of them (rounded up) to have it, as in the MASTERING update loop.
+    return acknowledged[consistency == ONE ? 0 : (acknowledged.size() + 1) / 2 - 1];
 }
 
 void SQLiteNode::sendResponse(const SQLiteCommand& command)
@@ -102,7 +352,14 @@ void SQLiteNode::sendResponse(const SQLiteCommand& command)
     SData escalate("ESCALATE_RESPONSE");
     escalate["ID"] = command.id;
     escalate.content = command.response.serialize();
-    _sendToPeer(peer, escalate);
+    if (SIEquals((*peer)["BatchEscalation"], "true")) {
+        PendingBatch& batch = _pendingResponses[peer];
+        batch.content += escalate.serializeHeaders();
+        batch.content += escalate.content;
+        batch.count++;
+    } else {
+        _sendToPeer(peer, move(escalate));
+    }
 }
 
 void SQLiteNode::beginShutdown(uint64_t usToWait) {
@@ -149,6 +406,7 @@ bool SQLiteNode::shutdownComplete() {
                 _server.acceptCommand(move(commandPair.second), false);
             }
             _escalatedCommandMap.clear();
+            _escalatedHold.clear();
         }
         _changeState(SEARCHING);
         return true;
@@ -178,6 +436,17 @@ bool SQLiteNode::shutdownComplete() {
     }
 
     // If we have unsent data, not done
+    if (_pendingEscalations.count || !_pendingResponses.empty()) {
+        SINFO("Can't graceful shutdown yet because of unsent escalations");
+        return false;
+    }
+    {
+        lock_guard<mutex> lock(_sendMutex);
+        if (!_sendQueue.empty() || _sendInProgress) {
+            SINFO("Can't graceful shutdown yet because of queued messages to peers");
+            return false;
+        }
+    }
     for (auto peer : peerList) {
         if (peer->s && !peer->s->sendBufferEmpty()) {
             // Still sending data
@@ -207,35 +476,90 @@ void SQLiteNode::_sendOutstandingTransactions() {
         return;
     }
     auto transactions = _db.getCommittedTransactions();
+    transactions.erase(transactions.begin(), transactions.upper_bound(_lastSentTransactionID));
+    _replicateTransactions(transactions, acknowledgementsRequested.load());
+    if (!transactions.empty()) {
+        _lastSentTransactionID = transactions.rbegin()->first;
+
+        // Commits made by other threads are implicitly not quorum commits. We'll update our counter.
+        _commitsSinceCheckpoint += transactions.size();
+    }
+
+    // Clear the response flag from the last transaction.
+    for (auto peer : peerList) {
+        (*peer)["TransactionResponse"].clear();
+    }
+    unsentTransactions.store(false);
+}
+
+void SQLiteNode::_replicateTransactions(const map<uint64_t, pair<string, string>>& transactions, bool acknowledge) {
+    if (transactions.empty()) {
+        return;
+    }
+
+    // Peers that support it get every transaction in a single REPLICATE_TRANSACTIONS message per flush, serialized
+    // (and compressed) once for all of them. Older peers get a BEGIN_TRANSACTION and COMMIT_TRANSACTION for each.
+    bool anyBatchPeers = false;
+    bool anyIndividualPeers = false;
+    for (auto peer : peerList) {
+        if (peer->s && SIEquals((*peer)["Subscribed"], "true")) {
+            const bool batch = SIEquals((*peer)["BatchReplication"], "true");
+            anyBatchPeers |= batch;
+            anyIndividualPeers |= !batch;
+        }
+    }
+    if (!anyBatchPeers && !anyIndividualPeers) {
+        return;
+    }
+    const string commitCount = SToStr(_db.getCommitCount());
+    const string committedHash = _db.getCommittedHash();
+    string batchContent;
+    size_t batchCount = 0;
     for (auto& i : transactions) {
         uint64_t id = i.first;
-        if (id <= _lastSentTransactionID) {
-            continue;
-        }
-        string& query = i.second.first;
-        string& hash = i.second.second;
+        const string& query = i.second.first;
+        const string& hash = i.second.second;
         SData transaction("BEGIN_TRANSACTION");
         transaction["Command"] = "ASYNC";
         transaction["NewCount"] = to_string(id);
         transaction["NewHash"] = hash;
         transaction["ID"] = "ASYNC_" + to_string(id);
+        transaction["CommitCount"] = commitCount;
+        transaction["Hash"] = committedHash;
         transaction.content = query;
-        _sendToAllPeers(transaction, true); // subscribed only
-        for (auto peer : peerList) {
-            // Clear the response flag from the last transaction
-            (*peer)["TransactionResponse"].clear();
-        }
         SData commit("COMMIT_TRANSACTION");
         commit["ID"] = transaction["ID"];
         commit["CommitCount"] = transaction["NewCount"];
         commit["Hash"] = hash;
-        _sendToAllPeers(commit, true); // subscribed only
-        _lastSentTransactionID = id;
+        if (acknowledge) {
+            commit["Acknowledge"] = "true";
+        }
+        if (anyBatchPeers) {
+            batchContent += transaction.serialize();
+            batchContent += commit.serialize();
+            batchCount++;
+        }
+        if (anyIndividualPeers) {
+            _sendToPeers(move(transaction), [](Peer* peer) { return !SIEquals((*peer)["BatchReplication"], "true"); });
+            _sendToPeers(move(commit), [](Peer* peer) { return !SIEquals((*peer)["BatchReplication"], "true"); });
+        }
+    }
+    if (batchCount) {
+        SData batch("REPLICATE_TRANSACTIONS");
+        batch["NumTransactions"] = SToStr(batchCount);
+        batch.content = move(batchContent);
+        _sendToPeers(move(batch), [](Peer* peer) { return SIEquals((*peer)["BatchReplication"], "true"); });
+    }
+}
 
-        // Commits made by other threads are implicitly not quorum commits. We'll update our counter.
-        _commitsSinceCheckpoint++;
+void SQLiteNode::_relayTransactions() {
+    // Everything a slave commits came from upstream, so it only goes anywhere if an observer has subscribed to us.
+    // Either way, we drain the list so it doesn't keep growing.
+    if (_state != SLAVING) {
+        return;
     }
-    unsentTransactions.store(false);
+    SQLITE_COMMIT_AUTOLOCK;
+    _replicateTransactions(_db.getCommittedTransactions(), false);
 }
 
 void SQLiteNode::escalateCommand(SQLiteCommand&& command, bool forget) {
@@ -258,16 +582,129 @@ void SQLiteNode::escalateCommand(SQLiteCommand&& command, bool forget) {
     escalate["ID"] = command.id;
     escalate.content = command.request.serialize();
 
+    // Let master know how long we'll wait for this, so it doesn't bother with it once we've given up. A command's
+    // `timeout` isn't a deadline: it's how long a long-polling command like GetJob may wait on master for work, so
+    // only a deadline the client set explicitly replaces our own.
+    if (!forget && !command.deadline && _escalationTimeoutUS) {
+        command.deadline = command.creationTime + _escalationTimeoutUS;
+    }
+    if (command.deadline && _escalationDeadlineLimit) {
+        command.deadline = min(command.deadline, _escalationDeadlineLimit);
+    }
+    if (command.deadline) {
+        const uint64_t now = STimeNow();
+        escalate["TimeoutUS"] = to_string(command.deadline > now ? command.deadline - now : 0);
+    }
+
     // Store the command as escalated, unless we intend to forget about it anyway.
     if (forget) {
         SINFO("Firing and forgetting command '" << command.request.methodLine << "' to master.");
     } else {
+        // If we're holding as many escalated commands as we're allowed, the oldest may give up its place.
+        if (_expireOldestEscalated && _escalatedHold.full()) {
+            _expireOldestEscalation();
+        }
         command.escalationTimeUS = STimeNow();
+        _escalatedHold.add(command);
         _escalatedCommandMap.emplace(command.id, move(command));
     }
 
-    // And send to master.
-    _sendToPeer(_masterPeer, escalate);
+    // And send to master, with whatever else we escalate before we next poll, if it supports that.
+    if (SIEquals((*_masterPeer)["BatchEscalation"], "true")) {
+        _pendingEscalations.content += escalate.serializeHeaders();
+        _pendingEscalations.content += escalate.content;
+        _pendingEscalations.count++;
+    } else {
+        _sendToPeer(_masterPeer, move(escalate));
+    }
+}
+
+void SQLiteNode::_flushEscalations() {
+    if (_pendingEscalations.count) {
+        // Escalations are only made while slaving, and anything escalated to a master we've since lost has already
+        // been handed back to the server with the rest of `_escalatedCommandMap`.
+        if (_state == SLAVING && _masterPeer) {
+            SData batch("ESCALATE_BATCH");
+            batch["NumCommands"] = SToStr(_pendingEscalations.count);
+            batch.content = move(_pendingEscalations.content);
+            _sendToPeer(_masterPeer, move(batch));
+        }
+        _pendingEscalations = PendingBatch();
+    }
+    for (auto& pending : _pendingResponses) {
+        if (pending.second.count) {
+            SData batch("ESCALATE_RESPONSE_BATCH");
+            batch["NumCommands"] = SToStr(pending.second.count);
+            batch.content = move(pending.second.content);
+            _sendToPeer(pending.first, move(batch));
+        }
+    }
+    _pendingResponses.clear();
+}
+
+void SQLiteNode::setEscalatedLimits(uint64_t maxCount, uint64_t maxBytes, bool expireOldest) {
+    _escalatedHold.setLimits(maxCount, maxBytes);
+    _expireOldestEscalated = expireOldest;
+}
+
+void SQLiteNode::setEscalationTimeout(uint64_t timeoutUS) {
+    _escalationTimeoutUS = timeoutUS;
+}
+
+void SQLiteNode::expireEscalationsBy(uint64_t deadline) {
+    _escalationDeadlineLimit = deadline;
+    for (auto& commandPair : _escalatedCommandMap) {
+        SQLiteCommand& command = commandPair.second;
+        command.deadline = command.deadline ? min(command.deadline, deadline) : deadline;
+    }
+}
+
+void SQLiteNode::_expireEscalations(uint64_t& nextActivity) {
+    const uint64_t now = STimeNow();
+    for (auto it = _escalatedCommandMap.begin(); it != _escalatedCommandMap.end();) {
+        SQLiteCommand& command = it->second;
+        if (!command.deadline) {
+            it++;
+            continue;
+        }
+        if (command.deadline > now) {
+            nextActivity = min(nextActivity, command.deadline);
+            it++;
+            continue;
+        }
+
+        // The master may still finish this, and if it does, we'll ignore its response as being for an unknown command.
+        SINFO("Giving up on escalated command '" << command.request.methodLine << "' (" << command.id << ") after "
+              << (now - command.escalationTimeUS) / STIME_US_PER_MS << "ms, its deadline passed.");
+        command.response.methodLine = "555 Timeout waiting for master";
+        command.complete = true;
+        _escalatedHold.remove(command);
+        _server.acceptCommand(move(command), false);
+        it = _escalatedCommandMap.erase(it);
+    }
+}
+
+void SQLiteNode::_expireOldestEscalation() {
+    auto oldest = _escalatedCommandMap.end();
+    for (auto it = _escalatedCommandMap.begin(); it != _escalatedCommandMap.end(); it++) {
+        if (oldest == _escalatedCommandMap.end() || it->second.escalationTimeUS < oldest->second.escalationTimeUS) {
+            oldest = it;
+        }
+    }
+    if (oldest == _escalatedCommandMap.end()) {
+        return;
+    }
+
+    // The master may still finish this, and if it does, we'll ignore its response as being for an unknown command.
+    SQLiteCommand& command = oldest->second;
+    SWARN("Holding " << _escalatedHold.count() << " escalated commands (" << _escalatedHold.bytes()
+          << " bytes), giving up on the oldest, '" << command.request.methodLine << "' (" << command.id << ").");
+    command.response.methodLine = "555 Timeout waiting for master";
+    command.complete = true;
+    _escalatedHold.remove(command);
+    _escalatedHold.expired++;
+    _server.acceptCommand(move(command), false);
+    _escalatedCommandMap.erase(oldest);
 }
 
 list<string> SQLiteNode::getEscalatedCommandRequestMethodLines() {
@@ -407,7 +844,7 @@ bool SQLiteNode::update() {
         SASSERTWARN(!_syncPeer);
         _updateSyncPeer();
         if (_syncPeer) {
-            _sendToPeer(_syncPeer, SData("SYNCHRONIZE"));
+            _sendSynchronizeRequests();
         } else {
             SWARN("Updated to NULL _syncPeer when about to send SYNCHRONIZE. Going to WAITING.");
             _changeState(WAITING);
@@ -534,11 +971,25 @@ bool SQLiteNode::update() {
         // us back up to speed while subscribing.)
         if (currentMaster && _priority < highestPriorityPeer->calc("Priority") &&
             SIEquals((*currentMaster)["State"], "MASTERING")) {
-            // Subscribe to the master
-            SINFO("Subscribing to master '" << currentMaster->name << "'");
+            // Subscribe to the master, or, if we're an observer, to the slave we replicate from as long as it's
+            // slaving. We still escalate to the master either way.
             _masterPeer = currentMaster;
             _masterVersion = (*_masterPeer)["Version"];
-            _sendToPeer(currentMaster, SData("SUBSCRIBE"));
+            _upstreamPeer = nullptr;
+            if (!_upstreamName.empty()) {
+                for (auto peer : peerList) {
+                    if (peer->name == _upstreamName && SIEquals((*peer)["LoggedIn"], "true") &&
+                        SIEquals((*peer)["State"], "SLAVING")) {
+                        _upstreamPeer = peer;
+                    }
+                }
+                if (!_upstreamPeer) {
+                    SHMMM("Upstream peer '" << _upstreamName << "' isn't slaving, falling back to master.");
+                }
+            }
+            SINFO("Subscribing to " << (_upstreamPeer ? "upstream peer" : "master") << " '"
+                  << _replicationPeer()->name << "'");
+            _sendToPeer(_replicationPeer(), SData("SUBSCRIBE"));
             _changeState(SUBSCRIBING);
             return true; // Re-update
         }
@@ -801,7 +1252,8 @@ bool SQLiteNode::update() {
                           << _db.getCommitCount() << " (" << _db.getCommittedHash() << "). "
                           << _commitsSinceCheckpoint << " commits since quorum (consistencyRequired="
                           << consistencyLevelNames[_commitConsistency] << "), " << numFullApproved << " of "
-                          << numFullPeers << " approved (" << peerList.size() << " total) in "
+                          << numFullPeers << " approved (" << peerList.size() << " total) after "
+                          << (STimeNow() - _commitStartTime) / 1000 << "ms, in "
                           << totalElapsed / 1000 << " ms ("
                           << beginElapsed / 1000 << "+" << readElapsed / 1000 << "+"
                           << writeElapsed / 1000 << "+" << prepareElapsed / 1000 << "+"
@@ -842,6 +1294,17 @@ bool SQLiteNode::update() {
             // is the 'return false' immediately above here, everything else completes the transaction (even if it was
             // a failed transaction), so we can safely unlock now.
             SQLite::g_commitLock.unlock();
+
+            // Note how long this took, from sending BEGIN_TRANSACTION until the commit's consistency was met or it
+            // failed.
+            if (!_commitTraceID.empty()) {
+                STable span;
+                span["commitCount"] = _db.getCommitCount();
+                span["consistency"] = consistencyLevelNames[_commitConsistency];
+                span["succeeded"] = _commitState == CommitState::SUCCESS;
+                SQLiteCommand::recordTraceSpan(_commitTraceID, "distributedCommit", _commitStartTime, move(span));
+                _commitTraceID.clear();
+            }
         }
 
         // If there's a transaction that's waiting, we'll start it. We do this *before* we check to see if we should
@@ -886,6 +1349,9 @@ bool SQLiteNode::update() {
                 transaction.set("ID", _lastSentTransactionID + 1);
             }
             transaction.content = _db.getUncommittedQuery();
+            if (!_commitTraceID.empty()) {
+                transaction["traceID"] = _commitTraceID;
+            }
 
             for (auto peer : peerList) {
                 // Clear the response flag from the last transaction
@@ -894,7 +1360,8 @@ bool SQLiteNode::update() {
 
             // And send it to everyone who's subscribed.
             uint64_t beforeSend = STimeNow();
-            _sendToAllPeers(transaction, true);
+            _commitStartTime = beforeSend;
+            _sendToAllPeers(move(transaction), true);
             SINFO("SQLite::_sendToAllPeers in SQLiteNode took " << ((STimeNow() - beforeSend)/1000) << "ms.");
 
             // We return `true` here to immediately re-update and thus commit this transaction immediately if it was
@@ -977,9 +1444,11 @@ bool SQLiteNode::update() {
         // Nothing to do but wait
         if (STimeNow() > _stateTimeout) {
             // Give up
-            SHMMM("Timed out waiting for SUBSCRIPTION_APPROVED, reconnecting to master and re-SEARCHING.");
-            _reconnectPeer(_masterPeer);
+            SHMMM("Timed out waiting for SUBSCRIPTION_APPROVED, reconnecting to " << _replicationPeer()->name
+                  << " and re-SEARCHING.");
+            _reconnectPeer(_replicationPeer());
             _masterPeer = nullptr;
+            _upstreamPeer = nullptr;
             _changeState(SEARCHING);
             return true; // Re-update
         }
@@ -1018,6 +1487,7 @@ bool SQLiteNode::update() {
                 _server.acceptCommand(move(cmd.second), false);
             }
             _escalatedCommandMap.clear();
+            _escalatedHold.clear();
 
             // Are we in the middle of a commit? This should only happen if we received a `BEGIN_TRANSACTION` without a
             // corresponding `COMMIT` or `ROLLBACK`, this isn't supposed to happen.
@@ -1029,6 +1499,22 @@ bool SQLiteNode::update() {
             return true; // Re-update
         }
 
+        // Likewise, if the slave we replicate from stops slaving, it won't be sending us anything else, so we go
+        // looking for something else to subscribe to.
+        if (_upstreamPeer && !SIEquals((*_upstreamPeer)["State"], "SLAVING")) {
+            SHMMM("Upstream peer '" << _upstreamPeer->name << "' stopped slaving, re-queueing commands.");
+            for (auto& cmd : _escalatedCommandMap) {
+                _server.acceptCommand(move(cmd.second), false);
+            }
+            _escalatedCommandMap.clear();
+            _escalatedHold.clear();
+            if (!_db.getUncommittedHash().empty()) {
+                _db.rollback();
+            }
+            _changeState(SEARCHING);
+            return true; // Re-update
+        }
+
         break;
 
     default:
@@ -1039,6 +1525,42 @@ bool SQLiteNode::update() {
     return false;
 }
 
+SQLiteNode::MessageType SQLiteNode::_getMessageType(const string& methodLine) {
+    static const map<string, MessageType> types = {
+        {"LOGIN", MessageType::LOGIN},
+        {"STATE", MessageType::STATE},
+        {"STANDUP_RESPONSE", MessageType::STANDUP_RESPONSE},
+        {"SYNCHRONIZE", MessageType::SYNCHRONIZE},
+        {"SYNCHRONIZE_RESPONSE", MessageType::SYNCHRONIZE_RESPONSE},
+        {"SNAPSHOT", MessageType::SNAPSHOT},
+        {"SNAPSHOT_RESPONSE", MessageType::SNAPSHOT_RESPONSE},
+        {"SUBSCRIBE", MessageType::SUBSCRIBE},
+        {"SUBSCRIPTION_APPROVED", MessageType::SUBSCRIPTION_APPROVED},
+        {"BEGIN_TRANSACTION", MessageType::BEGIN_TRANSACTION},
+        {"APPROVE_TRANSACTION", MessageType::APPROVE_TRANSACTION},
+        {"DENY_TRANSACTION", MessageType::DENY_TRANSACTION},
+        {"COMMIT_TRANSACTION", MessageType::COMMIT_TRANSACTION},
+        {"REPLICATE_TRANSACTIONS", MessageType::REPLICATE_TRANSACTIONS},
+        {"ACKNOWLEDGE_TRANSACTION", MessageType::ACKNOWLEDGE_TRANSACTION},
+        {"ROLLBACK_TRANSACTION", MessageType::ROLLBACK_TRANSACTION},
+        {"ESCALATE", MessageType::ESCALATE},
+        {"ESCALATE_BATCH", MessageType::ESCALATE_BATCH},
+        {"ESCALATE_CANCEL", MessageType::ESCALATE_CANCEL},
+        {"ESCALATE_RESPONSE", MessageType::ESCALATE_RESPONSE},
+        {"ESCALATE_RESPONSE_BATCH", MessageType::ESCALATE_RESPONSE_BATCH},
+        {"ESCALATE_ABORTED", MessageType::ESCALATE_ABORTED},
+        {"CRASH_COMMAND", MessageType::CRASH_COMMAND},
+        {"BROADCAST_COMMAND", MessageType::BROADCAST_COMMAND},
+    };
+
+    // Peers send method lines in upper case, and only anything else needs converting for the case-insensitive match.
+    auto it = types.find(methodLine);
+    if (it == types.end()) {
+        it = types.find(SToUpper(methodLine));
+    }
+    return it == types.end() ? MessageType::UNKNOWN : it->second;
+}
+
 // Messages
 // Here are the messages that can be received, and how a cluster node will respond to each based on its state:
 void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
@@ -1053,9 +1575,19 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
     }
     (*peer)["CommitCount"] = message["CommitCount"];
     (*peer)["Hash"] = message["Hash"];
+    if (peer == _replicationPeer()) {
+        const uint64_t masterCommitCount = message.calcU64("CommitCount");
+        if (masterCommitCount > _masterCommitCount.load()) {
+            if (!_behindMasterSince.load() && masterCommitCount > _db.getCommitCount()) {
+                _behindMasterSince.store(STimeNow());
+            }
+            _masterCommitCount.store(masterCommitCount);
+        }
+    }
 
     // Classify and process the message
-    if (SIEquals(message.methodLine, "LOGIN")) {
+    const MessageType type = _getMessageType(message.methodLine);
+    if (type == MessageType::LOGIN) {
         // LOGIN: This is the first message sent to and received from a new peer. It communicates the current state of
         // the peer (hash and commit count), as well as the peer's priority. Peers can connect in any state, so this
         // message can be sent and received in any state.
@@ -1085,13 +1617,24 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
         peer->set("State",    message["State"]);
         peer->set("LoggedIn", "true");
         peer->set("Version",  message["Version"]);
+        peer->set("HashVersion", message.isSet("HashVersion") ? message["HashVersion"] : "1");
+        peer->set("Changesets", SIEquals(message["Changesets"], "true") ? "true" : "false");
+        if (SWITHIN(STANDINGUP, _state, STANDINGDOWN)) {
+            _updateHashVersion();
+            _updateChangesets();
+        }
+
+        // Older peers don't send this, and keep getting uncompressed messages from us.
+        peer->supportsCompression = SIEquals(message["Compression"], "gzip");
+        peer->set("BatchReplication", SIEquals(message["BatchReplication"], "true") ? "true" : "false");
+        peer->set("BatchEscalation", SIEquals(message["BatchEscalation"], "true") ? "true" : "false");
 
         // Let the server know that a peer has logged in.
         _server.onNodeLogin(peer);
     } else if (!SIEquals((*peer)["LoggedIn"], "true")) {
         STHROW("not logged in");
     }
-    else if (SIEquals(message.methodLine, "STATE")) {
+    else if (type == MessageType::STATE) {
         // STATE: Broadcast to all peers whenever a node's state changes. Also sent whenever a node commits a new query
         // (and thus has a new commit count and hash). A peer can react or respond to a peer's state change as follows:
         if (!message.isSet("State")) {
@@ -1266,7 +1809,7 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
                 }
             }
         }
-    } else if (SIEquals(message.methodLine, "STANDUP_RESPONSE")) {
+    } else if (type == MessageType::STANDUP_RESPONSE) {
         // STANDUP_RESPONSE: Sent in response to the STATE message generated when a node enters the STANDINGUP state.
         // Contains a header "Response" with either the value "approve" or "deny".  This response is stored within the
         // peer for testing in the update loop.
@@ -1294,9 +1837,9 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
         } else {
             SINFO("Got STANDUP_RESPONSE but not STANDINGUP. Probably a late message, ignoring.");
         }
-    } else if (SIEquals(message.methodLine, "SYNCHRONIZE")) {
-        // If we're MASTERING or SLAVING, we'll let worker threads handle SYNCHRONIOZATION messages.
-        if (_state == MASTERING || _state == SLAVING) {
+    } else if (type == MessageType::SYNCHRONIZE) {
+        // If we're MASTERING, STANDINGDOWN, or SLAVING, we'll let worker threads handle SYNCHRONIZATION messages.
+        if (_canPeekPeerRequests()) {
             // Attach all of the state required to populate a SYNCHRONIZE_RESPONSE to this message. All of this is
             // processed asynchronously, but that is fine, the final `SUBSCRIBE` message and its response will be
             // processed synchronously.
@@ -1314,13 +1857,18 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
             command.request["peerName"] = peer->name;
             _server.acceptCommand(move(command), true);
         } else {
-            // Otherwise we handle them immediately, as the server doesn't deliver commands to workers until we've
-            // stood up.
+            // Otherwise we handle them immediately, as workers can all be waiting for us to get to one of those
+            // states with the commands they've already dequeued.
             SData response("SYNCHRONIZE_RESPONSE");
-            _queueSynchronize(peer, response, false);
-            _sendToPeer(peer, response);
-        }
-    } else if (SIEquals(message.methodLine, "SYNCHRONIZE_RESPONSE")) {
+            _queueSynchronize(peer, response, false, message.calcU64("StartCommit"), message.calcU64("MaxCommits"));
+            _sendToPeer(peer, move(response));
+        }
+    } else if (type == MessageType::SYNCHRONIZE_RESPONSE && message.isSet("StartCommit") &&
+               (_state != SYNCHRONIZING || peer != _syncPeer)) {
+        // With several SYNCHRONIZE requests outstanding, responses to ones we've since abandoned (because we finished,
+        // gave up, or switched sync peers) can arrive late. They're harmless, so we don't treat them as errors.
+        PINFO("Ignoring SYNCHRONIZE_RESPONSE for commit #" << message["StartCommit"] << " that we're not waiting for.");
+    } else if (type == MessageType::SYNCHRONIZE_RESPONSE) {
         // SYNCHRONIZE_RESPONSE: Sent in response to a SYNCHRONIZE request. Contains a payload of zero or more COMMIT
         // messages, all of which are immediately committed to the local database.
         if (_state != SYNCHRONIZING) {
@@ -1335,9 +1883,26 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
         PINFO("Beginning synchronization");
         try {
             // Received this synchronization response; are we done?
-            _recvSynchronize(peer, message);
             uint64_t peerCommitCount = _syncPeer->calcU64("CommitCount");
-            if (_db.getCommitCount() == peerCommitCount) {
+            if (message.test("SnapshotRequired")) {
+                // We're too far behind to catch up from our peer's journal. Start downloading a snapshot of its
+                // database instead, unless we already are (several outstanding requests can all get this answer).
+                if (_snapshotPath.empty()) {
+                    PINFO("Too far behind to synchronize from the journal at commitCount #" << _db.getCommitCount()
+                          << ", requesting snapshot.");
+                    _synchronizeRequests.clear();
+                    _synchronizeResponses.clear();
+                    _snapshotPath = _db.getFilename() + ".snapshot";
+                    _snapshotOffset = 0;
+                    SData request("SNAPSHOT");
+                    request["Offset"] = "0";
+                    _sendToPeer(_syncPeer, request);
+                    _stateTimeout = STimeNow() + SQL_NODE_SNAPSHOT_RECV_TIMEOUT;
+                }
+            } else if (!_recvSynchronizeResponse(peer, message)) {
+                // Nothing to do until the response we're missing arrives.
+                PINFO("Waiting on earlier SYNCHRONIZE_RESPONSE, at commitCount #" << _db.getCommitCount() << ".");
+            } else if (_db.getCommitCount() == peerCommitCount) {
                 // All done
                 SINFO("Synchronization complete, at commitCount #" << _db.getCommitCount() << " ("
                       << _db.getCommittedHash() << "), WAITING");
@@ -1355,9 +1920,12 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
                 SINFO("Synchronization underway, at commitCount #"
                       << _db.getCommitCount() << " (" << _db.getCommittedHash() << "), "
                       << peerCommitCount - _db.getCommitCount() << " to go.");
-                _updateSyncPeer();
+                // Only switch sync peers between rounds of requests, as responses must come from the peer we asked.
+                if (_synchronizeRequests.empty()) {
+                    _updateSyncPeer();
+                }
                 if (_syncPeer) {
-                    _sendToPeer(_syncPeer, SData("SYNCHRONIZE"));
+                    _sendSynchronizeRequests();
                 } else {
                     SWARN("No usable _syncPeer but syncing not finished. Going to SEARCHING.");
                     _changeState(SEARCHING);
@@ -1374,19 +1942,81 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
             _changeState(SEARCHING);
             throw e;
         }
-    } else if (SIEquals(message.methodLine, "SUBSCRIBE")) {
+    } else if (type == MessageType::SNAPSHOT) {
+        // SNAPSHOT: Sent by a SYNCHRONIZING peer that's too far behind to catch up from our journal. Respond with a
+        // SNAPSHOT_RESPONSE containing the chunk of a snapshot of our database starting at "Offset". As with
+        // SYNCHRONIZE, we let worker threads do this if we can, as creating the snapshot can take a long time.
+        if (_canPeekPeerRequests()) {
+            SQLiteCommand command;
+            command.request = message;
+            command.initiatingPeerID = peer->id;
+            command.request["peerID"] = to_string(getIDByPeer(peer));
+
+            // The following properties are only used to expand out our log macros.
+            command.request["state"] = to_string(_state);
+            command.request["name"] = name;
+            command.request["peerName"] = peer->name;
+            _server.acceptCommand(move(command), true);
+        } else {
+            // Creating the snapshot here would hold up the sync thread, and so replication, for as long as copying the
+            // whole database takes. The peer can get one from somebody else.
+            PINFO("Refusing SNAPSHOT request while " << stateNames[_state] << ".");
+            SData response("SNAPSHOT_RESPONSE");
+            response["Error"] = "not serving snapshots while " + stateNames[_state];
+            _sendToPeer(peer, move(response));
+        }
+    } else if (type == MessageType::SNAPSHOT_RESPONSE) {
+        // SNAPSHOT_RESPONSE: Sent in response to a SNAPSHOT request. Contains a chunk of our sync peer's database,
+        // which we write out until we have all of it.
+        if (_state != SYNCHRONIZING || peer != _syncPeer || _snapshotPath.empty()) {
+            // We've given up on this snapshot since we asked for it.
+            PINFO("Ignoring SNAPSHOT_RESPONSE that we're not waiting for.");
+        } else {
+            try {
+                _recvSnapshot(peer, message);
+                if (_snapshotPath.empty()) {
+                    // We've restored the snapshot, catch up on anything since from the journal.
+                    SINFO("Snapshot restored, at commitCount #" << _db.getCommitCount() << " ("
+                          << _db.getCommittedHash() << "), continuing synchronization.");
+                    _sendSynchronizeRequests();
+                    _stateTimeout = STimeNow() + SQL_NODE_SYNCHRONIZING_RECV_TIMEOUT + SRandom::rand64() % STIME_US_PER_M * 5;
+                } else {
+                    _stateTimeout = STimeNow() + SQL_NODE_SNAPSHOT_RECV_TIMEOUT;
+                }
+            } catch (const SException& e) {
+                SWARN("Snapshot failed '" << e.what() << "', reconnecting and re-SEARCHING.");
+                _reconnectPeer(_syncPeer);
+                _syncPeer = nullptr;
+                _changeState(SEARCHING);
+                throw e;
+            }
+        }
+    } else if (type == MessageType::SUBSCRIBE) {
         // SUBSCRIBE: Sent by a node in the WAITING state to the current master to begin SLAVING. Respond
         // SUBSCRIPTION_APPROVED with any COMMITs that the subscribing peer lacks (for example, any commits that have
         // occurred after it completed SYNCHRONIZING but before this SUBSCRIBE was received). Tag this peer as
         // "subscribed" for use in the MASTERING and STANDINGDOWN update loops. Finally, if there is an outstanding
         // distributed transaction being processed, send it to this new slave.
+        // A slave can also accept a SUBSCRIBE from a permaslave observer (see setUpstreamPeer), which it then relays
+        // its commits to. It never has a distributed transaction to invite it into.
+        if (_state == SLAVING && peer->params["Permaslave"] == "true") {
+            SQLITE_COMMIT_AUTOLOCK;
+            _relayTransactions();
+            PINFO("Received SUBSCRIBE, accepting new observer");
+            SData response("SUBSCRIPTION_APPROVED");
+            _queueSynchronize(peer, response, true);
+            _sendToPeer(peer, move(response));
+            SASSERTWARN(!SIEquals((*peer)["Subscribed"], "true"));
+            (*peer)["Subscribed"] = "true";
+            return;
+        }
         if (_state != MASTERING) {
             STHROW("not mastering");
         }
         PINFO("Received SUBSCRIBE, accepting new slave");
         SData response("SUBSCRIPTION_APPROVED");
         _queueSynchronize(peer, response, true); // Send everything it's missing
-        _sendToPeer(peer, response);
+        _sendToPeer(peer, move(response));
         SASSERTWARN(!SIEquals((*peer)["Subscribed"], "true"));
         (*peer)["Subscribed"] = "true";
 
@@ -1404,15 +2034,15 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
             transaction.set("NewHash", _db.getUncommittedHash());
             transaction.set("ID", _lastSentTransactionID + 1);
             transaction.content = _db.getUncommittedQuery();
-            _sendToPeer(peer, transaction);
+            _sendToPeer(peer, move(transaction));
         }
-    } else if (SIEquals(message.methodLine, "SUBSCRIPTION_APPROVED")) {
+    } else if (type == MessageType::SUBSCRIPTION_APPROVED) {
         // SUBSCRIPTION_APPROVED: Sent by a slave's new master to complete the subscription process. Includes zero or
         // more COMMITS that should be immediately applied to the database.
         if (_state != SUBSCRIBING) {
             STHROW("not subscribing");
         }
-        if (_masterPeer != peer) {
+        if (_replicationPeer() != peer) {
             STHROW("not subscribing to you");
         }
         SINFO("Received SUBSCRIPTION_APPROVED, final synchronization.");
@@ -1424,17 +2054,37 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
             _changeState(SLAVING);
         } catch (const SException& e) {
             // Transaction failed
-            SWARN("Subscription failed '" << e.what() << "', reconnecting to master and re-SEARCHING.");
-            _reconnectPeer(_masterPeer);
+            SWARN("Subscription failed '" << e.what() << "', reconnecting to " << peer->name << " and re-SEARCHING.");
+            _reconnectPeer(peer);
             _changeState(SEARCHING);
             throw e;
         }
-    } else if (SIEquals(message.methodLine, "BEGIN_TRANSACTION")) {
+    } else if (type == MessageType::BEGIN_TRANSACTION) {
         // BEGIN_TRANSACTION: Sent by the MASTER to all subscribed slaves to begin a new distributed transaction. Each
         // slave begins a local transaction with this query and responds APPROVE_TRANSACTION. If the slave cannot start
         // the transaction for any reason, it is broken somehow -- disconnect from the master.
         // **FIXME**: What happens if MASTER steps down before sending BEGIN?
         // **FIXME**: What happens if MASTER steps down or disconnects after BEGIN?
+        if (!_applyThreads.empty() && _state == SLAVING && SStartsWith(message["ID"], "ASYNC_") &&
+            message.isSet("NewCount") && message.isSet("NewHash")) {
+            // Hand these off to our apply threads, the master isn't waiting for a response.
+            const uint64_t expected = max(_db.getCommitCount(), _applyQueuedThrough) + 1;
+            if (message.calcU64("NewCount") != expected) {
+                STHROW("commit count mismatch. Expected: " + message["NewCount"] + ", but would actually be: " +
+                       to_string(expected));
+            }
+            {
+                lock_guard<mutex> lock(_applyMutex);
+                _applyQueue.push_back({message.calcU64("NewCount"), message["NewHash"], message.content,
+                                       message["traceID"], STimeNow()});
+            }
+            _applyCV.notify_all();
+            _applyQueuedThrough = message.calcU64("NewCount");
+            return;
+        }
+
+        // Anything else has to wait for our apply threads to catch up.
+        _waitForApplies();
         bool success = true;
         if (!message.isSet("ID")) {
             STHROW("missing ID");
@@ -1457,6 +2107,8 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
         if (_db.getCommitCount() + 1 != message.calcU64("NewCount")) {
             STHROW("commit count mismatch. Expected: " + message["NewCount"] + ", but would actually be: " + to_string(_db.getCommitCount() + 1));
         }
+        _replicateTraceID = message["traceID"];
+        _replicateTraceStart = STimeNow();
         if (!_db.beginTransaction()) {
             STHROW("failed to begin transaction");
         }
@@ -1465,6 +2117,7 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
             if (!_db.writeUnmodified(message.content)) {
                 STHROW("failed to write transaction");
             }
+            _db.setHashVersion(SQLite::getHashVersion(message["NewHash"]));
             if (!_db.prepare()) {
                 STHROW("failed to prepare transaction");
             }
@@ -1512,8 +2165,7 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
             SINFO("Master is processing our command " << message["ID"] << " (" << message["Command"] << ")");
             commandIt->second.transaction = message;
         }
-    } else if (SIEquals(message.methodLine, "APPROVE_TRANSACTION") ||
-               SIEquals(message.methodLine, "DENY_TRANSACTION")) {
+    } else if (type == MessageType::APPROVE_TRANSACTION || type == MessageType::DENY_TRANSACTION) {
         // APPROVE_TRANSACTION: Sent to the master by a slave when it confirms it was able to begin a transaction and
         // is ready to commit. Note that this peer approves the transaction for use in the MASTERING and STANDINGDOWN
         // update loop.
@@ -1529,7 +2181,7 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
         if (_state != MASTERING && _state != STANDINGDOWN) {
             STHROW("not mastering");
         }
-        string response = SIEquals(message.methodLine, "APPROVE_TRANSACTION") ? "approve" : "deny";
+        string response = type == MessageType::APPROVE_TRANSACTION ? "approve" : "deny";
         try {
             // We ignore late approvals of commits that have already been finalized. They could have been committed
             // already, in which case `_lastSentTransactionID` will have incremented, or they could have been rolled
@@ -1546,6 +2198,16 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
                 }
                 PINFO("Peer " << response << " transaction #" << message["NewCount"] << " (" << message["NewHash"] << ")");
                 (*peer)["TransactionResponse"] = response;
+
+                // Keep a moving average of how long this peer takes to respond, which is what decides how quickly we
+                // can reach quorum.
+                const uint64_t approvalLatency = STimeNow() - _commitStartTime;
+                const uint64_t averageLatency = SToUInt64((*peer)["ApprovalLatencyUS"]);
+                (*peer)["ApprovalLatencyUS"] = SToStr(averageLatency ? (averageLatency * 7 + approvalLatency) / 8
+                                                                     : approvalLatency);
+
+                // To have begun this one, the peer must have committed everything before it.
+                (*peer)["AcknowledgedCommitCount"] = SToStr(message.calcU64("NewCount") - 1);
             } else {
                 // Old command.  Nothing to do.  We already sent a commit or rollback.
                 PINFO("Peer '" << message.methodLine << "' transaction #" << message["NewCount"]
@@ -1563,12 +2225,21 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
                   << message.calc("NewCount") << " (" << message["NewHash"] << ", " << message["ID"] << ") but '"
                   << e.what() << "', ignoring.");
         }
-    } else if (SIEquals(message.methodLine, "COMMIT_TRANSACTION")) {
+    } else if (type == MessageType::COMMIT_TRANSACTION) {
         // COMMIT_TRANSACTION: Sent to all subscribed slaves by the master when it determines that the current
         // outstanding transaction should be committed to the database. This completes a given distributed transaction.
         if (_state != SLAVING) {
             STHROW("not slaving");
         }
+        if (_db.getUncommittedHash().empty() && SStartsWith(message["ID"], "ASYNC_") &&
+            message.calcU64("CommitCount") <= _applyQueuedThrough) {
+            // Our apply threads have this one, and will commit it in its turn. If the master wants to hear when we
+            // have, we'll tell it once they've caught up with everything so far.
+            if (message.test("Acknowledge")) {
+                _applyAcknowledge = true;
+            }
+            return;
+        }
         if (_db.getUncommittedHash().empty()) {
             STHROW("no outstanding transaction");
         }
@@ -1583,8 +2254,10 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
         SDEBUG("Committing current transaction because COMMIT_TRANSACTION: " << _db.getUncommittedQuery());
         _db.commit();
 
-        // Clear the list of committed transactions. We're slaving, so we don't need to send these.
-        _db.getCommittedTransactions();
+        // Pass it on to any observers replicating from us.
+        _relayTransactions();
+        _recordReplicateSpan(_replicateTraceID, _replicateTraceStart, _db.getCommitCount(), true, false);
+        _replicateTraceID.clear();
 
         // Log timing info.
         // TODO: This is obsolete and replaced by timing info in BedrockCommand. This should be removed.
@@ -1597,6 +2270,14 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
               << prepareElapsed / 1000 << "+" << commitElapsed / 1000 << "+"
               << rollbackElapsed / 1000 << "ms)");
 
+        // If master wants to know when we've committed this, tell it. Permaslaves don't count towards consistency, so
+        // they don't bother.
+        if (message.test("Acknowledge") && _priority) {
+            SData acknowledge("ACKNOWLEDGE_TRANSACTION");
+            acknowledge["CommitCount"] = SToStr(_db.getCommitCount());
+            _sendToPeer(_masterPeer, acknowledge);
+        }
+
         // Look up in our escalated commands and see if it's one being processed
         auto commandIt = _escalatedCommandMap.find(message["ID"]);
         if (commandIt != _escalatedCommandMap.end()) {
@@ -1605,7 +2286,47 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
             SINFO("Master has committed in response to our command " << message["ID"]);
             commandIt->second.transaction = message;
         }
-    } else if (SIEquals(message.methodLine, "ROLLBACK_TRANSACTION")) {
+    } else if (type == MessageType::REPLICATE_TRANSACTIONS) {
+        // REPLICATE_TRANSACTIONS: Sent by the master in place of the BEGIN_TRANSACTION and COMMIT_TRANSACTION
+        // messages for transactions committed outside of the sync thread, to peers that said they support it when
+        // logging in. Its content is those messages, which we handle exactly as if they'd arrived one at a time.
+        if (!message.isSet("NumTransactions")) {
+            STHROW("missing NumTransactions");
+        }
+        const char* content = message.content.c_str();
+        int remaining = (int)message.content.size();
+        int messageSize = 0;
+        int messages = 0;
+        SData transactionMessage;
+        while ((messageSize = transactionMessage.deserialize(content, remaining))) {
+            content += messageSize;
+            remaining -= messageSize;
+            if (!SIEquals(transactionMessage.methodLine, "BEGIN_TRANSACTION") &&
+                !SIEquals(transactionMessage.methodLine, "COMMIT_TRANSACTION")) {
+                STHROW("unexpected " + transactionMessage.methodLine + " in REPLICATE_TRANSACTIONS");
+            }
+            _onMESSAGE(peer, transactionMessage);
+            messages++;
+        }
+        if (remaining || messages != 2 * message.calc("NumTransactions")) {
+            STHROW("malformed REPLICATE_TRANSACTIONS");
+        }
+    } else if (type == MessageType::ACKNOWLEDGE_TRANSACTION) {
+        // ACKNOWLEDGE_TRANSACTION: Sent to the master by a slave when it's committed a transaction that the master
+        // asked it to acknowledge. Commands committed outside of the sync thread wait on these to reach their write
+        // consistency.
+        if (!message.isSet("CommitCount")) {
+            STHROW("missing CommitCount");
+        }
+        if (_state != MASTERING && _state != STANDINGDOWN) {
+            STHROW("not mastering");
+        }
+        if (peer->params["Permaslave"] == "true") {
+            STHROW("permaslaves shouldn't acknowledge");
+        }
+        (*peer)["AcknowledgedCommitCount"] =
+            SToStr(max(message.calcU64("CommitCount"), SToUInt64((*peer)["AcknowledgedCommitCount"])));
+    } else if (type == MessageType::ROLLBACK_TRANSACTION) {
         // ROLLBACK_TRANSACTION: Sent to all subscribed slaves by the master when it determines that the current
         // outstanding transaction should be rolled back. This completes a given distributed transaction.
         if (!message.isSet("ID")) {
@@ -1618,6 +2339,8 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
             SINFO("Received ROLLBACK_TRANSACTION with no outstanding transaction.");
         }
         _db.rollback();
+        _recordReplicateSpan(_replicateTraceID, _replicateTraceStart, _db.getCommitCount() + 1, false, false);
+        _replicateTraceID.clear();
 
         // Look through our escalated commands and see if it's one being processed
         auto commandIt = _escalatedCommandMap.find(message["ID"]);
@@ -1627,7 +2350,7 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
             SINFO("Master has rolled back in response to our command " << message["ID"]);
             commandIt->second.transaction = message;
         }
-    } else if (SIEquals(message.methodLine, "ESCALATE")) {
+    } else if (type == MessageType::ESCALATE) {
         // ESCALATE: Sent to the master by a slave. Is processed like a normal command, except when complete an
         // ESCALATE_RESPONSE is sent to the slave that initiated the escalation.
         if (!message.isSet("ID")) {
@@ -1661,9 +2384,47 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
             SQLiteCommand command(move(request));
             command.initiatingPeerID = peer->id;
             command.id = message["ID"];
+            if (message.isSet("TimeoutUS")) {
+                command.deadline = STimeNow() + message.calcU64("TimeoutUS");
+            }
             _server.acceptCommand(move(command), true);
         }
-    } else if (SIEquals(message.methodLine, "ESCALATE_CANCEL")) {
+    } else if (type == MessageType::ESCALATE_BATCH) {
+        // ESCALATE_BATCH: Sent to the master by a slave in place of the ESCALATE messages for every command it
+        // escalated since it last polled, if we said we support it when logging in. Its content is those messages.
+        list<SData> escalations = _deserializeBatch(message, "ESCALATE");
+        if (_state != MASTERING) {
+            // Each one gets its own ESCALATE_ABORTED.
+            for (auto& escalation : escalations) {
+                _onMESSAGE(peer, escalation);
+            }
+        } else {
+            // Check everything before we accept anything, so the slave doesn't get responses for part of the batch.
+            if ((*peer)["Subscribed"] != "true") {
+                STHROW("not subscribed");
+            }
+            list<SQLiteCommand> commands;
+            for (auto& escalation : escalations) {
+                if (!escalation.isSet("ID")) {
+                    STHROW("missing ID");
+                }
+                SData request;
+                if (!request.deserialize(escalation.content)) {
+                    STHROW("malformed request");
+                }
+                PINFO("Received ESCALATE command for '" << escalation["ID"] << "' (" << request.methodLine << ")");
+                commands.emplace_back(move(request));
+                commands.back().initiatingPeerID = peer->id;
+                commands.back().id = escalation["ID"];
+                if (escalation.isSet("TimeoutUS")) {
+                    commands.back().deadline = STimeNow() + escalation.calcU64("TimeoutUS");
+                }
+            }
+
+            // Send them to the server together, so they're queued all at once.
+            _server.acceptCommands(move(commands), true);
+        }
+    } else if (type == MessageType::ESCALATE_CANCEL) {
         // ESCALATE_CANCEL: Sent to the master by a slave. Indicates that the slave would like to cancel the escalated
         // command, such that it is not processed. For example, if the client that sent the original request
         // disconnects from the slave before an answer is returned, there is no value (and sometimes a negative value)
@@ -1694,7 +2455,7 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
             // (i.e., a few MS network latency would make it too late, anyway).
             _server.cancelCommand(commandID);
         }
-    } else if (SIEquals(message.methodLine, "ESCALATE_RESPONSE")) {
+    } else if (type == MessageType::ESCALATE_RESPONSE) {
         // ESCALATE_RESPONSE: Sent when the master processes the ESCALATE.
         if (_state != SLAVING) {
             STHROW("not slaving");
@@ -1720,12 +2481,19 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
             }
             command.response = response;
             command.complete = true;
+            _escalatedHold.remove(command);
             _server.acceptCommand(move(command), false);
             _escalatedCommandMap.erase(commandIt);
         } else {
             SHMMM("Received ESCALATE_RESPONSE for unknown command ID '" << message["ID"] << "', ignoring. " << message.serialize());
         }
-    } else if (SIEquals(message.methodLine, "ESCALATE_ABORTED")) {
+    } else if (type == MessageType::ESCALATE_RESPONSE_BATCH) {
+        // ESCALATE_RESPONSE_BATCH: Sent by the master in place of the ESCALATE_RESPONSE messages for every command of
+        // ours it's finished since it last polled. Its content is those messages, which we handle one at a time.
+        for (auto& response : _deserializeBatch(message, "ESCALATE_RESPONSE")) {
+            _onMESSAGE(peer, response);
+        }
+    } else if (type == MessageType::ESCALATE_ABORTED) {
         // ESCALATE_RESPONSE: Sent when the master aborts processing an escalated command. Re-submit to the new master.
         if (_state != SLAVING) {
             STHROW("not slaving");
@@ -1742,11 +2510,12 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
             SQLiteCommand& command = commandIt->second;
             PINFO("Re-queueing command '" << message["ID"] << "' (" << command.request.methodLine << ") ("
                   << command.id << ")");
+            _escalatedHold.remove(command);
             _server.acceptCommand(move(command), false);
             _escalatedCommandMap.erase(commandIt);
         } else
             SWARN("Received ESCALATE_ABORTED for unescalated command " << message["ID"] << ", ignoring.");
-    } else if (SIEquals(message.methodLine, "CRASH_COMMAND") || SIEquals(message.methodLine, "BROADCAST_COMMAND")) {
+    } else if (type == MessageType::CRASH_COMMAND || type == MessageType::BROADCAST_COMMAND) {
         // Create a new Command and send to the server.
         SData messageCopy = message;
         PINFO("Received " << message.methodLine << " command, forwarding to server.");
@@ -1756,6 +2525,35 @@ void SQLiteNode::_onMESSAGE(Peer* peer, const SData& message) {
     }
 }
 
+list<SData> SQLiteNode::_deserializeBatch(const SData& batch, const string& methodLine) {
+    if (!batch.isSet("NumCommands")) {
+        STHROW("missing NumCommands");
+    }
+    list<SData> messages;
+    const char* content = batch.content.c_str();
+    int remaining = (int)batch.content.size();
+    int messageSize = 0;
+    SData message;
+    while ((messageSize = message.deserialize(content, remaining))) {
+        content += messageSize;
+        remaining -= messageSize;
+        if (!SIEquals(message.methodLine, methodLine)) {
+            STHROW("unexpected " + message.methodLine + " in " + batch.methodLine);
+        }
+
+        // The messages in a batch are sent without the state that every message carries, as it's the same for all of
+        // them.
+        message["CommitCount"] = batch["CommitCount"];
+        message["Hash"] = batch["Hash"];
+        messages.push_back(move(message));
+        message.clear();
+    }
+    if (remaining || messages.size() != batch.calcU64("NumCommands")) {
+        STHROW("malformed " + batch.methodLine);
+    }
+    return messages;
+}
+
 void SQLiteNode::_onConnect(Peer* peer) {
     SASSERT(peer);
     SASSERTWARN(!SIEquals((*peer)["LoggedIn"], "true"));
@@ -1765,6 +2563,11 @@ void SQLiteNode::_onConnect(Peer* peer) {
     login["Priority"] = to_string(_priority);
     login["State"] = stateNames[_state];
     login["Version"] = _version;
+    login["Compression"] = "gzip";
+    login["BatchReplication"] = "true";
+    login["BatchEscalation"] = "true";
+    login["HashVersion"] = to_string(SQLite::HASH_VERSION_MAX);
+    login["Changesets"] = "true";
     _sendToPeer(peer, login);
 }
 
@@ -1787,17 +2590,28 @@ void SQLiteNode::_onDisconnect(Peer* peer) {
     ///
     if (peer->s && peer->s->sendBufferCopy().find("ESCALATE_RESPONSE") != string::npos)
         PWARN("Initiating slave died before receiving response to escalation: " << peer->s->sendBufferCopy());
+    auto pendingIt = _pendingResponses.find(peer);
+    if (pendingIt != _pendingResponses.end()) {
+        PWARN("Initiating slave died before receiving " << pendingIt->second.count << " responses to escalations: "
+              << pendingIt->second.content);
+        _pendingResponses.erase(pendingIt);
+    }
+
+    /// - Delete any snapshot we were sending it. If it reconnects, it starts over with a new one.
+    ///
+    _deleteServedSnapshot(peer->name);
 
     /// - Verify we didn't just lose contact with our master.  This should
     ///   only be possible if we're SUBSCRIBING or SLAVING.  If we did lose our
     ///   master, roll back any uncommitted transaction and go SEARCHING.
     ///
-    if (peer == _masterPeer) {
-        // We've lost our master: make sure we aren't waiting for
+    if (peer == _masterPeer || peer == _upstreamPeer) {
+        // We've lost our master (or the slave we replicate from): make sure we aren't waiting for
         // transaction response and re-SEARCH
-        PHMMM("Lost our MASTER, re-SEARCHING.");
+        PHMMM("Lost our " << (peer == _masterPeer ? "MASTER" : "upstream peer") << ", re-SEARCHING.");
         SASSERTWARN(_state == SUBSCRIBING || _state == SLAVING);
         _masterPeer = nullptr;
+        _upstreamPeer = nullptr;
         if (!_db.getUncommittedHash().empty()) {
             // We're in the middle of a transaction and waiting for it to
             // approve or deny, but we'll never get its response.  Roll it
@@ -1821,6 +2635,7 @@ void SQLiteNode::_onDisconnect(Peer* peer) {
             _server.acceptCommand(move(cmd.second), false);
         }
         _escalatedCommandMap.clear();
+        _escalatedHold.clear();
         _changeState(SEARCHING);
     }
 
@@ -1871,7 +2686,7 @@ void SQLiteNode::_onDisconnect(Peer* peer) {
     }
 }
 
-void SQLiteNode::_sendToPeer(Peer* peer, const SData& message) {
+void SQLiteNode::_sendToPeer(Peer* peer, SData message) {
     SASSERT(peer);
     SASSERT(!message.empty());
 
@@ -1880,40 +2695,123 @@ void SQLiteNode::_sendToPeer(Peer* peer, const SData& message) {
         PWARN("Can't send message to peer, no socket. Message '" << message.methodLine << "' will be discarded.");
         return;
     }
-    // Piggyback on whatever we're sending to add the CommitCount/Hash
-    SData messageCopy = message;
-    messageCopy["CommitCount"] = to_string(_db.getCommitCount());
-    messageCopy["Hash"] = _db.getCommittedHash();
-    peer->s->send(messageCopy.serialize());
+
+    // Piggyback on whatever we're sending to add the CommitCount/Hash, as they are now rather than when it's sent.
+    PendingSend send;
+    send.message = move(message);
+    send.message["CommitCount"] = to_string(_db.getCommitCount());
+    send.message["Hash"] = _db.getCommittedHash();
+    send.peers.emplace_back(peer, peer->closedConnections.load());
+    _queueSend(move(send));
+}
+
+void SQLiteNode::_sendToAllPeers(SData message, bool subscribedOnly) {
+    _sendToPeers(move(message), [](Peer* peer) { return true; }, subscribedOnly);
 }
 
-void SQLiteNode::_sendToAllPeers(const SData& message, bool subscribedOnly) {
-    // Piggyback on whatever we're sending to add the CommitCount/Hash, but only serialize once before broadcasting.
-    SData messageCopy = message;
-    if (!messageCopy.isSet("CommitCount")) {
-        messageCopy["CommitCount"] = SToStr(_db.getCommitCount());
+void SQLiteNode::_sendToPeers(SData message, const function<bool(Peer*)>& filter, bool subscribedOnly) {
+    // Piggyback on whatever we're sending to add the CommitCount/Hash, as in `_sendToPeer`.
+    PendingSend send;
+    send.message = move(message);
+    if (!send.message.isSet("CommitCount")) {
+        send.message["CommitCount"] = SToStr(_db.getCommitCount());
     }
-    if (!messageCopy.isSet("Hash")) {
-        messageCopy["Hash"] = _db.getCommittedHash();
+    if (!send.message.isSet("Hash")) {
+        send.message["Hash"] = _db.getCommittedHash();
     }
-    const string& serializedMessage = messageCopy.serialize();
 
-    // Loop across all connected peers and send the message
-    for (auto peer : peerList) {
-        // Send either to everybody, or just subscribed peers.
-        if (peer->s && (!subscribedOnly || SIEquals((*peer)["Subscribed"], "true"))) {
-            // Send it now, without waiting for the outer event loop
-            peer->s->send(serializedMessage);
+    // Send to the closest peers first, as they're the ones most likely to make up the quorum (or be the one peer
+    // needed for ONE) for a transaction. Peers we haven't measured yet go last.
+    vector<Peer*> peers = peerList;
+    stable_sort(peers.begin(), peers.end(), [](const Peer* a, const Peer* b) {
+        return (a->latency ? a->latency : UINT64_MAX) < (b->latency ? b->latency : UINT64_MAX);
+    });
+
+    // Send either to everybody, or just subscribed peers.
+    for (auto peer : peers) {
+        if (peer->s && (!subscribedOnly || SIEquals((*peer)["Subscribed"], "true")) && filter(peer)) {
+            send.peers.emplace_back(peer, peer->closedConnections.load());
         }
     }
+    if (!send.peers.empty()) {
+        _queueSend(move(send));
+    }
+}
+
+void SQLiteNode::_queueSend(PendingSend&& send) {
+    {
+        lock_guard<mutex> lock(_sendMutex);
+        _sendQueue.push_back(move(send));
+    }
+    _sendCV.notify_one();
+}
+
+void SQLiteNode::_sendThreadLoop() {
+    SInitialize("send");
+    while (true) {
+        PendingSend send;
+        {
+            unique_lock<mutex> lock(_sendMutex);
+            _sendCV.wait(lock, [this]() { return _sendExit || !_sendQueue.empty(); });
+            if (_sendQueue.empty()) {
+                break;
+            }
+            send = move(_sendQueue.front());
+            _sendQueue.pop_front();
+            _sendInProgress = true;
+        }
+        _sendQueued(send);
+        lock_guard<mutex> lock(_sendMutex);
+        _sendInProgress = false;
+    }
+}
+
+void SQLiteNode::_sendQueued(const PendingSend& send) {
+    // We serialize the message once for everybody. The content is sent after the headers as it is, as it can be a
+    // whole transaction or escalated command.
+    const SData& message = send.message;
+    const string serializedHeaders = SComposeHTTPHeaders(message.methodLine, message.nameValueMap, message.content);
+
+    // Peers that support compression all get the same compressed copy, which we only build if one of them needs it.
+    // If it doesn't compress, they get the same as everybody else.
+    string compressedMessage;
+    bool triedCompression = false;
+    bool unsent = false;
+    for (const auto& target : send.peers) {
+        Peer* peer = target.first;
+        if (peer->supportsCompression && !triedCompression) {
+            compressedMessage = peer->serializeCompressed(message, message.content);
+            triedCompression = true;
+        }
+
+        // The sync thread can close the socket at any time, so we hold it open while we write to it, and drop the
+        // message if the connection it was meant for is gone.
+        lock_guard<decltype(peer->socketMutex)> lock(peer->socketMutex);
+        if (!peer->s || peer->closedConnections.load() != target.second) {
+            PINFO("Connection closed before message '" << message.methodLine << "' was sent, discarding.");
+            continue;
+        }
+        if (peer->supportsCompression && !compressedMessage.empty()) {
+            peer->s->send(compressedMessage);
+        } else if (!serializedHeaders.empty()) {
+            peer->s->send(serializedHeaders, message.content);
+        } else {
+            peer->s->send(SComposeHTTP(message.methodLine, message.nameValueMap, message.content));
+        }
+        unsent = unsent || !peer->s->sendBufferEmpty();
+    }
+    if (unsent) {
+        _sendNotifications.push(true);
+    }
 }
 
 void SQLiteNode::broadcast(const SData& message, Peer* peer) {
     if (peer) {
-        SINFO("Sending broadcast: " << message.serialize() << " to peer: " << peer->name);
+        SINFO("Sending broadcast: " << message.methodLine << " (" << message.content.size() << " bytes) to peer: "
+              << peer->name);
         _sendToPeer(peer, message);
     } else {
-        SINFO("Sending broadcast: " << message.serialize());
+        SINFO("Sending broadcast: " << message.methodLine << " (" << message.content.size() << " bytes)");
         _sendToAllPeers(message, false);
     }
 }
@@ -1927,9 +2825,33 @@ void SQLiteNode::_changeState(SQLiteNode::State newState) {
     // mater before we complete the transition.
     _sendOutstandingTransactions();
 
+    // Likewise, slaves need any responses to their escalations before they hear that we've changed state, or they'll
+    // retry those commands. Escalations we haven't sent yet are for commands we're handing back to the server (or
+    // dropping) along with the rest of `_escalatedCommandMap` if we're no longer going to be slaving.
+    if (_state == SLAVING && newState != SLAVING) {
+        _pendingEscalations = PendingBatch();
+    }
+    _flushEscalations();
+
     // Did we actually change _state?
     SQLiteNode::State oldState = _state;
     if (newState != oldState) {
+        // Anything our apply threads have queued needs to be committed before we do anything else with the database.
+        if (oldState == SUBSCRIBING || oldState == SLAVING) {
+            _masterCommitCount.store(0);
+            _behindMasterSince.store(0);
+        }
+        if (oldState == SLAVING) {
+            _waitForApplies();
+            _applyFailed.store(false);
+            _applyQueuedThrough = 0;
+            _applyAcknowledge = false;
+            _applyLastAcknowledged = 0;
+
+            // Observers get everything we committed before we stop relaying to them.
+            _relayTransactions();
+        }
+
         // Depending on the state, set a timeout
         SDEBUG("Switching from '" << stateNames[_state] << "' to '" << stateNames[newState] << "'");
         uint64_t timeout = 0;
@@ -1938,9 +2860,15 @@ void SQLiteNode::_changeState(SQLiteNode::State newState) {
             // for the other to respond, but neither sends a response. We want a short timeout on this state.
             // TODO: Maybe it would be better to re-send the message indicating we're standing up when we see someone
             // hasn't responded.
-            timeout = STIME_US_PER_S * 5 + SRandom::rand64() % STIME_US_PER_S * 5;
+            // Every peer we're waiting on answers within a round trip, so with fast failover we give up sooner.
+            if (_fastFailover) {
+                timeout = STIME_US_PER_S + SRandom::rand64() % STIME_US_PER_S;
+            } else {
+                timeout = STIME_US_PER_S * 5 + SRandom::rand64() % STIME_US_PER_S * 5;
+            }
         } else if (newState == SEARCHING || newState == SUBSCRIBING) {
-            timeout = SQL_NODE_DEFAULT_RECV_TIMEOUT + SRandom::rand64() % STIME_US_PER_S * 5;
+            timeout = (_fastFailover ? SQL_NODE_FAST_FAILOVER_TIMEOUT : SQL_NODE_DEFAULT_RECV_TIMEOUT)
+                      + SRandom::rand64() % STIME_US_PER_S * 5;
         } else if (newState == SYNCHRONIZING) {
             timeout = SQL_NODE_SYNCHRONIZING_RECV_TIMEOUT + SRandom::rand64() % STIME_US_PER_M * 5;
         } else {
@@ -1959,11 +2887,22 @@ void SQLiteNode::_changeState(SQLiteNode::State newState) {
                 _db.rollback();
             }
         }
+        if (!SWITHIN(STANDINGUP, newState, STANDINGDOWN)) {
+            // Only the master records changesets, slaves journal whatever they're sent.
+            _db.setChangesets(false);
+        }
 
         // Clear some state if we can
+        if (_state == SYNCHRONIZING) {
+            // Any outstanding synchronization requests are no longer relevant.
+            _synchronizeRequests.clear();
+            _synchronizeResponses.clear();
+            _abandonSnapshot();
+        }
         if (newState < SUBSCRIBING) {
             // We're no longer SUBSCRIBING or SLAVING, so we have no master
             _masterPeer = nullptr;
+            _upstreamPeer = nullptr;
         }
 
         // Additional logic for some new states
@@ -1976,9 +2915,12 @@ void SQLiteNode::_changeState(SQLiteNode::State newState) {
                 // Clear these.
                 _db.getCommittedTransactions();
             }
+            _updateHashVersion();
+            _updateChangesets();
         } else if (newState == STANDINGDOWN) {
             // start the timeout countdown.
-            _standDownTimeOut.alarmDuration = STIME_US_PER_S * 30; // 30s timeout before we give up
+            _standDownTimeOut.alarmDuration = _fastFailover ? SQL_NODE_FAST_FAILOVER_TIMEOUT
+                                                            : STIME_US_PER_S * 30; // 30s timeout before we give up
             _standDownTimeOut.start();
 
             // Abort all remote initiated commands if no longer MASTERING
@@ -1989,6 +2931,7 @@ void SQLiteNode::_changeState(SQLiteNode::State newState) {
                 // So what we'll do is try and correct the problem and log the state we're coming from to see if that
                 // gives us any more useful info in the future.
                 _escalatedCommandMap.clear();
+                _escalatedHold.clear();
                 SWARN(
                     "Switching from '" << stateNames[_state] << "' to '" << stateNames[newState]
                                        << "' but _escalatedCommandMap not empty. Clearing it and hoping for the best.");
@@ -2008,11 +2951,11 @@ void SQLiteNode::_changeState(SQLiteNode::State newState) {
     }
 }
 
-void SQLiteNode::_queueSynchronize(Peer* peer, SData& response, bool sendAll) {
-    _queueSynchronizeStateless(peer->nameValueMap, name, peer->name, _state, (unsentTransactions.load() ? _lastSentTransactionID : _db.getCommitCount()), _db, response, sendAll);
+void SQLiteNode::_queueSynchronize(Peer* peer, SData& response, bool sendAll, uint64_t startCommit, uint64_t maxCommits) {
+    _queueSynchronizeStateless(peer->nameValueMap, name, peer->name, _state, (unsentTransactions.load() ? _lastSentTransactionID : _db.getCommitCount()), _db, response, sendAll, startCommit, maxCommits);
 }
 
-void SQLiteNode::_queueSynchronizeStateless(const STable& params, const string& name, const string& peerName, int _state, uint64_t targetCommit, SQLite& db, SData& response, bool sendAll) {
+void SQLiteNode::_queueSynchronizeStateless(const STable& params, const string& name, const string& peerName, int _state, uint64_t targetCommit, SQLite& db, SData& response, bool sendAll, uint64_t startCommit, uint64_t maxCommits) {
     // This is a hack to make the PXXXX macros works, since they expect `peer->name` to be defined.
     struct {string name;} peerBase;
     auto peer = &peerBase;
@@ -2025,6 +2968,21 @@ void SQLiteNode::_queueSynchronizeStateless(const STable& params, const string&
     }
     if (peerCommitCount > db.getCommitCount())
         STHROW("you have more data than me");
+
+    // If our journal doesn't go back far enough to catch the peer up (or it has nothing at all and is very far
+    // behind), tell it to get a snapshot instead. We can't do this for SUBSCRIBE, which must send everything.
+    uint64_t oldestCommit = db.getOldestCommit();
+    if (!sendAll && ((peerCommitCount && peerCommitCount < oldestCommit) ||
+                     (!peerCommitCount && (oldestCommit > 1 || targetCommit >= SQL_NODE_SNAPSHOT_THRESHOLD)))) {
+        PINFO("Peer at commit #" << peerCommitCount << " can't be synchronized from our journal (oldest commit #"
+              << oldestCommit << ", target commit #" << targetCommit << "), it needs a snapshot.");
+        if (startCommit) {
+            response["StartCommit"] = SToStr(startCommit);
+        }
+        response["SnapshotRequired"] = "true";
+        response["NumCommits"] = "0";
+        return;
+    }
     if (peerCommitCount) {
         // It has some data -- do we agree on what we share?
         string myHash, ignore;
@@ -2046,17 +3004,24 @@ void SQLiteNode::_queueSynchronizeStateless(const STable& params, const string&
         PINFO("Peer has no commits, beginning synchronization.");
     }
 
+    // A pipelined request asks for a specific chunk, which we echo back so the peer can tell which one this is.
+    if (startCommit) {
+        response["StartCommit"] = SToStr(startCommit);
+    }
+
     // We agree on what we share, do we need to give it more?
     SQResult result;
-    if (peerCommitCount == targetCommit) {
+    uint64_t fromIndex = max(peerCommitCount + 1, startCommit);
+    if (peerCommitCount == targetCommit || fromIndex > targetCommit) {
         // Already synchronized; nothing to send
         PINFO("Peer is already synchronized");
         response["NumCommits"] = "0";
     } else {
         // Figure out how much to send it
-        uint64_t fromIndex = peerCommitCount + 1;
         uint64_t toIndex = targetCommit;
-        if (!sendAll)
+        if (startCommit && maxCommits)
+            toIndex = min(toIndex, fromIndex + maxCommits - 1); // The chunk the peer asked for
+        else if (!sendAll)
             toIndex = min(toIndex, fromIndex + 100); // 100 transactions at a time
         if (!db.getCommits(fromIndex, toIndex, result))
             STHROW("error getting commits");
@@ -2064,13 +3029,13 @@ void SQLiteNode::_queueSynchronizeStateless(const STable& params, const string&
             STHROW("mismatched commit count");
 
         // Wrap everything into one huge message
-        PINFO("Synchronizing commits from " << peerCommitCount + 1 << "-" << targetCommit);
+        PINFO("Synchronizing commits from " << fromIndex << "-" << toIndex);
         response["NumCommits"] = SToStr(result.size());
         for (size_t c = 0; c < result.size(); ++c) {
             // Queue the result
             SASSERT(result[c].size() == 2);
             SData commit("COMMIT");
-            commit["CommitIndex"] = SToStr(peerCommitCount + c + 1);
+            commit["CommitIndex"] = SToStr(fromIndex + c);
             commit["Hash"] = result[c][0];
             commit.content = result[c][1];
             response.content += commit.serialize();
@@ -2079,6 +3044,248 @@ void SQLiteNode::_queueSynchronizeStateless(const STable& params, const string&
     }
 }
 
+void SQLiteNode::_sendSynchronizeRequests() {
+    SASSERT(_syncPeer);
+
+    // If nothing's outstanding, we start from wherever we are now.
+    if (_synchronizeRequests.empty()) {
+        _synchronizeResponses.clear();
+        _synchronizeRequestedThrough = _db.getCommitCount();
+    }
+
+    // Keep the pipeline full, but always ask for something if we have nothing outstanding, as that's how we'll find
+    // out that our peer's commit count has changed.
+    uint64_t peerCommitCount = _syncPeer->calcU64("CommitCount");
+    while (_synchronizeRequests.empty() || (_synchronizeRequests.size() < SQL_NODE_SYNCHRONIZE_PIPELINE_DEPTH &&
+                                            _synchronizeRequestedThrough < peerCommitCount)) {
+        uint64_t startCommit = _synchronizeRequestedThrough + 1;
+        uint64_t numCommits = _synchronizeChunkCommits;
+        if (peerCommitCount > _synchronizeRequestedThrough) {
+            numCommits = min(numCommits, peerCommitCount - _synchronizeRequestedThrough);
+        }
+        SData request("SYNCHRONIZE");
+        request["StartCommit"] = SToStr(startCommit);
+        request["MaxCommits"] = SToStr(numCommits);
+        _sendToPeer(_syncPeer, request);
+        _synchronizeRequests[startCommit] = make_pair(STimeNow(), numCommits);
+        _synchronizeRequestedThrough += numCommits;
+    }
+}
+
+bool SQLiteNode::_recvSynchronizeResponse(Peer* peer, const SData& message) {
+    if (!message.isSet("StartCommit")) {
+        // This peer doesn't support pipelined requests, and answers each one with the chunk following whatever our
+        // commit count was when we asked. Only the first response to a round of requests is useful, so we skip the
+        // rest, and start the next round from scratch.
+        SData first;
+        if (message.calc("NumCommits") && first.deserialize(message.content) &&
+            first.calcU64("CommitIndex") != _db.getCommitCount() + 1) {
+            return false;
+        }
+        _recvSynchronize(peer, message);
+        _synchronizeRequests.clear();
+        return true;
+    }
+
+    // Is this a response we're waiting for?
+    uint64_t startCommit = message.calcU64("StartCommit");
+    auto requestIt = _synchronizeRequests.find(startCommit);
+    if (requestIt == _synchronizeRequests.end()) {
+        PINFO("Ignoring SYNCHRONIZE_RESPONSE for commit #" << startCommit << " that we're not waiting for.");
+        return false;
+    }
+
+    // Adjust our chunk size based on how long this one took, and how big its commits were.
+    uint64_t latency = STimeNow() - requestIt->second.first;
+    uint64_t numCommits = message.calcU64("NumCommits");
+    if (numCommits) {
+        uint64_t bytesPerCommit = max((uint64_t)1, (uint64_t)message.content.size() / numCommits);
+        _synchronizeBytesPerCommit = _synchronizeBytesPerCommit ? (_synchronizeBytesPerCommit * 3 + bytesPerCommit) / 4
+                                                                : bytesPerCommit;
+        if (latency < SQL_NODE_SYNCHRONIZE_TARGET_LATENCY) {
+            _synchronizeChunkCommits *= 2;
+        } else if (latency > SQL_NODE_SYNCHRONIZE_TARGET_LATENCY * 2) {
+            _synchronizeChunkCommits /= 2;
+        }
+        uint64_t maxChunkCommits = max((uint64_t)10, SQL_NODE_SYNCHRONIZE_MAX_CHUNK_BYTES / _synchronizeBytesPerCommit);
+        _synchronizeChunkCommits = min(max(_synchronizeChunkCommits, (uint64_t)10), maxChunkCommits);
+        PINFO("SYNCHRONIZE_RESPONSE for commit #" << startCommit << " took " << latency / 1000 << "ms for "
+              << message.content.size() << " bytes, chunk size now " << _synchronizeChunkCommits << " commits.");
+    }
+
+    // If it's arrived ahead of an earlier chunk, hold onto it until that one shows up.
+    if (startCommit != _db.getCommitCount() + 1) {
+        _synchronizeResponses.emplace(startCommit, message);
+        return false;
+    }
+
+    // Apply this response, and then any that we were holding that follow it.
+    SData next;
+    const SData* response = &message;
+    while (true) {
+        uint64_t requestedCommits = _synchronizeRequests[startCommit].second;
+        _synchronizeRequests.erase(startCommit);
+        _recvSynchronize(peer, *response);
+
+        // If our peer had less to send than we asked for, our later requests won't line up with what we have.
+        // Discard them, and we'll start a new round from our current commit.
+        uint64_t commitCount = _db.getCommitCount();
+        if (commitCount < startCommit + requestedCommits - 1) {
+            _synchronizeRequests.clear();
+            _synchronizeResponses.clear();
+            break;
+        }
+
+        // Do we have the next one already?
+        auto nextIt = _synchronizeResponses.find(commitCount + 1);
+        if (nextIt == _synchronizeResponses.end()) {
+            break;
+        }
+        startCommit = nextIt->first;
+        next = move(nextIt->second);
+        _synchronizeResponses.erase(nextIt);
+        response = &next;
+    }
+    return true;
+}
+
+void SQLiteNode::_queueSnapshotStateless(const string& name, const string& peerName, int _state, uint64_t offset, SQLite& db, SData& response) {
+    // This is a hack to make the PXXXX macros works, since they expect `peer->name` to be defined.
+    struct {string name;} peerBase;
+    auto peer = &peerBase;
+    peerBase.name = peerName;
+
+    // Each peer gets its own snapshot, created when it asks for the first chunk.
+    const string path = _snapshotPathFor(db, peerName);
+    {
+        lock_guard<mutex> lock(_servedSnapshotsMutex);
+        _servedSnapshots[path] = STimeNow();
+    }
+    if (!offset) {
+        PINFO("Creating snapshot at commit #" << db.getCommitCount() << ".");
+        if (!db.createSnapshot(path)) {
+            STHROW("failed to create snapshot");
+        }
+
+        // Making it may have taken a while, which doesn't count against the peer.
+        lock_guard<mutex> lock(_servedSnapshotsMutex);
+        _servedSnapshots[path] = STimeNow();
+    } else if (!SFileExists(path)) {
+        STHROW("no snapshot in progress");
+    }
+    uint64_t size = SFileSize(path);
+    if (offset > size) {
+        STHROW("invalid snapshot offset");
+    }
+
+    // Read the chunk they asked for.
+    string chunk(min((uint64_t)SQL_NODE_SNAPSHOT_CHUNK_BYTES, size - offset), '\0');
+    FILE* fp = fopen(path.c_str(), "rb");
+    bool success = fp && !fseeko(fp, offset, SEEK_SET) && fread(&chunk[0], 1, chunk.size(), fp) == chunk.size();
+    if (fp) {
+        fclose(fp);
+    }
+    if (!success) {
+        STHROW("failed to read snapshot");
+    }
+    response["Offset"] = SToStr(offset);
+    response["Size"] = SToStr(size);
+    response.content = move(chunk);
+
+    // Once the last chunk is on its way, we're done with the snapshot.
+    if (offset + response.content.size() == size) {
+        PINFO("Sending final snapshot chunk, " << size << " bytes total.");
+        lock_guard<mutex> lock(_servedSnapshotsMutex);
+        _servedSnapshots.erase(path);
+        SFileDelete(path);
+    }
+}
+
+string SQLiteNode::_snapshotPathFor(SQLite& db, const string& peerName) {
+    return db.getFilename() + ".snapshot." + peerName;
+}
+
+void SQLiteNode::_deleteServedSnapshot(const string& peerName) {
+    // A worker may still be reading or creating this, in which case it fails to find it for the next chunk, which the
+    // peer, having gone away, won't ask for anyway.
+    const string path = _snapshotPathFor(_db, peerName);
+    lock_guard<mutex> lock(_servedSnapshotsMutex);
+    if (_servedSnapshots.erase(path) && SFileExists(path)) {
+        SINFO("Deleting snapshot '" << path << "'.");
+        SFileDelete(path);
+    }
+}
+
+void SQLiteNode::_expireServedSnapshots(uint64_t& nextActivity) {
+    const uint64_t now = STimeNow();
+    lock_guard<mutex> lock(_servedSnapshotsMutex);
+    for (auto it = _servedSnapshots.begin(); it != _servedSnapshots.end();) {
+        const uint64_t expiry = it->second + SQL_NODE_SNAPSHOT_SERVE_TIMEOUT;
+        if (expiry > now) {
+            nextActivity = min(nextActivity, expiry);
+            it++;
+            continue;
+        }
+        SINFO("Deleting snapshot '" << it->first << "', nobody's asked for any of it in "
+              << (now - it->second) / STIME_US_PER_S << "s.");
+        if (SFileExists(it->first)) {
+            SFileDelete(it->first);
+        }
+        it = _servedSnapshots.erase(it);
+    }
+}
+
+void SQLiteNode::_recvSnapshot(Peer* peer, const SData& message) {
+    if (message.isSet("Error")) {
+        STHROW("peer refused snapshot: " + message["Error"]);
+    }
+    if (message.calcU64("Offset") != _snapshotOffset) {
+        STHROW("snapshot offset mismatch");
+    }
+
+    // Append this chunk to what we've got so far.
+    FILE* fp = fopen(_snapshotPath.c_str(), _snapshotOffset ? "ab" : "wb");
+    bool success = fp && fwrite(message.content.data(), 1, message.content.size(), fp) == message.content.size();
+    if (fp) {
+        success = !fclose(fp) && success;
+    }
+    if (!success) {
+        STHROW("failed to write snapshot");
+    }
+    _snapshotOffset += message.content.size();
+
+    // Ask for more if there is any.
+    uint64_t size = message.calcU64("Size");
+    if (_snapshotOffset < size) {
+        if (message.content.empty()) {
+            STHROW("empty snapshot chunk");
+        }
+        PINFO("Received " << _snapshotOffset << " of " << size << " snapshot bytes.");
+        SData request("SNAPSHOT");
+        request["Offset"] = SToStr(_snapshotOffset);
+        _sendToPeer(peer, request);
+        return;
+    }
+
+    // We have all of it, swap it in.
+    PINFO("Received complete " << size << " byte snapshot, restoring.");
+    bool restored = _db.restoreSnapshot(_snapshotPath);
+    _abandonSnapshot();
+    if (!restored) {
+        STHROW("failed to restore snapshot");
+    }
+}
+
+void SQLiteNode::_abandonSnapshot() {
+    if (!_snapshotPath.empty()) {
+        if (SFileExists(_snapshotPath)) {
+            SFileDelete(_snapshotPath);
+        }
+        _snapshotPath.clear();
+        _snapshotOffset = 0;
+    }
+}
+
 void SQLiteNode::_recvSynchronize(Peer* peer, const SData& message) {
     SASSERT(peer);
     // Walk across the content and commit in order
@@ -2089,9 +3296,10 @@ void SQLiteNode::_recvSynchronize(Peer* peer, const SData& message) {
     const char* content = message.content.c_str();
     int messageSize = 0;
     int remaining = (int)message.content.size();
+    list<SData> batch;
+    size_t batchBytes = 0;
     while ((messageSize = commit.deserialize(content, remaining))) {
-        // Consume this message and process
-        // **FIXME: This could be optimized to commit in one huge transaction
+        // Consume this message and validate it
         content += messageSize;
         remaining -= messageSize;
         if (!SIEquals(commit.methodLine, "COMMIT"))
@@ -2104,14 +3312,55 @@ void SQLiteNode::_recvSynchronize(Peer* peer, const SData& message) {
             STHROW("missing Hash");
         if (commit.content.empty())
             SALERT("Synchronized blank query");
-        if (commit.calcU64("CommitIndex") != _db.getCommitCount() + 1)
+        if (commit.calcU64("CommitIndex") != _db.getCommitCount() + batch.size() + 1)
             STHROW("commit index mismatch");
+
+        // Queue it up, and apply what we've got once the batch is full.
+        batchBytes += commit.content.size();
+        batch.push_back(move(commit));
+        if (batch.size() >= SQL_NODE_SYNCHRONIZE_BATCH_COMMITS || batchBytes >= SQL_NODE_SYNCHRONIZE_BATCH_BYTES) {
+            _applySynchronizedCommits(batch);
+            commitsRemaining -= batch.size();
+            batch.clear();
+            batchBytes = 0;
+        }
+    }
+    if (!batch.empty()) {
+        _applySynchronizedCommits(batch);
+        commitsRemaining -= batch.size();
+    }
+
+    // Did we get all our commits?
+    if (commitsRemaining)
+        STHROW("commits remaining at end");
+}
+
+void SQLiteNode::_applySynchronizedCommits(const list<SData>& commits) {
+    // Try to commit the whole batch at once. There's no benefit to this for a single commit.
+    if (commits.size() > 1) {
+        list<pair<string, string>> transactions;
+        for (const SData& commit : commits) {
+            transactions.emplace_back(commit.content, commit["Hash"]);
+        }
+        uint64_t start = STimeNow();
+        if (_db.commitBatch(transactions)) {
+            SINFO("Applied " << commits.size() << " synchronized commits in one transaction in "
+                  << ((STimeNow() - start) / 1000) << "ms.");
+            return;
+        }
+        SWARN("Failed to apply " << commits.size() << " synchronized commits as a batch, applying individually.");
+    }
+
+    // Apply them one at a time. If the batch failed, this gets us as far as possible and fails on the commit that
+    // caused the problem.
+    for (const SData& commit : commits) {
         if (!_db.beginTransaction())
             STHROW("failed to begin transaction");
         try {
             // Inside a transaction; get ready to back out if an error
             if (!_db.writeUnmodified(commit.content))
                 STHROW("failed to write transaction");
+            _db.setHashVersion(SQLite::getHashVersion(commit["Hash"]));
             if (!_db.prepare())
                 STHROW("failed to prepare transaction");
         } catch (const SException& e) {
@@ -2127,12 +3376,7 @@ void SQLiteNode::_recvSynchronize(Peer* peer, const SData& message) {
         _db.commit();
         if (_db.getCommittedHash() != commit["Hash"])
             STHROW("potential hash mismatch");
-        --commitsRemaining;
     }
-
-    // Did we get all our commits?
-    if (commitsRemaining)
-        STHROW("commits remaining at end");
 }
 
 void SQLiteNode::_updateSyncPeer()
@@ -2204,6 +3448,26 @@ void SQLiteNode::_updateSyncPeer()
     }
 }
 
+void SQLiteNode::_updateHashVersion() {
+    int version = SQLite::HASH_VERSION_MAX;
+    for (auto peer : peerList) {
+        if (SIEquals((*peer)["LoggedIn"], "true")) {
+            version = min(version, max(1, SToInt((*peer)["HashVersion"])));
+        }
+    }
+    _db.setHashVersion(version);
+}
+
+void SQLiteNode::_updateChangesets() {
+    bool enable = _changesetReplication;
+    for (auto peer : peerList) {
+        if (SIEquals((*peer)["LoggedIn"], "true") && (*peer)["Changesets"] != "true") {
+            enable = false;
+        }
+    }
+    _db.setChangesets(enable);
+}
+
 void SQLiteNode::_reconnectPeer(Peer* peer) {
     // If we're connected, just kill the connection
     if (peer->s) {
@@ -2239,6 +3503,10 @@ bool SQLiteNode::_majoritySubscribed() {
 }
 
 
+bool SQLiteNode::_canPeekPeerRequests() {
+    return _state == MASTERING || _state == STANDINGDOWN || _state == SLAVING;
+}
+
 bool SQLiteNode::peekPeerCommand(SQLiteNode* node, SQLite& db, SQLiteCommand& command)
 {
     Peer* peer = nullptr;
@@ -2257,7 +3525,27 @@ bool SQLiteNode::peekPeerCommand(SQLiteNode* node, SQLite& db, SQLiteCommand& co
                                        SToUInt64(command.request["targetCommit"]),
                                        db,
                                        command.response,
-                                       false);
+                                       false,
+                                       command.request.calcU64("StartCommit"),
+                                       command.request.calcU64("MaxCommits"));
+
+            // The following two lines are copied from `_sendToPeer`.
+            command.response["CommitCount"] = to_string(db.getCommitCount());
+            command.response["Hash"] = db.getCommittedHash();
+            peer->sendMessage(command.response);
+            return true;
+        } else if (SIEquals(command.request.methodLine, "SNAPSHOT")) {
+            peer = node->getPeerByID(SToUInt64(command.request["peerID"]));
+            if (!peer) {
+                return true;
+            }
+            command.response.methodLine = "SNAPSHOT_RESPONSE";
+            _queueSnapshotStateless(command.request["name"],
+                                    command.request["peerName"],
+                                    SToInt(command.request["state"]),
+                                    command.request.calcU64("Offset"),
+                                    db,
+                                    command.response);
 
             // The following two lines are copied from `_sendToPeer`.
             command.response["CommitCount"] = to_string(db.getCommitCount());
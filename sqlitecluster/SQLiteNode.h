@@ -1,5 +1,6 @@
 #pragma once
 #include "SQLite.h"
+#include "SQLiteCommandHold.h"
 class SQLiteCommand;
 class SQLiteServer;
 
@@ -15,6 +16,33 @@ class SQLiteNode : public STCPNode {
     // Separate timeout for receiving and applying synchronization commits.
     static const uint64_t SQL_NODE_SYNCHRONIZING_RECV_TIMEOUT;
 
+    // Limits on how many synchronized commits (and how many bytes of queries) we'll apply in a single transaction.
+    static const size_t SQL_NODE_SYNCHRONIZE_BATCH_COMMITS;
+    static const size_t SQL_NODE_SYNCHRONIZE_BATCH_BYTES;
+
+    // While synchronizing, we keep this many SYNCHRONIZE requests outstanding to our sync peer, so that we can apply
+    // one chunk of commits while the next is on the wire. Chunks grow while they come back faster than the target
+    // latency, shrink when they come back much slower, and never get larger than the maximum size.
+    static const size_t SQL_NODE_SYNCHRONIZE_PIPELINE_DEPTH;
+    static const uint64_t SQL_NODE_SYNCHRONIZE_TARGET_LATENCY;
+    static const size_t SQL_NODE_SYNCHRONIZE_MAX_CHUNK_BYTES;
+
+    // A peer that's too far behind to catch up from our journal is sent a snapshot of the whole database instead, in
+    // chunks of this size. Peers with no commits at all get a snapshot once we're this many commits ahead of them.
+    static const size_t SQL_NODE_SNAPSHOT_CHUNK_BYTES;
+    static const uint64_t SQL_NODE_SNAPSHOT_THRESHOLD;
+
+    // Creating a snapshot of a large database can take a long time, so we wait this long for each chunk of one.
+    static const uint64_t SQL_NODE_SNAPSHOT_RECV_TIMEOUT;
+
+    // A snapshot we're serving that nobody's asked for a chunk of in this long has been given up on, and is deleted.
+    static const uint64_t SQL_NODE_SNAPSHOT_SERVE_TIMEOUT;
+
+    // With fast failover enabled, we PING peers this often, and the states that wait on peers that may be gone give
+    // up after this long rather than after SQL_NODE_DEFAULT_RECV_TIMEOUT.
+    static const uint64_t SQL_NODE_HEARTBEAT_INTERVAL;
+    static const uint64_t SQL_NODE_FAST_FAILOVER_TIMEOUT;
+
     // Possible states of a node in a DB cluster
     enum State {
         SEARCHING,     // Searching for peers
@@ -58,6 +86,34 @@ class SQLiteNode : public STCPNode {
     const string& getMasterVersion() { return _masterVersion; }
     const string& getVersion()       { return _version; }
     uint64_t      getCommitCount()   { return _db.getCommitCount(); }
+    uint64_t      getCacheHits()     { return _db.getCacheHits(); }
+    uint64_t      getCacheMisses()   { return _db.getCacheMisses(); }
+
+    // While we're slaving, the highest commit count we've heard the master has, and how long we've been behind it (0 if
+    // we've caught up, or aren't slaving). These can be called from any thread.
+    uint64_t getMasterCommitCount() { return _masterCommitCount.load(); }
+    uint64_t getReplicationLagUS();
+
+    // Limits how many commands we hold while they're escalated to the master, and how many bytes their requests take
+    // (0 for no limit). With `expireOldest`, once we're holding as many as we're allowed, the oldest is answered with a
+    // 555 to make room for each one escalated after it. Otherwise, it's up to the server to stop taking commands
+    // while `getEscalatedHold` is full.
+    void setEscalatedLimits(uint64_t maxCount, uint64_t maxBytes, bool expireOldest);
+    const SQLiteCommandHold& getEscalatedHold() const { return _escalatedHold; }
+
+    // Gives each command we escalate a deadline of `timeoutUS` after it was created, unless its client already set one
+    // with `clientTimeout`, after which we answer it with a 555 rather than keep waiting on master. The time it has
+    // left is sent with it, so that master can skip it if it's still queued when that runs out.
+    void setEscalationTimeout(uint64_t timeoutUS);
+
+    // Brings the deadline of every command we've escalated, and any we escalate from now on, forward to `deadline`
+    // if it's later. Used when shutting down, so a slow master can't hold us up past the time we have.
+    void expireEscalationsBy(uint64_t deadline);
+
+    // Makes this permaslave an observer that subscribes to the named slave, rather than to the master, and receives
+    // the master's commits from it as that slave commits them. Falls back to subscribing to the master while that
+    // slave isn't SLAVING. Has no effect on a node with a non-zero priority.
+    void setUpstreamPeer(const string& peerName);
 
     // Returns whether we're in the process of gracefully shutting down.
     bool gracefulShutdown() { return (_gracefulShutdownTimeout.alarmDuration != 0); }
@@ -81,8 +137,9 @@ class SQLiteNode : public STCPNode {
     bool update();
 
     // Begins the process of committing a transaction on this SQLiteNode's database. When this returns,
-    // commitInProgress() will return true until the commit completes.
-    void startCommit(ConsistencyLevel consistency);
+    // commitInProgress() will return true until the commit completes. If the command being committed is traced,
+    // `traceID` is passed on to slaves with the transaction, and a "distributedCommit" span is recorded for it.
+    void startCommit(ConsistencyLevel consistency, const string& traceID = "");
 
     // If we have a command that can't be handled on a slave, we can escalate it to the master node. The SQLiteNode
     // takes ownership of the command until it receives a response from the slave. When the command completes, it will
@@ -104,9 +161,37 @@ class SQLiteNode : public STCPNode {
     // threads making commits to the database, and they communicate that to the node via this flag.
     static atomic<bool> unsentTransactions;
 
+    // The number of transactions committed by other threads that are waiting to hear that peers have committed them
+    // too. While this is non-zero, we ask slaves to acknowledge each transaction they commit.
+    static atomic<int> acknowledgementsRequested;
+
+    // Returns the highest commit count that enough peers have acknowledged committing to satisfy `consistency`, by
+    // the same rules used to approve a distributed transaction. Only meaningful while mastering.
+    uint64_t getAcknowledgedCommitCount(ConsistencyLevel consistency);
+
     // This exists so that the _server can inspect internal state for diagnostic purposes.
     list<string> getEscalatedCommandRequestMethodLines();
 
+    // Starts `threads` threads that apply ASYNC transactions in parallel while we're slaving, each with its own handle
+    // to `filename` using the journal tables starting at `firstJournalTable`. The other arguments are as for
+    // `SQLite`, and `mmapSize` is passed to `SQLite::setMmapSize` if it's set. Call once, before the first `update`.
+    void enableParallelApply(const string& filename, int cacheSize, int maxJournalSize, int firstJournalTable,
+                             int threads, const string& synchronous, int64_t mmapSize = 0);
+
+    // Enables fast failover: a peer that stops answering heartbeats is dropped within a second, and STANDINGUP,
+    // STANDINGDOWN, SEARCHING and SUBSCRIBING time out in seconds rather than minutes. Call once, before the first
+    // `update`.
+    void enableFastFailover();
+
+    // Lets this node journal its commits as changesets while it's master, so that slaves apply the rows each commit
+    // changed instead of running its queries again. This only happens while every logged in peer supports them. See
+    // SQLite::setChangesets.
+    void enableChangesetReplication();
+
+    // STCPNode API. These let us hear about transactions applied on other threads.
+    void prePoll(fd_map& fdm);
+    void postPoll(fd_map& fdm, uint64_t& nextActivity);
+
     // This mutex is exposed publicly so that others (particularly, the _server) can atomically act on the current
     // state of the node. When working with this and SQLite::g_commitLock, the correct order of acquisition is always:
     // 1. stateMutex
@@ -122,6 +207,37 @@ class SQLiteNode : public STCPNode {
     void _onDisconnect(Peer* peer);
     void _onMESSAGE(Peer* peer, const SData& message);
 
+    // The messages peers send each other, so that `_onMESSAGE` can look up what it's been sent once rather than
+    // comparing the method line against every message it knows in turn.
+    enum class MessageType {
+        UNKNOWN,
+        LOGIN,
+        STATE,
+        STANDUP_RESPONSE,
+        SYNCHRONIZE,
+        SYNCHRONIZE_RESPONSE,
+        SNAPSHOT,
+        SNAPSHOT_RESPONSE,
+        SUBSCRIBE,
+        SUBSCRIPTION_APPROVED,
+        BEGIN_TRANSACTION,
+        APPROVE_TRANSACTION,
+        DENY_TRANSACTION,
+        COMMIT_TRANSACTION,
+        REPLICATE_TRANSACTIONS,
+        ACKNOWLEDGE_TRANSACTION,
+        ROLLBACK_TRANSACTION,
+        ESCALATE,
+        ESCALATE_BATCH,
+        ESCALATE_CANCEL,
+        ESCALATE_RESPONSE,
+        ESCALATE_RESPONSE_BATCH,
+        ESCALATE_ABORTED,
+        CRASH_COMMAND,
+        BROADCAST_COMMAND
+    };
+    static MessageType _getMessageType(const string& methodLine);
+
     // Handle to the underlying database that we write to. This should also be passed to an SQLiteCore object that can
     // actually perform some action on the DB. When those action are complete, you can call SQLiteNode::startCommit()
     // to commit and replicate them.
@@ -132,6 +248,54 @@ class SQLiteNode : public STCPNode {
     void _updateSyncPeer();
     Peer* _syncPeer;
 
+    // Pipelined synchronization state. `_synchronizeRequests` maps the first commit of each outstanding SYNCHRONIZE
+    // request to the time it was sent and the number of commits requested, and `_synchronizeResponses` holds
+    // responses that arrived ahead of the ones before them. `_synchronizeRequestedThrough` is the highest commit
+    // we've asked for. These are only used while SYNCHRONIZING, and cleared when we leave that state.
+    map<uint64_t, pair<uint64_t, uint64_t>> _synchronizeRequests;
+    map<uint64_t, SData> _synchronizeResponses;
+    uint64_t _synchronizeRequestedThrough;
+
+    // The number of commits we'll ask for in each SYNCHRONIZE request, and our running estimate of the size of each
+    // commit, used to keep chunks under SQL_NODE_SYNCHRONIZE_MAX_CHUNK_BYTES.
+    uint64_t _synchronizeChunkCommits;
+    uint64_t _synchronizeBytesPerCommit;
+
+    // Sends SYNCHRONIZE requests to our sync peer until we either have SQL_NODE_SYNCHRONIZE_PIPELINE_DEPTH of them
+    // outstanding or have asked for everything it has.
+    void _sendSynchronizeRequests();
+
+    // Handles a SYNCHRONIZE_RESPONSE from our sync peer, applying it and any buffered responses that follow it.
+    // Returns false if nothing was applied (because the response was stale, or is waiting on an earlier one).
+    bool _recvSynchronizeResponse(Peer* peer, const SData& message);
+
+    // When our sync peer tells us we need a snapshot, we download it to this path, and `_snapshotOffset` is how many
+    // bytes of it we've received. Empty unless a snapshot download is in progress.
+    string _snapshotPath;
+    uint64_t _snapshotOffset;
+
+    // Handles a chunk of a snapshot from our sync peer, requesting the next one or, once we have it all, restoring it
+    // and continuing synchronization from the journal.
+    void _recvSnapshot(Peer* peer, const SData& message);
+
+    // Cancels any in-progress snapshot download.
+    void _abandonSnapshot();
+
+    // Fills `response` with the chunk of our snapshot starting at `offset`, creating the snapshot if `offset` is 0.
+    // Like _queueSynchronizeStateless, this is thread-safe.
+    static void _queueSnapshotStateless(const string& name, const string& peerName, int _state, uint64_t offset, SQLite& db, SData& response);
+
+    // Every snapshot file we're serving, with the last time a chunk of it was asked for, protected by
+    // `_servedSnapshotsMutex`. Each is a copy of the whole database, so it's deleted once its last chunk is sent, its
+    // peer disconnects, or it's gone unread for SQL_NODE_SNAPSHOT_SERVE_TIMEOUT.
+    static mutex _servedSnapshotsMutex;
+    static map<string, uint64_t> _servedSnapshots;
+    static string _snapshotPathFor(SQLite& db, const string& peerName);
+    void _deleteServedSnapshot(const string& peerName);
+
+    // Deletes every snapshot that's gone unread too long, and lowers `nextActivity` to when the next one will.
+    void _expireServedSnapshots(uint64_t& nextActivity);
+
     // Store the ID of the last transaction that we replicated to peers. Whenever we do an update, we will try and send
     // any new committed transactions to peers, and update this value.
     static uint64_t _lastSentTransactionID;
@@ -146,6 +310,14 @@ class SQLiteNode : public STCPNode {
     // Pointer to the peer that is the master. Null if we're the master, or if we don't have a master yet.
     Peer* _masterPeer;
 
+    // The name of the slave we'd like to replicate from (see setUpstreamPeer), and the peer we're currently subscribed
+    // to in its place, if any. Escalations still go straight to _masterPeer.
+    string _upstreamName;
+    Peer* _upstreamPeer;
+
+    // Returns the peer our transactions come from: our upstream slave if we have one, otherwise our master.
+    Peer* _replicationPeer() { return _upstreamPeer ? _upstreamPeer : _masterPeer; }
+
     // Timestamp that, if we pass with no activity, we'll give up on our current state, and start over from SEARCHING.
     uint64_t _stateTimeout;
 
@@ -156,12 +328,34 @@ class SQLiteNode : public STCPNode {
     // The write consistency requested for the current in-progress commit.
     ConsistencyLevel _commitConsistency;
 
+    // When we sent the BEGIN_TRANSACTION for the current in-progress commit, so we can time each peer's approval. Each
+    // peer's average is kept in its "ApprovalLatencyUS", which shows up in `Status`.
+    uint64_t _commitStartTime;
+
+    // The `traceID` of the command being committed, if it's traced.
+    string _commitTraceID;
+
+    // On a slave, the `traceID` of the transaction we've begun but not yet been told to commit or roll back, if it's
+    // traced, and when its BEGIN_TRANSACTION arrived.
+    string _replicateTraceID;
+    uint64_t _replicateTraceStart;
+
+    // Records a "replicate" span for a traced transaction, from when its BEGIN_TRANSACTION arrived until now.
+    static void _recordReplicateSpan(const string& traceID, uint64_t start, uint64_t commitCount, bool succeeded,
+                                     bool applyThread);
+
     // Stopwatch to track if we're going to give up on gracefully shutting down and force it.
     SStopwatch _gracefulShutdownTimeout;
 
     // Stopwatch to track if we're giving up on the server preventing a standdown.
     SStopwatch _standDownTimeOut;
 
+    // Set by enableFastFailover.
+    bool _fastFailover;
+
+    // Set by enableChangesetReplication.
+    bool _changesetReplication;
+
     // Our version string. Supplied by constructor.
     string _version;
 
@@ -175,30 +369,161 @@ class SQLiteNode : public STCPNode {
     // The number of commits we've actually done since the last quorum command.
     int _commitsSinceCheckpoint;
 
-    // Helper methods
-    void _sendToPeer(Peer* peer, const SData& message);
-    void _sendToAllPeers(const SData& message, bool subscribedOnly = false);
+    // Helper methods. These take the message by value so that callers done with it can move it, rather than copying
+    // a transaction or escalated command into the send queue.
+    void _sendToPeer(Peer* peer, SData message);
+    void _sendToAllPeers(SData message, bool subscribedOnly = false);
+
+    // Sends `message` to every connected peer for which `filter` returns true, serializing it only once.
+    void _sendToPeers(SData message, const function<bool(Peer*)>& filter, bool subscribedOnly = true);
+
+    // Messages sent with the above. The caller works out what to send and to whom, but serializing, compressing and
+    // writing it to each peer's socket is left to `_sendThread`, so a big message or a slow peer doesn't hold up the
+    // sync thread. Messages go out in the order they're queued, and each only on the connection its peer had when it
+    // was queued (as counted by `closedConnections`).
+    struct PendingSend {
+        SData message;
+        list<pair<Peer*, uint64_t>> peers;
+    };
+    void _queueSend(PendingSend&& send);
+    void _sendThreadLoop();
+    void _sendQueued(const PendingSend& send);
+
+    // Protected by `_sendMutex`, and `_sendCV` is notified whenever a message is queued or we're exiting.
+    mutex _sendMutex;
+    condition_variable _sendCV;
+    list<PendingSend> _sendQueue;
+    bool _sendInProgress;
+    bool _sendExit;
+    thread _sendThread;
+
+    // The send thread pushes to this when it leaves data in a socket's send buffer, so the sync thread polls again to
+    // finish sending it.
+    SSynchronizedQueue<bool> _sendNotifications;
+
     void _changeState(State newState);
 
-    // Queue a SYNCHRONIZE message based on the current state of the node.
-    void _queueSynchronize(Peer* peer, SData& response, bool sendAll);
+    // Queue a SYNCHRONIZE message based on the current state of the node. If `startCommit` is set, only commits from
+    // there on are sent, and at most `maxCommits` of them.
+    void _queueSynchronize(Peer* peer, SData& response, bool sendAll, uint64_t startCommit = 0, uint64_t maxCommits = 0);
 
     // Queue a SYNCHRONIZE message based on pre-computed state of the node. This version is thread-safe.
-    static void _queueSynchronizeStateless(const STable& params, const string& name, const string& peerName, int _state, uint64_t targetCommit, SQLite& db, SData& response, bool sendAll);
+    static void _queueSynchronizeStateless(const STable& params, const string& name, const string& peerName, int _state, uint64_t targetCommit, SQLite& db, SData& response, bool sendAll, uint64_t startCommit = 0, uint64_t maxCommits = 0);
     void _recvSynchronize(Peer* peer, const SData& message);
+
+    // Applies a batch of commits received in a SYNCHRONIZE_RESPONSE or SUBSCRIPTION_APPROVED message. Commits are
+    // applied in a single transaction if possible, and otherwise one at a time, so that a failure is attributed to the
+    // correct commit.
+    void _applySynchronizedCommits(const list<SData>& commits);
+
     void _reconnectPeer(Peer* peer);
     void _reconnectAll();
     bool _isQueuedCommandMapEmpty();
     bool _isNothingBlockingShutdown();
     bool _majoritySubscribed();
 
+    // Whether read-only requests from peers (SYNCHRONIZE and SNAPSHOT) can be handed to the server for workers to
+    // answer with `peekPeerCommand`, rather than answered on the sync thread. Workers only get to commands once we're
+    // in a state that can serve clients.
+    bool _canPeekPeerRequests();
+
     // When we're a slave, we can escalate a command to the master. When we do so, we store that command in the
     // following map of commandID to Command until the slave responds.
     map<string, SQLiteCommand> _escalatedCommandMap;
+    SQLiteCommandHold _escalatedHold;
+    bool _expireOldestEscalated = false;
+
+    // Answers the command that's been escalated the longest with a 555, and stops waiting for it.
+    void _expireOldestEscalation();
+
+    // Answers every escalated command whose deadline has passed with a 555, and lowers `nextActivity` to the next
+    // deadline, so we wake up for it.
+    void _expireEscalations(uint64_t& nextActivity);
+    uint64_t _escalationTimeoutUS = 0;
+    uint64_t _escalationDeadlineLimit = 0;
+
+    // Escalations and their responses are sent to peers that support it as a single ESCALATE_BATCH or
+    // ESCALATE_RESPONSE_BATCH message per poll loop, rather than one message each. These hold the serialized messages
+    // collected since the last flush: escalations to our master, and responses for each peer.
+    struct PendingBatch {
+        PendingBatch() : count(0) { }
+        size_t count;
+        string content;
+    };
+    PendingBatch _pendingEscalations;
+    map<Peer*, PendingBatch> _pendingResponses;
+
+    // Sends everything in the batches above, called just before we poll.
+    void _flushEscalations();
+
+    // Splits a batch received from a peer back into the `methodLine` messages it's made of, throwing if it's
+    // malformed or contains anything else.
+    static list<SData> _deserializeBatch(const SData& batch, const string& methodLine);
 
     // Replicates any transactions that have been made on our database by other threads to peers.
     void _sendOutstandingTransactions();
 
+    // Sends the given committed transactions (keyed by commit count, each a query and hash) to all subscribed peers as
+    // ASYNC transactions, batched for peers that support it.
+    void _replicateTransactions(const map<uint64_t, pair<string, string>>& transactions, bool acknowledge);
+
+    // When slaving, forwards any transactions we've committed since the last call to observers subscribed to us.
+    void _relayTransactions();
+
+    // Slave-side parallel apply. When enabled, ASYNC transactions (the ones the master committed outside of its sync
+    // thread) aren't applied on the sync thread. They're queued for a pool of threads with their own handles, which run
+    // their queries concurrently, then each waits for its turn to prepare, check the hash, and commit in commit-count
+    // order. A transaction that conflicts with one committed ahead of it is just run again once it's its turn, when
+    // nothing else can commit. Anything else that needs the database waits for the queue to drain first.
+    struct PendingApply {
+        uint64_t commitCount;
+        string hash;
+        string query;
+        string traceID;
+        uint64_t received;
+    };
+    list<SQLite> _applyDBs;
+    list<thread> _applyThreads;
+
+    // Protected by `_applyMutex`, and `_applyCV` is notified whenever any of them change or a transaction commits.
+    mutex _applyMutex;
+    condition_variable _applyCV;
+    list<PendingApply> _applyQueue;
+    int _applyInProgress;
+    bool _applyExit;
+
+    // Set by an apply thread that couldn't apply its transaction. Everything queued after it is dropped, and the sync
+    // thread reconnects to the master to start over.
+    atomic<bool> _applyFailed;
+
+    // Apply threads push to this after each commit, to wake the sync thread.
+    SSynchronizedQueue<bool> _applyNotifications;
+
+    // Only used by the sync thread: the highest commit count we've queued, whether the master has asked us to
+    // acknowledge queued transactions, and the highest commit count we've acknowledged.
+    uint64_t _applyQueuedThrough;
+    bool _applyAcknowledge;
+    uint64_t _applyLastAcknowledged;
+
+    // Set on the sync thread as messages arrive from our master: its commit count, and when we most recently went from
+    // having all of its commits to being behind.
+    atomic<uint64_t> _masterCommitCount;
+    atomic<uint64_t> _behindMasterSince;
+
+    // The body of each apply thread.
+    void _applyThreadLoop(SQLite& db, int threadID);
+
+    // Waits until everything queued has been applied or dropped.
+    void _waitForApplies();
+
+    // Sets the hash version our commits are prepared with to the newest one every logged in peer supports. Peers
+    // follow whichever version each transaction uses, which they can tell from the length of its hash.
+    void _updateHashVersion();
+
+    // Likewise, journals our commits as changesets if we've been configured to, and every logged in peer can apply
+    // them.
+    void _updateChangesets();
+
     // The server object to which we'll pass incoming escalated commands.
     SQLiteServer& _server;
 
@@ -13,6 +13,13 @@ class SQLiteServer : public STCPServer {
     // was previously escalated.
     virtual void acceptCommand(SQLiteCommand&& command, bool isNew) = 0;
 
+    // As above, for a batch of commands received together. By default this just accepts them one at a time.
+    virtual void acceptCommands(list<SQLiteCommand>&& commands, bool isNew) {
+        for (auto& command : commands) {
+            acceptCommand(move(command), isNew);
+        }
+    }
+
     // An SQLiteNode will call this to cancel a command that a peer has escalated but no longer wants a response to.
     // The command may or may not be canceled, depending on whether it's already been processed.
     virtual void cancelCommand(const string& commandID) = 0;
@@ -0,0 +1,197 @@
+#include "BenchCluster.h"
+
+BenchProxy::BenchProxy(const string& listenHost, const string& targetHost, uint64_t latencyUS,
+                       uint64_t bytesPerSecond)
+  : _targetHost(targetHost), _latencyUS(latencyUS), _bytesPerSecond(bytesPerSecond), _exit(false)
+{
+    _listenSocket = S_socket(listenHost, true, true, true);
+    SASSERT(_listenSocket > 0);
+    _acceptThread = thread(&BenchProxy::_acceptLoop, this);
+}
+
+BenchProxy::~BenchProxy() {
+    _exit = true;
+    shutdown(_listenSocket, SHUT_RDWR);
+    _acceptThread.join();
+    {
+        lock_guard<mutex> lock(_lock);
+        for (int s : _sockets) {
+            shutdown(s, SHUT_RDWR);
+        }
+        for (auto& pipe : _pipes) {
+            lock_guard<mutex> pipeLock(pipe->lock);
+            pipe->closed = true;
+            pipe->cv.notify_all();
+        }
+    }
+    for (auto& t : _threads) {
+        t.join();
+    }
+    for (int s : _sockets) {
+        close(s);
+    }
+    close(_listenSocket);
+}
+
+void BenchProxy::_acceptLoop() {
+    while (!_exit) {
+        sockaddr_in addr;
+        int client = accept(_listenSocket, (sockaddr*)&addr, nullptr);
+        if (client < 0) {
+            if (_exit) {
+                return;
+            }
+            continue;
+        }
+        _forward(client);
+    }
+}
+
+void BenchProxy::_forward(int client) {
+    int target = S_socket(_targetHost, true, false, true);
+    lock_guard<mutex> lock(_lock);
+    _sockets.push_back(client);
+    if (target <= 0) {
+        // The node we forward to is down, so this looks to the client like it's down too.
+        shutdown(client, SHUT_RDWR);
+        return;
+    }
+    _sockets.push_back(target);
+    for (auto direction : {make_pair(client, target), make_pair(target, client)}) {
+        shared_ptr<Pipe> pipe = make_shared<Pipe>();
+        _pipes.push_back(pipe);
+        _threads.emplace_back(&BenchProxy::_read, this, direction.first, pipe);
+        _threads.emplace_back(&BenchProxy::_write, this, direction.second, pipe);
+    }
+}
+
+void BenchProxy::_read(int from, shared_ptr<Pipe> pipe) {
+    char buffer[64 * 1024];
+    while (true) {
+        ssize_t size = recv(from, buffer, sizeof(buffer), 0);
+        lock_guard<mutex> lock(pipe->lock);
+        if (size <= 0) {
+            pipe->closed = true;
+            pipe->cv.notify_all();
+            return;
+        }
+        pipe->chunks.emplace_back(STimeNow(), string(buffer, size));
+        pipe->cv.notify_all();
+    }
+}
+
+void BenchProxy::_write(int to, shared_ptr<Pipe> pipe) {
+    while (true) {
+        pair<uint64_t, string> chunk;
+        {
+            unique_lock<mutex> lock(pipe->lock);
+            pipe->cv.wait(lock, [&]() { return pipe->closed || !pipe->chunks.empty(); });
+            if (pipe->chunks.empty()) {
+                // Closed, and everything before that has been sent, so pass on the close.
+                shutdown(to, SHUT_WR);
+                return;
+            }
+            chunk = move(pipe->chunks.front());
+            pipe->chunks.pop_front();
+        }
+
+        // Hold each chunk until it's been "in flight" for our latency, then send it no faster than our bandwidth.
+        const uint64_t due = chunk.first + _latencyUS;
+        const uint64_t now = STimeNow();
+        if (due > now) {
+            usleep(due - now);
+        }
+        const uint64_t start = STimeNow();
+        const size_t size = chunk.second.size();
+        string& data = chunk.second;
+        while (!data.empty()) {
+            if (!S_sendconsume(to, data)) {
+                return;
+            }
+        }
+        if (_bytesPerSecond) {
+            const uint64_t done = start + size * STIME_US_PER_S / _bytesPerSecond;
+            const uint64_t sent = STimeNow();
+            if (done > sent) {
+                usleep(done - sent);
+            }
+        }
+    }
+}
+
+BenchCluster::BenchCluster(int size, const list<string>& queries, const map<string, string>& args,
+                           uint64_t latencyUS, uint64_t bytesPerSecond)
+{
+    // Each node gets four ports: node, server, control, and the proxy in front of its node port.
+    const int portBase = 12111;
+    const bool proxied = latencyUS || bytesPerSecond;
+    auto port = [&](int node, int offset) { return "127.0.0.1:" + to_string(portBase + node * 4 + offset); };
+
+    for (int i = 0; i < size; i++) {
+        list<string> peerList;
+        for (int j = 0; j < size; j++) {
+            if (j != i) {
+                peerList.push_back(port(j, proxied ? 3 : 0) + "?nodeName=bench_node_" + to_string(j));
+            }
+        }
+        map<string, string> nodeArgs = {
+            {"-serverHost",  port(i, 1)},
+            {"-nodeHost",    port(i, 0)},
+            {"-controlPort", port(i, 2)},
+            {"-db",          BedrockTester::getTempFileName("bench_node_" + to_string(i))},
+            {"-priority",    to_string(100 - i * 10)},
+            {"-nodeName",    "bench_node_" + to_string(i)},
+            {"-peerList",    SComposeList(peerList, ",")},
+            {"-plugins",     "db,cache,jobs"},
+            {"-overrideProcessName", "bedrock" + to_string(portBase + i * 4)},
+        };
+        for (auto& arg : args) {
+            nodeArgs[arg.first] = arg.second;
+        }
+        _nodes.emplace_back(new BedrockTester(0, nodeArgs, queries, false));
+        if (proxied) {
+            _proxies.emplace_back(new BenchProxy(port(i, 3), port(i, 0), latencyUS, bytesPerSecond));
+        }
+    }
+
+    list<thread> threads;
+    for (auto& node : _nodes) {
+        threads.emplace_back([&node]() { node->startServer(); });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+BenchCluster::~BenchCluster() {
+    // Shut down in reverse order, so the others don't try to take over as master along the way.
+    for (auto it = _nodes.rbegin(); it != _nodes.rend(); ++it) {
+        (*it)->stopServer();
+    }
+    _nodes.clear();
+    _proxies.clear();
+}
+
+int BenchCluster::waitForMaster() {
+    for (int tries = 0; tries < 120; tries++) {
+        for (size_t i = 0; i < _nodes.size(); i++) {
+            if (getStatus(i)["state"] == "MASTERING") {
+                return i;
+            }
+        }
+        usleep(500'000);
+    }
+    return -1;
+}
+
+STable BenchCluster::getStatus(size_t index) {
+    try {
+        return SParseJSONObject(_nodes[index]->executeWaitVerifyContent(SData("Status")));
+    } catch (...) {
+        return STable();
+    }
+}
+
+uint64_t BenchCluster::getCommitCount(size_t index) {
+    return SToUInt64(getStatus(index)["CommitCount"]);
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <test/lib/BedrockTester.h>
+
+// Forwards TCP connections from one address to another, delaying everything sent in each direction by a fixed
+// latency, and optionally limiting its throughput. This stands in for the network between nodes in different data
+// centers, so replication can be measured under realistic conditions on a single machine.
+class BenchProxy {
+  public:
+    // Listens on `listenHost` and forwards each connection to `targetHost`. `bytesPerSecond` of 0 means no limit.
+    BenchProxy(const string& listenHost, const string& targetHost, uint64_t latencyUS, uint64_t bytesPerSecond);
+    ~BenchProxy();
+
+  private:
+    // The data waiting to go one way through a connection, each chunk with the time it was received.
+    struct Pipe {
+        mutex lock;
+        condition_variable cv;
+        list<pair<uint64_t, string>> chunks;
+        bool closed = false;
+    };
+
+    void _acceptLoop();
+    void _read(int from, shared_ptr<Pipe> pipe);
+    void _write(int to, shared_ptr<Pipe> pipe);
+
+    // Starts forwarding between `client` and a new connection to our target.
+    void _forward(int client);
+
+    string _targetHost;
+    uint64_t _latencyUS;
+    uint64_t _bytesPerSecond;
+    int _listenSocket;
+    atomic<bool> _exit;
+
+    // Every socket and thread we've started, so we can close and join them all on destruction.
+    mutex _lock;
+    list<int> _sockets;
+    list<shared_ptr<Pipe>> _pipes;
+    list<thread> _threads;
+    thread _acceptThread;
+};
+
+// A cluster of nodes for benchmarking. This is like BedrockClusterTester, but it doesn't load the cluster tests' test
+// plugin (so it can run from anywhere), and can put a BenchProxy in front of each node's node port, so that its peers
+// only reach it with the given latency and bandwidth.
+class BenchCluster {
+  public:
+    BenchCluster(int size, const list<string>& queries, const map<string, string>& args, uint64_t latencyUS = 0,
+                 uint64_t bytesPerSecond = 0);
+    ~BenchCluster();
+
+    size_t size() const { return _nodes.size(); }
+    BedrockTester& getNode(size_t index) { return *_nodes[index]; }
+
+    // Waits up to a minute for some node to be MASTERING, and returns its index, or -1 if none is.
+    int waitForMaster();
+
+    // Returns the given node's `Status` as a table, or an empty table if it didn't respond.
+    STable getStatus(size_t index);
+
+    // Returns the commit count reported by the given node, or 0 if it didn't respond.
+    uint64_t getCommitCount(size_t index);
+
+  private:
+    vector<unique_ptr<BedrockTester>> _nodes;
+    list<unique_ptr<BenchProxy>> _proxies;
+};
@@ -0,0 +1,412 @@
+#include <libstuff/libstuff.h>
+#include <BedrockClient.h>
+#include "BenchCluster.h"
+
+/*
+ * bedrock-bench drives an open-loop workload against a running node, or a cluster it starts itself, and reports
+ * throughput and latency percentiles as JSON.
+ *
+ * Open-loop means requests are sent on a fixed schedule (`-qps`, spread across `-connections`) whether or not earlier
+ * ones have been answered. Latency is measured from when each request was *scheduled* to be sent, so a server that
+ * falls behind shows up in the percentiles rather than just slowing the benchmark down.
+ *
+ * With `-replication`, it instead measures the cluster it starts: how fast the master commits writes, how far behind
+ * the slaves fall while it does, and how long a restarted slave takes to synchronize the commits it missed.
+ * `-peerLatency` and `-peerBandwidth` put a proxy between the nodes to simulate them being further apart.
+ */
+
+// The workloads we know how to generate. Each one is a single request, except `Job`, which creates a job, gets it,
+// and finishes it, recording each step under its own name.
+static const set<string> WORKLOADS = {"Query", "QueryWrite", "ReadCache", "WriteCache", "Job"};
+
+struct BenchStats {
+    // Latency in microseconds by request name, from when each request was scheduled until its response.
+    map<string, unique_ptr<SHistogram>> latency;
+
+    // Responses by request name that weren't a 2xx (or, for GetJob, a 404 with nothing to get).
+    map<string, unique_ptr<atomic<uint64_t>>> errors;
+
+    void add(const string& name) {
+        latency.emplace(name, unique_ptr<SHistogram>(new SHistogram()));
+        errors.emplace(name, unique_ptr<atomic<uint64_t>>(new atomic<uint64_t>(0)));
+    }
+};
+
+// A single connection to a node that sends a request and waits for its response. This goes through BedrockClient, so
+// the bench measures what our services see. Without `readYourWrites`, reads aren't held up waiting for writes, and a
+// node that won't take connections fails requests after a few seconds rather than the usual minute.
+class BenchConnection {
+  public:
+    BenchConnection(const string& host) : _client({host}, 1, 1, 5 * STIME_US_PER_S, false) { }
+
+    // Sends `request` and returns the response, or a response with a "000" method line if it couldn't be sent or
+    // the connection dropped.
+    SData execute(const SData& request) {
+        return _client.execute(request);
+    }
+
+  private:
+    BedrockClient _client;
+};
+
+// Builds the requests for each workload.
+class BenchWorkload {
+  public:
+    BenchWorkload(const SData& args) : _args(args), _valueSize(max(1, args.calc("-valueSize"))) { }
+
+    // Runs one instance of `workload` on `connection`, recording everything it sends in `stats`, with latencies
+    // measured from `scheduled`.
+    void run(const string& workload, BenchConnection& connection, BenchStats& stats, uint64_t scheduled) {
+        const uint64_t id = SRandom::rand64() >> 1;
+        if (workload == "Query") {
+            SData request("Query");
+            request["query"] = "SELECT value FROM bench WHERE id = " + SQ((int64_t)(id % 100000)) + ";";
+            _send("Query", request, connection, stats, scheduled);
+        } else if (workload == "QueryWrite") {
+            SData request("Query");
+            request["query"] = "INSERT OR REPLACE INTO bench VALUES (" + SQ((int64_t)(id % 100000)) + ", " +
+                               SQ(string(_valueSize, 'x')) + ");";
+            _send("QueryWrite", request, connection, stats, scheduled);
+        } else if (workload == "ReadCache") {
+            SData request("ReadCache");
+            request["name"] = "bench" + to_string(id % 1000);
+            _send("ReadCache", request, connection, stats, scheduled);
+        } else if (workload == "WriteCache") {
+            SData request("WriteCache");
+            request["name"] = "bench" + to_string(id % 1000);
+            request.content = string(_valueSize, 'x');
+            _send("WriteCache", request, connection, stats, scheduled);
+        } else if (workload == "Job") {
+            SData request("CreateJob");
+            request["name"] = "bench";
+            SData response = _send("CreateJob", request, connection, stats, scheduled);
+            if (!SStartsWith(response.methodLine, "200")) {
+                return;
+            }
+            request = SData("GetJob");
+            request["name"] = "bench";
+            response = _send("GetJob", request, connection, stats, STimeNow());
+            if (!SStartsWith(response.methodLine, "200")) {
+                return;
+            }
+            request = SData("FinishJob");
+            request["jobID"] = SParseJSONObject(response.content)["jobID"];
+            _send("FinishJob", request, connection, stats, STimeNow());
+        }
+    }
+
+  private:
+    SData _send(const string& name, SData& request, BenchConnection& connection, BenchStats& stats,
+                uint64_t scheduled) {
+        if (_args.isSet("-writeConsistency")) {
+            request["writeConsistency"] = _args["-writeConsistency"];
+        }
+        SData response = connection.execute(request);
+        stats.latency.at(name)->record(STimeNow() - scheduled);
+        const bool ok = SStartsWith(response.methodLine, "2") ||
+                        (name == "GetJob" && SStartsWith(response.methodLine, "404"));
+        if (!ok) {
+            (*stats.errors.at(name))++;
+        }
+        return response;
+    }
+
+    const SData& _args;
+    int _valueSize;
+};
+
+// Sends QueryWrite requests to `host` on `connections` connections, each sending its next write as soon as the last
+// one is answered, until `end` or until `count` writes have been sent, whichever comes first. Returns the number of
+// writes sent.
+uint64_t writeClosedLoop(const string& host, int connections, uint64_t end, uint64_t count, BenchWorkload& workload,
+                         BenchStats& stats) {
+    atomic<uint64_t> sent(0);
+    list<thread> threads;
+    for (int i = 0; i < connections; i++) {
+        threads.emplace_back([&, i]() {
+            SInitialize("write" + to_string(i));
+            BenchConnection connection(host);
+            while (STimeNow() < end && sent++ < count) {
+                workload.run("QueryWrite", connection, stats, STimeNow());
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    return min(sent.load(), count);
+}
+
+// Runs the `-replication` benchmark on `cluster`, and returns its report.
+STable runReplication(const SData& args, BenchCluster& cluster, int master, BenchStats& stats) {
+    const int connections = args.isSet("-connections") ? max(1, args.calc("-connections")) : 16;
+    const uint64_t duration = (args.isSet("-duration") ? max((uint64_t)1, args.calcU64("-duration")) : 10) *
+                              STIME_US_PER_S;
+    const uint64_t catchUpCommits = args.isSet("-catchUpCommits") ? args.calcU64("-catchUpCommits") : 10000;
+    const string host = cluster.getNode(master).getServerAddr();
+    BenchWorkload workload(args);
+    stats.add("QueryWrite");
+    STable report;
+
+    // Phase one: write as fast as the master will let us, while watching how many commits behind each slave is.
+    SHistogram lag;
+    atomic<bool> writing(true);
+    uint64_t drainUS = 0;
+    thread monitor([&]() {
+        SInitialize("monitor");
+        uint64_t drainStart = 0;
+        while (true) {
+            const uint64_t masterCount = cluster.getCommitCount(master);
+            bool caughtUp = true;
+            for (size_t i = 0; i < cluster.size(); i++) {
+                if ((int)i != master) {
+                    const uint64_t slaveCount = cluster.getCommitCount(i);
+                    const uint64_t behind = masterCount > slaveCount ? masterCount - slaveCount : 0;
+                    caughtUp = caughtUp && !behind;
+                    if (writing) {
+                        lag.record(behind);
+                    }
+                }
+            }
+            if (!writing) {
+                // Once writes stop, see how long it takes for the slaves to drain whatever lag is left.
+                if (!drainStart) {
+                    drainStart = STimeNow();
+                }
+                if (caughtUp || STimeNow() - drainStart > 60 * STIME_US_PER_S) {
+                    drainUS = STimeNow() - drainStart;
+                    return;
+                }
+            }
+            usleep(100'000);
+        }
+    });
+    const uint64_t start = STimeNow();
+    const uint64_t commitsBefore = cluster.getCommitCount(master);
+    writeClosedLoop(host, connections, start + duration, UINT64_MAX, workload, stats);
+    const uint64_t elapsed = STimeNow() - start;
+    const uint64_t commits = cluster.getCommitCount(master) - commitsBefore;
+    writing = false;
+    monitor.join();
+    STable throughput;
+    throughput["durationUS"] = to_string(elapsed);
+    throughput["commits"] = to_string(commits);
+    throughput["commitsPerSecond"] = SToStr((double)commits * STIME_US_PER_S / elapsed);
+    throughput["lagSamples"] = to_string(lag.count());
+    throughput["lagP50"] = to_string(lag.percentile(50));
+    throughput["lagP99"] = to_string(lag.percentile(99));
+    throughput["lagMax"] = to_string(lag.max());
+    throughput["drainUS"] = to_string(drainUS);
+    report["throughput"] = SComposeJSONObject(throughput);
+
+    // Phase two: stop the lowest priority slave, commit while it's down, and time how long it takes to catch back up
+    // once it's restarted.
+    const int slave = master == (int)cluster.size() - 1 ? cluster.size() - 2 : cluster.size() - 1;
+    cluster.getNode(slave).stopServer();
+    const uint64_t missed = writeClosedLoop(host, connections, UINT64_MAX, catchUpCommits, workload, stats);
+    const uint64_t target = cluster.getCommitCount(master);
+    const uint64_t restart = STimeNow();
+    cluster.getNode(slave).startServer();
+    const uint64_t started = STimeNow();
+    while (cluster.getCommitCount(slave) < target && STimeNow() - started < 10 * 60 * STIME_US_PER_S) {
+        usleep(10'000);
+    }
+    STable catchUp;
+    catchUp["commits"] = to_string(missed);
+    catchUp["startUS"] = to_string(started - restart);
+    catchUp["catchUpUS"] = to_string(STimeNow() - restart);
+    catchUp["commitsPerSecond"] = SToStr((double)missed * STIME_US_PER_S / max((uint64_t)1, STimeNow() - restart));
+    report["catchUp"] = SComposeJSONObject(catchUp);
+    return report;
+}
+
+void printUsage() {
+    cout << "Usage: bench [-host <host:port> | -nodes <1|3|5>] [options]" << endl;
+    cout << "       bench -replication -nodes <3|5> [options]" << endl;
+    cout << endl;
+    cout << "-host             <host:port>  Node to send requests to" << endl;
+    cout << "-nodes            <#>          Start a cluster of this many nodes and send requests to the master" << endl;
+    cout << "-mix              <list>       Workloads and their weights, as name:weight "
+            "(default 'Query:50,ReadCache:30,WriteCache:10,Job:10')"
+         << endl;
+    cout << "                               Workloads: Query, QueryWrite, ReadCache, WriteCache, Job" << endl;
+    cout << "-qps              <#>          Requests per second to schedule, across all connections (default 1000)"
+         << endl;
+    cout << "-connections      <#>          Number of connections to send on (default 16)" << endl;
+    cout << "-duration         <seconds>    How long to run for (default 10)" << endl;
+    cout << "-valueSize        <bytes>      Size of values written by QueryWrite and WriteCache (default 100)" << endl;
+    cout << "-writeConsistency <#>          Consistency for every request: 0 ASYNC, 1 ONE, 2 QUORUM" << endl;
+    cout << "-output           <file>       Write the JSON report here rather than to stdout" << endl;
+    cout << endl;
+    cout << "-replication                   Measure commit rate, slave lag, and catch up time instead of a mix" << endl;
+    cout << "-catchUpCommits   <#>          Commits to make while a slave is down (default 10000)" << endl;
+    cout << "-peerLatency      <us>         Delay added to traffic between nodes, each way" << endl;
+    cout << "-peerBandwidth    <bytes/s>    Limit on traffic between nodes, per connection and direction" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    SData args = SParseCommandLine(argc, argv);
+    if (args.isSet("-help") || (!args.isSet("-host") && !args.isSet("-nodes"))) {
+        printUsage();
+        return 1;
+    }
+    if (!args.isSet("-mix")) {
+        args["-mix"] = "Query:50,ReadCache:30,WriteCache:10,Job:10";
+    }
+    if (!args.isSet("-valueSize")) {
+        args["-valueSize"] = "100";
+    }
+    const uint64_t qps = args.isSet("-qps") ? max((uint64_t)1, args.calcU64("-qps")) : 1000;
+    const int connections = args.isSet("-connections") ? max(1, args.calc("-connections")) : 16;
+    const uint64_t duration = (args.isSet("-duration") ? max((uint64_t)1, args.calcU64("-duration")) : 10) *
+                              STIME_US_PER_S;
+
+    // Parse the mix into a list of workloads we can pick from with a random number.
+    vector<pair<string, int>> mix;
+    int totalWeight = 0;
+    for (const string& item : SParseList(args["-mix"])) {
+        const string name = SBefore(item, ":").empty() ? item : SBefore(item, ":");
+        const int weight = SContains(item, ":") ? SToInt(SAfter(item, ":")) : 1;
+        if (!WORKLOADS.count(name) || weight <= 0) {
+            cout << "Invalid workload '" << item << "'." << endl;
+            return 1;
+        }
+        totalWeight += weight;
+        mix.emplace_back(name, totalWeight);
+    }
+
+    // Start our own cluster, if we were asked to, with a table for the Query workloads.
+    unique_ptr<BenchCluster> cluster;
+    int master = 0;
+    string host = args["-host"];
+    const list<string> queries = {"CREATE TABLE bench (id INTEGER PRIMARY KEY, value TEXT NOT NULL)"};
+    if (args.isSet("-nodes")) {
+        BedrockTester::locations = {"../../bedrock", "./bedrock"};
+        int nodes = args.calc("-nodes");
+        if (nodes != 1 && nodes != 3 && nodes != 5) {
+            cout << "-nodes must be 1, 3, or 5." << endl;
+            return 1;
+        }
+        if (args.isSet("-replication") && nodes == 1) {
+            cout << "-replication needs at least 3 nodes." << endl;
+            return 1;
+        }
+        cluster.reset(new BenchCluster(nodes, queries, {}, args.calcU64("-peerLatency"),
+                                       args.calcU64("-peerBandwidth")));
+        master = cluster->waitForMaster();
+        if (master < 0) {
+            cout << "No node came up as master." << endl;
+            return 1;
+        }
+        host = cluster->getNode(master).getServerAddr();
+    } else if (args.isSet("-replication")) {
+        cout << "-replication needs -nodes." << endl;
+        return 1;
+    } else {
+        // Make sure there's a table for the Query workloads on the node we were given.
+        BenchConnection connection(host);
+        SData request("Query");
+        request["query"] = "CREATE TABLE IF NOT EXISTS bench (id INTEGER PRIMARY KEY, value TEXT NOT NULL);";
+        connection.execute(request);
+    }
+
+    BenchStats stats;
+    if (args.isSet("-replication")) {
+        STable report = runReplication(args, *cluster, master, stats);
+        report["nodes"] = args["-nodes"];
+        report["writeConsistency"] = args["-writeConsistency"];
+        report["peerLatencyUS"] = to_string(args.calcU64("-peerLatency"));
+        report["peerBandwidth"] = to_string(args.calcU64("-peerBandwidth"));
+        report["errors"] = to_string(stats.errors.at("QueryWrite")->load());
+        const string json = SComposeJSONObject(report);
+        if (args.isSet("-output")) {
+            SFileSave(args["-output"], json + "\n");
+        } else {
+            cout << json << endl;
+        }
+        cluster.reset();
+        return stats.errors.at("QueryWrite")->load() ? 2 : 0;
+    }
+    for (const auto& workload : mix) {
+        if (workload.first == "Job") {
+            for (const char* name : {"CreateJob", "GetJob", "FinishJob"}) {
+                stats.add(name);
+            }
+        } else {
+            stats.add(workload.first);
+        }
+    }
+
+    // Each connection sends on its own schedule, offset from the others so they don't all send at once.
+    const uint64_t interval = STIME_US_PER_S * connections / qps;
+    const uint64_t start = STimeNow() + 100 * STIME_US_PER_MS;
+    const uint64_t end = start + duration;
+    BenchWorkload workload(args);
+    list<thread> threads;
+    for (int i = 0; i < connections; i++) {
+        threads.emplace_back([&, i]() {
+            SInitialize("bench" + to_string(i));
+            BenchConnection connection(host);
+            uint64_t scheduled = start + interval * i / connections;
+            while (scheduled < end) {
+                const uint64_t now = STimeNow();
+                if (now < scheduled) {
+                    usleep(scheduled - now);
+                }
+                const int pick = SRandom::rand64() % totalWeight;
+                for (const auto& item : mix) {
+                    if (pick < item.second) {
+                        workload.run(item.first, connection, stats, scheduled);
+                        break;
+                    }
+                }
+                scheduled += interval;
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    const uint64_t elapsed = max(STimeNow(), end) - start;
+
+    // Compose the report.
+    STable report;
+    STable verbs;
+    uint64_t totalRequests = 0;
+    uint64_t totalErrors = 0;
+    for (const auto& entry : stats.latency) {
+        const SHistogram& histogram = *entry.second;
+        const uint64_t errors = stats.errors.at(entry.first)->load();
+        STable verb;
+        verb["count"] = to_string(histogram.count());
+        verb["errors"] = to_string(errors);
+        verb["perSecond"] = SToStr((double)histogram.count() * STIME_US_PER_S / elapsed);
+        verb["p50"] = to_string(histogram.percentile(50));
+        verb["p90"] = to_string(histogram.percentile(90));
+        verb["p99"] = to_string(histogram.percentile(99));
+        verb["p999"] = to_string(histogram.percentile(99.9));
+        verb["max"] = to_string(histogram.max());
+        verbs[entry.first] = SComposeJSONObject(verb);
+        totalRequests += histogram.count();
+        totalErrors += errors;
+    }
+    report["host"] = host;
+    report["mix"] = args["-mix"];
+    report["targetQPS"] = to_string(qps);
+    report["connections"] = to_string(connections);
+    report["durationUS"] = to_string(elapsed);
+    report["requests"] = to_string(totalRequests);
+    report["errors"] = to_string(totalErrors);
+    report["perSecond"] = SToStr((double)totalRequests * STIME_US_PER_S / elapsed);
+    report["verbs"] = SComposeJSONObject(verbs);
+    const string json = SComposeJSONObject(report);
+    if (args.isSet("-output")) {
+        SFileSave(args["-output"], json + "\n");
+    } else {
+        cout << json << endl;
+    }
+
+    // Shut down our cluster, if we started one.
+    cluster.reset();
+    return totalErrors ? 2 : 0;
+}
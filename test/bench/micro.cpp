@@ -0,0 +1,111 @@
+#include <libstuff/libstuff.h>
+
+/*
+ * Microbenchmarks for the libstuff primitives that run on every request. Each benchmark runs its body in batches,
+ * doubling the batch size until a batch takes at least `-minTime` milliseconds, and reports the time per call from
+ * that last batch. The results are printed as a JSON object, so they can be compared between builds.
+ *
+ * Run from test/bench, or pass `-sampleData` with the path to test/sample_data/lottoNumbers.json.
+ */
+
+// Everything a benchmark computes gets added to this, so the compiler can't decide the work is unused.
+static volatile size_t g_sink = 0;
+
+struct Microbenchmark {
+    string name;
+    function<void()> body;
+};
+
+int main(int argc, char* argv[]) {
+    SData args = SParseCommandLine(argc, argv);
+    const uint64_t minTime = (args.isSet("-minTime") ? args.calcU64("-minTime") : 200) * STIME_US_PER_MS;
+    const string samplePath = args.isSet("-sampleData") ? args["-sampleData"] : "../sample_data/lottoNumbers.json";
+
+    // Representative payloads: a large JSON document, a typical request with its headers, and a query result.
+    const string sampleJSON = SFileLoad(samplePath);
+    if (sampleJSON.empty()) {
+        cout << "Couldn't load sample data from '" << samplePath << "', pass -sampleData." << endl;
+        return 1;
+    }
+    const STable sampleObject = SParseJSONObject(sampleJSON);
+    SData request("Query");
+    request["query"] = "SELECT name, value FROM cache WHERE name GLOB 'bench*' LIMIT 100;";
+    request["format"] = "json";
+    request["requestID"] = "abcdef";
+    request["writeConsistency"] = "ASYNC";
+    request["priority"] = "500";
+    request.content = sampleJSON.substr(0, 4096);
+    const string serializedRequest = request.serialize();
+    SQResult result;
+    result.headers = {"jobID", "name", "data", "created"};
+    for (int i = 0; i < 100; i++) {
+        result.rows.push_back({to_string(i), "bench" + to_string(i), "{\"value\":\"it's \\\"quoted\\\"\"}",
+                               "2018-07-05 12:34:56"});
+    }
+    const string resultJSON = result.serializeToJSON();
+    const string quotable = "It's a string with a 'few' quotes in it, as a user might write in a job's data.";
+
+    vector<Microbenchmark> benchmarks = {
+        {"SParseHTTP", [&]() {
+            string methodLine, content;
+            STable headers;
+            g_sink += SParseHTTP(serializedRequest, methodLine, headers, content);
+        }},
+        {"SData::serialize", [&]() { g_sink += request.serialize().size(); }},
+        {"SData::deserialize", [&]() {
+            SData message;
+            g_sink += message.deserialize(serializedRequest);
+        }},
+        {"SComposeJSONObject", [&]() { g_sink += SComposeJSONObject(sampleObject).size(); }},
+        {"SParseJSONObject", [&]() { g_sink += SParseJSONObject(sampleJSON).size(); }},
+        {"SQResult::serializeToJSON", [&]() { g_sink += result.serializeToJSON().size(); }},
+        {"SQResult::deserialize", [&]() {
+            SQResult parsed;
+            g_sink += parsed.deserialize(resultJSON);
+        }},
+        {"SEscape", [&]() { g_sink += SEscape(sampleJSON.substr(0, 1024), "\"\\/\b\f\n\r\t").size(); }},
+        {"SQ", [&]() { g_sink += SQ(quotable).size(); }},
+        {"SHashSHA1", [&]() { g_sink += SHashSHA1(serializedRequest).size(); }},
+        {"STable::insert", [&]() {
+            STable table;
+            for (int i = 0; i < 20; i++) {
+                table["header" + to_string(i)] = "value";
+            }
+            g_sink += table.size();
+        }},
+        {"STable::lookup", [&]() {
+            for (const char* name : {"query", "format", "requestID", "missing"}) {
+                g_sink += SContains(request.nameValueMap, name);
+            }
+        }},
+    };
+
+    STable report;
+    for (const auto& benchmark : benchmarks) {
+        if (args.isSet("-only") && !SContains(benchmark.name, args["-only"])) {
+            continue;
+        }
+
+        // Warm up, then keep doubling the batch until it runs for long enough to measure.
+        benchmark.body();
+        uint64_t iterations = 1;
+        uint64_t elapsed = 0;
+        while (true) {
+            const uint64_t start = STimeNow();
+            for (uint64_t i = 0; i < iterations; i++) {
+                benchmark.body();
+            }
+            elapsed = STimeNow() - start;
+            if (elapsed >= minTime) {
+                break;
+            }
+            iterations *= 2;
+        }
+        STable entry;
+        entry["iterations"] = to_string(iterations);
+        entry["nsPerOp"] = SToStr((double)elapsed * 1000 / iterations);
+        report[benchmark.name] = SComposeJSONObject(entry);
+    }
+    cout << SComposeJSONObject(report) << endl;
+    return g_sink ? 0 : 1;
+}
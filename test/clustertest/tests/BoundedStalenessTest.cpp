@@ -0,0 +1,76 @@
+#include "../BedrockClusterTester.h"
+
+struct BoundedStalenessTest : tpunit::TestFixture {
+    BoundedStalenessTest()
+        : tpunit::TestFixture("BoundedStaleness",
+                              BEFORE_CLASS(BoundedStalenessTest::setup),
+                              AFTER_CLASS(BoundedStalenessTest::teardown),
+                              TEST(BoundedStalenessTest::readsOnSlaves),
+                              TEST(BoundedStalenessTest::stalenessOnLaggingSlave)) { }
+
+    BedrockClusterTester* tester;
+
+    void setup() {
+        tester = new BedrockClusterTester(BedrockClusterTester::THREE_NODE_CLUSTER,
+                                          {"CREATE TABLE test (id INTEGER NOT NULL PRIMARY KEY, value TEXT NOT NULL)"},
+                                          _threadID);
+    }
+
+    void teardown() {
+        delete tester;
+    }
+
+    void readsOnSlaves() {
+        BedrockTester* master = tester->getBedrockTester(0);
+        BedrockTester* slave = tester->getBedrockTester(1);
+        for (int i = 0; i < 20; i++) {
+            SData write("Query");
+            write["writeConsistency"] = "ASYNC";
+            write["query"] = "INSERT INTO test VALUES(" + SQ(80000 + i) + ", " + SQ("stale" + to_string(i)) + ");";
+            vector<SData> results = master->executeWaitMultipleData({write}, 1);
+            ASSERT_EQUAL(SToInt(results[0].methodLine), 200);
+
+            // Waiting on the write's commit count always sees it.
+            SData read("Query");
+            read["query"] = "SELECT value FROM test WHERE id = " + SQ(80000 + i) + ";";
+            read["minCommitCount"] = results[0]["commitCount"];
+            ASSERT_TRUE(SContains(slave->executeWaitVerifyContent(read), "stale" + to_string(i)));
+        }
+    }
+
+    // A slave that's behind master answers from its own data if that's within the staleness bound, and otherwise
+    // waits until it has master's latest commit
+    void stalenessOnLaggingSlave() {
+        BedrockTester* master = tester->getBedrockTester(0);
+        BedrockTester* slave = tester->getBedrockTester(1);
+
+        // This takes a couple of seconds to run on master, and as long again for the slave to replay, so for that long
+        // the slave has heard about the commit but doesn't have it.
+        SData write("Query");
+        write["writeConsistency"] = "ASYNC";
+        write["query"] = "INSERT INTO test VALUES(90000, (WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM c "
+                         "WHERE i < 5000000) SELECT 'slow' || count(*) FROM c));";
+        vector<SData> results = master->executeWaitMultipleData({write}, 1);
+        ASSERT_EQUAL(SToInt(results[0].methodLine), 200);
+        const uint64_t commitCount = SToUInt64(results[0]["commitCount"]);
+
+        // Give the transaction time to reach the slave.
+        usleep(200'000);
+
+        // A generous bound is served locally, from before the write.
+        SData read("Query");
+        read["query"] = "SELECT value FROM test WHERE id = 90000;";
+        read["maxStalenessMS"] = "60000";
+        vector<SData> stale = slave->executeWaitMultipleData({read}, 1);
+        ASSERT_EQUAL(SToInt(stale[0].methodLine), 200);
+        ASSERT_LESS_THAN(SToUInt64(stale[0]["commitCount"]), commitCount);
+        ASSERT_FALSE(SContains(stale[0].content, "slow"));
+
+        // No staleness waits for the commit the slave is behind, so sees the write.
+        read["maxStalenessMS"] = "0";
+        vector<SData> fresh = slave->executeWaitMultipleData({read}, 1);
+        ASSERT_EQUAL(SToInt(fresh[0].methodLine), 200);
+        ASSERT_GREATER_THAN_EQUAL(SToUInt64(fresh[0]["commitCount"]), commitCount);
+        ASSERT_TRUE(SContains(fresh[0].content, "slow5000000"));
+    }
+} __BoundedStalenessTest;
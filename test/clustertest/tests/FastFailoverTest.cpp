@@ -0,0 +1,49 @@
+#include "../BedrockClusterTester.h"
+
+struct FastFailoverTest : tpunit::TestFixture {
+    FastFailoverTest()
+        : tpunit::TestFixture("FastFailover",
+                              BEFORE_CLASS(FastFailoverTest::setup),
+                              AFTER_CLASS(FastFailoverTest::teardown),
+                              TEST(FastFailoverTest::failover)) { }
+
+    BedrockClusterTester* tester;
+
+    void setup() {
+        tester = new BedrockClusterTester(BedrockClusterTester::THREE_NODE_CLUSTER,
+                                          {"CREATE TABLE test (id INTEGER NOT NULL PRIMARY KEY, value TEXT NOT NULL)"},
+                                          _threadID, {{"-fastFailover", "true"}});
+    }
+
+    void teardown() {
+        delete tester;
+    }
+
+    void failover() {
+        BedrockTester* slave = tester->getBedrockTester(1);
+
+        // Stop the master, and the next highest priority node should take over within a few seconds.
+        tester->stopNode(0);
+        uint64_t start = STimeNow();
+        bool success = false;
+        while (STimeNow() - start < STIME_US_PER_S * 10) {
+            SData cmd("Status");
+            STable json = SParseJSONObject(slave->executeWaitVerifyContent(cmd));
+            if (json["state"] == "MASTERING") {
+                success = true;
+                break;
+            }
+            usleep(100000);
+        }
+        ASSERT_TRUE(success);
+
+        // And it can commit.
+        SData query("Query");
+        query["writeConsistency"] = "ASYNC";
+        query["query"] = "INSERT INTO test VALUES(1, " + SQ("failover") + ");";
+        slave->executeWaitVerifyContent(query);
+
+        // Bring the old master back so it can take over again for the next test.
+        tester->startNode(0);
+    }
+} __FastFailoverTest;
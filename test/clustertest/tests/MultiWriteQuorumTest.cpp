@@ -0,0 +1,50 @@
+#include "../BedrockClusterTester.h"
+
+struct MultiWriteQuorumTest : tpunit::TestFixture {
+    MultiWriteQuorumTest()
+        : tpunit::TestFixture("MultiWriteQuorum",
+                              BEFORE_CLASS(MultiWriteQuorumTest::setup),
+                              AFTER_CLASS(MultiWriteQuorumTest::teardown),
+                              TEST(MultiWriteQuorumTest::quorumWrites)) { }
+
+    BedrockClusterTester* tester;
+
+    void setup() {
+        tester = new BedrockClusterTester(BedrockClusterTester::THREE_NODE_CLUSTER,
+                                          {"CREATE TABLE test (id INTEGER NOT NULL PRIMARY KEY, value TEXT NOT NULL)"},
+                                          _threadID, {{"-enableMultiWriteQuorum", "true"}});
+    }
+
+    void teardown() {
+        delete tester;
+    }
+
+    void quorumWrites() {
+        BedrockTester* master = tester->getBedrockTester(0);
+
+        // Send a batch of QUORUM writes at once, so several are waiting on peers at the same time.
+        vector<SData> requests;
+        for (int i = 0; i < 50; i++) {
+            SData query("Query");
+            query["writeConsistency"] = "2"; // QUORUM, consistencies are parsed as numbers.
+            query["query"] = "INSERT INTO test VALUES(" + SQ(60000 + i) + ", " + SQ("quorum") + ");";
+            requests.push_back(query);
+        }
+        vector<SData> results = master->executeWaitMultipleData(requests, 10);
+        uint64_t highestCommit = 0;
+        for (auto& result : results) {
+            ASSERT_EQUAL(SToInt(result.methodLine), 200);
+            highestCommit = max(highestCommit, SToUInt64(result["commitCount"]));
+        }
+
+        // Each was only answered once a peer had committed it, so by now at least one slave has all of them.
+        int slavesWithAll = 0;
+        for (int i = 1; i < 3; i++) {
+            SQResult result;
+            tester->getBedrockTester(i)->readDB("SELECT COUNT(*) FROM test WHERE value = 'quorum';", result);
+            slavesWithAll += result[0][0] == "50";
+        }
+        ASSERT_TRUE(slavesWithAll >= 1);
+        ASSERT_TRUE(highestCommit > 0);
+    }
+} __MultiWriteQuorumTest;
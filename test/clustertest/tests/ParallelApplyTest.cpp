@@ -0,0 +1,57 @@
+#include "../BedrockClusterTester.h"
+
+struct ParallelApplyTest : tpunit::TestFixture {
+    ParallelApplyTest()
+        : tpunit::TestFixture("ParallelApply",
+                              BEFORE_CLASS(ParallelApplyTest::setup),
+                              AFTER_CLASS(ParallelApplyTest::teardown),
+                              TEST(ParallelApplyTest::slavesCatchUp)) { }
+
+    BedrockClusterTester* tester;
+
+    void setup() {
+        tester = new BedrockClusterTester(BedrockClusterTester::THREE_NODE_CLUSTER,
+                                          {"CREATE TABLE test (id INTEGER NOT NULL PRIMARY KEY, value TEXT NOT NULL)"},
+                                          _threadID, {{"-slaveApplyThreads", "4"}});
+    }
+
+    void teardown() {
+        delete tester;
+    }
+
+    void slavesCatchUp() {
+        BedrockTester* master = tester->getBedrockTester(0);
+
+        // Send a batch of writes at once, so that master commits them on several workers, and the slaves are sent
+        // several at a time to apply in parallel. Every tenth one also updates a shared row, so some conflict.
+        vector<SData> requests;
+        for (int i = 0; i < 200; i++) {
+            SData query("Query");
+            query["writeConsistency"] = "ASYNC";
+            query["query"] = "INSERT INTO test VALUES(" + SQ(70000 + i) + ", " + SQ("parallel") + ");";
+            if (i % 10 == 0) {
+                query["query"] += "INSERT OR REPLACE INTO test VALUES(69999, " + SQ(i) + ");";
+            }
+            requests.push_back(query);
+        }
+        for (auto& result : master->executeWaitMultipleData(requests, 20)) {
+            ASSERT_EQUAL(SToInt(result.methodLine), 200);
+        }
+
+        // The slaves should end up with exactly what master has.
+        SQResult expected;
+        master->readDB("SELECT id, value FROM test ORDER BY id;", expected);
+        for (int i = 1; i < 3; i++) {
+            bool matched = false;
+            for (int tries = 0; tries < 10 && !matched; tries++) {
+                SQResult result;
+                tester->getBedrockTester(i)->readDB("SELECT id, value FROM test ORDER BY id;", result);
+                matched = result.rows == expected.rows;
+                if (!matched) {
+                    sleep(1);
+                }
+            }
+            ASSERT_TRUE(matched);
+        }
+    }
+} __ParallelApplyTest;
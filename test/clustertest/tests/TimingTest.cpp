@@ -6,7 +6,8 @@ struct TimingTest : tpunit::TestFixture {
         : tpunit::TestFixture("TimingTest",
                               BEFORE_CLASS(TimingTest::setup),
                               AFTER_CLASS(TimingTest::teardown),
-                              TEST(TimingTest::test)) { }
+                              TEST(TimingTest::test),
+                              TEST(TimingTest::trace)) { }
 
     BedrockClusterTester* tester;
 
@@ -95,5 +96,32 @@ struct TimingTest : tpunit::TestFixture {
             ASSERT_LESS_THAN(peekTime + processTime, totalTime);
         }
     }
+
+    // Returns the names of the spans `node` has recorded for `traceID`.
+    set<string> getSpanNames(int node, const string& traceID) {
+        SData request("GetTraces");
+        request["traceID"] = traceID;
+        STable response = SParseJSONObject(tester->getBedrockTester(node)->executeWaitVerifyContent(request));
+        set<string> names;
+        for (auto& span : SParseJSONArray(response["spans"])) {
+            names.insert(SParseJSONObject(span)["name"]);
+        }
+        return names;
+    }
+
+    void trace()
+    {
+        // Escalate a traced write from a slave, and master's part in it should be traced as well.
+        SData query("idcollision t");
+        query["writeConsistency"] = "QUORUM";
+        query["value"] = "traced";
+        query["traceID"] = "timingtesttrace";
+        tester->getBedrockTester(1)->executeWaitVerifyContent(query);
+
+        // The slave may or may not have been told to commit the transaction yet, so it may also have "replicate".
+        ASSERT_TRUE(getSpanNames(1, "timingtesttrace").count("command"));
+        ASSERT_EQUAL(getSpanNames(0, "timingtesttrace"), set<string>({"command", "distributedCommit"}));
+        ASSERT_TRUE(getSpanNames(0, "someothertrace").empty());
+    }
 } __TimingTest;
 
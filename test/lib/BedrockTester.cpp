@@ -404,6 +404,15 @@ SQLite& BedrockTester::getSQLiteDB()
     return *_db;
 }
 
+bool BedrockTester::queryDB(const string& query, SQResult& result)
+{
+    SData command("Query");
+    command["query"] = query;
+    command["Format"] = "binary";
+    auto results = executeWaitMultipleData({command}, 1);
+    return SStartsWith(results[0].methodLine, "200") && result.deserializeBinary(results[0].content);
+}
+
 string BedrockTester::readDB(const string& query)
 {
     return getSQLiteDB().read(query);
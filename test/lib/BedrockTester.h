@@ -61,6 +61,9 @@ class BedrockTester {
     // If the response method line doesn't begin with the expected result, throws.
     STable executeWaitVerifyContentTable(SData request, const string& expectedResult = "200");
 
+    // Runs a read query through the server's Query command, fetched and decoded in the binary format.
+    bool queryDB(const string& query, SQResult& result);
+
     // Read from the DB file. Interface is the same as SQLiteNode's 'read' for backwards compatibility.
     string readDB(const string& query);
     bool readDB(const string& query, SQResult& result);
@@ -0,0 +1,134 @@
+#include <libstuff/libstuff.h>
+#include <BedrockCommandQueue.h>
+#include <BedrockCommand.h>
+#include <test/lib/BedrockTester.h>
+
+struct BedrockCommandQueueTest : tpunit::TestFixture {
+    BedrockCommandQueueTest() : tpunit::TestFixture("BedrockCommandQueue",
+                                                    TEST(BedrockCommandQueueTest::testOrdering),
+                                                    TEST(BedrockCommandQueueTest::testFutureCommands),
+                                                    TEST(BedrockCommandQueueTest::testRemoveByID),
+                                                    TEST(BedrockCommandQueueTest::testRecentWait),
+                                                    TEST(BedrockCommandQueueTest::testFairQueuing)) { }
+
+    BedrockCommand makeCommand(const string& name, BedrockCommand::Priority priority, uint64_t executeTime) {
+        SData request(name);
+        request["priority"] = to_string(priority);
+        request["commandExecuteTime"] = to_string(executeTime);
+        return BedrockCommand(request);
+    }
+
+    void testOrdering() {
+        BedrockCommandQueue queue;
+        uint64_t now = STimeNow();
+        queue.push(makeCommand("normalLater", BedrockCommand::PRIORITY_NORMAL, now - 1));
+        queue.push(makeCommand("normalEarlier", BedrockCommand::PRIORITY_NORMAL, now - 2));
+        queue.push(makeCommand("high", BedrockCommand::PRIORITY_HIGH, now));
+        ASSERT_EQUAL(queue.size(), 3);
+
+        // Priority trumps timestamp, and then the earliest timestamp goes first.
+        ASSERT_EQUAL(queue.get().request.methodLine, "high");
+        ASSERT_EQUAL(queue.get().request.methodLine, "normalEarlier");
+        ASSERT_EQUAL(queue.get().request.methodLine, "normalLater");
+        ASSERT_TRUE(queue.empty());
+    }
+
+    void testFutureCommands() {
+        BedrockCommandQueue queue;
+        uint64_t now = STimeNow();
+        queue.push(makeCommand("soon", BedrockCommand::PRIORITY_MAX, now + 200000));
+        queue.push(makeCommand("muchLater", BedrockCommand::PRIORITY_MAX, now + 60 * STIME_US_PER_S));
+        queue.push(makeCommand("now", BedrockCommand::PRIORITY_MIN, now));
+
+        // A higher priority command that isn't due yet doesn't block one that is.
+        ASSERT_EQUAL(queue.get(1000).request.methodLine, "now");
+
+        // We wake up for the future command as soon as it's due, rather than waiting out our whole timeout.
+        uint64_t before = STimeNow();
+        ASSERT_EQUAL(queue.get(10 * STIME_US_PER_S).request.methodLine, "soon");
+        ASSERT_LESS_THAN(STimeNow() - before, 5 * STIME_US_PER_S);
+
+        // The far future command can be abandoned.
+        ASSERT_EQUAL(queue.size(), 1);
+        queue.abandonFutureCommands(5000);
+        ASSERT_TRUE(queue.empty());
+        ASSERT_THROW(queue.get(1000), BedrockCommandQueue::timeout_error);
+    }
+
+    void testRemoveByID() {
+        BedrockCommandQueue queue;
+        uint64_t now = STimeNow();
+        for (uint64_t executeTime : {now, now + 10 * STIME_US_PER_S, now + 600 * STIME_US_PER_S}) {
+            BedrockCommand command = makeCommand("command", BedrockCommand::PRIORITY_NORMAL, executeTime);
+            command.id = to_string(executeTime);
+            queue.push(move(command));
+        }
+
+        // Commands can be removed whether they're ready, in the timer wheel, or beyond it.
+        ASSERT_FALSE(queue.removeByID("missing"));
+        ASSERT_TRUE(queue.removeByID(to_string(now + 10 * STIME_US_PER_S)));
+        ASSERT_TRUE(queue.removeByID(to_string(now + 600 * STIME_US_PER_S)));
+        ASSERT_TRUE(queue.removeByID(to_string(now)));
+        ASSERT_TRUE(queue.empty());
+
+        // A command can still be found after it's moved from the timer wheel into the ready queue.
+        BedrockCommand soon = makeCommand("soon", BedrockCommand::PRIORITY_LOW, STimeNow() + 50 * STIME_US_PER_MS);
+        soon.id = "soon";
+        queue.push(move(soon));
+        queue.push(makeCommand("high", BedrockCommand::PRIORITY_HIGH, STimeNow() + 50 * STIME_US_PER_MS));
+        usleep(100 * STIME_US_PER_MS);
+        ASSERT_EQUAL(queue.get().request.methodLine, "high");
+        ASSERT_TRUE(queue.removeByID("soon"));
+        ASSERT_TRUE(queue.empty());
+    }
+
+    void testRecentWait() {
+        BedrockCommandQueue queue;
+        for (int i = 0; i < 2; i++) {
+            queue.push(makeCommand("low", BedrockCommand::PRIORITY_LOW, 0));
+        }
+        usleep(50 * STIME_US_PER_MS);
+        queue.get();
+
+        // The wait counts at the priority it was measured at, and any higher one, while there's more waiting there.
+        ASSERT_GREATER_THAN_EQUAL(queue.getRecentWaitUS(BedrockCommand::PRIORITY_LOW), 50 * STIME_US_PER_MS);
+        ASSERT_GREATER_THAN_EQUAL(queue.getRecentWaitUS(BedrockCommand::PRIORITY_HIGH), 50 * STIME_US_PER_MS);
+        ASSERT_EQUAL(queue.getRecentWaitUS(BedrockCommand::PRIORITY_MIN), 0);
+
+        // Once nothing's waiting at that priority, neither is a new command.
+        queue.get();
+        ASSERT_EQUAL(queue.getRecentWaitUS(BedrockCommand::PRIORITY_HIGH), 0);
+    }
+
+    void testFairQueuing() {
+        BedrockCommandQueue queue;
+        queue.setFairQueuing({{BedrockCommand::PRIORITY_HIGH, 3}}, "clientID");
+        auto push = [&](const string& name, BedrockCommand::Priority priority, const string& clientID) {
+            BedrockCommand command = makeCommand(name, priority, 0);
+            command.request["clientID"] = clientID;
+            queue.push(move(command));
+        };
+
+        // A client that floods the queue only gets every other turn with one that sends a couple of commands.
+        for (int i = 0; i < 6; i++) {
+            push("flood", BedrockCommand::PRIORITY_HIGH, "a");
+        }
+        push("interactive", BedrockCommand::PRIORITY_HIGH, "b");
+        push("interactive", BedrockCommand::PRIORITY_HIGH, "b");
+        for (const char* name : {"flood", "interactive", "flood", "interactive", "flood", "flood"}) {
+            ASSERT_EQUAL(queue.get().request.methodLine, name);
+        }
+        queue.clear();
+
+        // Higher priorities get turns in proportion to their weights, but don't starve lower ones.
+        for (int i = 0; i < 8; i++) {
+            push("high", BedrockCommand::PRIORITY_HIGH, "a");
+            push("normal", BedrockCommand::PRIORITY_NORMAL, "a");
+        }
+        int high = 0;
+        for (int i = 0; i < 8; i++) {
+            high += queue.get().request.methodLine == "high";
+        }
+        ASSERT_EQUAL(high, 6);
+    }
+} __BedrockCommandQueueTest;
@@ -0,0 +1,37 @@
+#include <test/lib/BedrockTester.h>
+
+struct CacheTest : tpunit::TestFixture {
+    CacheTest()
+        : tpunit::TestFixture("Cache",
+                              BEFORE_CLASS(CacheTest::setup),
+                              TEST(CacheTest::overwriteFromMemory),
+                              AFTER_CLASS(CacheTest::tearDown)) { }
+
+    BedrockTester* tester;
+
+    void setup() { tester = new BedrockTester(_threadID, {{"-plugins", "Cache,DB"}, {"-cache.memory", "1MB"}}, {}); }
+
+    void tearDown() { delete tester; }
+
+    string _read(const string& name) {
+        SData command("ReadCache");
+        command["name"] = name;
+        return tester->executeWaitVerifyContent(command);
+    }
+
+    void _write(const string& name, const string& value) {
+        SData command("WriteCache");
+        command["name"] = name;
+        command["value"] = value;
+        tester->executeWaitVerifyContent(command);
+    }
+
+    // Overwriting a name replaces its row with a new one, and the value held in memory for it goes with the old row
+    void overwriteFromMemory() {
+        _write("overwrite", "first");
+        ASSERT_EQUAL(_read("overwrite"), "first");
+        ASSERT_EQUAL(_read("overwrite"), "first");
+        _write("overwrite", "second");
+        ASSERT_EQUAL(_read("overwrite"), "second");
+    }
+} __CacheTest;
@@ -0,0 +1,64 @@
+#include <test/lib/BedrockTester.h>
+#include <BedrockClient.h>
+
+struct ClientTest : tpunit::TestFixture {
+    ClientTest()
+        : tpunit::TestFixture("Client",
+                              BEFORE_CLASS(ClientTest::setup),
+                              TEST(ClientTest::pipelining),
+                              TEST(ClientTest::commitCount),
+                              TEST(ClientTest::failover),
+                              AFTER_CLASS(ClientTest::tearDown)) { }
+
+    BedrockTester* tester;
+
+    void setup() {
+        tester = new BedrockTester(_threadID, {{"-plugins", "DB"}}, {"CREATE TABLE client (id INTEGER PRIMARY KEY)"});
+    }
+
+    void tearDown() { delete tester; }
+
+    // More requests than there are connections all come back, each with its own response
+    void pipelining() {
+        BedrockClient client({tester->getServerAddr()}, 2, 10);
+        vector<future<SData>> responses;
+        for (int i = 0; i < 50; i++) {
+            SData request("Query");
+            request["query"] = "SELECT " + to_string(i) + ";";
+            request["format"] = "json";
+            responses.push_back(client.send(request));
+        }
+        for (int i = 0; i < 50; i++) {
+            SData response = responses[i].get();
+            ASSERT_TRUE(SStartsWith(response.methodLine, "200"));
+            SQResult result;
+            ASSERT_TRUE(result.deserialize(response.content));
+            ASSERT_EQUAL(result[0][0], to_string(i));
+        }
+    }
+
+    // The client keeps the commit count of its writes, and sends it with what comes after
+    void commitCount() {
+        BedrockClient client({tester->getServerAddr()});
+        SData write("Query");
+        write["query"] = "INSERT INTO client VALUES (NULL);";
+        SData response = client.execute(write);
+        ASSERT_TRUE(SStartsWith(response.methodLine, "200"));
+        ASSERT_EQUAL(client.getCommitCount(), SToUInt64(response["commitCount"]));
+        ASSERT_TRUE(client.getCommitCount() > 0);
+
+        SData read("Query");
+        read["query"] = "SELECT COUNT(*) FROM client;";
+        ASSERT_TRUE(SStartsWith(client.execute(read).methodLine, "200"));
+    }
+
+    // A node that won't take connections is skipped for the next one
+    void failover() {
+        BedrockClient client({"127.0.0.1:1", tester->getServerAddr()}, 1, 1, 10 * STIME_US_PER_S);
+        SData request("Query");
+        request["query"] = "SELECT 1;";
+        ASSERT_TRUE(SStartsWith(client.execute(request).methodLine, "200"));
+        ASSERT_TRUE(SStartsWith(client.execute(request).methodLine, "200"));
+    }
+
+} __ClientTest;
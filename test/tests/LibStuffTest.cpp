@@ -19,13 +19,19 @@ struct LibStuff : tpunit::TestFixture {
                                     TEST(LibStuff::testParseIntegerList),
                                     TEST(LibStuff::testSData),
                                     TEST(LibStuff::testSTable),
+                                    TEST(LibStuff::testSFlatTable),
                                     TEST(LibStuff::testFileIO),
                                     TEST(LibStuff::testSTimeNow),
                                     TEST(LibStuff::testCurrentTimestamp),
                                     TEST(LibStuff::testSQList),
                                     TEST(LibStuff::testRandom),
                                     TEST(LibStuff::testHexConversion),
-                                    TEST(LibStuff::testContains))
+                                    TEST(LibStuff::testContains),
+                                    TEST(LibStuff::testFastBuffer),
+                                    TEST(LibStuff::testHistogram),
+                                    TEST(LibStuff::testLockTimer),
+                                    TEST(LibStuff::testThreadAffinity),
+                                    TEST(LibStuff::testQueryLog))
     { }
 
     void testEncryptDecrpyt() {
@@ -74,6 +80,27 @@ struct LibStuff : tpunit::TestFixture {
         ASSERT_EQUAL(SToJSON("{\"science\":9e+61}"), "{\"science\":9e+61}");
         ASSERT_EQUAL(SToJSON("{\"science\":1E+99}"), "{\"science\":1E+99}");
 
+        // Only integers that print the same way come out as numbers.
+        ASSERT_EQUAL(SToJSON("-9223372036854775808"), "-9223372036854775808");
+        ASSERT_EQUAL(SToJSON("9223372036854775808"), "\"9223372036854775808\"");
+        ASSERT_EQUAL(SToJSON("007"), "\"007\"");
+        ASSERT_EQUAL(SToJSON("-0"), "\"-0\"");
+
+        // Long strings are escaped the same way wherever the special characters fall.
+        const string longString = "0123456789abcdef\"0123456789abcde\\/\x01\x7f\n0123456789";
+        ASSERT_EQUAL(SToJSON(longString),
+                     "\"0123456789abcdef\\\"0123456789abcde\\\\\\/\\u0001\\\x7f\\n0123456789\"");
+        ASSERT_EQUAL(SParseJSONArray("[" + SToJSON(longString) + "]").front(), longString);
+
+        // SComposeJSON appends to what's already there.
+        STable appended;
+        appended["a"] = "1";
+        appended["b"] = "x";
+        string buffer = "[";
+        SComposeJSON(buffer, appended);
+        SComposeJSON(buffer, "y");
+        ASSERT_EQUAL(buffer, "[{\"a\":1,\"b\":\"x\"}\"y\"");
+
         STable innerObject0, innerObject1, innerObject0Verify, innerObject1Verify;
         innerObject0["utf8"] = "{\"foo\":\"\\u00b7\"}";
         innerObject0["singleQuoteTest"] = "These are 'single quotes'.";
@@ -133,6 +160,12 @@ struct LibStuff : tpunit::TestFixture {
         ASSERT_EQUAL(SUnescape("\\u00b7"), "\xc2\xb7");     // 2 Byte
         ASSERT_EQUAL(SUnescape("\\uc2b7"), "\xec\x8a\xb7"); // 3 Byte
         ASSERT_EQUAL(SUnescape("\\u05c0"), "\xd7\x80");     // 2 Byte, bottom 0
+        ASSERT_EQUAL(SUnescape("nothing escaped"), "nothing escaped");
+        ASSERT_EQUAL(SQ("it's 'quoted'"), "'it''s ''quoted'''");
+        ASSERT_EQUAL(SQ(""), "''");
+        string appended = "x=";
+        SAppendEscaped(appended, "a,b", ",");
+        ASSERT_EQUAL(appended, "x=a\\,b");
     }
 
     void testTrim() {
@@ -320,6 +353,14 @@ struct LibStuff : tpunit::TestFixture {
 
         // Test end to end.
         ASSERT_EQUAL(SGUnzip(SGZip(data)), data);
+
+        // The fastest level still round-trips.
+        data = "";
+        for (int i = 0; i < 1000; i++) {
+            data += "this is a test";
+        }
+        ASSERT_TRUE(SGZip(data, 1).length() < data.length());
+        ASSERT_EQUAL(SGUnzip(SGZip(data, 1)), data);
     }
 
     void testConstantTimeEquals() {
@@ -370,6 +411,29 @@ struct LibStuff : tpunit::TestFixture {
         ASSERT_EQUAL(c["e"], "char*");
         ASSERT_EQUAL(c["f"], "string");
         ASSERT_EQUAL(SToInt(c["g"]), 97);
+
+        // Escaped values round trip, and repeated cookies are all kept.
+        SData d("Test");
+        d["escaped"] = "line one\nline two\\";
+        d["plain"] = "  padded  ";
+        SData e;
+        ASSERT_EQUAL(e.deserialize(d.serialize() + "Next"), (int)d.serialize().size());
+        ASSERT_EQUAL(e["escaped"], "line one\nline two\\");
+        ASSERT_EQUAL(e["plain"], "padded");
+        ASSERT_TRUE(e.deserialize("Test\r\nSet-Cookie: a=1\r\nSet-Cookie: b=2\r\n\r\n"));
+        ASSERT_EQUAL(e["Set-Cookie"], string("a=1") + S_COOKIE_SEPARATOR + "b=2");
+
+        // Headers followed by content are the same as the whole message, unless the content gets compressed.
+        d.content = "some content";
+        ASSERT_EQUAL(d.serializeHeaders() + d.content, d.serialize());
+        d["Content-Encoding"] = "gzip";
+        ASSERT_EQUAL(d.serializeHeaders(), "");
+
+        // Serializing into a buffer appends to whatever's already there.
+        string buffer = "prefix";
+        a.serialize(buffer);
+        c.serialize(buffer);
+        ASSERT_EQUAL(buffer, "prefix" + a.serialize() + c.serialize());
     }
 
     void testSTable() {
@@ -397,6 +461,70 @@ struct LibStuff : tpunit::TestFixture {
         ASSERT_EQUAL(test["i"], "string");
         ASSERT_EQUAL(test["j"], "true");
         ASSERT_EQUAL(test["k"], "false");
+
+        // Keys are case-insensitive, and ordered as if lowercase.
+        STable headers;
+        headers["Content-Length"] = 1;
+        headers["content-length"] = 2;
+        headers["Z"] = 3;
+        headers["_"] = 4;
+        headers["content"] = 5;
+        ASSERT_EQUAL(headers.size(), 4);
+        ASSERT_EQUAL(headers["CONTENT-LENGTH"], "2");
+        list<string> keys;
+        for (const auto& header : headers) {
+            keys.push_back(header.first);
+        }
+        ASSERT_EQUAL(SComposeList(keys), "_, content, Content-Length, Z");
+    }
+
+    void testSFlatTable() {
+        // Lookups ignore case, and iteration is in the same order as an STable with the same keys.
+        SFlatTable headers;
+        headers["Content-Length"] = 1;
+        headers["content-length"] = 2;
+        headers["Z"] = 3;
+        headers["_"] = 4;
+        headers["content"] = 5;
+        ASSERT_EQUAL(headers.size(), 4);
+        ASSERT_EQUAL(headers["CONTENT-LENGTH"], "2");
+        ASSERT_TRUE(SContains(headers, "z"));
+        ASSERT_FALSE(SContains(headers, "y"));
+        ASSERT_FALSE(headers.emplace("Z", SString()).second);
+        ASSERT_EQUAL(headers.at("z"), "3");
+        list<string> keys;
+        for (const auto& header : headers) {
+            keys.push_back(header.first);
+        }
+        ASSERT_EQUAL(SComposeList(keys), "_, content, Content-Length, Z");
+        ASSERT_EQUAL(headers.erase("CONTENT"), 1);
+        ASSERT_EQUAL(headers.erase("content"), 0);
+        ASSERT_EQUAL(headers.size(), 3);
+
+        // Past the point where lookups stop scanning, they still find everything, in order.
+        SFlatTable large;
+        STable reference;
+        for (size_t i = 0; i < SFlatTable::LINEAR_LIMIT * 2; i++) {
+            const string name = (i % 2 ? "Header" : "header") + to_string(SFlatTable::LINEAR_LIMIT * 2 - i);
+            large[name] = i;
+            reference[name] = i;
+        }
+        ASSERT_EQUAL(large.size(), reference.size());
+        ASSERT_EQUAL(large["HEADER7"], reference["header7"]);
+        ASSERT_TRUE(STable(large) == reference);
+        ASSERT_TRUE(STable(SFlatTable(reference)) == reference);
+
+        // SData keeps its headers in one, and serializes them in the same order as before.
+        SData request("Test");
+        request["b"] = "2";
+        request["A"] = "1";
+        request["c"] = "3";
+        ASSERT_EQUAL(request["a"], "1");
+        ASSERT_EQUAL(request.serialize(), "Test\r\nA: 1\r\nb: 2\r\nc: 3\r\nContent-Length: 0\r\n\r\n");
+        SData parsed;
+        parsed.deserialize(request.serialize());
+        ASSERT_EQUAL(parsed.calc("B"), 2);
+        ASSERT_TRUE(parsed.nameValueMap.find("C") != parsed.nameValueMap.end());
     }
 
     void testFileIO() {
@@ -460,6 +588,12 @@ struct LibStuff : tpunit::TestFixture {
             prev = next;
         }
         ASSERT_EQUAL(failures, 0);
+
+        // The cached string matches formatting the time directly, unless the second rolled over in between.
+        const string now = SCurrentTimeString();
+        const string composed = SComposeTime("%Y-%m-%d %H:%M:%S", STimeNow());
+        ASSERT_TRUE(now == composed || now < composed);
+        ASSERT_EQUAL(SQ(SCurrentTimeString()).size(), SCURRENT_TIMESTAMP().size());
     }
 
     void testSQList() {
@@ -611,4 +745,132 @@ struct LibStuff : tpunit::TestFixture {
         ASSERT_TRUE(SContains(string("asdf"), "a"));
         ASSERT_TRUE(SContains(string("asdf"), string("asd")));
     }
+
+    void testFastBuffer() {
+        SFastBuffer buffer;
+        ASSERT_TRUE(buffer.empty());
+        buffer += "abcdef";
+        buffer.consumeFront(2);
+        ASSERT_EQUAL(string(buffer), "cdef");
+        buffer.append("gh", 2);
+        ASSERT_EQUAL(buffer.size(), 6);
+        ASSERT_EQUAL(string(buffer.c_str()), "cdefgh");
+
+        // Consuming past the end just empties it.
+        buffer.consumeFront(4);
+        ASSERT_EQUAL(string(buffer), "gh");
+        buffer.consumeFront(10);
+        ASSERT_TRUE(buffer.empty());
+        buffer = "new";
+        ASSERT_EQUAL(string(buffer), "new");
+    }
+
+    void testHistogram() {
+        SHistogram histogram;
+        ASSERT_EQUAL(histogram.percentile(50), 0);
+
+        // Small values are exact.
+        for (uint64_t i = 1; i <= 10; i++) {
+            histogram.record(i);
+        }
+        ASSERT_EQUAL(histogram.count(), 10);
+        ASSERT_EQUAL(histogram.percentile(50), 5);
+        ASSERT_EQUAL(histogram.percentile(100), 10);
+
+        // Larger values come back within a bucket's width, and never above the largest recorded value.
+        SHistogram large;
+        for (uint64_t i = 1; i <= 1000; i++) {
+            large.record(i * 1000);
+        }
+        uint64_t p99 = large.percentile(99);
+        ASSERT_TRUE(p99 >= 990000 && p99 <= 990000 * 107 / 100);
+        ASSERT_EQUAL(large.percentile(100), 1000000);
+        ASSERT_EQUAL(large.max(), 1000000);
+
+        // Merging adds the counts together.
+        large.merge(histogram);
+        ASSERT_EQUAL(large.count(), 1010);
+        ASSERT_EQUAL(large.percentile(0.5), 6);
+    }
+
+    void testLockTimer() {
+        recursive_mutex m;
+        SLockTimer<recursive_mutex> timer("Test Lock", m, 10, 2);
+
+        // Recursive locking only counts once.
+        timer.lock();
+        timer.lock();
+        timer.unlock();
+        timer.unlock();
+        ASSERT_EQUAL(timer.getAcquisitions(), 1);
+
+        // Each thread gets its own totals, and every second acquisition is sampled.
+        thread t([&]() {
+            SLogSetThreadName("lockTimerTest");
+            for (int i = 0; i < 3; i++) {
+                SLockTimerGuard<decltype(timer)> guard(timer);
+            }
+        });
+        t.join();
+        ASSERT_EQUAL(timer.getAcquisitions(), 4);
+        ASSERT_EQUAL(timer.getWaitHistogram().count(), 2);
+        ASSERT_EQUAL(timer.getHoldHistogram().count(), 2);
+        ASSERT_TRUE(SContains(timer.getPerThreadTotals(), string("lockTimerTest")));
+    }
+
+    void testThreadAffinity() {
+        // Invalid lists are rejected without changing anything.
+        for (const char* cpuList : {"", "a", "3-1", "1-2-3", "-1", "node", "nodeX", "100000"}) {
+            ASSERT_FALSE(SSetThreadAffinity(cpuList));
+        }
+
+        // Pinning a thread to whichever CPU it's on works, and only affects that thread.
+        bool pinned = false;
+        thread t([&]() {
+            pinned = SSetThreadAffinity(to_string(sched_getcpu()));
+        });
+        t.join();
+        ASSERT_TRUE(pinned);
+    }
+
+    void testQueryLog() {
+        const string path = "./querylog.test";
+        sqlite3* db;
+        ASSERT_EQUAL(sqlite3_open(":memory:", &db), SQLITE_OK);
+
+        // Queries that only differ in their values share a fingerprint, so the CSV shows the statement for each.
+        SQueryLogOpen(path);
+        ASSERT_TRUE(SQueryLogIsOpen());
+        ASSERT_FALSE(SQuery(db, "test", "SELECT 1, 'one';"));
+        ASSERT_FALSE(SQuery(db, "test", "SELECT  2, 'it''s';"));
+        SQueryLogClose();
+        ASSERT_FALSE(SQueryLogIsOpen());
+        ostringstream csv;
+        ASSERT_TRUE(SQueryLogToCSV(path, csv));
+        list<string> lines = SParseList(csv.str(), '\n');
+        ASSERT_EQUAL(lines.size(), 3);
+        lines.pop_front();
+        for (const string& line : lines) {
+            ASSERT_TRUE(SStartsWith(line, "\"\", \"SELECT ?, ?;\", "));
+        }
+
+        // With full text and sampling, we get every other query as it was run.
+        SQueryLogOpen(path, 2, true);
+        for (int i = 0; i < 4; i++) {
+            ASSERT_FALSE(SQuery(db, "test", "SELECT " + SQ(i) + ";"));
+        }
+        SQueryLogClose();
+        csv.str("");
+        ASSERT_TRUE(SQueryLogToCSV(path, csv));
+        lines = SParseList(csv.str(), '\n');
+        ASSERT_EQUAL(lines.size(), 3);
+        ASSERT_TRUE(SContains(csv.str(), "\"SELECT 0;\""));
+        ASSERT_TRUE(SContains(csv.str(), "\"SELECT 2;\""));
+
+        // Anything else isn't a query log.
+        ASSERT_TRUE(SFileSave(path, "filename, query, elapsed\n"));
+        ASSERT_FALSE(SQueryLogToCSV(path, csv));
+        SFileDelete(path);
+        sqlite3_close(db);
+    }
 } __LibStuff;
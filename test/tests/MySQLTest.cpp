@@ -0,0 +1,40 @@
+#include <libstuff/libstuff.h>
+#include <plugins/MySQL.h>
+#include <test/lib/BedrockTester.h>
+
+class MySQLTester {
+  public:
+    static vector<size_t> findUnquoted(const string& query, char c) {
+        return BedrockPlugin_MySQL::_findUnquoted(query, c);
+    }
+};
+
+struct MySQLTest : tpunit::TestFixture {
+    MySQLTest()
+        : tpunit::TestFixture("MySQL",
+                              TEST(MySQLTest::placeholdersInComments),
+                              TEST(MySQLTest::escapedQuotes)) { }
+
+    // Placeholders and statement separators in comments aren't found, but those after them are
+    void placeholdersInComments() {
+        ASSERT_EQUAL(MySQLTester::findUnquoted("SELECT ? -- why?\n, ?", '?'), vector<size_t>({7, 19}));
+        ASSERT_EQUAL(MySQLTester::findUnquoted("SELECT ? # why?\n, ?", '?'), vector<size_t>({7, 18}));
+        ASSERT_EQUAL(MySQLTester::findUnquoted("SELECT /* ?; */ ?", '?'), vector<size_t>({16}));
+        ASSERT_EQUAL(MySQLTester::findUnquoted("SELECT 1; -- done; really\nSELECT 2", ';'), vector<size_t>({8}));
+        ASSERT_EQUAL(MySQLTester::findUnquoted("SELECT 1 /* ; */; SELECT 2", ';'), vector<size_t>({16}));
+
+        // "--" is only a comment if it's followed by whitespace.
+        ASSERT_EQUAL(MySQLTester::findUnquoted("SELECT 1--?", '?'), vector<size_t>({10}));
+    }
+
+    // Quotes escaped with a backslash or by doubling them don't end the string
+    void escapedQuotes() {
+        ASSERT_EQUAL(MySQLTester::findUnquoted("SELECT 'it\\'s?', ?", '?'), vector<size_t>({17}));
+        ASSERT_EQUAL(MySQLTester::findUnquoted("SELECT \"say \\\"hi;\\\"\"; SELECT 2", ';'), vector<size_t>({20}));
+        ASSERT_EQUAL(MySQLTester::findUnquoted("SELECT 'it''s?', ?", '?'), vector<size_t>({17}));
+        ASSERT_EQUAL(MySQLTester::findUnquoted("SELECT '\\\\', ?", '?'), vector<size_t>({13}));
+
+        // Identifiers don't use backslash escapes.
+        ASSERT_EQUAL(MySQLTester::findUnquoted("SELECT `a\\`, ?", '?'), vector<size_t>({13}));
+    }
+} __MySQLTest;
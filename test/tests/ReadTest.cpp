@@ -7,6 +7,10 @@ struct ReadTest : tpunit::TestFixture {
                               TEST(ReadTest::simpleRead),
                               TEST(ReadTest::simpleReadWithHttp),
                               TEST(ReadTest::readNoSemicolon),
+                              TEST(ReadTest::pipelinedReads),
+                              TEST(ReadTest::binaryFormat),
+                              TEST(ReadTest::identicalParallelReads),
+                              TEST(ReadTest::clientTimeout),
                               AFTER_CLASS(ReadTest::tearDown)) { }
 
     BedrockTester* tester;
@@ -37,4 +41,87 @@ struct ReadTest : tpunit::TestFixture {
         tester->executeWaitVerifyContent(status, "502");
     }
 
+    void identicalParallelReads() {
+        // Identical reads sent at once may share one response, but each still gets the right answer.
+        vector<SData> requests;
+        for (int i = 0; i < 50; i++) {
+            SData query("Query");
+            query["query"] = "SELECT 12345;";
+            query["debugID"] = "identical#" + to_string(i);
+            requests.push_back(query);
+        }
+        for (auto& response : tester->executeWaitMultipleData(requests)) {
+            ASSERT_EQUAL(SToInt(response.methodLine), 200);
+            ASSERT_EQUAL(SToInt(response.content), 12345);
+        }
+    }
+
+    void pipelinedReads() {
+        // Send several requests on one connection without waiting for any responses.
+        int socket = S_socket(tester->getServerAddr(), true, false, true);
+        ASSERT_TRUE(socket > 0);
+        string sendBuffer;
+        for (int i = 1; i <= 5; i++) {
+            SData query("Query");
+            query["query"] = "SELECT " + SQ(i) + ";";
+            sendBuffer += query.serialize();
+        }
+        while (sendBuffer.size()) {
+            ASSERT_TRUE(S_sendconsume(socket, sendBuffer));
+        }
+
+        // The responses come back in the order the requests were sent.
+        string recvBuffer;
+        for (int i = 1; i <= 5; i++) {
+            SData response;
+            int size = 0;
+            int timeouts = 0;
+            while (!(size = response.deserialize(recvBuffer)) && timeouts < 60) {
+                pollfd readSock = {socket, POLLIN, 0};
+                if (poll(&readSock, 1, 1000) > 0) {
+                    ASSERT_TRUE(S_recvappend(socket, recvBuffer));
+                } else {
+                    timeouts++;
+                }
+            }
+            SConsumeFront(recvBuffer, size);
+            ASSERT_EQUAL(SToInt(response.methodLine), 200);
+            ASSERT_EQUAL(SToInt(response.content), i);
+        }
+        ::shutdown(socket, SHUT_RDWR);
+        ::close(socket);
+    }
+
+    void binaryFormat() {
+        // Every type comes back the way sqlite would've written it as text.
+        SQResult result;
+        ASSERT_TRUE(tester->queryDB("SELECT 1 AS i, 2.5 AS f, 'it''s' AS t, X'00FF' AS b, NULL AS n "
+                                    "UNION ALL SELECT -9000000000, 0.1, '', X'', NULL;", result));
+        ASSERT_EQUAL(result.headers, vector<string>({"i", "f", "t", "b", "n"}));
+        ASSERT_EQUAL(result.size(), 2);
+        ASSERT_EQUAL(result[0][0], "1");
+        ASSERT_EQUAL(result[0][1], "2.5");
+        ASSERT_EQUAL(result[0][2], "it's");
+        ASSERT_EQUAL(result[0][3], string("\x00\xFF", 2));
+        ASSERT_EQUAL(result[0][4], "");
+        ASSERT_EQUAL(result[1][0], "-9000000000");
+        ASSERT_EQUAL(result[1][1], "0.1");
+        ASSERT_EQUAL(result[1][3], "");
+
+        // A query with no rows still decodes.
+        ASSERT_TRUE(tester->queryDB("SELECT 1 WHERE 0;", result));
+        ASSERT_TRUE(result.empty());
+    }
+
+    // A read the client has already given up on isn't run
+    void clientTimeout() {
+        SData query("Query");
+        query["query"] = "SELECT 1;";
+        query["clientTimeout"] = "0";
+        tester->executeWaitVerifyContent(query, "555");
+
+        query["clientTimeout"] = "60000";
+        ASSERT_EQUAL(SToInt(tester->executeWaitVerifyContent(query)), 1);
+    }
+
 } __ReadTest;
@@ -13,21 +13,84 @@ class SQLiteNodeTester {
     static void updateSyncPeer(SQLiteNode& node) {
         node._updateSyncPeer();
     }
+
+    // Holds `command` as though it had been escalated to master.
+    static void holdEscalated(SQLiteNode& node, SQLiteCommand&& command) {
+        node._escalatedHold.add(command);
+        node._escalatedCommandMap.emplace(command.id, move(command));
+    }
+
+    static void expireEscalations(SQLiteNode& node, uint64_t& nextActivity) {
+        node._expireEscalations(nextActivity);
+    }
+
+    static void setMaster(SQLiteNode& node, SQLiteNode::Peer* peer) {
+        node._masterPeer = peer;
+    }
+
+    static const SQLiteCommand& getEscalated(SQLiteNode& node, const string& id) {
+        return node._escalatedCommandMap.at(id);
+    }
+
+    static void onMessage(SQLiteNode& node, SQLiteNode::Peer* peer, const SData& message) {
+        node._onMESSAGE(peer, message);
+    }
+
+    static void onDisconnect(SQLiteNode& node, SQLiteNode::Peer* peer) {
+        node._onDisconnect(peer);
+    }
+
+    static void queueSnapshot(SQLite& db, const string& peerName, uint64_t offset, SData& response) {
+        SQLiteNode::_queueSnapshotStateless("test", peerName, SQLiteNode::MASTERING, offset, db, response);
+    }
+
+    // Makes every snapshot being served look like it was last read long ago.
+    static void ageServedSnapshots() {
+        lock_guard<mutex> lock(SQLiteNode::_servedSnapshotsMutex);
+        for (auto& snapshot : SQLiteNode::_servedSnapshots) {
+            snapshot.second = 0;
+        }
+    }
+
+    static void expireServedSnapshots(SQLiteNode& node, uint64_t& nextActivity) {
+        node._expireServedSnapshots(nextActivity);
+    }
+
+    static void recvSnapshot(SQLiteNode& node, SQLiteNode::Peer* peer, const SData& message) {
+        node._recvSnapshot(peer, message);
+    }
+};
+
+class STCPNodeTester {
+  public:
+    static void decompress(SData& message) {
+        STCPNode::_decompress(message);
+    }
 };
 
 class TestServer : public SQLiteServer {
   public:
     TestServer(const string& host) : SQLiteServer(host) { }
 
-    virtual void acceptCommand(SQLiteCommand&& command, bool isNew) { }
+    virtual void acceptCommand(SQLiteCommand&& command, bool isNew) {
+        accepted.push_back(move(command));
+    }
     virtual void cancelCommand(const string& commandID) { }
     virtual bool canStandDown() { return true; }
     virtual void onNodeLogin(SQLiteNode::Peer* peer) { }
+
+    // Every command the node has handed back.
+    list<SQLiteCommand> accepted;
 };
 
 struct SQLiteNodeTest : tpunit::TestFixture {
     SQLiteNodeTest() : tpunit::TestFixture("SQLiteNode",
-                                           TEST(SQLiteNodeTest::testFindSyncPeer)) { }
+                                           TEST(SQLiteNodeTest::testFindSyncPeer),
+                                           TEST(SQLiteNodeTest::testEscalationDeadline),
+                                           TEST(SQLiteNodeTest::testEscalationIgnoresTimeout),
+                                           TEST(SQLiteNodeTest::testCompressionNegotiation),
+                                           TEST(SQLiteNodeTest::testCompressedMessages),
+                                           TEST(SQLiteNodeTest::testServedSnapshotCleanup)) { }
 
     void testFindSyncPeer() {
 
@@ -110,4 +173,182 @@ struct SQLiteNodeTest : tpunit::TestFixture {
         ASSERT_EQUAL(SQLiteNodeTester::getSyncPeer(testNode), fastest);
     }
 
+    void testEscalationDeadline() {
+        SQLite db(":memory:", 1000000, 100, 5000, -1, -1);
+        TestServer server("");
+        SQLiteNode testNode(server, db, "test", "localhost:19999", "", 1, 1000000000, "1.0", 100);
+
+        const uint64_t now = STimeNow();
+        SQLiteCommand expired(SData("Query"));
+        expired.id = "expired";
+        expired.deadline = now - 1;
+        SQLiteNodeTester::holdEscalated(testNode, move(expired));
+        SQLiteCommand waiting(SData("Query"));
+        waiting.id = "waiting";
+        waiting.deadline = now + STIME_US_PER_M;
+        SQLiteNodeTester::holdEscalated(testNode, move(waiting));
+
+        // Only the command past its deadline is answered, and we'll wake up for the other one.
+        uint64_t nextActivity = now + 2 * STIME_US_PER_M;
+        SQLiteNodeTester::expireEscalations(testNode, nextActivity);
+        ASSERT_EQUAL(server.accepted.size(), 1);
+        ASSERT_EQUAL(server.accepted.front().id, "expired");
+        ASSERT_EQUAL(server.accepted.front().response.methodLine, "555 Timeout waiting for master");
+        ASSERT_EQUAL(nextActivity, now + STIME_US_PER_M);
+        ASSERT_EQUAL(testNode.getEscalatedHold().count(), 1);
+
+        // Shutting down brings the other's deadline forward.
+        testNode.expireEscalationsBy(now);
+        SQLiteNodeTester::expireEscalations(testNode, nextActivity);
+        ASSERT_EQUAL(server.accepted.size(), 2);
+        ASSERT_EQUAL(server.accepted.back().id, "waiting");
+        ASSERT_EQUAL(testNode.getEscalatedHold().count(), 0);
+    }
+
+    void testEscalationIgnoresTimeout() {
+        SQLite db(":memory:", 1000000, 100, 5000, -1, -1);
+        TestServer server("");
+        SQLiteNode testNode(server, db, "test", "localhost:19999", "", 1, 1000000000, "1.0", 100);
+        STable dummyParams;
+        testNode.addPeer("master", "host1.fake:15555", dummyParams);
+        SQLiteNode::Peer* master = testNode.peerList.front();
+        (*master)["State"] = "MASTERING";
+        SQLiteNodeTester::setMaster(testNode, master);
+        testNode.setEscalationTimeout(STIME_US_PER_S);
+
+        // A long poll's `timeout` is how long it may wait on master, and doesn't stretch the escalation budget.
+        SQLiteCommand longPoll(SData("GetJob"));
+        longPoll.id = "longPoll";
+        longPoll.request["timeout"] = to_string(STIME_US_PER_H / STIME_US_PER_MS);
+        const uint64_t longPollCreated = longPoll.creationTime;
+        testNode.escalateCommand(move(longPoll));
+        ASSERT_EQUAL(SQLiteNodeTester::getEscalated(testNode, "longPoll").deadline, longPollCreated + STIME_US_PER_S);
+
+        // A deadline the client asked for is kept.
+        SQLiteCommand withDeadline(SData("Query"));
+        withDeadline.id = "withDeadline";
+        withDeadline.deadline = withDeadline.creationTime + STIME_US_PER_M;
+        const uint64_t clientDeadline = withDeadline.deadline;
+        testNode.escalateCommand(move(withDeadline));
+        ASSERT_EQUAL(SQLiteNodeTester::getEscalated(testNode, "withDeadline").deadline, clientDeadline);
+    }
+
+    void testCompressionNegotiation() {
+        SQLite db(":memory:", 1000000, 100, 5000, -1, -1);
+        TestServer server("");
+        SQLiteNode testNode(server, db, "test", "localhost:19999", "", 1, 1000000000, "1.0", 100);
+        STable dummyParams;
+        testNode.addPeer("current", "host1.fake:15555", dummyParams);
+        testNode.addPeer("older", "host2.fake:16666", dummyParams);
+        SQLiteNode::Peer* current = testNode.peerList[0];
+        SQLiteNode::Peer* older = testNode.peerList[1];
+
+        SData login("LOGIN");
+        login["CommitCount"] = "0";
+        login["Hash"] = "";
+        login["Priority"] = "2";
+        login["State"] = "SEARCHING";
+        login["Version"] = "1.0";
+        login["Compression"] = "gzip";
+        SQLiteNodeTester::onMessage(testNode, current, login);
+        ASSERT_TRUE(current->supportsCompression.load());
+
+        // A peer that doesn't say it can decompress doesn't get compressed messages.
+        login["Priority"] = "3";
+        login.erase("Compression");
+        SQLiteNodeTester::onMessage(testNode, older, login);
+        ASSERT_FALSE(older->supportsCompression.load());
+    }
+
+    void testCompressedMessages() {
+        STable dummyParams;
+        SQLiteNode::Peer current("current", "host1.fake:15555", dummyParams, 1);
+        current.supportsCompression = true;
+        SQLiteNode::Peer older("older", "host2.fake:16666", dummyParams, 2);
+
+        SData message("BEGIN_TRANSACTION");
+        message["ID"] = "1";
+        for (int i = 0; i < 100; i++) {
+            message.content += "INSERT INTO test VALUES (" + to_string(i) + ", 'some value to compress');";
+        }
+
+        // The compressed message parses, and decompresses back to what was sent.
+        const string compressed = current.serialize(message);
+        ASSERT_LESS_THAN(compressed.size(), message.serialize().size());
+        SData received;
+        ASSERT_EQUAL(received.deserialize(compressed), (int)compressed.size());
+        ASSERT_EQUAL(received["Content-Encoding"], "gzip");
+        ASSERT_EQUAL(received["ID"], "1");
+        ASSERT_NOT_EQUAL(received.content, message.content);
+        STCPNodeTester::decompress(received);
+        ASSERT_FALSE(received.isSet("Content-Encoding"));
+        ASSERT_EQUAL(received.content, message.content);
+
+        // Peers that don't support it, and messages that are too small or don't compress, are sent as they are.
+        ASSERT_EQUAL(older.serialize(message), message.serialize());
+        SData small("COMMIT_TRANSACTION");
+        small.content = "short";
+        ASSERT_EQUAL(current.serialize(small), small.serialize());
+        SData incompressible("BEGIN_TRANSACTION");
+        for (int i = 0; i < 2000; i++) {
+            incompressible.content += (char)SRandom::rand64();
+        }
+        ASSERT_EQUAL(current.serializeCompressed(incompressible, incompressible.content), "");
+    }
+
+    void testServedSnapshotCleanup() {
+        const string dbFile = "/tmp/sqliteNodeSnapshot.db";
+        const string snapshotFile = dbFile + ".snapshot.peer1";
+        for (const string& file : {dbFile, dbFile + "-wal", dbFile + "-shm", snapshotFile}) {
+            SFileDelete(file);
+        }
+        SFileSave(dbFile, "");
+        {
+            // Big enough that the snapshot takes two chunks.
+            SQLite db(dbFile, 1000000, false, 5000, -1, -1);
+            ASSERT_TRUE(db.beginTransaction());
+            ASSERT_TRUE(db.write("CREATE TABLE things (data BLOB);"));
+            ASSERT_TRUE(db.write("INSERT INTO things VALUES (randomblob(5000000));"));
+            ASSERT_TRUE(db.prepare());
+            ASSERT_EQUAL(db.commit(), SQLITE_OK);
+            TestServer server("");
+            SQLiteNode testNode(server, db, "test", "localhost:19999", "", 1, 1000000000, "1.0", 100);
+            STable dummyParams;
+            testNode.addPeer("peer1", "host1.fake:15555", dummyParams);
+            SQLiteNode::Peer* peer = testNode.peerList.front();
+
+            // Sending the last chunk is the end of it.
+            SData response("SNAPSHOT_RESPONSE");
+            SQLiteNodeTester::queueSnapshot(db, "peer1", 0, response);
+            ASSERT_TRUE(SFileExists(snapshotFile));
+            const uint64_t size = SToUInt64(response["Size"]);
+            SQLiteNodeTester::queueSnapshot(db, "peer1", response.content.size(), response);
+            ASSERT_EQUAL(SToUInt64(response["Offset"]) + response.content.size(), size);
+            ASSERT_FALSE(SFileExists(snapshotFile));
+
+            // So is the peer going away partway through.
+            SQLiteNodeTester::queueSnapshot(db, "peer1", 0, response);
+            ASSERT_TRUE(SFileExists(snapshotFile));
+            SQLiteNodeTester::onDisconnect(testNode, peer);
+            ASSERT_FALSE(SFileExists(snapshotFile));
+
+            // And so is it going unread for too long, but not before.
+            SQLiteNodeTester::queueSnapshot(db, "peer1", 0, response);
+            uint64_t nextActivity = STimeNow() + 2 * STIME_US_PER_H;
+            SQLiteNodeTester::expireServedSnapshots(testNode, nextActivity);
+            ASSERT_TRUE(SFileExists(snapshotFile));
+            ASSERT_LESS_THAN_EQUAL(nextActivity, STimeNow() + SQLiteNode::SQL_NODE_SNAPSHOT_SERVE_TIMEOUT);
+            SQLiteNodeTester::ageServedSnapshots();
+            SQLiteNodeTester::expireServedSnapshots(testNode, nextActivity);
+            ASSERT_FALSE(SFileExists(snapshotFile));
+
+            // A peer that won't serve a snapshot says so, and we give up on it.
+            SData refused("SNAPSHOT_RESPONSE");
+            refused["Error"] = "not serving snapshots while SEARCHING";
+            ASSERT_THROW(SQLiteNodeTester::recvSnapshot(testNode, peer, refused), SException);
+        }
+        for (const string& file : {dbFile, dbFile + "-wal", dbFile + "-shm"}) {
+            SFileDelete(file);
+        }
+    }
 } __SQLiteNodeTest;
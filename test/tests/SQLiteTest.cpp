@@ -0,0 +1,436 @@
+#include <libstuff/libstuff.h>
+#include <sqlitecluster/SQLite.h>
+#include <sqlitecluster/SQLiteMerkleTree.h>
+#include <test/lib/BedrockTester.h>
+
+struct SQLiteTest : tpunit::TestFixture {
+    SQLiteTest() : tpunit::TestFixture("SQLite",
+                                       TEST(SQLiteTest::testParameterizedQueries),
+                                       TEST(SQLiteTest::testCommitBatch),
+                                       TEST(SQLiteTest::testHashVersions),
+                                       TEST(SQLiteTest::testSnapshot),
+                                       TEST(SQLiteTest::testChangesets),
+                                       TEST(SQLiteTest::testMerkleTree),
+                                       TEST(SQLiteTest::testGroupCommit),
+                                       TEST(SQLiteTest::testTypedResult),
+                                       TEST(SQLiteTest::testWhitelist)) { }
+
+    void testParameterizedQueries() {
+        SQLite db(":memory:", 1000000, false, 5000, -1, -1);
+        ASSERT_TRUE(db.beginTransaction());
+        ASSERT_TRUE(db.write("CREATE TABLE things (id INTEGER PRIMARY KEY, name TEXT);"));
+
+        // Run the same statement more than once, so that the second run comes from the cache, and include a value that
+        // needs quoting.
+        ASSERT_TRUE(db.write("INSERT INTO things VALUES (?, ?);", {"1", "it's"}));
+        ASSERT_TRUE(db.write("INSERT INTO things VALUES (?, ?);", {"2", "two"}));
+
+        // The wrong number of parameters is an error, not a crash.
+        ASSERT_FALSE(db.write("INSERT INTO things VALUES (?, ?);", {"3"}));
+
+        SQResult result;
+        ASSERT_TRUE(db.read("SELECT name FROM things WHERE id = ?;", {"1"}, result));
+        ASSERT_EQUAL(result.size(), 1);
+        ASSERT_EQUAL(result[0][0], "it's");
+        ASSERT_TRUE(db.read("SELECT name FROM things WHERE id = ?;", {"2"}, result));
+        ASSERT_EQUAL(result.size(), 1);
+        ASSERT_EQUAL(result[0][0], "two");
+
+        // The journal gets the queries with their values expanded.
+        ASSERT_TRUE(SContains(db.getUncommittedQuery(), "INSERT INTO things VALUES ('1', 'it''s');"));
+
+        // Changing the schema invalidates cached statements, and they must still work afterward.
+        ASSERT_TRUE(db.write("ALTER TABLE things ADD COLUMN extra TEXT;"));
+        ASSERT_TRUE(db.read("SELECT name FROM things WHERE id = ?;", {"2"}, result));
+        ASSERT_EQUAL(result[0][0], "two");
+
+        ASSERT_TRUE(db.prepare());
+        ASSERT_EQUAL(db.commit(), SQLITE_OK);
+        ASSERT_EQUAL(db.getCommitCount(), 1);
+    }
+
+    void testCommitBatch() {
+        SQLite db(":memory:", 1000000, false, 5000, -1, -1);
+        ASSERT_TRUE(db.beginTransaction());
+        ASSERT_TRUE(db.write("CREATE TABLE things (id INTEGER PRIMARY KEY);"));
+        ASSERT_TRUE(db.prepare());
+        ASSERT_EQUAL(db.commit(), SQLITE_OK);
+
+        // Build a batch the way a peer would, chaining each hash onto the previous one.
+        list<pair<string, string>> transactions;
+        string hash = db.getCommittedHash();
+        for (int i = 1; i <= 3; i++) {
+            const string query = "INSERT INTO things VALUES (" + SQ(i) + ");";
+            hash = SToHex(SHashSHA1(hash + query));
+            transactions.emplace_back(query, hash);
+        }
+        ASSERT_TRUE(db.commitBatch(transactions));
+        ASSERT_EQUAL(db.getCommitCount(), 4);
+        ASSERT_EQUAL(db.getCommittedHash(), hash);
+        string query, journalHash;
+        ASSERT_TRUE(db.getCommit(3, query, journalHash));
+        ASSERT_EQUAL(query, "INSERT INTO things VALUES (2);");
+
+        // A bad hash anywhere in the batch rolls the whole thing back.
+        transactions.clear();
+        transactions.emplace_back("INSERT INTO things VALUES (4);", SToHex(SHashSHA1(hash + "INSERT INTO things VALUES (4);")));
+        transactions.emplace_back("INSERT INTO things VALUES (5);", "bogus");
+        ASSERT_FALSE(db.commitBatch(transactions));
+        ASSERT_EQUAL(db.getCommitCount(), 4);
+        ASSERT_EQUAL(db.read("SELECT COUNT(*) FROM things;"), "3");
+    }
+
+    void testHashVersions() {
+        SQLite db(":memory:", 1000000, false, 5000, -1, -1);
+        ASSERT_TRUE(db.beginTransaction());
+        ASSERT_TRUE(db.write("CREATE TABLE hashed (id INTEGER PRIMARY KEY);"));
+        ASSERT_TRUE(db.prepare());
+        ASSERT_EQUAL(db.commit(), SQLITE_OK);
+
+        // Version 2 commits chain onto version 1 commits, and can be told apart by length.
+        db.setHashVersion(2);
+        string previousHash = db.getCommittedHash();
+        ASSERT_TRUE(db.beginTransaction());
+        ASSERT_TRUE(db.write("INSERT INTO hashed VALUES (1);"));
+        ASSERT_TRUE(db.prepare());
+        ASSERT_EQUAL(db.commit(), SQLITE_OK);
+        const string hash = db.getCommittedHash();
+        ASSERT_EQUAL(hash, SQLite::getTransactionHash(previousHash, "INSERT INTO hashed VALUES (1);", 2));
+        ASSERT_EQUAL(SQLite::getHashVersion(hash), 2);
+        ASSERT_EQUAL(SQLite::getHashVersion(previousHash), 1);
+
+        // A batch can mix versions, each transaction is checked with the version its hash was made with.
+        db.setHashVersion(1);
+        list<pair<string, string>> transactions;
+        previousHash = hash;
+        for (int i = 2; i <= 3; i++) {
+            const string query = "INSERT INTO hashed VALUES (" + SQ(i) + ");";
+            previousHash = SQLite::getTransactionHash(previousHash, query, i);
+            transactions.emplace_back(query, previousHash);
+        }
+        ASSERT_TRUE(db.commitBatch(transactions));
+        ASSERT_EQUAL(db.getCommittedHash(), previousHash);
+    }
+
+    void testSnapshot() {
+        const string sourceFile = "/tmp/sqliteSnapshotSource.db";
+        const string destinationFile = "/tmp/sqliteSnapshotDestination.db";
+        const string snapshotFile = "/tmp/sqliteSnapshot.db";
+        const string incrementFile = "/tmp/sqliteSnapshotIncrement.db";
+        for (const string& file : {sourceFile, destinationFile, snapshotFile, incrementFile}) {
+            SFileDelete(file);
+            SFileDelete(file + "-wal");
+            SFileDelete(file + "-shm");
+        }
+        SFileSave(sourceFile, "");
+        SFileSave(destinationFile, "");
+        {
+            SQLite source(sourceFile, 1000000, false, 5000, -1, -1);
+            ASSERT_TRUE(source.beginTransaction());
+            ASSERT_TRUE(source.write("CREATE TABLE things (id INTEGER PRIMARY KEY);"));
+            ASSERT_TRUE(source.prepare());
+            ASSERT_EQUAL(source.commit(), SQLITE_OK);
+            ASSERT_TRUE(source.beginTransaction());
+            ASSERT_TRUE(source.write("INSERT INTO things VALUES (1);"));
+            ASSERT_TRUE(source.prepare());
+            ASSERT_EQUAL(source.commit(), SQLITE_OK);
+            ASSERT_EQUAL(source.getOldestCommit(), 1);
+            uint64_t snapshotCommit = 0;
+            ASSERT_TRUE(source.createSnapshot(snapshotFile, 1024 * 1024, &snapshotCommit));
+            ASSERT_EQUAL(snapshotCommit, 2);
+
+            // The destination picks up exactly where the source was.
+            SQLite destination(destinationFile, 1000000, false, 5000, -1, -1);
+            ASSERT_EQUAL(destination.getCommitCount(), 0);
+            ASSERT_TRUE(destination.restoreSnapshot(snapshotFile));
+            ASSERT_EQUAL(destination.getCommitCount(), 2);
+            ASSERT_EQUAL(destination.getCommittedHash(), source.getCommittedHash());
+            ASSERT_EQUAL(destination.read("SELECT COUNT(*) FROM things;"), "1");
+
+            // Later commits can be carried over as an increment on top of the snapshot.
+            for (int i = 2; i <= 4; i++) {
+                ASSERT_TRUE(source.beginTransaction());
+                ASSERT_TRUE(source.write("INSERT INTO things VALUES (" + SQ(i) + ");"));
+                ASSERT_TRUE(source.prepare());
+                ASSERT_EQUAL(source.commit(), SQLITE_OK);
+            }
+            uint64_t incrementCommit = 0;
+            ASSERT_TRUE(source.createIncrementalBackup(incrementFile, snapshotCommit, 0, incrementCommit));
+            ASSERT_EQUAL(incrementCommit, 5);
+            ASSERT_TRUE(destination.applyIncrementalBackup(incrementFile));
+            ASSERT_EQUAL(destination.getCommitCount(), 5);
+            ASSERT_EQUAL(destination.getCommittedHash(), source.getCommittedHash());
+            ASSERT_EQUAL(destination.read("SELECT COUNT(*) FROM things;"), "4");
+        }
+        for (const string& file : {sourceFile, destinationFile, snapshotFile, incrementFile}) {
+            SFileDelete(file);
+        }
+    }
+
+    void testChangesets() {
+        const string sourceFile = "/tmp/sqliteChangesetSource.db";
+        const string destinationFile = "/tmp/sqliteChangesetDestination.db";
+        for (const string& file : {sourceFile, destinationFile}) {
+            SFileDelete(file);
+            SFileDelete(file + "-wal");
+            SFileDelete(file + "-shm");
+            SFileSave(file, "");
+        }
+        {
+            SQLite source(sourceFile, 1000000, false, 5000, -1, -1);
+            SQLite destination(destinationFile, 1000000, false, 5000, -1, -1);
+            source.setChangesets(true);
+            // Commits `query` on the source, and returns what was journaled for it.
+            auto commit = [&](const string& query) -> string {
+                if (!source.beginTransaction() || !source.write(query) || !source.prepare()) {
+                    source.rollback();
+                    return "";
+                }
+                const string journaled = source.getUncommittedQuery();
+                return source.commit() == SQLITE_OK ? journaled : "";
+            };
+
+            // Schema changes and tables without primary keys are journaled as queries. Everything else is journaled
+            // as the rows it changed, including the results of functions a peer running the query again wouldn't
+            // reproduce.
+            ASSERT_FALSE(SStartsWith(commit("CREATE TABLE things (id INTEGER PRIMARY KEY, value);"), "CHANGESET "));
+            ASSERT_FALSE(SStartsWith(commit("CREATE TABLE loose (value);"), "CHANGESET "));
+            ASSERT_TRUE(SStartsWith(commit("INSERT INTO things VALUES (1, RANDOM()), (2, RANDOM());"), "CHANGESET "));
+            ASSERT_TRUE(SStartsWith(commit("UPDATE things SET value = RANDOM() WHERE id = 2;"), "CHANGESET "));
+            ASSERT_FALSE(SStartsWith(commit("INSERT INTO loose VALUES (1);"), "CHANGESET "));
+            ASSERT_EQUAL(source.getCommitCount(), 5);
+
+            // Applying the journal elsewhere reproduces the same rows and hashes.
+            SQResult commits;
+            ASSERT_TRUE(source.getCommits(1, source.getCommitCount(), commits));
+            for (auto& row : commits.rows) {
+                ASSERT_TRUE(destination.beginTransaction());
+                ASSERT_TRUE(destination.writeUnmodified(row[1]));
+                ASSERT_TRUE(destination.prepare());
+                ASSERT_EQUAL(destination.getUncommittedHash(), row[0]);
+                ASSERT_EQUAL(destination.commit(), SQLITE_OK);
+            }
+            const string query = "SELECT group_concat(id || ':' || value) FROM things;";
+            ASSERT_EQUAL(destination.read(query), source.read(query));
+            ASSERT_EQUAL(destination.read("SELECT COUNT(*) FROM loose;"), "1");
+
+            // A changeset that doesn't match the rows it expects to find fails to apply.
+            ASSERT_TRUE(destination.beginTransaction());
+            ASSERT_FALSE(destination.writeUnmodified(commits[2][1]));
+            destination.rollback();
+        }
+        for (const string& file : {sourceFile, destinationFile}) {
+            SFileDelete(file);
+        }
+    }
+
+    // Gets a node of `tree` in a transaction of its own on `db`, as a peek would.
+    static bool getMerkleNode(SQLite& db, SQLiteMerkleTree& tree, int level, uint64_t index,
+                              SQLiteMerkleTree::Node& node) {
+        if (!db.beginTransaction()) {
+            return false;
+        }
+        const bool success = tree.getNode(db, level, index, node);
+        db.rollback();
+        return success;
+    }
+
+    void testMerkleTree() {
+        const vector<string> files = {"/tmp/sqliteMerkleTree1.db", "/tmp/sqliteMerkleTree2.db"};
+        for (const string& file : files) {
+            SFileDelete(file);
+            SFileDelete(file + "-wal");
+            SFileDelete(file + "-shm");
+            SFileSave(file, "");
+        }
+        {
+            // Two copies of the same table, spread over several leaves.
+            list<SQLite> dbs;
+            list<SQLiteMerkleTree> trees;
+            for (const string& file : files) {
+                dbs.emplace_back(file, 1000000, false, 5000, -1, -1);
+                trees.emplace_back("things");
+                SQLite& db = dbs.back();
+                ASSERT_TRUE(db.beginTransaction());
+                ASSERT_TRUE(db.write("CREATE TABLE things (id INTEGER PRIMARY KEY, value TEXT);"));
+                ASSERT_TRUE(db.write("WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 5000) "
+                                     "INSERT INTO things SELECT i, 'value ' || i FROM n;"));
+                ASSERT_TRUE(db.prepare());
+                ASSERT_EQUAL(db.commit(), SQLITE_OK);
+            }
+            SQLite& db1 = dbs.front();
+            SQLite& db2 = dbs.back();
+            SQLiteMerkleTree& tree1 = trees.front();
+            SQLiteMerkleTree& tree2 = trees.back();
+
+            SQLiteMerkleTree::Node root1, root2;
+            ASSERT_TRUE(getMerkleNode(db1, tree1, -1, 0, root1));
+            ASSERT_TRUE(getMerkleNode(db2, tree2, -1, 0, root2));
+            ASSERT_EQUAL(root1.commitCount, 1);
+            ASSERT_EQUAL(root1.height, 1);
+            ASSERT_EQUAL(root1.children.size(), 5);
+            ASSERT_FALSE(root1.hash.empty());
+            ASSERT_EQUAL(root1.hash, root2.hash);
+
+            // Change one row on the second copy, and tell its tree, as its commit listener would.
+            ASSERT_TRUE(db2.beginTransaction());
+            ASSERT_TRUE(db2.write("UPDATE things SET value = 'changed' WHERE id = 3000;"));
+            ASSERT_TRUE(db2.prepare());
+            ASSERT_EQUAL(db2.commit(), SQLITE_OK);
+            const set<int64_t> rowIDs = {3000};
+            tree2.invalidate(&rowIDs, db2.getCommitCount());
+
+            // Descending through the children that differ finds the leaf with that row in it.
+            ASSERT_TRUE(getMerkleNode(db2, tree2, -1, 0, root2));
+            ASSERT_EQUAL(root2.commitCount, 2);
+            ASSERT_NOT_EQUAL(root1.hash, root2.hash);
+            list<uint64_t> different;
+            for (const auto& child : root1.children) {
+                if (root2.children[child.first] != child.second) {
+                    different.push_back(child.first);
+                }
+            }
+            ASSERT_EQUAL(different.size(), 1);
+            SQLiteMerkleTree::Node leaf1, leaf2;
+            ASSERT_TRUE(getMerkleNode(db1, tree1, 0, different.front(), leaf1));
+            ASSERT_TRUE(getMerkleNode(db2, tree2, 0, different.front(), leaf2));
+            ASSERT_NOT_EQUAL(leaf1.hash, leaf2.hash);
+            const pair<int64_t, int64_t> range = SQLiteMerkleTree::getRange(0, different.front());
+            ASSERT_LESS_THAN_EQUAL(range.first, 3000);
+            ASSERT_GREATER_THAN_EQUAL(range.second, 3000);
+
+            // Making the same change on the first copy makes them match again, and deleting a whole leaf's rows
+            // removes it from the tree.
+            for (auto copy : {make_pair(&db1, &tree1), make_pair(&db2, &tree2)}) {
+                ASSERT_TRUE(copy.first->beginTransaction());
+                ASSERT_TRUE(copy.first->write("UPDATE things SET value = 'changed' WHERE id = 3000;"));
+                ASSERT_TRUE(copy.first->write("DELETE FROM things WHERE id < 1024;"));
+                ASSERT_TRUE(copy.first->prepare());
+                ASSERT_EQUAL(copy.first->commit(), SQLITE_OK);
+                set<int64_t> changed = {3000};
+                for (int64_t id = 1; id < 1024; id++) {
+                    changed.insert(id);
+                }
+                copy.second->invalidate(&changed, copy.first->getCommitCount());
+            }
+            ASSERT_TRUE(getMerkleNode(db1, tree1, -1, 0, root1));
+            ASSERT_TRUE(getMerkleNode(db2, tree2, -1, 0, root2));
+            ASSERT_EQUAL(root1.children.size(), 4);
+            ASSERT_NOT_EQUAL(root1.commitCount, root2.commitCount);
+            ASSERT_EQUAL(root1.hash, root2.hash);
+
+            // Without the rows that changed, the whole table is hashed again.
+            ASSERT_TRUE(db1.beginTransaction());
+            ASSERT_TRUE(db1.write("DELETE FROM things;"));
+            ASSERT_TRUE(db1.prepare());
+            ASSERT_EQUAL(db1.commit(), SQLITE_OK);
+            tree1.invalidate(nullptr, db1.getCommitCount());
+            ASSERT_TRUE(getMerkleNode(db1, tree1, -1, 0, root1));
+            ASSERT_EQUAL(root1.height, -1);
+            ASSERT_TRUE(root1.hash.empty());
+        }
+        for (const string& file : files) {
+            SFileDelete(file);
+        }
+    }
+
+    void testGroupCommit() {
+        const string file = "/tmp/sqliteGroupCommit.db";
+        SFileDelete(file);
+        SFileDelete(file + "-wal");
+        SFileDelete(file + "-shm");
+        SFileSave(file, "");
+        {
+            SQLite setup(file, 1000000, false, 5000, -1, 1, "FULL");
+            ASSERT_TRUE(setup.beginTransaction());
+            ASSERT_TRUE(setup.write("CREATE TABLE things (id INTEGER PRIMARY KEY);"));
+            ASSERT_TRUE(setup.prepare());
+            ASSERT_EQUAL(setup.commit(), SQLITE_OK);
+
+            // Two handles committing at the same time share syncs, and all of their commits make it in.
+            list<thread> threads;
+            for (int journal = 0; journal < 2; journal++) {
+                threads.emplace_back([&, journal]() {
+                    SQLite db(file, 1000000, false, 5000, journal, 1, "FULL");
+                    db.enableGroupCommit(1000);
+                    for (int i = 0; i < 10; i++) {
+                        ASSERT_TRUE(db.beginTransaction());
+                        ASSERT_TRUE(db.write("INSERT INTO things VALUES (" + SQ(journal * 100 + i) + ");"));
+                        ASSERT_TRUE(db.prepare());
+                        ASSERT_EQUAL(db.commit(), SQLITE_OK);
+                    }
+                });
+            }
+            for (auto& t : threads) {
+                t.join();
+            }
+            ASSERT_EQUAL(setup.getCommitCount(), 21);
+            ASSERT_EQUAL(setup.read("SELECT COUNT(*) FROM things;"), "20");
+        }
+        SFileDelete(file);
+    }
+
+    void testTypedResult() {
+        SQLite db(":memory:", 1000000, false, 5000, -1, -1);
+        ASSERT_TRUE(db.beginTransaction());
+        ASSERT_TRUE(db.write("CREATE TABLE typed (i INTEGER, r REAL, t TEXT, n TEXT);"));
+        ASSERT_TRUE(db.write("INSERT INTO typed VALUES (-12, 1.5, 'one', NULL), (3, 0.1, '', NULL);"));
+
+        // Every value comes back with its type, and as the same text an SQResult would have.
+        SQTypedResult typed;
+        SQResult text;
+        const string query = "SELECT i, r, t, n FROM typed ORDER BY i;";
+        ASSERT_TRUE(db.read(query, typed));
+        ASSERT_TRUE(db.read(query, text));
+        ASSERT_EQUAL(typed.size(), 2);
+        ASSERT_EQUAL(typed.columns(), 4);
+        ASSERT_EQUAL(typed.headers, text.headers);
+        for (size_t row = 0; row < typed.size(); row++) {
+            for (size_t column = 0; column < typed.columns(); column++) {
+                ASSERT_EQUAL(typed.getString(row, column), text[row][column]);
+            }
+        }
+        ASSERT_EQUAL(typed.type(0, 0), SQLITE_INTEGER);
+        ASSERT_EQUAL(typed.getInt64(0, 0), -12);
+        ASSERT_EQUAL(typed.type(0, 1), SQLITE_FLOAT);
+        ASSERT_EQUAL(typed.getDouble(0, 1), 1.5);
+        ASSERT_EQUAL(string(typed.data(0, 2), typed.bytes(0, 2)), "one");
+        ASSERT_TRUE(typed.isNull(1, 3));
+
+        // No rows means no columns.
+        ASSERT_TRUE(db.read("SELECT i FROM typed WHERE i > 100;", typed));
+        ASSERT_TRUE(typed.empty());
+        ASSERT_EQUAL(typed.columns(), 0);
+        db.rollback();
+    }
+
+    void testWhitelist() {
+        SQLite db(":memory:", 1000000, false, 5000, -1, -1);
+        ASSERT_TRUE(db.beginTransaction());
+        ASSERT_TRUE(db.write("CREATE TABLE things (id INTEGER PRIMARY KEY, name TEXT, secret TEXT);"));
+        ASSERT_TRUE(db.write("INSERT INTO things VALUES (1, 'one', 'hidden');"));
+        ASSERT_TRUE(db.prepare());
+        ASSERT_EQUAL(db.commit(), SQLITE_OK);
+
+        // Read once before there's a whitelist, so the statement is cached without one.
+        SQResult result;
+        ASSERT_TRUE(db.read("SELECT name, secret FROM things WHERE id = ?;", {"1"}, result));
+        ASSERT_EQUAL(result[0][1], "hidden");
+
+        // Columns that aren't whitelisted read as NULL, and writes are denied.
+        SQLite::Whitelist whitelist;
+        whitelist["things"].insert("name");
+        ASSERT_TRUE(db.beginTransaction());
+        db.setWhitelist(&whitelist);
+        ASSERT_TRUE(db.read("SELECT name, secret FROM things WHERE id = ?;", {"1"}, result));
+        ASSERT_EQUAL(result[0][0], "one");
+        ASSERT_EQUAL(result[0][1], "");
+        ASSERT_FALSE(db.write("UPDATE things SET name = 'two';"));
+
+        // And everything can be read again once it's removed.
+        db.setWhitelist(nullptr);
+        db.rollback();
+        ASSERT_TRUE(db.read("SELECT name, secret FROM things WHERE id = ?;", {"1"}, result));
+        ASSERT_EQUAL(result[0][1], "hidden");
+    }
+} __SQLiteTest;
@@ -0,0 +1,46 @@
+#include <test/lib/BedrockTester.h>
+
+struct SlowQueryTest : tpunit::TestFixture {
+    SlowQueryTest()
+        : tpunit::TestFixture("SlowQuery",
+                              BEFORE_CLASS(SlowQueryTest::setup),
+                              TEST(SlowQueryTest::capture),
+                              AFTER_CLASS(SlowQueryTest::tearDown)) { }
+
+    BedrockTester* tester;
+
+    // Every query counts as slow, so we don't have to wait for one.
+    void setup() {
+        tester = new BedrockTester(_threadID, {{"-plugins", "DB"}, {"-slowQueryThreshold", "0"},
+                                               {"-slowQueryLogSize", "1000"}}, {});
+    }
+
+    void tearDown() { delete tester; }
+
+    // A query is kept normalized, with its plan, what it cost, and the command it ran for
+    void capture() {
+        SData query("Query");
+        query["query"] = "SELECT COUNT(*) FROM (WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n "
+                         "WHERE i < 1000) SELECT i FROM n WHERE i % 7 = 3);";
+        query["requestID"] = "slowQueryTest";
+        tester->executeWaitVerifyContent(query);
+
+        SData getSlowQueries("GetSlowQueries");
+        STable content = SParseJSONObject(tester->executeWaitVerifyContent(getSlowQueries));
+        STable found;
+        for (const string& slowQuery : SParseJSONArray(content["queries"])) {
+            STable fields = SParseJSONObject(slowQuery);
+            if (SContains(fields["query"], "WITH RECURSIVE n(i)")) {
+                found = fields;
+            }
+        }
+        ASSERT_FALSE(found.empty());
+        ASSERT_TRUE(SContains(found["query"], "WHERE i < ?"));
+        ASSERT_TRUE(SContains(found["plan"], "SCAN"));
+        ASSERT_EQUAL(found["command"], "Query");
+        ASSERT_EQUAL(found["requestID"], "slowQueryTest");
+        ASSERT_EQUAL(SToUInt64(found["rows"]), 1);
+        ASSERT_TRUE(SToUInt64(found["vmSteps"]) > 0);
+    }
+
+} __SlowQueryTest;
@@ -5,6 +5,8 @@ struct StatusTest : tpunit::TestFixture {
         : tpunit::TestFixture("Status",
                               BEFORE_CLASS(StatusTest::setup),
                               TEST(StatusTest::test),
+                              TEST(StatusTest::metrics),
+                              TEST(StatusTest::resourceUsage),
                               AFTER_CLASS(StatusTest::tearDown)) { }
 
     BedrockTester* tester;
@@ -18,6 +20,40 @@ struct StatusTest : tpunit::TestFixture {
         string response = tester->executeWaitMultipleData({status})[0].content;
         ASSERT_TRUE(SContains(response, "plugins"));
         ASSERT_TRUE(SContains(response, "multiWriteManualBlacklist"));
+
+        // The Status command we just ran shows up in the timing stats.
+        SData timing("TimingStats");
+        STable stats = SParseJSONObject(tester->executeWaitMultipleData({timing})[0].content);
+        ASSERT_TRUE(SContains(stats, "Status"));
+        STable statusStats = SParseJSONObject(stats["Status"]);
+        ASSERT_TRUE(SToInt(statusStats["count"]) >= 1);
+        ASSERT_TRUE(SContains(SParseJSONObject(statusStats["total"]), "p99"));
+    }
+
+    void metrics() {
+        SData metrics("GET /metrics HTTP/1.1");
+        SData response = tester->executeWaitMultipleData({metrics})[0];
+        ASSERT_TRUE(SStartsWith(response.methodLine, "HTTP/1.1 200"));
+        ASSERT_TRUE(SContains(response.content, "# TYPE bedrock_commit_lock_wait_seconds_total counter\n"));
+        ASSERT_TRUE(SContains(response.content, "\nbedrock_command_queue_depth "));
+        ASSERT_TRUE(SContains(response.content, "\nbedrock_held_commands{area=\"futureCommit\"} 0\n"));
+    }
+
+    void resourceUsage() {
+        // A query is charged to the DB plugin, under its verb.
+        SData query("Query");
+        query["query"] = "SELECT 1;";
+        tester->executeWaitVerifyContent(query);
+
+        SData status("Status");
+        STable content = SParseJSONObject(tester->executeWaitVerifyContent(status));
+        STable usage = SParseJSONObject(content["resourceUsage"]);
+        ASSERT_TRUE(SContains(usage, "DB"));
+        STable verbs = SParseJSONObject(SParseJSONObject(usage["DB"])["verbs"]);
+        ASSERT_TRUE(SContains(verbs, "Query"));
+        STable queryUsage = SParseJSONObject(verbs["Query"]);
+        ASSERT_TRUE(SToUInt64(queryUsage["calls"]) >= 1);
+        ASSERT_TRUE(SToUInt64(queryUsage["vmSteps"]) > 0);
     }
 
 } __StatusTest;
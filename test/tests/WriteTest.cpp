@@ -16,14 +16,20 @@ struct WriteTest : tpunit::TestFixture {
                               TEST(WriteTest::failedUpdateNoWhereTrue),
                               TEST(WriteTest::failedUpdateNoWhereFalse),
                               TEST(WriteTest::updateAndInsertWithHttp),
+                              TEST(WriteTest::cachedReadSeesWrites),
+                              TEST(WriteTest::cachedReadSeesUnhookedWrites),
                               AFTER_CLASS(WriteTest::tearDown)) { }
 
     BedrockTester* tester;
 
     void setup() {
-        tester = new BedrockTester(_threadID, {}, {
+        tester = new BedrockTester(_threadID, {{"-peekCacheSize", "100"}}, {
             "CREATE TABLE foo (bar INTEGER);",
             "CREATE TABLE stuff (id INTEGER PRIMARY KEY, value INTEGER);",
+            "CREATE TABLE cached (id INTEGER PRIMARY KEY, value INTEGER);",
+            "CREATE TABLE truncated (id INTEGER PRIMARY KEY, value INTEGER);",
+            "CREATE TABLE norowid (id INTEGER PRIMARY KEY, value INTEGER) WITHOUT ROWID;",
+            "CREATE TABLE altered (id INTEGER PRIMARY KEY);",
         });
     }
 
@@ -134,6 +140,65 @@ struct WriteTest : tpunit::TestFixture {
         tester->executeWaitVerifyContent(status);
     }
 
+    void cachedReadSeesWrites() {
+        SData write("Query");
+        write["writeConsistency"] = "ASYNC";
+        write["query"] = "INSERT INTO cached VALUES (1, 111);";
+        tester->executeWaitVerifyContent(write);
+
+        // Asking for the same thing twice gets the same answer, the second time from the peek cache.
+        SData read("Query");
+        read["query"] = "SELECT value FROM cached WHERE id = 1;";
+        read["cacheable"] = "true";
+        ASSERT_TRUE(SContains(tester->executeWaitVerifyContent(read), "111"));
+        ASSERT_TRUE(SContains(tester->executeWaitVerifyContent(read), "111"));
+
+        // Writing to another table doesn't change it, but writing to the one it read does.
+        write["query"] = "INSERT INTO foo VALUES (222);";
+        tester->executeWaitVerifyContent(write);
+        ASSERT_TRUE(SContains(tester->executeWaitVerifyContent(read), "111"));
+        write["query"] = "UPDATE cached SET value = 333 WHERE id = 1;";
+        tester->executeWaitVerifyContent(write);
+        ASSERT_TRUE(SContains(tester->executeWaitVerifyContent(read), "333"));
+    }
+
+    void cachedReadSeesUnhookedWrites() {
+        // sqlite's update hook isn't called for any of these writes, so they're only seen by the authorizer.
+        SData write("Query");
+        write["writeConsistency"] = "ASYNC";
+        SData read("Query");
+        read["cacheable"] = "true";
+
+        // A DELETE with no WHERE clause is done with the truncate optimization.
+        write["query"] = "INSERT INTO truncated VALUES (1, 111);";
+        tester->executeWaitVerifyContent(write);
+        read["query"] = "SELECT 'rows:' || COUNT(*) FROM truncated;";
+        ASSERT_TRUE(SContains(tester->executeWaitVerifyContent(read), "rows:1"));
+        write["query"] = "DELETE FROM truncated;";
+        write["nowhere"] = "true";
+        tester->executeWaitVerifyContent(write);
+        write.erase("nowhere");
+        ASSERT_TRUE(SContains(tester->executeWaitVerifyContent(read), "rows:0"));
+
+        // Tables without rowids.
+        write["query"] = "INSERT INTO norowid VALUES (1, 111);";
+        tester->executeWaitVerifyContent(write);
+        read["query"] = "SELECT value FROM norowid WHERE id = 1;";
+        ASSERT_TRUE(SContains(tester->executeWaitVerifyContent(read), "111"));
+        write["query"] = "UPDATE norowid SET value = 333 WHERE id = 1;";
+        tester->executeWaitVerifyContent(write);
+        ASSERT_TRUE(SContains(tester->executeWaitVerifyContent(read), "333"));
+
+        // Schema changes.
+        write["query"] = "INSERT INTO altered VALUES (1);";
+        tester->executeWaitVerifyContent(write);
+        read["query"] = "SELECT * FROM altered;";
+        ASSERT_FALSE(SContains(tester->executeWaitVerifyContent(read), "added"));
+        write["query"] = "ALTER TABLE altered ADD COLUMN extra TEXT DEFAULT 'added';";
+        tester->executeWaitVerifyContent(write);
+        ASSERT_TRUE(SContains(tester->executeWaitVerifyContent(read), "added"));
+    }
+
     void failedUpdateNoWhere() {
         SData status("Query");
         status["writeConsistency"] = "ASYNC";
@@ -0,0 +1,127 @@
+#include <test/lib/BedrockTester.h>
+
+struct BulkJobsTest : tpunit::TestFixture {
+    BulkJobsTest()
+        : tpunit::TestFixture("BulkJobs",
+                              BEFORE_CLASS(BulkJobsTest::setupClass),
+                              TEST(BulkJobsTest::finishJobs),
+                              TEST(BulkJobsTest::retryJobs),
+                              TEST(BulkJobsTest::deleteJobs),
+                              TEST(BulkJobsTest::invalidJson),
+                              AFTER(BulkJobsTest::tearDown),
+                              AFTER_CLASS(BulkJobsTest::tearDownClass)) { }
+
+    BedrockTester* tester;
+
+    void setupClass() { tester = new BedrockTester(_threadID, {{"-plugins", "Jobs,DB"}}, {});}
+
+    // Reset the jobs table
+    void tearDown() {
+        SData command("Query");
+        command["query"] = "DELETE FROM jobs WHERE jobID > 0;";
+        tester->executeWaitVerifyContent(command);
+    }
+
+    void tearDownClass() { delete tester; }
+
+    // Creates a job called `name`, and if `run`, gets it so it's RUNNING. Returns its jobID.
+    string _createJob(const string& name, bool run) {
+        SData command("CreateJob");
+        command["name"] = name;
+        string jobID = tester->executeWaitVerifyContentTable(command)["jobID"];
+        if (run) {
+            command.clear();
+            command.methodLine = "GetJob";
+            command["name"] = name;
+            tester->executeWaitVerifyContent(command);
+        }
+        return jobID;
+    }
+
+    // Returns the JSON for one job in a bulk command, with its `jobID` and optionally one other parameter.
+    string _jobJSON(const string& jobID, const string& name = "", const string& value = "") {
+        STable job;
+        job["jobID"] = jobID;
+        if (!name.empty()) {
+            job[name] = value;
+        }
+        return SComposeJSONObject(job);
+    }
+
+    // Returns the `result` for each job in a bulk command's response.
+    list<string> _getResults(const STable& response) {
+        list<string> results;
+        for (auto& result : SParseJSONArray(response.at("results"))) {
+            results.push_back(SParseJSONObject(result)["result"]);
+        }
+        return results;
+    }
+
+    // Jobs that can be finished are, and those that can't get their own error
+    void finishJobs() {
+        string running1 = _createJob("bulk1", true);
+        string running2 = _createJob("bulk2", true);
+        string queued = _createJob("bulk3", false);
+
+        SData command("FinishJobs");
+        command["jobs"] = SComposeJSONArray(vector<string>{
+            _jobJSON(running1),
+            _jobJSON(queued),
+            _jobJSON(running2),
+            _jobJSON("1"),
+        });
+        list<string> results = _getResults(tester->executeWaitVerifyContentTable(command));
+        ASSERT_EQUAL(results, list<string>({"200 OK", "405 Can only retry/finish RUNNING and RUNQUEUED jobs", "200 OK",
+                                            "404 No job with this jobID"}));
+
+        // The finished jobs are gone, and the queued one is left alone.
+        SQResult result;
+        tester->readDB("SELECT jobID, state FROM jobs;", result);
+        ASSERT_EQUAL(result.size(), 1);
+        ASSERT_EQUAL(result[0][0], queued);
+        ASSERT_EQUAL(result[0][1], "QUEUED");
+    }
+
+    // Each job can be retried with its own parameters
+    void retryJobs() {
+        string jobID1 = _createJob("bulk1", true);
+        string jobID2 = _createJob("bulk2", true);
+
+        SData command("RetryJobs");
+        command["jobs"] = SComposeJSONArray(vector<string>{
+            _jobJSON(jobID1, "nextRun", "2030-01-01 00:00:00"),
+            _jobJSON(jobID2, "delay", "-1"),
+        });
+        list<string> results = _getResults(tester->executeWaitVerifyContentTable(command));
+        ASSERT_EQUAL(results, list<string>({"200 OK", "402 Must specify a non-negative delay when retrying"}));
+
+        ASSERT_EQUAL(tester->readDB("SELECT state || ' ' || nextRun FROM jobs WHERE jobID=" + jobID1 + ";"),
+                     "QUEUED 2030-01-01 00:00:00");
+        ASSERT_EQUAL(tester->readDB("SELECT state FROM jobs WHERE jobID=" + jobID2 + ";"), "RUNNING");
+    }
+
+    // Jobs that can be deleted are, and running ones are left alone
+    void deleteJobs() {
+        string queued = _createJob("bulk1", false);
+        string running = _createJob("bulk2", true);
+
+        SData command("DeleteJobs");
+        command["jobs"] = SComposeJSONArray(vector<string>{
+            _jobJSON(queued),
+            _jobJSON(running),
+            _jobJSON("abc"),
+        });
+        list<string> results = _getResults(tester->executeWaitVerifyContentTable(command));
+        ASSERT_EQUAL(results, list<string>({"200 OK", "405 Can't delete a RUNNING job", "402 Malformed jobID"}));
+        ASSERT_EQUAL(tester->readDB("SELECT group_concat(jobID) FROM jobs;"), running);
+    }
+
+    // A malformed list fails the whole command before any job is touched
+    void invalidJson() {
+        string jobID = _createJob("bulk1", true);
+        SData command("FinishJobs");
+        command["jobs"] = SComposeJSONArray(vector<string>{_jobJSON(jobID), "nope"});
+        tester->executeWaitVerifyContent(command, "401 Invalid JSON");
+        ASSERT_EQUAL(tester->readDB("SELECT state FROM jobs WHERE jobID=" + jobID + ";"), "RUNNING");
+    }
+} __BulkJobsTest;
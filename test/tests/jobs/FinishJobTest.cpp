@@ -19,6 +19,7 @@ struct FinishJobTest : tpunit::TestFixture {
                               TEST(FinishJobTest::hasRepeatWithNextRun),
                               TEST(FinishJobTest::hasNextRun),
                               TEST(FinishJobTest::simpleFinishJobWithHttp),
+                              TEST(FinishJobTest::childCountsFollowWrites),
                               AFTER(FinishJobTest::tearDown),
                               AFTER_CLASS(FinishJobTest::tearDownClass)) { }
 
@@ -546,4 +547,54 @@ struct FinishJobTest : tpunit::TestFixture {
         tester->readDB("SELECT * FROM jobs WHERE jobID = " + jobID + ";", result);
         ASSERT_TRUE(result.empty());
     }
+
+    // The counts of each parent's children stay right however the children are changed
+    void childCountsFollowWrites() {
+        // Create the parent
+        SData command("CreateJob");
+        command["name"] = "parent";
+        STable response = tester->executeWaitVerifyContentTable(command);
+        string parentID = response["jobID"];
+
+        // Get the parent
+        command.clear();
+        command.methodLine = "GetJob";
+        command["name"] = "parent";
+        tester->executeWaitVerifyContent(command);
+
+        // Create two children, and finish the parent so they're QUEUED
+        list<string> childIDs;
+        for (int i = 0; i < 2; i++) {
+            command.clear();
+            command.methodLine = "CreateJob";
+            command["name"] = "child";
+            command["parentJobID"] = parentID;
+            childIDs.push_back(tester->executeWaitVerifyContentTable(command)["jobID"]);
+        }
+        command.clear();
+        command.methodLine = "Query";
+        command["Query"] = "DELETE FROM jobs WHERE parentJobID = " + parentID + " AND JSON_EXTRACT(data, '$.mockRequest') IS NOT NULL;";
+        tester->executeWaitVerifyContent(command);
+        command.clear();
+        command.methodLine = "FinishJob";
+        command["jobID"] = parentID;
+        tester->executeWaitVerifyContent(command);
+        const string countsQuery = "SELECT pending || ',' || paused || ',' || finished || ',' || cancelled "
+                                   "FROM jobChildCounts WHERE parentJobID = " + parentID + ";";
+        ASSERT_EQUAL(tester->readDB(countsQuery), "2,0,0,0");
+
+        // Cancel one directly, and the counts follow
+        command.clear();
+        command.methodLine = "Query";
+        command["Query"] = "UPDATE jobs SET state = 'CANCELLED' WHERE jobID = " + childIDs.front() + ";";
+        tester->executeWaitVerifyContent(command);
+        ASSERT_EQUAL(tester->readDB(countsQuery), "1,0,0,1");
+
+        // Once there are no children left, the parent has no counts at all
+        command.clear();
+        command.methodLine = "Query";
+        command["Query"] = "DELETE FROM jobs WHERE parentJobID = " + parentID + ";";
+        tester->executeWaitVerifyContent(command);
+        ASSERT_EQUAL(tester->readDB(countsQuery), "");
+    }
 } __FinishJobTest;
@@ -13,6 +13,9 @@ struct GetJobTest : tpunit::TestFixture {
                               TEST(GetJobTest::testWithFinishedAndCancelledChildren),
                               TEST(GetJobTest::testPrioritiesWithRunQueued),
                               TEST(GetJobTest::testMultipleNames),
+                              TEST(GetJobTest::testNamePatternAndDirectUpdates),
+                              TEST(GetJobTest::testWait),
+                              TEST(GetJobTest::testGetJobsWithRetryAfter),
                               AFTER(GetJobTest::tearDown),
                               AFTER_CLASS(GetJobTest::tearDownClass)) { }
 
@@ -543,5 +546,102 @@ struct GetJobTest : tpunit::TestFixture {
         list<string> jobList = SParseJSONArray(response["jobs"]);
         ASSERT_EQUAL(jobList.size(), 2);
     }
-} __GetJobTest;
 
+    void testNamePatternAndDirectUpdates() {
+        for (const char* name : {"sync.a", "sync.b", "other"}) {
+            SData command("CreateJob");
+            command["name"] = name;
+            tester->executeWaitVerifyContent(command);
+        }
+
+        // A job pushed into the future behind our back, with a direct query, can't be returned.
+        SData command("Query");
+        command["query"] = "UPDATE jobs SET nextRun = DATETIME('now', '+1 HOUR') WHERE name = 'sync.b';";
+        tester->executeWaitVerifyContent(command);
+
+        // Only the matching, runnable job comes back.
+        command.clear();
+        command.methodLine = "GetJobs";
+        command["name"] = "sync.*";
+        command["numResults"] = "10";
+        STable response = tester->executeWaitVerifyContentTable(command);
+        list<string> jobList = SParseJSONArray(response["jobs"]);
+        ASSERT_EQUAL(jobList.size(), 1);
+        ASSERT_EQUAL(SParseJSONObject(jobList.front())["name"], "sync.a");
+
+        // And once it's runnable again, it comes back too.
+        command.clear();
+        command.methodLine = "Query";
+        command["query"] = "UPDATE jobs SET nextRun = DATETIME('now', '-1 HOUR') WHERE name = 'sync.b';";
+        tester->executeWaitVerifyContent(command);
+        command.clear();
+        command.methodLine = "GetJob";
+        command["name"] = "sync.*";
+        response = tester->executeWaitVerifyContentTable(command);
+        ASSERT_EQUAL(response["name"], "sync.b");
+    }
+
+    void testWait() {
+        // With nothing to get, a waiting GetJob times out.
+        SData command("GetJob");
+        command["name"] = "waitedFor";
+        command["Connection"] = "wait";
+        command["timeout"] = "500";
+        uint64_t start = STimeNow();
+        tester->executeWaitVerifyContent(command, "303");
+        ASSERT_GREATER_THAN(STimeNow() - start, 500 * STIME_US_PER_MS);
+
+        // A job created while we're waiting gets handed to us, well before we'd time out.
+        thread creator([this]() {
+            usleep(500'000);
+            SData create("CreateJob");
+            create["name"] = "waitedFor";
+            tester->executeWaitVerifyContent(create);
+        });
+        command["timeout"] = "30000";
+        start = STimeNow();
+        STable response = tester->executeWaitVerifyContentTable(command);
+        creator.join();
+        ASSERT_EQUAL(response["name"], "waitedFor");
+        ASSERT_GREATER_THAN(10 * STIME_US_PER_S, STimeNow() - start);
+
+        // A job scheduled for the future is handed to a waiter once it comes due, and not before.
+        SData create("CreateJob");
+        create["name"] = "waitedFor";
+        create["firstRun"] = SComposeTime("%Y-%m-%d %H:%M:%S", STimeNow() + 2 * STIME_US_PER_S);
+        tester->executeWaitVerifyContent(create);
+        start = STimeNow();
+        response = tester->executeWaitVerifyContentTable(command);
+        ASSERT_EQUAL(response["name"], "waitedFor");
+        ASSERT_GREATER_THAN(STimeNow() - start, 500 * STIME_US_PER_MS);
+        ASSERT_GREATER_THAN(10 * STIME_US_PER_S, STimeNow() - start);
+    }
+
+    // GetJobs claims several jobs with different retryAfter values at once, and each gets its own nextRun
+    void testGetJobsWithRetryAfter() {
+        SData command("CreateJob");
+        command["name"] = "retry";
+        command["retryAfter"] = "+1 HOURS";
+        tester->executeWaitVerifyContent(command);
+        command["retryAfter"] = "+2 HOURS";
+        tester->executeWaitVerifyContent(command);
+        command.erase("retryAfter");
+        tester->executeWaitVerifyContent(command);
+
+        command.clear();
+        command.methodLine = "GetJobs";
+        command["name"] = "retry";
+        command["numResults"] = "3";
+        STable response = tester->executeWaitVerifyContentTable(command);
+        ASSERT_EQUAL(SParseJSONArray(response["jobs"]).size(), 3);
+
+        SQResult result;
+        tester->readDB("SELECT state, STRFTIME('%s', nextRun) - STRFTIME('%s', lastRun) FROM jobs WHERE name = 'retry' AND JSON_EXTRACT(data, '$.mockRequest') IS NULL ORDER BY retryAfter;", result);
+        ASSERT_EQUAL(result.size(), 3);
+        ASSERT_EQUAL(result[0][0], "RUNNING");
+        ASSERT_EQUAL(result[1][0], "RUNQUEUED");
+        ASSERT_EQUAL(result[1][1], "3600");
+        ASSERT_EQUAL(result[2][0], "RUNQUEUED");
+        ASSERT_EQUAL(result[2][1], "7200");
+    }
+} __GetJobTest;
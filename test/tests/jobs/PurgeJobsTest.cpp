@@ -0,0 +1,58 @@
+#include <test/lib/BedrockTester.h>
+
+struct PurgeJobsTest : tpunit::TestFixture {
+    PurgeJobsTest()
+        : tpunit::TestFixture("PurgeJobs",
+                              BEFORE_CLASS(PurgeJobsTest::setupClass),
+                              TEST(PurgeJobsTest::purgeOldJobs),
+                              AFTER(PurgeJobsTest::tearDown),
+                              AFTER_CLASS(PurgeJobsTest::tearDownClass)) { }
+
+    BedrockTester* tester;
+
+    void setupClass() {
+        tester = new BedrockTester(_threadID, {{"-plugins", "Jobs,DB"}, {"-jobs.retentionHours", "1"},
+                                               {"-jobs.archive", "true"}}, {});
+    }
+
+    // Reset the jobs table
+    void tearDown() {
+        SData command("Query");
+        command["query"] = "DELETE FROM jobs WHERE jobID > 0;";
+        tester->executeWaitVerifyContent(command);
+    }
+
+    void tearDownClass() { delete tester; }
+
+    // Creates and fails a job. Returns its jobID.
+    string _createFailedJob(const string& name) {
+        SData command("CreateJob");
+        command["name"] = name;
+        string jobID = tester->executeWaitVerifyContentTable(command)["jobID"];
+        command.clear();
+        command.methodLine = "GetJob";
+        command["name"] = name;
+        tester->executeWaitVerifyContent(command);
+        command.clear();
+        command.methodLine = "FailJob";
+        command["jobID"] = jobID;
+        tester->executeWaitVerifyContent(command);
+        return jobID;
+    }
+
+    // Only terminal jobs older than the retention period are purged, into the archive
+    void purgeOldJobs() {
+        string oldJobID = _createFailedJob("old");
+        string newJobID = _createFailedJob("new");
+        SData command("Query");
+        command["query"] = "UPDATE jobs SET lastRun = DATETIME('now', '-2 HOURS') WHERE jobID = " + oldJobID + ";";
+        tester->executeWaitVerifyContent(command);
+
+        command.clear();
+        command.methodLine = "PurgeJobs";
+        tester->executeWaitVerifyContent(command);
+
+        ASSERT_EQUAL(tester->readDB("SELECT group_concat(jobID) FROM jobs;"), newJobID);
+        ASSERT_EQUAL(tester->readDB("SELECT state FROM jobsArchive WHERE jobID = " + oldJobID + ";"), "FAILED");
+    }
+} __PurgeJobsTest;
@@ -0,0 +1,139 @@
+#include <test/lib/BedrockTester.h>
+
+struct ShardedJobsTest : tpunit::TestFixture {
+    ShardedJobsTest()
+        : tpunit::TestFixture("ShardedJobs",
+                              BEFORE_CLASS(ShardedJobsTest::setupClass),
+                              TEST(ShardedJobsTest::createGetFinish),
+                              TEST(ShardedJobsTest::childrenInOtherShards),
+                              TEST(ShardedJobsTest::retryWithNewName),
+                              AFTER(ShardedJobsTest::tearDown),
+                              AFTER_CLASS(ShardedJobsTest::tearDownClass)) { }
+
+    BedrockTester* tester;
+
+    void setupClass() {
+        tester = new BedrockTester(_threadID, {{"-plugins", "Jobs,DB"}, {"-jobs.shards", "3"},
+                                               {"-jobs.shardMap", "hot:2, warm:1, cold:0"}}, {});
+    }
+
+    // Reset the jobs tables
+    void tearDown() {
+        for (const char* table : {"jobs", "jobs_1", "jobs_2"}) {
+            SData command("Query");
+            command["query"] = "DELETE FROM " + string(table) + " WHERE jobID > 0;";
+            tester->executeWaitVerifyContent(command);
+        }
+    }
+
+    void tearDownClass() { delete tester; }
+
+    // Jobs go in the table for their name, and are found there by jobID
+    void createGetFinish() {
+        SData command("CreateJob");
+        command["name"] = "hot";
+        STable response = tester->executeWaitVerifyContentTable(command);
+        const string jobID = response["jobID"];
+        ASSERT_EQUAL(SToInt64(jobID) % 3, 2);
+        SQResult result;
+        tester->readDB("SELECT name FROM jobs_2 WHERE jobID = " + jobID + ";", result);
+        ASSERT_EQUAL(result.size(), 1);
+        tester->readDB("SELECT COUNT(*) FROM jobs;", result);
+        ASSERT_EQUAL(result[0][0], "0");
+
+        command.clear();
+        command.methodLine = "GetJob";
+        command["name"] = "hot";
+        response = tester->executeWaitVerifyContentTable(command);
+        ASSERT_EQUAL(response["jobID"], jobID);
+
+        command.clear();
+        command.methodLine = "FinishJob";
+        command["jobID"] = jobID;
+        tester->executeWaitVerifyContent(command);
+        tester->readDB("SELECT COUNT(*) FROM jobs_2;", result);
+        ASSERT_EQUAL(result[0][0], "0");
+    }
+
+    // A parent's children can be in other shards, and finishing them resumes it
+    void childrenInOtherShards() {
+        SData command("CreateJob");
+        command["name"] = "hot";
+        STable response = tester->executeWaitVerifyContentTable(command);
+        const string parentID = response["jobID"];
+        command.clear();
+        command.methodLine = "GetJob";
+        command["name"] = "hot";
+        tester->executeWaitVerifyContent(command);
+
+        command.clear();
+        command.methodLine = "CreateJob";
+        command["name"] = "cold";
+        command["parentJobID"] = parentID;
+        response = tester->executeWaitVerifyContentTable(command);
+        const string childID = response["jobID"];
+
+        // Finishing the parent pauses it and queues the child.
+        command.clear();
+        command.methodLine = "FinishJob";
+        command["jobID"] = parentID;
+        tester->executeWaitVerifyContent(command);
+        SQResult result;
+        tester->readDB("SELECT state FROM jobs_2 WHERE jobID = " + parentID + ";", result);
+        ASSERT_EQUAL(result[0][0], "PAUSED");
+        tester->readDB("SELECT state FROM jobs WHERE jobID = " + childID + ";", result);
+        ASSERT_EQUAL(result[0][0], "QUEUED");
+
+        // Finishing the child resumes the parent, which then sees the finished child.
+        command.clear();
+        command.methodLine = "GetJob";
+        command["name"] = "cold";
+        tester->executeWaitVerifyContent(command);
+        command.clear();
+        command.methodLine = "FinishJob";
+        command["jobID"] = childID;
+        tester->executeWaitVerifyContent(command);
+        command.clear();
+        command.methodLine = "GetJob";
+        command["name"] = "hot";
+        response = tester->executeWaitVerifyContentTable(command);
+        ASSERT_EQUAL(response["jobID"], parentID);
+        ASSERT_EQUAL(SParseJSONArray(response["finishedChildJobs"]).size(), 1);
+    }
+
+    // Renaming a job in RetryJob moves it to the new name's shard
+    void retryWithNewName() {
+        SData command("CreateJob");
+        command["name"] = "hot";
+        STable response = tester->executeWaitVerifyContentTable(command);
+        const string jobID = response["jobID"];
+        command.clear();
+        command.methodLine = "GetJob";
+        command["name"] = "hot";
+        tester->executeWaitVerifyContent(command);
+
+        command.clear();
+        command.methodLine = "RetryJob";
+        command["jobID"] = jobID;
+        command["name"] = "warm";
+        command["delay"] = "0";
+        tester->executeWaitVerifyContent(command);
+        SQResult result;
+        tester->readDB("SELECT name, state FROM jobs_1 WHERE jobID = " + jobID + ";", result);
+        ASSERT_EQUAL(result.size(), 1);
+        ASSERT_EQUAL(result[0][0], "warm");
+        ASSERT_EQUAL(result[0][1], "QUEUED");
+
+        // It can still be found by its old jobID, and by its new name.
+        command.clear();
+        command.methodLine = "QueryJob";
+        command["jobID"] = jobID;
+        response = tester->executeWaitVerifyContentTable(command);
+        ASSERT_EQUAL(response["name"], "warm");
+        command.clear();
+        command.methodLine = "GetJob";
+        command["name"] = "warm";
+        response = tester->executeWaitVerifyContentTable(command);
+        ASSERT_EQUAL(response["jobID"], jobID);
+    }
+} __ShardedJobsTest;